@@ -1,48 +1,49 @@
 ## Example of a python plugin for tcpflow.
 ## This sample contains three functions.
+##
+## Each function takes a list of (name, data) tuples, one for each
+## finished flow. data is a read-only memoryview of the flow; it is
+## released when the function returns, so copy it (bytes(data)) to keep it.
+## A function returns None, or a list with a string or None for each flow.
 
-## The first function takes a string and returns a sample message.
-## The input string contains the application data from tcpflow's buffer.
+## The first function returns a sample message for each flow.
 
-def sampleFunction(appData):
-    return "This message appears in the XML tag 'tcpflow:result' of report.xml (DFXML)."
+def sampleFunction(flows):
+    return ["This message appears in the XML tag 'tcpflow:result' of report.xml (DFXML)."
+            for name, data in flows]
 
-## The second function takes a string (application data)
-## and writes the application (HTTP) header data to the file
-## myOutput.txt located in the python director.
-## This function does not return and simply prints to stdout.
+## The second function writes the application (HTTP) header data of each
+## flow to the file myOutput.txt located in the python directory.
+## It returns None, so nothing is added to the report.
 
-def headerWriter(appData):
+def headerWriter(flows):
     fName = "myOutput.txt"
-    f = open("python/" + fName, 'a')
-    headerFinish = appData.find("\r\n\r\n") + 4
-    headerData = appData[:headerFinish+1]
-    f.write(headerData)
-    f.close()
-    print "Wrote data to " + fName
-
-## The third function takes a string (application data)
-## parses the HTTP message (without headers)
+    with open("python/" + fName, 'ab') as f:
+        for name, data in flows:
+            headerFinish = bytes(data[:65536]).find(b"\r\n\r\n")
+            if headerFinish >= 0:
+                f.write(data[:headerFinish + 4])
+    print("Wrote data to " + fName)
+
+## The third function takes the HTTP message of each flow (without headers),
 ## performs a bitwise xor operation with a key defined in the function
 ## and returns the text corresponding to this binary result.
 
-def xorOp(appData):
-    # Assume variable buffer includes message data.
-    dataStart = appData.find("\r\n\r\n") + 4
+def xorOp(flows):
+    return [xorOne(bytes(data)) for name, data in flows]
+
+def xorOne(appData):
+    dataStart = appData.find(b"\r\n\r\n") + 4
     httpData = appData[dataStart:]
-    binaryData = ''.join(format(ord(x), 'b') for x in httpData)
+    binaryData = ''.join(format(x, 'b') for x in httpData)
     if len(binaryData) < 1:
-        return 0
+        return None
 
     key = "01101011101"
     keyLen = len(key)
-    newKey = ""
-    while len(newKey) + keyLen <= len(binaryData):
-        newKey += key
+    newKey = key * (len(binaryData) // keyLen)
     i = 0
     while len(newKey) < len(binaryData):
-        if i == keyLen:
-            i = 0
         newKey += key[i]
         i += 1
     xorRes = int(binaryData,2) ^ int(newKey,2)
@@ -0,0 +1,210 @@
+/**
+ *
+ * alert_channel.cpp
+ * Batched tcp_alert_fd / http_alert_fd notifications. See alert_channel.h
+ *
+ * The ring is a bounded multi-producer queue: each slot has a sequence
+ * number that says whether it is free for the producer that claimed
+ * position pos (seq==pos) or holds an event for the writer (seq==pos+1).
+ *
+ * This source code is under the GNU Public License (GPL).  See
+ * LICENSE for details.
+ *
+ */
+
+#include "tcpflow.h"
+#include "tcpip.h"
+#include "alert_channel.h"
+
+#include <sstream>
+#include <chrono>
+
+/* static */ uint32_t    alert_channel::queue_size = 4096;
+/* static */ std::string alert_channel::format     = "text";
+
+enum { MAX_CHANNELS = 8 };              // distinct alert descriptors
+enum { BATCH_BYTES  = 64*1024 };        // written once this much is formatted, or the ring is empty
+
+static std::mutex                   channels_M; // for starting a channel
+static std::atomic<alert_channel *> channels[MAX_CHANNELS];
+
+static void move_event(alert_channel::event &to,alert_channel::event &from)
+{
+    to.what       = from.what;
+    to.kind       = from.kind;
+    to.path.swap(from.path);
+    to.has_flow   = from.has_flow;
+    to.addr       = from.addr;
+    to.session_id = from.session_id;
+    to.bytes      = from.bytes;
+    to.packets    = from.packets;
+}
+
+static size_t ring_size(uint32_t n)
+{
+    size_t s = 16;
+    while(s < n) s <<= 1;
+    return s;
+}
+
+alert_channel::alert_channel(int fd_):
+    fd(fd_),mask(ring_size(queue_size)-1),ring(new slot[mask+1]),head(0),tail(0),
+    dropped(0),reported(0),idle(false),stopping(false),M(),ready(),writer(),failed(false)
+{
+    for(size_t i=0;i<=mask;i++) ring[i].seq.store(i,std::memory_order_relaxed);
+    writer = std::thread(&alert_channel::run,this);
+}
+
+alert_channel::~alert_channel()
+{
+    stopping = true;
+    {
+        std::lock_guard<std::mutex> lock(M);
+        ready.notify_one();
+    }
+    writer.join();
+    if(dropped>0) DEBUG(1)("alert fd %d: %" PRIu64 " events dropped because the reader fell behind",fd,(uint64_t)dropped);
+}
+
+/* static */ alert_channel *alert_channel::channel_for(int fd_)
+{
+    for(int i=0;i<MAX_CHANNELS;i++){
+        alert_channel *c = channels[i].load(std::memory_order_acquire);
+        if(c==0) break;
+        if(c->fd==fd_) return c;
+    }
+    std::lock_guard<std::mutex> lock(channels_M);
+    for(int i=0;i<MAX_CHANNELS;i++){
+        alert_channel *c = channels[i].load(std::memory_order_acquire);
+        if(c && c->fd==fd_) return c;
+        if(c==0){
+            c = new alert_channel(fd_);
+            channels[i].store(c,std::memory_order_release);
+            return c;
+        }
+    }
+    return 0;                           // that many descriptors are not given alerts
+}
+
+/* static */ void alert_channel::post(int fd_,event &e)
+{
+    alert_channel *c = channel_for(fd_);
+    if(c==0) return;
+    if(!c->push(e)){
+        c->dropped.fetch_add(1,std::memory_order_relaxed);
+        return;
+    }
+    /* without M: a wakeup that comes between the writer's last look at the
+     * ring and its wait is missed, and the writer looks again after its timeout
+     */
+    if(c->idle.load(std::memory_order_acquire)) c->ready.notify_one();
+}
+
+/* static */ void alert_channel::stop_all()
+{
+    std::lock_guard<std::mutex> lock(channels_M);
+    for(int i=0;i<MAX_CHANNELS;i++){
+        delete channels[i].exchange(0);
+    }
+}
+
+bool alert_channel::push(event &e)
+{
+    size_t pos = head.load(std::memory_order_relaxed);
+    slot *s = 0;
+    while(true){
+        s = &ring[pos & mask];
+        size_t seq = s->seq.load(std::memory_order_acquire);
+        if(seq==pos){
+            if(head.compare_exchange_weak(pos,pos+1,std::memory_order_relaxed)) break;
+        } else if((ptrdiff_t)(seq-pos) < 0){
+            return false;               // full: the writer has not taken the slot a turn ago
+        } else {
+            pos = head.load(std::memory_order_relaxed);
+        }
+    }
+    move_event(s->e,e);
+    s->seq.store(pos+1,std::memory_order_release);
+    return true;
+}
+
+bool alert_channel::pop(event &e)
+{
+    slot &s = ring[tail & mask];
+    if(s.seq.load(std::memory_order_acquire)!=tail+1) return false;
+    move_event(e,s.e);
+    s.seq.store(tail+mask+1,std::memory_order_release);
+    tail++;
+    return true;
+}
+
+void alert_channel::format_event(const event &e,std::string &out) const
+{
+    if(format!="jsonl"){
+        out.append(e.what).append("\t").append(e.path).append("\n");
+        return;
+    }
+    std::stringstream ss;
+    ss << "{\"event\":\"" << e.what << "\",\"kind\":\"" << e.kind << "\",\"path\":" << json_quote(e.path);
+    if(e.has_flow){
+        ss << ",\"session_id\":" << e.session_id
+           << ",\"src\":\"" << ipaddr_prn(e.addr.src,e.addr.family) << "\",\"sport\":" << e.addr.sport
+           << ",\"dst\":\"" << ipaddr_prn(e.addr.dst,e.addr.family) << "\",\"dport\":" << e.addr.dport
+           << ",\"packets\":" << e.packets;
+    }
+    ss << ",\"bytes\":" << e.bytes << "}\n";
+    out += ss.str();
+}
+
+void alert_channel::write_out(std::string &batch)
+{
+    const char *p = batch.data();
+    size_t left = batch.size();
+    while(left>0 && !failed){
+        ssize_t n = ::write(fd,p,left);
+        if(n<0 && errno==EINTR) continue;
+        if(n<=0){
+            perror("write");
+            failed = true;
+            break;
+        }
+        p += n;
+        left -= n;
+    }
+    batch.clear();
+}
+
+void alert_channel::run()
+{
+    std::string batch;
+    event e;
+    while(true){
+        uint64_t d = dropped.load(std::memory_order_relaxed);
+        if(d>reported){
+            std::stringstream ss;
+            if(format=="jsonl"){
+                ss << "{\"event\":\"dropped\",\"count\":" << d-reported << "}\n";
+            } else {
+                ss << "dropped\t" << d-reported << "\n";
+            }
+            batch += ss.str();
+            reported = d;
+        }
+        if(pop(e)){
+            format_event(e,batch);
+            if(batch.size()>=BATCH_BYTES) write_out(batch);
+            continue;
+        }
+        if(batch.size()>0){             // the ring is empty; do not keep the reader waiting
+            write_out(batch);
+            continue;
+        }
+        if(stopping) break;
+        std::unique_lock<std::mutex> lock(M);
+        idle = true;
+        if(ring[tail & mask].seq.load(std::memory_order_acquire)!=tail+1 && !stopping){
+            ready.wait_for(lock,std::chrono::milliseconds(100)); // post() may have missed idle
+        }
+        idle = false;
+    }
+}
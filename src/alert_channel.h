@@ -0,0 +1,97 @@
+#ifndef ALERT_CHANNEL_H
+#define ALERT_CHANNEL_H
+
+/**
+ * alert_channel.h
+ *
+ * The -S tcp_alert_fd and -S http_alert_fd notifications.
+ *
+ * post() puts an event on the channel's ring and returns; it never
+ * waits, not even for a lock, once the descriptor's channel has been
+ * started by its first event. A writer thread for each descriptor takes
+ * what is on the ring, formats it and writes it out in batches, so a
+ * slow reader no longer holds up the packet thread. When the ring is
+ * full the event is dropped and counted, and the writer reports the
+ * count on the stream before the next event it writes.
+ *
+ * -S alert_format says how the events are written:
+ *   text    open<TAB>path and close<TAB>path, one per line, as before;
+ *           dropped<TAB>count after a drop
+ *   jsonl   one JSON object per line, with the flow's addresses, ports,
+ *           session_id and byte and packet counts where there are any;
+ *           {"event":"dropped","count":n} after a drop
+ *
+ * Include after tcpip.h.
+ *
+ * This source code is under the GNU Public License (GPL).  See
+ * LICENSE for details.
+ */
+
+#include <stdint.h>
+#include <string>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <memory>
+
+class alert_channel {
+public:
+    struct event {
+        event():what(""),kind(""),path(),has_flow(false),addr(),session_id(0),bytes(0),packets(0){}
+        const char  *what;              // open or close
+        const char  *kind;              // tcp or http
+        std::string path;
+        bool        has_flow;           // addr and session_id are set
+        flow_addr   addr;
+        uint64_t    session_id;
+        uint64_t    bytes;
+        uint64_t    packets;
+    private:
+        event(const event &);
+        event &operator=(const event &);
+    };
+
+    static uint32_t    queue_size;      // -S alert_queue: events on each ring
+    static std::string format;          // -S alert_format: text or jsonl
+
+    /* Send e to fd; its path is moved out of it */
+    static void post(int fd,event &e);
+    /* Write what is left on every channel and stop the writers; at the end of the run */
+    static void stop_all();
+
+private:
+    explicit alert_channel(int fd_);
+    ~alert_channel();
+    alert_channel(const alert_channel &);
+    alert_channel &operator=(const alert_channel &);
+
+    struct slot {
+        slot():seq(0),e(){}
+        std::atomic<size_t> seq;        // which turn of the ring the slot is ready for
+        event               e;
+    };
+
+    const int                 fd;
+    const size_t              mask;     // ring size - 1
+    std::unique_ptr<slot[]>   ring;
+    std::atomic<size_t>       head;     // next slot to fill
+    size_t                    tail;     // next slot to write; the writer's own
+    std::atomic<uint64_t>     dropped;
+    uint64_t                  reported; // drops written to the stream so far
+    std::atomic<bool>         idle;     // the writer is waiting for an event
+    std::atomic<bool>         stopping;
+    std::mutex                M;        // only for the writer's wait; post() does not take it
+    std::condition_variable   ready;
+    std::thread               writer;
+    bool                      failed;   // a write failed; the rest are thrown away
+
+    bool push(event &e);
+    bool pop(event &e);
+    void format_event(const event &e,std::string &out) const;
+    void write_out(std::string &batch);
+    void run();                         // writer thread body
+    static alert_channel *channel_for(int fd_);
+};
+
+#endif
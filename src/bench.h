@@ -0,0 +1,79 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+/**
+ * bench.h
+ *
+ * What the bench_* microbenchmarks share, in the manner of Google Benchmark.
+ * Each case is a function that does n operations and returns the seconds
+ * they took, leaving its setup out of the time. bench_run() calls it with
+ * n doubling until a call takes -t seconds (default 0.5), and prints the
+ * time per operation with the n that gave it:
+ *
+ *   iptree/add/v4/maxnodes:10000          41.3 ns/op      16777216
+ *
+ * Every program takes
+ *   -t secs    the least time to measure each case for
+ *   -f text    run only the cases whose name contains text
+ * before its own arguments.
+ *
+ * This source code is under the GNU Public License (GPL).  See
+ * LICENSE for details.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+#include <chrono>
+#include <functional>
+
+class bench_timer {
+    std::chrono::steady_clock::time_point t0;
+public:
+    bench_timer():t0(std::chrono::steady_clock::now()){}
+    void   restart() { t0 = std::chrono::steady_clock::now(); }
+    double seconds() const {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now()-t0).count();
+    }
+};
+
+static double      bench_min_secs = 0.5;
+static std::string bench_filter;
+
+/* parses -t and -f; returns the arguments after them */
+static inline std::vector<std::string> bench_init(int argc,char **argv,const char *usage)
+{
+    int ch;
+    while((ch = getopt(argc,argv,"t:f:h")) != -1){
+        switch(ch){
+        case 't': bench_min_secs = atof(optarg); break;
+        case 'f': bench_filter   = optarg; break;
+        default:
+            fprintf(stderr,"usage: %s [-t secs] [-f filter] %s\n",argv[0],usage);
+            exit(1);
+        }
+    }
+    return std::vector<std::string>(argv+optind,argv+argc);
+}
+
+typedef std::function<double(size_t n)> bench_fn;  // does n operations; returns the seconds they took
+
+static inline void bench_run(const std::string &name,bench_fn fn,size_t n=1)
+{
+    if(!bench_filter.empty() && name.find(bench_filter)==std::string::npos) return;
+    double secs = 0;
+    for(;;){
+        secs = fn(n);
+        if(secs>=bench_min_secs || n>=((size_t)1<<34)) break;
+        /* aim a little past the time, but never more than 10 times as many */
+        double scale = secs>0 ? bench_min_secs*1.4/secs : 10;
+        n = (size_t)(n * (scale>10 ? 10 : (scale<2 ? 2 : scale)));
+    }
+    printf("%-44s %10.1f ns/op %12zu\n",name.c_str(),secs*1e9/n,n);
+    fflush(stdout);
+}
+
+#endif
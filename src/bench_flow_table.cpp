@@ -0,0 +1,109 @@
+/**
+ * bench_flow_table.cpp
+ *
+ * Compare the cost of flow lookups in flow_table against std::unordered_map.
+ *
+ * usage: bench_flow_table [nflows]     (default 1000000)
+ *
+ * Builds both tables with the same flows (a mix of IPv4 and IPv6), then
+ * times looking up every flow, every reverse flow (mostly misses, as in
+ * tcpdemux::process_tcp) and a random order of hits.
+ *
+ * This source code is under the GNU Public License (GPL).  See
+ * LICENSE for details.
+ */
+
+#include "tcpflow.h"
+#include "tcpip.h"
+#include "flow_table.h"
+
+#include <unordered_map>
+#include <chrono>
+#include <random>
+#include <algorithm>
+
+struct flow_addr_hash {
+    uint64_t operator() (const flow_addr &k) const { return k.hash(); }
+};
+struct flow_addr_key_eq {
+    bool operator() (const flow_addr &x, const flow_addr &y) const { return x==y; }
+};
+
+typedef std::unordered_map<flow_addr,int *,flow_addr_hash,flow_addr_key_eq> std_map_t;
+typedef flow_table<flow_addr,int *,flow_addr_hash,flow_addr_key_eq> flat_map_t;
+
+static double seconds_since(const std::chrono::steady_clock::time_point &t0)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now()-t0).count();
+}
+
+template <class MAP>
+static void time_lookups(const char *table,const char *what,MAP &map,const std::vector<flow_addr> &keys)
+{
+    std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+    size_t found = 0;
+    for(std::vector<flow_addr>::const_iterator it=keys.begin();it!=keys.end();it++){
+        if(map.find(*it)!=map.end()) found++;
+    }
+    double t = seconds_since(t0);
+    printf("%-14s %-10s %8.1f ns/lookup  (%zu found)\n",table,what,t*1e9/keys.size(),found);
+}
+
+template <class MAP>
+static void run(const char *table,MAP &map,const std::vector<flow_addr> &flows,
+                const std::vector<flow_addr> &reverse,const std::vector<flow_addr> &shuffled)
+{
+    static int dummy;
+    std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+    for(std::vector<flow_addr>::const_iterator it=flows.begin();it!=flows.end();it++){
+        map[*it] = &dummy;
+    }
+    printf("%-14s %-10s %8.1f ns/insert\n",table,"insert",seconds_since(t0)*1e9/flows.size());
+    time_lookups(table,"hit",map,flows);
+    time_lookups(table,"reverse",map,reverse);
+    time_lookups(table,"random",map,shuffled);
+}
+
+int main(int argc,char **argv)
+{
+    size_t nflows = argc>1 ? strtoul(argv[1],0,10) : 1000000;
+    std::mt19937_64 rng(1);
+
+    std::vector<flow_addr> flows;
+    std::vector<flow_addr> reverse;
+    flows.reserve(nflows);
+    reverse.reserve(nflows);
+    for(size_t i=0;i<nflows;i++){
+        uint8_t s[16] = {0};
+        uint8_t d[16] = {0};
+        bool v6 = (i%4)==0;
+        uint64_t r = rng();
+        if(v6){
+            /* one /64 talking to a few servers */
+            s[0]=0x20; s[1]=0x01; s[2]=0x0d; s[3]=0xb8;
+            memcpy(s+8,&r,8);
+            d[0]=0x20; d[1]=0x01; d[2]=0x0d; d[3]=0xb8; d[15]=(uint8_t)(r>>56)&7;
+        } else {
+            /* a 10.0.0.0/8 client network talking to a few servers */
+            s[0]=10; s[1]=(uint8_t)r; s[2]=(uint8_t)(r>>8); s[3]=(uint8_t)(r>>16);
+            d[0]=192; d[1]=168; d[2]=1; d[3]=(uint8_t)(r>>24)&7;
+        }
+        uint16_t sport = 1024 + (uint16_t)((r>>32)%60000);
+        uint16_t dport = (r>>48)&1 ? 443 : 80;
+        flows.push_back(flow_addr(ipaddr(s),ipaddr(d),sport,dport,v6 ? AF_INET6 : AF_INET));
+        reverse.push_back(flow_addr(ipaddr(d),ipaddr(s),dport,sport,v6 ? AF_INET6 : AF_INET));
+    }
+    std::vector<flow_addr> shuffled(flows);
+    std::shuffle(shuffled.begin(),shuffled.end(),rng);
+
+    printf("%zu flows\n",nflows);
+    {
+        std_map_t map;
+        run("unordered_map",map,flows,reverse,shuffled);
+    }
+    {
+        flat_map_t map;
+        run("flow_table",map,flows,reverse,shuffled);
+    }
+    return 0;
+}
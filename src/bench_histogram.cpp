@@ -0,0 +1,70 @@
+/**
+ * bench_histogram.cpp
+ *
+ * Time the netviz histograms as one_page_report fills them: time_histogram::insert()
+ * with the packets spread over a minute, an hour, a day, a week and a year,
+ * and port_histogram::increment().
+ *
+ * usage: bench_histogram [-t secs] [-f filter]
+ *
+ * The ports are a few busy ones (80, 443, 53, ...) and the ephemeral range.
+ *
+ * This source code is under the GNU Public License (GPL).  See
+ * LICENSE for details.
+ */
+
+#include "tcpflow.h"
+#include "netviz/time_histogram.h"
+#include "netviz/port_histogram.h"
+#include "bench.h"
+
+#include <random>
+
+static std::vector<uint16_t> make_ports(size_t count,std::mt19937_64 &rng)
+{
+    static const uint16_t busy[] = {80,443,53,22,25,993,8080,123};
+    std::vector<uint16_t> ports(count);
+    for(size_t i=0;i<count;i++){
+        uint64_t r = rng();
+        ports[i] = (r & 3) ? busy[(r>>2)%8] : 32768 + (uint16_t)((r>>8)%28232);
+    }
+    return ports;
+}
+
+int main(int argc,char **argv)
+{
+    bench_init(argc,argv,"");
+    std::mt19937_64 rng(1);
+    const size_t nports = 1<<16;
+    std::vector<uint16_t> ports = make_ports(nports,rng);
+
+    static const struct { const char *name; uint64_t secs; } spans[] = {
+        {"minute",60},{"hour",3600},{"day",86400},{"week",7*86400},{"year",365*86400}
+    };
+    for(size_t s=0;s<sizeof(spans)/sizeof(spans[0]);s++){
+        uint64_t span_usec = spans[s].secs*1000000;
+        bench_run(std::string("time_histogram/insert/span:")+spans[s].name,[&](size_t n){
+            time_histogram h;
+            uint64_t t0 = 1577836800ULL*1000000; // 2020-01-01
+            bench_timer t;
+            for(size_t i=0;i<n;i++){
+                uint64_t usec = t0 + (uint64_t)((double)span_usec*i/n);
+                struct timeval ts;
+                ts.tv_sec  = usec/1000000;
+                ts.tv_usec = usec%1000000;
+                h.insert(ts,ports[i%nports],1500);
+            }
+            return t.seconds();
+        },10000);
+    }
+
+    bench_run("port_histogram/increment",[&](size_t n){
+        port_histogram h;
+        bench_timer t;
+        for(size_t i=0;i<n;i++){
+            h.increment(ports[i%nports],1500);
+        }
+        return t.seconds();
+    },10000);
+    return 0;
+}
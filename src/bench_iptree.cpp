@@ -0,0 +1,107 @@
+/**
+ * bench_iptree.cpp
+ *
+ * Time iptree::add(), one address at a time and in batches, as the tree
+ * is pruned to different maxnodes.
+ *
+ * usage: bench_iptree [-t secs] [-f filter] [maxnodes ...]   (default 1000 10000 100000)
+ *
+ * The addresses are drawn from a million IPv4 (or IPv6) clients, a few of
+ * them much busier than the rest, as the source addresses of real traffic are.
+ * Past 100000 nodes an IPv6 tree spends minutes pruning.
+ *
+ * This source code is under the GNU Public License (GPL).  See
+ * LICENSE for details.
+ */
+
+#include "tcpflow.h"
+#include "iptree.h"
+#include "bench.h"
+
+#include <random>
+#include <cmath>
+
+static const size_t naddrs = 1<<20;
+
+/* a zipf-like pick: address i is about 1/i as likely as address 1 */
+static std::vector<size_t> make_picks(std::mt19937_64 &rng)
+{
+    std::vector<size_t> picks(naddrs);
+    std::uniform_real_distribution<double> u(0.0,1.0);
+    for(size_t i=0;i<naddrs;i++){
+        picks[i] = (size_t)(pow((double)naddrs,u(rng))) - 1;
+    }
+    return picks;
+}
+
+static std::vector<uint8_t> make_addrs(size_t addrlen,std::mt19937_64 &rng)
+{
+    std::vector<uint8_t> addrs(naddrs*addrlen);
+    for(size_t i=0;i<naddrs;i++){
+        uint8_t *a = &addrs[i*addrlen];
+        uint64_t r = rng();
+        if(addrlen==4){
+            a[0]=10; a[1]=(uint8_t)r; a[2]=(uint8_t)(r>>8); a[3]=(uint8_t)(r>>16);
+        } else {
+            a[0]=0x20; a[1]=0x01; a[2]=0x0d; a[3]=0xb8;
+            for(int j=4;j<8;j++) a[j] = (uint8_t)(r>>(8*j));
+            uint64_t r2 = rng();
+            memcpy(a+8,&r2,8);
+        }
+    }
+    return addrs;
+}
+
+int main(int argc,char **argv)
+{
+    std::vector<std::string> args = bench_init(argc,argv,"[maxnodes ...]");
+    std::vector<int> sizes;
+    for(size_t i=0;i<args.size();i++) sizes.push_back(atoi(args[i].c_str()));
+    if(sizes.empty()){
+        sizes.push_back(1000);
+        sizes.push_back(10000);
+        sizes.push_back(100000);
+    }
+
+    std::mt19937_64 rng(1);
+    std::vector<size_t> picks = make_picks(rng);
+    const size_t lens[2] = {4,16};
+    for(size_t l=0;l<2;l++){
+        size_t addrlen = lens[l];
+        std::vector<uint8_t> addrs = make_addrs(addrlen,rng);
+        const char *family = addrlen==4 ? "v4" : "v6";
+
+        for(std::vector<int>::const_iterator sz=sizes.begin();sz!=sizes.end();sz++){
+            int maxnodes = *sz;
+            std::string suffix = std::string(family) + "/maxnodes:" + std::to_string(maxnodes);
+
+            bench_run("iptree/add/"+suffix,[&](size_t n){
+                iptree tree(maxnodes);
+                bench_timer t;
+                for(size_t i=0;i<n;i++){
+                    tree.add(&addrs[picks[i%naddrs]*addrlen],addrlen,1);
+                }
+                return t.seconds();
+            },1000);
+
+            /* 4096 addresses at a time, which add(batch) sorts */
+            bench_run("iptree/add_batch/"+suffix,[&](size_t n){
+                iptree tree(maxnodes);
+                iptree::batch_t batch;
+                batch.reserve(4096);
+                double secs = 0;
+                for(size_t done=0;done<n;){
+                    batch.clear();
+                    for(;batch.size()<4096 && done<n;done++){
+                        batch.push_back(iptree::batch_element(&addrs[picks[done%naddrs]*addrlen],addrlen,1));
+                    }
+                    bench_timer t;
+                    tree.add(batch);
+                    secs += t.seconds();
+                }
+                return secs;
+            },4096);
+        }
+    }
+    return 0;
+}
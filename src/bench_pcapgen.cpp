@@ -0,0 +1,335 @@
+/**
+ * bench_pcapgen.cpp
+ *
+ * Write a synthetic pcap for benchmarking tcpflow; tests/bench.sh runs
+ * tcpflow over what it writes.
+ *
+ * usage: bench_pcapgen [options] out.pcap
+ *   -f flows       flows in all                          (default 1000)
+ *   -c concurrent  flows open at once                    (default 100)
+ *   -b bytes       response body bytes per flow          (default 100000)
+ *   -s segsize     TCP payload per segment               (default 1448)
+ *   -6 fraction    of flows over IPv6                    (default 0)
+ *   -z fraction    of flows whose body is sent gzip'ed   (default 0)
+ *   -o fraction    of segments held back behind the next (reordered) (default 0)
+ *   -l fraction    of segments lost, never resent        (default 0)
+ *   -r fraction    of segments sent twice                (default 0)
+ *   -S seed        for the random choices                (default 1)
+ *
+ * Each flow is an HTTP/1.1 GET to port 80: the handshake, the request, a
+ * response of -b bytes of text in -s byte segments (gzip'ed, with
+ * Content-Encoding: gzip, for a -z fraction of them) and the FINs. Packets
+ * of the -c open flows are interleaved at random. The same options and seed
+ * always give the same file, byte for byte. The number of packets and bytes
+ * written is printed on stdout as "packets N bytes M".
+ *
+ * This source code is under the GNU Public License (GPL).  See
+ * LICENSE for details.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <random>
+
+static std::mt19937_64 rng;
+
+static double uniform()
+{
+    return std::uniform_real_distribution<double>(0.0,1.0)(rng);
+}
+
+static bool chance(double p)
+{
+    return p>0 && uniform()<p;
+}
+
+/* the pcap file; classic format, DLT_EN10MB, microsecond times */
+static FILE    *out = 0;
+static uint64_t packets_written = 0;
+static uint64_t bytes_written = 0;
+static uint64_t now_usec = 1577836800ULL*1000000; // 2020-01-01
+
+static void put16(std::string &s,uint16_t v) { s.append((const char *)&v,2); }   // host order, as pcap wants
+static void put32(std::string &s,uint32_t v) { s.append((const char *)&v,4); }
+static void put16be(std::string &s,uint16_t v) { s += (char)(v>>8); s += (char)v; }
+static void put32be(std::string &s,uint32_t v) { put16be(s,v>>16); put16be(s,v); }
+
+static void write_or_die(const std::string &s)
+{
+    if(fwrite(s.data(),1,s.size(),out)!=s.size()){
+        perror("write");
+        exit(1);
+    }
+}
+
+static void write_file_header()
+{
+    std::string h;
+    put32(h,0xa1b2c3d4);
+    put16(h,2);                               // version 2.4
+    put16(h,4);
+    put32(h,0);                               // thiszone
+    put32(h,0);                               // sigfigs
+    put32(h,65535);                           // snaplen
+    put32(h,1);                               // DLT_EN10MB
+    write_or_die(h);
+}
+
+static uint32_t sum16(const std::string &s,size_t start,size_t len,uint32_t sum=0)
+{
+    for(size_t i=0;i+1<len;i+=2){
+        sum += ((uint8_t)s[start+i]<<8) | (uint8_t)s[start+i+1];
+    }
+    if(len & 1) sum += (uint8_t)s[start+len-1]<<8;
+    return sum;
+}
+
+static uint16_t fold(uint32_t sum)
+{
+    while(sum>>16) sum = (sum & 0xffff) + (sum>>16);
+    return ~sum & 0xffff;
+}
+
+enum { TH_FIN=0x01, TH_SYN=0x02, TH_PUSH=0x08, TH_ACK=0x10 };
+
+struct endpoint {
+    bool     v6;
+    uint8_t  addr[2][16];   // client, server
+    uint16_t port[2];
+};
+
+/* one frame: ethernet, IPv4 or IPv6, TCP, payload */
+static std::string make_frame(const endpoint &ep,int dir,uint32_t seq,uint32_t ack,
+                              uint8_t flags,const std::string &data)
+{
+    const uint8_t *src = ep.addr[dir], *dst = ep.addr[1-dir];
+    std::string f;
+    f.append(dir ? "\x00\x00\x5e\x00\x01\x02" : "\x00\x00\x5e\x00\x01\x01",6);
+    f.append(dir ? "\x00\x00\x5e\x00\x01\x01" : "\x00\x00\x5e\x00\x01\x02",6);
+    put16be(f,ep.v6 ? 0x86dd : 0x0800);
+
+    size_t tcp_len = 20 + data.size();
+    size_t ip = f.size();
+    if(ep.v6){
+        put32be(f,0x60000000);
+        put16be(f,tcp_len);
+        f += (char)6;                       // next header: TCP
+        f += (char)64;
+        f.append((const char *)src,16);
+        f.append((const char *)dst,16);
+    } else {
+        f += (char)0x45; f += (char)0;
+        put16be(f,20+tcp_len);
+        put16be(f,(uint16_t)packets_written);
+        put16be(f,0x4000);                  // DF
+        f += (char)64; f += (char)6;
+        put16be(f,0);
+        f.append((const char *)src,4);
+        f.append((const char *)dst,4);
+        uint16_t c = fold(sum16(f,ip,20));
+        f[ip+10] = c>>8; f[ip+11] = c;
+    }
+    size_t tcp = f.size();
+    put16be(f,ep.port[dir]);
+    put16be(f,ep.port[1-dir]);
+    put32be(f,seq);
+    put32be(f,ack);
+    f += (char)0x50;                        // 20 byte header
+    f += (char)flags;
+    put16be(f,65535);
+    put16be(f,0);
+    put16be(f,0);
+    f += data;
+
+    /* the pseudo header, then the segment */
+    std::string ph;
+    size_t alen = ep.v6 ? 16 : 4;
+    ph.append((const char *)src,alen);
+    ph.append((const char *)dst,alen);
+    put32be(ph,tcp_len);
+    put32be(ph,6);
+    uint16_t c = fold(sum16(f,tcp,tcp_len,sum16(ph,0,ph.size())));
+    f[tcp+16] = c>>8; f[tcp+17] = c;
+    return f;
+}
+
+static void emit(const std::string &frame)
+{
+    now_usec += 10;
+    std::string h;
+    put32(h,now_usec/1000000);
+    put32(h,now_usec%1000000);
+    put32(h,frame.size());
+    put32(h,frame.size());
+    write_or_die(h);
+    write_or_die(frame);
+    packets_written++;
+    bytes_written += frame.size();
+}
+
+static std::string gzip(const std::string &in)
+{
+    z_stream zs;
+    memset(&zs,0,sizeof(zs));
+    if(deflateInit2(&zs,Z_DEFAULT_COMPRESSION,Z_DEFLATED,16+MAX_WBITS,8,Z_DEFAULT_STRATEGY)!=Z_OK){
+        fprintf(stderr,"deflateInit2 failed\n");
+        exit(1);
+    }
+    std::string res(deflateBound(&zs,in.size()),'\0');
+    zs.next_in   = (Bytef *)in.data();
+    zs.avail_in  = in.size();
+    zs.next_out  = (Bytef *)&res[0];
+    zs.avail_out = res.size();
+    deflate(&zs,Z_FINISH);
+    res.resize(zs.total_out);
+    deflateEnd(&zs);
+    return res;
+}
+
+/* text that compresses about as well as a web page does */
+static std::string body_text(size_t len)
+{
+    static const char *words[] = {"the ","<div class=\"item\">","flow ","packet ","</div>\n",
+                                  "tcpflow ","<a href=\"/x\">","link</a> ","data ","\n"};
+    std::string s;
+    while(s.size()<len){
+        s += words[rng()%10];
+        if(rng()%7==0) s += std::to_string(rng()%100000);
+    }
+    s.resize(len);
+    return s;
+}
+
+struct flow {
+    endpoint ep;
+    std::deque<std::string> frames;         // still to be sent, in order
+};
+
+static double opt_v6 = 0, opt_gzip = 0, opt_reorder = 0, opt_loss = 0, opt_retransmit = 0;
+static size_t opt_body = 100000, opt_segsize = 1448;
+
+static void new_flow(flow &fl,uint64_t n)
+{
+    fl.ep.v6 = chance(opt_v6);
+    memset(fl.ep.addr,0,sizeof(fl.ep.addr));
+    if(fl.ep.v6){
+        static const uint8_t net[2][8] = {{0x20,0x01,0x0d,0xb8,0,0,0,1},{0x20,0x01,0x0d,0xb8,0,0,0,2}};
+        for(int d=0;d<2;d++){
+            memcpy(fl.ep.addr[d],net[d],8);
+            for(int i=0;i<8;i++) fl.ep.addr[d][8+i] = (uint8_t)(n>>(8*(7-i)));
+        }
+    } else {
+        uint8_t c[4] = {10,(uint8_t)(n>>16),(uint8_t)(n>>8),(uint8_t)n};
+        uint8_t s[4] = {192,168,(uint8_t)(n>>8),(uint8_t)(1+n%250)};
+        memcpy(fl.ep.addr[0],c,4);
+        memcpy(fl.ep.addr[1],s,4);
+    }
+    fl.ep.port[0] = 1024 + n%64000;
+    fl.ep.port[1] = 80;
+
+    uint32_t cseq = rng(), sseq = rng();
+    std::string body = body_text(opt_body);
+    std::string hdr = "HTTP/1.1 200 OK\r\nContent-Type: text/html\r\n";
+    if(chance(opt_gzip)){
+        body = gzip(body);
+        hdr += "Content-Encoding: gzip\r\n";
+    }
+    hdr += "Content-Length: " + std::to_string(body.size()) + "\r\n\r\n";
+    std::string response = hdr + body;
+    std::string request = "GET /" + std::to_string(n) + " HTTP/1.1\r\nHost: bench\r\n\r\n";
+
+    std::deque<std::string> &q = fl.frames;
+    q.clear();
+    q.push_back(make_frame(fl.ep,0,cseq,0,TH_SYN,""));
+    q.push_back(make_frame(fl.ep,1,sseq,cseq+1,TH_SYN|TH_ACK,""));
+    q.push_back(make_frame(fl.ep,0,cseq+1,sseq+1,TH_ACK,""));
+    q.push_back(make_frame(fl.ep,0,cseq+1,sseq+1,TH_PUSH|TH_ACK,request));
+    cseq += 1 + request.size();
+    sseq += 1;
+
+    std::vector<std::string> segs;
+    for(size_t off=0;off<response.size();off+=opt_segsize){
+        std::string data = response.substr(off,opt_segsize);
+        if(chance(opt_loss)) continue;
+        segs.push_back(make_frame(fl.ep,1,sseq+off,cseq,TH_ACK,data));
+        if(chance(opt_retransmit)) segs.push_back(segs.back());
+    }
+    for(size_t i=0;i+1<segs.size();i++){
+        if(chance(opt_reorder)) std::swap(segs[i],segs[i+1]);
+    }
+    for(size_t i=0;i<segs.size();i++){
+        q.push_back(segs[i]);
+    }
+    sseq += response.size();
+    q.push_back(make_frame(fl.ep,1,sseq,cseq,TH_FIN|TH_ACK,""));
+    q.push_back(make_frame(fl.ep,0,cseq,sseq+1,TH_FIN|TH_ACK,""));
+    q.push_back(make_frame(fl.ep,1,sseq+1,cseq+1,TH_ACK,""));
+}
+
+static void usage()
+{
+    fprintf(stderr,"usage: bench_pcapgen [-f flows] [-c concurrent] [-b bytes] [-s segsize]\n"
+            "                     [-6 v6] [-z gzip] [-o reorder] [-l loss] [-r retransmit]\n"
+            "                     [-S seed] out.pcap\n");
+    exit(1);
+}
+
+int main(int argc,char **argv)
+{
+    uint64_t nflows = 1000, concurrent = 100, seed = 1;
+    int ch;
+    while((ch = getopt(argc,argv,"f:c:b:s:6:z:o:l:r:S:h")) != -1){
+        switch(ch){
+        case 'f': nflows         = strtoull(optarg,0,10); break;
+        case 'c': concurrent     = strtoull(optarg,0,10); break;
+        case 'b': opt_body       = strtoull(optarg,0,10); break;
+        case 's': opt_segsize    = strtoull(optarg,0,10); break;
+        case '6': opt_v6         = atof(optarg); break;
+        case 'z': opt_gzip       = atof(optarg); break;
+        case 'o': opt_reorder    = atof(optarg); break;
+        case 'l': opt_loss       = atof(optarg); break;
+        case 'r': opt_retransmit = atof(optarg); break;
+        case 'S': seed           = strtoull(optarg,0,10); break;
+        default: usage();
+        }
+    }
+    if(optind+1!=argc || opt_segsize<1 || opt_segsize>9000 || concurrent<1) usage();
+    rng.seed(seed);
+
+    out = fopen(argv[optind],"wb");
+    if(out==0){
+        perror(argv[optind]);
+        exit(1);
+    }
+    write_file_header();
+
+    std::vector<flow> open;
+    uint64_t started = 0;
+    while(started<nflows || !open.empty()){
+        while(started<nflows && open.size()<concurrent){
+            open.push_back(flow());
+            new_flow(open.back(),started++);
+        }
+        size_t i = rng()%open.size();
+        emit(open[i].frames.front());
+        open[i].frames.pop_front();
+        if(open[i].frames.empty()){
+            std::swap(open[i],open.back());
+            open.pop_back();
+        }
+    }
+    if(fclose(out)!=0){
+        perror(argv[optind]);
+        exit(1);
+    }
+    printf("packets %llu bytes %llu\n",(unsigned long long)packets_written,(unsigned long long)bytes_written);
+    return 0;
+}
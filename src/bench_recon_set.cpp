@@ -0,0 +1,71 @@
+/**
+ * bench_recon_set.cpp
+ *
+ * Time recon_set, which is tcpip::seen: the add() that tcpip::store_packet()
+ * makes for each segment and the size() that seen_bytes() returns.
+ *
+ * usage: bench_recon_set [-t secs] [-f filter] [segsize]   (default 1448)
+ *
+ *   in_order    each segment follows the one before it
+ *   reordered   one segment in 50 swapped with the next
+ *   holes       one segment in 50 never arrives, so the gaps pile up
+ *   retransmit  every segment twice
+ *
+ * This source code is under the GNU Public License (GPL).  See
+ * LICENSE for details.
+ */
+
+#include "recon_set.h"
+#include "bench.h"
+
+#include <random>
+#include <algorithm>
+
+/* the offsets of n segments; a flow is 10,000 segments before a new set is started */
+static std::vector<uint64_t> make_offsets(const std::string &order,size_t n,size_t segsize,std::mt19937_64 &rng)
+{
+    std::vector<uint64_t> offsets;
+    offsets.reserve(n);
+    for(uint64_t i=0;offsets.size()<n;i++){
+        if(order=="holes" && rng()%50==0) continue;
+        offsets.push_back(i*segsize);
+        if(order=="retransmit" && offsets.size()<n) offsets.push_back(i*segsize);
+    }
+    if(order=="reordered"){
+        for(size_t i=0;i+1<offsets.size();i++){
+            if(rng()%50==0) std::swap(offsets[i],offsets[i+1]);
+        }
+    }
+    return offsets;
+}
+
+int main(int argc,char **argv)
+{
+    std::vector<std::string> args = bench_init(argc,argv,"[segsize]");
+    size_t segsize = args.empty() ? 1448 : strtoull(args[0].c_str(),0,10);
+    const size_t per_flow = 10000;
+    std::mt19937_64 rng(1);
+
+    static const char *orders[] = {"in_order","reordered","holes","retransmit"};
+    for(size_t o=0;o<4;o++){
+        std::vector<uint64_t> offsets = make_offsets(orders[o],per_flow,segsize,rng);
+        uint64_t seen = 0;
+        bench_run(std::string("recon_set/add/")+orders[o],[&](size_t n){
+            double secs = 0;
+            for(size_t done=0;done<n;){
+                recon_set set;
+                size_t batch = std::min(n-done,per_flow);
+                bench_timer t;
+                for(size_t i=0;i<batch;i++){
+                    set.add(offsets[i],segsize);
+                    seen += set.size();
+                }
+                secs += t.seconds();
+                done += batch;
+            }
+            return secs;
+        },per_flow);
+        if(seen==0) printf("(nothing seen)\n"); // keeps the calls from being optimised away
+    }
+    return 0;
+}
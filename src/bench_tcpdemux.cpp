@@ -0,0 +1,154 @@
+/**
+ * bench_tcpdemux.cpp
+ *
+ * Time the flow database of tcpdemux and flow::filename().
+ *
+ * usage: bench_tcpdemux [-t secs] [-f filter] [nflows ...]   (default 10000 100000 1000000)
+ *
+ * For each number of flows:
+ *   create_tcpip  a new flow, while the database fills up to nflows
+ *   find_tcpip    a flow in a database of nflows, in random order
+ *   find_miss     the other half of one of them, not seen yet (as for a SYN/ACK)
+ * and then flow::filename() with the default template and with -Fk's.
+ * The flows are the same mix of IPv4 and IPv6 as bench_flow_table's.
+ * 10 million flows take several GB.
+ *
+ * This source code is under the GNU Public License (GPL).  See
+ * LICENSE for details.
+ */
+
+#include "tcpflow.h"
+#include "tcpip.h"
+#include "tcpdemux.h"
+#include "bench.h"
+
+#include <random>
+#include <algorithm>
+
+/* tcpflow.cpp defines these for tcpflow */
+const char *progname = "bench_tcpdemux";
+int debug = 0;
+sem_t *semlock = 0;
+
+static std::vector<flow_addr> make_flows(size_t nflows,std::mt19937_64 &rng)
+{
+    std::vector<flow_addr> flows;
+    flows.reserve(nflows);
+    for(size_t i=0;i<nflows;i++){
+        uint8_t s[16] = {0};
+        uint8_t d[16] = {0};
+        bool v6 = (i%4)==0;
+        uint64_t r = rng();
+        if(v6){
+            s[0]=0x20; s[1]=0x01; s[2]=0x0d; s[3]=0xb8;
+            memcpy(s+8,&r,8);
+            d[0]=0x20; d[1]=0x01; d[2]=0x0d; d[3]=0xb8; d[15]=(uint8_t)(r>>56)&7;
+        } else {
+            s[0]=10; s[1]=(uint8_t)r; s[2]=(uint8_t)(r>>8); s[3]=(uint8_t)(r>>16);
+            d[0]=192; d[1]=168; d[2]=1; d[3]=(uint8_t)(r>>24)&7;
+        }
+        uint16_t sport = 1024 + (uint16_t)((r>>32)%60000);
+        uint16_t dport = (r>>48)&1 ? 443 : 80;
+        flows.push_back(flow_addr(ipaddr(s),ipaddr(d),sport,dport,v6 ? AF_INET6 : AF_INET));
+    }
+    return flows;
+}
+
+static std::string number(const char *name,size_t n)
+{
+    return std::string(name) + std::to_string(n);
+}
+
+int main(int argc,char **argv)
+{
+    std::vector<std::string> args = bench_init(argc,argv,"[nflows ...]");
+    std::vector<size_t> sizes;
+    for(size_t i=0;i<args.size();i++) sizes.push_back(strtoull(args[i].c_str(),0,10));
+    if(sizes.empty()){
+        sizes.push_back(10000);
+        sizes.push_back(100000);
+        sizes.push_back(1000000);
+    }
+
+    /* every flow starts with the same packet; create_tcpip() only takes its time and vlan */
+    static u_char frame[64] = {0};
+    frame[12] = 0x08;                    // ETHERTYPE_IP
+    struct pcap_pkthdr hdr;
+    memset(&hdr,0,sizeof(hdr));
+    hdr.caplen = hdr.len = sizeof(frame);
+    be13::packet_info pi(DLT_EN10MB,&hdr,frame,hdr.ts,frame+14,sizeof(frame)-14);
+
+    tcpdemux &demux = *tcpdemux::getInstance();
+    std::mt19937_64 rng(1);
+
+    for(std::vector<size_t>::const_iterator sz=sizes.begin();sz!=sizes.end();sz++){
+        size_t nflows = *sz;
+        std::vector<flow_addr> flows = make_flows(nflows,rng);
+        std::vector<tcpip *> made;
+        made.reserve(nflows);
+
+        bench_run(number("tcpdemux/create_tcpip/flows:",nflows),[&](size_t n){
+            double secs = 0;
+            size_t done = 0;
+            while(done<n){
+                size_t batch = std::min(n-done,nflows);
+                bench_timer t;
+                for(size_t i=0;i<batch;i++){
+                    made.push_back(demux.create_tcpip(flows[i],0,pi,0));
+                }
+                secs += t.seconds();
+                for(size_t i=0;i<made.size();i++) demux.release_tcpip(made[i]);
+                made.clear();
+                done += batch;
+            }
+            return secs;
+        },nflows);
+
+        /* the full database, looked up in random order */
+        for(size_t i=0;i<nflows;i++) made.push_back(demux.create_tcpip(flows[i],0,pi,0));
+        std::vector<flow_addr> shuffled(flows);
+        std::shuffle(shuffled.begin(),shuffled.end(),rng);
+        std::vector<flow_addr> reverse;
+        reverse.reserve(nflows);
+        for(size_t i=0;i<nflows;i++){
+            const flow_addr &f = shuffled[i];
+            reverse.push_back(flow_addr(f.dst,f.src,f.dport,f.sport,f.family));
+        }
+
+        size_t found = 0;
+        bench_run(number("tcpdemux/find_tcpip/flows:",nflows),[&](size_t n){
+            bench_timer t;
+            for(size_t i=0;i<n;i++){
+                if(demux.find_tcpip(shuffled[i%nflows])) found++;
+            }
+            return t.seconds();
+        },nflows);
+        bench_run(number("tcpdemux/find_miss/flows:",nflows),[&](size_t n){
+            bench_timer t;
+            for(size_t i=0;i<n;i++){
+                if(demux.find_tcpip(reverse[i%nflows])) found++;
+            }
+            return t.seconds();
+        },nflows);
+
+        size_t chars = 0;
+        const std::string default_template = flow::filename_template;
+        const char *templates[][2] = {{"default",""},{"Fk","%K/"}};
+        for(size_t j=0;j<2;j++){
+            flow::filename_template = templates[j][1] + default_template;
+            bench_run(number((std::string("flow/filename/")+templates[j][0]+"/flows:").c_str(),nflows),[&](size_t n){
+                bench_timer t;
+                for(size_t i=0;i<n;i++){
+                    chars += made[i%nflows]->myflow.filename(0,false).size();
+                }
+                return t.seconds();
+            },nflows);
+        }
+        flow::filename_template = default_template;
+
+        for(size_t i=0;i<made.size();i++) demux.release_tcpip(made[i]);
+        made.clear();
+        if(found==0 || chars==0) printf("(nothing found)\n"); // keeps the calls from being optimised away
+    }
+    return 0;
+}
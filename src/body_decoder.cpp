@@ -0,0 +1,280 @@
+/*
+ * body_decoder.cpp:
+ *
+ * Content-Encoding decoders for scan_http. See body_decoder.h
+ *
+ * This source code is under the GNU Public License (GPL).  See
+ * LICENSE for details.
+ */
+
+#include "tcpflow.h"
+#include "body_decoder.h"
+
+#include <mutex>
+#include <vector>
+
+#ifdef HAVE_BODY_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_BODY_LIBDEFLATE
+#include <libdeflate.h>
+#endif
+#ifdef HAVE_BODY_BROTLI
+#include <brotli/decode.h>
+#endif
+#ifdef HAVE_BODY_ZSTD
+#include <zstd.h>
+#endif
+
+/* static */ uint32_t body_decoder::buffer_size = 1024*1024;
+
+/* Output buffers, kept for the next body */
+static std::mutex             pool_M;
+static std::vector<uint8_t *> pool;
+static size_t                 pool_buffer_size = 0; // of the buffers in pool
+enum { MAX_POOLED = 16 };
+enum { MAX_WHOLE_BODY = 256*1024*1024 }; // larger bodies are decoded a buffer at a time
+
+/* static */ body_decoder::encoding_t body_decoder::encoding_for(const std::string &content_encoding)
+{
+    const char *ce = content_encoding.c_str();
+    if(content_encoding.size()==0 || strcasecmp(ce,"identity")==0) return IDENTITY;
+    if(strcasecmp(ce,"gzip")==0 || strcasecmp(ce,"x-gzip")==0 || strcasecmp(ce,"deflate")==0) return GZIP;
+    if(strcasecmp(ce,"br")==0) return BROTLI;
+    if(strcasecmp(ce,"zstd")==0) return ZSTD;
+    return UNKNOWN;
+}
+
+/* static */ const char *body_decoder::suffix(encoding_t e)
+{
+    switch(e){
+    case GZIP:   return ".gz";
+    case BROTLI: return ".br";
+    case ZSTD:   return ".zst";
+    default:     return "";
+    }
+}
+
+body_decoder::body_decoder(sink &out_):out(out_),buf(0),size(0),used(0),failed(false),ended(false)
+{
+    std::lock_guard<std::mutex> lock(pool_M);
+    size = buffer_size>=4096 ? buffer_size : 4096;
+    if(pool.size()>0 && pool_buffer_size==size){
+        buf = pool.back();
+        pool.pop_back();
+    } else {
+        buf = new uint8_t[size];
+    }
+}
+
+body_decoder::~body_decoder()
+{
+    std::lock_guard<std::mutex> lock(pool_M);
+    if(pool.size()>0 && pool_buffer_size!=size){ // buffer_size was changed
+        for(std::vector<uint8_t *>::iterator it=pool.begin();it!=pool.end();it++) delete[] *it;
+        pool.clear();
+    }
+    if(pool.size()<MAX_POOLED){
+        pool_buffer_size = size;
+        pool.push_back(buf);
+    } else {
+        delete[] buf;
+    }
+}
+
+void body_decoder::flush()
+{
+    if(used==0) return;
+    out.put(buf,used);
+    used = 0;
+}
+
+int body_decoder::fail(const char *why)
+{
+    DEBUG(3) ("decompression failed (%s); the rest of the body is ignored",why);
+    failed = true;
+    return -1;
+}
+
+#ifdef HAVE_BODY_ZLIB
+/* gzip and deflate */
+class zlib_decoder : public body_decoder {
+    zlib_decoder(const zlib_decoder &);
+    zlib_decoder &operator=(const zlib_decoder &);
+    z_stream zs;
+    bool     zinit;
+public:
+    explicit zlib_decoder(sink &out_):body_decoder(out_),zs(),zinit(false){}
+    virtual ~zlib_decoder(){
+        if(zinit) inflateEnd(&zs);
+    }
+    virtual int decode(const uint8_t *data,size_t length);
+    virtual int decode_all(const uint8_t *data,size_t length);
+};
+
+int zlib_decoder::decode(const uint8_t *data,size_t length)
+{
+    if(failed) return -1;
+    if(ended || length==0) return 0;
+    if(!zinit){
+        memset(&zs,0,sizeof(zs));
+        int rv = inflateInit2(&zs, 32 + MAX_WBITS);      /* 32 auto-detects gzip or deflate */
+        if (rv != Z_OK) return fail("bad Content-Encoding?");
+        zinit = true;
+    }
+    zs.next_in  = (Bytef *)data;
+    zs.avail_in = length;
+    while(true){
+        zs.next_out  = (Bytef *)buf+used;
+        zs.avail_out = size-used;
+        int rv = inflate(&zs, Z_SYNC_FLUSH);
+        used = size - zs.avail_out;
+        if(rv == Z_STREAM_END){
+            ended = true;
+            if(zs.avail_in > 0) DEBUG(3) ("decompression completed, but with trailing garbage");
+            return 0;
+        }
+        if(rv != Z_OK && rv != Z_BUF_ERROR) return fail("corrupted stream?");
+        if(used==size){                 // there may be more to come out
+            flush();
+            continue;
+        }
+        if(zs.avail_in==0) return 0;
+        if(rv == Z_BUF_ERROR) return fail("no progress");
+    }
+}
+
+int zlib_decoder::decode_all(const uint8_t *data,size_t length)
+{
+#ifdef HAVE_BODY_LIBDEFLATE
+    static thread_local struct libdeflate_decompressor *ld = 0;
+    if(failed || ended || zinit || length<2) return decode(data,length);
+    if(ld==0) ld = libdeflate_alloc_decompressor();
+    if(ld==0) return decode(data,length);
+
+    bool gzip = data[0]==0x1f && data[1]==0x8b;
+    size_t avail = size;
+    if(gzip && length>=18){             // the trailer has the size, mod 2^32
+        uint32_t isize = data[length-4] | (data[length-3]<<8) | (data[length-2]<<16) | ((uint32_t)data[length-1]<<24);
+        if(isize > avail) avail = isize;
+    }
+    std::vector<uint8_t> big;           // when the body does not fit in buf
+    while(avail <= MAX_WHOLE_BODY){
+        uint8_t *o = buf;
+        if(avail > size){
+            big.resize(avail);
+            o = &big[0];
+        }
+        size_t actual = 0;
+        enum libdeflate_result r = gzip ?
+            libdeflate_gzip_decompress(ld,data,length,o,avail,&actual) :
+            libdeflate_zlib_decompress(ld,data,length,o,avail,&actual);
+        if(r==LIBDEFLATE_SUCCESS){
+            ended = true;
+            if(o==buf){
+                used = actual;
+            } else {
+                out.put(o,actual);
+            }
+            return 0;
+        }
+        if(r!=LIBDEFLATE_INSUFFICIENT_SPACE) break; // raw deflate, say; let zlib try
+        avail *= 4;
+    }
+#endif
+    return decode(data,length);
+}
+#endif
+
+#ifdef HAVE_BODY_BROTLI
+class brotli_decoder : public body_decoder {
+    brotli_decoder(const brotli_decoder &);
+    brotli_decoder &operator=(const brotli_decoder &);
+    BrotliDecoderState *st;
+public:
+    explicit brotli_decoder(sink &out_):body_decoder(out_),st(BrotliDecoderCreateInstance(0,0,0)){
+        if(st==0) failed = true;
+    }
+    virtual ~brotli_decoder(){
+        if(st) BrotliDecoderDestroyInstance(st);
+    }
+    virtual int decode(const uint8_t *data,size_t length);
+};
+
+int brotli_decoder::decode(const uint8_t *data,size_t length)
+{
+    if(failed) return -1;
+    if(ended || length==0) return 0;
+    size_t avail_in = length;
+    while(true){
+        uint8_t *next_out = buf+used;
+        size_t avail_out = size-used;
+        BrotliDecoderResult r = BrotliDecoderDecompressStream(st,&avail_in,&data,&avail_out,&next_out,0);
+        used = size - avail_out;
+        switch(r){
+        case BROTLI_DECODER_RESULT_NEEDS_MORE_OUTPUT:
+            flush();
+            continue;
+        case BROTLI_DECODER_RESULT_SUCCESS:
+            ended = true;
+            if(avail_in > 0) DEBUG(3) ("decompression completed, but with trailing garbage");
+            return 0;
+        case BROTLI_DECODER_RESULT_NEEDS_MORE_INPUT:
+            return 0;
+        default:
+            return fail(BrotliDecoderErrorString(BrotliDecoderGetErrorCode(st)));
+        }
+    }
+}
+#endif
+
+#ifdef HAVE_BODY_ZSTD
+class zstd_decoder : public body_decoder {
+    zstd_decoder(const zstd_decoder &);
+    zstd_decoder &operator=(const zstd_decoder &);
+    ZSTD_DCtx *dctx;
+public:
+    explicit zstd_decoder(sink &out_):body_decoder(out_),dctx(ZSTD_createDCtx()){
+        if(dctx==0) failed = true;
+    }
+    virtual ~zstd_decoder(){
+        ZSTD_freeDCtx(dctx);
+    }
+    virtual int decode(const uint8_t *data,size_t length);
+};
+
+/* A body can be several frames one after another */
+int zstd_decoder::decode(const uint8_t *data,size_t length)
+{
+    if(failed) return -1;
+    if(length==0) return 0;
+    ZSTD_inBuffer ib = {data,length,0};
+    while(true){
+        ZSTD_outBuffer ob = {buf,size,used};
+        size_t r = ZSTD_decompressStream(dctx,&ob,&ib);
+        used = ob.pos;
+        if(ZSTD_isError(r)) return fail(ZSTD_getErrorName(r));
+        if(used==size){
+            flush();
+            continue;
+        }
+        if(ib.pos==ib.size) return 0;
+    }
+}
+#endif
+
+/* static */ body_decoder *body_decoder::make(encoding_t e,sink &out)
+{
+    switch(e){
+#ifdef HAVE_BODY_ZLIB
+    case GZIP:   return new zlib_decoder(out);
+#endif
+#ifdef HAVE_BODY_BROTLI
+    case BROTLI: return new brotli_decoder(out);
+#endif
+#ifdef HAVE_BODY_ZSTD
+    case ZSTD:   return new zstd_decoder(out);
+#endif
+    default:     return 0;
+    }
+}
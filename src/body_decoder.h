@@ -0,0 +1,82 @@
+/*
+ * body_decoder.h:
+ *
+ * Decode HTTP bodies sent with a Content-Encoding, for scan_http.
+ *
+ *   gzip, x-gzip, deflate   zlib (or zlib-ng, built as zlib); when the
+ *                           whole body is in the buffer and tcpflow was
+ *                           built with libdeflate, that decodes it in one call
+ *   br                      brotli, if tcpflow was built with libbrotlidec
+ *   zstd                    if tcpflow was built with libzstd
+ *
+ * The decoded bytes are collected in a buffer of buffer_size bytes and
+ * handed to the sink when it is full and by flush(), so that the body
+ * file is written in large pieces. The buffers are kept for the next
+ * body rather than freed.
+ *
+ * This source code is under the GNU Public License (GPL).  See
+ * LICENSE for details.
+ */
+
+#ifndef BODY_DECODER_H
+#define BODY_DECODER_H
+
+#include "config.h"
+
+#include <stdint.h>
+#include <string>
+
+#if defined(HAVE_ZLIB_H) && defined(HAVE_LIBZ)
+#define HAVE_BODY_ZLIB
+#endif
+#if defined(HAVE_LIBDEFLATE_H) && defined(HAVE_LIBDEFLATE)
+#define HAVE_BODY_LIBDEFLATE
+#endif
+#if defined(HAVE_BROTLI_DECODE_H) && defined(HAVE_LIBBROTLIDEC)
+#define HAVE_BODY_BROTLI
+#endif
+#if defined(HAVE_ZSTD_H) && defined(HAVE_LIBZSTD)
+#define HAVE_BODY_ZSTD
+#endif
+
+class body_decoder {
+    body_decoder(const body_decoder &);
+    body_decoder &operator=(const body_decoder &);
+
+public:
+    /* where the decoded body goes */
+    class sink {
+    public:
+        virtual ~sink(){}
+        virtual void put(const uint8_t *data,size_t length)=0;
+    };
+
+    static uint32_t buffer_size;        // -S http_decode_buffer
+
+    enum encoding_t { IDENTITY, GZIP, BROTLI, ZSTD, UNKNOWN };
+    static encoding_t encoding_for(const std::string &content_encoding);
+    static const char *suffix(encoding_t e); // for a body that is saved still encoded
+
+    /* 0 if e cannot be decoded by this build */
+    static body_decoder *make(encoding_t e,sink &out);
+    virtual ~body_decoder();            // without flush()
+
+    /* Returns -1 once the body turns out to be corrupt; the rest of it is ignored */
+    virtual int decode(const uint8_t *data,size_t length)=0;
+    /* data is the whole body */
+    virtual int decode_all(const uint8_t *data,size_t length) { return decode(data,length); }
+    void flush();
+
+protected:
+    explicit body_decoder(sink &out_);
+    sink     &out;
+    uint8_t  *buf;
+    size_t   size;                      // of buf; buffer_size when it was made
+    size_t   used;
+    bool     failed;
+    bool     ended;                     // the end of the encoded stream was seen
+
+    int fail(const char *why);          // reports why, and returns -1
+};
+
+#endif
@@ -0,0 +1,241 @@
+/**
+ *
+ * body_store.cpp
+ * HTTP bodies kept once for each content. See body_store.h
+ *
+ * This source code is under the GNU Public License (GPL).  See
+ * LICENSE for details.
+ *
+ */
+
+#include "tcpflow.h"
+#include "tcpip.h"
+#include "tcpdemux.h"
+#include "body_store.h"
+
+#include <algorithm>
+#include <sstream>
+#include <unordered_map>
+#include <mutex>
+#include <atomic>
+
+/* static */ std::string body_store::dir;
+/* static */ uint32_t    body_store::prefix_bytes = 65536;
+/* static */ bool        body_store::links        = true;
+/* static */ bool        body_store::started      = false;
+
+static std::string root;                // dir, as the objects are named
+static std::mutex  prefixes_M;
+static std::unordered_map<uint64_t,std::string> prefixes; // the object each key was last seen for
+static const size_t prefixes_max = 65536; // then it starts again; it only saves writes
+
+static std::atomic<uint64_t> bodies(0);
+static std::atomic<uint64_t> objects(0);       // made in this run
+static std::atomic<uint64_t> duplicates(0);
+static std::atomic<uint64_t> stored_bytes(0);
+static std::atomic<uint64_t> saved_bytes(0);
+static std::atomic<uint64_t> tmp_counter(0);
+
+/* Copy length bytes of from, from its start, to the start of to */
+static bool copy_range(int from,int to,uint64_t length)
+{
+    char buf[65536];
+    for(uint64_t off=0;off<length;){
+        size_t n = (size_t)std::min((uint64_t)sizeof(buf),length-off);
+        ssize_t r = pread(from,buf,n,(off_t)off);
+        if(r<=0) return false;
+        if(pwrite(to,buf,r,(off_t)off)!=r) return false;
+        off += r;
+    }
+    return true;
+}
+
+static void copy_file(const std::string &from,const std::string &to)
+{
+    int in = ::open(from.c_str(),O_RDONLY|O_BINARY);
+    int out = in<0 ? -1 : ::open(to.c_str(),O_WRONLY|O_CREAT|O_TRUNC|O_BINARY,0644);
+    struct stat st;
+    if(out<0 || fstat(in,&st) || !copy_range(in,out,st.st_size)){
+        DEBUG(1)("cannot copy %s to %s: %s",from.c_str(),to.c_str(),strerror(errno));
+    }
+    if(in>=0) ::close(in);
+    if(out>=0) ::close(out);
+}
+
+/* static */ bool body_store::start(const std::string &path,std::string &error)
+{
+    if(!flow_hash::available()){
+        error = "-S dedup_dir needs tcpflow built with OpenSSL";
+        return false;
+    }
+    root = path;
+    mkdirs_for_path(root + "/x");
+    struct stat st;
+    if(stat(root.c_str(),&st) || !S_ISDIR(st.st_mode)){
+        error = root + ": cannot make the directory";
+        return false;
+    }
+    started = true;
+    return true;
+}
+
+/* static */ void body_store::dump_xml(dfxml_writer *xreport)
+{
+    std::stringstream attrs;
+    attrs << "dir='" << dfxml_writer::xmlescape(root) << "' bodies='" << bodies.load()
+          << "' objects='" << objects.load() << "' duplicates='" << duplicates.load()
+          << "' stored_bytes='" << stored_bytes.load() << "' saved_bytes='" << saved_bytes.load() << "'";
+    xreport->xmlout("dedup","",attrs.str(),false);
+}
+
+body_store::writer::writer(const std::string &output_path_,uint64_t length):
+    output_path(output_path_),expected(length),bytes(0),key(0),head(),held(true),
+    fd(-1),tmp_path(),cand_fd(-1),cand_path(),hash(new flow_hash::context(flow_hash::SHA256))
+{
+    bodies++;
+}
+
+body_store::writer::~writer()
+{
+    if(fd>=0){
+        ::close(fd);
+        ::unlink(tmp_path.c_str());
+    }
+    if(cand_fd>=0) ::close(cand_fd);
+    delete hash;
+}
+
+bool body_store::writer::open_tmp()
+{
+    std::stringstream ss;
+    ss << root << "/tmp-" << getpid() << "-" << tmp_counter++;
+    tmp_path = ss.str();
+    fd = tcpdemux::getInstance()->retrying_open(tmp_path,O_WRONLY|O_CREAT|O_EXCL|O_BINARY,0644);
+    if(fd<0){
+        DEBUG(1)("unable to open %s for %s: %s",tmp_path.c_str(),output_path.c_str(),strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+void body_store::writer::decide()
+{
+    held = false;
+    key  = std::hash<std::string>()(head.substr(0,prefix_bytes)) ^ (expected * 0x9e3779b97f4a7c15ULL);
+    {
+        std::lock_guard<std::mutex> lock(prefixes_M);
+        std::unordered_map<uint64_t,std::string>::const_iterator it = prefixes.find(key);
+        if(it!=prefixes.end()) cand_path = it->second;
+    }
+    if(cand_path.size()){
+        cand_fd = ::open(cand_path.c_str(),O_RDONLY|O_BINARY);
+        if(cand_fd>=0){
+            std::string theirs(head.size(),'\0');
+            if(pread(cand_fd,&theirs[0],theirs.size(),0)==(ssize_t)theirs.size() && theirs==head){
+                std::string().swap(head);  // the same so far, so nothing is written
+                return;
+            }
+            ::close(cand_fd);
+            cand_fd = -1;
+        }
+        cand_path.clear();
+    }
+    if(open_tmp() && pwrite(fd,head.data(),head.size(),0)!=(ssize_t)head.size()){
+        DEBUG(1)("write to %s failed: %s",tmp_path.c_str(),strerror(errno));
+    }
+    std::string().swap(head);
+}
+
+void body_store::writer::diverge()
+{
+    if(open_tmp() && !copy_range(cand_fd,fd,bytes)){
+        DEBUG(1)("cannot copy %s to %s: %s",cand_path.c_str(),tmp_path.c_str(),strerror(errno));
+    }
+    ::close(cand_fd);
+    cand_fd = -1;
+    cand_path.clear();
+}
+
+void body_store::writer::write(const uint8_t *data,size_t length)
+{
+    if(length==0) return;
+    hash->update(data,length);
+    if(held){
+        head.append((const char *)data,length);
+        bytes += length;
+        if(head.size()>=prefix_bytes) decide();
+        return;
+    }
+    if(cand_fd>=0){
+        std::string theirs(length,'\0');
+        if(pread(cand_fd,&theirs[0],length,(off_t)bytes)==(ssize_t)length && memcmp(theirs.data(),data,length)==0){
+            bytes += length;
+            return;
+        }
+        diverge();
+    }
+    if(fd>=0 && pwrite(fd,data,length,(off_t)bytes)!=(ssize_t)length){
+        DEBUG(1)("write to %s failed: %s",tmp_path.c_str(),strerror(errno));
+    }
+    bytes += length;
+}
+
+std::string body_store::writer::finish(std::string &filename,std::string &sha256)
+{
+    flow_hash::digests_t d;
+    hash->final(d);
+    sha256 = d.size()>0 ? d[0].hex : "";
+    std::string object = root + "/" + sha256.substr(0,2) + "/" + sha256;
+    mkdirs_for_path(object);
+
+    if(cand_fd>=0){
+        struct stat st;
+        if(fstat(cand_fd,&st)==0 && (uint64_t)st.st_size==bytes){
+            ::close(cand_fd);           // all of it is the object
+            cand_fd = -1;
+        } else {
+            diverge();                  // the start of it
+        }
+    }
+    bool is_new = false;
+    if(held){
+        /* small enough never to have been written; it is only if it is new */
+        if(access(object.c_str(),F_OK)!=0 && open_tmp()
+           && pwrite(fd,head.data(),head.size(),0)!=(ssize_t)head.size()){
+            DEBUG(1)("write to %s failed: %s",tmp_path.c_str(),strerror(errno));
+        }
+    }
+    if(fd>=0){
+        ::close(fd);
+        fd = -1;
+        if(::link(tmp_path.c_str(),object.c_str())==0){
+            is_new = true;
+        } else if(errno!=EEXIST){
+            DEBUG(1)("cannot make %s: %s",object.c_str(),strerror(errno));
+        }
+        ::unlink(tmp_path.c_str());
+        if(!held){
+            std::lock_guard<std::mutex> lock(prefixes_M);
+            if(prefixes.size()>=prefixes_max) prefixes.clear();
+            prefixes[key] = object;     // for the next body that starts the same
+        }
+    }
+    if(is_new){
+        objects++;
+        stored_bytes += bytes;
+    } else {
+        duplicates++;
+        saved_bytes += bytes;
+    }
+
+    if(links){
+        ::unlink(output_path.c_str());  // from an earlier run
+        if(::link(object.c_str(),output_path.c_str())){
+            copy_file(object,output_path); // another file system
+        }
+        filename = output_path;
+    } else {
+        filename = object;
+    }
+    return "<dedup object='" + dfxml_writer::xmlescape(object) + "' stored='" + (is_new ? "1" : "0") + "'/>";
+}
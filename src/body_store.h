@@ -0,0 +1,99 @@
+/*
+ * body_store.h:
+ *
+ * HTTP bodies kept once for each content, with -S dedup_dir=dir (in the
+ * output directory unless it is an absolute path), so that the same
+ * script, image or update fetched a thousand times is written once.
+ *
+ * Each body is an object named by its SHA-256, dir/ab/abcdef...; the
+ * -HTTPBODY- file that scan_http would have written is a hard link to
+ * it (with -S dedup_links=0 there is none, and the report names the
+ * object). The body's <fileobject> says which object it is:
+ *
+ *   <fileobject><filename>...-HTTPBODY-001.js</filename><filesize>N</filesize>
+ *     <hashdigest type='SHA256'>abcdef...</hashdigest>
+ *     <dedup object='dir/ab/abcdef...' stored='0'/></fileobject>
+ *
+ * stored is 1 for the body whose bytes made the object, and 0 for the
+ * ones that found it there.
+ *
+ * The digest is only known at the end, so a body is not written before
+ * there is a reason to:
+ *   - the first -S dedup_prefix bytes (default 65536) are held in memory;
+ *     a body that ends within them is hashed and written only if its
+ *     object is not there yet
+ *   - a longer one is looked up by its length, when the response gave it,
+ *     and a hash of those bytes; if no object seen in this run starts
+ *     the same, the body is new and is written as it comes, to a
+ *     temporary file that becomes its object
+ *   - if one does, the rest of the body is compared with that object as
+ *     it comes, and written only from where they differ (with the bytes
+ *     before that copied from the object)
+ * so a new body costs one write of its bytes, and a repeated one none.
+ *
+ * Objects outlive the run, and a later run with the same dir finds the
+ * ones that fit in dedup_prefix. It needs OpenSSL, and is not used with
+ * --segments. The hard links need dir on the same file system as the
+ * bodies; where it is not, the body is copied from its object.
+ *
+ * This source code is under the GNU Public License (GPL).  See
+ * LICENSE for details.
+ */
+
+#ifndef BODY_STORE_H
+#define BODY_STORE_H
+
+#include "flow_hash.h"
+
+#include <stdint.h>
+#include <string>
+
+class body_store {
+public:
+    static std::string dir;             // -S dedup_dir; "" for none
+    static uint32_t    prefix_bytes;    // -S dedup_prefix
+    static bool        links;           // -S dedup_links
+
+    static bool start(const std::string &path,std::string &error); // path is dir, made absolute
+    static bool active() { return started; }
+    static void dump_xml(class dfxml_writer *xreport); // <dedup>
+
+    /* One body, as scan_http has it */
+    class writer {
+        writer(const writer &);
+        writer &operator=(const writer &);
+    public:
+        /* output_path is the -HTTPBODY- name; length is the Content-Length, or 0 if it is not known */
+        writer(const std::string &output_path,uint64_t length);
+        ~writer();                      // a body that was not finished leaves nothing
+        void write(const uint8_t *data,size_t length);
+        /* Puts the body in the store and makes output_path. Returns the
+         * <dedup> for its <fileobject>, with the name the report gives
+         * it in filename and its digest in sha256.
+         */
+        std::string finish(std::string &filename,std::string &sha256);
+        uint64_t size() const { return bytes; }
+
+    private:
+        const std::string output_path;
+        const uint64_t    expected;     // Content-Length, or 0
+        uint64_t          bytes;
+        uint64_t          key;          // expected and a hash of the first prefix_bytes, once they are in
+        std::string       head;         // the first prefix_bytes, until there is a reason to write
+        bool              held;         // the body is all in head so far
+        int               fd;           // the temporary file the body is written to, once it is new
+        std::string       tmp_path;
+        int               cand_fd;      // the object it is being compared with
+        std::string       cand_path;
+        flow_hash::context *hash;
+
+        void decide();                  // head is full: new, or compared with an object
+        void diverge();                 // no longer the object; write it from here
+        bool open_tmp();
+    };
+
+private:
+    static bool started;
+};
+
+#endif
@@ -0,0 +1,112 @@
+/*
+ * capture_ring.cpp:
+ *
+ * A capture thread apart from the demultiplexer. See capture_ring.h
+ *
+ * This source code is under the GNU Public License (GPL).  See
+ * LICENSE for details.
+ */
+
+#include "tcpflow.h"
+#include "capture_ring.h"
+#include "packet_batch.h"
+
+#include <algorithm>
+#include <thread>
+#include <chrono>
+
+/* static */ uint64_t capture_ring::size_bytes = 0;
+
+static inline uint64_t align8(uint64_t n) { return (n+7) & ~(uint64_t)7; }
+
+capture_ring::capture_ring(uint64_t bytes):
+    ring(align8(std::max(bytes,(uint64_t)MIN_BYTES))/8),capacity(ring.size()*8),
+    head(0),tail(0),packets(0),overflows(0),high_water(0),done(false),waiting(false),M(),ready()
+{
+}
+
+void capture_ring::push(const struct pcap_pkthdr *h,const u_char *p)
+{
+    uint64_t need = align8(sizeof(record) + h->caplen);
+    uint64_t pos  = head.load(std::memory_order_relaxed);
+    uint64_t end  = tail.load(std::memory_order_acquire) + capacity;
+    uint64_t room = capacity - pos % capacity;      // before the end of the ring
+    uint64_t skip = room < need ? room : 0;
+    if(pos + skip + need > end){
+        overflows.fetch_add(1,std::memory_order_relaxed);
+        return;
+    }
+    if(skip){
+        record *r = reinterpret_cast<record *>(at(pos));
+        r->length = (uint32_t)skip;
+        r->skip   = 1;
+        pos += skip;
+    }
+    record *r = reinterpret_cast<record *>(at(pos));
+    r->length = (uint32_t)need;
+    r->skip   = 0;
+    r->hdr    = *h;
+    memcpy(r+1,p,h->caplen);
+    head.store(pos+need);               // seq_cst, with waiting below: see run()
+    packets.fetch_add(1,std::memory_order_relaxed);
+
+    uint64_t used = pos + need - (end - capacity);
+    if(used > high_water.load(std::memory_order_relaxed)) high_water.store(used,std::memory_order_relaxed);
+    if(waiting.load()){
+        std::lock_guard<std::mutex> lock(M);
+        ready.notify_one();
+    }
+}
+
+/* static */ void capture_ring::collect(u_char *user,const struct pcap_pkthdr *h,const u_char *p)
+{
+    reinterpret_cast<capture_ring *>(user)->push(h,p);
+}
+
+size_t capture_ring::drain(pcap_handler handler,u_char *user)
+{
+    uint64_t pos = tail.load(std::memory_order_relaxed);
+    uint64_t end = head.load(std::memory_order_acquire);
+    size_t n = 0;
+    while(pos < end && n < BATCH_PACKETS){
+        const record *r = reinterpret_cast<const record *>(at(pos));
+        if(!r->skip){
+            (*handler)(user,&r->hdr,reinterpret_cast<const u_char *>(r+1));
+            n++;
+        }
+        pos += r->length;
+    }
+    packet_batch::flush();              // the records are about to be given back
+    tail.store(pos,std::memory_order_release);
+    return n;
+}
+
+int capture_ring::run(pcap_t *pd,pcap_handler handler,u_char *user)
+{
+    int result = 0;
+    std::thread capture([&]{
+        result = pcap_loop(pd,-1,collect,reinterpret_cast<u_char *>(this));
+        done.store(true,std::memory_order_release);
+        std::lock_guard<std::mutex> lock(M);
+        ready.notify_one();
+    });
+
+    packet_batch::scope batch;
+    while(true){
+        bool finished = done.load(std::memory_order_acquire); // before the last look at head
+        if(drain(handler,user)>0) continue;
+        if(used()>0) continue;          // only SKIP records
+        if(finished) break;
+        /* waiting is set before head is looked at, and push() sets head before it
+         * looks at waiting, so one of the two sees the other
+         */
+        std::unique_lock<std::mutex> lock(M);
+        waiting.store(true);
+        if(head.load()==tail.load(std::memory_order_relaxed) && !done.load()){
+            ready.wait_for(lock,std::chrono::milliseconds(10));
+        }
+        waiting.store(false,std::memory_order_relaxed);
+    }
+    capture.join();
+    return result;
+}
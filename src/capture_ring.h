@@ -0,0 +1,93 @@
+/*
+ * capture_ring.h:
+ *
+ * A capture thread apart from the demultiplexer, with -S capture_ring=bytes.
+ *
+ * Without it, libpcap calls the datalink handler on the thread that reads
+ * the interface, so reassembly, the writes and the scanners all run
+ * between two reads; a disk that stalls for a moment stops the reading,
+ * and the kernel drops what it cannot hold. With it, pcap_loop() runs on
+ * a thread of its own whose handler only copies each packet, header and
+ * all, into a ring of bytes allocated once, and the thread that called
+ * run() takes the packets out in batches of up to BATCH_PACKETS and hands
+ * them to the datalink handler where they lie (through packet_batch), so
+ * the ring absorbs the stall instead of the kernel.
+ *
+ * There is one writer and one reader, so the ring needs no lock: each
+ * side owns one of the two positions and publishes it with a release
+ * store. A packet that does not fit is dropped and counted, rather than
+ * holding up the capture thread.
+ *
+ * report.xml has <capture_ring bytes='...' packets='...' high_water='...'
+ * overflows='...'/>, with the most bytes the ring held at once; -S
+ * metrics_file has capture_ring_used and capture_ring_overflows.
+ *
+ * Used for a single interface read with libpcap; -i with several
+ * interfaces (live_capture.h) and -S tpacket have threads of their own.
+ *
+ * This source code is under the GNU Public License (GPL).  See
+ * LICENSE for details.
+ */
+
+#ifndef CAPTURE_RING_H
+#define CAPTURE_RING_H
+
+#include "tcpflow.h"
+
+#include <stdint.h>
+#include <vector>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+
+class capture_ring {
+    capture_ring(const capture_ring &);
+    capture_ring &operator=(const capture_ring &);
+
+    /* Each packet is a record, 8-byte aligned; a record that would not fit
+     * before the end of the ring is put at its start, after a SKIP record.
+     */
+    struct record {
+        uint32_t length;                // of the record, with this header and the padding
+        uint32_t skip;                  // nothing but padding to the end of the ring
+        struct pcap_pkthdr hdr;
+    };
+
+    std::vector<uint64_t> ring;
+    const uint64_t        capacity;     // bytes
+    alignas(64) std::atomic<uint64_t> head; // bytes ever written; the capture thread's
+    alignas(64) std::atomic<uint64_t> tail; // bytes ever taken out; the reader's
+    alignas(64) std::atomic<uint64_t> packets;
+    std::atomic<uint64_t> overflows;
+    std::atomic<uint64_t> high_water;
+    std::atomic<bool>     done;         // pcap_loop() has returned
+    std::atomic<bool>     waiting;      // the reader is asleep on ready
+    std::mutex            M;            // only for ready
+    std::condition_variable ready;
+
+    u_char *at(uint64_t pos) { return reinterpret_cast<u_char *>(&ring[0]) + pos % capacity; }
+    void push(const struct pcap_pkthdr *h,const u_char *p); // capture thread
+    static void collect(u_char *user,const struct pcap_pkthdr *h,const u_char *p);
+    size_t drain(pcap_handler handler,u_char *user);  // one batch; returns the packets delivered
+
+public:
+    static uint64_t size_bytes;         // -S capture_ring; 0 for none
+    enum { BATCH_PACKETS = 256,
+           MIN_BYTES = 4*(SNAPLEN+sizeof(record)) };
+
+    explicit capture_ring(uint64_t bytes);
+
+    /* pcap_loop(pd) on a thread of its own, into the ring, while this thread
+     * hands the packets to handler with user, until it returns and the ring
+     * is empty. Returns what pcap_loop() returned.
+     */
+    int run(pcap_t *pd,pcap_handler handler,u_char *user);
+
+    uint64_t size() const { return capacity; }
+    uint64_t used() const { return head.load(std::memory_order_relaxed)-tail.load(std::memory_order_relaxed); }
+    uint64_t packet_count() const { return packets.load(std::memory_order_relaxed); }
+    uint64_t overflow_count() const { return overflows.load(std::memory_order_relaxed); }
+    uint64_t high_water_mark() const { return high_water.load(std::memory_order_relaxed); }
+};
+
+#endif
@@ -0,0 +1,356 @@
+/*
+ * capture_tpacket.cpp:
+ *
+ * Live capture from a Linux AF_PACKET TPACKET_V3 ring.
+ * See capture_tpacket.h
+ *
+ * This source code is under the GNU Public License (GPL).  See
+ * LICENSE for details.
+ */
+
+#include "tcpflow.h"
+#include "capture_tpacket.h"
+#include "packet_batch.h"
+
+#ifdef HAVE_TPACKET_V3
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <net/if.h>
+#include <net/if_arp.h>
+#include <linux/if_ether.h>
+#include <poll.h>
+#endif
+
+/* static */ bool     tpacket_ring::enabled = false;
+/* static */ uint32_t tpacket_ring::block_size = 1024*1024;
+/* static */ uint32_t tpacket_ring::block_count = 64;
+/* static */ bool     tpacket_ring::busy_poll = false;
+
+/* static */ bool tpacket_ring::available()
+{
+#ifdef HAVE_TPACKET_V3
+    return true;
+#else
+    return false;
+#endif
+}
+
+tpacket_ring::tpacket_ring():
+    idle(0),fd(-1),dlt(0),ring(0),ring_size(0),ring_block_size(0),ring_block_count(0),current(0),stop(0),
+    total_packets(0),total_drops(0),total_freezes(0),vlan_buf()
+{
+}
+
+tpacket_ring::~tpacket_ring()
+{
+    close();
+}
+
+#ifdef HAVE_TPACKET_V3
+
+/* struct sock_fprog from <linux/filter.h>, which can't be included with <pcap.h>.
+ * struct bpf_insn and struct sock_filter have the same layout.
+ */
+struct tpacket_fprog {
+    unsigned short  len;
+    struct bpf_insn *filter;
+};
+
+static int set_error(std::string &error,const char *what)
+{
+    error = std::string(what) + ": " + strerror(errno);
+    return -1;
+}
+
+int tpacket_ring::open(const std::string &device,bool promisc,const std::string &expression,
+                       int block_timeout,std::string &error)
+{
+    close();
+
+    /* Protocol 0 means that nothing is received until bind(), after the filter is in place */
+    fd = socket(AF_PACKET,SOCK_RAW,0);
+    if(fd<0) return set_error(error,"socket(AF_PACKET)");
+
+    int ifindex = if_nametoindex(device.c_str());
+    if(ifindex==0){
+        set_error(error,device.c_str());
+        close();
+        return -1;
+    }
+
+    /* Work out what the frames will look like */
+    struct ifreq ifr;
+    memset(&ifr,0,sizeof(ifr));
+    strncpy(ifr.ifr_name,device.c_str(),sizeof(ifr.ifr_name)-1);
+    if(ioctl(fd,SIOCGIFHWADDR,&ifr)<0){
+        set_error(error,"SIOCGIFHWADDR");
+        close();
+        return -1;
+    }
+    switch(ifr.ifr_hwaddr.sa_family){
+    case ARPHRD_ETHER:
+    case ARPHRD_LOOPBACK:
+        dlt = DLT_EN10MB;
+        break;
+    case ARPHRD_NONE:                   // tun devices
+    case ARPHRD_PPP:
+        dlt = DLT_RAW;
+        break;
+    default:
+        error = ssprintf("link type %d is not supported",(int)ifr.ifr_hwaddr.sa_family);
+        close();
+        return -1;
+    }
+
+    /* Compile the filter for this link type and attach it to the socket */
+    pcap_t *dead = pcap_open_dead(dlt,SNAPLEN);
+    struct bpf_program fcode;
+    if(pcap_compile(dead,&fcode,expression.c_str(),1,0) < 0){
+        error = pcap_geterr(dead);
+        pcap_close(dead);
+        close();
+        return -1;
+    }
+    struct tpacket_fprog prog;
+    prog.len    = fcode.bf_len;
+    prog.filter = (struct bpf_insn *)fcode.bf_insns;
+    int r = setsockopt(fd,SOL_SOCKET,SO_ATTACH_FILTER,&prog,sizeof(prog));
+    pcap_freecode(&fcode);
+    pcap_close(dead);
+    if(r<0){
+        set_error(error,"SO_ATTACH_FILTER");
+        close();
+        return -1;
+    }
+
+    int version = TPACKET_V3;
+    if(setsockopt(fd,SOL_PACKET,PACKET_VERSION,&version,sizeof(version))<0){
+        set_error(error,"PACKET_VERSION");
+        close();
+        return -1;
+    }
+
+    /* Blocks must be a whole number of pages */
+    size_t page = getpagesize();
+    ring_block_size  = (uint32_t)(((block_size ? block_size : 1) + page - 1) / page * page);
+    ring_block_count = block_count ? block_count : 1;
+    const uint32_t frame_size = TPACKET_ALIGN(TPACKET3_HDRLEN + SNAPLEN);
+
+    struct tpacket_req3 req;
+    memset(&req,0,sizeof(req));
+    req.tp_block_size = ring_block_size;
+    req.tp_block_nr   = ring_block_count;
+    req.tp_frame_size = frame_size < ring_block_size ? frame_size : ring_block_size;
+    req.tp_frame_nr   = (ring_block_size / req.tp_frame_size) * ring_block_count;
+    req.tp_retire_blk_tov = block_timeout>0 ? block_timeout : 1;
+    if(setsockopt(fd,SOL_PACKET,PACKET_RX_RING,&req,sizeof(req))<0){
+        set_error(error,"PACKET_RX_RING");
+        close();
+        return -1;
+    }
+
+    ring_size = (size_t)ring_block_size * ring_block_count;
+    void *m = mmap(0,ring_size,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_LOCKED,fd,0);
+    if(m==MAP_FAILED){
+        m = mmap(0,ring_size,PROT_READ|PROT_WRITE,MAP_SHARED,fd,0); // MAP_LOCKED needs RLIMIT_MEMLOCK
+    }
+    if(m==MAP_FAILED){
+        ring = 0;
+        set_error(error,"mmap");
+        close();
+        return -1;
+    }
+    ring = (uint8_t *)m;
+    current = 0;
+
+#ifdef SO_BUSY_POLL
+    if(busy_poll){
+        int usecs = 50;
+        if(setsockopt(fd,SOL_SOCKET,SO_BUSY_POLL,&usecs,sizeof(usecs))<0){
+            DEBUG(2)("SO_BUSY_POLL: %s",strerror(errno));
+        }
+    }
+#endif
+
+    struct sockaddr_ll sll;
+    memset(&sll,0,sizeof(sll));
+    sll.sll_family   = AF_PACKET;
+    sll.sll_protocol = htons(ETH_P_ALL);
+    sll.sll_ifindex  = ifindex;
+    if(bind(fd,(struct sockaddr *)&sll,sizeof(sll))<0){
+        set_error(error,"bind");
+        close();
+        return -1;
+    }
+
+    if(promisc){
+        struct packet_mreq mreq;
+        memset(&mreq,0,sizeof(mreq));
+        mreq.mr_ifindex = ifindex;
+        mreq.mr_type    = PACKET_MR_PROMISC;
+        if(setsockopt(fd,SOL_PACKET,PACKET_ADD_MEMBERSHIP,&mreq,sizeof(mreq))<0){
+            DEBUG(1)("%s: cannot enable promiscuous mode: %s",device.c_str(),strerror(errno));
+        }
+    }
+
+    DEBUG(5)("%s: TPACKET_V3 ring of %u blocks of %u bytes",device.c_str(),ring_block_count,ring_block_size);
+    return 0;
+}
+
+int tpacket_ring::join_fanout(int group,std::string &error)
+{
+#ifdef PACKET_FANOUT
+    int mode = PACKET_FANOUT_HASH;
+#ifdef PACKET_FANOUT_FLAG_DEFRAG
+    mode |= PACKET_FANOUT_FLAG_DEFRAG;  // so that all fragments of a packet go to the same socket
+#endif
+    int arg = (group & 0xffff) | (mode << 16);
+    if(setsockopt(fd,SOL_PACKET,PACKET_FANOUT,&arg,sizeof(arg))<0){
+        return set_error(error,"PACKET_FANOUT");
+    }
+    return 0;
+#else
+    error = "PACKET_FANOUT is not available on this system";
+    return -1;
+#endif
+}
+
+/*
+ * Hand every packet in a block to the handler.
+ */
+void tpacket_ring::process_block(void *block,pcap_handler handler,u_char *user)
+{
+    struct tpacket_block_desc *bd = (struct tpacket_block_desc *)block;
+    uint32_t num_pkts = bd->hdr.bh1.num_pkts;
+    const uint8_t *next = (const uint8_t *)block + bd->hdr.bh1.offset_to_first_pkt;
+    packet_batch::scope batch;              // the block is ours until we return
+
+    for(uint32_t i=0;i<num_pkts;i++){
+        const struct tpacket3_hdr *ph = (const struct tpacket3_hdr *)next;
+        const u_char *frame = (const u_char *)ph + ph->tp_mac;
+        struct pcap_pkthdr h;
+        h.ts.tv_sec  = ph->tp_sec;
+        h.ts.tv_usec = ph->tp_nsec / 1000;
+        h.caplen     = ph->tp_snaplen;
+        h.len        = ph->tp_len;
+
+        /* The kernel takes the 802.1Q tag out of the frame; put it back as libpcap does */
+        bool retagged = false;
+        if((ph->tp_status & TP_STATUS_VLAN_VALID) && dlt==DLT_EN10MB && h.caplen >= 2*ETH_ALEN){
+            uint16_t tpid = ETH_P_8021Q;
+#ifdef TP_STATUS_VLAN_TPID_VALID
+            if(ph->tp_status & TP_STATUS_VLAN_TPID_VALID) tpid = ph->hv1.tp_vlan_tpid;
+#endif
+            uint16_t tci = ph->hv1.tp_vlan_tci;
+            vlan_buf.resize(h.caplen + 4);
+            memcpy(&vlan_buf[0],frame,2*ETH_ALEN);
+            vlan_buf[2*ETH_ALEN+0] = tpid >> 8;
+            vlan_buf[2*ETH_ALEN+1] = tpid & 0xff;
+            vlan_buf[2*ETH_ALEN+2] = tci >> 8;
+            vlan_buf[2*ETH_ALEN+3] = tci & 0xff;
+            memcpy(&vlan_buf[2*ETH_ALEN+4],frame+2*ETH_ALEN,h.caplen-2*ETH_ALEN);
+            frame = &vlan_buf[0];
+            retagged = true;
+            h.caplen += 4;
+            h.len    += 4;
+        }
+
+        (*handler)(user,&h,frame);
+        if(retagged) packet_batch::flush(); // vlan_buf is used again for the next one
+        next += ph->tp_next_offset;
+    }
+}
+
+int tpacket_ring::loop(pcap_handler handler,u_char *user)
+{
+    if(ring==0) return -1;
+    stop = 0;
+    while(!stop){
+        struct tpacket_block_desc *bd = (struct tpacket_block_desc *)(ring + (size_t)current * ring_block_size);
+        if((__atomic_load_n(&bd->hdr.bh1.block_status,__ATOMIC_ACQUIRE) & TP_STATUS_USER)==0){
+            if(busy_poll) continue;
+            struct pollfd pfd;
+            pfd.fd      = fd;
+            pfd.events  = POLLIN | POLLERR;
+            pfd.revents = 0;
+            int n = poll(&pfd,1,100);   // wake up now and then to notice breakloop()
+            if(n<0 && errno!=EINTR){
+                DEBUG(1)("poll: %s",strerror(errno));
+                return -1;
+            }
+            if(n==0 && idle) (*idle)(user);
+            continue;
+        }
+        process_block(bd,handler,user);
+        __atomic_store_n(&bd->hdr.bh1.block_status,(uint32_t)TP_STATUS_KERNEL,__ATOMIC_RELEASE);
+        current = (current+1) % ring_block_count;
+    }
+    return 0;
+}
+
+void tpacket_ring::stats(uint64_t &packets,uint64_t &drops,uint64_t &freeze_count)
+{
+    if(fd>=0){
+        /* The kernel resets the counters each time they are read */
+        struct tpacket_stats_v3 st;
+        socklen_t len = sizeof(st);
+        memset(&st,0,sizeof(st));
+        if(getsockopt(fd,SOL_PACKET,PACKET_STATISTICS,&st,&len)==0){
+            total_packets += st.tp_packets;
+            total_drops   += st.tp_drops;
+            total_freezes += st.tp_freeze_q_cnt;
+        }
+    }
+    packets      = total_packets;
+    drops        = total_drops;
+    freeze_count = total_freezes;
+}
+
+void tpacket_ring::close()
+{
+    if(ring){
+        munmap(ring,ring_size);
+        ring = 0;
+    }
+    if(fd>=0){
+        ::close(fd);
+        fd = -1;
+    }
+}
+
+#else
+
+int tpacket_ring::open(const std::string &device,bool promisc,const std::string &expression,
+                       int block_timeout,std::string &error)
+{
+    error = "TPACKET_V3 is not available on this system";
+    return -1;
+}
+
+int tpacket_ring::join_fanout(int group,std::string &error)
+{
+    error = "PACKET_FANOUT is not available on this system";
+    return -1;
+}
+
+int tpacket_ring::loop(pcap_handler handler,u_char *user)
+{
+    return -1;
+}
+
+void tpacket_ring::stats(uint64_t &packets,uint64_t &drops,uint64_t &freeze_count)
+{
+    packets = drops = freeze_count = 0;
+}
+
+void tpacket_ring::close()
+{
+}
+
+/* unused */
+void tpacket_ring::process_block(void *block,pcap_handler handler,u_char *user)
+{
+}
+
+#endif
@@ -0,0 +1,84 @@
+/*
+ * capture_tpacket.h:
+ *
+ * Live capture from a Linux AF_PACKET TPACKET_V3 ring.
+ *
+ * The kernel fills blocks of packets in a ring that is mmap'ed into our
+ * address space; packets are handed to the datalink handlers (see
+ * find_handler()) straight from the ring, one block at a time, and the
+ * block is given back to the kernel when all of its packets are done.
+ *
+ * This source code is under the GNU Public License (GPL).  See
+ * LICENSE for details.
+ */
+
+#ifndef CAPTURE_TPACKET_H
+#define CAPTURE_TPACKET_H
+
+#include "tcpflow.h"
+
+#include <string>
+#include <vector>
+#include <signal.h>
+
+#ifdef HAVE_LINUX_IF_PACKET_H
+#include <linux/if_packet.h>
+#endif
+
+#if defined(HAVE_LINUX_IF_PACKET_H) && defined(TPACKET3_HDRLEN)
+#define HAVE_TPACKET_V3
+#endif
+
+class tpacket_ring {
+    tpacket_ring(const tpacket_ring &);
+    tpacket_ring &operator=(const tpacket_ring &);
+
+public:
+    /* Tuning; set with -S */
+    static bool     enabled;                // use the ring for live capture, instead of libpcap
+    static uint32_t block_size;             // bytes per block; rounded up to a whole number of pages
+    static uint32_t block_count;            // blocks in the ring
+    static bool     busy_poll;              // spin on the ring instead of sleeping in poll()
+
+    static bool available();                // was TPACKET_V3 support compiled in?
+
+    tpacket_ring();
+    ~tpacket_ring();
+
+    /* Open device, compile and attach expression, and set up the ring.
+     * block_timeout is how long (ms) the kernel waits before handing us a partly filled block.
+     * Returns 0 on success or -1 with error set; the caller can then fall back to libpcap.
+     */
+    int  open(const std::string &device,bool promisc,const std::string &expression,
+              int block_timeout,std::string &error);
+    int  datalink() const { return dlt; }
+    /* Join PACKET_FANOUT group; the kernel then spreads flows over the group's sockets
+     * by a hash that is the same for both directions. Call after open().
+     */
+    int  join_fanout(int group,std::string &error);
+    int  loop(pcap_handler handler,u_char *user); // until breakloop(); 0 on success, -1 on error
+    void breakloop() { stop = 1; }          // safe to call from a signal handler
+    void close();
+    void (*idle)(u_char *user);             // if set, called by loop() with user when poll() finds no packets
+
+    /* Totals from PACKET_STATISTICS since open() */
+    void stats(uint64_t &packets,uint64_t &drops,uint64_t &freeze_count);
+
+private:
+    void process_block(void *block,pcap_handler handler,u_char *user);
+
+    int      fd;
+    int      dlt;
+    uint8_t  *ring;                         // mmap'ed ring of block_count blocks
+    size_t   ring_size;
+    uint32_t ring_block_size;
+    uint32_t ring_block_count;
+    uint32_t current;                       // next block to look at
+    volatile sig_atomic_t stop;
+    uint64_t total_packets;
+    uint64_t total_drops;
+    uint64_t total_freezes;
+    std::vector<u_char> vlan_buf;           // for frames whose VLAN tag the kernel took out
+};
+
+#endif
@@ -0,0 +1,178 @@
+/**
+ *
+ * cmd_pool.cpp
+ * Long-lived tcp_cmd workers. See cmd_pool.h
+ *
+ * This source code is under the GNU Public License (GPL).  See
+ * LICENSE for details.
+ *
+ */
+
+#include "tcpflow.h"
+#include "tcpip.h"
+#include "cmd_pool.h"
+
+#include <sstream>
+#include <iomanip>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <poll.h>
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0                  // a worker that is gone may raise SIGPIPE instead
+#endif
+
+/* static */ uint32_t cmd_pool::workers   = 0;
+/* static */ uint32_t cmd_pool::queue_max = 64;
+
+cmd_pool::cmd_pool(const std::string &cmd):w(workers),M(),send_M(),answered(),reaper(),sent(0),waited(0)
+{
+    if(queue_max<1) queue_max = 1;
+    DEBUG(1)("starting %u tcp_cmd workers: %s",workers,cmd.c_str());
+    for(size_t i=0;i<w.size();i++){
+        int sv[2];
+        if(socketpair(AF_UNIX,SOCK_STREAM,0,sv)<0){
+            DEBUG(1)("tcp_cmd worker: socketpair: %s",strerror(errno));
+            continue;
+        }
+        fcntl(sv[0],F_SETFD,FD_CLOEXEC); // not inherited by the other workers
+#ifdef HAVE_FORK
+        pid_t pid = fork();
+        if(pid<0) die("Cannot fork child");
+        if(pid==0){
+            /* We are the child */
+            dup2(sv[1],0);
+            dup2(sv[1],1);
+            if(sv[1]>1) close(sv[1]);
+            execl("/bin/sh","sh","-c",cmd.c_str(),(char *)0);
+            _exit(127);
+        }
+        close(sv[1]);
+        w[i].pid   = pid;
+        w[i].fd    = sv[0];
+        w[i].alive = true;
+#else
+        close(sv[0]);
+        close(sv[1]);
+#endif
+    }
+    reaper = std::thread(&cmd_pool::run,this);
+}
+
+cmd_pool::~cmd_pool()
+{
+    {
+        std::lock_guard<std::mutex> lock(M);
+        for(size_t i=0;i<w.size();i++){
+            if(w[i].alive) shutdown(w[i].fd,SHUT_WR); // the worker sees the end of its input
+        }
+    }
+    reaper.join();                      // once every worker has closed its output
+    for(size_t i=0;i<w.size();i++){
+        if(w[i].fd>=0) close(w[i].fd);
+        if(w[i].pid>0){
+            int status = 0;
+            waitpid(w[i].pid,&status,0);
+        }
+    }
+    DEBUG(2)("tcp_cmd workers: %" PRIu64 " flows sent, waited %" PRIu64 " times for an answer",sent,waited);
+}
+
+/* static */ std::string cmd_pool::describe(const tcpip &tcp)
+{
+    const flow &f = tcp.myflow;
+    std::stringstream ss;
+    ss << tcp.flow_pathname << '\t' << tcp.last_byte << '\t' << f.packet_count << '\t'
+       << ipaddr_prn(f.src,f.family) << '\t' << f.sport << '\t'
+       << ipaddr_prn(f.dst,f.family) << '\t' << f.dport << '\t'
+       << f.tstart.tv_sec << '.' << std::setw(6) << std::setfill('0') << f.tstart.tv_usec << '\t'
+       << f.tlast.tv_sec  << '.' << std::setw(6) << std::setfill('0') << f.tlast.tv_usec  << '\n';
+    return ss.str();
+}
+
+bool cmd_pool::submit(const std::string &line)
+{
+    size_t best = 0;
+    {
+        std::unique_lock<std::mutex> lock(M);
+        while(true){
+            bool any = false;
+            for(size_t i=0;i<w.size();i++){
+                if(!w[i].alive) continue;
+                if(!any || w[i].in_flight < w[best].in_flight) best = i;
+                any = true;
+            }
+            if(!any) return false;
+            if(w[best].in_flight < queue_max) break;
+            waited++;
+            answered.wait(lock);
+        }
+        w[best].in_flight++;
+        sent++;
+    }
+    /* M is not held, so that the reaper can take answers while a worker is slow to read */
+    std::lock_guard<std::mutex> slock(send_M);
+    const char *p = line.data();
+    size_t left = line.size();
+    while(left>0){
+        ssize_t n = send(w[best].fd,p,left,MSG_NOSIGNAL);
+        if(n<0 && errno==EINTR) continue;
+        if(n<=0){
+            DEBUG(1)("tcp_cmd worker %d: %s",(int)w[best].pid,strerror(errno));
+            std::lock_guard<std::mutex> lock(M);
+            w[best].alive = false;
+            w[best].in_flight = 0;
+            answered.notify_all();
+            return false;
+        }
+        p += n;
+        left -= n;
+    }
+    return true;
+}
+
+void cmd_pool::run()
+{
+    std::vector<struct pollfd> pfd;
+    std::vector<size_t> which;          // the worker of each pfd
+    char buf[4096];
+    while(true){
+        pfd.clear();
+        which.clear();
+        {
+            std::lock_guard<std::mutex> lock(M);
+            for(size_t i=0;i<w.size();i++){
+                if(!w[i].alive) continue;
+                struct pollfd p;
+                p.fd = w[i].fd;
+                p.events = POLLIN;
+                p.revents = 0;
+                pfd.push_back(p);
+                which.push_back(i);
+            }
+        }
+        if(pfd.empty()) break;          // every worker has exited or closed its output
+        if(poll(&pfd[0],pfd.size(),-1)<0){
+            if(errno==EINTR) continue;
+            DEBUG(1)("tcp_cmd workers: poll: %s",strerror(errno));
+            break;
+        }
+        for(size_t j=0;j<pfd.size();j++){
+            if(pfd[j].revents==0) continue;
+            ssize_t n = recv(pfd[j].fd,buf,sizeof(buf),0);
+            if(n<0 && errno==EINTR) continue;
+            std::lock_guard<std::mutex> lock(M);
+            worker &wk = w[which[j]];
+            if(n<=0){
+                if(wk.in_flight>0) DEBUG(1)("tcp_cmd worker %d exited with %u flows unanswered",(int)wk.pid,wk.in_flight);
+                wk.alive = false;
+                wk.in_flight = 0;
+            } else {
+                for(ssize_t k=0;k<n;k++){
+                    if(buf[k]=='\n' && wk.in_flight>0) wk.in_flight--;
+                }
+            }
+            answered.notify_all();
+        }
+    }
+}
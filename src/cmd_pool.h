@@ -0,0 +1,73 @@
+#ifndef CMD_POOL_H
+#define CMD_POOL_H
+
+/**
+ * cmd_pool.h
+ *
+ * Long-lived -S tcp_cmd processes, with -S tcp_cmd_workers=N.
+ *
+ * Without it, post_process() forks a shell for the command on each
+ * finished flow and waits for one to exit when tcp_subproc_max are
+ * running. With it, N copies of the command are started once, each with
+ * its standard input and output connected to a socket, and every
+ * finished flow is sent to the worker with the fewest flows outstanding,
+ * as one line:
+ *
+ *   path TAB bytes TAB packets TAB src_ip TAB src_port TAB dst_ip TAB dst_port TAB start TAB end
+ *
+ * (the times are seconds since the epoch, with microseconds). The
+ * command answers each line with a line of its own when it is done with
+ * the flow; a reaper thread reads the answers, so the packet thread only
+ * waits when every worker has -S tcp_cmd_queue flows outstanding. At the
+ * end their input is closed, and tcpflow waits for them to exit.
+ *
+ * A worker that exits early is not restarted; when none are left, flows
+ * are given to a forked shell as before.
+ *
+ * This source code is under the GNU Public License (GPL).  See
+ * LICENSE for details.
+ */
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+class cmd_pool {
+public:
+    static uint32_t workers;            // -S tcp_cmd_workers; 0 forks a shell for each flow
+    static uint32_t queue_max;          // -S tcp_cmd_queue: flows a worker can have unanswered
+
+    explicit cmd_pool(const std::string &cmd); // starts workers copies of cmd
+    virtual ~cmd_pool();                // closes their input, reads the last answers and waits for them
+
+    static std::string describe(const class tcpip &tcp); // the line for a finished flow
+    bool submit(const std::string &line); // false if no worker is left
+
+private:
+    cmd_pool(const cmd_pool &);
+    cmd_pool &operator=(const cmd_pool &);
+
+    struct worker {
+        worker():pid(-1),fd(-1),in_flight(0),alive(false){}
+        pid_t    pid;
+        int      fd;                    // our end of the socket
+        uint32_t in_flight;             // lines sent and not answered
+        bool     alive;
+    };
+
+    std::vector<worker>      w;
+    std::mutex               M;         // protects w and the counts
+    std::mutex               send_M;    // one line at a time on the sockets
+    std::condition_variable  answered;  // signaled when in_flight goes down or a worker goes
+    std::thread              reaper;
+    uint64_t                 sent;
+    uint64_t                 waited;    // times submit() waited for an answer
+
+    void run();                         // reaper thread body
+};
+
+#endif
@@ -0,0 +1,167 @@
+/**
+ * console_output.cpp
+ *
+ * Rendering and writing the -c and -C console output; see console_output.h
+ *
+ * This source code is under the GNU Public License (GPL).  See
+ * LICENSE for details.
+ */
+
+#include "tcpflow.h"
+#include "console_output.h"
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/* static */ uint32_t console_output::buffer_size = 0;
+/* static */ std::mutex  console_output::M;
+/* static */ std::string console_output::pending;
+
+/* What each byte becomes with -s: itself if it is printable, a newline or a return, '.' otherwise */
+class strip_table {
+public:
+    char c[256];
+    strip_table() {
+        for(int i=0;i<256;i++){
+            c[i] = (i>=' ' && i<='~') || i=='\n' || i=='\r' ? (char)i : '.';
+        }
+    }
+};
+static const strip_table strip;
+
+/* The two hex digits of each byte */
+class hex_table {
+public:
+    char c[256][2];
+    hex_table() {
+        static const char digits[] = "0123456789abcdef";
+        for(int i=0;i<256;i++){
+            c[i][0] = digits[i>>4];
+            c[i][1] = digits[i&0x0f];
+        }
+    }
+};
+static const hex_table hex;
+
+void console_output::append_stripped(std::string &out,const uint8_t *data,size_t length)
+{
+    size_t start = out.size();
+    out.resize(start+length);
+    char *dst = &out[start];
+    size_t i = 0;
+#if defined(__AVX2__)
+    /* bytes are compared as signed, so each is moved by 0x80 first: ' '..'~' becomes -96..-2 */
+    const __m256i bias = _mm256_set1_epi8((char)0x80);
+    const __m256i lo   = _mm256_set1_epi8((char)(' '^0x80));
+    const __m256i hi   = _mm256_set1_epi8((char)('~'^0x80));
+    for(;i+32<=length;i+=32){
+        __m256i v = _mm256_loadu_si256((const __m256i *)(data+i));
+        __m256i t = _mm256_xor_si256(v,bias);
+        __m256i bad = _mm256_or_si256(_mm256_cmpgt_epi8(lo,t),_mm256_cmpgt_epi8(t,hi));
+        _mm256_storeu_si256((__m256i *)(dst+i),v);
+        if(_mm256_movemask_epi8(bad)){
+            for(size_t j=i;j<i+32;j++) dst[j] = strip.c[data[j]];
+        }
+    }
+#elif defined(__SSE2__)
+    const __m128i bias = _mm_set1_epi8((char)0x80);
+    const __m128i lo   = _mm_set1_epi8((char)(' '^0x80));
+    const __m128i hi   = _mm_set1_epi8((char)('~'^0x80));
+    for(;i+16<=length;i+=16){
+        __m128i v = _mm_loadu_si128((const __m128i *)(data+i));
+        __m128i t = _mm_xor_si128(v,bias);
+        __m128i bad = _mm_or_si128(_mm_cmplt_epi8(t,lo),_mm_cmpgt_epi8(t,hi));
+        _mm_storeu_si128((__m128i *)(dst+i),v);
+        if(_mm_movemask_epi8(bad)){
+            for(size_t j=i;j<i+16;j++) dst[j] = strip.c[data[j]];
+        }
+    }
+#endif
+    for(;i<length;i++) dst[i] = strip.c[data[i]];
+}
+
+/* 32 bytes a line: the offset, the bytes in hex in pairs, and the bytes as -s prints them.
+ * The last line is padded so that its text lines up with the others.
+ */
+void console_output::append_hex(std::string &out,const uint8_t *data,size_t length)
+{
+    const size_t bytes_per_line = 32;
+    size_t max_spaces = 0;
+    for(size_t i=0;i<length;i+=bytes_per_line){
+        size_t line_start = out.size();
+        char b[32];
+        int count = snprintf(b,sizeof(b),"%04x: ",(unsigned int)i);
+        out.append(b,count);
+        size_t n = length-i < bytes_per_line ? length-i : bytes_per_line;
+        for(size_t j=0;j<n;j++){
+            out.append(hex.c[data[i+j]],2);
+            if(j%2==1) out += ' ';
+        }
+        size_t spaces = out.size()-line_start;
+        if(spaces>max_spaces) max_spaces = spaces;
+        out.append(max_spaces-spaces+1,' ');
+        for(size_t j=0;j<n;j++){
+            uint8_t ch = data[i+j];
+            out += ch>=' ' && ch<='~' ? (char)ch : '.';
+        }
+        out += '\n';
+    }
+}
+
+void console_output::write_out(const char *buf,size_t length)
+{
+#ifdef HAVE_PTHREAD
+    if(semlock){
+        if(sem_wait(semlock)){
+            fprintf(stderr,"%s: attempt to acquire semaphore failed: %s\n",progname,strerror(errno));
+            exit(1);
+        }
+    }
+#endif
+    fflush(stdout);                     // anything printed through stdio goes first
+    while(length>0){
+        ssize_t w = ::write(fileno(stdout),buf,length);
+        if(w<0 && errno==EINTR) continue;
+        if(w<=0){
+            std::cerr << "\nwrite error to stdout: " << strerror(errno) << "\n";
+            exit(1);
+        }
+        buf += w;
+        length -= w;
+    }
+#ifdef HAVE_PTHREAD
+    if(semlock){
+        if(sem_post(semlock)){
+            fprintf(stderr,"%s: attempt to post semaphore failed: %s\n",progname,strerror(errno));
+            exit(1);
+        }
+    }
+#endif
+}
+
+void console_output::write(const std::string &segment)
+{
+    if(buffer_size==0){
+        write_out(segment.data(),segment.size());
+        return;
+    }
+    std::lock_guard<std::mutex> lock(M);
+    pending += segment;
+    if(pending.size() >= buffer_size) flush_locked();
+}
+
+void console_output::flush()
+{
+    std::lock_guard<std::mutex> lock(M);
+    flush_locked();
+}
+
+void console_output::flush_locked()
+{
+    if(pending.size()==0) return;
+    write_out(pending.data(),pending.size());
+    pending.clear();
+}
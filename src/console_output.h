@@ -0,0 +1,52 @@
+#ifndef CONSOLE_OUTPUT_H
+#define CONSOLE_OUTPUT_H
+
+/**
+ * console_output.h
+ *
+ * What -c and -C print for each segment: the flow name, then the data as
+ * it is, with the non-printable bytes changed to '.' (-s), in hex (-D), or
+ * as JSON (-J), and the color codes of -g.
+ *
+ * Each segment is rendered into a buffer and written to stdout with one
+ * write(), instead of through stdio a byte at a time. -s is done 16 (or,
+ * when built with AVX2, 32) bytes at a time: a run of printable bytes is
+ * copied as it is, and only a block with something else in it goes
+ * through the table. -D takes its hex digits from a table. The -L
+ * semaphore is held only for the write.
+ *
+ * With -S console_buffer=bytes, segments are kept until that many bytes
+ * are waiting and written together, which is faster when stdout is a
+ * pipe; flush() writes what is left when tcpflow stops. The segments of
+ * --parallel-inputs=independent come from several threads, so the buffer
+ * has a lock.
+ *
+ * This source code is under the GNU Public License (GPL).  See
+ * LICENSE for details.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+#include <mutex>
+
+class console_output {
+public:
+    static uint32_t buffer_size;        // -S console_buffer; 0 writes each segment at once
+
+    /* Render the segment data into out, as -s, -D and the plain console output do */
+    static void append_stripped(std::string &out,const uint8_t *data,size_t length);
+    static void append_hex(std::string &out,const uint8_t *data,size_t length);
+
+    /* Add a rendered segment; it is written now, or with -S console_buffer when enough are waiting */
+    static void write(const std::string &segment);
+    static void flush();                // write whatever is waiting
+
+private:
+    static std::mutex  M;               // protects pending
+    static std::string pending;
+    static void flush_locked();
+    static void write_out(const char *buf,size_t length);
+};
+
+#endif
@@ -10,7 +10,8 @@
  *
  * This file contains datalink handlers which are called by the pcap callback.
  * The purpose of each handler is to make a packet_info() object and then call
- * process_packet. The packet_info() object contains both the original
+ * process_packet (through packet_batch::deliver, which may hold it for a few
+ * packets). The packet_info() object contains both the original
  * MAC-layer (with some of the fields broken out) and the packet data layer.
  *
  * For wifi datalink handlers, please see datalink_wifi.cpp
@@ -18,6 +19,8 @@
 
 #include <stddef.h>
 #include "tcpflow.h"
+#include "packet_batch.h"
+#include "metrics.h"
 
 /* The DLT_NULL packet header is 4 bytes long. It contains a network
  * order 32 bit integer that specifies the family, e.g. AF_INET.
@@ -41,12 +44,65 @@
 
 int32_t datalink_tdelta = 0;
 
+/* The handlers check a frame's lengths before they look at it, and give up
+ * on one that is too short or not IP with a status rather than by letting
+ * something throw: a mirror port can deliver runts and garbage in bursts,
+ * and each of them then costs a few compares and a counter (bad_frames in
+ * -S metrics_file) instead of an exception.
+ */
+enum dl_status { DL_OK, DL_SHORT, DL_NOT_IP };
+
+static inline uint16_t get16(const u_char *p)   // network order, at any alignment
+{
+    return (uint16_t)((p[0]<<8) | p[1]);
+}
+
+static inline bool is_vlan(uint16_t type)
+{
+    return type==ETHERTYPE_VLAN || type==ETH_P_QINQ1 || type==ETH_P_8021AD;
+}
+
+/* Ethernet with up to two VLAN tags taken without a loop; more than that is
+ * rare enough for one. On DL_OK *data is the IP packet and *datalen its
+ * length; *type is the ether type after the tags, whatever the status.
+ */
+static inline dl_status parse_ethernet(const u_char *p,u_int caplen,
+                                       const u_char **data,u_int *datalen,uint16_t *type)
+{
+    u_int off = offsetof(struct be13::ether_header, ether_type);
+    *type = 0;
+    if (__builtin_expect(caplen < sizeof(struct be13::ether_header),0)) return DL_SHORT;
+    *type = get16(p+off);
+    if (is_vlan(*type)) {
+        if (caplen < off + 4 + 2) return DL_SHORT;
+        off += 4;
+        *type = get16(p+off);
+        if (is_vlan(*type)) {           /* QinQ */
+            if (caplen < off + 4 + 2) return DL_SHORT;
+            off += 4;
+            *type = get16(p+off);
+            while (is_vlan(*type)) {
+                if (caplen < off + 4 + 2) return DL_SHORT;
+                off += 4;
+                *type = get16(p+off);
+            }
+        }
+    }
+    *data    = p + off + 2;
+    *datalen = caplen - (off + 2);
+    return (*type==ETHERTYPE_IP || *type==ETHERTYPE_IPV6) ? DL_OK : DL_NOT_IP;
+}
+
+static inline void bad_frame()
+{
+    metrics::event(metrics::BAD_FRAMES);
+}
+
 #pragma GCC diagnostic ignored "-Wcast-align"
 void dl_null(u_char *user, const struct pcap_pkthdr *h, const u_char *p)
 {
     u_int caplen = h->caplen;
     u_int length = h->len;
-    uint32_t family = (uint32_t)*p;
 
     if (length != caplen) {
 	DEBUG(6) ("warning: only captured %d bytes of %d byte null frame",
@@ -55,8 +111,10 @@ void dl_null(u_char *user, const struct pcap_pkthdr *h, const u_char *p)
 
     if (caplen < NULL_HDRLEN) {
 	DEBUG(6) ("warning: received incomplete null frame");
+	bad_frame();
 	return;
     }
+    uint32_t family = (uint32_t)*p;
 
     /* make sure this is AF_INET */
     if (family != AF_INET && family != AF_INET6) {
@@ -66,7 +124,7 @@ void dl_null(u_char *user, const struct pcap_pkthdr *h, const u_char *p)
     }
     struct timeval tv;
     be13::packet_info pi(DLT_NULL,h,p,tvshift(tv,h->ts),p+NULL_HDRLEN,caplen - NULL_HDRLEN);
-    be13::plugin::process_packet(pi);
+    packet_batch::deliver(pi);
 }
 #pragma GCC diagnostic warning "-Wcast-align"
 
@@ -83,7 +141,7 @@ void dl_raw(u_char *user, const struct pcap_pkthdr *h, const u_char *p)
     struct timeval tv;
     be13::packet_info pi(DLT_RAW,h,p,tvshift(tv,h->ts),p, h->caplen);
     counter++;
-    be13::plugin::process_packet(pi);
+    packet_batch::deliver(pi);
 }
 
 /* Ethernet datalink handler; used by all 10 and 100 mbit/sec
@@ -95,61 +153,24 @@ void dl_ethernet(u_char *user, const struct pcap_pkthdr *h, const u_char *p)
 {
     u_int caplen = h->caplen;
     u_int length = h->len;
-    struct be13::ether_header *eth_header = (struct be13::ether_header *) p;
-    u_int ether_type_offset = offsetof(struct be13::ether_header, ether_type);
-
-    /* Variables to support VLAN */
-    const u_short *ether_type = NULL;
     const u_char *ether_data = NULL;
-
-    if (caplen < ether_type_offset) {
-        DEBUG(0) ("error: the captured packet header bytes are shorter than the ether_type offset");
-        return;
-    }
-
-    ether_type = &eth_header->ether_type; /* where the ether type is located */
-    ether_data = p+sizeof(struct be13::ether_header); /* where the data is located */
+    u_int ether_datalen = 0;
+    uint16_t ether_type = 0;
 
     if (length != caplen) {
 	DEBUG(6) ("warning: only captured %d bytes of %d byte ether frame",
 		  caplen, length);
     }
 
-    /* Handle basic VLAN packets */
-    while (ntohs(*ether_type) == ETHERTYPE_VLAN
-#ifdef ETH_P_QINQ1
-           || ntohs(*ether_type) == ETH_P_QINQ1
-#endif
-#ifdef ETH_P_8021AD
-           || ntohs(*ether_type) == ETH_P_8021AD
-#endif
-           ) {
-	//vlan = ntohs(*(u_short *)(p+sizeof(struct ether_header)));
-	ether_type += 2;			/* skip past VLAN header (note it skips by 2s) */
-	ether_data += 4;			/* skip past VLAN header */
-	caplen     -= 4;
-        if (caplen < ether_type_offset) {
-            DEBUG(0) ("error: the captured packet header bytes are shorter than the ether_type offset");
-            return;
-        }
-    }
-
-    if (caplen < sizeof(struct be13::ether_header)) {
+    switch (parse_ethernet(p, caplen, &ether_data, &ether_datalen, &ether_type)) {
+    case DL_OK:
+        break;
+    case DL_SHORT:
 	DEBUG(6) ("warning: received incomplete ethernet frame");
-	return;
-    }
-
-    /* Create a packet_info structure with ip data and data length  */
-    try {
-        struct timeval tv;
-        be13::packet_info pi(DLT_IEEE802,h,p,tvshift(tv,h->ts),
-                             ether_data, caplen - sizeof(struct be13::ether_header));
-        switch (ntohs(*ether_type)){
-        case ETHERTYPE_IP:
-        case ETHERTYPE_IPV6:
-            be13::plugin::process_packet(pi);
-            break;
-
+        bad_frame();
+        return;
+    case DL_NOT_IP:
+        switch (ether_type) {
 #ifdef ETHERTYPE_ARP
         case ETHERTYPE_ARP:
             /* What should we do for ARP? */
@@ -167,15 +188,16 @@ void dl_ethernet(u_char *user, const struct pcap_pkthdr *h, const u_char *p)
 #endif
         default:
             /* Unknown Ethernet Frame Type */
-            DEBUG(6) ("warning: received ethernet frame with unknown type 0x%x", ntohs(eth_header->ether_type));
+            DEBUG(6) ("warning: received ethernet frame with unknown type 0x%x", ether_type);
             break;
         }
-    } catch( std::logic_error e){
-        std::string s(std::string("warning: caught std::logic_error ")
-                      + e.what()
-                      + std::string(" in packet"));
-        DEBUG(6)(s.c_str());
+        return;
     }
+
+    /* The frame is whole up to its IP data, so packet_info has nothing to throw about */
+    struct timeval tv;
+    be13::packet_info pi(DLT_IEEE802,h,p,tvshift(tv,h->ts),ether_data,ether_datalen);
+    packet_batch::deliver(pi);
 }
 
 #pragma GCC diagnostic warning "-Wcast-align"
@@ -198,12 +220,13 @@ void dl_ppp(u_char *user, const struct pcap_pkthdr *h, const u_char *p)
 
     if (caplen < PPP_HDRLEN) {
 	DEBUG(6) ("warning: received incomplete PPP frame");
+	bad_frame();
 	return;
     }
 
     struct timeval tv;
     be13::packet_info pi(DLT_PPP,h,p,tvshift(tv,h->ts),p + PPP_HDRLEN, caplen - PPP_HDRLEN);
-    be13::plugin::process_packet(pi);
+    packet_batch::deliver(pi);
 }
 
 
@@ -232,6 +255,7 @@ void dl_linux_sll(u_char *user, const struct pcap_pkthdr *h, const u_char *p)
 
     if (caplen < SLL_HDR_LEN) {
 	DEBUG(6) ("warning: received incomplete Linux cooked frame");
+	bad_frame();
 	return;
     }
 
@@ -250,6 +274,7 @@ void dl_linux_sll(u_char *user, const struct pcap_pkthdr *h, const u_char *p)
         do {
             if(caplen < SLL_HDR_LEN + mpls_sz + 4){
                 DEBUG(6) ("warning: MPLS stack overrun");
+                bad_frame();
                 return;
             }
             mpls_sz += 4;
@@ -259,7 +284,7 @@ void dl_linux_sll(u_char *user, const struct pcap_pkthdr *h, const u_char *p)
 
     struct timeval tv;
     be13::packet_info pi(DLT_LINUX_SLL,h,p,tvshift(tv,h->ts),p + SLL_HDR_LEN + mpls_sz, caplen - SLL_HDR_LEN);
-    be13::plugin::process_packet(pi);
+    packet_batch::deliver(pi);
 }
 #endif
 
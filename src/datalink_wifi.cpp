@@ -6,16 +6,16 @@
 
 #include "tcpflow.h"
 #include "datalink_wifi.h"
+#include "metrics.h"
+#include "tracer.h"
 
 /**
  * TFCB --- TCPFLOW callbacks for wifippcap
  */
 
-void TFCB::Handle80211(const WifiPacket &p, u_int16_t fc, const MAC& sa, const MAC& da, const MAC& ra, const MAC& ta, const u_char *ptr, size_t len)
-{
-}
-
 void TFCB::HandleLLC(const WifiPacket &p, const struct llc_hdr_t *hdr, const u_char *rest, size_t len) {
+    metrics::count(metrics::DATALINK,p.header->caplen);
+    tracer::event(trace_record::DATALINK,p.header->caplen,p.header_type);
     sbuf_t sb(pos0_t(),rest,len,len,0,false,false,false);
     struct timeval tv;
     be13::packet_info pi(p.header_type,p.header,p.packet,tvshift(tv,p.header->ts),rest,len);
@@ -27,8 +27,27 @@ void TFCB::Handle80211MgmtBeacon(const WifiPacket &p, const mgmt_header_t *hdr,
 #ifdef DEBUG_WIFI
     std::cerr << "  " << "802.11 mgmt: " << hdr->sa << " beacon " << body->ssid.ssid << "\"";
 #endif
-    mac_ssid bcn(hdr->sa,std::string(body->ssid.ssid));
-    mac_to_ssid[bcn] += 1;
+    std::unordered_map<std::string,uint32_t>::const_iterator id = ssid_ids.find(body->ssid.ssid);
+    ap_key key;
+    key.mac = hdr->sa.val;
+    key.ssid = id!=ssid_ids.end() ? id->second : ssids.size();
+    ap_map_t::iterator it = aps.find(key);
+    if(it==aps.end()){
+        if(max_aps>0 && aps.size()>=max_aps){
+            dropped_beacons++;
+            return;
+        }
+        if(id==ssid_ids.end()){
+            ssid_ids[body->ssid.ssid] = key.ssid;
+            ssids.push_back(body->ssid.ssid);
+        }
+        ap_info info;
+        info.count = 0;
+        info.first_seen = p.header->ts;
+        it = aps.insert(std::make_pair(key,info)).first;
+    }
+    it->second.count++;
+    it->second.last_seen = p.header->ts;
 }
 
 
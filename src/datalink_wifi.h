@@ -2,45 +2,48 @@
 #define DATALINK_WIFI_H
 
 #include <algorithm>
-#include <map>
+#include <string>
+#include <unordered_map>
+#include <vector>
 #include "wifipcap.h"
 
 //#define DEBUG_WIFI
 
-class TFCB : public WifipcapCallbacks {
+/* Only the layers with callbacks here are decoded; see WifipcapCallbacksFor */
+class TFCB : public WifipcapCallbacksFor<TFCB> {
 private:
 
 public:
     bool opt_check_fcs;
 
-    typedef struct mac_ssid {
-        mac_ssid(const MAC &mac_,const std::string &ssid_):mac(mac_),ssid(ssid_){}
-        const MAC mac;
-        const std::string ssid;
-        bool operator<(const struct mac_ssid &b) const{
-            if (mac < b.mac) return true;
-            if (b.mac < mac) return false;
-            return ssid < b.ssid;
-        };
-    } mac_ssid_t;
-
-    typedef struct {
-        bool operator() (const struct mac_ssid &a, const struct mac_ssid &b) const {
-            if (a.mac < b.mac) return true;
-            if (b.mac < a.mac) return false;
-            return a.ssid < b.ssid;
-        }
-    } mac_ssid_lt;
-    typedef std::set<mac_ssid_t,mac_ssid_lt> mac_ssid_set_t;
-    typedef std::map<mac_ssid_t,uint64_t> mac_ssid_map_t;
-    mac_ssid_map_t mac_to_ssid;        // mapping of macs to SSIDs
+    /* Beacons are counted by the MAC that sent them and the SSID, which is
+     * interned so that a beacon costs one hash of the SSID and one of the key.
+     */
+    struct ap_key {
+        uint64_t mac;
+        uint32_t ssid;                  // index in ssids
+        bool operator==(const ap_key &b) const { return mac==b.mac && ssid==b.ssid; }
+    };
+    struct ap_key_hash {
+        size_t operator()(const ap_key &k) const { return (k.mac * 0x9E3779B97F4A7C15ULL) ^ k.ssid; }
+    };
+    struct ap_info {
+        uint64_t       count;
+        struct timeval first_seen;
+        struct timeval last_seen;
+    };
+    typedef std::unordered_map<ap_key,ap_info,ap_key_hash> ap_map_t;
+    ap_map_t aps;
+    std::vector<std::string> ssids;
+    std::unordered_map<std::string,uint32_t> ssid_ids;
+    uint32_t max_aps;                   // -S wifiviz_max_aps; beacons of any more are only counted
+    uint64_t dropped_beacons;
+    bool     opt_ap_times;              // -S wifiviz_ap_times: report when each was first and last seen
 
     static TFCB   theTFCB;
-    TFCB():opt_check_fcs(true),mac_to_ssid(){}
+    TFCB():opt_check_fcs(true),aps(),ssids(),ssid_ids(),max_aps(100000),dropped_beacons(0),opt_ap_times(false){}
 
     virtual bool Check80211FCS(const WifiPacket &p) { return opt_check_fcs; }  
-    virtual void Handle80211(const WifiPacket &p,u_int16_t fc, const MAC& sa, const MAC& da,
-                             const MAC& ra, const MAC& ta, const u_char *ptr, size_t len)  ;
 
     void HandleLLC(const WifiPacket &p,const struct llc_hdr_t *hdr, const u_char *rest, size_t len) ;
     void Handle80211MgmtBeacon(const WifiPacket &p,const mgmt_header_t *hdr, const mgmt_body_t *body) ;
@@ -0,0 +1,167 @@
+/**
+ *
+ * disk_ring.cpp
+ * Continuous capture in a bounded amount of disk. See disk_ring.h
+ *
+ * This source code is under the GNU Public License (GPL).  See
+ * LICENSE for details.
+ *
+ */
+
+#include "tcpflow.h"
+#include "tcpip.h"
+#include "tcpdemux.h"
+#include "disk_ring.h"
+#include "report_writer.h"
+#include "metrics.h"
+
+#include <vector>
+#include <deque>
+#include <sstream>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+
+/* static */ uint64_t disk_ring::max_bytes = 0;
+
+/* A finished flow: its files, once the thread has found them */
+struct ring_flow {
+    ring_flow():files(),bytes(0){}
+    std::vector<std::string> files;
+    uint64_t bytes;
+};
+
+static std::deque<ring_flow *>  added;     // from add(), not yet looked at; under M
+static std::deque<ring_flow *>  catalogue; // oldest first; only the thread has it until stop() has joined it
+static std::atomic<uint64_t>    held(0);   // bytes in catalogue
+static uint64_t                 kept_flows    = 0;
+static uint64_t                 expired_flows = 0;
+static uint64_t                 expired_bytes = 0;
+static dfxml_writer             *report = 0;
+static std::thread              keeper;
+static std::mutex               M;
+static std::condition_variable  wake;
+static bool                     stopping = false;
+
+/* static */ bool disk_ring::running()
+{
+    return keeper.joinable();
+}
+
+/* static */ void disk_ring::start(dfxml_writer *xreport)
+{
+    report = xreport;
+    metrics::add_gauge("ring_bytes",[]{ return held.load(std::memory_order_relaxed); });
+    keeper = std::thread(&disk_ring::run);
+}
+
+/* static */ void disk_ring::stop()
+{
+    if(!keeper.joinable()) return;
+    {
+        std::lock_guard<std::mutex> lock(M);
+        stopping = true;
+    }
+    wake.notify_all();
+    keeper.join();
+    metrics::remove_gauge("ring_bytes");
+    for(std::deque<ring_flow *>::iterator it=catalogue.begin();it!=catalogue.end();it++) delete *it;
+    catalogue.clear();
+}
+
+/* static */ void disk_ring::add(const flow_report &r,const std::string &xmladd)
+{
+    if(r.flow_pathname.empty()) return;  // no transcript, and so no bodies
+    ring_flow *f = new ring_flow();
+    f->files.push_back(r.flow_pathname);
+    f->files.push_back(r.flow_pathname + (tcpdemux::packet_index_text ? ".findx" : ".findb"));
+    /* the HTTP bodies, as scan_http names them in its <byte_run>s */
+    static const std::string open_tag("<filename>"),close_tag("</filename>");
+    for(size_t p=xmladd.find(open_tag);p!=std::string::npos;p=xmladd.find(open_tag,p)){
+        p += open_tag.size();
+        size_t e = xmladd.find(close_tag,p);
+        if(e==std::string::npos) break;
+        f->files.push_back(xmladd.substr(p,e-p));
+    }
+    {
+        std::lock_guard<std::mutex> lock(M);
+        added.push_back(f);
+    }
+    wake.notify_one();
+}
+
+/* Record that the files of f are gone, after its own record */
+static void expired(const ring_flow &f)
+{
+    report_writer::expiry e;
+    e.path  = f.files[0];
+    e.bytes = f.bytes;
+    gettimeofday(&e.when,0);
+    if(tcpdemux::reports){
+        tcpdemux::reports->expire(e);
+    } else if(report){
+        std::lock_guard<std::mutex> lock(tcpdemux::output_M);
+        report_writer::dump_expired_xml(report,e);
+        report->flush();
+    }
+}
+
+/* static */ void disk_ring::run()
+{
+    std::deque<ring_flow *> batch;
+    while(true){
+        {
+            std::unique_lock<std::mutex> lock(M);
+            while(added.empty() && !stopping) wake.wait(lock);
+            if(added.empty() && stopping) break;
+            batch.swap(added);
+        }
+        for(std::deque<ring_flow *>::iterator it=batch.begin();it!=batch.end();it++){
+            ring_flow *f = *it;
+            std::vector<std::string> present;
+            for(std::vector<std::string>::const_iterator fn=f->files.begin();fn!=f->files.end();fn++){
+                struct stat st;
+                if(stat(fn->c_str(),&st)==0 && S_ISREG(st.st_mode)){
+                    present.push_back(*fn);
+                    f->bytes += st.st_size;
+                }
+            }
+            if(present.empty()){        // nothing was written, or -S http_bodies_only removed it
+                delete f;
+                continue;
+            }
+            if(present[0]!=f->files[0]) present.insert(present.begin(),f->files[0]); // the name it is reported by
+            f->files.swap(present);
+            catalogue.push_back(f);
+            kept_flows++;
+            held += f->bytes;
+        }
+        batch.clear();
+
+        /* the oldest go until the rest fit, but not the last one, which may be bigger than all */
+        while(held.load(std::memory_order_relaxed) > max_bytes && catalogue.size()>1){
+            ring_flow *f = catalogue.front();
+            catalogue.pop_front();
+            for(std::vector<std::string>::const_iterator fn=f->files.begin();fn!=f->files.end();fn++){
+                if(::unlink(fn->c_str()) && errno!=ENOENT){
+                    DEBUG(1)("disk_ring: cannot remove %s: %s",fn->c_str(),strerror(errno));
+                }
+            }
+            held -= f->bytes;
+            expired_flows++;
+            expired_bytes += f->bytes;
+            DEBUG(5)("disk_ring: removed %s (%" PRIu64 " bytes)",f->files[0].c_str(),f->bytes);
+            expired(*f);
+            delete f;
+        }
+    }
+}
+
+/* static */ void disk_ring::dump_xml(dfxml_writer *xreport)
+{
+    std::stringstream attrs;
+    attrs << "max_bytes='" << max_bytes << "' flows='" << kept_flows << "' bytes='" << held.load()
+          << "' expired_flows='" << expired_flows << "' expired_bytes='" << expired_bytes << "'";
+    xreport->xmlout("disk_ring","",attrs.str(),false);
+}
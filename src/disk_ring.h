@@ -0,0 +1,57 @@
+#ifndef DISK_RING_H
+#define DISK_RING_H
+
+/**
+ * disk_ring.h
+ *
+ * Continuous capture in a bounded amount of disk, with -S ring_bytes=N:
+ * once the files of the finished flows add up to more than N bytes, the
+ * files of the flows that finished first are removed.
+ *
+ * tcpdemux::report() gives each finished flow to add(), in the order the
+ * flows are reported, and returns. A thread of its own finds the flow's
+ * files (the transcript, its -I index and the HTTP bodies the report
+ * names), adds up their sizes and keeps them in a catalogue, oldest first;
+ * while the catalogue is over N it unlinks the oldest flow's files, so the
+ * packet thread never waits for the file system.
+ *
+ * A flow whose files were removed is not left in the records as if they
+ * were there: the report gets
+ *
+ *   <expired filename='...' time='...' bytes='...'/>
+ *
+ * (a line {"expired":...} with -S report_format=jsonl), and with -S flow_db
+ * its row has expired set to when. These go through the report_writer,
+ * when there is one, after the flow's own record. <disk_ring> at the end
+ * of the report says how much was kept and how much was removed.
+ *
+ * N bounds the finished flows of this run; the files of the flows still
+ * open, the report and the other files of the run, and the files an
+ * earlier run left, come on top of it. It does nothing with --segments,
+ * whose segment files hold many flows.
+ *
+ * This source code is under the GNU Public License (GPL).  See
+ * LICENSE for details.
+ */
+
+#include <stdint.h>
+#include <string>
+
+class disk_ring {
+public:
+    static uint64_t max_bytes;          // -S ring_bytes; 0 for no ring
+
+    static bool running();
+    static void start(class dfxml_writer *xreport); // where the expired flows go without a report_writer
+    static void stop();                 // after the last add(); removes what is over max_bytes first
+
+    /* A finished flow, as it is reported */
+    static void add(const struct flow_report &r,const std::string &xmladd);
+
+    static void dump_xml(class dfxml_writer *xreport); // <disk_ring>, after stop()
+
+private:
+    static void run();                  // the thread that keeps the catalogue
+};
+
+#endif
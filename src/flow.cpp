@@ -26,7 +26,6 @@
 #include <sstream>
 
 std::string flow::filename_template("%A.%a-%B.%b%V%v%C%c");
-std::string flow::outdir(".");
 
 void flow::usage()
 {
@@ -51,112 +50,190 @@ void flow::usage()
     std::cout << "      Filename template format handles '/' to create sub-directories.\n";
 }
 
+/* static */ std::vector<flow::template_op> flow::template_ops;
+/* static */ std::string flow::compiled_template;
+
+/*
+ * Parse filename_template into template_ops, so that filename() does not
+ * have to for every flow. Called from main() once the options are set.
+ */
+void flow::compile_template()
+{
+    static const std::string directives("AaBbEeNKMGTtVvCcS#");
+    template_ops.clear();
+    std::string literal;
+    for(unsigned int i=0;i<filename_template.size();i++){
+        char ch = filename_template.at(i);
+        if(ch!='%'){
+            literal += ch;
+            continue;
+        }
+        if(i==filename_template.size()-1){
+            std::cerr << "Invalid filename_template: " << filename_template << " cannot end with a %\n";
+            exit(1);
+        }
+        char d = filename_template.at(++i);
+        if(d=='%'){                     // Output a '%'
+            literal += '%';
+            continue;
+        }
+        if(directives.find(d)==std::string::npos){
+            std::cerr << "Invalid filename_template: " << filename_template << "\n";
+            std::cerr << "unknown character: " << d << "\n";
+            exit(1);
+        }
+        if(literal.size()) template_ops.push_back(template_op(0,literal));
+        literal.clear();
+        template_ops.push_back(template_op(d,std::string()));
+    }
+    if(literal.size()) template_ops.push_back(template_op(0,literal));
+    compiled_template = filename_template;
+}
+
+/*
+ * Make the binning directories of the first flows ahead of time, so that
+ * creating a flow's file is only an open(). This is for templates whose
+ * directories depend on nothing but the flow number, like -Fk, -Fm and
+ * -Fg; for others there is nothing that can be known in advance.
+ */
+void flow::precreate_dirs(uint64_t flows)
+{
+    if(compiled_template!=filename_template) compile_template();
+    size_t dir_ops = 0;                 // the ops up to the last '/'
+    for(size_t i=0;i<template_ops.size();i++){
+        if(template_ops[i].directive==0 && template_ops[i].text.find('/')!=std::string::npos) dir_ops = i+1;
+    }
+    uint64_t step = 1000;               // %K changes every 1000 flows
+    for(size_t i=0;i<dir_ops;i++){
+        switch(template_ops[i].directive){
+        case 0: case 'K': case 'M': case 'G': break;
+        case 'N': step = 1; break;
+        default:
+            DEBUG(1)("filename template directories depend on more than the flow number; not creating them ahead");
+            return;
+        }
+    }
+    if(dir_ops==0) return;
+    DEBUG(2)("creating the directories for %" PRIu64 " flows",flows);
+    flow f;
+    size_t roots = tcpdemux::getInstance()->roots.size();
+    for(f.root=0;f.root<roots;f.root++){
+        for(uint64_t id=0;id<flows;id+=step){
+            f.id = id;
+            mkdirs_for_path(f.filename(0,false));
+        }
+    }
+}
+
+/* Fixed-width formatters; each appends to out */
+static void append_decimal(std::string &out,uint64_t v,int width)
+{
+    char buf[24];
+    int n = 0;
+    do {
+        buf[n++] = '0' + (v % 10);
+        v /= 10;
+    } while(v>0 && n<(int)sizeof(buf));
+    while(n<width && n<(int)sizeof(buf)) buf[n++] = '0';
+    while(n>0) out += buf[--n];
+}
+
+static void append_ipv4(std::string &out,const uint8_t *addr)
+{
+    for(int i=0;i<4;i++){
+        if(i) out += '.';
+        append_decimal(out,addr[i],3);
+    }
+}
+
+static void append_mac(std::string &out,const uint8_t *mac)
+{
+    static const char hex[] = "0123456789abcdef";
+    for(int i=0;i<6;i++){
+        if(i) out += ':';
+        out += hex[mac[i]>>4];
+        out += hex[mac[i]&0x0f];
+    }
+}
+
+void flow::append_directive(std::string &out,char directive,uint32_t connection_count) const
+{
+    switch(directive){
+    case 'A': // source IP address
+    case 'B': // dest IP address
+    {
+        const uint8_t *addr = directive=='A' ? src.addr : dst.addr;
+        if(family==AF_INET){
+            append_ipv4(out,addr);
+        } else if(family==AF_INET6){
+            char buf[INET6_ADDRSTRLEN+1];
+            buf[0] = 0;
+            inet_ntop(family,addr,buf,sizeof(buf));
+            out += buf;
+        }
+        break;
+    }
+    case 'a': append_decimal(out,sport,5); break; // source IP port
+    case 'b': append_decimal(out,dport,5); break; // dest IP port
+        /* binning by connection number */
+    case 'E': append_mac(out,mac_saddr); break;
+    case 'e': append_mac(out,mac_daddr); break;
+    case 'N': append_decimal(out,(int)(id)             % 1000,3); break;
+    case 'K': append_decimal(out,(int)(id /1000 )      % 1000,3); break;
+    case 'M': append_decimal(out,(int)(id /1000000)    % 1000,3); break;
+    case 'G': append_decimal(out,(int)(id /1000000000) % 1000,3); break;
+    case 'T': // Timestamp in ISO8601 format
+    {
+        char buf[32];
+        time_t t = tstart.tv_sec;
+        if(strftime(buf,sizeof(buf),"%Y-%m-%dT%H:%M:%SZ",gmtime(&t))) out += buf;
+        break;
+    }
+    case 't': // Unix time_t
+        if(tstart.tv_sec<0) out += '-';
+        append_decimal(out,tstart.tv_sec<0 ? -(int64_t)tstart.tv_sec : tstart.tv_sec,0);
+        break;
+    case 'V': // '--' if VLAN is present
+        if(vlan!=be13::packet_info::NO_VLAN) out += "--";
+        break;
+    case 'v': // VLAN number if VLAN is present
+        if(vlan!=be13::packet_info::NO_VLAN){
+            if(vlan<0) out += '-';
+            append_decimal(out,vlan<0 ? -(int64_t)vlan : vlan,0);
+        }
+        break;
+    case 'C': // 'c' if connection_count >0
+        if(connection_count>0) out += 'c';
+        break;
+    case 'c': // connection_count if connection_count >0
+        if(connection_count>0) append_decimal(out,connection_count,0);
+        break;
+    case 'S': append_decimal(out,session_id,20); break; // session ID
+    case '#': append_decimal(out,connection_count,0); break; // always output connection count
+    }
+}
+
 std::string flow::filename(uint32_t connection_count, bool is_pcap)
 {
-    std::stringstream ss;
+    if(compiled_template!=filename_template) compile_template(); // only if main() did not
+    static thread_local std::string out;  // reused, so that it does not have to grow each time
+    out.clear();
 
-    /* Add the outdir */
-    if(flow::outdir!="." && flow::outdir!=""){
-        ss << flow::outdir;
-        ss << '/';
+    /* Add the flow's root, of the demux that owns the flow (each has its own with --parallel-inputs=independent) */
+    const std::string &outdir = tcpdemux::getInstance()->roots.dir(root);
+    if(outdir!="." && outdir!=""){
+        out += outdir;
+        out += '/';
     }
 
-    for(unsigned int i=0;i<filename_template.size();i++){
-	switch(filename_template.at(i)){
-	default:
-	    ss << filename_template.at(i);
-	    break;
-	case '%':
-	    if(i==filename_template.size()-1){
-		std::cerr << "Invalid filename_template: " << filename_template << " cannot end with a %\n";
-		exit(1);
-	    }
-	    /* put the substitute in ss or buf */
-	    char buf[1024];
-	    buf[0] = 0;
-	    switch(filename_template.at(++i)){
-	    case 'A': // source IP address
-		switch(family){
-		case AF_INET:
-		    snprintf(buf,sizeof(buf),"%03d.%03d.%03d.%03d",
-                             src.addr[0], src.addr[1], src.addr[2], src.addr[3]);
-		    break;
-		case AF_INET6:
-		    inet_ntop(family, src.addr, buf,sizeof(buf));
-		}
-		break;
-	    case 'a': // source IP port
-		snprintf(buf,sizeof(buf),"%05d",sport);
-		break;
-	    case 'B': // dest IP address
-		switch(family){
-		case AF_INET:
-		    snprintf(buf,sizeof(buf),"%03d.%03d.%03d.%03d",
-                             dst.addr[0], dst.addr[1], dst.addr[2], dst.addr[3]);
-		    break;
-		case AF_INET6:
-		    inet_ntop(family, dst.addr, buf,sizeof(buf));
-		}
-		break;
-	    case 'b': // dest IP port
-		snprintf(buf,sizeof(buf),"%05d",dport);
-		break;
-                /* binning by connection number */
-            case 'E':
-                snprintf(buf,sizeof(buf),"%02x:%02x:%02x:%02x:%02x:%02x",
-                         mac_saddr[0],mac_saddr[1],mac_saddr[2],mac_saddr[3],mac_saddr[4],mac_saddr[5]);
-                break;
-            case 'e':
-                snprintf(buf,sizeof(buf),"%02x:%02x:%02x:%02x:%02x:%02x",
-                         mac_daddr[0],mac_daddr[1],mac_daddr[2],mac_daddr[3],mac_daddr[4],mac_daddr[5]);
-                break;
-            case 'N': snprintf(buf,sizeof(buf),"%03d",(int)(id)             % 1000);break;
-            case 'K': snprintf(buf,sizeof(buf),"%03d",(int)(id /1000 )      % 1000);break;
-            case 'M': snprintf(buf,sizeof(buf),"%03d",(int)(id /1000000)    % 1000);break;
-            case 'G': snprintf(buf,sizeof(buf),"%03d",(int)(id /1000000000) % 1000);break;
-
-	    case 'T': // Timestamp in ISO8601 format
-	      {
-		time_t t = tstart.tv_sec;
-		strftime(buf,sizeof(buf),"%Y-%m-%dT%H:%M:%SZ",gmtime(&t));
-		break;
-	      }
-	    case 't': // Unix time_t
-		ss << tstart.tv_sec;
-		break;
-	    case 'V': // '--' if VLAN is present
-		if(vlan!=be13::packet_info::NO_VLAN) ss << "--";
-		break;
-	    case 'v': // VLAN number if VLAN is present
-		if(vlan!=be13::packet_info::NO_VLAN) ss << vlan;
-		break;
-	    case 'C': // 'c' if connection_count >0
-		if(connection_count>0) ss << "c";
-		break;
-	    case 'c': // connection_count if connection_count >0
-		if(connection_count>0) ss << connection_count;
-		break;
-	    case 'S': // session ID
-		ss << std::setfill('0') << std::setw(20) << session_id;
-		break;
-	    case '#': // always output connection count
-		ss << connection_count;
-		break;
-	    case '%': // Output a '%'
-		ss << "%";
-		break;
-	    default:
-		std::cerr << "Invalid filename_template: " << filename_template << "\n";
-		std::cerr << "unknown character: " << filename_template.at(i+1) << "\n";
-		exit(1);
-	    }
-	    if(buf[0]) ss << buf;
-	}
+    for(std::vector<template_op>::const_iterator it=template_ops.begin();it!=template_ops.end();it++){
+        if(it->directive==0) out += it->text;
+        else append_directive(out,it->directive,connection_count);
     }
     if(is_pcap){
-        ss << ".pcap"; // file extension
+        out += pcap_writer::pcapng ? ".pcapng" : ".pcap"; // file extension
     }
-    return ss.str();
+    return out;
 }
 
 /**
@@ -164,11 +241,11 @@ std::string flow::filename(uint32_t connection_count, bool is_pcap)
  * This is called from tcpip::open_file().
  */
 
-std::string flow::new_filename(int *fd,int flags,int mode)
+std::string flow::new_filename(int *fd,int flags,int mode,const char *suffix)
 {
     /* Loop connection count until we find a file that doesn't exist */
     for(uint32_t connection_count=0;;connection_count++){
-        std::string nfn = filename(connection_count, false);
+        std::string nfn = filename(connection_count, false) + suffix;
         if(nfn.find('/')!=std::string::npos) mkdirs_for_path(nfn.c_str());
         int nfd = tcpdemux::getInstance()->retrying_open(nfn,flags,mode);
         if(nfd>=0){
@@ -0,0 +1,328 @@
+/**
+ *
+ * flow_arrow.cpp
+ * The finished flows as columns, in an Arrow IPC stream. See flow_arrow.h
+ *
+ * The format is https://arrow.apache.org/docs/format/Columnar.html:
+ * each message is 0xFFFFFFFF, the length of its metadata, the metadata (a
+ * flatbuffer Message, from Message.fbs and Schema.fbs) and its body, the
+ * buffers of the columns, each a multiple of 8 bytes.
+ *
+ * This source code is under the GNU Public License (GPL).  See
+ * LICENSE for details.
+ *
+ */
+
+#include "tcpflow.h"
+#include "tcpip.h"
+#include "flow_arrow.h"
+
+#include <sstream>
+#include <algorithm>
+
+/* static */ std::string flow_arrow::path       = "";
+/* static */ uint32_t    flow_arrow::batch_rows = 65536;
+
+/* From Schema.fbs and Message.fbs */
+enum { METADATA_V5 = 4 };
+enum { HEADER_SCHEMA = 1, HEADER_RECORD_BATCH = 3 };
+enum { TYPE_INT = 2, TYPE_UTF8 = 5, TYPE_TIMESTAMP = 10 };
+enum { MICROSECOND = 2 };
+
+/*
+ * A flatbuffer, written from the front: a table's offsets are filled in
+ * with point() once what they point to is written after it, so that they
+ * all point forward, as flatbuffer offsets have to. Scalars are written
+ * as they are in memory, which is little-endian where tcpflow runs.
+ */
+class fbuilder {
+public:
+    /* A field of a table: size 1, 2, 4 or 8 for a scalar, 0 for an offset */
+    struct field {
+        field(unsigned id_,unsigned size_,uint64_t value_):id(id_),size(size_),value(value_){}
+        unsigned id;
+        unsigned size;
+        uint64_t value;
+    };
+
+    std::string buf;
+
+    fbuilder():buf(4,'\0'){}            // the offset of the root table
+
+    /* A table, pointed to from from; at[id] gets where each offset field is */
+    void table(size_t from,std::vector<field> fields,std::vector<size_t> &at) {
+        unsigned slots = 0;
+        for(size_t i=0;i<fields.size();i++) slots = std::max(slots,fields[i].id+1);
+        std::stable_sort(fields.begin(),fields.end(),bigger_first);
+        std::vector<uint16_t> slot(slots,0);
+        size_t size = 4;                // the offset of the vtable comes first
+        for(size_t i=0;i<fields.size();i++){
+            size_t fs = width(fields[i]);
+            size = (size+fs-1)/fs*fs;
+            slot[fields[i].id] = size;
+            size += fs;
+        }
+        align(2);
+        size_t vtable = buf.size();
+        put<uint16_t>(4+2*slots);
+        put<uint16_t>(size);
+        for(unsigned i=0;i<slots;i++) put<uint16_t>(slot[i]);
+        align(8);
+        size_t t = buf.size();
+        point(from);
+        put<int32_t>(t-vtable);
+        buf.resize(t+size,'\0');
+        at.assign(slots,0);
+        for(size_t i=0;i<fields.size();i++){
+            if(fields[i].size){
+                memcpy(&buf[t+slot[fields[i].id]],&fields[i].value,fields[i].size);
+            } else {
+                at[fields[i].id] = t+slot[fields[i].id];
+            }
+        }
+    }
+
+    void string(size_t from,const std::string &s) {
+        align(4);
+        point(from);
+        put<uint32_t>(s.size());
+        buf.append(s);
+        buf.push_back('\0');
+    }
+
+    /* A vector of n offsets, pointed to from from; returns where each is */
+    std::vector<size_t> offsets(size_t from,size_t n) {
+        align(4);
+        point(from);
+        put<uint32_t>(n);
+        std::vector<size_t> at;
+        for(size_t i=0;i<n;i++){
+            at.push_back(buf.size());
+            put<uint32_t>(0);
+        }
+        return at;
+    }
+
+    /* A vector of structs of two longs: FieldNode and Buffer */
+    void pairs(size_t from,const std::vector<int64_t> &values) {
+        align(4);
+        if(buf.size()%8==0) put<uint32_t>(0); // so that the structs start at a multiple of 8
+        point(from);
+        put<uint32_t>(values.size()/2);
+        for(size_t i=0;i<values.size();i++) put<int64_t>(values[i]);
+    }
+
+private:
+    static size_t width(const field &f) { return f.size ? f.size : 4; }
+    static bool bigger_first(const field &a,const field &b) { return width(a) > width(b); }
+    void align(size_t n) { while(buf.size()%n) buf.push_back('\0'); }
+    template<class T> void put(T v) { buf.append((const char *)&v,sizeof(v)); }
+    void point(size_t from) {
+        uint32_t off = buf.size()-from;
+        memcpy(&buf[from],&off,sizeof(off));
+    }
+};
+
+flow_arrow::flow_arrow(const std::string &file):out(0),columns(),rows(0),written(0),batches(0)
+{
+    out = fopen(file.c_str(),"wb");
+    if(out==0){
+        perror(file.c_str());
+        exit(1);
+    }
+    if(batch_rows<1) batch_rows = 1;
+    columns.push_back(column("starttime", column::TIMESTAMP,64,true ,false));
+    columns.push_back(column("endtime",   column::TIMESTAMP,64,true ,false));
+    columns.push_back(column("family",    column::INT,      8 ,false,false));
+    columns.push_back(column("src_ip",    column::UTF8,     0 ,false,false));
+    columns.push_back(column("dst_ip",    column::UTF8,     0 ,false,false));
+    columns.push_back(column("srcport",   column::INT,      16,false,false));
+    columns.push_back(column("dstport",   column::INT,      16,false,false));
+    columns.push_back(column("vlan",      column::INT,      32,true ,true ));
+    columns.push_back(column("mac_daddr", column::UTF8,     0 ,false,true ));
+    columns.push_back(column("mac_saddr", column::UTF8,     0 ,false,true ));
+    columns.push_back(column("packets",   column::INT,      64,false,false));
+    columns.push_back(column("len",       column::INT,      64,false,false));
+    columns.push_back(column("caplen",    column::INT,      64,false,false));
+    columns.push_back(column("filesize",  column::INT,      64,false,false));
+    columns.push_back(column("session_id",column::INT,      64,false,false));
+    columns.push_back(column("filename",  column::UTF8,     0 ,false,false));
+    columns.push_back(column("md5",       column::UTF8,     0 ,false,true ));
+    columns.push_back(column("sha1",      column::UTF8,     0 ,false,true ));
+    columns.push_back(column("sha256",    column::UTF8,     0 ,false,true ));
+    for(std::vector<column>::iterator it=columns.begin();it!=columns.end();it++){
+        if(it->kind==column::UTF8) it->offsets.push_back(0);
+    }
+    write_schema();
+}
+
+flow_arrow::~flow_arrow()
+{
+    flush();
+    static const uint32_t eos[2] = {0xffffffff,0};
+    fwrite(eos,1,sizeof(eos),out);
+    fclose(out);
+    DEBUG(2)("flow_arrow: %" PRIu64 " flows in %" PRIu64 " batches",written,batches);
+}
+
+void flow_arrow::set_valid(column &col,bool valid)
+{
+    if(rows%8==0) col.validity.push_back('\0');
+    if(valid){
+        col.validity[rows/8] |= (char)(1 << (rows%8));
+    } else {
+        col.nulls++;
+    }
+}
+
+void flow_arrow::add_int(size_t c,uint64_t v)
+{
+    column &col = columns[c];
+    set_valid(col,true);
+    col.values.append((const char *)&v,col.bits/8); // the low bytes, little-endian
+}
+
+void flow_arrow::add_str(size_t c,const std::string &s)
+{
+    column &col = columns[c];
+    set_valid(col,true);
+    col.values.append(s);
+    col.offsets.push_back(col.values.size());
+}
+
+void flow_arrow::add_null(size_t c)
+{
+    column &col = columns[c];
+    set_valid(col,false);
+    if(col.kind==column::UTF8){
+        col.offsets.push_back(col.values.size());
+    } else {
+        col.values.append(col.bits/8,'\0');
+    }
+}
+
+static uint64_t usec(const struct timeval &t)
+{
+    return (uint64_t)((int64_t)t.tv_sec*1000000 + t.tv_usec);
+}
+
+static std::string addr_text(const ipaddr &a,sa_family_t family)
+{
+    std::stringstream ss;
+    ss << ipaddr_prn(a,family);
+    return ss.str();
+}
+
+void flow_arrow::append(const flow_report &r)
+{
+    const flow &f = r.myflow;
+    size_t c = 0;
+    add_int(c++,usec(f.tstart));
+    add_int(c++,usec(f.tlast));
+    add_int(c++,f.family);
+    add_str(c++,addr_text(f.src,f.family));
+    add_str(c++,addr_text(f.dst,f.family));
+    add_int(c++,f.sport);
+    add_int(c++,f.dport);
+    if(f.vlan>=0) add_int(c++,(uint32_t)f.vlan); else add_null(c++);
+    if(f.has_mac_daddr()) add_str(c++,macaddr(f.mac_daddr)); else add_null(c++);
+    if(f.has_mac_saddr()) add_str(c++,macaddr(f.mac_saddr)); else add_null(c++);
+    add_int(c++,f.packet_count);
+    add_int(c++,f.len);
+    add_int(c++,f.caplen);
+    add_int(c++,r.last_byte);
+    add_int(c++,f.session_id);
+    add_str(c++,r.flow_pathname);
+    static const char *types[3] = {"MD5","SHA1","SHA256"};
+    for(int i=0;i<3;i++){
+        const std::string *hex = 0;
+        for(flow_hash::digests_t::const_iterator it=r.digests.begin();it!=r.digests.end();it++){
+            if(it->type==types[i]) hex = &it->hex;
+        }
+        if(hex) add_str(c++,*hex); else add_null(c++);
+    }
+    rows++;
+    if(rows>=batch_rows) flush();
+}
+
+void flow_arrow::write_message(const std::string &metadata,const std::string &body)
+{
+    uint32_t prefix[2] = {0xffffffff,(uint32_t)((metadata.size()+7)/8*8)};
+    static const char zeros[8] = {0};
+    fwrite(prefix,1,sizeof(prefix),out);
+    fwrite(metadata.data(),1,metadata.size(),out);
+    fwrite(zeros,1,prefix[1]-metadata.size(),out);
+    fwrite(body.data(),1,body.size(),out);
+}
+
+void flow_arrow::write_schema()
+{
+    typedef fbuilder::field F;
+    fbuilder b;
+    std::vector<size_t> message,schema,field,type;
+    b.table(0,{F(0,2,METADATA_V5),F(1,1,HEADER_SCHEMA),F(2,0,0),F(3,8,0)},message);
+    b.table(message[2],{F(0,2,0),F(1,0,0)},schema);     // little-endian, and the fields
+    std::vector<size_t> fields = b.offsets(schema[1],columns.size());
+    for(size_t i=0;i<columns.size();i++){
+        const column &col = columns[i];
+        uint8_t type_type = col.kind==column::INT ? TYPE_INT : col.kind==column::UTF8 ? TYPE_UTF8 : TYPE_TIMESTAMP;
+        b.table(fields[i],{F(0,0,0),F(1,1,col.nullable),F(2,1,type_type),F(3,0,0),F(5,0,0)},field);
+        b.string(field[0],col.name);
+        switch(col.kind){
+        case column::INT:
+            b.table(field[3],{F(0,4,col.bits),F(1,1,col.is_signed)},type);
+            break;
+        case column::TIMESTAMP:
+            b.table(field[3],{F(0,2,MICROSECOND),F(1,0,0)},type);
+            b.string(type[1],"UTC");
+            break;
+        case column::UTF8:
+            b.table(field[3],{},type);
+            break;
+        }
+        b.offsets(field[5],0);          // no children; readers want the vector all the same
+    }
+    write_message(b.buf,"");
+}
+
+void flow_arrow::flush()
+{
+    if(rows==0) return;
+    std::string body;
+    std::vector<int64_t> nodes,buffers;
+    for(std::vector<column>::iterator it=columns.begin();it!=columns.end();it++){
+        nodes.push_back(rows);
+        nodes.push_back(it->nulls);
+        std::vector<std::string *> parts;
+        std::string offsets;
+        if(it->nulls==0) it->validity.clear(); // a column without nulls needs no bitmap
+        parts.push_back(&it->validity);
+        if(it->kind==column::UTF8){
+            offsets.assign((const char *)it->offsets.data(),it->offsets.size()*sizeof(int32_t));
+            parts.push_back(&offsets);
+        }
+        parts.push_back(&it->values);
+        for(std::vector<std::string *>::const_iterator p=parts.begin();p!=parts.end();p++){
+            buffers.push_back(body.size());
+            buffers.push_back((*p)->size());
+            body.append(**p);
+            body.append((8-body.size()%8)%8,'\0');
+        }
+        it->values.clear();
+        it->validity.clear();
+        it->nulls = 0;
+        if(it->kind==column::UTF8) it->offsets.assign(1,0);
+    }
+    typedef fbuilder::field F;
+    fbuilder b;
+    std::vector<size_t> message,batch;
+    b.table(0,{F(0,2,METADATA_V5),F(1,1,HEADER_RECORD_BATCH),F(2,0,0),F(3,8,body.size())},message);
+    b.table(message[2],{F(0,8,rows),F(1,0,0),F(2,0,0)},batch);
+    b.pairs(batch[1],nodes);
+    b.pairs(batch[2],buffers);
+    write_message(b.buf,body);
+    fflush(out);
+    written += rows;
+    batches++;
+    rows = 0;
+}
@@ -0,0 +1,91 @@
+#ifndef FLOW_ARROW_H
+#define FLOW_ARROW_H
+
+/**
+ * flow_arrow.h
+ *
+ * The finished flows as columns, in an Arrow IPC stream, with
+ * -S flow_arrow=file (in the output directory unless it is an absolute
+ * path), for analytics that would otherwise parse the DFXML report:
+ *
+ *   pyarrow.ipc.open_stream("flows.arrows").read_all()
+ *   duckdb: SELECT ... FROM read_arrow('flows.arrows')  (or through pyarrow)
+ *
+ * The report_writer thread appends each flow it reports to the columns
+ * and writes them as a record batch every -S flow_arrow_batch flows
+ * (default 65536), and at the end; the stream is then ended, so a file
+ * cut short by a crash still has every batch before the last.
+ *
+ *   starttime, endtime      timestamp[us, UTC]
+ *   family                  uint8   (AF_INET or AF_INET6)
+ *   src_ip, dst_ip          utf8
+ *   srcport, dstport        uint16
+ *   vlan                    int32   null without a VLAN
+ *   mac_daddr, mac_saddr    utf8    null if not known
+ *   packets, len, caplen    uint64  (len and caplen as in the report)
+ *   filesize                uint64
+ *   session_id              uint64
+ *   filename                utf8
+ *   md5, sha1, sha256       utf8    null if the flow was not hashed
+ *
+ * It is written here, with no Arrow library, since only the IPC format's
+ * schema and record batch messages are needed, in little-endian order.
+ * Parquet is not written; pyarrow turns the stream into it if wanted.
+ *
+ * Include after tcpip.h.
+ *
+ * This source code is under the GNU Public License (GPL).  See
+ * LICENSE for details.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+class flow_arrow {
+public:
+    static std::string path;            // -S flow_arrow; "" for none
+    static uint32_t    batch_rows;      // -S flow_arrow_batch
+
+    explicit flow_arrow(const std::string &file); // exits if it cannot be created
+    virtual ~flow_arrow();              // writes the last batch and ends the stream
+
+    void append(const flow_report &r);
+    void flush();                       // the flows appended so far, as a record batch
+
+private:
+    flow_arrow(const flow_arrow &);
+    flow_arrow &operator=(const flow_arrow &);
+
+    struct column {
+        enum kind_t { INT, TIMESTAMP, UTF8 };
+        column(const char *name_,kind_t kind_,int bits_,bool is_signed_,bool nullable_):
+            name(name_),kind(kind_),bits(bits_),is_signed(is_signed_),nullable(nullable_),
+            values(),offsets(),validity(),nulls(0){}
+        const char *name;
+        kind_t      kind;
+        int         bits;               // of INT and TIMESTAMP values
+        bool        is_signed;
+        bool        nullable;
+        std::string values;             // the fixed-width values, or the UTF8 bytes
+        std::vector<int32_t> offsets;   // UTF8: where each value starts, and where the last ends
+        std::string validity;           // a bit for each row, set if it is not null
+        uint64_t    nulls;
+    };
+
+    FILE                *out;
+    std::vector<column> columns;
+    uint64_t            rows;           // in the columns
+    uint64_t            written;        // flows in the batches written
+    uint64_t            batches;
+
+    void add_int(size_t c,uint64_t v);
+    void add_str(size_t c,const std::string &s);
+    void add_null(size_t c);
+    void set_valid(column &col,bool valid);
+    void write_schema();
+    void write_message(const std::string &metadata,const std::string &body);
+};
+
+#endif
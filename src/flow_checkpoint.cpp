@@ -0,0 +1,374 @@
+/**
+ *
+ * flow_checkpoint.cpp
+ * Open flows written out at the end and taken up again. See flow_checkpoint.h
+ *
+ * A FLOW record is, in order:
+ *   the address: source and destination (16 bytes each), ports (2 each),
+ *     family (1: 4 or 6)
+ *   the flow: id, session id (8 each), vlan (4), destination and source
+ *     MAC (6 each), start and last time (8 bytes of seconds, 4 of
+ *     microseconds each), len, caplen, packets (8 each)
+ *   the state: direction (1), isn, nsn, SYNs, FINs, FIN size (4 each),
+ *     pos, last byte, last packet number, out of order count, violations,
+ *     max bytes (8 each), load_shed level (1), flags (1: 1 if the file was
+ *     created, 2 if there is a transcript)
+ *   the transcript's name and the -I index's, each a 4-byte length and that
+ *     many bytes
+ *   the intervals seen: a 4-byte count, then the start and end of each (8 each)
+ *   the -I packet index: a 4-byte count, then packet_index_record::SIZE bytes each
+ *
+ * A SAVED_FLOW record is the address as above, isn (4), tail offset (8),
+ * and the transcript's name and its tail, each a 4-byte length and that
+ * many bytes.
+ *
+ * This source code is under the GNU Public License (GPL).  See
+ * LICENSE for details.
+ *
+ */
+
+#include "tcpflow.h"
+#include "tcpip.h"
+#include "tcpdemux.h"
+#include "tcpdemux_pool.h"
+#include "flow_checkpoint.h"
+#include "flow_policy.h"
+#include "mem_budget.h"
+
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <mutex>
+
+/* static */ std::string flow_checkpoint::path;
+/* static */ std::string flow_checkpoint::load_path;
+
+static std::mutex  M;
+static FILE       *out = 0;
+static std::string out_file;            // where out is renamed to
+static uint64_t    out_records = 0;
+static bool        out_ok = true;
+
+static const char magic[] = "tcpflow-ckpt";
+
+static void put(std::string &s,uint64_t v,int bytes)
+{
+    for(int i=0;i<bytes;i++) s.push_back((char)(uint8_t)(v >> (8*i)));
+}
+
+static void put_string(std::string &s,const std::string &v)
+{
+    put(s,v.size(),4);
+    s += v;
+}
+
+static void put_addr(std::string &s,const flow_addr &a)
+{
+    s.append((const char *)a.src.addr,sizeof(a.src.addr));
+    s.append((const char *)a.dst.addr,sizeof(a.dst.addr));
+    put(s,a.sport,2);
+    put(s,a.dport,2);
+    put(s,a.family==AF_INET6 ? 6 : 4,1);
+}
+
+static void put_record(std::string &s,flow_checkpoint::record_t type,const std::string &payload)
+{
+    put(s,type,4);
+    put(s,payload.size(),4);
+    s += payload;
+}
+
+/* the bytes of one record; ok goes false, and stays false, if it runs out */
+class reader {
+    const uint8_t *p;
+    const uint8_t *end;
+public:
+    reader(const uint8_t *p_,size_t len):p(p_),end(p_+len),ok(true){}
+    bool ok;
+    uint64_t get(int bytes) {
+        if(!ok || end-p<bytes){ ok = false; return 0; }
+        uint64_t v = 0;
+        for(int i=0;i<bytes;i++) v |= (uint64_t)p[i] << (8*i);
+        p += bytes;
+        return v;
+    }
+    void get_raw(uint8_t *buf,size_t n) {
+        if(!ok || (size_t)(end-p)<n){ ok = false; return; }
+        memcpy(buf,p,n);
+        p += n;
+    }
+    std::string get_string() {
+        size_t n = get(4);
+        if(!ok || (size_t)(end-p)<n){ ok = false; return std::string(); }
+        std::string s((const char *)p,n);
+        p += n;
+        return s;
+    }
+    flow_addr get_addr() {
+        flow_addr a;
+        get_raw(a.src.addr,sizeof(a.src.addr));
+        get_raw(a.dst.addr,sizeof(a.dst.addr));
+        a.sport  = get(2);
+        a.dport  = get(2);
+        a.family = get(1)==6 ? AF_INET6 : AF_INET;
+        return a;
+    }
+    struct timeval get_time() {
+        struct timeval tv;
+        tv.tv_sec  = get(8);
+        tv.tv_usec = get(4);
+        return tv;
+    }
+};
+
+/* static */ void flow_checkpoint::encode_flow(std::string &s,const tcpip &tcp)
+{
+    const flow &f = tcp.myflow;
+    std::string p;
+    put_addr(p,f);
+    put(p,f.id,8);
+    put(p,f.session_id,8);
+    put(p,(uint32_t)f.vlan,4);
+    p.append((const char *)f.mac_daddr,sizeof(f.mac_daddr));
+    p.append((const char *)f.mac_saddr,sizeof(f.mac_saddr));
+    put(p,f.tstart.tv_sec,8);
+    put(p,f.tstart.tv_usec,4);
+    put(p,f.tlast.tv_sec,8);
+    put(p,f.tlast.tv_usec,4);
+    put(p,f.len,8);
+    put(p,f.caplen,8);
+    put(p,f.packet_count,8);
+
+    put(p,tcp.dir,1);
+    put(p,tcp.isn,4);
+    put(p,tcp.nsn,4);
+    put(p,tcp.syn_count,4);
+    put(p,tcp.fin_count,4);
+    put(p,tcp.fin_size,4);
+    put(p,tcp.pos,8);
+    put(p,tcp.last_byte,8);
+    put(p,tcp.last_packet_number,8);
+    put(p,tcp.out_of_order_count,8);
+    put(p,tcp.violations,8);
+    put(p,(uint64_t)tcp.max_bytes,8);
+    put(p,tcp.shed_level,1);
+    put(p,(tcp.file_created ? 1 : 0) | (tcp.transcript ? 2 : 0),1);
+    put_string(p,tcp.flow_pathname);
+    put_string(p,tcp.flow_index_pathname);
+
+    put(p,tcp.seen.interval_count(),4);
+    for(size_t i=0;i<tcp.seen.interval_count();i++){
+        recon_set::interval r = tcp.seen.get_interval(i);
+        put(p,r.begin,8);
+        put(p,r.end,8);
+    }
+    put(p,tcp.packet_index.size(),4);
+    for(packet_index_t::const_iterator it=tcp.packet_index.begin();it!=tcp.packet_index.end();it++){
+        uint8_t buf[packet_index_record::SIZE];
+        it->encode(buf);
+        p.append((const char *)buf,sizeof(buf));
+    }
+    put_record(s,FLOW,p);
+}
+
+/* static */ void flow_checkpoint::encode_saved_flow(std::string &s,const saved_flow &sf)
+{
+    std::string p;
+    put_addr(p,sf.addr);
+    put(p,sf.isn,4);
+    put(p,sf.tail_offset,8);
+    put_string(p,sf.saved_filename);
+    put_string(p,sf.tail);
+    put_record(s,SAVED_FLOW,p);
+}
+
+/* static */ void flow_checkpoint::start(const std::string &file)
+{
+    out_file = file;
+    std::string tmp = file + ".tmp";
+    out = fopen(tmp.c_str(),"wb");
+    if(out==0){
+        perror(tmp.c_str());
+        exit(1);
+    }
+    uint8_t buf[HEADER_SIZE];
+    memcpy(buf,magic,12);
+    for(int i=0;i<4;i++) buf[12+i] = (uint8_t)(VERSION >> (8*i));
+    out_ok = fwrite(buf,1,sizeof(buf),out)==sizeof(buf);
+}
+
+/* static */ void flow_checkpoint::add(const std::string &records,uint64_t count)
+{
+    std::lock_guard<std::mutex> lock(M);
+    if(out==0 || records.size()==0) return;
+    if(out_ok) out_ok = fwrite(records.data(),1,records.size(),out)==records.size();
+    out_records += count;
+}
+
+/* static */ void flow_checkpoint::finish()
+{
+    std::lock_guard<std::mutex> lock(M);
+    if(out==0) return;
+    std::string p, s;
+    put(p,out_records,8);
+    put_record(s,END,p);
+    if(out_ok) out_ok = fwrite(s.data(),1,s.size(),out)==s.size();
+    if(fclose(out)!=0) out_ok = false;
+    out = 0;
+    std::string tmp = out_file + ".tmp";
+    if(!out_ok || rename(tmp.c_str(),out_file.c_str())!=0){
+        /* the last complete checkpoint, if there is one, is left as it was */
+        std::cerr << tmp << ": " << strerror(errno) << "; the checkpoint was not written\n";
+        return;
+    }
+    DEBUG(1)("%s: %" PRIu64 " flows and saved flows checkpointed",out_file.c_str(),out_records);
+}
+
+/* the worker of demux that would get the packets of a */
+static tcpdemux &owner(tcpdemux &demux,const flow_addr &a)
+{
+    if(demux.pool==0 || demux.pool->size()==0) return demux;
+    return demux.pool->get_worker(tcpdemux_pool::shard_hash(a) % demux.pool->size());
+}
+
+static bool restore_flow(reader &r,tcpdemux &demux,uint64_t &max_id,uint64_t &max_session)
+{
+    flow f;
+    (flow_addr &)f = r.get_addr();
+    f.id         = r.get(8);
+    f.session_id = r.get(8);
+    f.vlan       = (int32_t)r.get(4);
+    r.get_raw(f.mac_daddr,sizeof(f.mac_daddr));
+    r.get_raw(f.mac_saddr,sizeof(f.mac_saddr));
+    f.tstart     = r.get_time();
+    f.tlast      = r.get_time();
+    f.len        = r.get(8);
+    f.caplen     = r.get(8);
+    f.packet_count = r.get(8);
+    tcpip::dir_t dir = (tcpip::dir_t)r.get(1);
+    be13::tcp_seq isn = r.get(4);
+    if(!r.ok) return false;
+
+    tcpdemux &d = owner(demux,f);
+    tcpip *tcp = d.restore_tcpip(f,isn);
+    if(tcp==0) return true;             // there already is one; the first is kept
+    tcp->dir                = dir;
+    tcp->nsn                = r.get(4);
+    tcp->syn_count          = r.get(4);
+    tcp->fin_count          = r.get(4);
+    tcp->fin_size           = r.get(4);
+    tcp->pos                = r.get(8);
+    tcp->last_byte          = r.get(8);
+    tcp->last_packet_number = r.get(8);
+    tcp->out_of_order_count = r.get(8);
+    tcp->violations         = r.get(8);
+    tcp->max_bytes          = (int64_t)r.get(8);
+    tcp->shed_level         = r.get(1);
+    uint64_t flags          = r.get(1);
+    tcp->file_created       = flags & 1;
+    tcp->transcript         = (flags & 2)!=0;
+    tcp->flow_pathname      = r.get_string();
+    tcp->flow_index_pathname = r.get_string();
+    if(flow_policy::active() && !tcp->file_created){ // this run's rules; one with a file goes on with it
+        flow_policy::apply(*tcp,tcp->session->half[1-tcp_session::direction(f)]);
+        if(tcp->last_byte>0 && flow_policy::action(*tcp)==flow_policy::TLS_ONLY){
+            tcp->bypass = true;         // its hello went by in the last run
+        }
+    }
+    /* a file it has stays on the root it is on; see output_roots.h */
+    tcp->myflow.root = tcp->flow_pathname.size() ? d.roots.join(d.roots.find(tcp->flow_pathname))
+                                                 : d.roots.place(tcp->myflow);
+    uint64_t intervals = r.get(4);
+    for(uint64_t i=0;i<intervals && r.ok;i++){
+        uint64_t begin = r.get(8);
+        uint64_t end   = r.get(8);
+        if(end>begin) tcp->seen.add(begin,end-begin);
+    }
+    mem_budget::charge(mem_budget::RECON,tcpip::recon_bytes(tcp->seen.interval_count()));
+    uint64_t indexed = r.get(4);
+    for(uint64_t i=0;i<indexed && r.ok;i++){
+        uint8_t buf[packet_index_record::SIZE];
+        r.get_raw(buf,sizeof(buf));
+        if(r.ok) tcp->packet_index.push_back(packet_index_record::decode(buf));
+    }
+    tcp->hash_broken = tcp->last_byte>0; // what was written before is hashed from the file
+    if(tcpdemux::tcp_timeout) d.flow_timeouts.schedule(tcp,tcp->myflow.tlast.tv_sec + tcpdemux::tcp_timeout + 1);
+    if(f.id>max_id) max_id = f.id;
+    if(f.session_id>max_session) max_session = f.session_id;
+    return r.ok;
+}
+
+static bool restore_saved_flow(reader &r,tcpdemux &demux)
+{
+    flow_addr a = r.get_addr();
+    be13::tcp_seq isn = r.get(4);
+    uint64_t tail_offset = r.get(8);
+    std::string filename = r.get_string();
+    std::string tail = r.get_string();
+    if(!r.ok) return false;
+    saved_flow *sf = new saved_flow(a,filename,isn);
+    sf->tail_offset = tail_offset;
+    sf->tail.swap(tail);
+    owner(demux,a).restore_saved_flow(sf);
+    return true;
+}
+
+/* static */ int64_t flow_checkpoint::load(const std::string &file,tcpdemux &demux)
+{
+    std::ifstream in(file.c_str(),std::ios::binary);
+    if(!in.is_open()) return -1;
+    std::stringstream ss;
+    ss << in.rdbuf();
+    const std::string buf = ss.str();
+    const uint8_t *data = (const uint8_t *)buf.data();
+    if(buf.size()<HEADER_SIZE || memcmp(data,magic,12)!=0) return -1;
+    reader header(data+12,4);
+    if(header.get(4)!=VERSION) return -1;
+
+    /* first make sure that it is all there, so that nothing is taken up from half a checkpoint */
+    size_t pos = HEADER_SIZE;
+    uint64_t records = 0;
+    bool complete = false;
+    while(!complete){
+        reader h(data+pos,buf.size()-pos);
+        uint64_t type = h.get(4);
+        uint64_t len  = h.get(4);
+        if(!h.ok || buf.size()-pos-8 < len) return -1;
+        if(type==END){
+            reader e(data+pos+8,len);
+            complete = e.get(8)==records;
+            if(!complete) return -1;
+        }
+        records++;
+        pos += 8+len;
+    }
+
+    int64_t flows = 0;
+    uint64_t max_id = 0, max_session = 0;
+    for(pos=HEADER_SIZE;;){
+        reader h(data+pos,8);
+        uint64_t type = h.get(4);
+        uint64_t len  = h.get(4);
+        reader r(data+pos+8,len);
+        pos += 8+len;
+        bool ok = true;
+        switch(type){
+        case FLOW:       ok = restore_flow(r,demux,max_id,max_session); flows++; break;
+        case SAVED_FLOW: ok = restore_saved_flow(r,demux); break;
+        case END:        break;
+        default:         break;     // from a later version; skipped
+        }
+        if(!ok) DEBUG(1)("%s: a record at %zu is damaged",file.c_str(),pos-8-len);
+        if(type==END) break;
+    }
+
+    /* new flows and sessions are numbered after the ones taken up */
+    std::vector<tcpdemux *> demuxes(1,&demux);
+    if(demux.pool) for(size_t i=0;i<demux.pool->size();i++) demuxes.push_back(&demux.pool->get_worker(i));
+    for(std::vector<tcpdemux *>::iterator it=demuxes.begin();it!=demuxes.end();it++){
+        tcpdemux &d = **it;
+        if(d.flow_counter <= max_id/d.nshards) d.flow_counter = max_id/d.nshards+1;
+        if(d.unique_id <= max_session/d.nshards) d.unique_id = max_session/d.nshards+1;
+    }
+    return flows;
+}
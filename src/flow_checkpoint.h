@@ -0,0 +1,64 @@
+#ifndef FLOW_CHECKPOINT_H
+#define FLOW_CHECKPOINT_H
+
+/**
+ * flow_checkpoint.h
+ *
+ * The flows still open when tcpflow stops, written to -S checkpoint_file
+ * instead of being finished, so that the next tcpflow can take them up
+ * again with -S checkpoint_load and carry on writing their transcripts
+ * where this one stopped. Without it, a restart finishes every open flow
+ * as it is, and the next run sees the rest of each long-lived connection
+ * as a new flow that missed its SYN.
+ *
+ * For each flow the checkpoint has its address, its flow (times, MAC
+ * addresses, counts and ids), its sequence numbers and position, the
+ * intervals of it that were seen, where its transcript is and its -I
+ * packet index; the write buffers and reorder windows are written out
+ * first. The saved flows (see saved_flow) are in it as well. HTTP parsers,
+ * compressed transcripts and --segments flows cannot be carried over, so
+ * those flows are finished as before. A flow that was being hashed as it
+ * was written (-S stream_hash) is hashed from its file when it finishes.
+ *
+ * The file is written to checkpoint_file.tmp and renamed when it is
+ * complete. It is a 16-byte header, "tcpflow-ckpt" and four bytes of
+ * version (1), followed by records of a 4-byte type, a 4-byte length and
+ * that many bytes, all little-endian, and ends with an END record that
+ * has the number of records before it. See flow_checkpoint.cpp for what
+ * a FLOW and a SAVED_FLOW record hold.
+ *
+ * Transcript names include the output directory, so the next tcpflow
+ * has to be run in the same directory with the same -o. The same file
+ * can be given to both options. With --threads, each flow goes to the
+ * worker its addresses select.
+ *
+ * This source code is under the GNU Public License (GPL).  See
+ * LICENSE for details.
+ */
+
+#include <stdint.h>
+#include <string>
+
+class flow_checkpoint {
+public:
+    enum { HEADER_SIZE = 16, VERSION = 1 };
+    enum record_t { FLOW = 1, SAVED_FLOW = 2, END = 3 };
+
+    static std::string path;            // -S checkpoint_file; "" for none
+    static std::string load_path;       // -S checkpoint_load; "" for none
+
+    static bool enabled() { return path.size()>0; }
+
+    static void start(const std::string &file); // file is path, resolved against the output directory
+    static void add(const std::string &records,uint64_t count); // encoded records; from any thread
+    static void finish();               // after the last add(): the END record, and the rename
+
+    /* take up the flows in file; returns how many, or -1 if it cannot be read */
+    static int64_t load(const std::string &file,class tcpdemux &demux);
+
+    /* the records, for tcpdemux::checkpoint_flows() */
+    static void encode_flow(std::string &out,const class tcpip &tcp);
+    static void encode_saved_flow(std::string &out,const class saved_flow &sf);
+};
+
+#endif
@@ -0,0 +1,193 @@
+/**
+ *
+ * flow_db.cpp
+ * The SQLite database of finished flows. See flow_db.h
+ *
+ * This source code is under the GNU Public License (GPL).  See
+ * LICENSE for details.
+ *
+ */
+
+#include "tcpflow.h"
+#include "tcpip.h"
+#include "flow_db.h"
+#include "disk_ring.h"
+
+#ifdef HAVE_FLOW_DB
+#include <sqlite3.h>
+#endif
+
+/* static */ std::string flow_db::path       = "";
+/* static */ uint32_t    flow_db::batch_rows = 1000;
+/* static */ uint32_t    flow_db::batch_ms   = 500;
+
+/* static */ bool flow_db::available()
+{
+#ifdef HAVE_FLOW_DB
+    return true;
+#else
+    return false;
+#endif
+}
+
+flow_db::flow_db(const std::string &file):db(0),insert_stmt(0),expire_stmt(0),rows(0),began(),inserted(0),commits(0)
+{
+#ifdef HAVE_FLOW_DB
+    if(sqlite3_open(file.c_str(),&db)!=SQLITE_OK){
+        std::cerr << file << ": cannot open database: " << sqlite3_errmsg(db) << "\n";
+        exit(1);
+    }
+    exec("PRAGMA journal_mode=WAL");
+    exec("PRAGMA synchronous=NORMAL");
+    exec("CREATE TABLE IF NOT EXISTS connections ("
+         "starttime INTEGER NOT NULL,"
+         "endtime INTEGER NOT NULL,"
+         "family INTEGER,"
+         "src_ip BLOB,"
+         "dst_ip BLOB,"
+         "srcport INTEGER,"
+         "dstport INTEGER,"
+         "mac_daddr BLOB,"
+         "mac_saddr BLOB,"
+         "packets INTEGER,"
+         "bytes INTEGER,"
+         "session_id INTEGER,"
+         "filename TEXT,"
+         "hashdigest_md5 TEXT,"
+         "hashdigest_sha1 TEXT,"
+         "hashdigest_sha256 TEXT,"
+         "expired INTEGER)");
+    /* a database from before expired; the column is there if this fails */
+    sqlite3_exec(db,"ALTER TABLE connections ADD COLUMN expired INTEGER",0,0,0);
+    if(disk_ring::max_bytes>0) exec("CREATE INDEX IF NOT EXISTS connections_filename ON connections (filename)");
+    const char *sql = "INSERT INTO connections (starttime,endtime,family,src_ip,dst_ip,srcport,dstport,"
+        "mac_daddr,mac_saddr,packets,bytes,session_id,filename,"
+        "hashdigest_md5,hashdigest_sha1,hashdigest_sha256) VALUES (?,?,?,?,?,?,?,?,?,?,?,?,?,?,?,?)";
+    if(sqlite3_prepare_v2(db,sql,-1,&insert_stmt,0)!=SQLITE_OK){
+        std::cerr << file << ": " << sqlite3_errmsg(db) << "\n";
+        exit(1);
+    }
+    if(sqlite3_prepare_v2(db,"UPDATE connections SET expired=? WHERE filename=? AND expired IS NULL",
+                          -1,&expire_stmt,0)!=SQLITE_OK){
+        std::cerr << file << ": " << sqlite3_errmsg(db) << "\n";
+        exit(1);
+    }
+    if(batch_rows<1) batch_rows = 1;
+#else
+    std::cerr << "-S flow_db requires a tcpflow built with SQLite\n";
+    exit(1);
+#endif
+}
+
+flow_db::~flow_db()
+{
+#ifdef HAVE_FLOW_DB
+    commit();
+    sqlite3_finalize(insert_stmt);
+    sqlite3_finalize(expire_stmt);
+    sqlite3_close(db);
+    DEBUG(2)("flow_db: %" PRIu64 " flows in %" PRIu64 " transactions",inserted,commits);
+#endif
+}
+
+void flow_db::exec(const char *sql)
+{
+#ifdef HAVE_FLOW_DB
+    char *err = 0;
+    if(sqlite3_exec(db,sql,0,0,&err)!=SQLITE_OK){
+        std::cerr << "flow_db: " << sql << ": " << (err ? err : "error") << "\n";
+        sqlite3_free(err);
+        exit(1);
+    }
+#endif
+}
+
+#ifdef HAVE_FLOW_DB
+static int64_t usec(const struct timeval &t)
+{
+    return (int64_t)t.tv_sec*1000000 + t.tv_usec;
+}
+#endif
+
+void flow_db::begin()
+{
+    if(rows==0){
+        exec("BEGIN");
+        began = std::chrono::steady_clock::now();
+    }
+}
+
+void flow_db::insert(const flow_report &r)
+{
+#ifdef HAVE_FLOW_DB
+    begin();
+    const flow &f = r.myflow;
+    const int alen = f.family==AF_INET6 ? 16 : 4;
+    sqlite3_stmt *s = insert_stmt;
+    sqlite3_bind_int64(s,1,usec(f.tstart));
+    sqlite3_bind_int64(s,2,usec(f.tlast));
+    sqlite3_bind_int(s,3,f.family);
+    sqlite3_bind_blob(s,4,f.src.addr,alen,SQLITE_STATIC);
+    sqlite3_bind_blob(s,5,f.dst.addr,alen,SQLITE_STATIC);
+    sqlite3_bind_int(s,6,f.sport);
+    sqlite3_bind_int(s,7,f.dport);
+    if(f.has_mac_daddr()){
+        sqlite3_bind_blob(s,8,f.mac_daddr,sizeof(f.mac_daddr),SQLITE_STATIC);
+    } else {
+        sqlite3_bind_null(s,8);
+    }
+    if(f.has_mac_saddr()){
+        sqlite3_bind_blob(s,9,f.mac_saddr,sizeof(f.mac_saddr),SQLITE_STATIC);
+    } else {
+        sqlite3_bind_null(s,9);
+    }
+    sqlite3_bind_int64(s,10,f.packet_count);
+    sqlite3_bind_int64(s,11,r.last_byte);
+    sqlite3_bind_int64(s,12,f.session_id);
+    sqlite3_bind_text(s,13,r.flow_pathname.data(),r.flow_pathname.size(),SQLITE_STATIC);
+    static const char *types[3] = {"MD5","SHA1","SHA256"};
+    for(int i=0;i<3;i++){
+        sqlite3_bind_null(s,14+i);
+        for(flow_hash::digests_t::const_iterator it=r.digests.begin();it!=r.digests.end();it++){
+            if(it->type==types[i]) sqlite3_bind_text(s,14+i,it->hex.data(),it->hex.size(),SQLITE_STATIC);
+        }
+    }
+    if(sqlite3_step(s)!=SQLITE_DONE){
+        DEBUG(1)("flow_db: insert failed: %s",sqlite3_errmsg(db));
+    }
+    sqlite3_reset(s);
+    rows++;
+    inserted++;
+#endif
+}
+
+/* The row is in this transaction or an earlier one, as the report_writer does it after the flow's */
+void flow_db::expire(const std::string &filename,const struct timeval &when)
+{
+#ifdef HAVE_FLOW_DB
+    begin();
+    sqlite3_stmt *s = expire_stmt;
+    sqlite3_bind_int64(s,1,usec(when));
+    sqlite3_bind_text(s,2,filename.data(),filename.size(),SQLITE_STATIC);
+    if(sqlite3_step(s)!=SQLITE_DONE){
+        DEBUG(1)("flow_db: update failed: %s",sqlite3_errmsg(db));
+    }
+    sqlite3_reset(s);
+    rows++;
+#endif
+}
+
+bool flow_db::commit_due() const
+{
+    if(rows==0) return false;
+    if(rows>=batch_rows) return true;
+    return std::chrono::steady_clock::now()-began >= std::chrono::milliseconds(batch_ms);
+}
+
+void flow_db::commit()
+{
+    if(rows==0) return;
+    exec("COMMIT");
+    rows = 0;
+    commits++;
+}
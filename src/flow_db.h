@@ -0,0 +1,75 @@
+#ifndef FLOW_DB_H
+#define FLOW_DB_H
+
+/**
+ * flow_db.h
+ *
+ * A SQLite database of the finished flows, with -S flow_db=file (in the
+ * output directory unless it is an absolute path).
+ *
+ * The report_writer thread inserts a row for each flow that it reports.
+ * The rows go in transactions of -S flow_db_batch rows, or whatever
+ * -S flow_db_ms milliseconds brought; the database is in WAL mode with
+ * synchronous=NORMAL, so a commit does not wait for the disk. Times,
+ * ports and counts are bound as integers and the addresses as blobs of
+ * 4 or 16 bytes, rather than formatted as text.
+ *
+ *   CREATE TABLE connections (starttime INTEGER, endtime INTEGER,  -- microseconds since 1970
+ *       family INTEGER, src_ip BLOB, dst_ip BLOB, srcport INTEGER, dstport INTEGER,
+ *       mac_daddr BLOB, mac_saddr BLOB, packets INTEGER, bytes INTEGER,
+ *       session_id INTEGER, filename TEXT,
+ *       hashdigest_md5 TEXT, hashdigest_sha1 TEXT, hashdigest_sha256 TEXT,
+ *       expired INTEGER)                                           -- see disk_ring.h
+ *
+ * expired is NULL unless -S ring_bytes removed the flow's files, when it
+ * is the time they were removed; filename is then indexed.
+ *
+ * Include after tcpip.h.
+ *
+ * This source code is under the GNU Public License (GPL).  See
+ * LICENSE for details.
+ */
+
+#include "config.h"
+
+#include <stdint.h>
+#include <string>
+#include <chrono>
+
+#if defined(HAVE_SQLITE3_H) && defined(HAVE_LIBSQLITE3)
+#define HAVE_FLOW_DB
+#endif
+
+class flow_db {
+public:
+    static std::string path;            // -S flow_db; "" for none
+    static uint32_t    batch_rows;      // -S flow_db_batch
+    static uint32_t    batch_ms;        // -S flow_db_ms
+    static bool        available();     // false if tcpflow was built without SQLite
+
+    explicit flow_db(const std::string &file); // exits if it cannot be opened
+    virtual ~flow_db();                 // commits
+
+    void insert(const flow_report &r);
+    void expire(const std::string &filename,const struct timeval &when);
+    bool pending() const { return rows>0; } // rows not committed yet
+    bool commit_due() const;
+    void commit();
+
+private:
+    flow_db(const flow_db &);
+    flow_db &operator=(const flow_db &);
+
+    struct sqlite3      *db;
+    struct sqlite3_stmt *insert_stmt;
+    struct sqlite3_stmt *expire_stmt;
+    uint32_t             rows;          // in the open transaction
+    std::chrono::steady_clock::time_point began;
+    uint64_t             inserted;
+    uint64_t             commits;
+
+    void exec(const char *sql);         // exits on an error
+    void begin();                       // the transaction, if none is open
+};
+
+#endif
@@ -0,0 +1,160 @@
+/*
+ * flow_hash.cpp:
+ *
+ * Digests of flows and HTTP bodies. See flow_hash.h
+ *
+ * This source code is under the GNU Public License (GPL).  See
+ * LICENSE for details.
+ */
+
+#include "flow_hash.h"
+
+#include <string.h>
+#include <algorithm>
+#include <memory>
+
+#ifdef HAVE_FLOW_HASH
+#include <openssl/evp.h>
+#endif
+
+/* static */ std::string flow_hash::names   = "md5";
+/* static */ unsigned    flow_hash::algs    = flow_hash::MD5;
+/* static */ bool        flow_hash::enabled = false;
+
+enum { CHUNK = 16*1024 };               // taken through every digest before the next
+
+static const char *dfxml_type[flow_hash::ALG_COUNT] = {"MD5","SHA1","SHA256"};
+
+/* static */ unsigned flow_hash::parse(const std::string &names_)
+{
+    unsigned bits = 0;
+    size_t start = 0;
+    while(start<=names_.size()){
+        size_t end = names_.find(',',start);
+        if(end==std::string::npos) end = names_.size();
+        std::string name = names_.substr(start,end-start);
+        std::transform(name.begin(),name.end(),name.begin(),::tolower);
+        if(name=="md5"){
+            bits |= MD5;
+        } else if(name=="sha1" || name=="sha-1"){
+            bits |= SHA1;
+        } else if(name=="sha256" || name=="sha-256"){
+            bits |= SHA256;
+        } else {
+            return 0;
+        }
+        start = end+1;
+    }
+    return bits;
+}
+
+/* static */ bool flow_hash::available()
+{
+#ifdef HAVE_FLOW_HASH
+    return true;
+#else
+    return false;
+#endif
+}
+
+#ifdef HAVE_FLOW_HASH
+static const EVP_MD *evp_md(int i)
+{
+    switch(i){
+    case 0:  return EVP_md5();
+    case 1:  return EVP_sha1();
+    default: return EVP_sha256();
+    }
+}
+#endif
+
+flow_hash::context::context(unsigned which_algs_):which_algs(which_algs_),ctx()
+{
+    for(int i=0;i<ALG_COUNT;i++){
+        ctx[i] = 0;
+#ifdef HAVE_FLOW_HASH
+        if(which_algs & (1u<<i)) ctx[i] = EVP_MD_CTX_create();
+#endif
+    }
+    reset();
+}
+
+flow_hash::context::~context()
+{
+#ifdef HAVE_FLOW_HASH
+    for(int i=0;i<ALG_COUNT;i++){
+        if(ctx[i]) EVP_MD_CTX_destroy(static_cast<EVP_MD_CTX *>(ctx[i]));
+    }
+#endif
+}
+
+void flow_hash::context::reset()
+{
+#ifdef HAVE_FLOW_HASH
+    for(int i=0;i<ALG_COUNT;i++){
+        if(ctx[i]) EVP_DigestInit_ex(static_cast<EVP_MD_CTX *>(ctx[i]),evp_md(i),0);
+    }
+#endif
+}
+
+void flow_hash::context::update(const uint8_t *data,size_t length)
+{
+#ifdef HAVE_FLOW_HASH
+    while(length>0){
+        size_t n = std::min(length,(size_t)CHUNK);
+        for(int i=0;i<ALG_COUNT;i++){
+            if(ctx[i]) EVP_DigestUpdate(static_cast<EVP_MD_CTX *>(ctx[i]),data,n);
+        }
+        data += n;
+        length -= n;
+    }
+#endif
+}
+
+void flow_hash::context::final(digests_t &d)
+{
+    d.clear();
+#ifdef HAVE_FLOW_HASH
+    static const char hexbuf[] = "0123456789abcdef";
+    for(int i=0;i<ALG_COUNT;i++){
+        if(ctx[i]==0) continue;
+        unsigned char md[EVP_MAX_MD_SIZE];
+        unsigned int len = 0;
+        EVP_DigestFinal_ex(static_cast<EVP_MD_CTX *>(ctx[i]),md,&len);
+        std::string hex(len*2,'0');
+        for(unsigned int j=0;j<len;j++){
+            hex[j*2]   = hexbuf[md[j]>>4];
+            hex[j*2+1] = hexbuf[md[j]&0x0f];
+        }
+        d.push_back(digest(dfxml_type[i],hex));
+    }
+#endif
+}
+
+/* static */ void flow_hash::hash(unsigned algs_,const uint8_t *data,size_t length,digests_t &d)
+{
+    static thread_local std::unique_ptr<context> c; // kept for the thread's next flow
+    if(!c || c->which()!=algs_){
+        c.reset(new context(algs_));
+    } else {
+        c->reset();
+    }
+    c->update(data,length);
+    c->final(d);
+}
+
+/* static */ std::string flow_hash::hexdigest(alg_t a,const uint8_t *data,size_t length)
+{
+    digests_t d;
+    hash(a,data,length,d);
+    return d.size()>0 ? d[0].hex : std::string();
+}
+
+/* static */ std::string flow_hash::xml(const digests_t &d)
+{
+    std::string s;
+    for(digests_t::const_iterator it=d.begin();it!=d.end();it++){
+        s += std::string("<hashdigest type='") + it->type + "'>" + it->hex + "</hashdigest>";
+    }
+    return s;
+}
@@ -0,0 +1,70 @@
+/*
+ * flow_hash.h:
+ *
+ * MD5, SHA-1 and SHA-256 digests of flows and HTTP bodies, for the md5
+ * scanner (-e md5, -FM), tcpip's hashing of flows as they are written,
+ * and the feature recorders' hash_def.
+ *
+ * A context computes any of the three at once, taking each piece of the
+ * data through all of them while it is still in the cache. Its OpenSSL
+ * digest contexts are made once and re-initialized for each flow, and
+ * hash() uses one per thread, so that a short flow does not pay for
+ * looking up the digest and allocating a context every time; OpenSSL
+ * picks its SHA-NI or AVX2 code for the machine it runs on.
+ *
+ * This source code is under the GNU Public License (GPL).  See
+ * LICENSE for details.
+ */
+
+#ifndef FLOW_HASH_H
+#define FLOW_HASH_H
+
+#include "config.h"
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#if defined(HAVE_OPENSSL_EVP_H) && defined(HAVE_EVP_GET_DIGESTBYNAME)
+#define HAVE_FLOW_HASH
+#endif
+
+class flow_hash {
+public:
+    enum alg_t { MD5=1, SHA1=2, SHA256=4 };
+    enum { ALG_COUNT=3 };
+
+    struct digest {
+        digest(const std::string &type_,const std::string &hex_):type(type_),hex(hex_){}
+        std::string type;               // MD5, SHA1 or SHA256, as DFXML has it
+        std::string hex;
+    };
+    typedef std::vector<digest> digests_t;
+
+    static std::string names;           // -S flow_hashes
+    static unsigned    algs;            // names, as alg_t bits
+    static bool        enabled;         // the md5 scanner is on; set by tcpflow.cpp
+    static unsigned    parse(const std::string &names); // md5,sha1,sha256 as alg_t bits; 0 if a name is unknown
+    static bool        available();     // false if tcpflow was built without OpenSSL
+
+    class context {
+        context(const context &);
+        context &operator=(const context &);
+    public:
+        explicit context(unsigned which_algs_);
+        ~context();
+        void reset();                   // start again, for the next flow or body
+        void update(const uint8_t *data,size_t length);
+        void final(digests_t &d);       // then reset() before it is used again
+        unsigned which() const { return which_algs; }
+    private:
+        unsigned which_algs;
+        void     *ctx[ALG_COUNT];       // EVP_MD_CTX, by alg_t bit
+    };
+
+    static void hash(unsigned algs,const uint8_t *data,size_t length,digests_t &d);
+    static std::string hexdigest(alg_t a,const uint8_t *data,size_t length);
+    static std::string xml(const digests_t &d); // <hashdigest type='...'> elements
+};
+
+#endif
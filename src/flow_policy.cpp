@@ -0,0 +1,280 @@
+/**
+ *
+ * flow_policy.cpp
+ * What is kept of each connection, by a table of rules. See flow_policy.h
+ *
+ * This source code is under the GNU Public License (GPL).  See
+ * LICENSE for details.
+ *
+ */
+
+#include "tcpflow.h"
+#include "tcpip.h"
+#include "tcpdemux.h"
+#include "flow_policy.h"
+
+#include <fstream>
+#include <sstream>
+
+/* static */ std::string flow_policy::path;
+/* static */ std::vector<flow_policy::rule> flow_policy::rules;
+/* static */ std::atomic<uint64_t> *flow_policy::connections = 0;
+
+bool flow_policy::cidr::matches(const uint8_t *a,int fam) const
+{
+    if(fam!=family) return false;
+    int whole = len/8;
+    if(memcmp(a,addr,whole)) return false;
+    int bits = len%8;
+    if(bits==0) return true;
+    uint8_t mask = (uint8_t)(0xff << (8-bits));
+    return (a[whole] & mask) == (addr[whole] & mask);
+}
+
+static bool parse_cidr(const std::string &s,int &family,uint8_t *addr,int &len)
+{
+    size_t slash = s.find('/');
+    std::string a = s.substr(0,slash);
+    memset(addr,0,16);
+    if(inet_pton(AF_INET,a.c_str(),addr)==1){
+        family = AF_INET;
+        len = 32;
+    } else if(inet_pton(AF_INET6,a.c_str(),addr)==1){
+        family = AF_INET6;
+        len = 128;
+    } else {
+        return false;
+    }
+    if(slash!=std::string::npos){
+        char *end = 0;
+        long n = strtol(s.c_str()+slash+1,&end,10);
+        if(end==s.c_str()+slash+1 || *end || n<0 || n>len) return false;
+        len = (int)n;
+    }
+    return true;
+}
+
+static bool parse_ports(const std::string &s,uint16_t &lo,uint16_t &hi)
+{
+    unsigned a=0,b=0;
+    char extra;
+    if(sscanf(s.c_str(),"%u-%u%c",&a,&b,&extra)==2){
+        // a range
+    } else if(sscanf(s.c_str(),"%u%c",&a,&extra)==1){
+        b = a;
+    } else {
+        return false;
+    }
+    if(a>65535 || b>65535 || a>b) return false;
+    lo = a;
+    hi = b;
+    return true;
+}
+
+static bool parse_mac(const std::string &s,std::string &mac)
+{
+    unsigned b[6];
+    char extra;
+    if(sscanf(s.c_str(),"%x:%x:%x:%x:%x:%x%c",&b[0],&b[1],&b[2],&b[3],&b[4],&b[5],&extra)!=6) return false;
+    mac.clear();
+    for(int i=0;i<6;i++){
+        if(b[i]>255) return false;
+        mac.push_back((char)b[i]);
+    }
+    return true;
+}
+
+/* static */ bool flow_policy::parse(const std::string &line,rule &r,std::string &error)
+{
+    std::stringstream ss(line);
+    std::string word;
+    ss >> word;
+    if(word=="store"){
+        r.act = STORE;
+    } else if(word=="truncate"){
+        r.act = TRUNCATE;
+        std::string n;
+        char *end = 0;
+        if(!(ss >> n) || (r.max_bytes = strtoll(n.c_str(),&end,10))<0 || *end || end==n.c_str()){
+            error = "truncate needs a number of bytes";
+            return false;
+        }
+    } else if(word=="metadata"){
+        r.act = METADATA_ONLY;
+    } else if(word=="drop"){
+        r.act = DROP;
+    } else if(word=="tls"){
+        r.act = TLS_ONLY;
+    } else {
+        error = "unknown action " + word;
+        return false;
+    }
+    std::string what,arg;
+    while(ss >> what){
+        if(!(ss >> arg)){
+            error = what + " needs a value";
+            return false;
+        }
+        if(what=="net" || what=="src" || what=="dst"){
+            cidr c;
+            if(!parse_cidr(arg,c.family,c.addr,c.len)){
+                error = "bad address " + arg;
+                return false;
+            }
+            (what=="net" ? r.net : what=="src" ? r.src : r.dst).push_back(c);
+        } else if(what=="port" || what=="sport" || what=="dport"){
+            ports p;
+            if(!parse_ports(arg,p.lo,p.hi)){
+                error = "bad port " + arg;
+                return false;
+            }
+            (what=="port" ? r.port : what=="sport" ? r.sport : r.dport).push_back(p);
+        } else if(what=="vlan"){
+            char *end = 0;
+            long v = strtol(arg.c_str(),&end,10);
+            if(end==arg.c_str() || *end || v<0 || v>4095){
+                error = "bad vlan " + arg;
+                return false;
+            }
+            r.vlan.push_back((int32_t)v);
+        } else if(what=="mac"){
+            std::string m;
+            if(!parse_mac(arg,m)){
+                error = "bad mac " + arg;
+                return false;
+            }
+            r.mac.push_back(m);
+        } else {
+            error = "unknown condition " + what;
+            return false;
+        }
+    }
+    return true;
+}
+
+/* static */ bool flow_policy::load(const std::string &file,std::string &error)
+{
+    std::ifstream in(file.c_str());
+    if(!in.is_open()){
+        error = file + ": " + strerror(errno);
+        return false;
+    }
+    rules.clear();
+    std::string line;
+    unsigned lineno = 0;
+    while(std::getline(in,line)){
+        lineno++;
+        size_t hash = line.find('#');
+        if(hash!=std::string::npos) line.erase(hash);
+        size_t b = line.find_first_not_of(" \t\r");
+        if(b==std::string::npos) continue;
+        size_t e = line.find_last_not_of(" \t\r");
+        rule r;
+        r.line = lineno;
+        r.text = line.substr(b,e+1-b);
+        if(!parse(r.text,r,error)){
+            std::stringstream ss;
+            ss << file << ":" << lineno << ": " << error;
+            error = ss.str();
+            return false;
+        }
+        if(rules.size()>=0xffff){
+            error = file + ": too many rules";
+            return false;
+        }
+        rules.push_back(r);
+    }
+    delete[] connections;
+    connections = new std::atomic<uint64_t>[rules.size()];
+    for(size_t i=0;i<rules.size();i++) connections[i] = 0;
+    return true;
+}
+
+template<class T,class F>
+static bool holds(const std::vector<T> &v,F test)
+{
+    if(v.empty()) return true;          // not a condition of the rule
+    for(typename std::vector<T>::const_iterator it=v.begin();it!=v.end();it++){
+        if(test(*it)) return true;
+    }
+    return false;
+}
+
+bool flow_policy::rule::matches(const flow &f) const
+{
+    return holds(net,  [&](const cidr &c){ return c.matches(f.src.addr,f.family) || c.matches(f.dst.addr,f.family); })
+        && holds(src,  [&](const cidr &c){ return c.matches(f.src.addr,f.family); })
+        && holds(dst,  [&](const cidr &c){ return c.matches(f.dst.addr,f.family); })
+        && holds(port, [&](const ports &p){ return p.matches(f.sport) || p.matches(f.dport); })
+        && holds(sport,[&](const ports &p){ return p.matches(f.sport); })
+        && holds(dport,[&](const ports &p){ return p.matches(f.dport); })
+        && holds(vlan, [&](int32_t v){ return f.vlan==v; })
+        && holds(mac,  [&](const std::string &m){
+                return memcmp(m.data(),f.mac_saddr,6)==0 || memcmp(m.data(),f.mac_daddr,6)==0; });
+}
+
+/* static */ uint16_t flow_policy::match(const flow &f)
+{
+    for(size_t i=0;i<rules.size();i++){
+        if(rules[i].matches(f)) return (uint16_t)(i+1);
+    }
+    return 0;
+}
+
+/* static */ void flow_policy::apply(tcpip &tcp,const tcpip *other)
+{
+    uint16_t n;
+    if(other){
+        n = other->policy;
+    } else {
+        n = match(tcp.myflow);
+        if(n) connections[n-1].fetch_add(1,std::memory_order_relaxed);
+    }
+    tcp.policy = n;
+    if(n==0) return;
+    const rule &r = rules[n-1];
+    switch(r.act){
+    case TRUNCATE:
+        if(tcp.max_bytes<0 || tcp.max_bytes>r.max_bytes) tcp.max_bytes = r.max_bytes;
+        break;
+    case METADATA_ONLY:
+    case DROP:
+        tcp.transcript = false;
+        tcp.bypass     = true;
+        break;
+    case TLS_ONLY:
+        tcp.transcript = false;         // bypass once the hello is parsed; see tcpip::store_packet()
+        break;
+    case STORE:
+        break;
+    }
+}
+
+/* static */ flow_policy::action_t flow_policy::action(const tcpip &tcp)
+{
+    return tcp.policy ? rules[tcp.policy-1].act : STORE;
+}
+
+/* static */ const char *flow_policy::action_name(action_t a)
+{
+    switch(a){
+    case STORE:         return "store";
+    case TRUNCATE:      return "truncate";
+    case METADATA_ONLY: return "metadata";
+    case DROP:          return "drop";
+    case TLS_ONLY:      return "tls";
+    }
+    return "";
+}
+
+/* static */ void flow_policy::dump_xml(dfxml_writer *xreport)
+{
+    std::stringstream ss;
+    for(size_t i=0;i<rules.size();i++){
+        ss << "<rule id='" << i+1 << "' line='" << rules[i].line << "' action='" << action_name(rules[i].act)
+           << "' connections='" << connections[i].load() << "'>" << dfxml_writer::xmlescape(rules[i].text) << "</rule>";
+    }
+    std::stringstream attrs;
+    attrs << "file='" << dfxml_writer::xmlescape(path) << "'";
+    xreport->xmlout("flow_policy",ss.str(),attrs.str(),false);
+}
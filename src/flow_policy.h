@@ -0,0 +1,114 @@
+#ifndef FLOW_POLICY_H
+#define FLOW_POLICY_H
+
+/**
+ * flow_policy.h
+ *
+ * What is kept of each connection, by a table of rules in the file given
+ * with -S flow_policy=file, so that bulk flows nobody will read (backups,
+ * video) do not take the write and scan path that the others need.
+ *
+ * Each line is an action and the conditions a connection must meet for
+ * it; the first rule a connection meets is its rule, and a connection
+ * that meets none is kept as the other options say. # starts a comment.
+ *
+ *   # action        conditions
+ *   drop            port 873
+ *   metadata        port 554 vlan 20
+ *   tls             port 443
+ *   truncate 65536  port 443 net 10.1.0.0/16
+ *   store           mac 00:1b:21:3a:4f:10
+ *
+ * The actions:
+ *
+ *   store          as without a rule, but no other rule is looked at
+ *   truncate N     keep the first N bytes of each direction, as -b does
+ *   metadata       no transcript and no scan; the flows are reported
+ *   drop           no transcript, no scan and no report; only counted
+ *   tls            as metadata, but the TLS hello of each direction that
+ *                  starts with one is parsed first; see tls_stream.h
+ *
+ * The conditions, all of which have to hold (one given more than once
+ * holds if any of them does, so "port 80 port 8080" is either):
+ *
+ *   net CIDR       either address is in CIDR (an address alone is /32 or /128)
+ *   src CIDR       the address the connection's first packet came from
+ *   dst CIDR       the address it went to
+ *   port P[-Q]     either port is P, or from P to Q
+ *   sport P[-Q]    the port of src
+ *   dport P[-Q]    the port of dst
+ *   vlan N         the VLAN of the connection's first packet
+ *   mac M          either Ethernet address of the connection's first packet
+ *
+ * The rule is looked up once, when the first direction of a connection
+ * is created, and kept in its tcpip; the other direction takes the same
+ * rule. A metadata or drop flow's packets are only counted, without a
+ * look at their data, and so are a tls flow's once its hello is parsed. Each reported flow with a rule says so in the
+ * report with <flow_policy rule='n' action='...'/>, and <flow_policy> at
+ * the end of the report says how many connections each rule had.
+ *
+ * -K (and -Z, which is -K) splits the packets by connection before this
+ * and is not affected.
+ *
+ * This source code is under the GNU Public License (GPL).  See
+ * LICENSE for details.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <atomic>
+
+class flow_policy {
+public:
+    enum action_t { STORE, TRUNCATE, METADATA_ONLY, DROP, TLS_ONLY };
+
+    static std::string path;            // -S flow_policy
+
+    /* Reads the rules; false, with error, if the file cannot be read or a line is wrong */
+    static bool load(const std::string &file,std::string &error);
+    static bool active() { return rules.size()>0; }
+
+    /* Gives tcp its rule, that of other if the other direction has one */
+    static void apply(class tcpip &tcp,const class tcpip *other);
+    static action_t action(const class tcpip &tcp);
+    static const char *action_name(action_t a);
+
+    static void dump_xml(class dfxml_writer *xreport); // <flow_policy>
+
+private:
+    struct cidr {
+        cidr():family(0),len(0){ memset(addr,0,sizeof(addr)); }
+        int     family;
+        uint8_t addr[16];
+        int     len;
+        bool matches(const uint8_t *a,int fam) const;
+    };
+    struct ports {
+        ports():lo(0),hi(0){}
+        uint16_t lo,hi;
+        bool matches(uint16_t p) const { return lo<=p && p<=hi; }
+    };
+    struct rule {
+        rule():line(0),text(),act(STORE),max_bytes(0),net(),src(),dst(),port(),sport(),dport(),
+               vlan(),mac(){}
+        unsigned    line;               // in the file
+        std::string text;               // as it was given, for the report
+        action_t    act;
+        int64_t     max_bytes;          // truncate
+        std::vector<cidr>    net,src,dst;
+        std::vector<ports>   port,sport,dport;
+        std::vector<int32_t> vlan;
+        std::vector<std::string> mac;   // 6 bytes each
+        bool matches(const class flow &f) const;
+    };
+
+    static std::vector<rule> rules;
+    static std::atomic<uint64_t> *connections; // for each rule
+
+    static uint16_t match(const class flow &f); // 1 + the rule f meets; 0 for none
+    static bool parse(const std::string &line,rule &r,std::string &error);
+};
+
+#endif
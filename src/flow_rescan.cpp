@@ -0,0 +1,190 @@
+/**
+ *
+ * flow_rescan.cpp
+ * The scanners over the flows of an earlier run. See flow_rescan.h
+ *
+ * This source code is under the GNU Public License (GPL).  See
+ * LICENSE for details.
+ *
+ */
+
+#include "tcpflow.h"
+#include "tcpip.h"
+#include "tcpdemux.h"
+#include "scan_pool.h"
+#include "segment_reader.h"
+#include "flow_rescan.h"
+
+#include <vector>
+#include <algorithm>
+#include <map>
+#include <sstream>
+#include <thread>
+#include <mutex>
+#include <atomic>
+
+#include <dirent.h>
+#include <limits.h>
+
+/* A flow to scan */
+struct rescan_item {
+    rescan_item():rel(),path(),obj(0){}
+    std::string rel;                    // its name, relative to the directory
+    std::string path;                   // the transcript; "" if it is in the segments
+    const segment_reader::object *obj;  // the flow, if it is in the segments
+    bool operator<(const rescan_item &b) const { return rel < b.rel; }
+};
+
+static bool ends_with(const std::string &s,const char *suffix)
+{
+    size_t n = strlen(suffix);
+    return s.size()>=n && s.compare(s.size()-n,n,suffix)==0;
+}
+
+/* The files tcpflow writes that are not flows */
+static bool not_a_flow(const std::string &fn)
+{
+    static const char *suffixes[] = {".xml",".jsonl",".json",".txt",".findx",".findb",".pcap",".pcapng",
+                                     ".arrows",".db",".db-wal",".db-shm",".idx",0};
+    if(fn.empty() || fn[0]=='.') return true;
+    if(fn.find("-HTTPBODY-")!=std::string::npos) return true;
+    if(fn.compare(0,8,"segment-")==0) return true;
+    for(const char **s=suffixes;*s;s++){
+        if(ends_with(fn,*s)) return true;
+    }
+    return false;
+}
+
+static void walk(const std::string &dir,const std::string &rel,const std::string &skip,
+                 std::vector<rescan_item> &items)
+{
+    DIR *dirp = opendir(dir.c_str());
+    if(dirp==0){
+        DEBUG(1)("%s: %s",dir.c_str(),strerror(errno));
+        return;
+    }
+    struct dirent *dp = 0;
+    while((dp=readdir(dirp))!=0){
+        std::string fn(dp->d_name);
+        if(fn=="." || fn=="..") continue;
+        std::string path = dir + "/" + fn;
+        struct stat st;
+        if(lstat(path.c_str(),&st)) continue;
+        std::string name = rel.empty() ? fn : rel + "/" + fn;
+        if(S_ISDIR(st.st_mode)){
+            if(path!=skip) walk(path,name,skip,items); // not the -o directory, if it is in dir
+        } else if(S_ISREG(st.st_mode) && !not_a_flow(fn)){
+            rescan_item it;
+            it.rel  = name;
+            it.path = path;
+            items.push_back(it);
+        }
+    }
+    closedir(dirp);
+}
+
+static std::string real(const std::string &path)
+{
+    char buf[PATH_MAX];
+    return realpath(path.c_str(),buf) ? std::string(buf) : path;
+}
+
+/* static */ int64_t flow_rescan::run(tcpdemux &demux,const std::string &dir,unsigned int threads,std::string &error)
+{
+    std::string from = real(dir);
+    std::string to   = real(demux.outdir);
+    if(from==to){
+        error = "--rescan needs an output directory (-o) other than " + dir;
+        return -1;
+    }
+
+    /* the flows: those in the segments, or else the transcripts */
+    segment_reader segments(dir);
+    if(segments.open(error)) return -1;
+    std::vector<rescan_item> items;
+    for(segment_reader::objects_t::const_iterator it=segments.objects().begin();it!=segments.objects().end();it++){
+        if(it->name.find("-HTTPBODY-")!=std::string::npos) continue;
+        rescan_item item;
+        item.rel = it->name;
+        item.obj = &*it;
+        items.push_back(item);
+    }
+    if(items.empty()) walk(dir,"",to,items);
+    std::stable_sort(items.begin(),items.end());
+    DEBUG(1)("rescanning %zu flows in %s on %u threads",items.size(),dir.c_str(),threads);
+
+    if(threads<1) threads = 1;
+    if(threads>items.size()) threads = std::max((size_t)1,items.size());
+    std::vector<tcpdemux *> demuxes;
+    for(unsigned int i=0;i<threads;i++){
+        demuxes.push_back(demux.make_worker(tcpdemux::SCAN_SHARD_BASE+i,1));
+    }
+
+    std::atomic<size_t>     next(0);    // the next item nobody has taken
+    std::mutex              scan_M;     // the scanners run one flow at a time
+    std::mutex              report_M;   // protects done and next_report
+    std::map<size_t,std::string> done;  // reports waiting for an earlier one
+    size_t                  next_report = 0;
+    std::atomic<int64_t>    scanned(0);
+
+    auto work = [&](unsigned int t){
+        tcpdemux::set_thread_instance(demuxes[t]);
+        size_t n;
+        while((n=next.fetch_add(1))<items.size()){
+            const rescan_item &item = items[n];
+            scan_pool::job j(demux.fs,demux.xreport);
+            j.scan = true;
+            j.name = demux.outdir + "/" + item.rel;
+            uint64_t filesize = 0;
+            if(item.obj){
+                std::string e;
+                if(segments.read(*item.obj,j.contents,e)){
+                    DEBUG(1)("%s",e.c_str());
+                } else {
+                    j.in_memory = true;
+                }
+                filesize = j.contents.size();
+            } else {
+                j.path = item.path;
+                if(ends_with(j.name,".zst")){
+                    j.zstd = true;
+                    j.name.erase(j.name.size()-4);
+                }
+                struct stat st;
+                if(stat(j.path.c_str(),&st)==0) filesize = st.st_size;
+            }
+            mkdirs_for_path(j.name);    // for what the scanners write beside it
+            if(j.in_memory || j.path.size()){
+                scan_pool::scan(j,scan_M);
+                scanned++;
+            }
+
+            std::stringstream ss;
+            ss << "<fileobject><filename>" << dfxml_writer::xmlescape(item.obj ? item.rel : item.path)
+               << "</filename><filesize>" << filesize << "</filesize>" << j.xmladd << "</fileobject>";
+            std::lock_guard<std::mutex> lock(report_M);
+            done[n] = ss.str();
+            while(!done.empty() && done.begin()->first==next_report){
+                if(demux.xreport){
+                    std::lock_guard<std::mutex> out(tcpdemux::output_M);
+                    demux.xreport->xmlout("",done.begin()->second,"",false);
+                    demux.xreport->flush();
+                }
+                done.erase(done.begin());
+                next_report++;
+            }
+        }
+        tcpdemux::set_thread_instance(0);
+    };
+    std::vector<std::thread> workers;
+    for(unsigned int t=0;t<threads;t++) workers.push_back(std::thread(work,t));
+    for(std::vector<std::thread>::iterator it=workers.begin();it!=workers.end();it++) it->join();
+
+    for(std::vector<tcpdemux *>::iterator it=demuxes.begin();it!=demuxes.end();it++){
+        /* the report and packet writer belong to the parent demux */
+        (*it)->xreport = 0;
+        (*it)->pwriter = 0;
+        delete *it;
+    }
+    return scanned.load();
+}
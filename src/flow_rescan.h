@@ -0,0 +1,51 @@
+#ifndef FLOW_RESCAN_H
+#define FLOW_RESCAN_H
+
+/**
+ * flow_rescan.h
+ *
+ * Running the scanners again over the flows of an earlier run, with
+ * --rescan=DIR, without the packets: after a new scanner is added, or
+ * one is fixed, the flows already on disk are scanned as if they had
+ * just been finished, and a fresh report and fresh feature files go to
+ * the -o directory, which has to be another one than DIR.
+ *
+ * The flows are the transcripts found under DIR (its subdirectories too,
+ * as -F and the filename template make them), or, when DIR has --segments
+ * output, the flows its index lists. The other files tcpflow writes (the
+ * report, feature files, -I indexes, HTTP bodies, packet files and so on)
+ * are not flows and are passed over; a -S compress=zstd transcript is
+ * scanned as the flow it holds.
+ *
+ * The list is made first, sorted by name, and each of the threads takes
+ * the next flow on it that no other thread has taken, so that a thread
+ * that finished a small flow does not wait behind one given a big one.
+ * A thread maps its transcript (or reads it out of the segments) and
+ * runs the scanners on it, which still scan one flow at a time, since
+ * they are not thread-safe; the threads take the reading, mapping and
+ * decompression off one another. As with scan_pool, each thread has a
+ * demux of its own, and the <fileobject>s go to the report in the order
+ * of the list:
+ *
+ *   <fileobject><filename>DIR/...</filename><filesize>N</filesize>
+ *     ...what the scanners found...</fileobject>
+ *
+ * What the scanners write beside the flow (scan_http's bodies) is put
+ * where the flow would be in the -o directory.
+ *
+ * This source code is under the GNU Public License (GPL).  See
+ * LICENSE for details.
+ */
+
+#include <stdint.h>
+#include <string>
+
+class flow_rescan {
+public:
+    /* Scans the flows in dir on threads threads, as demux is configured.
+     * Returns the number of flows scanned, or -1 with error set.
+     */
+    static int64_t run(class tcpdemux &demux,const std::string &dir,unsigned int threads,std::string &error);
+};
+
+#endif
@@ -0,0 +1,180 @@
+#ifndef FLOW_TABLE_H
+#define FLOW_TABLE_H
+
+#include <vector>
+#include <utility>
+#include <cstddef>
+#include <stdint.h>
+
+// An open-addressing hash table (Robin Hood probing with backward-shift deletion)
+// used for the tcpdemux flow tables.
+//
+// Entries live in one flat array together with their stored hash, so a lookup
+// usually touches a single cache line and only compares keys whose hash matches.
+// The interface is the subset of std::unordered_map that tcpdemux uses:
+// find(), operator[], erase(), begin()/end(), size() and clear().
+//
+// As with any open-addressing table, insert and erase invalidate iterators.
+
+template <class K, class V, class Hash, class Eq>
+class flow_table {
+  public:
+  typedef std::pair<K,V> value_type;
+
+  private:
+  struct slot {
+    slot():hash(0), dist(0), kv() {}
+    uint32_t hash;                       // stored hash of kv.first
+    uint32_t dist;                       // 0 if empty, otherwise 1 + distance from the home slot
+    value_type kv;
+  };
+
+  template <class TABLE, class VALUE>
+  class basic_iterator {
+    public:
+    basic_iterator():t(0), i(0) {}
+    basic_iterator(TABLE *t_, size_t i_):t(t_), i(i_) { skip(); }
+    template <class T2, class V2>
+    basic_iterator(const basic_iterator<T2,V2> &that):t(that.t), i(that.i) {}
+
+    VALUE &operator*() const { return t->slots[i].kv; }
+    VALUE *operator->() const { return &t->slots[i].kv; }
+    basic_iterator &operator++() { i++; skip(); return *this; }
+    basic_iterator operator++(int) { basic_iterator r(*this); ++(*this); return r; }
+    template <class T2, class V2>
+    bool operator==(const basic_iterator<T2,V2> &b) const { return i==b.i; }
+    template <class T2, class V2>
+    bool operator!=(const basic_iterator<T2,V2> &b) const { return i!=b.i; }
+
+    TABLE *t;
+    size_t i;                            // slot index; slots.size() is end()
+
+    private:
+    void skip() { while (i < t->slots.size() && t->slots[i].dist==0) i++; }
+  };
+
+  public:
+  typedef basic_iterator<flow_table,value_type> iterator;
+  typedef basic_iterator<const flow_table,const value_type> const_iterator;
+
+  enum { MIN_CAPACITY = 16 };            // must be a power of 2
+
+  flow_table(size_t capacity=0):slots(), mask(0), count(0), hasher(), eq() {
+    rehash(capacity_for(capacity));
+  }
+
+  iterator begin() { return iterator(this, 0); }
+  iterator end() { return iterator(this, slots.size()); }
+  const_iterator begin() const { return const_iterator(this, 0); }
+  const_iterator end() const { return const_iterator(this, slots.size()); }
+
+  size_t size() const { return count; }
+  bool empty() const { return count==0; }
+  size_t capacity() const { return slots.size(); }
+
+  iterator find(const K &k) { return iterator(this, find_index(k, hash_of(k))); }
+  const_iterator find(const K &k) const { return const_iterator(this, find_index(k, hash_of(k))); }
+
+  V &operator[](const K &k) {
+    uint32_t h = hash_of(k);
+    size_t i = find_index(k, h);
+    if (i != slots.size()) return slots[i].kv.second;
+    if ((count+1)*5 > slots.size()*4) rehash(slots.size()*2);   // keep the load below 80%
+    return slots[insert_new(value_type(k, V()), h)].kv.second;
+  }
+
+  // Start loading the cache line where a lookup of k begins, so that a
+  // find() shortly afterwards does not wait on memory.
+  void prefetch(const K &k) const { __builtin_prefetch(&slots[hash_of(k) & mask]); }
+
+  void erase(iterator it) { erase_index(it.i); }
+  void erase(const_iterator it) { erase_index(it.i); }
+  size_t erase(const K &k) {
+    size_t i = find_index(k, hash_of(k));
+    if (i == slots.size()) return 0;
+    erase_index(i);
+    return 1;
+  }
+
+  void clear() {
+    for (size_t i=0; i<slots.size(); i++) slots[i] = slot();
+    count = 0;
+  }
+
+  private:
+  static size_t capacity_for(size_t n) {
+    size_t cap = MIN_CAPACITY;
+    while (cap*4 < n*5) cap *= 2;
+    return cap;
+  }
+
+  uint32_t hash_of(const K &k) const {
+    uint64_t h = hasher(k);
+    return (uint32_t)(h ^ (h>>32));
+  }
+
+  size_t find_index(const K &k, uint32_t h) const {
+    size_t i = h & mask;
+    for (uint32_t dist=1; ; dist++) {
+      const slot &s = slots[i];
+      if (s.dist < dist) return slots.size();  // empty, or we would have displaced it
+      if (s.hash==h && eq(s.kv.first, k)) return i;
+      i = (i+1) & mask;
+    }
+  }
+
+  /* insert a key known not to be present; returns where it was put */
+  size_t insert_new(value_type kv, uint32_t h) {
+    size_t i = h & mask;
+    size_t result = slots.size();
+    for (uint32_t dist=1; ; dist++) {
+      slot &s = slots[i];
+      if (s.dist==0) {
+        s.hash = h;
+        s.dist = dist;
+        s.kv = kv;
+        count++;
+        return result==slots.size() ? i : result;
+      }
+      if (s.dist < dist) {               // take from the rich
+        std::swap(h, s.hash);
+        std::swap(dist, s.dist);
+        std::swap(kv, s.kv);
+        if (result==slots.size()) result = i;
+      }
+      i = (i+1) & mask;
+    }
+  }
+
+  void erase_index(size_t i) {
+    if (i >= slots.size() || slots[i].dist==0) return;
+    size_t next = (i+1) & mask;
+    while (slots[next].dist > 1) {       // shift the following run back by one
+      slots[i] = slots[next];
+      slots[i].dist--;
+      i = next;
+      next = (i+1) & mask;
+    }
+    slots[i] = slot();
+    count--;
+  }
+
+  void rehash(size_t newcap) {
+    std::vector<slot> old;
+    old.swap(slots);
+    slots.resize(newcap);
+    mask = newcap-1;
+    count = 0;
+    for (size_t i=0; i<old.size(); i++) {
+      if (old[i].dist) insert_new(old[i].kv, old[i].hash);
+    }
+  }
+
+  std::vector<slot> slots;
+  size_t mask;
+  size_t count;
+  Hash hasher;
+  Eq eq;
+};
+
+#endif // FLOW_TABLE_H
@@ -0,0 +1,62 @@
+/*
+ * http_stream.h:
+ *
+ * scan_http, driven by the bytes of a flow as they are stored, with
+ * -S http_stream=1 (and -e http).
+ *
+ * A flow whose first bytes are an HTTP response gets an http_stream in
+ * its tcpip. tcpip::write_segment() feeds it the flow in order, and the
+ * HTTP bodies are written out as they arrive, so the transcript does not
+ * have to be read and parsed again when the flow is finished. With
+ * -S http_bodies_only=1 such a flow's transcript is not written at all.
+ *
+ * A gap, or bytes put in front of the flow, ends the parsing. Finished
+ * flows that were parsed to the end are marked in stream_scan, so that
+ * scan_http skips them when the scanners run; the others are scanned from
+ * their transcripts as before (there is none to scan with http_bodies_only).
+ *
+ * This source code is under the GNU Public License (GPL).  See
+ * LICENSE for details.
+ */
+
+#ifndef HTTP_STREAM_H
+#define HTTP_STREAM_H
+
+#include <stdint.h>
+#include <string>
+#include <sstream>
+
+class http_stream {
+    http_stream(const http_stream &);
+    http_stream &operator=(const http_stream &);
+
+public:
+    static bool enabled;                // -S http_stream
+    static bool bodies_only;            // -S http_bodies_only
+    static bool active;                 // enabled, and the http scanner is on; set by tcpflow.cpp
+    static bool starts_response(const uint8_t *data,size_t length); // HTTP/1. at the start of a flow
+
+    explicit http_stream(const std::string &path); // bodies are named after path
+    ~http_stream();
+
+    void feed(uint64_t offset,const uint8_t *data,size_t length);
+    void give_up();                     // the rest of the flow cannot be parsed in order
+    /* Flush the parser and, if the flow was parsed to the end, add the
+     * <byte_runs> to xmladd.
+     */
+    bool finish(std::string &xmladd);   // false if the flow has to be scanned again
+
+private:
+    const std::string path;
+    struct http_parser *parser;
+    class scan_http_cbo *cbo;
+    std::stringstream xml;
+    uint64_t next;                      // offset in the flow of the next byte to parse
+    uint64_t started_at;                // where the current parser began
+    bool     stopped;                   // nothing more is parsed
+    bool     broken;                    // stopped by a gap, so the flow has to be scanned again
+
+    void start(uint64_t offset);        // a new parser and callback object, as scan_http does after an error
+};
+
+#endif
@@ -1,66 +1,136 @@
 #ifndef INTRUSIVE_LIST_H
 #define INTRUSIVE_LIST_H
 
-#include <iostream>
-#include <list>
+#include <cstddef>
 
-// implement boost::intrusive::list using std::list
+// A doubly-linked list whose links live in the nodes themselves.
+// push_back(), erase() and move_to_end() never allocate.
+//
+// T must have a public member
+//     intrusive_list_hook<T> it;
+// A node can be on at most one intrusive_list at a time.
+//
+// Besides exact LRU order (move_to_end() on every use), the list supports
+// CLOCK / second-chance replacement: touch() just marks a node as recently
+// used, and clock_victim() skips (and requeues) marked nodes when looking
+// for one to evict. That keeps the per-use cost to a single store.
+
+template <class T>
+class intrusive_list_hook {
+  public:
+  intrusive_list_hook():prev(0), next(0), linked(false), referenced(false) {}
+  T *prev;
+  T *next;
+  bool linked;
+  bool referenced;                       // touched since it was last considered by clock_victim()
+};
 
 template <class T>
 class intrusive_list {
+  intrusive_list(const intrusive_list &);
+  intrusive_list &operator=(const intrusive_list &);
+
   public:
-  intrusive_list():li(), len(0) {}
-  
-  typedef typename std::list<T*>::iterator iterator;
-  
+  intrusive_list():head(0), tail(0), len(0) {}
+
+  class iterator {
+    public:
+    iterator(T *node_=0):node(node_) {}
+    T *operator*() const { return node; }
+    iterator &operator++() { node = node->it.next; return *this; }
+    bool operator==(const iterator &b) const { return node==b.node; }
+    bool operator!=(const iterator &b) const { return node!=b.node; }
+    private:
+    T *node;
+  };
+
   inline void push_back(T* node) {
-    li.push_back(node);
+    if (node->it.linked)
+      return;
+    node->it.prev = tail;
+    node->it.next = 0;
+    node->it.linked = true;
+    node->it.referenced = false;
+    if (tail) tail->it.next = node; else head = node;
+    tail = node;
     len++;
-    node->it = --li.end();
   }
 
   inline void erase(T* node) {
     if (!is_linked(node))
       return;
-    li.erase(node->it);
+    unlink(node);
     len--;
     reset(node);
   }
-  
+
   inline void move_to_end(T* node) {
-    if (!is_linked(node))
+    if (!is_linked(node) || node == tail)
       return;
-    li.splice(li.end(), li, node->it);
+    unlink(node);
+    node->it.prev = tail;
+    node->it.next = 0;
+    tail->it.next = node;
+    tail = node;
   }
-  
+
+  /* CLOCK: mark as recently used without relinking */
+  inline void touch(T* node) {
+    node->it.referenced = true;
+  }
+
+  /* CLOCK: the first node from the front that has not been touched since it was last
+   * passed over. Touched nodes get a second chance: they are cleared and moved to the end.
+   */
+  inline T* clock_victim() {
+    for (size_t i = 0; i < len; i++) {
+      if (!head->it.referenced)
+        return head;
+      head->it.referenced = false;
+      move_to_end(head);
+    }
+    return head;                         // everything was touched; now the oldest is unmarked
+  }
+
   inline void reset(T* node) {
-    node->it = li.end();
+    node->it.prev = 0;
+    node->it.next = 0;
+    node->it.linked = false;
+    node->it.referenced = false;
+  }
+
+  inline T* front() const {
+    return head;
   }
-  
-  inline bool empty() {
-    return li.empty();
+
+  inline bool empty() const {
+    return len == 0;
   }
-  
-  inline size_t size() {
-    // std::list.size() is O(n) in some platform. Is there any define flag for that?
-    //return li.size();
+
+  inline size_t size() const {
     return len;
   }
-  
+
   inline iterator begin() {
-    return li.begin();
+    return iterator(head);
   }
-  
+
   inline iterator end() {
-    return li.end();
+    return iterator(0);
   }
-  
+
   private:
   inline bool is_linked(T* node) {
-    return node->it != li.end();
+    return node->it.linked;
   }
-  
-  std::list<T*> li;
+
+  inline void unlink(T* node) {
+    if (node->it.prev) node->it.prev->it.next = node->it.next; else head = node->it.next;
+    if (node->it.next) node->it.next->it.prev = node->it.prev; else tail = node->it.prev;
+  }
+
+  T *head;
+  T *tail;
   size_t len;
 };
 
@@ -0,0 +1,247 @@
+/*
+ * ip_reassembly.cpp:
+ *
+ * Put fragmented IPv4 and IPv6 datagrams back together. See ip_reassembly.h
+ *
+ * This source code is under the GNU Public License (GPL).  See
+ * LICENSE for details.
+ */
+
+#include "tcpflow.h"
+#include "ip_reassembly.h"
+
+#include <algorithm>
+
+/* static */ bool        ip_reassembler::enabled = true;
+/* static */ uint32_t    ip_reassembler::memory_budget = 4*1024*1024;
+/* static */ uint32_t    ip_reassembler::timeout = 30;
+/* static */ std::string ip_reassembler::overlap_policy("first");
+
+static const size_t IP4_MAX_PAYLOAD = 65535 - 20;  // offset + length of any fragment must stay below this
+static const size_t IP6_MAX_PAYLOAD = 65535;       // no jumbograms
+static const size_t IP6_HEADER_LEN = 40;
+static const uint16_t IP_MF = 0x2000;
+static const uint16_t IP_OFFMASK = 0x1fff;
+
+ip_reassembler::ip_reassembler():
+    datagrams(),arrivals(),datagram_slab(),free_buffers(),buffered(0),out(),
+    completed(0),expired(0),rejected(0)
+{
+}
+
+ip_reassembler::~ip_reassembler()
+{
+    clear();
+    for(std::vector<std::vector<uint8_t> *>::iterator it=free_buffers.begin();it!=free_buffers.end();it++){
+        delete *it;
+    }
+}
+
+/* static */ bool ip_reassembler::is_fragment(const uint8_t *ip,size_t len)
+{
+    if(len < sizeof(struct be13::ip4) || (ip[0]>>4)!=4) return false;
+    uint16_t off = (ip[6]<<8) | ip[7];
+    return (off & (IP_MF|IP_OFFMASK)) != 0;
+}
+
+void ip_reassembler::drop(datagram *d)
+{
+    datagrams.erase(d->k);
+    arrivals.erase(d);
+    if(d->payload){
+        buffered -= d->payload->capacity();
+        d->payload->clear();
+        free_buffers.push_back(d->payload);
+    }
+    d->~datagram();
+    datagram_slab.release(d);
+}
+
+void ip_reassembler::clear()
+{
+    while(!arrivals.empty()) drop(arrivals.front());
+}
+
+/* Give up on the datagrams that have been waiting too long */
+void ip_reassembler::expire(const struct timeval &now)
+{
+    while(!arrivals.empty()){
+        datagram *d = arrivals.front();
+        if(now.tv_sec - d->first_seen.tv_sec <= (time_t)timeout) break;
+        DEBUG(6)("giving up on fragmented datagram id %u after %u seconds",(unsigned)d->k.id,(unsigned)timeout);
+        expired++;
+        drop(d);
+    }
+}
+
+/* Copy [offset,offset+len) of the payload in, following the overlap policy */
+void ip_reassembler::copy_in(datagram *d,size_t offset,const uint8_t *data,size_t len)
+{
+    std::vector<uint8_t> &buf = *d->payload;
+    if(buf.size() < offset+len){
+        size_t before = buf.capacity();
+        buf.resize(offset+len);
+        buffered += buf.capacity() - before;
+    }
+    if(overlap_policy=="last" || d->have.size()==0){
+        memcpy(&buf[offset],data,len);
+    } else {
+        /* only fill in the bytes that are not there yet */
+        size_t pos = offset;
+        size_t end = offset+len;
+        for(size_t i=0;i<d->have.interval_count() && pos<end;i++){
+            recon_set::interval iv = d->have.get_interval(i);
+            if(iv.end <= pos) continue;
+            if(iv.begin >= end) break;
+            if(iv.begin > pos) memcpy(&buf[pos],data+(pos-offset),iv.begin-pos);
+            pos = std::max(pos,(size_t)iv.end);
+        }
+        if(pos < end) memcpy(&buf[pos],data+(pos-offset),end-pos);
+    }
+    d->have.add(offset,len);
+}
+
+int ip_reassembler::add(const struct timeval &ts,const uint8_t *ip,size_t len,
+                        const uint8_t **datagram_,size_t *datagram_len)
+{
+    expire(ts);
+
+    const struct be13::ip4 *ip_header = (const struct be13::ip4 *)ip;
+    size_t hlen    = ip_header->ip_hl * 4;
+    size_t ip_len  = ntohs(ip_header->ip_len);
+    uint16_t off   = ntohs(ip_header->ip_off);
+    bool   more    = (off & IP_MF) != 0;
+    size_t offset  = (off & IP_OFFMASK) * 8;
+    if(hlen < sizeof(struct be13::ip4) || ip_len < hlen || len < ip_len){
+        DEBUG(6)("rejecting truncated IP fragment");
+        rejected++;
+        return -1;
+    }
+    size_t flen = ip_len - hlen;
+    if(offset+flen > IP4_MAX_PAYLOAD || (more && flen%8) || flen > memory_budget){
+        DEBUG(6)("rejecting IP fragment at offset %zu length %zu",offset,flen);
+        rejected++;
+        return -1;
+    }
+
+    key k;
+    memcpy(k.src,ip+12,4);
+    memcpy(k.dst,ip+16,4);
+    k.id     = ip_header->ip_id;
+    k.proto  = ip_header->ip_p;
+    k.family = AF_INET;
+    return insert(k,ts,ip,hlen,offset,ip+hlen,flen,more,datagram_,datagram_len);
+}
+
+int ip_reassembler::add6(const struct timeval &ts,const uint8_t *ip,size_t len,size_t fragment_header,
+                         const uint8_t **datagram_,size_t *datagram_len)
+{
+    expire(ts);
+
+    size_t ip_len = IP6_HEADER_LEN + ((ip[4]<<8) | ip[5]);
+    size_t hlen   = fragment_header + 8;    // the fragmentable part starts after the fragment header
+    if(fragment_header < IP6_HEADER_LEN || ip_len < hlen || len < ip_len){
+        DEBUG(6)("rejecting truncated IPv6 fragment");
+        rejected++;
+        return -1;
+    }
+    const uint8_t *fh = ip + fragment_header;
+    uint16_t off   = (fh[2]<<8) | fh[3];
+    bool   more    = (off & 1) != 0;
+    size_t offset  = off & ~7;
+    size_t flen    = ip_len - hlen;
+    if(offset+flen > IP6_MAX_PAYLOAD || (more && flen%8) || flen > memory_budget){
+        DEBUG(6)("rejecting IPv6 fragment at offset %zu length %zu",offset,flen);
+        rejected++;
+        return -1;
+    }
+
+    key k;
+    memcpy(k.src,ip+8,16);
+    memcpy(k.dst,ip+24,16);
+    k.id     = load32(fh+4);
+    k.proto  = fh[0];
+    k.family = AF_INET6;
+
+    /* the reassembled datagram gets the fixed header, pointing at what followed the fragment header */
+    uint8_t header[IP6_HEADER_LEN];
+    memcpy(header,ip,IP6_HEADER_LEN);
+    header[6] = fh[0];
+    return insert(k,ts,header,sizeof(header),offset,ip+hlen,flen,more,datagram_,datagram_len);
+}
+
+int ip_reassembler::insert(const key &k,const struct timeval &ts,const uint8_t *header,size_t header_len,
+                           size_t offset,const uint8_t *data,size_t flen,bool more,
+                           const uint8_t **datagram_,size_t *datagram_len)
+{
+    datagram *d = 0;
+    datagram_map_t::iterator it = datagrams.find(k);
+    if(it!=datagrams.end()){
+        d = it->second;
+    } else {
+        d = new (datagram_slab.alloc()) datagram();
+        d->k = k;
+        d->first_seen = ts;
+        if(free_buffers.size()>0){
+            d->payload = free_buffers.back();
+            free_buffers.pop_back();
+            buffered += d->payload->capacity();
+        } else {
+            d->payload = new std::vector<uint8_t>();
+        }
+        datagrams[k] = d;
+        arrivals.push_back(d);
+    }
+
+    /* the last fragment fixes the length; anything that disagrees with it is bad */
+    if(!more){
+        if((d->total && d->total!=offset+flen) || (d->have.size() && d->have.get_interval(d->have.interval_count()-1).end > offset+flen)){
+            DEBUG(6)("fragments of datagram id %u disagree about its length",(unsigned)k.id);
+            rejected++;
+            drop(d);
+            return -1;
+        }
+        d->total = offset+flen;
+    } else if(d->total && offset+flen > d->total){
+        rejected++;
+        drop(d);
+        return -1;
+    }
+    if(offset==0 && d->header.empty()) d->header.assign(header,header+header_len);
+
+    copy_in(d,offset,data,flen);
+
+    /* make room by giving up on the oldest datagrams (never this one, unless it is alone) */
+    while(buffered > memory_budget && arrivals.front()!=d){
+        DEBUG(6)("fragment buffer full; giving up on datagram id %u",(unsigned)arrivals.front()->k.id);
+        expired++;
+        drop(arrivals.front());
+    }
+    if(buffered > memory_budget){
+        expired++;
+        drop(d);
+        return -1;
+    }
+
+    if(d->total==0 || d->header.empty() || d->have.size()!=d->total) return 0;
+
+    /* complete: the first fragment's header, with the length and offset fixed up */
+    out.assign(d->header.begin(),d->header.end());
+    out.insert(out.end(),d->payload->begin(),d->payload->begin()+d->total);
+    size_t dlen = out.size();
+    if(k.family==AF_INET){
+        if(dlen > 65535) dlen = 65535;
+        out[2] = dlen >> 8;
+        out[3] = dlen & 0xff;
+        out[6] = 0;
+        out[7] = 0;
+    } else {
+        out[4] = d->total >> 8;
+        out[5] = d->total & 0xff;
+    }
+    drop(d);
+    completed++;
+    *datagram_     = &out[0];
+    *datagram_len = dlen;
+    return 1;
+}
@@ -0,0 +1,133 @@
+/*
+ * ip_reassembly.h:
+ *
+ * Put fragmented IPv4 and IPv6 datagrams back together.
+ *
+ * Fragments are held, per (source, destination, protocol, id), until
+ * the datagram is complete. The datagrams being reassembled are kept
+ * in the order their first fragment arrived. They are given up when
+ * they have waited longer than timeout seconds (of packet time), or
+ * when the buffered bytes would exceed memory_budget. In both cases the
+ * oldest goes first.
+ *
+ * Overlapping fragments are resolved by overlap_policy: "first" keeps
+ * the bytes that arrived first (as BSD and Windows hosts do), and "last"
+ * lets later fragments overwrite them.
+ *
+ * Datagram records come from a slab and their buffers are recycled
+ * through a free list, so steady fragment traffic does not allocate.
+ * IPv4 and IPv6 datagrams share the slab, the buffers and the budget.
+ *
+ * A reassembled IPv6 datagram has only the fixed header, with the next
+ * header taken from the fragment header; the extension headers before
+ * the fragment header (hop-by-hop, routing) are left out.
+ *
+ * Not thread-safe; each tcpdemux, and the tcpdemux_pool dispatcher, has
+ * its own.
+ *
+ * This source code is under the GNU Public License (GPL).  See
+ * LICENSE for details.
+ */
+
+#ifndef IP_REASSEMBLY_H
+#define IP_REASSEMBLY_H
+
+#include "tcpflow.h"
+#include "tcpip.h"
+#include "recon_set.h"
+#include "slab_allocator.h"
+#include "intrusive_list.h"
+#include "flow_table.h"
+
+#include <string>
+#include <vector>
+
+class ip_reassembler {
+    struct key {
+        key():src(),dst(),id(0),proto(0),family(0){}
+        uint8_t  src[16];                   // IPv4 addresses use the first 4 bytes
+        uint8_t  dst[16];
+        uint32_t id;
+        uint8_t  proto;
+        uint8_t  family;                    // AF_INET or AF_INET6
+    };
+    struct key_hash {
+        uint64_t operator()(const key &k) const {
+            uint64_t h = hash_mix64((uint64_t)k.id<<16 | k.proto<<8 | k.family);
+            for(size_t i=0;i<16;i+=8) h = hash_mix64(h ^ load64(k.src+i) ^ hash_mix64(load64(k.dst+i)));
+            return h;
+        }
+    };
+    struct key_eq {
+        bool operator()(const key &a,const key &b) const {
+            return a.id==b.id && a.proto==b.proto && a.family==b.family
+                && memcmp(a.src,b.src,16)==0 && memcmp(a.dst,b.dst,16)==0;
+        }
+    };
+
+    class datagram {
+        datagram(const datagram &);
+        datagram &operator=(const datagram &);
+    public:
+        datagram():k(),first_seen(),header(),payload(0),have(),total(0),it(){}
+        key            k;
+        struct timeval first_seen;
+        std::vector<uint8_t> header;        // for the reassembled datagram, from the fragment at offset 0
+        std::vector<uint8_t> *payload;      // from the buffer pool
+        recon_set      have;                // payload bytes received
+        size_t         total;               // payload length, once the last fragment arrives; 0 until then
+        intrusive_list_hook<datagram> it;   // arrival order
+    };
+    typedef flow_table<key,datagram *,key_hash,key_eq> datagram_map_t;
+
+    ip_reassembler(const ip_reassembler &);
+    ip_reassembler &operator=(const ip_reassembler &);
+
+    datagram_map_t           datagrams;
+    intrusive_list<datagram> arrivals;      // oldest first
+    slab_allocator<datagram> datagram_slab;
+    std::vector<std::vector<uint8_t> *> free_buffers;
+    size_t                   buffered;      // bytes of payload buffer in use
+    std::vector<uint8_t>     out;           // the last datagram put together
+
+    void expire(const struct timeval &now);
+    void drop(datagram *d);                 // give up on d
+    void copy_in(datagram *d,size_t offset,const uint8_t *data,size_t len);
+    int  insert(const key &k,const struct timeval &ts,const uint8_t *header,size_t header_len,
+                size_t offset,const uint8_t *data,size_t len,bool more,
+                const uint8_t **datagram,size_t *datagram_len);
+
+public:
+    /* Tuning; set with -S */
+    static bool        enabled;             // -S ip_defrag=0 throws fragments away, as before
+    static uint32_t    memory_budget;       // bytes of fragments held at most
+    static uint32_t    timeout;             // seconds a datagram may wait for its fragments
+    static std::string overlap_policy;      // "first" or "last"
+
+    /* statistics */
+    uint64_t completed;
+    uint64_t expired;                       // timed out or pushed out by the memory budget
+    uint64_t rejected;                      // fragments that were malformed or would never fit
+
+    ip_reassembler();
+    ~ip_reassembler();
+
+    static bool is_fragment(const uint8_t *ip,size_t len); // an IPv4 header with MF set or an offset
+
+    /* Add the IPv4 fragment ip (len bytes, from the IP header on) that arrived at ts.
+     * Returns 1 and sets datagram/datagram_len to the reassembled datagram if this
+     * fragment completed one (valid until the next call), 0 if the fragment is held,
+     * or -1 if it was rejected.
+     */
+    int  add(const struct timeval &ts,const uint8_t *ip,size_t len,
+             const uint8_t **datagram,size_t *datagram_len);
+    /* The same for an IPv6 fragment whose fragment header is at ip+fragment_header
+     * (see ip6_headers in tcpip.h).
+     */
+    int  add6(const struct timeval &ts,const uint8_t *ip,size_t len,size_t fragment_header,
+              const uint8_t **datagram,size_t *datagram_len);
+    void clear();                           // give up on every datagram
+    size_t pending() const { return datagrams.size(); }
+};
+
+#endif
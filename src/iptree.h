@@ -15,6 +15,10 @@
 #include <assert.h>
 #include <iostream>
 #include <iomanip>
+#include <vector>
+#include <string>
+#include <string.h>
+#include <stdlib.h>
 
 #ifdef HAVE_ARPA_INET_H
 #include <arpa/inet.h>
@@ -27,202 +31,211 @@
  * the iptree.
  *
  * pruning a node means cutting off its leaves (the node remains in the tree).
+ *
+ * The nodes are kept in one vector and refer to each other by index, so a
+ * node is 32 bytes or so rather than a heap allocation of its own; pruned
+ * nodes are reused. There is still one node per address bit, so maxnodes
+ * means what it always has.
  */
 
 /* addrbytes is the number of bytes in the address */
 
 template <typename TYPE,size_t ADDRBYTES> class iptreet {
 private:;
+    typedef uint32_t index_t;           // of a node in the arena
+    enum {root=0};                      // the root is never a child, so a child of 0 means none
     /**
      * the node class.
      * Each node tracks the sum that it currently has and its two children.
-     * A node has pointers to the 0 and 1 children, as well as a sum for everything below.
+     * A node has the indexes of the 0 and 1 children, as well as a sum for everything below.
      * A short address or prefix being tallied may result in BOTH a sum and one or more PTR values.
      * If a node is pruned, ptr0=ptr1=0 and tsum>0.  
      * If tsum>0 and ptr0=0 and ptr1=0, then the node cannot be extended.
      * Nodes need to know their parent so that nodes found through the cache can be made dirty,
      * which requires knowing their parents.
      *
-     * Note: currently we get a slightly different answer when the pruning cache is enabled.
-     * Not sure why. It's probably not worth fixing at the moment.
+     * A node that is not dirty has no dirty node below it, so set_dirty() can stop
+     * at the first dirty node and the best node to prune can be cached.
      */
     class node {
-        /** best describes the best node to prune */
-    public:
-        class best {
-        public:
-            best &operator=(const best &that){
-                ptr  = that.ptr;
-                depth = that.depth;
-                return *this;
-            }
-            const node *ptr;
-            int depth;
-            best():ptr(0),depth(-1){}; // don't use this one
-            best(const node *ptr_,int depth_): ptr(ptr_),depth(depth_){}
-            best(const best &b):ptr(b.ptr),depth(b.depth){ }
-            virtual ~best(){}
-            friend std::ostream & operator<<(std::ostream &os,best const & foo) {
-                os << "node=" << foo.ptr << " depth=" << foo.depth << " ";
-                return os;
-            }
-        };
-    private:
-        /* Assignment and copy are not implemented */
-        node &operator=(const iptreet::node &that);
-        node(const node &n);
     public:
-        class node *parent;
-        class node *ptr0;               // 0 bit next
-        class node *ptr1;               // 1 bit next
-    private:
-    public:;
+        index_t parent;
+        index_t ptr0;                   // 0 bit next
+        index_t ptr1;                   // 1 bit next
         TYPE    tsum;                   // this node and pruned children.
 
         /* Caching system */
-        mutable bool    dirty;                  // add() has been called and cached data is no longer valid
-        mutable best    cached_best;
-    public:
-        node(node *p):parent(p),ptr0(0),ptr1(0),tsum(),dirty(false),cached_best(){ }
+        index_t cached_best;            // the best node to prune in this subtree, if not dirty
+        int16_t cached_depth;           // -1 if it has not been found
+        bool    dirty;                  // add() has been called and cached data is no longer valid
+
+        node(index_t p):parent(p),ptr0(0),ptr1(0),tsum(),cached_best(0),cached_depth(-1),dirty(false){ }
         int children() const {return (ptr0 ? 1 : 0) + (ptr1 ? 1 : 0);}
-        ~node(){
-            delete ptr0; ptr0 = 0;
-            delete ptr1; ptr1 = 0; 
-        };
         // a node is leaf if tsum>0 and both ptrs are 0.
         bool isLeaf() const {             
             if(tsum>0 && ptr0==0 && ptr1==0) return true;
             return false;
         }
-        /**
-         * prune():
-         * Cut this node's children off the tree.
-         * Returns the number removed, which should be larger than 0 (or we shouldn't have been called).
-         */
-        int prune(class iptreet &tree){                    // prune this node
-            //std::cerr << "prune " << this << " ptr0= " << ptr0 << " ptr1=" << ptr1 << " parent= " << parent << "\n";
-            /* If prune() on a node is called, then both ptr0 and ptr1 nodes, if present,
-             * must not have children.
-             * Now delete those that we counted out
-             */
-            int removed = 0;
-            if(ptr0){
-                assert(ptr0->isLeaf());   // only prune leaf nodes
-                tsum += ptr0->tsum;
-                tree.cache_remove(ptr0); // remove it from the cache
-                tree.pruned++;
-                delete ptr0; ptr0=0;
-                tree.nodes--;
-                removed++;
-            }
-            if(ptr1){
-                assert(ptr1->isLeaf()); 
-                tsum += ptr1->tsum;
-                tree.cache_remove(ptr1);
-                tree.pruned++;
-                delete ptr1;
-                ptr1=0;
-                tree.nodes--;
-                removed++;
-            }
-            assert(removed>0);
-            assert(isLeaf());           // I am now a leaf!
-            set_dirty();                // should be able to just set parent
-            //std::cerr << "   parent dirty=" << parent->dirty << "  this=" << this << " isLeaf()=" << isLeaf() << "\n";
-            //if(parent){
-            //parent->dirty=true; // parent is dirty, but no need to propigate it up
-            //}
-            return removed;
-        }
-
-        /**
-         * Return the best node to prune (the node with the leaves to remove)
-         * Possible outputs:
-         * case 1 - no node (if this is a leaf node, it can't be pruned; should not have been called)
-         * case 2 - this node (if all of the children are leaf)
-         * case 3 - the best node of the one child (if there is only one child)
-         * case 4 - the of the non-leaf child (if one child is leaf and one is not)
-         * case 5 - the better node of each child's best node.
-         */
-            
-        class best best_to_prune(int my_depth) const {
-            if(dirty==false && cached_best.ptr){
-                //return cached_best;     // haven't changed, so return
-            }
-            dirty = false;              // we will be cleaning
-            // case 1 - this is a leaf; it was an error to call best_to_prune
-            assert(isLeaf()==0);          
-            // case 2 - our only children are leaves; this is the best node
-            if ((ptr0==0 || ptr0->isLeaf()) &&
-                (ptr1==0 || ptr1->isLeaf())){
-                return cached_best = best(this,my_depth); // case 2
-            }
-            // case 3 - one of our children is a node and not a leaf,
-            //        - and the other is a child or not present.
-            //        - The best to prune is the child's best
+    }; /* end of node class */
 
-            if ((ptr0==0 || ptr0->isLeaf()) &&
-                (ptr1!=0 && !ptr1->isLeaf())){
-                return cached_best = ptr1->best_to_prune(my_depth+1); // case 3
-            }
+    /** best describes the best node to prune */
+    class best {
+    public:
+        index_t ptr;
+        int depth;
+        best():ptr(0),depth(-1){}; // don't use this one
+        best(index_t ptr_,int depth_): ptr(ptr_),depth(depth_){}
+        friend std::ostream & operator<<(std::ostream &os,best const & foo) {
+            os << "node=" << foo.ptr << " depth=" << foo.depth << " ";
+            return os;
+        }
+    };
 
-            if ((ptr1==0 || ptr1->isLeaf()) &&
-                (ptr0!=0 && !ptr0->isLeaf())){
-                return cached_best = ptr0->best_to_prune(my_depth+1); // case 3
-            }
+    std::vector<node>    arena;
+    std::vector<index_t> freed;         // nodes in arena that were pruned
+    TYPE                 total;         // of everything added
+
+    index_t new_node(index_t parent){
+        if(freed.size()){
+            index_t n = freed.back();
+            freed.pop_back();
+            arena[n] = node(parent);
+            return n;
+        }
+        arena.push_back(node(parent));
+        return arena.size()-1;
+    }
+
+    void set_dirty(index_t n) {         // make us dirty and our parent dirty
+        while(arena[n].dirty==false){
+            arena[n].dirty = true;
+            if(n==root) return;
+            n = arena[n].parent;        // up to the root or the first dirty node.
+        }
+    }
+
+    /** Increment this node by the given amount */
+    void node_add(index_t n,TYPE val) {
+        arena[n].tsum+=val;             // increment
+        total+=val;
+        set_dirty(n);
+    }
+
+    /** The sum is the sum of this node and its children (if they exist) */
+    TYPE node_sum(index_t n) const {
+        const node &nd = arena[n];
+        TYPE s = nd.tsum;
+        if(nd.ptr0) s+=node_sum(nd.ptr0);
+        if(nd.ptr1) s+=node_sum(nd.ptr1);
+        return s;
+    }
+
+    /* a child that best_to_prune() looks at but does not descend into */
+    bool leaf_or_none(index_t n) {
+        if(n==0) return true;
+        if(!arena[n].isLeaf()) return false;
+        arena[n].dirty = false;         // there is nothing below it
+        return true;
+    }
 
-            // case 5 - the better node of each child's best node.
-            best ptr0_best = ptr0->best_to_prune(my_depth+1);
-            best ptr1_best = ptr1->best_to_prune(my_depth+1);
+    /**
+     * Return the best node to prune (the node with the leaves to remove)
+     * Possible outputs:
+     * case 1 - no node (if this is a leaf node, it can't be pruned; should not have been called)
+     * case 2 - this node (if all of the children are leaf)
+     * case 3 - the best node of the one child (if there is only one child)
+     * case 4 - the of the non-leaf child (if one child is leaf and one is not)
+     * case 5 - the better node of each child's best node.
+     */
+    best best_to_prune(index_t n,int my_depth) {
+        if(arena[n].dirty==false && arena[n].cached_depth>=0){
+            return best(arena[n].cached_best,arena[n].cached_depth); // haven't changed, so return
+        }
+        best b = find_best_to_prune(n,my_depth);
+        node &nd = arena[n];
+        nd.dirty = false;               // we have cleaned
+        nd.cached_best = b.ptr;
+        nd.cached_depth = b.depth;
+        return b;
+    }
 
-            // The better to prune of two children is the one with a lower sum,
-            // or the one that is deeper if they have the same sum.
-            TYPE ptr0_best_sum = ptr0_best.ptr->sum();
-            TYPE ptr1_best_sum = ptr1_best.ptr->sum();
-            if(ptr0_best_sum < ptr1_best_sum ||
-               (ptr0_best_sum == ptr1_best_sum && ptr0_best.depth > ptr1_best.depth)){
-                return cached_best = ptr0_best;
-               }
-            return cached_best = ptr1_best;
+    best find_best_to_prune(index_t n,int my_depth) {
+        const index_t ptr0 = arena[n].ptr0;
+        const index_t ptr1 = arena[n].ptr1;
+        // case 1 - this is a leaf; it was an error to call best_to_prune
+        assert(arena[n].isLeaf()==0);          
+        const bool leaf0 = leaf_or_none(ptr0);
+        const bool leaf1 = leaf_or_none(ptr1);
+        // case 2 - our only children are leaves; this is the best node
+        if (leaf0 && leaf1){
+            return best(n,my_depth); // case 2
         }
+        // case 3 - one of our children is a node and not a leaf,
+        //        - and the other is a child or not present.
+        //        - The best to prune is the child's best
 
-        /** The nodesum is the sum of just the node.
-         * This exists purely because tsum is a private variable.
+        if (leaf0){
+            return best_to_prune(ptr1,my_depth+1); // case 3
+        }
+
+        if (leaf1){
+            return best_to_prune(ptr0,my_depth+1); // case 3
+        }
+
+        // case 5 - the better node of each child's best node.
+        best ptr0_best = best_to_prune(ptr0,my_depth+1);
+        best ptr1_best = best_to_prune(ptr1,my_depth+1);
+
+        // The better to prune of two children is the one with a lower sum,
+        // or the one that is deeper if they have the same sum.
+        TYPE ptr0_best_sum = node_sum(ptr0_best.ptr);
+        TYPE ptr1_best_sum = node_sum(ptr1_best.ptr);
+        if(ptr0_best_sum < ptr1_best_sum ||
+           (ptr0_best_sum == ptr1_best_sum && ptr0_best.depth > ptr1_best.depth)){
+            return ptr0_best;
+        }
+        return ptr1_best;
+    }
+
+    /**
+     * prune():
+     * Cut this node's children off the tree.
+     * Returns the number removed, which should be larger than 0 (or we shouldn't have been called).
+     */
+    int prune(index_t n){               // prune this node
+        /* If prune() on a node is called, then both ptr0 and ptr1 nodes, if present,
+         * must not have children.
+         * Now delete those that we counted out
          */
-        TYPE nodesum() const {
-            return tsum;
-        }
-
-        /** The sum is the sum of this node and its children (if they exist) */
-        TYPE sum() const {
-            TYPE s = tsum;
-            if(ptr0) s+=ptr0->sum();
-            if(ptr1) s+=ptr1->sum();
-            return s;
-        }
-        /** Increment this node by the given amount */
-        void add(TYPE val) {
-            tsum+=val;                  // increment
-            set_dirty();
-        }          
-
-        void set_dirty() {              // make us dirty and our parent dirty
-            if(dirty==false){
-                dirty = true;
-                if(parent && parent->dirty==false){
-                    parent->set_dirty();    // recurses to the root or the first dirty node.
-                } 
-            }
+        int removed = 0;
+        index_t *ptrs[2] = {&arena[n].ptr0,&arena[n].ptr1};
+        for(int i=0;i<2;i++){
+            index_t c = *ptrs[i];
+            if(c==0) continue;
+            assert(arena[c].isLeaf());  // only prune leaf nodes
+            arena[n].tsum += arena[c].tsum;
+            cache_remove(c);            // remove it from the cache
+            pruned++;
+            freed.push_back(c);
+            *ptrs[i] = 0;
+            nodes--;
+            removed++;
         }
+        assert(removed>0);
+        assert(arena[n].isLeaf());      // I am now a leaf!
+        set_dirty(n);
+        return removed;
+    }
 
-    }; /* end of node class */
-    class node *root;                  
     enum {root_depth=0,
           max_histogram_depth=128,
           ipv4_bits=32,
           ipv6_bits=128,
     };
     iptreet &operator=(const iptreet &that); // not implemented
+
+    /* add val to the node for the first addr_bits of addr, and return it */
+    index_t add_bits(const uint8_t *addr,u_int addr_bits,TYPE val);
 protected:
     size_t     nodes;                   // nodes in tree
     size_t     maxnodes;                // how many will we tolerate?
@@ -248,12 +261,14 @@ public:
     
     virtual ~iptreet(){}                // required per compiler warnings
     /* copy is a deep copy */
-    iptreet(const iptreet &n):root(n.root ? new node(*n.root) : 0),
-                              nodes(n.nodes),maxnodes(n.maxnodes),ctr_added(),pruned(),cache(),cachenext(),cache_hits(),cache_misses(){};
+    iptreet(const iptreet &n):arena(n.arena),freed(n.freed),total(n.total),
+                              nodes(n.nodes),maxnodes(n.maxnodes),ctr_added(),pruned(),cache(n.cache),cachenext(),cache_hits(),cache_misses(){};
 
     /* create an empty tree */
-    iptreet(int maxnodes_):root(new node(0)),nodes(0),maxnodes(maxnodes_),
+    iptreet(int maxnodes_):arena(),freed(),total(),nodes(0),maxnodes(maxnodes_),
                            ctr_added(),pruned(),cache(),cachenext(),cache_hits(),cache_misses(){
+        arena.reserve(maxnodes_>0 ? maxnodes_+ipv6_bits+1 : 1);
+        arena.push_back(node(root));
         for(size_t i=0;i<cache_size;i++){
             cache.push_back(cache_element(0,0,0));
         }
@@ -262,20 +277,54 @@ public:
     /* size the tree; the number of nodes */
     size_t size() const {return nodes;};
 
+    /* bytes the tree holds beyond itself */
+    size_t memory() const {
+        return arena.capacity()*sizeof(node) + freed.capacity()*sizeof(index_t) + cache.capacity()*sizeof(cache_element);
+    }
+
     /* sum the tree; the total number of adds that have been performed */
-    TYPE sum() const {return root->sum();};
+    TYPE sum() const {return total;};
 
     /* add a node; implementation below */
     void add(const uint8_t *addr,size_t addrlen,TYPE val); 
 
+    /* Addresses to add together. add(batch) sorts them, so that each address is
+     * found from where the one before it left the tree rather than from the root.
+     */
+    class batch_element {
+    public:
+        uint8_t addr[ADDRBYTES];
+        uint8_t addrlen;
+        TYPE    val;
+        batch_element(const uint8_t *addr_,size_t addrlen_,TYPE val_):addr(),addrlen(addrlen_),val(val_){
+            memcpy(addr,addr_,addrlen);
+        }
+        bool operator<(const batch_element &b) const {
+            int r = memcmp(addr,b.addr,sizeof(addr));
+            return r<0 || (r==0 && addrlen<b.addrlen);
+        }
+    };
+    typedef std::vector<batch_element> batch_t;
+    void add(batch_t &batch);           // implementation below
+
+    /* add the counts of another tree, pruning this one as needed */
+    void merge(const iptreet &that){
+        histogram_t histogram;
+        that.get_histogram(histogram);
+        for(typename histogram_t::const_iterator it=histogram.begin();it!=histogram.end();it++){
+            prune_if_needed();
+            add_bits(it->addr,it->depth,it->count);
+        }
+    }
+
     /****************************************************************
      *** cache
      ****************************************************************/
     class cache_element {
     public:
         uint8_t addr[ADDRBYTES];
-        node *ptr;                      // 0 means cache entry is not in use
-        cache_element(const uint8_t addr_[ADDRBYTES],size_t addrlen,node *p):addr(),ptr(p){
+        index_t ptr;                    // 0 means cache entry is not in use
+        cache_element(const uint8_t addr_[ADDRBYTES],size_t addrlen,index_t p):addr(),ptr(p){
             memcpy(addr,addr_,addrlen);
         }
     };
@@ -286,7 +335,7 @@ public:
     uint64_t cache_hits;
     uint64_t cache_misses;
 
-    void cache_remove(const node *p){
+    void cache_remove(index_t p){
         for(size_t i=0;i<cache.size();i++){
             if(cache[i].ptr==p){
                 cache[i].ptr = 0;
@@ -306,7 +355,7 @@ public:
         return -1;
     }
 
-    void cache_replace(const uint8_t *addr,size_t addrlen,node *ptr) {
+    void cache_replace(const uint8_t *addr,size_t addrlen,index_t ptr) {
         if(++cachenext>=cache.size()) cachenext = 0;
         memcpy(cache[cachenext].addr,addr,addrlen);
         cache[cachenext].ptr = ptr;
@@ -318,25 +367,26 @@ public:
      ****************************************************************/
 
     /* prune the tree, starting at the root. Find the node to prune and then prune it.
-     * node that best_to_prune() returns a const pointer. But we want to modify it, so we
-     * do a const_cast (which is completely fine).
      */
     int prune_best_node(){
-        if(root->isLeaf()) return 0;        // leaf nodes can't be pruned
-        class node::best b = root->best_to_prune(root_depth);
-        node *tnode = const_cast<node *>(b.ptr);
-        if(tnode){
-            return tnode->prune(*this);
+        if(arena[root].isLeaf()) return 0;        // leaf nodes can't be pruned
+        best b = best_to_prune(root,root_depth);
+        if(b.depth>=0){
+            return prune(b.ptr);
         }
         return 0;
     }
 
     /* Simple implementation to prune the table if over the limit.
      */
-    void prune_if_needed(){
+    int prune_if_needed(){              // returns how many were pruned
+        int removed = 0;
         while(nodes > maxnodes){
-            if(prune_best_node()==0) return; // cannot prune
+            int r = prune_best_node();
+            if(r==0) break;             // cannot prune
+            removed += r;
         }
+        return removed;
     }
 
     /****************************************************************
@@ -377,9 +427,11 @@ public:
      * @param histogram - where the histogram is written
      */
     typedef std::vector<addr_elem> histogram_t;
-    void get_histogram(int depth,const uint8_t *addr,const class node *ptr,histogram_t  &histogram) const{
-        if(ptr->nodesum()){
-            histogram.push_back(addr_elem(addr,depth,ptr->nodesum()));
+private:
+    void get_histogram(int depth,const uint8_t *addr,index_t ptr,histogram_t  &histogram) const{
+        const node &nd = arena[ptr];
+        if(nd.tsum){
+            histogram.push_back(addr_elem(addr,depth,nd.tsum));
             //return;
         }
         if(depth>max_histogram_depth) return;               // can't go deeper than this now
@@ -392,9 +444,10 @@ public:
         memset(addr1,0,sizeof(addr1)); memcpy(addr1,addr,(depth+7)/8);
         setbit(addr1,sizeof(addr1),depth);
         
-        if(ptr->ptr0) get_histogram(depth+1,addr0,ptr->ptr0,histogram);
-        if(ptr->ptr1) get_histogram(depth+1,addr1,ptr->ptr1,histogram);
+        if(nd.ptr0) get_histogram(depth+1,addr0,nd.ptr0,histogram);
+        if(nd.ptr1) get_histogram(depth+1,addr1,nd.ptr1,histogram);
     }
+public:
         
     void get_histogram(histogram_t &histogram) const { // adds the histogram to the passed in vector
         uint8_t addr[ADDRBYTES];
@@ -402,6 +455,44 @@ public:
         get_histogram(0,addr,root,histogram);
     }
 
+    /* The histogram as text, one "address-in-hex depth count" line for each
+     * node with a sum, then "end". load() adds such lines into the tree.
+     */
+    std::ostream & save(std::ostream &os) const {
+        histogram_t histogram;
+        get_histogram(histogram);
+        for(typename histogram_t::const_iterator it=histogram.begin();it!=histogram.end();it++){
+            size_t bytes = (it->depth+7)/8;
+            if(bytes==0) os << "-";
+            for(size_t i=0;i<bytes;i++){
+                os << std::hex << std::setw(2) << std::setfill('0') << (int)it->addr[i];
+            }
+            os << std::dec << " " << (int)it->depth << " " << it->count << "\n";
+        }
+        os << "end\n";
+        return os;
+    }
+    bool load(std::istream &is){        // false if the input is not what save() wrote
+        std::string hex;
+        while(is >> hex){
+            if(hex=="end") return true;
+            unsigned int depth = 0;
+            TYPE count = TYPE();
+            if(!(is >> depth >> count) || depth>ADDRBYTES*8) return false;
+            uint8_t addr[ADDRBYTES];
+            memset(addr,0,sizeof(addr));
+            if(hex!="-"){
+                if(hex.size()!=(depth+7)/8*2) return false;
+                for(size_t i=0;i<hex.size()/2;i++){
+                    addr[i] = strtoul(hex.substr(i*2,2).c_str(),0,16);
+                }
+            }
+            prune_if_needed();
+            add_bits(addr,depth,count);
+        }
+        return false;
+    }
+
     /****************************************************************
      *** output routines
      ****************************************************************/
@@ -480,46 +571,85 @@ void iptreet<TYPE,ADDRBYTES>::add(const uint8_t *addr,size_t addrlen,TYPE val)
     /* check the cache first */
     ssize_t i = cache_search(addr,addrlen);
     if(i>=0){
-        cache[i].ptr->add(val);
+        node_add(cache[i].ptr,val);
         return;
     }
 
+    cache_replace(addr,addrlen,add_bits(addr,addr_bits,val));
+}
+
+template <typename TYPE,size_t ADDRBYTES>
+typename iptreet<TYPE,ADDRBYTES>::index_t iptreet<TYPE,ADDRBYTES>::add_bits(const uint8_t *addr,u_int addr_bits,TYPE val)
+{
     /* descend the radix tree until we run out of bits, or we have a
        node with no pointers and a non-zero sum.
      */
 
-    node *ptr = root;               // start at the root
+    index_t ptr = root;             // start at the root
     for(u_int depth=0;depth<=addr_bits;depth++){
-        if(depth==addr_bits){       // reached end of address
-            ptr->add(val);          // increment this node (and all of its descendants 
-            cache_replace(addr,addrlen,ptr);
-            return;
-        }
-        if((ptr->tsum > 0) && (ptr->ptr0==0) && (ptr->ptr1==0)){
-            ptr->add(val);
-            cache_replace(addr,addrlen,ptr);
-            return;
+        if(depth==addr_bits || arena[ptr].isLeaf()){ // reached end of address, or cannot extend
+            node_add(ptr,val);      // increment this node (and all of its descendants 
+            return ptr;
         }
         /* Not a leaf node, so go down a level based on the next bit,
          * extending if necessary.
          */
-        if(bit(addr,depth)==0){
-            if(ptr->ptr0==0){
-                ptr->ptr0 = new node(ptr);
-                nodes++;
-                ctr_added++;
+        index_t next = bit(addr,depth) ? arena[ptr].ptr1 : arena[ptr].ptr0;
+        if(next==0){
+            next = new_node(ptr);   // may move the arena
+            if(bit(addr,depth)) arena[ptr].ptr1 = next; else arena[ptr].ptr0 = next;
+            nodes++;
+            ctr_added++;
+        }
+        ptr = next;
+    }
+    assert(0);                          // should never happen
+    return root;
+}
+
+/** Add a batch of addresses; the batch is sorted.
+ * The tree is pruned as it would be by add(), one address at a time.
+ */
+template <typename TYPE,size_t ADDRBYTES>
+void iptreet<TYPE,ADDRBYTES>::add(batch_t &batch)
+{
+    std::sort(batch.begin(),batch.end());
+    index_t path[ADDRBYTES*8+1];        // the nodes that the previous address went through
+    u_int   path_len = 0;               // and how far down it went
+    const uint8_t *prev = 0;
+    u_int   prev_bits = 0;
+
+    for(typename batch_t::const_iterator it=batch.begin();it!=batch.end();it++){
+        if(prune_if_needed()) path_len = 0; // nodes on the path may be gone
+        size_t addrlen = it->addrlen > ADDRBYTES ? ADDRBYTES : it->addrlen;
+        u_int addr_bits = addrlen * 8;
+
+        /* start from the deepest node of the previous path that has the same prefix */
+        u_int depth = 0;
+        if(prev && path_len>0){
+            u_int limit = std::min(std::min(prev_bits,addr_bits),path_len);
+            while(depth<limit && bit(prev,depth)==bit(it->addr,depth)) depth++;
+        }
+        index_t ptr = depth>0 ? path[depth] : (index_t)root;
+        for(;depth<=addr_bits;depth++){
+            path[depth] = ptr;
+            if(depth==addr_bits || arena[ptr].isLeaf()){
+                node_add(ptr,it->val);
+                break;
             }
-            ptr = ptr->ptr0;
-        } else {
-            if(ptr->ptr1==0){
-                ptr->ptr1 = new node(ptr); 
+            index_t next = bit(it->addr,depth) ? arena[ptr].ptr1 : arena[ptr].ptr0;
+            if(next==0){
+                next = new_node(ptr);
+                if(bit(it->addr,depth)) arena[ptr].ptr1 = next; else arena[ptr].ptr0 = next;
                 nodes++;
                 ctr_added++;
             }
-            ptr = ptr->ptr1;
+            ptr = next;
         }
+        path_len = depth;
+        prev = it->addr;
+        prev_bits = addr_bits;
     }
-    assert(0);                          // should never happen
 }
 
 
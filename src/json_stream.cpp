@@ -0,0 +1,256 @@
+/**
+ * json_stream.cpp
+ *
+ * The -S json_stream events; see json_stream.h
+ *
+ * This source code is under the GNU Public License (GPL).  See
+ * LICENSE for details.
+ */
+
+#include "tcpflow.h"
+#include "tcpip.h"
+#include "json_stream.h"
+
+#include <sstream>
+#include <chrono>
+
+#if defined(__SSSE3__)
+#include <tmmintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/* static */ std::string  json_stream::path;
+/* static */ std::string  json_stream::events      = "both";
+/* static */ std::string  json_stream::payload     = "base64";
+/* static */ uint32_t     json_stream::buffer_size = 64*1024;
+/* static */ json_stream *json_stream::sink        = 0;
+
+static const char base64_chars[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+/* The four characters of each 3 bytes are taken two at a time from this: 12 bits to 2 characters */
+class base64_table {
+public:
+    char c[4096][2];
+    base64_table() {
+        for(int i=0;i<4096;i++){
+            c[i][0] = base64_chars[i>>6];
+            c[i][1] = base64_chars[i&0x3f];
+        }
+    }
+};
+static const base64_table b64;
+
+void json_stream::append_base64(std::string &out,const uint8_t *data,size_t length)
+{
+    size_t start = out.size();
+    out.resize(start + (length+2)/3*4);
+    char *dst = &out[start];
+    size_t i = 0;
+#if defined(__SSSE3__)
+    /* 12 bytes to 16 characters; see Wojciech Mula and Daniel Lemire, "Faster Base64 Encoding and
+     * Decoding Using AVX2 Instructions". The load reads 16 bytes, so the last 4 are left to the loop below.
+     */
+    const __m128i shuf  = _mm_set_epi8(10,11,9,10, 7,8,6,7, 4,5,3,4, 1,2,0,1);
+    const __m128i shift = _mm_setr_epi8('a'-26,'0'-52,'0'-52,'0'-52,'0'-52,'0'-52,'0'-52,'0'-52,
+                                        '0'-52,'0'-52,'0'-52,'+'-62,'/'-63,'A',0,0);
+    for(;i+16<=length;i+=12,dst+=16){
+        __m128i in = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data+i)),shuf);
+        __m128i t0 = _mm_mulhi_epu16(_mm_and_si128(in,_mm_set1_epi32(0x0fc0fc00)),_mm_set1_epi32(0x04000040));
+        __m128i t1 = _mm_mullo_epi16(_mm_and_si128(in,_mm_set1_epi32(0x003f03f0)),_mm_set1_epi32(0x01000010));
+        __m128i idx = _mm_or_si128(t0,t1);  // each byte is a 6-bit index
+        __m128i r = _mm_subs_epu8(idx,_mm_set1_epi8(51));
+        r = _mm_or_si128(r,_mm_and_si128(_mm_cmpgt_epi8(_mm_set1_epi8(26),idx),_mm_set1_epi8(13)));
+        r = _mm_add_epi8(_mm_shuffle_epi8(shift,r),idx);
+        _mm_storeu_si128((__m128i *)dst,r);
+    }
+#endif
+    for(;i+3<=length;i+=3,dst+=4){
+        uint32_t v = (uint32_t)data[i]<<16 | (uint32_t)data[i+1]<<8 | data[i+2];
+        memcpy(dst,b64.c[v>>12],2);
+        memcpy(dst+2,b64.c[v&0xfff],2);
+    }
+    if(i<length){
+        uint32_t v = (uint32_t)data[i]<<16 | (i+1<length ? (uint32_t)data[i+1]<<8 : 0);
+        dst[0] = base64_chars[v>>18];
+        dst[1] = base64_chars[(v>>12)&0x3f];
+        dst[2] = i+1<length ? base64_chars[(v>>6)&0x3f] : '=';
+        dst[3] = '=';
+    }
+}
+
+/* A JSON string's contents: printable ASCII as it is, except '"' and '\', and \u00XX for the rest */
+void json_stream::append_escaped(std::string &out,const uint8_t *data,size_t length)
+{
+    static const char hex[] = "0123456789abcdef";
+    out.reserve(out.size()+length);
+    size_t i = 0;
+    while(i<length){
+#if defined(__SSE2__)
+        /* a run of 16 bytes that need nothing is copied as it is */
+        const __m128i bias  = _mm_set1_epi8((char)0x80);
+        const __m128i lo    = _mm_set1_epi8((char)(' '^0x80));
+        const __m128i hi    = _mm_set1_epi8((char)('~'^0x80));
+        const __m128i quote = _mm_set1_epi8('"');
+        const __m128i bsl   = _mm_set1_epi8('\\');
+        size_t run = i;
+        for(;run+16<=length;run+=16){
+            __m128i v = _mm_loadu_si128((const __m128i *)(data+run));
+            __m128i t = _mm_xor_si128(v,bias);
+            __m128i bad = _mm_or_si128(_mm_or_si128(_mm_cmplt_epi8(t,lo),_mm_cmpgt_epi8(t,hi)),
+                                       _mm_or_si128(_mm_cmpeq_epi8(v,quote),_mm_cmpeq_epi8(v,bsl)));
+            if(_mm_movemask_epi8(bad)) break;
+        }
+        if(run>i){
+            out.append((const char *)data+i,run-i);
+            i = run;
+            continue;
+        }
+#endif
+        /* the block with something in it, or the tail */
+        size_t end = i+16 < length ? i+16 : length;
+        for(;i<end;i++){
+            uint8_t ch = data[i];
+            if(ch=='"' || ch=='\\'){
+                out += '\\';
+                out += (char)ch;
+            } else if(ch>=' ' && ch<='~'){
+                out += (char)ch;
+            } else {
+                char u[6] = {'\\','u','0','0',hex[ch>>4],hex[ch&0x0f]};
+                out.append(u,6);
+            }
+        }
+    }
+}
+
+json_stream::json_stream(FILE *f_):
+    f(f_),M(),work_ready(),space_ready(),current(),queue(),stopping(false),writer()
+{
+    writer = std::thread(&json_stream::run,this);
+}
+
+json_stream::~json_stream()
+{
+    {
+        std::lock_guard<std::mutex> lock(M);
+        stopping = true;
+        work_ready.notify_one();
+    }
+    writer.join();
+    if(f!=stdout) fclose(f);
+    else fflush(f);
+}
+
+/* static */ void json_stream::start(const std::string &file)
+{
+    FILE *f = file=="-" ? stdout : fopen(file.c_str(),"w");
+    if(f==0){
+        std::cerr << file << ": " << strerror(errno) << "\n";
+        exit(1);
+    }
+    sink = new json_stream(f);
+}
+
+/* static */ void json_stream::stop()
+{
+    delete sink;
+    sink = 0;
+}
+
+/* Kept once the flow has its name (flow_pathname, with any connection count
+ * suffix); a flow that has no file, as without -o output, is called what its
+ * file would have been.
+ */
+/* static */ const std::string &json_stream::prefix(tcpip &tcp)
+{
+    if(!tcp.json_prefix_named){
+        const flow &f = tcp.myflow;
+        std::string name = tcp.flow_pathname.size() ? tcp.flow_pathname : tcp.myflow.filename(0,false);
+        std::stringstream ss;
+        ss << "\"flow\":" << json_quote(name) << ",\"session_id\":" << f.session_id
+           << ",\"src\":\"" << ipaddr_prn(f.src,f.family) << "\",\"sport\":" << f.sport
+           << ",\"dst\":\"" << ipaddr_prn(f.dst,f.family) << "\",\"dport\":" << f.dport;
+        tcp.json_prefix = ss.str();
+        tcp.json_prefix_named = tcp.flow_pathname.size()>0 || !tcp.demux.opt.store_output;
+    }
+    return tcp.json_prefix;
+}
+
+static void append_time(std::string &out,const struct timeval &tv)
+{
+    char buf[48];
+    int n = snprintf(buf,sizeof(buf),"\"%lld.%06ld\"",(long long)tv.tv_sec,(long)tv.tv_usec);
+    out.append(buf,n);
+}
+
+/* static */ void json_stream::segment(tcpip &tcp,const struct timeval &ts,uint64_t offset,
+                                       const uint8_t *data,size_t length)
+{
+    std::string line("{\"event\":\"segment\",");
+    line += prefix(tcp);
+    line += ",\"ts\":";
+    append_time(line,ts);
+    line += ",\"offset\":" + std::to_string(offset) + ",\"length\":" + std::to_string(length);
+    if(payload=="base64"){
+        line += ",\"data\":\"";
+        append_base64(line,data,length);
+        line += '"';
+    } else if(payload=="escape"){
+        line += ",\"data\":\"";
+        append_escaped(line,data,length);
+        line += '"';
+    }
+    line += "}\n";
+    sink->add(line);
+}
+
+/* static */ void json_stream::flow_finished(tcpip &tcp)
+{
+    std::string line("{\"event\":\"flow\",");
+    line += prefix(tcp);
+    line += ",\"start\":";
+    append_time(line,tcp.myflow.tstart);
+    line += ",\"end\":";
+    append_time(line,tcp.myflow.tlast);
+    line += ",\"bytes\":" + std::to_string(tcp.last_byte) + ",\"packets\":" + std::to_string(tcp.myflow.packet_count)
+        + ",\"out_of_order\":" + std::to_string(tcp.out_of_order_count) + "}\n";
+    sink->add(line);
+}
+
+void json_stream::add(const std::string &line)
+{
+    std::unique_lock<std::mutex> lock(M);
+    current += line;
+    if(current.size() < buffer_size) return;
+    while(queue.size() >= MAX_QUEUED) space_ready.wait(lock);
+    queue.push_back(std::string());
+    queue.back().swap(current);
+    work_ready.notify_one();
+}
+
+void json_stream::run()
+{
+    while(true){
+        std::string batch;
+        {
+            std::unique_lock<std::mutex> lock(M);
+            if(queue.empty() && !stopping){
+                work_ready.wait_for(lock,std::chrono::milliseconds(100));
+            }
+            if(queue.size()>0){
+                batch.swap(queue.front());
+                queue.pop_front();
+                space_ready.notify_all();
+            } else if(current.size()>0){
+                batch.swap(current);    // a quiet time; do not keep the reader waiting
+            } else if(stopping){
+                break;
+            }
+        }
+        if(batch.size()>0){
+            if(fwrite(batch.data(),1,batch.size(),f)!=batch.size()) perror("json_stream");
+            fflush(f);
+        }
+    }
+}
@@ -0,0 +1,89 @@
+#ifndef JSON_STREAM_H
+#define JSON_STREAM_H
+
+/**
+ * json_stream.h
+ *
+ * With -S json_stream=file, a JSON object per line for each segment of
+ * data and for each flow when it is finished, for forwarders that feed
+ * tcpflow's output to Kafka and the like. The file is in the output
+ * directory unless its path is absolute; "-" is stdout.
+ *
+ *   {"event":"segment","flow":"name","session_id":n,"src":"a","sport":n,
+ *    "dst":"b","dport":n,"ts":"sec.usec","offset":n,"length":n,"data":"..."}
+ *   {"event":"flow","flow":"name",...,"start":"sec.usec","end":"sec.usec",
+ *    "bytes":n,"packets":n,"out_of_order":n}
+ *
+ * The part from "flow" to "dport" is made once for each flow, when its
+ * file has been named, and kept in tcpip::json_prefix. -S json_events says
+ * which events there are: segments, flows or both (the default). -S
+ * json_payload says how "data" is written: base64 (the default), escape
+ * (a JSON string, with the bytes that are not printable ASCII as \u00XX)
+ * or none (no "data"). Both encoders do 12 or 16 input bytes at a time
+ * with SSSE3 or SSE2 where they can.
+ *
+ * Lines are put into a buffer under a lock and returned from at once; a
+ * thread of its own writes the buffer out when it has -S json_buffer
+ * bytes, or every 100 ms otherwise. If the writer falls behind by more
+ * than MAX_QUEUED buffers the packet threads wait for it, so no event is
+ * lost.
+ *
+ * Include after tcpip.h.
+ *
+ * This source code is under the GNU Public License (GPL).  See
+ * LICENSE for details.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+class json_stream {
+public:
+    enum { MAX_QUEUED = 64 };
+
+    static std::string path;            // -S json_stream; "" for none
+    static std::string events;          // -S json_events: segments, flows or both
+    static std::string payload;         // -S json_payload: base64, escape or none
+    static uint32_t    buffer_size;     // -S json_buffer
+    static json_stream *sink;           // the open stream, if there is one
+
+    static bool segments() { return sink && events!="flows"; }
+    static bool flows()    { return sink && events!="segments"; }
+
+    static void start(const std::string &file); // file is path, resolved against the output directory
+    static void stop();                 // write what is left
+
+    /* The events; from any packet thread */
+    static void segment(class tcpip &tcp,const struct timeval &ts,uint64_t offset,const uint8_t *data,size_t length);
+    static void flow_finished(class tcpip &tcp);
+
+    /* Payload encoders; each appends to out */
+    static void append_base64(std::string &out,const uint8_t *data,size_t length);
+    static void append_escaped(std::string &out,const uint8_t *data,size_t length);
+
+private:
+    explicit json_stream(FILE *f_);
+    ~json_stream();
+    json_stream(const json_stream &);
+    json_stream &operator=(const json_stream &);
+
+    FILE                    *f;
+    std::mutex              M;          // protects everything below
+    std::condition_variable work_ready;
+    std::condition_variable space_ready;
+    std::string             current;    // lines being added to
+    std::deque<std::string> queue;      // full buffers for the writer
+    bool                    stopping;
+    std::thread             writer;
+
+    static const std::string &prefix(class tcpip &tcp);
+    void add(const std::string &line);
+    void run();                         // writer thread body
+};
+
+#endif
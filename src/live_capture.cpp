@@ -0,0 +1,163 @@
+/*
+ * live_capture.cpp:
+ *
+ * Capture from several interfaces at once. See live_capture.h
+ *
+ * This source code is under the GNU Public License (GPL).  See
+ * LICENSE for details.
+ */
+
+#include "tcpflow.h"
+#include "live_capture.h"
+#include "packet_batch.h"
+
+live_capture::~live_capture()
+{
+    for(std::vector<source *>::iterator it=sources.begin();it!=sources.end();it++){
+        source *s = *it;
+        if(s->thread.joinable()) s->thread.join();
+        if(s->pd) pcap_close(s->pd);
+        delete s->filling;
+        delete s;
+    }
+    for(std::deque<batch *>::iterator b=queue.begin();b!=queue.end();b++) delete *b;
+    for(std::vector<batch *>::iterator b=free_batches.begin();b!=free_batches.end();b++) delete *b;
+}
+
+int live_capture::add_device(const std::string &device,const std::string &expression,bool promisc,int timeout_ms,
+                             std::string &error)
+{
+    char errbuf[PCAP_ERRBUF_SIZE];
+    pcap_t *pd = pcap_open_live(device.c_str(),SNAPLEN,promisc,timeout_ms,errbuf);
+    if(pd == NULL){
+        error = errbuf;
+        return -1;
+    }
+    struct bpf_program fcode;
+    if(pcap_compile(pd,&fcode,expression.c_str(),1,0) < 0 || pcap_setfilter(pd,&fcode) < 0){
+        error = device + ": " + pcap_geterr(pd);
+        pcap_close(pd);
+        return -1;
+    }
+    pcap_freecode(&fcode);
+
+    source *s  = new source(this);
+    s->name    = device;
+    s->pd      = pd;
+    s->dlt     = pcap_datalink(pd);
+    s->handler = find_handler(s->dlt,device.c_str());
+    sources.push_back(s);
+    return 0;
+}
+
+bool live_capture::stats(size_t i,uint64_t &packets,uint64_t &drops,uint64_t &ifdrops) const
+{
+    struct pcap_stat st;
+    if(i>=sources.size() || sources[i]->pd==0 || pcap_stats(sources[i]->pd,&st)!=0) return false;
+    packets = st.ps_recv;
+    drops   = st.ps_drop;
+    ifdrops = st.ps_ifdrop;
+    return true;
+}
+
+/* Hand the batch being filled to run(), waiting for room in the queue */
+void live_capture::queue_batch(source *s)
+{
+    std::unique_lock<std::mutex> lock(M);
+    while(queue.size() >= MAX_QUEUED_BATCHES && !stop){
+        space.wait(lock);
+    }
+    queue.push_back(s->filling);
+    ready.notify_one();
+    if(free_batches.size()>0){
+        s->filling = free_batches.back();
+        free_batches.pop_back();
+    } else {
+        s->filling = new batch();
+    }
+    s->filling->handler = s->handler;
+}
+
+/* pcap_handler for the capture threads: copy the packet into the batch being filled */
+/* static */ void live_capture::collect(u_char *user,const struct pcap_pkthdr *h,const u_char *p)
+{
+    source *s = reinterpret_cast<source *>(user);
+    batch *b = s->filling;
+    b->hdrs.push_back(*h);
+    b->offsets.push_back(b->data.size());
+    b->data.insert(b->data.end(),p,p+h->caplen);
+    if(b->size() >= BATCH_PACKETS || b->data.size() >= BATCH_BYTES){
+        s->owner->queue_batch(s);
+    }
+}
+
+void live_capture::capture(source *s)
+{
+    int r = 0;
+    while(!stop){
+        int n = pcap_dispatch(s->pd,-1,collect,(u_char *)s);
+        if(n == -2) break;              // pcap_breakloop()
+        if(n < 0){
+            DEBUG(1) ("%s: %s", s->name.c_str(), pcap_geterr(s->pd));
+            r = -1;
+            break;
+        }
+        if(s->filling->size()>0) queue_batch(s); // a quiet interface does not hold its packets back
+    }
+    if(s->filling->size()>0) queue_batch(s);
+    std::lock_guard<std::mutex> lock(M);
+    s->result = r;
+    running--;
+    ready.notify_one();
+}
+
+/* Only flags are set here; the capture threads queue what they have and finish */
+void live_capture::breakloop()
+{
+    stop = 1;
+    for(std::vector<source *>::iterator it=sources.begin();it!=sources.end();it++){
+        if((*it)->pd) pcap_breakloop((*it)->pd);
+    }
+}
+
+int live_capture::run(u_char *user)
+{
+    stop = 0;
+    running = sources.size();
+    for(std::vector<source *>::iterator it=sources.begin();it!=sources.end();it++){
+        (*it)->filling = new batch();
+        (*it)->filling->handler = (*it)->handler;
+        (*it)->thread = std::thread(&live_capture::capture,this,*it);
+    }
+
+    /* every batch that was captured is delivered, even after breakloop() */
+    packet_batch::scope scope;
+    while(true){
+        batch *b = 0;
+        {
+            std::unique_lock<std::mutex> lock(M);
+            while(queue.empty() && running>0){
+                ready.wait(lock);
+            }
+            if(queue.empty()) break;    // every thread has finished
+            b = queue.front();
+            queue.pop_front();
+            space.notify_one();
+        }
+        for(size_t i=0;i<b->size();i++){
+            (*b->handler)(user,&b->hdrs[i],&b->data[b->offsets[i]]);
+        }
+        packet_batch::flush();          // the batch is about to be reused
+        b->clear();
+        std::lock_guard<std::mutex> lock(M);
+        free_batches.push_back(b);
+    }
+
+    int ret = 0;
+    for(std::vector<source *>::iterator it=sources.begin();it!=sources.end();it++){
+        source *s = *it;
+        if(s->thread.joinable()) s->thread.join();
+        if(s->result < 0) ret = -1;
+    }
+    return ret;
+}
@@ -0,0 +1,106 @@
+/*
+ * live_capture.h:
+ *
+ * Capture from several interfaces at once, with -i eth0,eth1 (or -i
+ * given more than once).
+ *
+ * Each interface has a libpcap handle of its own, with the filter, and a
+ * thread that copies its packets into batches. run() hands the batches to
+ * the datalink handler for each interface's link type on the calling
+ * thread, in the order they arrive, so every interface feeds the one demux
+ * (and with --threads, its pool): both directions of a connection that is
+ * routed asymmetrically, in on one tap and out on another, are the same
+ * flow, and there is one output directory and one set of descriptors.
+ *
+ * Unlike pcap_merge, nothing waits for a quiet interface: a batch is
+ * queued when it is full or when the read that filled it returns, after
+ * at most the packet buffer timeout.
+ *
+ * The receive and drop counts of each interface are in report.xml as
+ * <capture_stats device='eth0' packets='...' drops='...' ifdrops='...'/>,
+ * and their sums are the capture gauges of -S metrics_file.
+ *
+ * This source code is under the GNU Public License (GPL).  See
+ * LICENSE for details.
+ */
+
+#ifndef LIVE_CAPTURE_H
+#define LIVE_CAPTURE_H
+
+#include "tcpflow.h"
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+class live_capture {
+    /* Packets copied out of libpcap's buffer */
+    class batch {
+    public:
+        batch():handler(0),hdrs(),offsets(),data(){}
+        pcap_handler handler;               // the interface's
+        std::vector<struct pcap_pkthdr> hdrs;
+        std::vector<size_t>  offsets;       // where each packet starts in data
+        std::vector<u_char>  data;
+        size_t size() const { return hdrs.size(); }
+        void clear() { hdrs.clear(); offsets.clear(); data.clear(); }
+    };
+
+    class source {
+        source(const source &);
+        source &operator=(const source &);
+    public:
+        source(live_capture *owner_):owner(owner_),name(),dlt(0),handler(0),pd(0),thread(),result(0),filling(0){}
+        live_capture    *owner;
+        std::string     name;
+        int             dlt;
+        pcap_handler    handler;            // for dlt
+        pcap_t          *pd;
+        std::thread     thread;
+        int             result;             // of the capture thread
+        batch           *filling;           // capture thread only
+    };
+
+    live_capture(const live_capture &);
+    live_capture &operator=(const live_capture &);
+
+    std::vector<source *> sources;
+    std::mutex            M;                // protects everything up to running
+    std::condition_variable ready;          // a batch was queued, or a thread finished
+    std::condition_variable space;          // a batch was taken off the queue
+    std::deque<batch *>   queue;
+    std::vector<batch *>  free_batches;
+    size_t                running;          // capture threads that have not finished
+    volatile sig_atomic_t stop;
+
+    static void collect(u_char *user,const struct pcap_pkthdr *h,const u_char *p);
+    void queue_batch(source *s);
+    void capture(source *s);                // capture thread body
+
+public:
+    enum { BATCH_PACKETS = 256,             // packets per batch
+           BATCH_BYTES = 1024*1024,         // or bytes per batch
+           MAX_QUEUED_BATCHES = 64 };       // for all of the interfaces; the capture threads wait beyond this
+
+    live_capture():sources(),M(),ready(),space(),queue(),free_batches(),running(0),stop(0){}
+    ~live_capture();
+
+    /* Open an interface and set up its filter. Returns 0, or -1 with error set. */
+    int  add_device(const std::string &device,const std::string &expression,bool promisc,int timeout_ms,
+                    std::string &error);
+    size_t size() const { return sources.size(); }
+    const std::string &name(size_t i) const { return sources.at(i)->name; }
+    /* libpcap's counts for interface i; false if it has none */
+    bool stats(size_t i,uint64_t &packets,uint64_t &drops,uint64_t &ifdrops) const;
+
+    /* Deliver the packets of every interface until they all stop; user is passed to the handlers.
+     * Returns 0, or -1 if any of them failed.
+     */
+    int  run(u_char *user);
+    void breakloop();                       // safe to call from a signal handler
+};
+
+#endif
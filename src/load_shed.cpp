@@ -0,0 +1,130 @@
+/**
+ *
+ * load_shed.cpp
+ * Giving up work in steps when tcpflow falls behind. See load_shed.h
+ *
+ * This source code is under the GNU Public License (GPL).  See
+ * LICENSE for details.
+ *
+ */
+
+#include "tcpflow.h"
+#include "tcpdemux.h"
+#include "load_shed.h"
+#include "metrics.h"
+#include "scan_pool.h"
+#include "report_writer.h"
+
+#include <vector>
+#include <sstream>
+#include <iomanip>
+#include <thread>
+#include <mutex>
+#include <chrono>
+#include <condition_variable>
+
+/* static */ bool             load_shed::enabled     = false;
+/* static */ uint32_t         load_shed::interval_ms = 1000;
+/* static */ uint64_t         load_shed::drops       = 1;
+/* static */ uint32_t         load_shed::calm        = 10;
+/* static */ uint64_t         load_shed::max_bytes   = 65536;
+/* static */ std::atomic<int> load_shed::current(load_shed::NORMAL);
+
+static const char *level_names[] = {"normal","no_scans","truncate","metadata_only"};
+
+/* a change of level, and why */
+struct change {
+    struct timeval when;
+    int      level;
+    uint64_t drops;                     // since the look before
+    uint64_t scan_queue;
+    uint64_t report_queue;
+};
+
+static std::vector<change>      changes;   // only the thread writes it until stop() has joined it
+static std::thread              watcher;
+static std::mutex               M;
+static std::condition_variable  wake;
+static bool                     stopping = false;
+
+/* static */ void load_shed::start()
+{
+    if(interval_ms<1) interval_ms = 1;
+    if(drops<1) drops = 1;
+    metrics::add_gauge("load_shed_level",[]{ return (uint64_t)level(); });
+    watcher = std::thread(&load_shed::run);
+}
+
+/* static */ void load_shed::stop()
+{
+    if(!watcher.joinable()) return;
+    {
+        std::lock_guard<std::mutex> lock(M);
+        stopping = true;
+    }
+    wake.notify_all();
+    watcher.join();
+    metrics::remove_gauge("load_shed_level");
+}
+
+/* static */ void load_shed::dump_xml(dfxml_writer *xreport)
+{
+    std::stringstream ss;
+    int highest = NORMAL;
+    for(std::vector<change>::const_iterator it=changes.begin();it!=changes.end();it++){
+        if(it->level>highest) highest = it->level;
+        ss << "<change time='" << it->when.tv_sec << "." << std::setw(6) << std::setfill('0') << it->when.tv_usec
+           << "' level='" << it->level << "' name='" << level_names[it->level]
+           << "' drops='" << it->drops << "' scan_queue='" << it->scan_queue
+           << "' report_queue='" << it->report_queue << "'/>";
+    }
+    std::stringstream attrs;
+    attrs << "changes='" << changes.size() << "' highest_level='" << highest << "'";
+    xreport->xmlout("load_shedding",ss.str(),attrs.str(),false);
+}
+
+/* static */ void load_shed::run()
+{
+    uint64_t last_dropped = 0;
+    bool     have_dropped = false;
+    uint32_t calm_looks   = 0;
+    std::unique_lock<std::mutex> lock(M);
+    for(;;){
+        if(wake.wait_for(lock,std::chrono::milliseconds(interval_ms),[]{return stopping;})) break;
+        lock.unlock();
+
+        /* what the capture dropped since the last look, and how full the queues are */
+        uint64_t dropped = 0, delta = 0, scan_queue = 0, report_queue = 0;
+        if(metrics::gauge_value("capture_dropped",dropped)){
+            if(have_dropped && dropped>=last_dropped) delta = dropped-last_dropped;
+            last_dropped = dropped;
+            have_dropped = true;
+        }
+        bool behind = delta>=drops;
+        if(metrics::gauge_value("scan_queue",scan_queue) && scan_queue>=scan_pool::queue_max) behind = true;
+        if(metrics::gauge_value("report_queue",report_queue) && report_queue>=report_writer::queue_max) behind = true;
+
+        int was = level(), now = was;
+        if(behind){
+            calm_looks = 0;
+            if(was<METADATA_ONLY) now = was+1;
+        } else if(was>NORMAL && ++calm_looks>=calm){
+            calm_looks = 0;
+            now = was-1;
+        }
+        if(now!=was){
+            current.store(now,std::memory_order_relaxed);
+            change c;
+            gettimeofday(&c.when,0);
+            c.level        = now;
+            c.drops        = delta;
+            c.scan_queue   = scan_queue;
+            c.report_queue = report_queue;
+            changes.push_back(c);
+            metrics::event(metrics::LOAD_SHED_CHANGES);
+            DEBUG(1)("load_shed: %s (%" PRIu64 " dropped, scan queue %" PRIu64 ", report queue %" PRIu64 ")",
+                     level_names[now],delta,scan_queue,report_queue);
+        }
+        lock.lock();
+    }
+}
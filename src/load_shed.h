@@ -0,0 +1,57 @@
+#ifndef LOAD_SHED_H
+#define LOAD_SHED_H
+
+/**
+ * load_shed.h
+ *
+ * Giving up work in steps when tcpflow falls behind, with -S load_shed=1,
+ * so that a few flows lose what they would have had instead of the kernel
+ * dropping packets of every flow.
+ *
+ * Every -S load_shed_ms milliseconds (default 1000) a thread of its own
+ * looks at the gauges that metrics has (whether or not -S metrics_file is
+ * given): tcpflow is behind if the capture dropped -S load_shed_drops
+ * packets (default 1) or more since the last look, or the scan or report
+ * queue is full. Each time it is behind the level goes up by one:
+ *
+ *   1  no_scans       finished flows are reported but not scanned (-e ...)
+ *   2  truncate       new flows keep only their first -S load_shed_bytes
+ *                     bytes (default 65536), as -b does
+ *   3  metadata_only  new flows get no transcript, only their report
+ *
+ * and after -S load_shed_calm looks in a row (default 10) that it is not,
+ * it goes down by one. Flows keep the level they were created at. Each
+ * change is counted in the metrics (load_shed_changes, load_shed_level),
+ * and listed at the end of the DFXML report in <load_shedding>; each flow
+ * created or finished while shedding says so with <load_shed level='n'/>.
+ *
+ * This source code is under the GNU Public License (GPL).  See
+ * LICENSE for details.
+ */
+
+#include <stdint.h>
+#include <atomic>
+#include <string>
+
+class load_shed {
+public:
+    enum level_t { NORMAL, NO_SCANS, TRUNCATE, METADATA_ONLY, LEVELS };
+
+    static bool     enabled;            // -S load_shed
+    static uint32_t interval_ms;        // -S load_shed_ms
+    static uint64_t drops;              // -S load_shed_drops
+    static uint32_t calm;               // -S load_shed_calm
+    static uint64_t max_bytes;          // -S load_shed_bytes
+
+    static int level() { return current.load(std::memory_order_relaxed); }
+
+    static void start();
+    static void stop();
+    static void dump_xml(class dfxml_writer *xreport); // <load_shedding>, after stop()
+
+private:
+    static std::atomic<int> current;
+    static void run();                  // the thread that sets current
+};
+
+#endif
@@ -0,0 +1,109 @@
+/**
+ *
+ * mem_budget.cpp
+ * What the flows, buffers and scanners hold. See mem_budget.h
+ *
+ * This source code is under the GNU Public License (GPL).  See
+ * LICENSE for details.
+ *
+ */
+
+#include "tcpflow.h"
+#include "mem_budget.h"
+#include "metrics.h"
+
+#include <vector>
+#include <sstream>
+#include <mutex>
+
+/* static */ uint64_t             mem_budget::max   = 0;
+/* static */ uint32_t             mem_budget::batch = 65536;
+/* static */ std::atomic<int64_t> mem_budget::total(0);
+/* static */ std::atomic<int64_t> mem_budget::peak_total(0);
+
+static const char *pool_names[] = {"sessions","recon","reorder","write_buffers",
+                                   "saved_flows","pcap_files","http","tls","netviz","scan"};
+
+static std::mutex                        blocks_M;
+static std::vector<mem_budget::block *>  blocks;  // one for each thread that charged; never freed
+
+mem_budget::block::block():used(),peak(),unpublished(0)
+{
+    for(int i=0;i<POOLS;i++){
+        used[i].store(0,std::memory_order_relaxed);
+        peak[i].store(0,std::memory_order_relaxed);
+    }
+}
+
+void mem_budget::block::publish()
+{
+    if(unpublished==0) return;
+    int64_t t = total.fetch_add(unpublished,std::memory_order_relaxed)+unpublished;
+    unpublished = 0;
+    int64_t p = peak_total.load(std::memory_order_relaxed);
+    while(t>p && !peak_total.compare_exchange_weak(p,t,std::memory_order_relaxed)){
+    }
+}
+
+/* static */ mem_budget::block &mem_budget::local()
+{
+    static thread_local block *mine = 0;
+    if(mine==0){
+        mine = new block();
+        std::lock_guard<std::mutex> lock(blocks_M);
+        blocks.push_back(mine);
+    }
+    return *mine;
+}
+
+/* static */ const char *mem_budget::name(pool_t p)
+{
+    return p<POOLS ? pool_names[p] : "";
+}
+
+/* static */ int64_t mem_budget::used(pool_t p)
+{
+    int64_t n = 0;
+    std::lock_guard<std::mutex> lock(blocks_M);
+    for(std::vector<block *>::const_iterator it=blocks.begin();it!=blocks.end();it++){
+        n += (*it)->used[p].load(std::memory_order_relaxed);
+    }
+    return n;
+}
+
+/* static */ void mem_budget::add_gauges()
+{
+    for(int i=0;i<POOLS;i++){
+        pool_t p = (pool_t)i;
+        metrics::add_gauge(std::string("memory_")+pool_names[i],[p]{
+            int64_t n = used(p);
+            return n>0 ? (uint64_t)n : 0;
+        });
+    }
+    metrics::add_gauge("memory_total",[]{
+        int64_t n = used_total();
+        return n>0 ? (uint64_t)n : 0;
+    });
+}
+
+/* static */ void mem_budget::remove_gauges()
+{
+    for(int i=0;i<POOLS;i++) metrics::remove_gauge(std::string("memory_")+pool_names[i]);
+    metrics::remove_gauge("memory_total");
+}
+
+/* static */ void mem_budget::dump_xml(dfxml_writer *xreport)
+{
+    std::stringstream ss;
+    std::lock_guard<std::mutex> lock(blocks_M);
+    for(int i=0;i<POOLS;i++){
+        int64_t peak = 0;
+        for(std::vector<block *>::const_iterator it=blocks.begin();it!=blocks.end();it++){
+            peak += (*it)->peak[i].load(std::memory_order_relaxed);
+        }
+        ss << "<pool name='" << pool_names[i] << "' peak='" << peak << "'/>";
+    }
+    std::stringstream attrs;
+    attrs << "max='" << max << "' peak='" << peak_total.load(std::memory_order_relaxed) << "'";
+    xreport->xmlout("memory_budget",ss.str(),attrs.str(),false);
+}
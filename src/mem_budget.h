@@ -0,0 +1,93 @@
+#ifndef MEM_BUDGET_H
+#define MEM_BUDGET_H
+
+/**
+ * mem_budget.h
+ *
+ * What tcpflow's flows, buffers and scanners hold in memory, and a limit
+ * for all of it together with -S memory_max=bytes.
+ *
+ * The code that allocates charges what it takes to one of the pools below,
+ * and releases it when it gives it back. As with metrics, each thread counts
+ * into a block of its own with no lock; what a thread has charged or
+ * released since it last did so is added to the total once it comes to
+ * -S memory_batch bytes (default 65536), so the total is that much behind
+ * for each thread, and over() is a single load.
+ *
+ * When the total is over memory_max, tcpdemux::enforce_budget() gives
+ * memory back in steps, stopping as soon as the total is 7/8 of memory_max:
+ *   1. the write buffers and the reorder windows are written out, and the
+ *      saved flows forgotten; nothing is lost but some speed
+ *   2. the flows that have gone longest without a packet are closed, as
+ *      remove_flow() does, up to a quarter of them at a time
+ *   3. if that was not enough, no new connections are started (see
+ *      tcpdemux::start_new_connections) until the total comes down again
+ *
+ * The pools are metrics gauges (memory_sessions, ..., memory_total). The
+ * DFXML report says in <memory_budget> what the total came to at most, and
+ * for each pool the most that each thread's share of it came to, added up.
+ *
+ * This source code is under the GNU Public License (GPL).  See
+ * LICENSE for details.
+ */
+
+#include <stdint.h>
+#include <atomic>
+
+class mem_budget {
+public:
+    enum pool_t {
+        SESSIONS,                       // tcp_session slabs and the flow_map table
+        RECON,                          // the intervals of flows with gaps in them
+        REORDER,                        // segments held past a gap
+        WRITE_BUFFERS,                  // data not yet written to the flows' files
+        SAVED_FLOWS,                    // closed flows remembered, and their tails
+        PCAP_FILES,                     // -K flows and their buffers
+        HTTP,                           // -S http_stream parsers
+        TLS,                            // -S tls_meta parsers
+        NETVIZ,                         // the netviz address trees
+        SCAN,                           // --segments flows read back to be scanned
+        POOLS
+    };
+
+    static uint64_t max;                // -S memory_max; 0 for no limit
+    static uint32_t batch;              // -S memory_batch
+
+    static void charge(pool_t p,int64_t bytes)  { local().charge(p,bytes); }
+    static void release(pool_t p,int64_t bytes) { local().charge(p,-bytes); }
+
+    static bool over()      { return max>0 && total.load(std::memory_order_relaxed) > (int64_t)max; }
+    static bool low_water() { return total.load(std::memory_order_relaxed) <= (int64_t)(max/8*7); }
+    static void flush()     { local().publish(); } // this thread's charges, into the total now
+
+    static const char *name(pool_t p);
+    static int64_t used(pool_t p);      // summed over the threads
+    static int64_t used_total() { return total.load(std::memory_order_relaxed); }
+
+    static void add_gauges();
+    static void remove_gauges();
+    static void dump_xml(class dfxml_writer *xreport);
+
+    /* one thread's charges; only that thread writes them */
+    struct alignas(64) block {
+        block();
+        std::atomic<int64_t> used[POOLS];
+        std::atomic<int64_t> peak[POOLS];
+        int64_t unpublished;            // charged since the last publish()
+        void charge(pool_t p,int64_t n) {
+            int64_t u = used[p].load(std::memory_order_relaxed)+n;
+            used[p].store(u,std::memory_order_relaxed);
+            if(u>peak[p].load(std::memory_order_relaxed)) peak[p].store(u,std::memory_order_relaxed);
+            unpublished += n;
+            if(unpublished>=(int64_t)batch || unpublished<=-(int64_t)batch) publish();
+        }
+        void publish();
+    };
+
+private:
+    static std::atomic<int64_t> total;
+    static std::atomic<int64_t> peak_total;
+    static block &local();
+};
+
+#endif
@@ -0,0 +1,187 @@
+/**
+ *
+ * metrics.cpp
+ * Counters written out while tcpflow runs. See metrics.h
+ *
+ * This source code is under the GNU Public License (GPL).  See
+ * LICENSE for details.
+ *
+ */
+
+#include "tcpflow.h"
+#include "metrics.h"
+
+#include <map>
+#include <vector>
+#include <sstream>
+#include <thread>
+#include <mutex>
+#include <chrono>
+#include <condition_variable>
+
+/* static */ std::string metrics::path     = "";
+/* static */ uint32_t    metrics::interval = 10;
+/* static */ std::string metrics::format   = "text";
+/* static */ bool        metrics::enabled  = false;
+
+static const char *stage_names[] = {"datalink","ip4","ip6","tcp","store","post_process"};
+static const char *event_names[] = {"fd_evictions","shift_file","unshift_file","load_shed_changes","memory_evictions","bad_frames"};
+
+static std::mutex                                    blocks_M;
+static std::vector<metrics::counters *>              blocks;  // one for each thread that counted; never freed
+static std::mutex                                    gauges_M; // held while the gauges are read
+static std::map<std::string,metrics::gauge_fn>       gauges;
+static std::string                                   file;
+static std::thread                                   writer;
+static std::mutex                                    M;
+static std::condition_variable                       wake;
+static bool                                          stopping = false;
+
+metrics::counters::counters():packets(),bytes(),events(),flow_count(0),flow_capacity(0)
+{
+    for(int i=0;i<STAGES;i++){
+        packets[i].store(0,std::memory_order_relaxed);
+        bytes[i].store(0,std::memory_order_relaxed);
+    }
+    for(int i=0;i<EVENTS;i++) events[i].store(0,std::memory_order_relaxed);
+}
+
+/* static */ metrics::counters &metrics::local()
+{
+    static thread_local counters *mine = 0;
+    if(mine==0){
+        mine = new counters();
+        std::lock_guard<std::mutex> lock(blocks_M);
+        blocks.push_back(mine);
+    }
+    return *mine;
+}
+
+/* static */ void metrics::add_gauge(const std::string &name,gauge_fn f)
+{
+    std::lock_guard<std::mutex> lock(gauges_M);
+    gauges[name] = f;
+}
+
+/* static */ void metrics::remove_gauge(const std::string &name)
+{
+    std::lock_guard<std::mutex> lock(gauges_M); // not while it is being read
+    gauges.erase(name);
+}
+
+/* static */ bool metrics::gauge_value(const std::string &name,uint64_t &v)
+{
+    std::lock_guard<std::mutex> lock(gauges_M);
+    std::map<std::string,gauge_fn>::const_iterator it = gauges.find(name);
+    if(it==gauges.end()) return false;
+    v = it->second();
+    return true;
+}
+
+/* static */ void metrics::start(const std::string &file_)
+{
+    if(format!="text" && format!="prometheus"){
+        std::cerr << "metrics_format must be text or prometheus\n";
+        exit(1);
+    }
+    if(interval<1) interval = 1;
+    file = file_;
+    enabled = true;
+    writer = std::thread(&metrics::run);
+}
+
+/* static */ void metrics::stop()
+{
+    if(!enabled) return;
+    {
+        std::lock_guard<std::mutex> lock(M);
+        stopping = true;
+    }
+    wake.notify_all();
+    writer.join();
+    write_out();
+}
+
+/* static */ void metrics::run()
+{
+    std::unique_lock<std::mutex> lock(M);
+    while(!stopping){
+        if(wake.wait_for(lock,std::chrono::seconds(interval),[]{return stopping;})) break;
+        lock.unlock();
+        write_out();
+        lock.lock();
+    }
+}
+
+/* static */ void metrics::write_out()
+{
+    uint64_t packets[STAGES] = {0}, bytes[STAGES] = {0}, events[EVENTS] = {0};
+    uint64_t flow_count = 0, flow_capacity = 0;
+    {
+        std::lock_guard<std::mutex> lock(blocks_M);
+        for(std::vector<counters *>::const_iterator it=blocks.begin();it!=blocks.end();it++){
+            for(int i=0;i<STAGES;i++){
+                packets[i] += (*it)->packets[i].load(std::memory_order_relaxed);
+                bytes[i]   += (*it)->bytes[i].load(std::memory_order_relaxed);
+            }
+            for(int i=0;i<EVENTS;i++) events[i] += (*it)->events[i].load(std::memory_order_relaxed);
+            flow_count    += (*it)->flow_count.load(std::memory_order_relaxed);
+            flow_capacity += (*it)->flow_capacity.load(std::memory_order_relaxed);
+        }
+    }
+    double load = flow_capacity ? (double)flow_count / flow_capacity : 0.0;
+
+    std::stringstream ss;
+    bool prom = format=="prometheus";
+    if(prom){
+        ss << "# TYPE tcpflow_packets_total counter\n";
+        for(int i=0;i<STAGES;i++){
+            ss << "tcpflow_packets_total{stage=\"" << stage_names[i] << "\"} " << packets[i] << "\n";
+        }
+        ss << "# TYPE tcpflow_bytes_total counter\n";
+        for(int i=0;i<STAGES;i++){
+            ss << "tcpflow_bytes_total{stage=\"" << stage_names[i] << "\"} " << bytes[i] << "\n";
+        }
+        for(int i=0;i<EVENTS;i++){
+            ss << "# TYPE tcpflow_" << event_names[i] << "_total counter\n"
+               << "tcpflow_" << event_names[i] << "_total " << events[i] << "\n";
+        }
+        ss << "# TYPE tcpflow_flows gauge\ntcpflow_flows " << flow_count << "\n"
+           << "# TYPE tcpflow_flow_table_load gauge\ntcpflow_flow_table_load " << load << "\n";
+    } else {
+        ss << "time " << time(0) << "\n";
+        for(int i=0;i<STAGES;i++){
+            ss << "packets." << stage_names[i] << " " << packets[i] << "\n"
+               << "bytes." << stage_names[i] << " " << bytes[i] << "\n";
+        }
+        for(int i=0;i<EVENTS;i++) ss << event_names[i] << " " << events[i] << "\n";
+        ss << "flows " << flow_count << "\n"
+           << "flow_table_load " << load << "\n";
+    }
+    {
+        std::lock_guard<std::mutex> lock(gauges_M);
+        for(std::map<std::string,gauge_fn>::const_iterator it=gauges.begin();it!=gauges.end();it++){
+            uint64_t v = it->second();
+            if(prom){
+                ss << "# TYPE tcpflow_" << it->first << " gauge\ntcpflow_" << it->first << " " << v << "\n";
+            } else {
+                ss << it->first << " " << v << "\n";
+            }
+        }
+    }
+
+    /* a new file renamed over the old one, so that it is never seen half written */
+    std::string tmp = file + ".tmp";
+    FILE *f = fopen(tmp.c_str(),"w");
+    if(f==0){
+        DEBUG(1)("%s: %s",tmp.c_str(),strerror(errno));
+        return;
+    }
+    std::string out = ss.str();
+    bool ok = fwrite(out.data(),1,out.size(),f)==out.size();
+    if(fclose(f)!=0) ok = false;
+    if(!ok || rename(tmp.c_str(),file.c_str())!=0){
+        DEBUG(1)("%s: %s",file.c_str(),strerror(errno));
+        unlink(tmp.c_str());
+    }
+}
@@ -0,0 +1,94 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+/**
+ * metrics.h
+ *
+ * Counters written to a file while tcpflow runs, with -S metrics_file.
+ *
+ * Each thread counts into a block of its own, so counting a packet is a
+ * load and a store with no lock and no shared cache line: the packets and
+ * bytes that reach each stage (datalink, ip4, ip6, tcp, store and
+ * post_process), the fds closed to make room for another (close_oldest_fd),
+ * the shift_file() calls, the -S load_shed level changes and the flows closed
+ * for -S memory_max, the frames the datalink handlers found too short
+ * (bad_frames), and the size of the thread's flow table.
+ * Every -S metrics_secs seconds (default 10) a thread of its own adds the
+ * blocks up, reads the gauges that other parts registered (the libpcap or
+ * TPACKET_V3 receive and drop counts, and the scan and report queues) and
+ * writes the lot to the file, by writing a new one and renaming it over the
+ * old, so that a reader never sees half of it. It is written once more at
+ * the end of the run.
+ *
+ * -S metrics_format says how:
+ *   text        name value, one per line
+ *   prometheus  the Prometheus text exposition format, for node_exporter's
+ *               textfile collector
+ *
+ * This source code is under the GNU Public License (GPL).  See
+ * LICENSE for details.
+ */
+
+#include <stdint.h>
+#include <string>
+#include <atomic>
+#include <functional>
+
+class metrics {
+public:
+    static std::string path;            // -S metrics_file; "" for none
+    static uint32_t    interval;        // -S metrics_secs
+    static std::string format;          // -S metrics_format: text or prometheus
+    static bool        enabled;         // set by start()
+
+    enum stage_t { DATALINK, IP4, IP6, TCP, STORE, POST_PROCESS, STAGES };
+    enum event_t { FD_EVICTIONS, SHIFT_FILE, UNSHIFT_FILE, LOAD_SHED_CHANGES, MEMORY_EVICTIONS, BAD_FRAMES, EVENTS };
+
+    static void count(stage_t s,uint64_t bytes) {
+        if(enabled) local().count(s,bytes);
+    }
+    static void event(event_t e) {
+        if(enabled) local().event(e);
+    }
+    /* the size of this thread's flow table */
+    static void flows(size_t count,size_t capacity) {
+        if(enabled) local().flows(count,capacity);
+    }
+
+    /* f is called on the metrics thread, so it has to be safe to call there */
+    typedef std::function<uint64_t()> gauge_fn;
+    static void add_gauge(const std::string &name,gauge_fn f);
+    static void remove_gauge(const std::string &name);
+    static bool gauge_value(const std::string &name,uint64_t &v); // false if there is no such gauge
+
+    static void start(const std::string &file); // file is path, resolved against the output directory
+    static void stop();                 // writes the file once more
+
+    /* one thread's counts; only that thread writes them */
+    struct alignas(64) counters {
+        counters();
+        std::atomic<uint64_t> packets[STAGES];
+        std::atomic<uint64_t> bytes[STAGES];
+        std::atomic<uint64_t> events[EVENTS];
+        std::atomic<uint64_t> flow_count;
+        std::atomic<uint64_t> flow_capacity;
+
+        /* only the thread that owns the block writes it */
+        static void add(std::atomic<uint64_t> &c,uint64_t n) {
+            c.store(c.load(std::memory_order_relaxed)+n,std::memory_order_relaxed);
+        }
+        void count(stage_t s,uint64_t n) { add(packets[s],1); add(bytes[s],n); }
+        void event(event_t e) { add(events[e],1); }
+        void flows(size_t n,size_t capacity) {
+            flow_count.store(n,std::memory_order_relaxed);
+            flow_capacity.store(capacity,std::memory_order_relaxed);
+        }
+    };
+
+private:
+    static counters &local();
+    static void run();                  // metrics thread body
+    static void write_out();
+};
+
+#endif
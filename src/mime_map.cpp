@@ -727,6 +727,7 @@ std::string get_extension_for_mime_type(const std::string& mime_type) {
 	/* Downcase it for comparsion purposes */
 	std::transform(base_type.begin(), base_type.end(), base_type.begin(), ::tolower);
 	
-	/* Look it up in the map */
-	return mime_map[base_type];
+	/* Look it up in the map; without adding to it, as it is shared between threads */
+	std::map<std::string, std::string>::const_iterator it = mime_map.find(base_type);
+	return it==mime_map.end() ? std::string() : it->second;
 }
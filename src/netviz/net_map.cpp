@@ -15,30 +15,91 @@
 
 #include "net_map.h"
 
-void net_map::ingest_packet(const be13::packet_info &pi)
+unsigned net_map::block(const uint8_t *addr)
 {
+    return ((addr[0] << 8) | addr[1]) * side / 65536;
 }
 
-void net_map::render(cairo_t *cr, const plot_view::bounds_t &bounds)
+void net_map::ingest(const uint8_t *src, const uint8_t *dst, uint64_t count)
 {
-    cairo_set_source_rgb(cr, 0.67, 0.67, 0.67);
-    cairo_rectangle(cr, bounds.x, bounds.y, bounds.width, bounds.height);
-    cairo_fill(cr);
+    if(bins.size() == 0) {
+        bins.resize(side * side);
+    }
+    bins[block(src) * side + block(dst)] += count;
+}
 
-    double font_size = 16.0;
-    std::string label = "pretty map";
-    cairo_text_extents_t extents;
+void net_map::merge(const net_map &that)
+{
+    if(that.bins.size() == 0) {
+        return;
+    }
+    if(bins.size() == 0) {
+        bins.resize(side * side);
+    }
+    for(unsigned ii = 0; ii < bins.size(); ii++) {
+        bins[ii] += that.bins[ii];
+    }
+}
 
-    cairo_set_font_size(cr, font_size);
-    cairo_set_source_rgb(cr, 0.0, 0.0, 0.0);
+// each bin that has anything in it
+void net_map::save(std::ostream &os) const
+{
+    for(size_t ii = 0; ii < bins.size(); ii++) {
+        if(bins[ii] > 0) {
+            os << ii << " " << bins[ii] << "\n";
+        }
+    }
+    os << "end\n";
+}
 
-    cairo_text_extents(cr, label.c_str(), &extents);
+bool net_map::load(std::istream &is)
+{
+    bins.assign(side * side, 0);
+    std::string word;
+    while(is >> word) {
+        if(word == "end") {
+            return true;
+        }
+        unsigned long index = strtoul(word.c_str(), 0, 10);
+        uint64_t count = 0;
+        if(index >= bins.size() || !(is >> count)) {
+            return false;
+        }
+        bins[index] += count;
+    }
+    return false;
+}
 
-    double text_x = bounds.x + (bounds.width - extents.width) / 2.0;
-    double text_y = bounds.y + (bounds.height + extents.height) / 2.0;
+void net_map::render(cairo_t *cr, const plot_view::bounds_t &bounds)
+{
+    cairo_set_source_rgb(cr, 0.67, 0.67, 0.67);
+    cairo_rectangle(cr, bounds.x, bounds.y, bounds.width, bounds.height);
+    cairo_fill(cr);
 
-    cairo_move_to(cr, text_x, text_y);
-    cairo_show_text(cr, label.c_str());
+    uint64_t greatest = 0;
+    for(std::vector<uint64_t>::const_iterator it = bins.begin(); it != bins.end(); it++) {
+        greatest = std::max(greatest, *it);
+    }
+    if(greatest == 0) {
+        return;
+    }
 
+    // sources across, destinations down
+    double bin_width = bounds.width / side;
+    double bin_height = bounds.height / side;
+    double log_greatest = log((double) greatest + 1.0);
+    for(unsigned src = 0; src < side; src++) {
+        for(unsigned dst = 0; dst < side; dst++) {
+            uint64_t count = bins[src * side + dst];
+            if(count == 0) {
+                continue;
+            }
+            double shade = 1.0 - log((double) count + 1.0) / log_greatest;
+            cairo_set_source_rgb(cr, shade, shade, shade);
+            cairo_rectangle(cr, bounds.x + src * bin_width, bounds.y + dst * bin_height,
+                    bin_width, bin_height);
+            cairo_fill(cr);
+        }
+    }
 }
 #endif
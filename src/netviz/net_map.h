@@ -13,12 +13,30 @@
 
 #include "plot_view.h"
 
+#include <iostream>
+
+/*
+ * Bytes are added up in a fixed grid of source by destination address
+ * blocks (the top bits of each address) as they arrive, so that memory does
+ * not grow with the packet count and render() draws one rectangle per bin
+ * that has anything in it.
+ */
 class net_map {
 public:
-    net_map() {}
+    static const unsigned side = 64;    // blocks of each address space
+
+    net_map() : bins() {}
 
-    void ingest_packet(const be13::packet_info &pi);
+    void ingest(const uint8_t *src, const uint8_t *dst, uint64_t count);
+    void merge(const net_map &that);
+    void save(std::ostream &os) const;
+    bool load(std::istream &is);
     void render(cairo_t *cr, const plot_view::bounds_t &bounds);
+
+private:
+    std::vector<uint64_t> bins;         // side * side, empty until the first packet
+
+    static unsigned block(const uint8_t *addr);
 };
 
 #endif
@@ -15,6 +15,7 @@
 #ifdef HAVE_LIBCAIRO
 #include "tcpflow.h"
 #include "tcpip.h"
+#include "mem_budget.h"
 
 #include <ctime>
 #include <iomanip>
@@ -60,8 +61,10 @@ one_page_report::one_page_report(int max_histogram_size) :
     bounds(0.0, 0.0, 611.0, 792.0), header_font_size(8.0),
     top_list_font_size(8.0), histogram_show_top_n_text(3),
     packet_count(0), byte_count(0), earliest(), latest(), transport_counts(),
+    packet_scale(packet_sample), flow_scale(flow_sample), sample_counter(0), sampled_packets(0),
     ports_in_time_histogram(), color_labels(), packet_histogram(),
-    src_port_histogram(), dst_port_histogram(), pfall(), netmap(),
+    src_port_histogram(), dst_port_histogram(), pfall(), netmap(), debug_views(getenv("DEBUG") != 0),
+    memory_charged(0),
     src_tree(max_histogram_size), dst_tree(max_histogram_size), port_aliases(),
     port_colormap()
 {
@@ -86,6 +89,57 @@ one_page_report::one_page_report(int max_histogram_size) :
     }
 }
 
+/* static */ uint32_t one_page_report::packet_sample = 1;
+/* static */ uint32_t one_page_report::flow_sample = 1;
+
+/* The same for both directions of a flow; false for a packet that is not IP */
+static bool flow_key(const be13::packet_info &pi,uint64_t &key)
+{
+    const uint8_t *src = 0, *dst = 0;
+    size_t len = 0;
+    uint32_t ports = 0;
+    if(pi.is_ip4()) {
+        src = (const uint8_t *) pi.ip_data + pi.ip4_src_off;
+        dst = (const uint8_t *) pi.ip_data + pi.ip4_dst_off;
+        len = IP4_ADDR_LEN;
+        if(pi.is_ip4_tcp()) {
+            ports = pi.get_ip4_tcp_sport() + pi.get_ip4_tcp_dport();
+        }
+    }
+    else if(pi.is_ip6()) {
+        src = (const uint8_t *) pi.ip_data + pi.ip6_src_off;
+        dst = (const uint8_t *) pi.ip_data + pi.ip6_dst_off;
+        len = IP6_ADDR_LEN;
+        if(pi.is_ip6_tcp()) {
+            ports = pi.get_ip6_tcp_sport() + pi.get_ip6_tcp_dport();
+        }
+    }
+    else {
+        return false;
+    }
+    // FNV-1a of each address, added so that the order does not matter
+    uint64_t hs = 14695981039346656037ULL, hd = 14695981039346656037ULL;
+    for(size_t ii = 0; ii < len; ii++) {
+        hs = (hs ^ src[ii]) * 1099511628211ULL;
+        hd = (hd ^ dst[ii]) * 1099511628211ULL;
+    }
+    key = hs + hd + ports * 0x9E3779B97F4A7C15ULL;
+    key ^= key >> 31;                   // mix the high bits into the low ones
+    key *= 0xBF58476D1CE4E5B9ULL;
+    key ^= key >> 29;
+    return true;
+}
+
+/* The trees only grow: charge what they have grown by */
+void one_page_report::charge_memory()
+{
+    int64_t m = src_tree.memory() + dst_tree.memory();
+    if(m!=memory_charged){
+        mem_budget::charge(mem_budget::NETVIZ,m-memory_charged);
+        memory_charged = m;
+    }
+}
+
 void one_page_report::ingest_packet(const be13::packet_info &pi)
 {
     if(earliest.tv_sec == 0 || (pi.ts.tv_sec < earliest.tv_sec ||
@@ -96,8 +150,27 @@ void one_page_report::ingest_packet(const be13::packet_info &pi)
         latest = pi.ts;
     }
 
-    size_t packet_length = pi.pcap_hdr->len;
-    packet_count++;
+    // with sampling, a packet that is counted stands for scale packets like it
+    uint64_t scale = 1;
+    if(packet_scale > 1) {
+        if(sample_counter++ % packet_scale != 0) {
+            return;
+        }
+        scale = packet_scale;
+    }
+    if(flow_scale > 1) {
+        uint64_t key = 0;
+        if(flow_key(pi,key)) {          // packets of no flow are all counted
+            if(key % flow_scale != 0) {
+                return;
+            }
+            scale *= flow_scale;
+        }
+    }
+    sampled_packets++;
+
+    uint64_t packet_length = pi.pcap_hdr->len * scale;
+    packet_count += scale;
     byte_count += packet_length;
     transport_counts[pi.ether_type()] += packet_length; // should we handle VLANs?
 
@@ -110,12 +183,22 @@ void one_page_report::ingest_packet(const be13::packet_info &pi)
 
         src_tree.add((uint8_t *) pi.ip_data + pi.ip4_src_off, IP4_ADDR_LEN, packet_length);
         dst_tree.add((uint8_t *) pi.ip_data + pi.ip4_dst_off, IP4_ADDR_LEN, packet_length);
+        if(debug_views) {
+            netmap.ingest((uint8_t *) pi.ip_data + pi.ip4_src_off, (uint8_t *) pi.ip_data + pi.ip4_dst_off,
+                    packet_length);
+        }
+        charge_memory();
     }
     else if(pi.is_ip6()) {
         ip_ver = 6;
 
         src_tree.add((uint8_t *) pi.ip_data + pi.ip6_src_off, IP6_ADDR_LEN, packet_length);
         dst_tree.add((uint8_t *) pi.ip_data + pi.ip6_dst_off, IP6_ADDR_LEN, packet_length);
+        if(debug_views) {
+            netmap.ingest((uint8_t *) pi.ip_data + pi.ip6_src_off, (uint8_t *) pi.ip_data + pi.ip6_dst_off,
+                    packet_length);
+        }
+        charge_memory();
     }
     else {
         packet_histogram.insert(pi.ts, 0, packet_length, time_histogram::F_NON_TCP);
@@ -164,15 +247,165 @@ void one_page_report::ingest_packet(const be13::packet_info &pi)
     }
     // if both are colored, alternate src and dst
     else if(tcp_src_color != port_colormap.end() && tcp_dst_color != port_colormap.end() &&
-            packet_count % 2 == 0) {
+            sampled_packets % 2 == 0) {
         packet_histogram_port = tcp_dst;
     }
     // record that this port appears in the histogram for legend building purposes
     ports_in_time_histogram[packet_histogram_port] = true;
-    packet_histogram.insert(pi.ts, packet_histogram_port, packet_length);
 
     src_port_histogram.increment(tcp_src, packet_length);
     dst_port_histogram.increment(tcp_dst, packet_length);
+
+    // a port with a color keeps a slot in its bucket: a pre-colored one, or one
+    // of the top source ports that render() gives the rest of the colors to
+    bool colored = port_colormap.find(packet_histogram_port) != port_colormap.end();
+    vector<port_histogram::port_count>::const_iterator top = src_port_histogram.begin();
+    for(size_t count = 0; !colored && count < port_colors_count && top != src_port_histogram.end(); top++) {
+        if(port_colormap.find(top->port) == port_colormap.end()) {
+            colored = top->port == packet_histogram_port;
+            count++;
+        }
+    }
+    packet_histogram.insert(pi.ts, packet_histogram_port, packet_length,
+            colored ? time_histogram::F_COLORED : 0);
+    if(debug_views) {
+        pfall.ingest(pi.ts, tcp_dst, packet_length);
+    }
+}
+
+void one_page_report::merge(const one_page_report &that)
+{
+    if(that.packet_count == 0) {
+        return;
+    }
+    if(earliest.tv_sec == 0 || timercmp(&that.earliest, &earliest, <)) {
+        earliest = that.earliest;
+    }
+    if(timercmp(&that.latest, &latest, >)) {
+        latest = that.latest;
+    }
+    packet_count += that.packet_count;
+    byte_count += that.byte_count;
+    packet_scale = max(packet_scale, that.packet_scale);
+    flow_scale = max(flow_scale, that.flow_scale);
+    sampled_packets += that.sampled_packets;
+    for(map<uint32_t, uint64_t>::const_iterator it = that.transport_counts.begin();
+            it != that.transport_counts.end(); it++) {
+        transport_counts[it->first] += it->second;
+    }
+    for(map<uint16_t, bool>::const_iterator it = that.ports_in_time_histogram.begin();
+            it != that.ports_in_time_histogram.end(); it++) {
+        if(it->second) {
+            ports_in_time_histogram[it->first] = true;
+        }
+    }
+    packet_histogram.merge(that.packet_histogram);
+    src_port_histogram.merge(that.src_port_histogram);
+    dst_port_histogram.merge(that.dst_port_histogram);
+    src_tree.merge(that.src_tree);
+    dst_tree.merge(that.dst_tree);
+    charge_memory();
+    pfall.merge(that.pfall);
+    netmap.merge(that.netmap);
+}
+
+// the version of what save() writes
+static const string state_header = "netviz-state 1";
+
+void one_page_report::save(std::ostream &os) const
+{
+    os << state_header << "\n";
+    os << "packets " << packet_count << " " << byte_count << " " << earliest.tv_sec << " " << earliest.tv_usec
+       << " " << latest.tv_sec << " " << latest.tv_usec << "\n";
+    os << "sampling " << packet_scale << " " << flow_scale << " " << sampled_packets << "\n";
+    for(map<uint32_t, uint64_t>::const_iterator it = transport_counts.begin();
+            it != transport_counts.end(); it++) {
+        os << "transport " << it->first << " " << it->second << "\n";
+    }
+    for(map<uint16_t, bool>::const_iterator it = ports_in_time_histogram.begin();
+            it != ports_in_time_histogram.end(); it++) {
+        if(it->second) {
+            os << "time_port " << it->first << "\n";
+        }
+    }
+    os << "time_histogram ";
+    packet_histogram.save(os);
+    os << "src_ports\n";
+    src_port_histogram.save(os);
+    os << "dst_ports\n";
+    dst_port_histogram.save(os);
+    os << "src_tree\n";
+    src_tree.save(os);
+    os << "dst_tree\n";
+    dst_tree.save(os);
+    if(debug_views) {
+        os << "packetfall ";
+        pfall.save(os);
+        os << "net_map\n";
+        netmap.save(os);
+    }
+    os << "end\n";
+}
+
+bool one_page_report::load(std::istream &is)
+{
+    string line;
+    if(!getline(is, line) || line != state_header) {
+        return false;
+    }
+    string word;
+    while(is >> word) {
+        bool ok = true;
+        if(word == "end") {
+            return true;
+        }
+        else if(word == "packets") {
+            ok = (bool) (is >> packet_count >> byte_count >> earliest.tv_sec >> earliest.tv_usec
+                         >> latest.tv_sec >> latest.tv_usec);
+        }
+        else if(word == "sampling") {
+            ok = (bool) (is >> packet_scale >> flow_scale >> sampled_packets);
+        }
+        else if(word == "transport") {
+            uint32_t ethertype = 0;
+            uint64_t count = 0;
+            ok = (bool) (is >> ethertype >> count);
+            transport_counts[ethertype] += count;
+        }
+        else if(word == "time_port") {
+            uint16_t port = 0;
+            ok = (bool) (is >> port);
+            ports_in_time_histogram[port] = true;
+        }
+        else if(word == "time_histogram") {
+            ok = packet_histogram.load(is);
+        }
+        else if(word == "src_ports") {
+            ok = src_port_histogram.load(is);
+        }
+        else if(word == "dst_ports") {
+            ok = dst_port_histogram.load(is);
+        }
+        else if(word == "src_tree") {
+            ok = src_tree.load(is);
+        }
+        else if(word == "dst_tree") {
+            ok = dst_tree.load(is);
+        }
+        else if(word == "packetfall") {
+            ok = pfall.load(is);
+        }
+        else if(word == "net_map") {
+            ok = netmap.load(is);
+        }
+        else {
+            ok = false;
+        }
+        if(!ok) {
+            return false;
+        }
+    }
+    return false;
 }
 
 void one_page_report::render(const string &outdir)
@@ -313,7 +546,7 @@ void one_page_report::render(const string &outdir)
     pass.render_header();
     pass.render(th_view);
     pass.render(lg_view);
-    if(getenv("DEBUG")) {
+    if(debug_views) {
         pass.render_map();
         pass.render_packetfall();
     }
@@ -371,6 +604,22 @@ void one_page_report::render_pass::render_header()
             plot_view::pretty_byte_total(report.byte_count).c_str());
     render_text_line(formatted.c_str(), report.header_font_size,
             title_line_space);
+    //// sampling, and how far the totals may be off
+    if(report.packet_scale > 1 || report.flow_scale > 1) {
+        if(report.flow_scale > 1) {
+            formatted = ssprintf("Sampled: 1 in %u packets of 1 in %u flows; counts are scaled up "
+                    "and depend on which flows were sampled",
+                    report.packet_scale, report.flow_scale);
+        }
+        else {
+            double err = report.sampled_packets ?
+                196.0 * sqrt((1.0 - 1.0 / report.packet_scale) / report.sampled_packets) : 100.0;
+            formatted = ssprintf("Sampled: 1 in %u packets; counts are scaled up (totals within %.2f%% at 95%% confidence)",
+                    report.packet_scale, err);
+        }
+        render_text_line(formatted.c_str(), report.header_font_size,
+                title_line_space);
+    }
     //// protocol breakdown
     uint64_t transport_total = 0;
     for(map<uint32_t, uint64_t>::const_iterator ii =
@@ -76,12 +76,23 @@ public:
     one_page_report(int max_histogram_size);
 
     void ingest_packet(const be13::packet_info &pi);
+    /* Partial reports, from other threads or saved by other runs, are merged
+     * into one before it is rendered.
+     */
+    void merge(const one_page_report &that);
+    void save(std::ostream &os) const;
+    bool load(std::istream &is);        // into a new report; false if is was not written by save()
     void render(const std::string &outdir);
     plot_view::rgb_t port_color(uint16_t port) const;
     void dump(int debug);
 
     static transport_type_vector build_display_transports();
 
+    // -S netviz_sample and -S netviz_sample_flows: count 1 in N packets, or the
+    // packets of 1 in N flows by a hash of their addresses and ports
+    static uint32_t packet_sample;
+    static uint32_t flow_sample;
+
     static const unsigned int max_bars;
     static const unsigned int port_colors_count;
     // string constants
@@ -118,13 +129,20 @@ private:
     struct timeval earliest;
     struct timeval latest;
     std::map<uint32_t, uint64_t> transport_counts;
+    uint32_t packet_scale;              // packet_sample and flow_sample when the report was made
+    uint32_t flow_scale;
+    uint64_t sample_counter;            // packets seen, for packet_sample
+    uint64_t sampled_packets;           // packets counted
     std::map<uint16_t, bool> ports_in_time_histogram;
     legend_view::entries_t color_labels;
     time_histogram packet_histogram;
     port_histogram src_port_histogram;
     port_histogram dst_port_histogram;
-    packetfall pfall;
+    packetfall pfall;                   // these two are only drawn, and so only fed, with DEBUG set
     net_map netmap;
+    bool debug_views;
+    int64_t memory_charged;             // what the trees are charged to mem_budget::NETVIZ
+    void charge_memory();
 public:
     iptree src_tree;
     iptree dst_tree;
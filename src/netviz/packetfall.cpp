@@ -15,30 +15,145 @@
 
 #include "packetfall.h"
 
-void packetfall::ingest_packet(const be13::packet_info &pi)
+static int64_t usecs_between(const struct timeval &from, const struct timeval &to)
 {
+    return (int64_t) (to.tv_sec - from.tv_sec) * 1000000 + (to.tv_usec - from.tv_usec);
 }
 
-void packetfall::render(cairo_t *cr, const plot_view::bounds_t &bounds)
+void packetfall::ingest(const struct timeval &ts, uint16_t port, uint64_t count)
 {
-    cairo_set_source_rgb(cr, 0.67, 0.67, 0.67);
-    cairo_rectangle(cr, bounds.x, bounds.y, bounds.width, bounds.height);
-    cairo_fill(cr);
+    if(bins.size() == 0) {
+        bins.resize(columns * rows);
+        start = ts;
+    }
+    unsigned row = (unsigned) (log2((double) port + 1.0) * 2.0);
+    if(row >= rows) {
+        row = rows - 1;
+    }
+    add(usecs_between(start, ts), row, count);
+}
+
+void packetfall::add(int64_t usecs, unsigned row, uint64_t count)
+{
+    if(usecs < 0) {
+        usecs = 0;                      // out of order; it goes in the first column
+    }
+    while((uint64_t) usecs / column_usecs >= columns) {
+        fold();
+    }
+    bins[((uint64_t) usecs / column_usecs) * rows + row] += count;
+}
+
+void packetfall::fold()
+{
+    for(unsigned col = 0; col < columns; col++) {
+        for(unsigned row = 0; row < rows; row++) {
+            uint64_t sum = 0;
+            if(col * 2 < columns) {
+                sum = bins[col * 2 * rows + row] + bins[(col * 2 + 1) * rows + row];
+            }
+            bins[col * rows + row] = sum;
+        }
+    }
+    column_usecs *= 2;
+}
 
-    double font_size = 16.0;
-    std::string label = "pretty packetfall";
-    cairo_text_extents_t extents;
+void packetfall::merge(const packetfall &that)
+{
+    if(that.bins.size() == 0) {
+        return;
+    }
+    if(bins.size() == 0) {
+        *this = that;
+        return;
+    }
+    if(usecs_between(start, that.start) < 0) {
+        packetfall earlier(that);       // so that nothing falls before the first column
+        earlier.merge(*this);
+        *this = earlier;
+        return;
+    }
+    // each of that's bins goes in at its start time
+    for(unsigned col = 0; col < columns; col++) {
+        int64_t usecs = usecs_between(start, that.start) + (int64_t) (col * that.column_usecs);
+        for(unsigned row = 0; row < rows; row++) {
+            if(that.bins[col * rows + row]) {
+                add(usecs, row, that.bins[col * rows + row]);
+            }
+        }
+    }
+}
 
-    cairo_set_font_size(cr, font_size);
-    cairo_set_source_rgb(cr, 0.0, 0.0, 0.0);
+// the start, the column width and then each bin that has anything in it
+void packetfall::save(std::ostream &os) const
+{
+    os << start.tv_sec << " " << start.tv_usec << " " << column_usecs << "\n";
+    for(size_t ii = 0; ii < bins.size(); ii++) {
+        if(bins[ii] > 0) {
+            os << ii << " " << bins[ii] << "\n";
+        }
+    }
+    os << "end\n";
+}
 
-    cairo_text_extents(cr, label.c_str(), &extents);
+bool packetfall::load(std::istream &is)
+{
+    if(!(is >> start.tv_sec >> start.tv_usec >> column_usecs) || column_usecs == 0) {
+        return false;
+    }
+    bins.assign(columns * rows, 0);
+    std::string word;
+    while(is >> word) {
+        if(word == "end") {
+            return true;
+        }
+        unsigned long index = strtoul(word.c_str(), 0, 10);
+        uint64_t count = 0;
+        if(index >= bins.size() || !(is >> count)) {
+            return false;
+        }
+        bins[index] += count;
+    }
+    return false;
+}
 
-    double text_x = bounds.x + (bounds.width - extents.width) / 2.0;
-    double text_y = bounds.y + (bounds.height + extents.height) / 2.0;
+void packetfall::render(cairo_t *cr, const plot_view::bounds_t &bounds)
+{
+    cairo_set_source_rgb(cr, 0.67, 0.67, 0.67);
+    cairo_rectangle(cr, bounds.x, bounds.y, bounds.width, bounds.height);
+    cairo_fill(cr);
 
-    cairo_move_to(cr, text_x, text_y);
-    cairo_show_text(cr, label.c_str());
+    uint64_t greatest = 0;
+    for(std::vector<uint64_t>::const_iterator it = bins.begin(); it != bins.end(); it++) {
+        greatest = std::max(greatest, *it);
+    }
+    if(greatest == 0) {
+        return;
+    }
 
+    // only the columns that were used are drawn, across the whole width
+    unsigned used = 0;
+    for(unsigned ii = 0; ii < bins.size(); ii++) {
+        if(bins[ii]) {
+            used = ii / rows + 1;
+        }
+    }
+    double bin_width = bounds.width / used;
+    double bin_height = bounds.height / rows;
+    double log_greatest = log((double) greatest + 1.0);
+    for(unsigned col = 0; col < used; col++) {
+        for(unsigned row = 0; row < rows; row++) {
+            uint64_t count = bins[col * rows + row];
+            if(count == 0) {
+                continue;
+            }
+            double shade = 1.0 - log((double) count + 1.0) / log_greatest;
+            cairo_set_source_rgb(cr, shade, shade, shade);
+            // low ports at the bottom
+            cairo_rectangle(cr, bounds.x + col * bin_width, bounds.y + (rows - 1 - row) * bin_height,
+                    bin_width, bin_height);
+            cairo_fill(cr);
+        }
+    }
 }
 #endif
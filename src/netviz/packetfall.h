@@ -13,12 +13,35 @@
 
 #include "plot_view.h"
 
+#include <iostream>
+
+/*
+ * Bytes are added up in a fixed grid of time columns by port rows as they
+ * arrive, so that memory does not grow with the packet count and render()
+ * draws one rectangle per bin that has anything in it. When a packet falls
+ * past the last column, neighbouring columns are folded together and each
+ * column covers twice the time.
+ */
 class packetfall {
 public:
-    packetfall() {}
+    static const unsigned columns = 128;
+    static const unsigned rows = 32;    // log2 of the port, in steps of 1/2
+
+    packetfall() : bins(), start(), column_usecs(1000) {}
 
-    void ingest_packet(const be13::packet_info &pi);
+    void ingest(const struct timeval &ts, uint16_t port, uint64_t count);
+    void merge(const packetfall &that);
+    void save(std::ostream &os) const;
+    bool load(std::istream &is);
     void render(cairo_t *cr, const plot_view::bounds_t &bounds);
+
+private:
+    std::vector<uint64_t> bins;         // columns * rows, empty until the first packet
+    struct timeval start;
+    uint64_t column_usecs;
+
+    void add(int64_t usecs, unsigned row, uint64_t count); // usecs since start
+    void fold();
 };
 
 #endif
@@ -36,22 +36,76 @@ bool port_histogram::descending_counts::operator()(const port_count &a,
 
 void port_histogram::increment(uint16_t port, uint64_t delta)
 {
-    port_counts[port] += delta;
+    uint64_t count = (port_counts[port] += delta);
     data_bytes_ingested += delta;
-    buckets_dirty = true;
+
+    // counts only grow, so a port that is not in the buckets can only get in
+    // by passing the smallest of them
+    port_count pc(port, count);
+    if(buckets.size() == bucket_count && descending_counts()(buckets.back(), pc)) {
+        return;
+    }
+    size_t ii = 0;
+    while(ii < buckets.size() && buckets[ii].port != port) {
+        ii++;
+    }
+    if(ii == buckets.size()) {
+        if(buckets.size() < bucket_count) {
+            buckets.push_back(pc);
+        }
+        else {
+            ii = buckets.size() - 1;    // takes the place of the smallest
+        }
+    }
+    buckets[ii] = pc;
+    for(; ii > 0 && descending_counts()(buckets[ii], buckets[ii - 1]); ii--) {
+        swap(buckets[ii], buckets[ii - 1]);
+    }
 }
 
-const port_histogram::port_count &port_histogram::at(size_t index)
+void port_histogram::merge(const port_histogram &that)
 {
-    refresh_buckets();
+    for(size_t port = 0; port < that.port_counts.size(); port++) {
+        if(that.port_counts[port] > 0) {
+            increment(port, that.port_counts[port]);
+        }
+    }
+}
 
+void port_histogram::save(std::ostream &os) const
+{
+    for(size_t port = 0; port < port_counts.size(); port++) {
+        if(port_counts[port] > 0) {
+            os << port << " " << port_counts[port] << "\n";
+        }
+    }
+    os << "end\n";
+}
+
+bool port_histogram::load(std::istream &is)
+{
+    std::string word;
+    while(is >> word) {
+        if(word == "end") {
+            return true;
+        }
+        unsigned long port = strtoul(word.c_str(), 0, 10);
+        uint64_t count = 0;
+        if(port > 65535 || !(is >> count)) {
+            return false;
+        }
+        increment(port, count);
+    }
+    return false;
+}
+
+const port_histogram::port_count &port_histogram::at(size_t index)
+{
     return buckets.at(index);
 }
 
 size_t port_histogram::size()
 {
-    refresh_buckets();
-
     return buckets.size();
 }
 
@@ -62,54 +116,18 @@ uint64_t port_histogram::ingest_count() const
 
 port_histogram::port_count_vector::const_iterator port_histogram::begin()
 {
-    refresh_buckets();
-
     return buckets.begin();
 }
 port_histogram::port_count_vector::const_iterator port_histogram::end()
 {
-    refresh_buckets();
-
     return buckets.end();
 }
 port_histogram::port_count_vector::const_reverse_iterator port_histogram::rbegin()
 {
-    refresh_buckets();
-
     return buckets.rbegin();
 }
 port_histogram::port_count_vector::const_reverse_iterator port_histogram::rend()
 {
-    refresh_buckets();
-
     return buckets.rend();
 }
-
-void port_histogram::refresh_buckets()
-{
-    if(!buckets_dirty) {
-        return;
-    }
-
-    buckets.clear();
-
-    for(port_counts_t::const_iterator it = port_counts.begin();
-            it != port_counts.end(); it++) {
-        buckets.push_back(port_count(it->first, it->second));
-    }
-
-    if(buckets.size() <= bucket_count) {
-        sort(buckets.begin(), buckets.end(), descending_counts());
-    }
-    else {
-        partial_sort(buckets.begin(), buckets.begin() + bucket_count,
-                buckets.end(), descending_counts());
-    }
-
-    if(buckets.size() > bucket_count) {
-        buckets.erase(buckets.begin() + bucket_count, buckets.end());
-    }
-
-    buckets_dirty = false;
-}
 #endif
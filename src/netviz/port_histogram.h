@@ -14,7 +14,7 @@
 class port_histogram {
 public:
     port_histogram() :
-        port_counts(), data_bytes_ingested(0), buckets(), buckets_dirty(true) {}
+        port_counts(65536), data_bytes_ingested(0), buckets() {}
 
     class port_count {
     public:
@@ -31,6 +31,10 @@ public:
     };
 
     void increment(uint16_t port, uint64_t delta);
+    void merge(const port_histogram &that);
+    // "port count" lines for the ports with counts, then "end"
+    void save(std::ostream &os) const;
+    bool load(std::istream &is);
     const port_count &at(size_t index);
     size_t size();
     uint64_t ingest_count() const;
@@ -45,13 +49,13 @@ public:
     static const size_t bucket_count;
 
 private:
-    typedef std::map<in_port_t, uint64_t> port_counts_t;
+    /* counted for every TCP packet, so the counts are indexed by port and the
+     * bucket_count largest are kept in order as they change
+     */
+    typedef std::vector<uint64_t> port_counts_t;
     port_counts_t port_counts;
     uint64_t data_bytes_ingested;
-    std::vector<port_count> buckets;
-    bool buckets_dirty;
-
-    void refresh_buckets();
+    std::vector<port_count> buckets;    // the largest port_counts, in descending_counts order
 };
 
 #endif
@@ -10,6 +10,7 @@
  */
 
 #include <vector>
+#include <sstream>
 
 #include "time_histogram.h"
 
@@ -35,6 +36,7 @@ const float time_histogram::underflow_pad_factor = 0.1;
 const std::vector<time_histogram::span_params> time_histogram::spans = time_histogram::build_spans();
 const time_histogram::bucket time_histogram::empty_bucket; // an empty bucket
 const unsigned int time_histogram::F_NON_TCP = 0x01;
+const unsigned int time_histogram::F_COLORED = 0x02;
 
 void time_histogram::insert(const struct timeval &ts, const in_port_t port, const uint64_t count,
         const unsigned int flags)
@@ -65,22 +67,126 @@ void time_histogram::condense(double factor)
     const histogram_map &original = histograms.at(best_fit_index);
     histogram_map condensed(span_params(original.span.usec, (uint64_t) ((double) original.span.bucket_count / factor)));
 
-    for(histogram_map::buckets_t::const_iterator it = original.buckets.begin(); it != original.buckets.end(); it++) {
+    for(uint32_t index = original.first_used; original.used > 0 && index <= original.last_used; index++) {
 
-        bucket &bkt = *(it->second);
-        uint64_t recons_usec = it->first * original.bucket_width + original.base_time;
+        const bucket &bkt = original.buckets[index];
+        if(bkt.sum() == 0) {
+            continue;
+        }
+        condensed.insert(original.bucket_time(index), bkt);
+    }
 
-        struct timeval reconstructed_ts;
-        reconstructed_ts.tv_usec = (time_t) (recons_usec % (1000LL * 1000LL));
-        reconstructed_ts.tv_sec = (time_t) (recons_usec / (1000LL * 1000LL));
+    histograms.at(best_fit_index) = condensed;
+}
 
-        for(bucket::counts_t::const_iterator jt = bkt.counts.begin(); jt != bkt.counts.end(); jt++) {
-            condensed.insert(reconstructed_ts, jt->first, jt->second);
+void time_histogram::merge(const time_histogram &that)
+{
+    if(that.insert_count == 0) {
+        return;
+    }
+    insert_count += that.insert_count;
+    if(earliest_ts.tv_sec == 0 || timercmp(&that.earliest_ts, &earliest_ts, <)) {
+        earliest_ts = that.earliest_ts;
+    }
+    if(timercmp(&that.latest_ts, &latest_ts, >)) {
+        latest_ts = that.latest_ts;
+    }
+    if(that.best_fit_index > best_fit_index) {
+        best_fit_index = that.best_fit_index;
+    }
+    for(uint32_t ii = best_fit_index; ii < histograms.size(); ii++) {
+        const histogram_map &from = that.histograms.at(ii);
+        for(uint32_t index = from.first_used; from.used > 0 && index <= from.last_used; index++) {
+            const bucket &bkt = from.buckets[index];
+            if(bkt.sum() == 0) {
+                continue;
+            }
+            // a span that does not hold both is no longer a fit
+            if(histograms[ii].insert(from.bucket_time(index), bkt)) {
+                if(best_fit_index <= ii && ii < histograms.size() - 1) {
+                    best_fit_index = ii + 1;
+                }
+                break;
+            }
         }
-        condensed.insert(reconstructed_ts, 0, bkt.portless_count, F_NON_TCP);
     }
+}
 
-    histograms.at(best_fit_index) = condensed;
+/* first the counts and times, then each span in use as a "span" line and a
+ * line for each of its buckets: index, portless, other and port:count pairs
+ */
+void time_histogram::save(std::ostream &os) const
+{
+    os << insert_count << " " << best_fit_index << " " << earliest_ts.tv_sec << " " << earliest_ts.tv_usec
+       << " " << latest_ts.tv_sec << " " << latest_ts.tv_usec << "\n";
+    for(uint32_t ii = best_fit_index; ii < histograms.size(); ii++) {
+        const histogram_map &hgram = histograms[ii];
+        if(hgram.used == 0) {
+            continue;
+        }
+        os << "span " << ii << " " << hgram.base_time << "\n";
+        for(uint32_t index = hgram.first_used; index <= hgram.last_used; index++) {
+            const bucket &bkt = hgram.buckets[index];
+            if(bkt.sum() == 0) {
+                continue;
+            }
+            os << index << " " << bkt.portless_count << " " << bkt.other_count;
+            // port:count, or port=count for a port with a color
+            for(unsigned int jj = 0; jj < bucket::port_slots && bkt.counts[jj] > 0; jj++) {
+                os << " " << bkt.ports[jj] << ((bkt.colored & (1 << jj)) ? "=" : ":") << bkt.counts[jj];
+            }
+            os << "\n";
+        }
+    }
+    os << "end\n";
+}
+
+bool time_histogram::load(std::istream &is)
+{
+    std::string line;
+    if(!(is >> insert_count >> best_fit_index >> earliest_ts.tv_sec >> earliest_ts.tv_usec
+         >> latest_ts.tv_sec >> latest_ts.tv_usec) || best_fit_index >= histograms.size()) {
+        return false;
+    }
+    histogram_map *hgram = 0;
+    std::getline(is, line);
+    while(std::getline(is, line)) {
+        std::istringstream ls(line);
+        std::string word;
+        ls >> word;
+        if(word == "end") {
+            return true;
+        }
+        if(word == "span") {
+            uint32_t ii = 0;
+            uint64_t base_time = 0;
+            if(!(ls >> ii >> base_time) || ii >= histograms.size()) {
+                return false;
+            }
+            hgram = &histograms[ii];
+            hgram->base_time = base_time;
+            continue;
+        }
+        bucket bkt;
+        uint32_t index = strtoul(word.c_str(), 0, 10);
+        uint64_t portless = 0, other = 0;
+        if(hgram == 0 || !(ls >> portless >> other)) {
+            return false;
+        }
+        bkt.increment(0, portless, F_NON_TCP);
+        bkt.other_count = other;
+        bkt.total += other;
+        unsigned int port = 0;
+        char sep = 0;
+        uint64_t count = 0;
+        while(ls >> port >> sep >> count) {
+            bkt.increment(port, count, sep == '=' ? F_COLORED : 0);
+        }
+        if(hgram->insert(hgram->bucket_time(index), bkt)) {
+            return false;
+        }
+    }
+    return false;
 }
 
 uint64_t time_histogram::usec_per_bucket() const
@@ -109,46 +215,32 @@ uint64_t time_histogram::tallest_bar() const
 }
 
 const time_histogram::bucket &time_histogram::at(uint32_t index) const {
-    const histogram_map::buckets_t hgram = histograms.at(best_fit_index).buckets;
-    histogram_map::buckets_t::const_iterator bkt = hgram.find(index);
-    if(bkt == hgram.end()) {
+    const histogram_map::buckets_t &hgram = histograms.at(best_fit_index).buckets;
+    if(index >= hgram.size()) {
         return empty_bucket;
     }
-    return *(bkt->second);
+    return hgram[index];
 }
 
+// the number of buckets with anything in them
 size_t time_histogram::size() const
 {
-    return histograms.at(best_fit_index).buckets.size();
+    return histograms.at(best_fit_index).used;
 }
 
-// calculate the number of buckets if this were a non-sparse data structure like a vector
+// the number of buckets from the first to the last with anything in them
 size_t time_histogram::non_sparse_size() const
 {
-    histogram_map::buckets_t buckets = histograms.at(best_fit_index).buckets;
-    histogram_map::buckets_t::const_iterator least = buckets.begin();
-    if(least == buckets.end()) {
+    const histogram_map &hgram = histograms.at(best_fit_index);
+    if(hgram.used == 0) {
         return 0;
     }
-    histogram_map::buckets_t::const_reverse_iterator most = buckets.rbegin();
-    return most->first - least->first + 1;
+    return hgram.last_used - hgram.first_used + 1;
 }
 
-time_histogram::histogram_map::buckets_t::const_iterator time_histogram::begin() const
-{
-    return histograms.at(best_fit_index).buckets.begin();
-}
-time_histogram::histogram_map::buckets_t::const_iterator time_histogram::end() const
-{
-    return histograms.at(best_fit_index).buckets.end();
-}
-time_histogram::histogram_map::buckets_t::const_reverse_iterator time_histogram::rbegin() const
-{
-    return histograms.at(best_fit_index).buckets.rbegin();
-}
-time_histogram::histogram_map::buckets_t::const_reverse_iterator time_histogram::rend() const
+uint32_t time_histogram::first_index() const
 {
-    return histograms.at(best_fit_index).buckets.rend();
+    return histograms.at(best_fit_index).first_used;
 }
 
 /* This should be rewritten, because currently it is building a bunch of spans and then returning a vector which has to be copied.
@@ -192,25 +284,51 @@ time_histogram::span_params_vector_t time_histogram::build_spans()
 /*
  * Insert into the time_histogram.
  *
- * This is optimized to be as fast as possible, so we compute the sums as necessary when generating the histogram.
+ * This is done for every packet, in every span that has not overflowed, so the
+ * buckets are an array indexed by time and the sums are kept as they change
+ * rather than computed when the histogram is drawn.
  */
 
+bool time_histogram::histogram_map::target(const struct timeval &ts, uint32_t &index)
+{
+    index = scale_timeval(ts);
+
+    if(index >= span.bucket_count) {
+        return false;
+    }
+    if(buckets.empty()) {
+        buckets.resize(span.bucket_count);
+    }
+    return true;
+}
+
 bool time_histogram::histogram_map::insert(const struct timeval &ts, const in_port_t port, const uint64_t count,
         const unsigned int flags)
 {
-    uint32_t target_index = scale_timeval(ts);
-
-    if(target_index >= span.bucket_count) {
+    uint32_t index = 0;
+    if(!target(ts, index)) {
         return true;                    // overflow; will cause this histogram to be shut down
     }
+    const uint64_t before = buckets[index].sum();
+    buckets[index].increment(port, count, flags);
+    counted(index, before);
+
+    insert_count += count;
 
-    buckets_t::iterator it = buckets.find(target_index);
-    if(it==buckets.end()){
-        buckets[target_index] = new bucket();
+    return false;
+}
+
+bool time_histogram::histogram_map::insert(const struct timeval &ts, const bucket &b)
+{
+    uint32_t index = 0;
+    if(!target(ts, index)) {
+        return true;
     }
-    buckets[target_index]->increment(port, count, flags);
+    const uint64_t before = buckets[index].sum();
+    buckets[index].merge(b);
+    counted(index, before);
 
-    insert_count += count;
+    insert_count += b.sum();
 
     return false;
 }
@@ -18,7 +18,7 @@
 #define TIME_HISTOGRAM_H
 
 #include "tcpflow.h"
-#include <map>
+#include <vector>
 
 class time_histogram {
 public:
@@ -38,53 +38,95 @@ public:
     };
     typedef std::vector<span_params> span_params_vector_t;
 
-    // a bucket counts packets received in a given timeframe, organized by TCP port
+    // a bucket counts packets received in a given timeframe, organized by TCP port.
+    // Only port_slots ports are kept apart in a timeframe; that is more than a bar
+    // has colors for, and the rest are drawn in the default color. The first ports
+    // seen get the slots, except that a port inserted with F_COLORED (one the
+    // report has a color for) takes the slot of the smallest port without one.
     class bucket {
     public:
-        typedef std::map<in_port_t, uint64_t> counts_t;
-        bucket() : counts(), portless_count(){};
+        static const unsigned int port_slots = 8;
+        bucket() : ports(), counts(), colored(0), other_count(0), portless_count(0), total(0) {}
         uint64_t sum() const {
-            /* this could be done with std::accumulate */
-            uint64_t count = 0;
-            for(counts_t::const_iterator it=counts.begin();it!=counts.end();it++){
-                count += it->second;
-            }
-            count += portless_count;
-            return count;
-        };
-        counts_t counts;
+            return total;
+        }
+        in_port_t ports[port_slots];
+        uint64_t counts[port_slots];    // a slot with a count of 0 is unused
+        uint8_t colored;                // a bit for each slot whose port has F_COLORED
+        uint64_t other_count;           // TCP ports that found no slot
         uint64_t portless_count;
+        uint64_t total;
         void increment(in_port_t port, uint64_t delta, unsigned int flags = 0x00) {
+            total += delta;
             if(flags & F_NON_TCP) {
                 portless_count += delta;
+                return;
+            }
+            unsigned int smallest = port_slots;     // of the ports without a color
+            for(unsigned int i = 0; i < port_slots; i++) {
+                if(counts[i] == 0) {
+                    ports[i] = port;
+                    counts[i] = delta;
+                    if(flags & F_COLORED) colored |= 1 << i;
+                    return;
+                }
+                if(ports[i] == port) {
+                    counts[i] += delta;
+                    return;
+                }
+                if(!(colored & (1 << i)) && (smallest == port_slots || counts[i] < counts[smallest])) {
+                    smallest = i;
+                }
             }
-            else {
-                counts[port] += delta;
+            if((flags & F_COLORED) && smallest < port_slots) {
+                other_count += counts[smallest];
+                ports[smallest] = port;
+                counts[smallest] = delta;
+                colored |= 1 << smallest;
+                return;
+            }
+            other_count += delta;
+        }
+        void merge(const bucket &b) {
+            for(unsigned int i = 0; i < port_slots && b.counts[i] > 0; i++) {
+                increment(b.ports[i], b.counts[i], (b.colored & (1 << i)) ? F_COLORED : 0);
             }
+            other_count += b.other_count;
+            portless_count += b.portless_count;
+            total += b.other_count + b.portless_count;
         }
     };
 
     class histogram_map {
     public:
-        typedef std::map<uint32_t, bucket *> buckets_t;
-        buckets_t buckets;
+        typedef std::vector<bucket> buckets_t;
+        buckets_t buckets;              // span.bucket_count of them, from the first insert
         histogram_map(span_params span_) :
             buckets(), span(span_), bucket_width(span.usec / span.bucket_count),
-            base_time(0), insert_count(0){}
+            base_time(0), insert_count(0), first_used(0), last_used(0), used(0), greatest(0){}
 
         span_params span;
         uint64_t bucket_width;          // in microseconds
         uint64_t base_time;             // microseconds since Jan 1, 1970; set on first call to scale_timeval
         uint64_t insert_count;                   // of entire histogram
+        uint32_t first_used;            // indexes of the first and last buckets with anything in them
+        uint32_t last_used;
+        uint32_t used;                  // buckets with anything in them
+        uint64_t greatest;              // the largest bucket sum
 
         uint64_t greatest_bucket_sum() const {
-            uint64_t greatest = 0;
-            for(buckets_t::const_iterator it = buckets.begin();it!=buckets.end();it++){
-                if(it->second->sum() > greatest) greatest = it->second->sum();
-            }
             return greatest;
         }
 
+        /** the start of a bucket */
+        struct timeval bucket_time(uint32_t index) const {
+            uint64_t usec = index * bucket_width + base_time;
+            struct timeval ts;
+            ts.tv_usec = (time_t) (usec % (1000LL * 1000LL));
+            ts.tv_sec = (time_t) (usec / (1000LL * 1000LL));
+            return ts;
+        }
+
         /** convert timeval to a scaled time.  */
         uint32_t scale_timeval(const struct timeval &ts) {
             uint64_t raw_time = ts.tv_sec * (1000LL * 1000LL) + ts.tv_usec;
@@ -101,11 +143,28 @@ public:
         // returns true if the insertion resulted in over/underflow
         bool insert(const struct timeval &ts, const in_port_t port, const uint64_t count = 1,
                 const unsigned int flags = 0x00);
+        // add all of b's counts at once, as condense() does
+        bool insert(const struct timeval &ts, const bucket &b);
+    private:
+        bool target(const struct timeval &ts, uint32_t &index); // false on over/underflow
+        void counted(uint32_t index, uint64_t before) { // buckets[index] had before in it
+            const uint64_t sum = buckets[index].sum();
+            if(sum > greatest) greatest = sum;
+            if(before > 0 || sum == 0) return;
+            if(used == 0 || index < first_used) first_used = index;
+            if(used == 0 || index > last_used) last_used = index;
+            used++;
+        }
     };
 
     void insert(const struct timeval &ts, const in_port_t port, const uint64_t count = 1,
             const unsigned int flags = 0x00);
     void condense(double factor);
+    // add the counts of another histogram; spans that either one overflowed are given up
+    void merge(const time_histogram &that);
+    // the spans that have not overflowed, as text ending with "end"
+    void save(std::ostream &os) const;
+    bool load(std::istream &is);        // into an empty histogram
     uint64_t usec_per_bucket() const;
     uint64_t packet_count() const;
     time_t start_date() const;
@@ -114,12 +173,7 @@ public:
     const bucket &at(uint32_t index) const;
     size_t size() const;
     size_t non_sparse_size() const;
-
-    /* iterators for the buckets */
-    histogram_map::buckets_t::const_iterator begin() const;
-    histogram_map::buckets_t::const_iterator end() const;
-    histogram_map::buckets_t::const_reverse_iterator rbegin() const;
-    histogram_map::buckets_t::const_reverse_iterator rend() const;
+    uint32_t first_index() const;       // of the first bucket with anything in it
     static span_params_vector_t build_spans();
 
 private:
@@ -136,6 +190,7 @@ private:
     static const bucket empty_bucket;
 public:
     static const unsigned int F_NON_TCP;
+    static const unsigned int F_COLORED;    // the port has a color of its own; see bucket
 };
 
 #endif
@@ -195,22 +195,25 @@ void time_histogram_view::render_data(cairo_t *cr, const bounds_t &bounds)
     double bar_allocation = bounds.width / (double) bars; // bar width with spacing
     double bar_width = bar_allocation / bar_space_factor; // bar width as rendered
     double bar_leading_pad = (bar_allocation - bar_width) / 2.0;
-    time_histogram::histogram_map::buckets_t::const_iterator it = histogram.begin();
 
-    if(it == histogram.end()) {
+    if(bars == 0) {
         return;
     }
 
-    uint32_t first_offset = it->first;
+    uint32_t first_offset = histogram.first_index();
     double tallest_bar = (double) histogram.tallest_bar();
 
-    for(; it != histogram.end(); it++) {
-        double bar_height = (double) it->second->sum() / tallest_bar * bounds.height;
-        double bar_x = bounds.x + (it->first - first_offset) * bar_allocation + bar_leading_pad;
+    for(size_t ii = 0; ii < bars; ii++) {
+        const time_histogram::bucket &bkt = histogram.at(ii + first_offset);
+        if(bkt.sum() == 0) {
+            continue;
+        }
+        double bar_height = (double) bkt.sum() / tallest_bar * bounds.height;
+        double bar_x = bounds.x + ii * bar_allocation + bar_leading_pad;
         double bar_y = bounds.y + (bounds.height - bar_height);
         bounds_t bar_bounds(bar_x, bar_y, bar_width, bar_height);
 
-        bucket_view bar(*it->second, port_colors, default_color);
+        bucket_view bar(bkt, port_colors, default_color);
 
         bar.render(cr, bar_bounds);
     }
@@ -301,7 +304,7 @@ void time_histogram_view::render_data(cairo_t *cr, const bounds_t &bounds)
     double histogram_sum = (double) histogram.packet_count();
     cairo_move_to(cr, bounds.x, bounds.y + bounds.height);
     for(size_t ii = 0; ii < bars; ii++) {
-        const time_histogram::bucket bkt = histogram.at(ii + first_offset);
+        const time_histogram::bucket &bkt = histogram.at(ii + first_offset);
         accumulator += (double) bkt.sum() / histogram_sum;
 
         double x = bounds.x + ii * bar_allocation;
@@ -464,14 +467,30 @@ void time_histogram_view::bucket_view::render(cairo_t *cr, const bounds_t &bound
     double height_accumulator = 0.0;
     rgb_t next_color = default_color;
 
+    // the used slots in port order, then the ports that found no slot
+    unsigned int order[time_histogram::bucket::port_slots + 1];
+    unsigned int sections = 0;
+    for(unsigned int i = 0; i < time_histogram::bucket::port_slots && bucket.counts[i] > 0; i++) {
+        unsigned int j = sections++;
+        for(; j > 0 && bucket.ports[order[j - 1]] > bucket.ports[i]; j--) {
+            order[j] = order[j - 1];
+        }
+        order[j] = i;
+    }
+    const unsigned int other = time_histogram::bucket::port_slots;
+    if(bucket.other_count > 0) {
+        order[sections++] = other;
+    }
+
     // The loop below is a bit confusing
-    for(time_histogram::bucket::counts_t::const_iterator it = bucket.counts.begin(); it != bucket.counts.end();) {
+    for(unsigned int s = 0; s < sections;) {
 
-        double height = bounds.height * ((double) it->second / (double) bucket.sum());
+        uint64_t count = order[s] == other ? bucket.other_count : bucket.counts[order[s]];
+        double height = bounds.height * ((double) count / (double) bucket.sum());
 
         // on first section, preload the first color as the 'next' color
-        if(it == bucket.counts.begin()) {
-            colormap_t::const_iterator color_pair = color_map.find(it->first);
+        if(s == 0 && order[s] != other) {
+            colormap_t::const_iterator color_pair = color_map.find(bucket.ports[order[s]]);
             if(color_pair != color_map.end()) {
                 next_color = color_pair->second;
             }
@@ -483,12 +502,14 @@ void time_histogram_view::bucket_view::render(cairo_t *cr, const bounds_t &bound
 
         // if there's a next bucket, get its color for the next color
         // next consolidate this section with the next if the colors match
-        it++;
-        if(it != bucket.counts.end()) {
+        s++;
+        if(s < sections) {
             /* This gets after every bar except the last bar */
-            colormap_t::const_iterator color_pair = color_map.find(it->first);
-            if(color_pair != color_map.end()) {
-                next_color = color_pair->second;
+            if(order[s] != other) {
+                colormap_t::const_iterator color_pair = color_map.find(bucket.ports[order[s]]);
+                if(color_pair != color_map.end()) {
+                    next_color = color_pair->second;
+                }
             }
 
             if(color == next_color) {
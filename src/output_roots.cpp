@@ -0,0 +1,115 @@
+/*
+ * output_roots.cpp:
+ *
+ * Flows spread over several output directories. See output_roots.h
+ *
+ * This source code is under the GNU Public License (GPL).  See
+ * LICENSE for details.
+ */
+
+#include "tcpflow.h"
+#include "tcpip.h"
+#include "tcpdemux.h"
+#include "output_roots.h"
+
+#include <sstream>
+
+/* static */ std::vector<std::string> output_roots::dirs;
+/* static */ std::string output_roots::placement = "hash";
+
+output_roots::output_roots():roots(1)
+{
+    roots[0].dir = ".";
+}
+
+output_roots::~output_roots()
+{
+    for(std::vector<root>::iterator it=roots.begin();it!=roots.end();it++){
+        delete it->writer;              // waits for its writes
+    }
+}
+
+void output_roots::configure(const std::string &subdir,unsigned int max_fds)
+{
+    for(std::vector<root>::iterator it=roots.begin();it!=roots.end();it++){
+        delete it->writer;
+    }
+    std::vector<std::string> d(dirs);
+    if(d.empty()) d.push_back(".");
+    roots.assign(d.size(),root());
+    for(size_t i=0;i<d.size();i++){
+        roots[i].dir     = subdir.size() ? d[i] + "/" + subdir : d[i];
+        roots[i].max_fds = max_fds/d.size() > 0 ? max_fds/d.size() : 1;
+    }
+}
+
+uint16_t output_roots::place(const flow_addr &f)
+{
+    uint16_t r = 0;
+    if(roots.size()>1){
+        if(placement=="queue"){
+            uint64_t least = queued(0);
+            for(uint16_t i=1;i<roots.size();i++){
+                uint64_t q = queued(i);
+                if(q<least || (q==least && roots[i].flows<roots[r].flows)){
+                    r = i;
+                    least = q;
+                }
+            }
+        } else {
+            r = tcp_session::canonical(f).hash() % roots.size();
+        }
+    }
+    return join(r);
+}
+
+uint16_t output_roots::find(const std::string &path) const
+{
+    uint16_t best = 0;
+    size_t   best_len = 0;
+    for(uint16_t i=0;i<roots.size();i++){
+        const std::string &d = roots[i].dir;
+        if(d.size()>best_len && path.size()>d.size() && path.compare(0,d.size(),d)==0 && path[d.size()]=='/'){
+            best = i;
+            best_len = d.size();
+        }
+    }
+    return best;
+}
+
+uint64_t output_roots::queued(uint16_t r) const
+{
+    return roots[r].buffered + (roots[r].writer ? roots[r].writer->pending : 0);
+}
+
+uring_writer *output_roots::writer(uint16_t r)
+{
+    root &rt = roots[r<roots.size() ? r : 0];
+    if(uring_writer::enabled && rt.writer==0 && !rt.writer_failed){
+        std::string error;
+        rt.writer = uring_writer::create(error);
+        if(rt.writer==0){
+            rt.writer_failed = true;
+            DEBUG(1)("cannot use io_uring for %s (%s); writing synchronously",rt.dir.c_str(),error.c_str());
+        }
+    }
+    return rt.writer;
+}
+
+void output_roots::add_flows(std::vector<uint64_t> &flows) const
+{
+    if(flows.size()<roots.size()) flows.resize(roots.size(),0);
+    for(size_t i=0;i<roots.size();i++) flows[i] += roots[i].flows;
+}
+
+/* static */ void output_roots::dump_xml(dfxml_writer *xreport,const std::vector<uint64_t> &flows)
+{
+    std::stringstream ss;
+    for(size_t i=0;i<dirs.size();i++){
+        ss << "<root id='" << i << "' dir='" << dfxml_writer::xmlescape(dirs[i])
+           << "' flows='" << (i<flows.size() ? flows[i] : 0) << "'/>";
+    }
+    std::stringstream attrs;
+    attrs << "placement='" << dfxml_writer::xmlescape(placement) << "'";
+    xreport->xmlout("output_roots",ss.str(),attrs.str(),false);
+}
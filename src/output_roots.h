@@ -0,0 +1,92 @@
+#ifndef OUTPUT_ROOTS_H
+#define OUTPUT_ROOTS_H
+
+/**
+ * output_roots.h
+ *
+ * Flows spread over several output directories, each on a disk of its
+ * own, when -o is given more than once:
+ *
+ *   tcpflow -o /nvme0/flows -o /nvme1/flows -o /nvme2/flows ...
+ *
+ * Each flow is placed on one of them, its root, when it is created; its
+ * transcript, -I index and HTTP bodies go there, and -K puts the flow's
+ * pcap file there. Both directions of a connection go to the same root.
+ * -S root_placement picks the root:
+ *
+ *   hash   (default) by the hash of the connection's addresses and ports,
+ *          so a connection goes to the same root in every run
+ *   queue  the root with the fewest bytes waiting to be written, in the
+ *          write buffers of its flows and, with -S io_uring=1, in its
+ *          ring; a disk that falls behind gets fewer new flows
+ *
+ * Each root has its own share of max_fds and of -S write_buffer_max, so
+ * the flows of a slow disk cannot hold the descriptors and buffer space
+ * of the others, and with -S io_uring=1 a ring of its own, so that writes
+ * waiting for one disk do not wait behind those for another.
+ *
+ * The first -o is where the report, --segments and the other files of
+ * the run go. In the DFXML report each flow's <tcpflow> has root='n'
+ * when there is more than one root, and <output_roots> lists the roots
+ * and how many flows were placed on each.
+ *
+ * Each tcpdemux has its own, used by the thread that runs it.
+ *
+ * This source code is under the GNU Public License (GPL).  See
+ * LICENSE for details.
+ */
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+class output_roots {
+    output_roots(const output_roots &);
+    output_roots &operator=(const output_roots &);
+public:
+    static std::vector<std::string> dirs;   // -o, in the order given
+    static std::string placement;           // -S root_placement: hash or queue
+
+    struct root {
+        root():dir(),max_fds(0),open_fds(0),buffered(0),flows(0),writer(0),writer_failed(false){}
+        std::string  dir;
+        unsigned int max_fds;               // its share of the demux's max_fds
+        unsigned int open_fds;              // transcripts open on it
+        uint64_t     buffered;              // bytes in the write buffers of its flows
+        uint64_t     flows;                 // flows placed on it
+        class uring_writer *writer;         // with -S io_uring=1, created when first used
+        bool         writer_failed;         // io_uring was asked for and could not be set up
+    };
+
+    output_roots();                         // "." alone, until configure()
+    ~output_roots();                        // waits for the writes of every root
+
+    /* One root for each of dirs, or "." without -o, with subdir/ added if given */
+    void configure(const std::string &subdir,unsigned int max_fds);
+
+    size_t size() const { return roots.size(); }
+    root &operator[](uint16_t r) { return roots[r]; }
+    const std::string &dir(uint16_t r) const { return roots[r<roots.size() ? r : 0].dir; }
+
+    uint16_t place(const class flow_addr &f); // the root for a new connection
+    uint16_t join(uint16_t r) { roots[r].flows++; return r; } // the other direction of one
+    uint16_t find(const std::string &path) const; // the root a file is in; 0 if none
+    uint64_t queued(uint16_t r) const;      // bytes buffered for the root and in its ring
+
+    /* Only with more than one root; one root is held to the demux's limits */
+    bool fds_full(uint16_t r) const { return roots.size()>1 && roots[r].open_fds >= roots[r].max_fds; }
+    bool buffers_full(uint16_t r,uint64_t write_buffer_max) const {
+        return roots.size()>1 && roots[r].buffered > write_buffer_max/roots.size();
+    }
+
+    class uring_writer *writer(uint16_t r); // 0 without -S io_uring=1, or if it cannot be set up
+
+    /* <output_roots> for the report; flows is added up over the demuxes that have roots */
+    void add_flows(std::vector<uint64_t> &flows) const;
+    static void dump_xml(class dfxml_writer *xreport,const std::vector<uint64_t> &flows);
+
+private:
+    std::vector<root> roots;
+};
+
+#endif
@@ -0,0 +1,80 @@
+/*
+ * packet_batch.cpp:
+ *
+ * Hand packets from the datalink handlers to the packet plugins in batches.
+ * See packet_batch.h
+ *
+ * This source code is under the GNU Public License (GPL).  See
+ * LICENSE for details.
+ */
+
+#include "tcpflow.h"
+#include "tcpip.h"
+#include "tcpdemux.h"
+#include "packet_batch.h"
+#include "segment_coalescer.h"
+#include "metrics.h"
+#include "tracer.h"
+
+/* static */ uint32_t packet_batch::max_packets = 32;
+
+/* static */ packet_batch::state &packet_batch::thread_state()
+{
+    static thread_local state s;
+    return s;
+}
+
+/* static */ void packet_batch::begin()
+{
+    thread_state().open++;
+}
+
+/* static */ void packet_batch::end()
+{
+    state &s = thread_state();
+    flush();
+    if(s.open>0) s.open--;
+}
+
+/* static */ void packet_batch::flush()
+{
+    state &s = thread_state();
+    if(s.packets.empty()) return;
+
+    /* With a pool, the main thread only dispatches; the workers look the flows up */
+    const tcpdemux *demux = tcpdemux::getInstance();
+    if(demux->pool==0){
+        for(std::vector<held>::const_iterator it=s.packets.begin();it!=s.packets.end();it++){
+            be13::packet_info pi(it->dlt,&it->hdr,it->data,it->ts,it->ip_data,it->ip_datalen);
+            demux->prefetch_flow(pi);
+        }
+    }
+    s.flushing = true;
+    for(std::vector<held>::const_iterator it=s.packets.begin();it!=s.packets.end();it++){
+        be13::packet_info pi(it->dlt,&it->hdr,it->data,it->ts,it->ip_data,it->ip_datalen);
+        be13::plugin::process_packet(pi);
+    }
+    segment_coalescer::flush();         // the last run, while its packets are still here
+    s.flushing = false;
+    s.packets.clear();
+}
+
+/* static */ void packet_batch::deliver(const be13::packet_info &pi)
+{
+    metrics::count(metrics::DATALINK,pi.pcap_hdr->caplen);
+    tracer::event(trace_record::DATALINK,pi.pcap_hdr->caplen,pi.pcap_dlt);
+    state &s = thread_state();
+    if(s.open==0 || max_packets<=1){
+        be13::plugin::process_packet(pi);
+        return;
+    }
+    held h;
+    h.hdr        = *pi.pcap_hdr;
+    h.ts         = pi.ts;
+    h.dlt        = pi.pcap_dlt;
+    h.data       = pi.pcap_data;
+    h.ip_data    = pi.ip_data;
+    h.ip_datalen = pi.ip_datalen;
+    s.packets.push_back(h);
+    if(s.packets.size() >= max_packets) flush();
+}
@@ -0,0 +1,73 @@
+/*
+ * packet_batch.h:
+ *
+ * Hand packets from the datalink handlers to the packet plugins in batches.
+ *
+ * A reader whose packets stay in place for a while (a mapped file, a
+ * TPACKET_V3 block, a pcap_merge batch) opens a batch on its thread with
+ * packet_batch::scope. The datalink handlers then give each packet_info to
+ * packet_batch::deliver(), which holds on to it; when max_packets are held,
+ * or the scope ends, the flow table slots of the whole batch are prefetched
+ * and the packets are passed to be13::plugin::process_packet() one after
+ * another, while their flows are in the cache.
+ *
+ * Without an open batch (libpcap reuses its buffer for each packet),
+ * deliver() passes the packet on at once.
+ *
+ * tcpdemux takes the runs of in-order segments of a flow in a batch
+ * together; see segment_coalescer.h
+ *
+ * This source code is under the GNU Public License (GPL).  See
+ * LICENSE for details.
+ */
+
+#ifndef PACKET_BATCH_H
+#define PACKET_BATCH_H
+
+#include "tcpflow.h"
+
+#include <vector>
+
+class packet_batch {
+public:
+    static uint32_t max_packets;            // -S packet_batch=N; 1 passes every packet on at once
+
+    /* Batching on the calling thread, for as long as this lives.
+     * The packet data and pcap headers given to the datalink handlers must
+     * not move until the scope ends or flush() is called.
+     */
+    class scope {
+        scope(const scope &);
+        scope &operator=(const scope &);
+    public:
+        scope()  { begin(); }
+        ~scope() { end(); }
+    };
+
+    static void begin();
+    static void end();                      // flush() and stop batching
+    static void flush();                    // pass on all of the packets that are held
+    static void deliver(const be13::packet_info &pi); // instead of be13::plugin::process_packet(pi)
+    /* True while flush() is passing held packets on; they stay in place until it returns */
+    static bool flushing() { return thread_state().flushing; }
+
+private:
+    /* What is needed to make the packet_info again */
+    struct held {
+        struct pcap_pkthdr hdr;             // a copy; readers often keep the header on the stack
+        struct timeval     ts;              // pi.ts, which refers to the handler's stack
+        int                dlt;
+        const u_char       *data;
+        const uint8_t      *ip_data;
+        uint32_t           ip_datalen;
+    };
+    struct state {
+        state():open(0),flushing(false),packets(){}
+        int open;                           // nesting depth of scopes
+        bool flushing;
+        std::vector<held> packets;
+    };
+    static state &thread_state();
+};
+
+#endif
@@ -0,0 +1,74 @@
+/*
+ * packet_index.h:
+ *
+ * The -I packet index: where the data of each packet went in its flow,
+ * and when the packet arrived.
+ *
+ * A flow's records are kept in memory while it is open and written to
+ * <flow>.findb in order of offset when it is finished, as 16-byte
+ * records, all little-endian:
+ *
+ *   bytes  0-5   offset of the data in the flow
+ *   bytes  6-7   length of the data
+ *   bytes  8-11  seconds of the packet time
+ *   bytes 12-15  microseconds of the packet time
+ *
+ * Data longer than 65535 bytes takes several records. tcpflow-findx
+ * turns a .findb file into the older text form, "offset|sec.usec|len"
+ * lines, which -S packet_index_text=1 writes instead.
+ *
+ * This header has no dependencies on the rest of tcpflow.
+ *
+ * This source code is under the GNU Public License (GPL).  See
+ * LICENSE for details.
+ */
+
+#ifndef PACKET_INDEX_H
+#define PACKET_INDEX_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <vector>
+
+class packet_index_record {
+    uint64_t offset_len;                // offset<<16 | length, so that records sort by offset
+    uint32_t sec_;
+    uint32_t usec_;
+public:
+    enum { SIZE = 16, MAX_LENGTH = 0xffff };
+    packet_index_record():offset_len(0),sec_(0),usec_(0){}
+    packet_index_record(uint64_t offset,uint32_t length,uint32_t sec,uint32_t usec):
+        offset_len((offset<<16) | (length & MAX_LENGTH)),sec_(sec),usec_(usec){}
+
+    uint64_t offset() const { return offset_len>>16; }
+    uint32_t length() const { return offset_len & MAX_LENGTH; }
+    uint32_t sec()    const { return sec_; }
+    uint32_t usec()   const { return usec_; }
+    void     shift(uint64_t bytes) { offset_len += bytes<<16; }
+    bool operator<(const packet_index_record &b) const { return offset_len < b.offset_len; }
+
+    void encode(uint8_t *buf) const {
+        uint64_t offset = offset_len>>16;
+        for(int i=0;i<6;i++) buf[i]    = (uint8_t)(offset >> (8*i));
+        buf[6] = (uint8_t)offset_len;
+        buf[7] = (uint8_t)(offset_len>>8);
+        for(int i=0;i<4;i++) buf[8+i]  = (uint8_t)(sec_  >> (8*i));
+        for(int i=0;i<4;i++) buf[12+i] = (uint8_t)(usec_ >> (8*i));
+    }
+    static packet_index_record decode(const uint8_t *buf) {
+        packet_index_record r;
+        uint64_t offset = 0;
+        for(int i=0;i<6;i++) offset |= (uint64_t)buf[i] << (8*i);
+        r.offset_len = (offset<<16) | buf[6] | ((uint32_t)buf[7]<<8);
+        for(int i=0;i<4;i++) r.sec_  |= (uint32_t)buf[8+i]  << (8*i);
+        for(int i=0;i<4;i++) r.usec_ |= (uint32_t)buf[12+i] << (8*i);
+        return r;
+    }
+    /* "offset|sec.usec|len\n", as -I has always written */
+    int print(FILE *f) const {
+        return fprintf(f,"%llu|%u.%06u|%u\n",(unsigned long long)offset(),sec_,usec_,length());
+    }
+};
+typedef std::vector<packet_index_record> packet_index_t;
+
+#endif
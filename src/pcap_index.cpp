@@ -0,0 +1,294 @@
+/*
+ * pcap_index.cpp:
+ *
+ * The --index sidecar of a pcap file, and --flows extraction with it.
+ * See pcap_index.h
+ *
+ * This source code is under the GNU Public License (GPL).  See
+ * LICENSE for details.
+ */
+
+#include "tcpflow.h"
+#include "pcap_index.h"
+
+#include <algorithm>
+#include <sys/stat.h>
+
+/* static */ bool pcap_index::build = false;
+/* static */ std::vector<flow_addr> pcap_index::wanted;
+/* static */ pcap_index *pcap_index::building = 0;
+/* static */ std::string pcap_index::suffix = ".tfidx";
+
+static const char INDEX_MAGIC[8] = {'t','c','p','f','l','i','d','x'};
+
+static void put64(uint8_t *p,uint64_t v) { for(int i=0;i<8;i++) p[i] = (uint8_t)(v >> (8*i)); }
+static void put32(uint8_t *p,uint32_t v) { for(int i=0;i<4;i++) p[i] = (uint8_t)(v >> (8*i)); }
+static void put16(uint8_t *p,uint16_t v) { p[0] = (uint8_t)v; p[1] = (uint8_t)(v>>8); }
+static uint64_t get64(const uint8_t *p) { uint64_t v=0; for(int i=0;i<8;i++) v |= (uint64_t)p[i] << (8*i); return v; }
+static uint16_t get16(const uint8_t *p) { return p[0] | (p[1]<<8); }
+
+/* static */ flow_addr pcap_index::canonical(const flow_addr &a)
+{
+    if(a.dst < a.src || (a.dst==a.src && a.dport < a.sport)){
+        return flow_addr(a.dst,a.src,a.dport,a.sport,a.family);
+    }
+    return a;
+}
+
+/* One endpoint, "address.port"; the port is after the last '.' */
+static bool parse_endpoint(const std::string &s,ipaddr &addr,uint16_t &port,uint16_t &family)
+{
+    size_t dot = s.rfind('.');
+    if(dot==std::string::npos || dot==0 || dot+1==s.size()) return false;
+    std::string a = s.substr(0,dot);
+    char *end = 0;
+    unsigned long p = strtoul(s.c_str()+dot+1,&end,10);
+    if(*end || p>0xffff) return false;
+    port = (uint16_t)p;
+    if(a.find(':')!=std::string::npos){
+        family = AF_INET6;
+        return inet_pton(AF_INET6,a.c_str(),addr.addr)==1;
+    }
+    /* not inet_pton(), which does not allow the leading zeros of the filenames */
+    family = AF_INET;
+    const char *c = a.c_str();
+    for(int i=0;i<4;i++){
+        if(i>0 && *c++!='.') return false;
+        if(*c<'0' || *c>'9') return false;
+        unsigned long v = strtoul(c,&end,10);
+        if(v>255) return false;
+        addr.addr[i] = (uint8_t)v;
+        c = end;
+    }
+    return *c==0;
+}
+
+/* static */ int pcap_index::parse_flows(const std::string &list,std::string &error)
+{
+    for(size_t start=0;start<=list.size();){
+        size_t comma = list.find(',',start);
+        if(comma==std::string::npos) comma = list.size();
+        std::string key = list.substr(start,comma-start);
+        start = comma+1;
+        if(key.size()==0) continue;
+        size_t dash = key.find('-');
+        flow_addr f;
+        uint16_t dfamily = 0;
+        if(dash==std::string::npos ||
+           !parse_endpoint(key.substr(0,dash),f.src,f.sport,f.family) ||
+           !parse_endpoint(key.substr(dash+1),f.dst,f.dport,dfamily) || dfamily!=f.family){
+            error = "--flows: cannot read '" + key + "'; expected address.port-address.port";
+            return -1;
+        }
+        wanted.push_back(canonical(f));
+    }
+    if(wanted.size()==0){
+        error = "--flows: no connections given";
+        return -1;
+    }
+    return 0;
+}
+
+pcap_index::pcap_index():notes(),headers(),flows(),records(0)
+{
+}
+
+void pcap_index::note(const u_char *data,const struct pcap_pkthdr &h,uint64_t offset)
+{
+    pending p;
+    p.data   = data;
+    p.offset = offset;
+    p.sec    = h.ts.tv_sec;
+    p.usec   = h.ts.tv_usec;
+    notes.push_back(p);
+}
+
+/* The reader noted the packet when it was read; the datalink handler may
+ * have dropped some of the packets noted before it.
+ */
+void pcap_index::add(const be13::packet_info &pi)
+{
+    while(notes.size()>0 && notes.front().data!=pi.pcap_data) notes.pop_front();
+    if(notes.empty()) return;
+    pending p = notes.front();
+    notes.pop_front();
+
+    const uint8_t *ip = pi.ip_data;
+    flow_addr f;
+    size_t tcp_offset = 0;
+    switch(pi.ip_version()){
+    case 4:
+        if(pi.ip_datalen < sizeof(struct be13::ip4) || ip[9]!=IPPROTO_TCP) return;
+        if(((ip[6] & 0x1f)<<8 | ip[7]) != 0) return;    // a fragment after the first
+        memcpy(f.src.addr,ip+12,4);
+        memcpy(f.dst.addr,ip+16,4);
+        f.family = AF_INET;
+        tcp_offset = (ip[0] & 0x0f) * 4;
+        break;
+    case 6: {
+        ip6_headers headers;
+        if(!headers.walk(ip,pi.ip_datalen) || headers.proto!=IPPROTO_TCP) return;
+        if(headers.fragment && ((ip[headers.fragment+2]<<8 | ip[headers.fragment+3]) & 0xfff8)) return;
+        memcpy(f.src.addr,ip+8,16);
+        memcpy(f.dst.addr,ip+24,16);
+        f.family = AF_INET6;
+        tcp_offset = headers.offset;
+        break;
+    }
+    default:
+        return;
+    }
+    if(pi.ip_datalen < tcp_offset+4) return;
+    f.sport = (ip[tcp_offset+0]<<8) | ip[tcp_offset+1];
+    f.dport = (ip[tcp_offset+2]<<8) | ip[tcp_offset+3];
+
+    record r;
+    r.offset = p.offset;
+    r.sec    = p.sec;
+    r.usec   = p.usec;
+    flows[canonical(f)].push_back(r);
+    records++;
+}
+
+int pcap_index::write(const std::string &pcap_fname,std::string &error) const
+{
+    struct stat st;
+    if(stat(pcap_fname.c_str(),&st)){
+        error = pcap_fname + ": " + strerror(errno);
+        return -1;
+    }
+    std::string fname = pcap_fname + suffix;
+    std::string tmp   = fname + ".tmp";
+    FILE *f = fopen(tmp.c_str(),"wb");
+    if(f==0){
+        error = tmp + ": " + strerror(errno);
+        return -1;
+    }
+    uint8_t buf[FLOW_SIZE];
+    memcpy(buf,INDEX_MAGIC,8);
+    put64(buf+8,st.st_size);
+    put64(buf+16,st.st_mtime);
+    put64(buf+24,flows.size());
+    put64(buf+32,headers.size());
+    put64(buf+40,records);
+    bool ok = fwrite(buf,HEADER_SIZE,1,f)==1;
+    for(size_t i=0;ok && i<headers.size();i++){
+        put64(buf,headers[i]);
+        ok = fwrite(buf,8,1,f)==1;
+    }
+    uint64_t first = 0;
+    for(flows_t::const_iterator it=flows.begin();ok && it!=flows.end();it++){
+        const flow_addr &a = it->first;
+        memset(buf,0,FLOW_SIZE);
+        buf[0] = a.family==AF_INET6 ? 6 : 4;
+        put16(buf+4,a.sport);
+        put16(buf+6,a.dport);
+        memcpy(buf+8,a.src.addr,16);
+        memcpy(buf+24,a.dst.addr,16);
+        put64(buf+40,first);
+        first += it->second.size();
+        ok = fwrite(buf,FLOW_SIZE,1,f)==1;
+    }
+    for(flows_t::const_iterator it=flows.begin();ok && it!=flows.end();it++){
+        for(std::vector<record>::const_iterator r=it->second.begin();ok && r!=it->second.end();r++){
+            put64(buf,r->offset);
+            put32(buf+8,r->sec);
+            put32(buf+12,r->usec);
+            ok = fwrite(buf,RECORD_SIZE,1,f)==1;
+        }
+    }
+    if(fclose(f)) ok = false;
+    if(!ok || rename(tmp.c_str(),fname.c_str())){
+        error = tmp + ": " + strerror(errno);
+        unlink(tmp.c_str());
+        return -1;
+    }
+    DEBUG(1)("%s: %zu connections, %" PRIu64 " packets",fname.c_str(),flows.size(),records);
+    return 0;
+}
+
+/* static */ int pcap_index::lookup(const std::string &pcap_fname,const std::vector<flow_addr> &want,
+                                    std::vector<uint64_t> &offsets,std::string &error)
+{
+    std::string fname = pcap_fname + suffix;
+    struct stat st;
+    if(stat(pcap_fname.c_str(),&st)){
+        error = pcap_fname + ": " + strerror(errno);
+        return -1;
+    }
+    FILE *f = fopen(fname.c_str(),"rb");
+    if(f==0){
+        error = fname + ": " + strerror(errno) + "; make it with --index";
+        return -1;
+    }
+    uint8_t hdr[HEADER_SIZE];
+    if(fread(hdr,HEADER_SIZE,1,f)!=1 || memcmp(hdr,INDEX_MAGIC,8)){
+        error = fname + ": not a tcpflow pcap index";
+        fclose(f);
+        return -1;
+    }
+    if(get64(hdr+8)!=(uint64_t)st.st_size || get64(hdr+16)!=(uint64_t)st.st_mtime){
+        error = fname + ": made for another version of " + pcap_fname + "; make it again with --index";
+        fclose(f);
+        return -1;
+    }
+    uint64_t nflows   = get64(hdr+24);
+    uint64_t nheaders = get64(hdr+32);
+    uint64_t nrecords = get64(hdr+40);
+
+    std::vector<uint8_t> table(nheaders*8 + nflows*FLOW_SIZE + 1);
+    if(fread(&table[0],1,table.size()-1,f)!=table.size()-1){
+        error = fname + ": truncated";
+        fclose(f);
+        return -1;
+    }
+    offsets.clear();
+    for(uint64_t i=0;i<nheaders;i++) offsets.push_back(get64(&table[i*8]));
+    const uint8_t *flow_table = &table[nheaders*8];
+    uint64_t records_start = HEADER_SIZE + nheaders*8 + nflows*FLOW_SIZE;
+
+    /* the connections are in order, so each wanted one is found by bisection */
+    for(std::vector<flow_addr>::const_iterator w=want.begin();w!=want.end();w++){
+        uint64_t lo = 0, hi = nflows;
+        bool found = false;
+        while(lo < hi && !found){
+            uint64_t mid = lo + (hi-lo)/2;
+            const uint8_t *e = flow_table + mid*FLOW_SIZE;
+            flow_addr a;
+            a.family = e[0]==6 ? AF_INET6 : AF_INET;
+            a.sport  = get16(e+4);
+            a.dport  = get16(e+6);
+            memcpy(a.src.addr,e+8,16);
+            memcpy(a.dst.addr,e+24,16);
+            if(a==*w){
+                lo = mid;
+                found = true;
+            }
+            else if(a < *w) lo = mid+1;
+            else hi = mid;
+        }
+        if(!found){
+            DEBUG(1)("%s: %s is not in the index",fname.c_str(),w->str().c_str());
+            continue;
+        }
+        uint64_t first = get64(flow_table + lo*FLOW_SIZE + 40);
+        uint64_t last  = lo+1 < nflows ? get64(flow_table + (lo+1)*FLOW_SIZE + 40) : nrecords;
+        if(first > last || last > nrecords){
+            error = fname + ": damaged";
+            fclose(f);
+            return -1;
+        }
+        std::vector<uint8_t> recs((last-first)*RECORD_SIZE + 1);
+        if(fseeko(f,records_start + first*RECORD_SIZE,SEEK_SET) ||
+           fread(&recs[0],1,recs.size()-1,f)!=recs.size()-1){
+            error = fname + ": truncated";
+            fclose(f);
+            return -1;
+        }
+        for(uint64_t i=0;i<last-first;i++) offsets.push_back(get64(&recs[i*RECORD_SIZE]));
+    }
+    fclose(f);
+    std::sort(offsets.begin(),offsets.end());
+    offsets.erase(std::unique(offsets.begin(),offsets.end()),offsets.end());
+    return 0;
+}
@@ -0,0 +1,118 @@
+/*
+ * pcap_index.h:
+ *
+ * A sidecar index of a pcap or pcapng file: for each TCP connection, where
+ * its packets are in the file and when they were captured.
+ *
+ * With --index, each -r file that is read through mmap_pcap_reader gets
+ * <file>.tfidx, written when the file has been read. With --flows KEYS,
+ * the index is read instead of the whole file, and only the packets of
+ * those connections are handed to the demultiplexer, found by seeking to
+ * them in the mapping. A connection is named as in the default filename
+ * template, source then destination, e.g.
+ *   192.168.001.002.01234-010.000.000.001.00080
+ * and either direction finds both halves. IPv6 addresses are written as
+ * inet_ntop() does; leading zeros may be left off the IPv4 ones and the ports.
+ *
+ * The index is made from the packets as the datalink handlers give them
+ * to the demultiplexer, so only the packets that matched the expression
+ * when it was built are in it. IP fragments after the first carry no
+ * ports and are not in it.
+ *
+ * The file is little-endian:
+ *
+ *   header, 48 bytes:
+ *     bytes  0-7   "tcpflidx"
+ *     bytes  8-15  size of the pcap file
+ *     bytes 16-23  modification time of the pcap file
+ *     bytes 24-31  number of connections
+ *     bytes 32-39  number of pcapng section and interface blocks
+ *     bytes 40-47  number of packet records
+ *   the offsets of the pcapng section and interface blocks, 8 bytes each,
+ *   which are read again before any packets
+ *   the connections, 48 bytes each, in order of address:
+ *     byte   0     family (4 or 6)
+ *     bytes  1-3   zero
+ *     bytes  4-5   first port
+ *     bytes  6-7   second port
+ *     bytes  8-23  first address
+ *     bytes 24-39  second address
+ *     bytes 40-47  number of the connection's first packet record
+ *   the packet records, 16 bytes each, a connection's in file order:
+ *     bytes  0-7   offset of the pcap record or pcapng block
+ *     bytes  8-11  seconds of the packet time
+ *     bytes 12-15  microseconds of the packet time
+ *
+ * An index whose size and modification time do not match the pcap file's
+ * is not used.
+ *
+ * This source code is under the GNU Public License (GPL).  See
+ * LICENSE for details.
+ */
+
+#ifndef PCAP_INDEX_H
+#define PCAP_INDEX_H
+
+#include "tcpflow.h"
+#include "tcpip.h"
+
+#include <map>
+#include <string>
+#include <vector>
+#include <deque>
+
+class pcap_index {
+    pcap_index(const pcap_index &);
+    pcap_index &operator=(const pcap_index &);
+
+public:
+    enum { HEADER_SIZE = 48, FLOW_SIZE = 48, RECORD_SIZE = 16 };
+
+    static bool build;                      // --index
+    static std::vector<flow_addr> wanted;   // --flows; canonical
+    static pcap_index *building;            // the index of the file being read, with --index
+    static std::string suffix;              // ".tfidx"
+
+    /* The key of a connection: the lower endpoint first, so both directions have the same one */
+    static flow_addr canonical(const flow_addr &a);
+    /* Parse a comma-separated list of connections into wanted. Returns 0, or -1 with error set. */
+    static int  parse_flows(const std::string &list,std::string &error);
+
+    pcap_index();
+
+    /* Building. The reader calls note() for each packet that passes the filter and
+     * note_header() for each pcapng section and interface block; add() is called
+     * with the packet when it reaches the demultiplexer.
+     */
+    void note(const u_char *data,const struct pcap_pkthdr &h,uint64_t offset);
+    void note_header(uint64_t offset) { headers.push_back(offset); }
+    void add(const be13::packet_info &pi);
+    int  write(const std::string &pcap_fname,std::string &error) const;
+
+    /* Extraction: the offsets of the header blocks and of the packets of wanted,
+     * in file order. Returns 0, or -1 with error set if there is no usable index.
+     */
+    static int lookup(const std::string &pcap_fname,const std::vector<flow_addr> &flows,
+                      std::vector<uint64_t> &offsets,std::string &error);
+
+private:
+    struct pending {                        // a packet noted by the reader, not yet added
+        const u_char *data;
+        uint64_t offset;
+        uint32_t sec;
+        uint32_t usec;
+    };
+    struct record {
+        uint64_t offset;
+        uint32_t sec;
+        uint32_t usec;
+    };
+    typedef std::map<flow_addr,std::vector<record> > flows_t;
+
+    std::deque<pending>   notes;
+    std::vector<uint64_t> headers;
+    flows_t               flows;
+    uint64_t              records;
+};
+
+#endif
@@ -0,0 +1,319 @@
+/*
+ * pcap_inflate.cpp:
+ *
+ * Decompress a capture file inside tcpflow, on a thread of its own.
+ * See pcap_inflate.h
+ *
+ * This source code is under the GNU Public License (GPL).  See
+ * LICENSE for details.
+ */
+
+#include "tcpflow.h"
+#include "pcap_inflate.h"
+
+#include <algorithm>
+
+#ifdef HAVE_ZLIB_H
+#include <zlib.h>
+#endif
+/* the libraries must be there as well as the headers */
+#if defined(HAVE_LZMA_H) && !defined(HAVE_LIBLZMA)
+#undef HAVE_LZMA_H
+#endif
+#if defined(HAVE_ZSTD_H) && !defined(HAVE_LIBZSTD)
+#undef HAVE_ZSTD_H
+#endif
+
+#ifdef HAVE_LZMA_H
+#include <lzma.h>
+#endif
+#ifdef HAVE_ZSTD_H
+#include <zstd.h>
+#endif
+
+/* static */ bool     inflate_stream::enabled = true;
+/* static */ uint32_t inflate_stream::buffer_size = 8*1024*1024;
+
+static const size_t OUT_SIZE = 256*1024;   // decompressed bytes produced at a time
+
+/* static */ inflate_stream::format_t inflate_stream::format_for(const std::string &fname)
+{
+#ifdef HAVE_INFLATE_STREAM
+#ifdef HAVE_ZLIB_H
+    if(ends_with(fname,".gz")) return GZIP;
+#endif
+#ifdef HAVE_LZMA_H
+    if(ends_with(fname,".xz") || ends_with(fname,".lzma")) return XZ;
+#endif
+#ifdef HAVE_ZSTD_H
+    if(ends_with(fname,".zst")) return ZSTD;
+#endif
+#endif
+    return NONE;
+}
+
+inflate_stream::inflate_stream(int fd_,format_t format_,const std::string &fname_):
+    fd(fd_),format(format_),fname(fname_),thread(),M(),data_ready(),space_ready(),
+    ring(buffer_size>OUT_SIZE ? buffer_size : OUT_SIZE),head(0),tail(0),
+    finished(false),failed(false),closed(false)
+{
+}
+
+inflate_stream::~inflate_stream()
+{
+    if(thread.joinable()) thread.join();
+    if(fd>=0) ::close(fd);
+}
+
+/* static */ FILE *inflate_stream::fopen(const std::string &fname,std::string &error)
+{
+    format_t format = format_for(fname);
+    if(format==NONE) return 0;
+#ifdef HAVE_INFLATE_STREAM
+    int fd = ::open(fname.c_str(),O_RDONLY|O_BINARY);
+    if(fd<0){
+        error = fname + ": " + strerror(errno);
+        return 0;
+    }
+#if defined(HAVE_POSIX_FADVISE) && defined(POSIX_FADV_SEQUENTIAL)
+    posix_fadvise(fd,0,0,POSIX_FADV_SEQUENTIAL);
+#endif
+    inflate_stream *s = new inflate_stream(fd,format,fname);
+#ifdef HAVE_FOPENCOOKIE
+    cookie_io_functions_t io;
+    memset(&io,0,sizeof(io));
+    io.read  = cookie_read;
+    io.close = cookie_close;
+    FILE *fp = fopencookie(s,"r",io);
+#else
+    FILE *fp = funopen(s,
+                       [](void *cookie,char *buf,int size){ return (int)cookie_read(cookie,buf,size); },
+                       0,0,cookie_close);
+#endif
+    if(fp==0){
+        error = fname + ": cannot create stream: " + strerror(errno);
+        delete s;
+        return 0;
+    }
+    s->thread = std::thread(&inflate_stream::run,s);
+    return fp;
+#else
+    error = "in-process decompression is not available";
+    return 0;
+#endif
+}
+
+/* Copy len bytes into the ring, waiting for room as needed */
+bool inflate_stream::put(const uint8_t *buf,size_t len)
+{
+    std::unique_lock<std::mutex> lock(M);
+    while(len>0){
+        while(head-tail == ring.size() && !closed) space_ready.wait(lock);
+        if(closed) return false;
+        size_t pos   = head % ring.size();
+        size_t count = std::min(len,std::min(ring.size()-(size_t)(head-tail),ring.size()-pos));
+        memcpy(&ring[pos],buf,count);
+        head += count;
+        buf  += count;
+        len  -= count;
+        data_ready.notify_one();
+    }
+    return true;
+}
+
+ssize_t inflate_stream::read(char *buf,size_t size)
+{
+    std::unique_lock<std::mutex> lock(M);
+    while(head==tail && !finished) data_ready.wait(lock);
+    if(head==tail){
+        if(failed){
+            errno = EIO;
+            return -1;
+        }
+        return 0;                       // end of file
+    }
+    size_t pos   = tail % ring.size();
+    size_t count = std::min(size,std::min((size_t)(head-tail),ring.size()-pos));
+    memcpy(buf,&ring[pos],count);
+    tail += count;
+    space_ready.notify_one();
+    return count;
+}
+
+/* static */ ssize_t inflate_stream::cookie_read(void *cookie,char *buf,size_t size)
+{
+    return reinterpret_cast<inflate_stream *>(cookie)->read(buf,size);
+}
+
+/* static */ int inflate_stream::cookie_close(void *cookie)
+{
+    inflate_stream *s = reinterpret_cast<inflate_stream *>(cookie);
+    {
+        std::lock_guard<std::mutex> lock(s->M);
+        s->closed = true;
+        s->space_ready.notify_one();
+    }
+    delete s;                               // joins the thread
+    return 0;
+}
+
+void inflate_stream::run()
+{
+    std::vector<uint8_t> in(READ_SIZE);
+    std::vector<uint8_t> out(OUT_SIZE);
+    int r = -1;
+    switch(format){
+    case GZIP: r = inflate_gzip(in,out); break;
+    case XZ:   r = inflate_xz(in,out);   break;
+    case ZSTD: r = inflate_zstd(in,out); break;
+    case NONE: break;
+    }
+    std::lock_guard<std::mutex> lock(M);
+    finished = true;
+    failed   = (r<0);
+    data_ready.notify_one();
+}
+
+/*
+ * Each inflater reads the whole file and returns 0 at its end (or when the
+ * reader went away) or -1 on an error. Files with several concatenated
+ * compressed streams, as made by appending to a .gz, are read to the end.
+ */
+
+int inflate_stream::inflate_gzip(std::vector<uint8_t> &in,std::vector<uint8_t> &out)
+{
+#ifdef HAVE_ZLIB_H
+    z_stream zs;
+    memset(&zs,0,sizeof(zs));
+    if(inflateInit2(&zs,15+32)!=Z_OK){      // +32: gzip or zlib header
+        DEBUG(1)("%s: inflateInit2 failed",fname.c_str());
+        return -1;
+    }
+    int ret = 0;
+    bool eof = false;
+    bool in_member = false;                 // between a gzip header and its trailer
+    while(ret==0){
+        if(zs.avail_in==0 && !eof){
+            ssize_t n = ::read(fd,&in[0],in.size());
+            if(n<0){
+                DEBUG(1)("%s: %s",fname.c_str(),strerror(errno));
+                ret = -1;
+                break;
+            }
+            eof = (n==0);
+            zs.next_in  = &in[0];
+            zs.avail_in = n;
+        }
+        if(zs.avail_in==0 && eof){
+            if(in_member){
+                DEBUG(1)("%s: unexpected end of gzip data",fname.c_str());
+                ret = -1;
+            }
+            break;
+        }
+        zs.next_out  = &out[0];
+        zs.avail_out = out.size();
+        int zr = inflate(&zs,Z_NO_FLUSH);
+        if(zr!=Z_OK && zr!=Z_STREAM_END && zr!=Z_BUF_ERROR){
+            DEBUG(1)("%s: %s",fname.c_str(),zs.msg ? zs.msg : "gzip data error");
+            ret = -1;
+            break;
+        }
+        size_t produced = out.size() - zs.avail_out;
+        if(produced>0 && !put(&out[0],produced)) break;
+        in_member = (zr!=Z_STREAM_END);
+        if(zr==Z_STREAM_END) inflateReset(&zs); // another member may follow
+    }
+    inflateEnd(&zs);
+    return ret;
+#else
+    return -1;
+#endif
+}
+
+int inflate_stream::inflate_xz(std::vector<uint8_t> &in,std::vector<uint8_t> &out)
+{
+#ifdef HAVE_LZMA_H
+    lzma_stream ls = LZMA_STREAM_INIT;
+    if(lzma_auto_decoder(&ls,UINT64_MAX,LZMA_CONCATENATED)!=LZMA_OK){ // .xz or .lzma
+        DEBUG(1)("%s: lzma_auto_decoder failed",fname.c_str());
+        return -1;
+    }
+    int ret = 0;
+    lzma_action action = LZMA_RUN;
+    while(true){
+        if(ls.avail_in==0 && action==LZMA_RUN){
+            ssize_t n = ::read(fd,&in[0],in.size());
+            if(n<0){
+                DEBUG(1)("%s: %s",fname.c_str(),strerror(errno));
+                ret = -1;
+                break;
+            }
+            if(n==0) action = LZMA_FINISH;
+            ls.next_in  = &in[0];
+            ls.avail_in = n;
+        }
+        ls.next_out  = &out[0];
+        ls.avail_out = out.size();
+        lzma_ret lr = lzma_code(&ls,action);
+        size_t produced = out.size() - ls.avail_out;
+        if(produced>0 && !put(&out[0],produced)) break;
+        if(lr==LZMA_STREAM_END) break;
+        if(lr!=LZMA_OK){
+            DEBUG(1)("%s: xz data error %d",fname.c_str(),(int)lr);
+            ret = -1;
+            break;
+        }
+    }
+    lzma_end(&ls);
+    return ret;
+#else
+    return -1;
+#endif
+}
+
+int inflate_stream::inflate_zstd(std::vector<uint8_t> &in,std::vector<uint8_t> &out)
+{
+#ifdef HAVE_ZSTD_H
+    ZSTD_DStream *zds = ZSTD_createDStream();
+    if(zds==0){
+        DEBUG(1)("%s: ZSTD_createDStream failed",fname.c_str());
+        return -1;
+    }
+    ZSTD_initDStream(zds);
+    int ret = 0;
+    size_t last = 0;                        // last return of ZSTD_decompressStream; 0 at the end of a frame
+    ZSTD_inBuffer ib = {&in[0],0,0};
+    while(true){
+        if(ib.pos==ib.size){
+            ssize_t n = ::read(fd,&in[0],in.size());
+            if(n<0){
+                DEBUG(1)("%s: %s",fname.c_str(),strerror(errno));
+                ret = -1;
+                break;
+            }
+            if(n==0){
+                if(last!=0){
+                    DEBUG(1)("%s: unexpected end of zstd data",fname.c_str());
+                    ret = -1;
+                }
+                break;
+            }
+            ib.size = n;
+            ib.pos  = 0;
+        }
+        ZSTD_outBuffer ob = {&out[0],out.size(),0};
+        last = ZSTD_decompressStream(zds,&ob,&ib);
+        if(ZSTD_isError(last)){
+            DEBUG(1)("%s: %s",fname.c_str(),ZSTD_getErrorName(last));
+            ret = -1;
+            break;
+        }
+        if(ob.pos>0 && !put(&out[0],ob.pos)) break;
+    }
+    ZSTD_freeDStream(zds);
+    return ret;
+#else
+    return -1;
+#endif
+}
@@ -0,0 +1,85 @@
+/*
+ * pcap_inflate.h:
+ *
+ * Decompress a .gz, .xz, .lzma or .zst capture file inside tcpflow.
+ *
+ * inflate_stream::fopen() returns a stdio stream that libpcap reads with
+ * pcap_fopen_offline(). A thread reads the compressed file in large
+ * chunks and decompresses it into a ring buffer; the stream's read
+ * function takes the packets out of the ring. This replaces running
+ * gunzip and friends through a pipe (see build_inflaters() in
+ * tcpflow.cpp), which needs a shell and a fork, and the decompressor
+ * programs themselves, none of which may be there after a chroot.
+ *
+ * Closing the stream (pcap_close() does this) stops the thread.
+ *
+ * This source code is under the GNU Public License (GPL).  See
+ * LICENSE for details.
+ */
+
+#ifndef PCAP_INFLATE_H
+#define PCAP_INFLATE_H
+
+#include "tcpflow.h"
+
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#if defined(HAVE_FOPENCOOKIE) || defined(HAVE_FUNOPEN)
+#define HAVE_INFLATE_STREAM
+#endif
+
+class inflate_stream {
+    inflate_stream(const inflate_stream &);
+    inflate_stream &operator=(const inflate_stream &);
+
+public:
+    /* Tuning; set with -S */
+    static bool     enabled;                // decompress in-process instead of with a child process
+    static uint32_t buffer_size;            // bytes of decompressed data in the ring
+    enum { READ_SIZE = 1024*1024 };         // compressed bytes read at a time
+
+    enum format_t { NONE, GZIP, XZ, ZSTD };
+    static format_t format_for(const std::string &fname); // by suffix; NONE if not compiled in
+
+    /* Open fname and start decompressing it.
+     * Returns the stream, or 0 with error set (error is empty if fname is not compressed
+     * in a format we can decompress).
+     */
+    static FILE *fopen(const std::string &fname,std::string &error);
+
+private:
+    inflate_stream(int fd_,format_t format_,const std::string &fname_);
+    ~inflate_stream();
+
+    void run();                             // decompressing thread
+    bool put(const uint8_t *buf,size_t len); // into the ring; false if the reader went away
+    int  inflate_gzip(std::vector<uint8_t> &in,std::vector<uint8_t> &out);
+    int  inflate_xz(std::vector<uint8_t> &in,std::vector<uint8_t> &out);
+    int  inflate_zstd(std::vector<uint8_t> &in,std::vector<uint8_t> &out);
+
+    /* stdio callbacks */
+    static ssize_t cookie_read(void *cookie,char *buf,size_t size);
+    static int     cookie_close(void *cookie);
+    ssize_t read(char *buf,size_t size);
+
+    int         fd;
+    format_t    format;
+    std::string fname;
+    std::thread thread;
+
+    std::mutex  M;                          // protects everything below
+    std::condition_variable data_ready;     // bytes were added, or the inflater finished
+    std::condition_variable space_ready;    // bytes were taken out, or the reader went away
+    std::vector<uint8_t> ring;
+    uint64_t    head;                       // bytes put into the ring so far
+    uint64_t    tail;                       // bytes taken out so far
+    bool        finished;                   // the inflater reached the end of the file or an error
+    bool        failed;
+    bool        closed;                     // the reader went away
+};
+
+#endif
@@ -0,0 +1,226 @@
+/*
+ * pcap_merge.cpp:
+ *
+ * Read several capture files at once and deliver their packets in
+ * timestamp order. See pcap_merge.h
+ *
+ * This source code is under the GNU Public License (GPL).  See
+ * LICENSE for details.
+ */
+
+#include "tcpflow.h"
+#include "pcap_merge.h"
+#include "pcap_mmap.h"
+#include "packet_batch.h"
+
+#include <algorithm>
+
+pcap_merge::~pcap_merge()
+{
+    close();
+}
+
+void pcap_merge::close()
+{
+    for(std::vector<source *>::iterator it=sources.begin();it!=sources.end();it++){
+        source *s = *it;
+        if(s->thread.joinable()) s->thread.join();
+        if(s->pd) pcap_close(s->pd);
+        delete s->reader;
+        delete s->filling;
+        delete s->current;
+        for(std::deque<batch *>::iterator b=s->queue.begin();b!=s->queue.end();b++) delete *b;
+        for(std::vector<batch *>::iterator b=s->free_batches.begin();b!=s->free_batches.end();b++) delete *b;
+        delete s;
+    }
+    sources.clear();
+}
+
+int pcap_merge::add_file(const std::string &path,FILE *fp,const std::string &name,const std::string &expression,
+                         std::string &error)
+{
+    source *s = new source(sources.size());
+    s->name = name;
+
+    std::string mmap_error;
+    if(fp==0 && mmap_pcap_reader::enabled){
+        s->reader = new mmap_pcap_reader();
+        if(s->reader->open(path,mmap_error)){
+            delete s->reader;
+            s->reader = 0;
+        }
+    }
+    if(s->reader){
+        s->dlt = s->reader->datalink();
+        if(s->reader->set_filter(expression,error)){
+            delete s->reader;
+            delete s;
+            return -1;
+        }
+    } else {
+        char errbuf[PCAP_ERRBUF_SIZE];
+        s->pd = fp ? pcap_fopen_offline(fp,errbuf) : pcap_open_offline(path.c_str(),errbuf);
+        if(s->pd == NULL){
+            error = errbuf;
+            if(fp) fclose(fp);
+            delete s;
+            return -1;
+        }
+        s->dlt = pcap_datalink(s->pd);
+        struct bpf_program fcode;
+        if(pcap_compile(s->pd,&fcode,expression.c_str(),1,0) < 0 || pcap_setfilter(s->pd,&fcode) < 0){
+            error = pcap_geterr(s->pd);
+            pcap_close(s->pd);
+            delete s;
+            return -1;
+        }
+        pcap_freecode(&fcode);
+    }
+    s->handler = find_handler(s->dlt,name.c_str());
+    sources.push_back(s);
+    return 0;
+}
+
+/* Hand a full batch to the merging thread, waiting for room in the queue */
+/* static */ void pcap_merge::queue_batch(source *s)
+{
+    std::unique_lock<std::mutex> lock(s->M);
+    while(s->queue.size() >= MAX_QUEUED_BATCHES && !s->stop){
+        s->space.wait(lock);
+    }
+    s->queue.push_back(s->filling);
+    s->ready.notify_one();
+    if(s->free_batches.size()>0){
+        s->filling = s->free_batches.back();
+        s->free_batches.pop_back();
+    } else {
+        s->filling = new batch();
+    }
+}
+
+/* pcap_handler for the reader threads: copy the packet into the batch being filled */
+/* static */ void pcap_merge::collect(u_char *user,const struct pcap_pkthdr *h,const u_char *p)
+{
+    source *s = reinterpret_cast<source *>(user);
+    if(s->reader && s->reader->current_datalink()!=s->dlt){
+        s->dlt     = s->reader->current_datalink();
+        s->handler = find_handler(s->dlt,s->name.c_str());
+    }
+    batch *b = s->filling;
+    b->hdrs.push_back(*h);
+    b->handlers.push_back(s->handler);
+    b->offsets.push_back(b->data.size());
+    b->data.insert(b->data.end(),p,p+h->caplen);
+    if(b->size() >= BATCH_PACKETS || b->data.size() >= BATCH_BYTES){
+        queue_batch(s);
+    }
+}
+
+void pcap_merge::read_source(source *s)
+{
+    int r = 0;
+    if(s->reader){
+        r = s->reader->loop(collect,(u_char *)s);
+    } else {
+        int pcap_retval = pcap_loop(s->pd,-1,collect,(u_char *)s);
+        if(pcap_retval < 0 && pcap_retval != -2){
+            DEBUG(1) ("%s: %s", s->name.c_str(), pcap_geterr(s->pd));
+            r = -1;
+        }
+    }
+    if(s->filling->size()>0) queue_batch(s);
+    std::lock_guard<std::mutex> lock(s->M);
+    s->result = r;
+    s->done = true;
+    s->ready.notify_one();
+}
+
+bool pcap_merge::fetch(source *s)
+{
+    if(s->current && s->next < s->current->size()) return true;
+    std::unique_lock<std::mutex> lock(s->M);
+    if(s->current){
+        s->current->clear();
+        s->free_batches.push_back(s->current);
+        s->current = 0;
+    }
+    while(s->queue.empty() && !s->done){
+        s->ready.wait(lock);
+    }
+    if(s->queue.empty()) return false;  // done
+    s->current = s->queue.front();
+    s->queue.pop_front();
+    s->next = 0;
+    s->space.notify_one();
+    return true;                        // batches are never queued empty
+}
+
+/* heap order: the source whose next packet is earliest comes first */
+/* static */ bool pcap_merge::later(const source *a,const source *b)
+{
+    const struct timeval &ta = a->head().ts;
+    const struct timeval &tb = b->head().ts;
+    if(ta.tv_sec  != tb.tv_sec)  return ta.tv_sec  > tb.tv_sec;
+    if(ta.tv_usec != tb.tv_usec) return ta.tv_usec > tb.tv_usec;
+    return a->index > b->index;
+}
+
+/* Only flags are set here; the readers finish their current packet and the merge stops */
+void pcap_merge::breakloop()
+{
+    stop = 1;
+    for(std::vector<source *>::iterator it=sources.begin();it!=sources.end();it++){
+        if((*it)->reader) (*it)->reader->breakloop();
+        if((*it)->pd) pcap_breakloop((*it)->pd);
+    }
+}
+
+int pcap_merge::run(u_char *user)
+{
+    stop = 0;
+    for(std::vector<source *>::iterator it=sources.begin();it!=sources.end();it++){
+        (*it)->filling = new batch();
+        (*it)->thread = std::thread(&pcap_merge::read_source,this,*it);
+    }
+
+    std::vector<source *> heap;
+    for(std::vector<source *>::iterator it=sources.begin();it!=sources.end();it++){
+        if(fetch(*it)) heap.push_back(*it);
+    }
+    std::make_heap(heap.begin(),heap.end(),later);
+
+    packet_batch::scope batch;
+    while(!heap.empty() && !stop){
+        if(halt && *halt){
+            stop = 1;
+            break;
+        }
+        std::pop_heap(heap.begin(),heap.end(),later);
+        source *s = heap.back();
+        (*s->current->handlers[s->next])(user,&s->head(),&s->current->data[s->current->offsets[s->next]]);
+        s->next++;
+        if(s->next==s->current->size()) packet_batch::flush(); // fetch() is about to reuse the batch
+        if(fetch(s)){
+            std::push_heap(heap.begin(),heap.end(),later);
+        } else {
+            heap.pop_back();
+        }
+    }
+
+    /* Stop any readers that are still going and wait for them */
+    int ret = 0;
+    if(stop){
+        breakloop();
+        for(std::vector<source *>::iterator it=sources.begin();it!=sources.end();it++){
+            std::lock_guard<std::mutex> lock((*it)->M);
+            (*it)->stop = true;
+            (*it)->space.notify_one();
+        }
+    }
+    for(std::vector<source *>::iterator it=sources.begin();it!=sources.end();it++){
+        source *s = *it;
+        if(s->thread.joinable()) s->thread.join();
+        if(s->result < 0) ret = -1;
+    }
+    return ret;
+}
@@ -0,0 +1,122 @@
+/*
+ * pcap_merge.h:
+ *
+ * Read several capture files at once and deliver their packets in
+ * timestamp order.
+ *
+ * Each file is read, and filtered, by its own thread into batches of
+ * copied packets. run() merges the heads of the files (a k-way merge
+ * on the packet timestamps; ties go to the file that was added first)
+ * and hands each packet to the datalink handler for its file on the
+ * calling thread. The result is the same as if the files had been
+ * concatenated and sorted, so flows that span files are reassembled
+ * as one.
+ *
+ * With a single file this is simply a read-ahead thread.
+ *
+ * This source code is under the GNU Public License (GPL).  See
+ * LICENSE for details.
+ */
+
+#ifndef PCAP_MERGE_H
+#define PCAP_MERGE_H
+
+#include "tcpflow.h"
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+class mmap_pcap_reader;
+
+class pcap_merge {
+    /* Packets copied out of a file */
+    class batch {
+    public:
+        batch():hdrs(),offsets(),handlers(),data(){}
+        std::vector<struct pcap_pkthdr> hdrs;
+        std::vector<size_t>  offsets;       // where each packet starts in data
+        std::vector<pcap_handler> handlers; // for each packet's link type (pcapng files can have several)
+        std::vector<u_char>  data;
+        size_t size() const { return hdrs.size(); }
+        void clear() { hdrs.clear(); offsets.clear(); handlers.clear(); data.clear(); }
+    };
+
+    class source {
+        source(const source &);
+        source &operator=(const source &);
+    public:
+        source(size_t index_):index(index_),name(),dlt(0),handler(0),pd(0),reader(0),
+                              thread(),M(),ready(),space(),queue(),free_batches(),done(false),result(0),
+                              stop(false),filling(0),current(0),next(0){}
+        size_t          index;              // order in which the file was added; breaks timestamp ties
+        std::string     name;
+        int             dlt;                // of the last packet read
+        pcap_handler    handler;            // for dlt
+        pcap_t          *pd;                // the file if libpcap reads it
+        mmap_pcap_reader *reader;           // the file if it is mapped
+
+        std::thread     thread;
+        std::mutex      M;                  // protects everything up to filling
+        std::condition_variable ready;      // a batch was queued, or done was set
+        std::condition_variable space;      // a batch was taken off the queue
+        std::deque<batch *> queue;
+        std::vector<batch *> free_batches;
+        bool            done;               // the reader thread has finished
+        int             result;             // of the reader thread
+        bool            stop;
+
+        batch           *filling;           // reader thread only
+        batch           *current;           // merging thread only
+        size_t          next;               // next packet of current
+
+        const struct pcap_pkthdr &head() const { return current->hdrs[next]; }
+    };
+
+    pcap_merge(const pcap_merge &);
+    pcap_merge &operator=(const pcap_merge &);
+
+    std::vector<source *> sources;
+    volatile sig_atomic_t stop;
+    const volatile sig_atomic_t *halt;      // run() stops when this is set; see halt_on()
+
+    static void collect(u_char *user,const struct pcap_pkthdr *h,const u_char *p);
+    static void queue_batch(source *s);
+    void read_source(source *s);            // reader thread body
+    bool fetch(source *s);                  // make s->current[s->next] the source's next packet
+    static bool later(const source *a,const source *b);
+
+public:
+    enum { BATCH_PACKETS = 256,             // packets per batch
+           BATCH_BYTES = 1024*1024,         // or bytes per batch
+           MAX_QUEUED_BATCHES = 16 };       // per file; the reader waits beyond this
+
+    pcap_merge():sources(),stop(0),halt(0){}
+    ~pcap_merge();
+
+    /* Open a file (path may be a pipe from a decompressor) and set up its filter.
+     * If fp is not null the packets are read from it instead of from path,
+     * and it is closed with the file.
+     * name is what the file is called in messages. Returns 0, or -1 with error set.
+     */
+    int  add_file(const std::string &path,FILE *fp,const std::string &name,const std::string &expression,
+                  std::string &error);
+    size_t size() const { return sources.size(); }
+
+    /* Deliver every packet of every file in timestamp order; user is passed to the handlers.
+     * Returns 0, or -1 if any file could not be read to the end.
+     */
+    int  run(u_char *user);
+    void breakloop();                       // safe to call from a signal handler, if no file is being added
+    /* Stop run() when *flag is set, instead of with breakloop(): for a merge whose
+     * files are added and closed while a signal may arrive, which the handler
+     * therefore must not touch.
+     */
+    void halt_on(const volatile sig_atomic_t *flag) { halt = flag; }
+    void close();                           // after run(): close the files now instead of with the merge
+};
+
+#endif
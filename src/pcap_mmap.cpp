@@ -0,0 +1,432 @@
+/*
+ * pcap_mmap.cpp:
+ *
+ * Read a pcap or pcapng file by mapping it into memory.
+ * See pcap_mmap.h
+ *
+ * This source code is under the GNU Public License (GPL).  See
+ * LICENSE for details.
+ */
+
+#include "tcpflow.h"
+#include "pcap_mmap.h"
+#include "packet_batch.h"
+#include "pcap_index.h"
+
+#include <algorithm>
+#include <sys/stat.h>
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+
+/* static */ bool mmap_pcap_reader::enabled = true;
+
+static const uint32_t PCAP_MAGIC_USEC = 0xa1b2c3d4;
+static const uint32_t PCAP_MAGIC_NSEC = 0xa1b23c4d;
+static const size_t   PCAP_FILE_HEADER_LEN   = 24;
+static const size_t   PCAP_RECORD_HEADER_LEN = 16;
+static const size_t   RELEASE_CHUNK = 64*1024*1024; // give back processed pages this many bytes at a time
+
+/* pcapng block types and options */
+static const uint32_t PCAPNG_SHB = 0x0a0d0d0a;     // Section Header Block; the same in either byte order
+static const uint32_t PCAPNG_IDB = 1;              // Interface Description Block
+static const uint32_t PCAPNG_PB  = 2;              // Packet Block (obsolete)
+static const uint32_t PCAPNG_SPB = 3;              // Simple Packet Block
+static const uint32_t PCAPNG_EPB = 6;              // Enhanced Packet Block
+static const uint32_t PCAPNG_BYTE_ORDER_MAGIC = 0x1a2b3c4d;
+static const uint16_t IF_TSRESOL  = 9;
+static const uint16_t IF_TSOFFSET = 14;
+static const size_t   PCAPNG_BLOCK_OVERHEAD = 12;  // type, length, and length again
+
+/* LINKTYPE_ values in the file are the same as the DLT_ values, except for DLT_RAW,
+ * which is different from one system to the next.
+ */
+static int linktype_to_dlt(uint32_t linktype)
+{
+    if(linktype==101) return DLT_RAW;   // LINKTYPE_RAW
+    return (int)linktype;
+}
+
+mmap_pcap_reader::mmap_pcap_reader():
+    fd(-1),base(0),size(0),swapped(false),nanosecond(false),ng(false),dlt(0),current_dlt(0),file_snaplen(0),
+    released(0),fname(),expression(),interfaces(),linktypes(),index(0),stop(0)
+{
+}
+
+mmap_pcap_reader::~mmap_pcap_reader()
+{
+    close();
+}
+
+int mmap_pcap_reader::open(const std::string &fname_,std::string &error)
+{
+#ifdef HAVE_SYS_MMAN_H
+    close();
+    fname = fname_;
+    struct stat st;
+    fd = ::open(fname.c_str(),O_RDONLY|O_BINARY);
+    if(fd<0 || fstat(fd,&st)){
+        error = fname + ": " + strerror(errno);
+        close();
+        return -1;
+    }
+    if(!S_ISREG(st.st_mode) || (size_t)st.st_size < PCAP_FILE_HEADER_LEN){
+        error = fname + ": not a regular pcap file";
+        close();
+        return -1;
+    }
+    size = st.st_size;
+    void *m = mmap(0,size,PROT_READ,MAP_PRIVATE,fd,0);
+    if(m==MAP_FAILED){
+        error = fname + ": mmap: " + strerror(errno);
+        size = 0;
+        close();
+        return -1;
+    }
+    base = (const uint8_t *)m;
+#ifdef MADV_SEQUENTIAL
+    madvise(m,size,MADV_SEQUENTIAL);
+#endif
+#ifdef MADV_HUGEPAGE
+    madvise(m,size,MADV_HUGEPAGE);      // only a hint; fails quietly where not supported
+#endif
+
+    uint32_t magic;
+    memcpy(&magic,base,4);
+    if(magic==PCAPNG_SHB){
+        ng = true;
+        if(read_section_header(0,size) < 0){
+            error = fname + ": bad pcapng section header";
+            close();
+            return -1;
+        }
+        /* the link type of the first interface is the file's, as far as datalink() is concerned */
+        size_t off = 0;
+        while(size-off >= PCAPNG_BLOCK_OVERHEAD){
+            uint32_t type = get32(base+off);
+            uint32_t len  = get32(base+off+4);
+            if(len < PCAPNG_BLOCK_OVERHEAD || len > size-off) break;
+            if(type==PCAPNG_IDB && len >= PCAPNG_BLOCK_OVERHEAD+8){
+                dlt = linktype_to_dlt(get16(base+off+8));
+                file_snaplen = get32(base+off+12);
+                break;
+            }
+            if(type==PCAPNG_EPB || type==PCAPNG_SPB || type==PCAPNG_PB) break;
+            off += len;
+        }
+        return 0;
+    }
+    swapped = (magic==__builtin_bswap32(PCAP_MAGIC_USEC) || magic==__builtin_bswap32(PCAP_MAGIC_NSEC));
+    magic = get32(base);
+    if(magic!=PCAP_MAGIC_USEC && magic!=PCAP_MAGIC_NSEC){
+        error = fname + ": not a pcap or pcapng file";
+        close();
+        return -1;
+    }
+    nanosecond   = (magic==PCAP_MAGIC_NSEC);
+    file_snaplen = get32(base+16);
+    dlt          = linktype_to_dlt(get32(base+20) & 0x03ffffff); // the top bits are FCS information
+    return 0;
+#else
+    error = "mmap is not available";
+    return -1;
+#endif
+}
+
+int mmap_pcap_reader::set_filter(const std::string &expression_,std::string &error)
+{
+    expression = expression_;
+    if(expression.size()==0) return 0;
+    /* compile it now, so that a bad expression is reported before any packets are read */
+    pcap_t *dead = pcap_open_dead(dlt,SNAPLEN);
+    struct bpf_program fcode;
+    if(pcap_compile(dead,&fcode,expression.c_str(),1,0) < 0){
+        error = pcap_geterr(dead);
+        pcap_close(dead);
+        return -1;
+    }
+    pcap_close(dead);
+    linktype &lt = linktypes[dlt];
+    if(lt.filtering) pcap_freecode(&lt.fcode);
+    lt.fcode = fcode;
+    lt.filtering = true;
+    return 0;
+}
+
+/* Filter the packet, whose record or block is at offset, and hand it on.
+ * Returns 0, or -1 if the filter cannot be compiled for dlt_
+ */
+int mmap_pcap_reader::deliver(pcap_handler handler,u_char *user,int dlt_,const struct pcap_pkthdr &h,const u_char *data,
+                              size_t offset)
+{
+    std::map<int,linktype>::iterator it = linktypes.find(dlt_);
+    if(it==linktypes.end() || (expression.size()>0 && !it->second.filtering)){
+        linktype &lt = linktypes[dlt_];
+        if(expression.size()>0){
+            pcap_t *dead = pcap_open_dead(dlt_,SNAPLEN);
+            if(pcap_compile(dead,&lt.fcode,expression.c_str(),1,0) < 0){
+                DEBUG(1)("%s: filter for link type %d: %s",fname.c_str(),dlt_,pcap_geterr(dead));
+                pcap_close(dead);
+                linktypes.erase(dlt_);
+                return -1;
+            }
+            pcap_close(dead);
+            lt.filtering = true;
+        }
+        it = linktypes.find(dlt_);
+    }
+    linktype &lt = it->second;
+    if(lt.filtering && !pcap_offline_filter(&lt.fcode,&h,data)) return 0;
+    if(index) index->note(data,h,offset);
+    if(handler==0){
+        if(lt.handler==0) lt.handler = find_handler(dlt_,fname.c_str());
+        handler = lt.handler;
+    }
+    current_dlt = dlt_;
+    (*handler)(user,&h,data);
+    return 0;
+}
+
+/* Packets are copied or written by the time the handler returns */
+void mmap_pcap_reader::release(size_t off)
+{
+#if defined(HAVE_SYS_MMAN_H) && defined(MADV_DONTNEED)
+    if(off - released >= 2*RELEASE_CHUNK){
+        packet_batch::flush();          // held packets may be in the chunk
+        madvise((void *)(base+released),RELEASE_CHUNK,MADV_DONTNEED);
+        released += RELEASE_CHUNK;
+    }
+#endif
+}
+
+int mmap_pcap_reader::loop(pcap_handler handler,u_char *user)
+{
+    if(base==0) return -1;
+    stop = 0;
+    released = 0;
+    packet_batch::scope batch;          // the packets stay mapped
+    return ng ? loop_pcapng(handler,user) : loop_pcap(handler,user);
+}
+
+int mmap_pcap_reader::loop_pcap(pcap_handler handler,u_char *user)
+{
+    size_t off = PCAP_FILE_HEADER_LEN;
+    while(!stop && off < size){
+        if(read_record(off,off,handler,user)) return -1;
+        release(off);
+    }
+    return 0;
+}
+
+/* Hand on the packet of the record at off, and set next to the record after it.
+ * Returns 0, or -1 if the file is damaged.
+ */
+int mmap_pcap_reader::read_record(size_t off,size_t &next,pcap_handler handler,u_char *user)
+{
+    size_t record = off;
+    if(size - off < PCAP_RECORD_HEADER_LEN){
+        DEBUG(1)("pcap file truncated in a record header at offset %zu",off);
+        return -1;
+    }
+    const uint8_t *rec = base + off;
+    struct pcap_pkthdr h;
+    h.ts.tv_sec  = get32(rec);
+    h.ts.tv_usec = nanosecond ? get32(rec+4)/1000 : get32(rec+4);
+    h.caplen     = get32(rec+8);
+    h.len        = get32(rec+12);
+    off += PCAP_RECORD_HEADER_LEN;
+    if(h.caplen > size - off){
+        DEBUG(1)("pcap file truncated in a packet at offset %zu",off);
+        return -1;
+    }
+    const u_char *data = base + off;
+    next = off + h.caplen;
+    return deliver(handler,user,dlt,h,data,record);
+}
+
+/* Check the byte order magic of the section header at off and start a new section.
+ * Returns the block length, or -1 if it is not a section header we can read.
+ */
+int mmap_pcap_reader::read_section_header(size_t off,size_t len)
+{
+    if(len < PCAPNG_BLOCK_OVERHEAD+16) return -1;
+    uint32_t bom;
+    memcpy(&bom,base+off+8,4);
+    if(bom==PCAPNG_BYTE_ORDER_MAGIC) swapped = false;
+    else if(bom==__builtin_bswap32(PCAPNG_BYTE_ORDER_MAGIC)) swapped = true;
+    else return -1;
+    if(get16(base+off+12)!=1) return -1;    // major version
+    interfaces.clear();                     // interface numbers start again in each section
+    return get32(base+off+4);
+}
+
+/* Add the interface described by the IDB at off; len is the block length.
+ * Returns 0, or -1 if the block is damaged.
+ */
+int mmap_pcap_reader::read_interface(size_t off,size_t len)
+{
+    if(len < PCAPNG_BLOCK_OVERHEAD+8) return -1;
+    const uint8_t *p   = base+off+8;
+    const uint8_t *end = base+off+len-4;
+    interface ifc;
+    ifc.dlt     = linktype_to_dlt(get16(p));
+    ifc.snaplen = get32(p+4);
+    for(p += 8; end-p >= 4;){
+        uint16_t code = get16(p);
+        uint16_t olen = get16(p+2);
+        p += 4;
+        if(code==0 || olen > end-p) break;  // opt_endofopt
+        if(code==IF_TSRESOL && olen==1){
+            uint8_t v = p[0];
+            uint64_t units = 1;
+            if(v & 0x80){
+                if((v & 0x7f) < 64) units = (uint64_t)1 << (v & 0x7f);
+            } else {
+                for(int i=0;i<(v<20 ? v : 19);i++) units *= 10;
+            }
+            ifc.units = units;
+        }
+        if(code==IF_TSOFFSET && olen==8){
+            uint64_t v;
+            memcpy(&v,p,8);
+            ifc.offset = (int64_t)(swapped ? __builtin_bswap64(v) : v);
+        }
+        p += (olen+3) & ~3;
+    }
+    interfaces.push_back(ifc);
+    return 0;
+}
+
+int mmap_pcap_reader::loop_pcapng(pcap_handler handler,u_char *user)
+{
+    size_t off = 0;
+    while(!stop && off < size){
+        if(read_block(off,off,handler,user)) return -1;
+        release(off);
+    }
+    return 0;
+}
+
+/* Read the block at off, handing on its packet if it has one, and set next
+ * to the block after it. Returns 0, or -1 if the file is damaged.
+ */
+int mmap_pcap_reader::read_block(size_t off,size_t &next,pcap_handler handler,u_char *user)
+{
+    if(size - off < PCAPNG_BLOCK_OVERHEAD){
+        DEBUG(1)("pcapng file truncated in a block header at offset %zu",off);
+        return -1;
+    }
+    uint32_t type = get32(base+off);
+    if(type==PCAPNG_SHB && read_section_header(off,size-off) < 0){
+        DEBUG(1)("pcapng file has a bad section header at offset %zu",off);
+        return -1;
+    }
+    uint32_t len = get32(base+off+4);
+    if(len < PCAPNG_BLOCK_OVERHEAD || len % 4 || len > size-off){
+        DEBUG(1)("pcapng file has a bad block length at offset %zu",off);
+        return -1;
+    }
+    next = off + len;
+    const uint8_t *b = base+off+8;      // block body
+    size_t blen = len - PCAPNG_BLOCK_OVERHEAD;
+    struct pcap_pkthdr h;
+    const uint8_t *data = 0;
+    uint32_t ifnum = 0;
+    uint64_t ts = 0;
+    switch(type){
+    case PCAPNG_SHB:
+        if(index) index->note_header(off);
+        break;
+    case PCAPNG_IDB:
+        if(read_interface(off,len)){
+            DEBUG(1)("pcapng file has a bad interface description at offset %zu",off);
+            return -1;
+        }
+        if(index) index->note_header(off);
+        break;
+    case PCAPNG_EPB:
+        if(blen < 20) break;
+        ifnum     = get32(b);
+        ts        = (uint64_t)get32(b+4)<<32 | get32(b+8);
+        h.caplen  = get32(b+12);
+        h.len     = get32(b+16);
+        data      = b+20;
+        if(h.caplen > blen-20) data = 0;
+        break;
+    case PCAPNG_PB:
+        if(blen < 20) break;
+        ifnum     = get16(b);
+        ts        = (uint64_t)get32(b+4)<<32 | get32(b+8);
+        h.caplen  = get32(b+12);
+        h.len     = get32(b+16);
+        data      = b+20;
+        if(h.caplen > blen-20) data = 0;
+        break;
+    case PCAPNG_SPB:                    // no timestamp; always interface 0
+        if(blen < 4) break;
+        h.len     = get32(b);
+        h.caplen  = std::min((size_t)h.len,blen-4);
+        if(interfaces.size()>0 && interfaces[0].snaplen>0 && h.caplen>interfaces[0].snaplen){
+            h.caplen = interfaces[0].snaplen;
+        }
+        data      = b+4;
+        break;
+    default:                            // statistics, name resolution, custom blocks...
+        break;
+    }
+    if(data){
+        if(ifnum >= interfaces.size()){
+            DEBUG(1)("pcapng packet at offset %zu is for undescribed interface %u",off,ifnum);
+            return -1;
+        }
+        const interface &ifc = interfaces[ifnum];
+        uint64_t frac   = ts % ifc.units;
+        h.ts.tv_sec     = ts / ifc.units + ifc.offset;
+        h.ts.tv_usec    = ifc.units==1000000 ? frac : (uint64_t)((double)frac * 1000000.0 / (double)ifc.units);
+        if(deliver(handler,user,ifc.dlt,h,data,off)) return -1;
+    }
+    return 0;
+}
+
+/* Only the records or blocks at offsets, which the --flows index gave */
+int mmap_pcap_reader::loop_at(const std::vector<uint64_t> &offsets,pcap_handler handler,u_char *user)
+{
+    if(base==0) return -1;
+    stop = 0;
+#if defined(HAVE_SYS_MMAN_H) && defined(MADV_RANDOM)
+    madvise((void *)base,size,MADV_RANDOM);
+#endif
+    packet_batch::scope batch;          // the packets stay mapped
+    for(size_t i=0;i<offsets.size() && !stop;i++){
+        size_t off = offsets[i];
+        size_t next = 0;
+        if(off >= size || (!ng && off < PCAP_FILE_HEADER_LEN)){
+            DEBUG(1)("%s: offset %zu from the index is not in the file",fname.c_str(),off);
+            return -1;
+        }
+        if(ng ? read_block(off,next,handler,user) : read_record(off,next,handler,user)) return -1;
+    }
+    return 0;
+}
+
+void mmap_pcap_reader::close()
+{
+#ifdef HAVE_SYS_MMAN_H
+    if(base){
+        munmap((void *)base,size);
+        base = 0;
+        size = 0;
+    }
+#endif
+    if(fd>=0){
+        ::close(fd);
+        fd = -1;
+    }
+    for(std::map<int,linktype>::iterator it=linktypes.begin();it!=linktypes.end();it++){
+        if(it->second.filtering) pcap_freecode(&it->second.fcode);
+    }
+    linktypes.clear();
+    interfaces.clear();
+    ng = false;
+    swapped = false;
+}
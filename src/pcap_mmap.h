@@ -0,0 +1,120 @@
+/*
+ * pcap_mmap.h:
+ *
+ * Read a pcap or pcapng file by mapping it into memory.
+ *
+ * The datalink handlers get pointers straight into the mapping, so packets
+ * are never copied through a stdio buffer as they are by pcap_open_offline().
+ * Pages that have been processed are given back as the reader goes, so that
+ * large captures do not fill up our address space.
+ *
+ * Classic pcap files (either byte order, microsecond or nanosecond
+ * timestamps) and pcapng files are read here; for anything else open()
+ * fails and the caller uses libpcap.
+ *
+ * A pcapng file can hold packets from several interfaces, each with its
+ * own link type and timestamp resolution (if_tsresol). Each packet is
+ * handed to the handler for its own interface's link type, and the filter
+ * is compiled once for each link type.
+ *
+ * This source code is under the GNU Public License (GPL).  See
+ * LICENSE for details.
+ */
+
+#ifndef PCAP_MMAP_H
+#define PCAP_MMAP_H
+
+#include "tcpflow.h"
+
+#include <string>
+#include <vector>
+#include <map>
+#include <signal.h>
+
+class mmap_pcap_reader {
+    mmap_pcap_reader(const mmap_pcap_reader &);
+    mmap_pcap_reader &operator=(const mmap_pcap_reader &);
+
+public:
+    static bool enabled;                    // -S mmap_pcap=0 turns this reader off
+
+    mmap_pcap_reader();
+    ~mmap_pcap_reader();
+
+    /* Map fname and read its file header. Returns 0 on success or -1 with error set. */
+    int  open(const std::string &fname,std::string &error);
+    int  datalink() const { return dlt; }   // of the first interface
+    uint32_t snaplen() const { return file_snaplen; }
+    bool pcapng() const { return ng; }
+    int  current_datalink() const { return current_dlt; } // of the packet being handled
+
+    /* Only hand on packets that match expression. Returns 0, or -1 with error set. */
+    int  set_filter(const std::string &expression,std::string &error);
+
+    /* Hand every packet to handler, or, if handler is null, to find_handler()
+     * for the packet's link type.
+     * Returns 0 at the end of the file or after breakloop(), -1 if the file is damaged.
+     */
+    int  loop(pcap_handler handler,u_char *user);
+    /* The same, but only for the records (pcapng blocks) at offsets, which must be in order */
+    int  loop_at(const std::vector<uint64_t> &offsets,pcap_handler handler,u_char *user);
+    void set_index(class pcap_index *index_) { index = index_; } // --index: tell it where each packet is
+    void breakloop() { stop = 1; }          // safe to call from a signal handler
+    void close();
+
+private:
+    /* A pcapng Interface Description Block */
+    struct interface {
+        interface():dlt(0),snaplen(0),units(1000000),offset(0){}
+        int      dlt;
+        uint32_t snaplen;
+        uint64_t units;                     // timestamp units per second (if_tsresol)
+        int64_t  offset;                    // seconds added to timestamps (if_tsoffset)
+    };
+    /* What each link type gets */
+    struct linktype {
+        linktype():handler(0),fcode(),filtering(false){}
+        pcap_handler handler;
+        struct bpf_program fcode;
+        bool filtering;
+    };
+
+    uint16_t get16(const uint8_t *p) const {
+        uint16_t v;
+        memcpy(&v,p,2);
+        return swapped ? __builtin_bswap16(v) : v;
+    }
+    uint32_t get32(const uint8_t *p) const {
+        uint32_t v;
+        memcpy(&v,p,4);
+        return swapped ? __builtin_bswap32(v) : v;
+    }
+    int  deliver(pcap_handler handler,u_char *user,int dlt_,const struct pcap_pkthdr &h,const u_char *data,
+                 size_t offset);
+    int  loop_pcap(pcap_handler handler,u_char *user);
+    int  loop_pcapng(pcap_handler handler,u_char *user);
+    int  read_record(size_t off,size_t &next,pcap_handler handler,u_char *user);
+    int  read_block(size_t off,size_t &next,pcap_handler handler,u_char *user);
+    int  read_section_header(size_t off,size_t len);
+    int  read_interface(size_t off,size_t len);
+    void release(size_t off);               // give back the pages before off
+
+    int      fd;
+    const uint8_t *base;                    // the mapping
+    size_t   size;
+    bool     swapped;                       // the file (or pcapng section) was written with the other byte order
+    bool     nanosecond;                    // classic pcap: timestamps are in nanoseconds
+    bool     ng;                            // pcapng
+    int      dlt;
+    int      current_dlt;
+    uint32_t file_snaplen;
+    size_t   released;
+    std::string fname;
+    std::string expression;
+    std::vector<interface> interfaces;      // of the current pcapng section
+    std::map<int,linktype> linktypes;
+    class pcap_index *index;
+    volatile sig_atomic_t stop;
+};
+
+#endif
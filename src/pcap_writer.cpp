@@ -0,0 +1,220 @@
+/*
+ * pcap_writer.cpp:
+ *
+ * Buffered pcap and pcapng output. See pcap_writer.h
+ *
+ * This source code is under the GNU Public License (GPL).  See
+ * LICENSE for details.
+ */
+
+#include "tcpflow.h"
+#include "pcap_writer.h"
+
+/* static */ bool pcap_writer::pcapng = false;
+
+/* pcapng block types and options; written in host byte order */
+static const uint32_t PCAPNG_SHB = 0x0a0d0d0a;
+static const uint32_t PCAPNG_IDB = 1;
+static const uint32_t PCAPNG_EPB = 6;
+static const uint32_t PCAPNG_BYTE_ORDER_MAGIC = 0x1a2b3c4d;
+static const uint16_t IF_TSRESOL = 9;
+
+pcap_writer::pcap_writer(const std::string &fname_,size_t buffer_size,uint32_t snaplen_):
+    fname(fname_),fd(-1),buf(0),buf_size(buffer_size>64 ? buffer_size : 64),used(0),
+    created(false),started(false),ng(false),failed(false),snaplen(snaplen_),file_dlt(-1),interfaces(),dropped_(0)
+{
+}
+
+pcap_writer::~pcap_writer()
+{
+    close();
+    if(dropped_) DEBUG(1)("%s: %" PRIu64 " packets not written",fname.c_str(),dropped_);
+}
+
+int pcap_writer::open()
+{
+    if(fd>=0) return 0;
+    int flags = created ? O_WRONLY|O_APPEND|O_BINARY : O_WRONLY|O_CREAT|O_TRUNC|O_BINARY;
+    fd = ::open(fname.c_str(),flags,0666);
+    if(fd<0) return -1;
+    created = true;
+    if(buf==0) buf = new uint8_t[buf_size];
+    return 0;
+}
+
+int pcap_writer::close()
+{
+    if(fd<0) return 0;
+    int r = flush();
+    if(::close(fd)){
+        DEBUG(1)("%s: %s",fname.c_str(),strerror(errno));
+        r = -1;
+    }
+    fd = -1;
+    delete[] buf;
+    buf = 0;
+    return r;
+}
+
+/* static */ pcap_writer *pcap_writer::open_new(const std::string &ofname,size_t buffer_size)
+{
+    pcap_writer *pcw = new pcap_writer(ofname,buffer_size,PCAP_MAX_PKT_LEN);
+    if(pcw->open()){
+        int e = errno;
+        delete pcw;
+        errno = e;
+        return 0;
+    }
+    return pcw;
+}
+
+/*
+ * The snapshot length in the header of a classic pcap file, in either byte
+ * order and either time stamp precision; PCAP_MAX_PKT_LEN for anything else.
+ * The header itself is not copied: the output is always in host order
+ * with microsecond (or, in pcapng, nanosecond) time stamps.
+ */
+/* static */ uint32_t pcap_writer::input_snaplen(const std::string &ifname)
+{
+    uint32_t r = PCAP_MAX_PKT_LEN;
+    FILE *f = fopen(ifname.c_str(),"rb");
+    if(f==0) return r;
+    uint8_t h[PCAP_HEADER_SIZE];
+    if(fread(h,1,sizeof(h),f)==sizeof(h)){
+        uint32_t le = h[0] | (h[1]<<8) | (h[2]<<16) | ((uint32_t)h[3]<<24);
+        bool little = (le==0xa1b2c3d4 || le==0xa1b23c4d);
+        bool big    = (le==0xd4c3b2a1 || le==0x4d3cb2a1);
+        if(little) r = h[16] | (h[17]<<8) | (h[18]<<16) | ((uint32_t)h[19]<<24);
+        if(big)    r = h[19] | (h[18]<<8) | (h[17]<<16) | ((uint32_t)h[16]<<24);
+        if(r==0) r = PCAP_MAX_PKT_LEN;
+    }
+    fclose(f);
+    return r;
+}
+
+/* static */ pcap_writer *pcap_writer::open_copy(const std::string &ofname,const std::string &ifname)
+{
+    pcap_writer *pcw = open_new(ofname);
+    if(pcw) pcw->snaplen = input_snaplen(ifname);
+    return pcw;
+}
+
+int pcap_writer::write_all(const void *data,size_t len)
+{
+    const uint8_t *p = (const uint8_t *)data;
+    while(len>0){
+        ssize_t r = ::write(fd,p,len);
+        if(r<0 && errno==EINTR) continue;
+        if(r<=0){
+            DEBUG(1)("%s: %s; no more packets will be written to it",fname.c_str(),
+                     r<0 ? strerror(errno) : "short write");
+            failed = true;
+            return -1;
+        }
+        p   += r;
+        len -= r;
+    }
+    return 0;
+}
+
+int pcap_writer::flush()
+{
+    if(used==0 || failed) return failed ? -1 : 0;
+    int r = write_all(buf,used);
+    used = 0;
+    return r;
+}
+
+void pcap_writer::put(const void *data,size_t len)
+{
+    if(used+len > buf_size){
+        if(flush()) return;
+        if(len >= buf_size){            // no point in copying it
+            write_all(data,len);
+            return;
+        }
+    }
+    memcpy(buf+used,data,len);
+    used += len;
+}
+
+void pcap_writer::start(int dlt)
+{
+    started = true;
+    ng = pcapng;
+    if(ng){
+        uint32_t shb[7] = {PCAPNG_SHB,28,PCAPNG_BYTE_ORDER_MAGIC,
+                           0,                   // major and minor version, below
+                           0xffffffff,0xffffffff, // section length not known
+                           28};
+        uint16_t version[2] = {1,0};
+        memcpy(&shb[3],version,sizeof(version));
+        put(shb,sizeof(shb));
+        return;
+    }
+    uint32_t h[6] = {0xa1b2c3d4,
+                     0,                 // major and minor version, below
+                     0,                 // time zone offset; always 0
+                     0,                 // accuracy of time stamps in the file; always 0
+                     snaplen,
+                     (uint32_t)dlt};    // link layer encapsulation
+    uint16_t version[2] = {2,4};
+    memcpy(&h[1],version,sizeof(version));
+    file_dlt = dlt;
+    put(h,sizeof(h));
+}
+
+/* The interface description for dlt, written the first time dlt is seen */
+uint32_t pcap_writer::interface_for(int dlt)
+{
+    for(size_t i=0;i<interfaces.size();i++){
+        if(interfaces[i]==dlt) return i;
+    }
+    uint32_t idb[8] = {PCAPNG_IDB,32,
+                       0,               // link type and a reserved half, below
+                       snaplen,
+                       0,               // if_tsresol option header, below
+                       0,               // its value, 10^-9 seconds, padded to 4 bytes
+                       0,               // opt_endofopt
+                       32};
+    uint16_t link[2]    = {(uint16_t)dlt,0};
+    uint16_t tsresol[2] = {IF_TSRESOL,1};
+    memcpy(&idb[2],link,sizeof(link));
+    memcpy(&idb[4],tsresol,sizeof(tsresol));
+    ((uint8_t *)&idb[5])[0] = 9;
+    put(idb,sizeof(idb));
+    interfaces.push_back(dlt);
+    return interfaces.size()-1;
+}
+
+void pcap_writer::writepkt(const struct pcap_pkthdr *h,const u_char *p,int dlt)
+{
+    if(failed || fd<0){
+        dropped_++;
+        return;
+    }
+    if(!started) start(dlt);
+    uint32_t caplen = h->caplen;
+    if(ng){
+        uint32_t ifid = interface_for(dlt);
+        uint32_t pad = (4 - (caplen & 3)) & 3;
+        uint32_t total = PCAPNG_EPB_HEADER_SIZE + caplen + pad + 4;
+        uint64_t ts = (uint64_t)h->ts.tv_sec*1000000000 + (uint64_t)h->ts.tv_usec*1000;
+        uint32_t epb[7] = {PCAPNG_EPB,total,ifid,(uint32_t)(ts>>32),(uint32_t)ts,caplen,h->len};
+        static const uint8_t zeros[4] = {0,0,0,0};
+        put(epb,sizeof(epb));
+        put(p,caplen);
+        put(zeros,pad);
+        put(&total,sizeof(total));
+        return;
+    }
+    if(dlt!=file_dlt){
+        if(dropped_==0) DEBUG(1)("%s: link type %d cannot go in a pcap file of link type %d; "
+                                 "use -S pcapng=1",fname.c_str(),dlt,file_dlt);
+        dropped_++;
+        return;
+    }
+    uint32_t rec[4] = {(uint32_t)h->ts.tv_sec,(uint32_t)h->ts.tv_usec,caplen,h->len};
+    put(rec,sizeof(rec));
+    put(p,caplen);
+}
@@ -1,102 +1,90 @@
 /*
  * pcap_writer.h:
- * 
+ *
  * A class for writing pcap files
+ *
+ * Each packet's record header is put together in a buffer along with
+ * the packet, and the buffer goes to the file when it is full; a packet
+ * too big for the buffer goes straight to the file after its header.
+ * The file header is written with the first packet, so that it carries
+ * that packet's link type.
+ *
+ * With -S pcapng=1 the files are pcapng instead: a section header, an
+ * interface description for each link type seen, and enhanced packet
+ * blocks with nanosecond time stamps.
+ *
+ * A writer can be closed and opened again, to keep the number of open
+ * files down while it is not being written to; the buffer is given back
+ * while it is closed, and it is opened again in append mode.
+ *
+ * A write error is reported once. After it, and for classic pcap files
+ * after a packet with another link type than the first, packets are
+ * counted as dropped instead of written.
+ *
+ * This source code is under the GNU Public License (GPL).  See
+ * LICENSE for details.
  */
 
 #ifndef HAVE_PCAP_WRITER_H
 #define HAVE_PCAP_WRITER_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+struct pcap_pkthdr;
+
 class pcap_writer {
     /* These are not implemented */
     pcap_writer &operator=(const pcap_writer &that);
     pcap_writer(const pcap_writer &t);
-    class write_error: public std::exception {
-        virtual const char *what() const throw() {
-            return "write error in pcap_write";
-        }
-    };
-    
+
     enum {PCAP_RECORD_HEADER_SIZE = 16,
           PCAP_MAX_PKT_LEN = 65535,      // wire shark may reject larger
           PCAP_HEADER_SIZE = 4+2+2+4+4+4+4,
+          PCAPNG_EPB_HEADER_SIZE = 28,   // then the data, padded to 4 bytes, and the length again
     };
-    FILE *fcap;                         // where file is written
-    void write_bytes(const uint8_t * const val, size_t num_bytes) {
-        size_t count = fwrite(val,1,num_bytes,fcap);
-        if (count != num_bytes) throw new write_error();
-    }
-    void write2(const uint16_t val) {
-        size_t count = fwrite(&val,1,2,fcap);
-        if (count != 2)  throw new write_error();
-    }
-    void write4(const uint32_t val) {
-        size_t count = fwrite(&val,1,4,fcap);
-        if (count != 4) throw new write_error();
-    }
-    void open(const std::string &fname) {
-        fcap = fopen(fname.c_str(),"wb"); // write the output
-        if(fcap==0) throw new write_error();
-    }
-    void write_header(const int pcap_dlt){
-        write4(0xa1b2c3d4);
-        write2(2);			// major version number
-        write2(4);			// minor version number
-        write4(0);			// time zone offset; always 0
-        write4(0);			// accuracy of time stamps in the file; always 0
-        write4(PCAP_MAX_PKT_LEN);	// snapshot length
-        write4(pcap_dlt);             // link layer encapsulation
-    }
-    void copy_header(const std::string &ifname){
-        /* assert byte order is correct */
-        FILE *f2 = fopen(ifname.c_str(),"rb");
-        if(f2==0) throw new write_error();
-        u_char buf[PCAP_HEADER_SIZE];
-        if(fread(buf,1,sizeof(buf),f2)!=sizeof(buf)) throw new write_error();
-        if((buf[0]!=0xd4) || (buf[1]!=0xc3) || (buf[2]!=0xb2) || (buf[3]!=0xa1)){
-            std::cout << "pcap file " << ifname << " is in wrong byte order. Cannot continue.\n";
-            throw new write_error();
-        }
-        if(fwrite(buf,1,sizeof(buf),fcap)!=sizeof(buf)) throw new write_error();
-        if(fclose(f2)!=0) throw new write_error();
-    }
+    std::string fname;
+    int         fd;
+    uint8_t     *buf;
+    size_t      buf_size;
+    size_t      used;                   // bytes in buf not yet written
+    bool        created;                // the file was made; open() appends to it
+    bool        started;                // file header written
+    bool        ng;                     // pcapng; decided when the file is started
+    bool        failed;                 // a write failed; the file is left alone
+    uint32_t    snaplen;
+    int         file_dlt;               // classic pcap: the one link type of the file
+    std::vector<int> interfaces;        // pcapng: the link type of each interface description
+    uint64_t    dropped_;
+
+    int  write_all(const void *data,size_t len);
+    int  flush();
+    void put(const void *data,size_t len);
+    void start(int dlt);
+    uint32_t interface_for(int dlt);
+    static uint32_t input_snaplen(const std::string &ifname);
 
 public:
-    pcap_writer():fcap(0){}
+    enum {DEFAULT_BUFFER_SIZE = 1024*1024,
+          FLOW_BUFFER_SIZE    = 16*1024, // -K writes one file per flow
+    };
+    static bool pcapng;                 // write pcapng instead of pcap
+
+    pcap_writer(const std::string &fname,size_t buffer_size=DEFAULT_BUFFER_SIZE,
+                uint32_t snaplen=PCAP_MAX_PKT_LEN); // not opened yet
+    /* Both return 0, with errno set, if the file cannot be made */
+    static pcap_writer *open_new(const std::string &ofname,size_t buffer_size=DEFAULT_BUFFER_SIZE);
+    static pcap_writer *open_copy(const std::string &ofname,const std::string &ifname); // snaplen of ifname
+    virtual ~pcap_writer();
 
-    static pcap_writer *open_new(const std::string &ofname){
-        pcap_writer *pcw = new pcap_writer();
-        pcw->open(ofname);
-        pcw->write_header(DLT_EN10MB); // static for temporary regression
-        return pcw;
-    }
-    static pcap_writer *open_copy(const std::string &ofname,const std::string &ifname){
-        pcap_writer *pcw = new pcap_writer();
-        pcw->open(ofname);
-        pcw->copy_header(ifname);
-        return pcw;
-    }
-    virtual ~pcap_writer(){
-        if(fcap) fclose(fcap);
-    }
-    void writepkt(const struct pcap_pkthdr *h,const u_char *p) {
-        /* Write a packet */
-        write4(h->ts.tv_sec);		// time stamp, seconds avalue
-        write4(h->ts.tv_usec);		// time stamp, microseconds
-        write4(h->caplen);
-        write4(h->len);
-        size_t count = fwrite(p,1,h->caplen,fcap);	// the packet
-        if(count!=h->caplen) throw new write_error();
-    }
-    void refresh_sink(const std::string &fname, const int pcap_dlt) {
-        open(fname);
-        write_header(pcap_dlt);
-    }
-    void update_sink(FILE *sink) {
-        fcap = sink;
-    }
-    FILE* yield_sink() {
-        return fcap;
-    }
+    int  open();                        // -1 with errno set on failure
+    int  close();                       // flush and close; packets can't be written until open()
+    bool is_open() const { return fd>=0; }
+    const std::string &name() const { return fname; }
+
+    void writepkt(const struct pcap_pkthdr *h,const u_char *p,int dlt); // must be open
+    uint64_t dropped() const { return dropped_; }
 };
-    
+
 #endif
@@ -0,0 +1,103 @@
+#ifndef RECON_SET_H
+#define RECON_SET_H
+
+#include <vector>
+#include <cstddef>
+#include <stdint.h>
+
+// The set of byte offsets of a flow that have been reconstructed.
+//
+// Almost every flow is one contiguous run of bytes, so a single interval
+// is kept inline and the vector is only used once there is a gap.
+// The number of bytes covered is kept up to date, so size() is O(1).
+//
+// Intervals are half-open [begin,end) and never overlap or touch.
+
+class recon_set {
+  public:
+  struct interval {
+    interval():begin(0), end(0) {}
+    interval(uint64_t begin_, uint64_t end_):begin(begin_), end(end_) {}
+    uint64_t begin;
+    uint64_t end;
+  };
+
+  recon_set():one(), many(), covered(0) {}
+
+  /* add the bytes [offset,offset+length) */
+  void add(uint64_t offset, uint64_t length) {
+    if (length == 0) return;
+    interval r(offset, offset+length);
+    if (many.empty()) {
+      if (one.begin == one.end) {        // empty
+        one = r;
+        covered = length;
+        return;
+      }
+      if (r.begin <= one.end && r.end >= one.begin) {
+        if (r.begin < one.begin) one.begin = r.begin;
+        if (r.end > one.end) one.end = r.end;
+        covered = one.end - one.begin;
+        return;
+      }
+      many.push_back(one);               // there is a gap now
+    }
+    add_many(r);
+    if (many.size() == 1) {              // the gaps were filled
+      one = many[0];
+      many.clear();
+    }
+  }
+
+  /* move every interval up by n bytes */
+  void shift(uint64_t n) {
+    one.begin += n;
+    one.end += n;
+    for (size_t i = 0; i < many.size(); i++) {
+      many[i].begin += n;
+      many[i].end += n;
+    }
+  }
+
+  uint64_t size() const { return covered; }
+  bool empty() const { return covered == 0; }
+  size_t interval_count() const {
+    if (!many.empty()) return many.size();
+    return one.begin == one.end ? 0 : 1;
+  }
+  interval get_interval(size_t i) const {
+    return many.empty() ? one : many[i];
+  }
+
+  private:
+  void add_many(const interval &r) {
+    /* the first interval that ends at or after r begins */
+    size_t lo = 0, hi = many.size();
+    while (lo < hi) {
+      size_t mid = (lo+hi)/2;
+      if (many[mid].end < r.begin) lo = mid+1; else hi = mid;
+    }
+    /* merge every interval that overlaps or touches r */
+    interval merged = r;
+    size_t j = lo;
+    while (j < many.size() && many[j].begin <= r.end) {
+      if (many[j].begin < merged.begin) merged.begin = many[j].begin;
+      if (many[j].end > merged.end) merged.end = many[j].end;
+      covered -= many[j].end - many[j].begin;
+      j++;
+    }
+    covered += merged.end - merged.begin;
+    if (j == lo) {
+      many.insert(many.begin()+lo, merged);
+    } else {
+      many[lo] = merged;
+      many.erase(many.begin()+lo+1, many.begin()+j);
+    }
+  }
+
+  interval one;                          // the only interval, while many is empty
+  std::vector<interval> many;            // all of the intervals, in order, once there is more than one
+  uint64_t covered;                      // bytes in all of the intervals
+};
+
+#endif // RECON_SET_H
@@ -0,0 +1,197 @@
+/**
+ *
+ * report_writer.cpp
+ * Writes the finished flows' reports on a thread of its own. See report_writer.h
+ *
+ * This source code is under the GNU Public License (GPL).  See
+ * LICENSE for details.
+ *
+ */
+
+#include "tcpflow.h"
+#include "tcpip.h"
+#include "tcpdemux.h"
+#include "report_writer.h"
+#include "flow_db.h"
+#include "flow_arrow.h"
+#include "metrics.h"
+
+#include <sstream>
+
+/* static */ bool        report_writer::background = true;
+/* static */ std::string report_writer::format     = "dfxml";
+/* static */ uint32_t    report_writer::queue_max  = 4096;
+
+enum { JSONL_BUFFER = 1024*1024 };
+
+/* static */ std::string report_writer::jsonl_name(const std::string &reportfilename)
+{
+    size_t len = reportfilename.size();
+    if(len>4 && reportfilename.substr(len-4)==".xml") return reportfilename.substr(0,len-4) + ".jsonl";
+    return reportfilename + ".jsonl";
+}
+
+report_writer::report_writer(dfxml_writer *xreport_,const std::string &jsonl_path,const std::string &db_path,
+                             const std::string &arrow_path):
+    xreport(xreport_),jsonl(0),db(0),arrow(0),M(),work_ready(),space_ready(),queue(),expiries(),stopping(false),
+    written(0),batches(0),waited(0),writer()
+{
+    if(queue_max<1) queue_max = 1;
+    if(jsonl_path.size()>0){
+        jsonl = fopen(jsonl_path.c_str(),"w");
+        if(jsonl==0){
+            perror(jsonl_path.c_str());
+            exit(1);
+        }
+        setvbuf(jsonl,0,_IOFBF,JSONL_BUFFER);
+    }
+    if(db_path.size()>0) db = new flow_db(db_path);
+    if(arrow_path.size()>0) arrow = new flow_arrow(arrow_path);
+    writer = std::thread(&report_writer::run,this);
+    metrics::add_gauge("report_queue",[this]{
+        std::lock_guard<std::mutex> lock(M);
+        return (uint64_t)queue.size();
+    });
+}
+
+report_writer::~report_writer()
+{
+    metrics::remove_gauge("report_queue");
+    {
+        std::lock_guard<std::mutex> lock(M);
+        stopping = true;
+    }
+    work_ready.notify_one();
+    writer.join();
+    if(jsonl) fclose(jsonl);
+    delete db;                          // commits
+    delete arrow;                       // the last batch
+    DEBUG(2)("report writer: %" PRIu64 " flows in %" PRIu64 " batches, waited %" PRIu64 " times for room",
+             written,batches,waited);
+}
+
+void report_writer::submit(const flow_report &r,const std::string &xmladd)
+{
+    record *rec = new record(r,xmladd);
+    std::unique_lock<std::mutex> lock(M);
+    if(queue.size()>=queue_max){
+        waited++;
+        while(queue.size()>=queue_max) space_ready.wait(lock);
+    }
+    bool was_empty = queue.empty();
+    queue.push_back(rec);
+    lock.unlock();
+    if(was_empty) work_ready.notify_one();
+}
+
+void report_writer::expire(const expiry &e)
+{
+    std::unique_lock<std::mutex> lock(M);
+    bool was_empty = queue.empty() && expiries.empty();
+    expiries.push_back(e);
+    lock.unlock();
+    if(was_empty) work_ready.notify_one();
+}
+
+/* static */ void report_writer::dump_expired_xml(dfxml_writer *xreport,const expiry &e)
+{
+    std::stringstream attrs;
+    attrs << "filename='" << dfxml_writer::xmlescape(e.path) << "' time='" << dfxml_writer::to8601(e.when)
+          << "' bytes='" << e.bytes << "'";
+    xreport->xmlout("expired","",attrs.str(),false);
+}
+
+/* static */ void report_writer::dump_expired_json(std::string &out,const expiry &e)
+{
+    std::stringstream ss;
+    ss << "{\"expired\":" << json_quote(e.path) << ",\"time\":\"" << dfxml_writer::to8601(e.when)
+       << "\",\"bytes\":" << e.bytes << "}\n";
+    out += ss.str();
+}
+
+void report_writer::run()
+{
+    std::deque<record *> batch;
+    std::deque<expiry> expired;
+    while(true){
+        {
+            std::unique_lock<std::mutex> lock(M);
+            while(queue.empty() && expiries.empty() && !stopping){
+                if(db && db->pending()){
+                    work_ready.wait_for(lock,std::chrono::milliseconds(flow_db::batch_ms));
+                    break;              // commit what is waiting, even if nothing came
+                }
+                work_ready.wait(lock);
+            }
+            if(queue.empty() && expiries.empty() && stopping) break; // and nothing is left
+            batch.swap(queue);
+            expired.swap(expiries);
+        }
+        space_ready.notify_all();
+        write_batch(batch);
+        write_expiries(expired);
+        if(db && db->commit_due()) db->commit();
+    }
+}
+
+void report_writer::write_batch(std::deque<record *> &batch)
+{
+    if(batch.empty()) return;
+    if(jsonl){
+        std::string line;
+        for(std::deque<record *>::const_iterator it=batch.begin();it!=batch.end();it++){
+            line.clear();
+            (*it)->report.dump_json(line,(*it)->xmladd);
+            fwrite(line.data(),1,line.size(),jsonl);
+        }
+        fflush(jsonl);
+    } else if(xreport){
+        std::lock_guard<std::mutex> lock(tcpdemux::output_M);
+        for(std::deque<record *>::const_iterator it=batch.begin();it!=batch.end();it++){
+            (*it)->report.dump_xml(xreport,(*it)->xmladd,false);
+        }
+        xreport->flush();
+    }
+    if(db){
+        for(std::deque<record *>::const_iterator it=batch.begin();it!=batch.end();it++){
+            db->insert((*it)->report);
+            if(db->commit_due()) db->commit();
+        }
+    }
+    if(arrow){
+        for(std::deque<record *>::const_iterator it=batch.begin();it!=batch.end();it++){
+            arrow->append((*it)->report);
+        }
+    }
+    written += batch.size();
+    batches++;
+    for(std::deque<record *>::iterator it=batch.begin();it!=batch.end();it++) delete *it;
+    batch.clear();
+}
+
+void report_writer::write_expiries(std::deque<expiry> &batch)
+{
+    if(batch.empty()) return;
+    if(jsonl){
+        std::string line;
+        for(std::deque<expiry>::const_iterator it=batch.begin();it!=batch.end();it++){
+            line.clear();
+            dump_expired_json(line,*it);
+            fwrite(line.data(),1,line.size(),jsonl);
+        }
+        fflush(jsonl);
+    } else if(xreport){
+        std::lock_guard<std::mutex> lock(tcpdemux::output_M);
+        for(std::deque<expiry>::const_iterator it=batch.begin();it!=batch.end();it++){
+            dump_expired_xml(xreport,*it);
+        }
+        xreport->flush();
+    }
+    if(db){
+        for(std::deque<expiry>::const_iterator it=batch.begin();it!=batch.end();it++){
+            db->expire(it->path,it->when);
+            if(db->commit_due()) db->commit();
+        }
+    }
+    batch.clear();
+}
@@ -0,0 +1,100 @@
+#ifndef REPORT_WRITER_H
+#define REPORT_WRITER_H
+
+/**
+ * report_writer.h
+ *
+ * Writes the <fileobject> of each finished flow to the DFXML report on
+ * a thread of its own, with -S report_thread=1 (the default).
+ *
+ * tcpdemux::report() gives it a copy of the flow_report and what the
+ * scanners added, and returns; the thread takes everything that is
+ * queued at once, writes it under tcpdemux::output_M and flushes the
+ * report once for the lot, rather than once for every flow. Up to
+ * -S report_queue flows wait for it; after that the flow is held until
+ * there is room, since the report has to have every flow.
+ *
+ * With -S report_format=jsonl the flows go instead to a file next to
+ * the report, named like it with .jsonl for .xml, one JSON object per
+ * line, and the DFXML report has only the run's configuration and
+ * summary. That file is always written by the thread.
+ *
+ * With -S flow_db the thread also inserts each flow into the database;
+ * see flow_db.h. With -S flow_arrow it adds it to the Arrow columns; see
+ * flow_arrow.h. Neither these nor jsonl can be had with -S report_thread=0.
+ *
+ * With -S ring_bytes, disk_ring gives it the flows whose files it removed
+ * with expire(); each is written after the records already queued, so it
+ * comes after the flow's own. See disk_ring.h.
+ *
+ * Include after tcpip.h.
+ *
+ * This source code is under the GNU Public License (GPL).  See
+ * LICENSE for details.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+class report_writer {
+public:
+    static bool        background;      // -S report_thread
+    static std::string format;          // -S report_format: dfxml or jsonl
+    static uint32_t    queue_max;       // -S report_queue
+
+    static std::string jsonl_name(const std::string &reportfilename);
+
+    /* xreport may be 0 with jsonl; jsonl_path is "" with dfxml, db_path and arrow_path "" without them */
+    report_writer(class dfxml_writer *xreport_,const std::string &jsonl_path,const std::string &db_path,
+                  const std::string &arrow_path);
+    virtual ~report_writer();           // writes what is queued
+
+    void submit(const flow_report &r,const std::string &xmladd);
+
+    /* A flow whose files -S ring_bytes removed */
+    struct expiry {
+        expiry():path(),bytes(0),when(){}
+        std::string    path;            // the transcript, as the flow was reported
+        uint64_t       bytes;           // all of its files
+        struct timeval when;
+    };
+    void expire(const expiry &e);
+    static void dump_expired_xml(class dfxml_writer *xreport,const expiry &e); // <expired>
+    static void dump_expired_json(std::string &out,const expiry &e);
+
+private:
+    report_writer(const report_writer &);
+    report_writer &operator=(const report_writer &);
+
+    struct record {
+        record(const flow_report &r,const std::string &x):report(r),xmladd(x){}
+        flow_report report;
+        std::string xmladd;
+    };
+
+    class dfxml_writer       *xreport;
+    FILE                     *jsonl;    // 0 with dfxml
+    class flow_db            *db;       // 0 without -S flow_db
+    class flow_arrow         *arrow;    // 0 without -S flow_arrow
+    std::mutex               M;         // protects queue and stopping
+    std::condition_variable  work_ready;
+    std::condition_variable  space_ready;
+    std::deque<record *>     queue;
+    std::deque<expiry>       expiries;  // after the records in queue
+    bool                     stopping;
+    uint64_t                 written;
+    uint64_t                 batches;
+    uint64_t                 waited;    // times submit() waited for room
+    std::thread              writer;
+
+    void run();                         // thread body
+    void write_batch(std::deque<record *> &batch);
+    void write_expiries(std::deque<expiry> &batch);
+};
+
+#endif
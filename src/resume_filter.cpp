@@ -0,0 +1,106 @@
+/**
+ *
+ * resume_filter.cpp
+ * Only the packets of the open flows, for the -R files. See resume_filter.h
+ *
+ * This source code is under the GNU Public License (GPL).  See
+ * LICENSE for details.
+ *
+ */
+
+#include "tcpflow.h"
+#include "tcpip.h"
+#include "tcpdemux.h"
+#include "tcpdemux_pool.h"
+#include "ip_reassembly.h"
+#include "resume_filter.h"
+
+#include <sstream>
+#include <unordered_set>
+
+/* static */ bool     resume_filter::enabled = true;
+/* static */ uint32_t resume_filter::bpf_max = 256;
+/* static */ bool     resume_filter::active  = false;
+/* static */ bool     resume_filter::resuming = false;
+
+static std::unordered_set<uint64_t> hashes; // of the open connections, and of their addresses alone
+static std::vector<flow_addr> keys;         // the open connections
+static std::string base_expression;         // from the command line
+
+/* static */ bool resume_filter::start(const tcpdemux &demux,const std::string &expression)
+{
+    keys.clear();
+    demux.open_flow_keys(keys);
+    base_expression = expression;
+    if(keys.empty()) return false;
+
+    hashes.clear();
+    hashes.reserve(keys.size()*2);
+    for(std::vector<flow_addr>::const_iterator it=keys.begin();it!=keys.end();it++){
+        flow_addr addrs(it->src,it->dst,0,0,it->family); // what a fragment without its ports hashes as
+        hashes.insert(tcpdemux_pool::shard_hash(*it));
+        hashes.insert(tcpdemux_pool::shard_hash(addrs));
+    }
+    DEBUG(1) ("-R: %zu open connections", keys.size());
+    resuming = true;
+    return true;
+}
+
+/* static */ std::string resume_filter::filter(int dlt)
+{
+    active = true;
+    if(keys.size() > bpf_max){
+        DEBUG(1) ("-R: filtered by the hashes of the open connections");
+        return base_expression;
+    }
+
+    std::stringstream flows;
+    for(std::vector<flow_addr>::const_iterator it=keys.begin();it!=keys.end();it++){
+        const char *ip = it->family==AF_INET6 ? "ip6" : "ip";
+        if(it!=keys.begin()) flows << " or ";
+        flows << "(" << ip << " host " << ipaddr_prn(it->src,it->family)
+              << " and " << ip << " host " << ipaddr_prn(it->dst,it->family)
+              << " and tcp port " << it->sport << " and tcp port " << it->dport << ")";
+    }
+    if(ip_reassembler::enabled){
+        flows << " or (ip and ip[6:2] & 0x3fff != 0) or (ip6 and ip6[6] = 44)"; // fragments, put together later
+    }
+    std::stringstream ss;
+    if(base_expression.size()>0) ss << "(" << base_expression << ") and ";
+    if(dlt==DLT_EN10MB){
+        /* the same again past a VLAN tag; "vlan" moves the offsets of what follows it,
+         * and is only for Ethernet
+         */
+        ss << "((" << flows.str() << ") or (vlan and (" << flows.str() << ")))";
+    } else {
+        ss << "(" << flows.str() << ")";
+    }
+    std::string expression = ss.str();
+
+    /* a link type the expression cannot be compiled for still has the set */
+    pcap_t *dead = pcap_open_dead(dlt,SNAPLEN);
+    struct bpf_program fcode;
+    bool compiled = pcap_compile(dead,&fcode,expression.c_str(),1,0) == 0;
+    if(compiled) pcap_freecode(&fcode);
+    else DEBUG(1) ("-R: link type %d: %s; filtered by the hashes of the open connections",dlt,pcap_geterr(dead));
+    pcap_close(dead);
+    if(!compiled) return base_expression;
+
+    active = false;
+    DEBUG(1) ("-R: filtered with BPF");
+    DEBUG(20) ("-R filter expression: '%s'", expression.c_str());
+    return expression;
+}
+
+/* static */ void resume_filter::stop()
+{
+    active = false;
+    resuming = false;
+    std::unordered_set<uint64_t>().swap(hashes);
+    std::vector<flow_addr>().swap(keys);
+}
+
+/* static */ bool resume_filter::in_set(const be13::packet_info &pi)
+{
+    return hashes.count(tcpdemux_pool::shard_hash(pi))>0;
+}
@@ -0,0 +1,69 @@
+/*
+ * resume_filter.h:
+ *
+ * Only the packets of the open flows, for the -R files.
+ *
+ * The -R files only finish the flows that are still open after the -r
+ * files; their other packets are read, decoded and looked up only to be
+ * thrown away. Before they are read, the keys of the open connections
+ * become a filter:
+ *
+ *   - up to -S resume_bpf_max connections (default 256) are a BPF
+ *     expression, (ip host A and ip host B and tcp port P and tcp port Q)
+ *     or ... (and on Ethernet the same behind a VLAN tag), added to the
+ *     one given on the command line, so that libpcap or the mapped reader
+ *     drops everything else before it is decoded; unless -S ip_defrag=0
+ *     the fragments get through as well. The expression is made for each
+ *     file's link type.
+ *   - more than that would take too long to compile and run, so the
+ *     connections go into a set of their direction-independent hashes
+ *     (the ones --threads shards by, and the same hash without the ports,
+ *     for fragments), and the tcpdemux packet handler drops the packets
+ *     that are not in it before they reach the demultiplexer or its pool;
+ *     so does a file whose link type the expression does not compile for
+ *
+ * Both let through a little more than they must (another connection
+ * between the same hosts on the same ports, a hash that collides); the
+ * demultiplexer drops those as before. With no open connections the -R
+ * files are not read at all. -S resume_filter=0 reads them as they are.
+ *
+ * This source code is under the GNU Public License (GPL).  See
+ * LICENSE for details.
+ */
+
+#ifndef RESUME_FILTER_H
+#define RESUME_FILTER_H
+
+#include "tcpflow.h"
+
+#include <stdint.h>
+#include <string>
+
+class tcpdemux;
+
+class resume_filter {
+public:
+    static bool     enabled;            // -S resume_filter
+    static uint32_t bpf_max;            // -S resume_bpf_max
+
+    /* Note the connections open in demux (and its workers), to read the -R
+     * files with expression. Returns false if there are none, and the files
+     * need not be read.
+     */
+    static bool start(const tcpdemux &demux,const std::string &expression);
+    static void stop();
+    static bool started() { return resuming; }
+    /* The expression to read a -R file with, for its link type dlt */
+    static std::string filter(int dlt);
+    /* true unless the set is in use and the packet is not in it */
+    static bool wanted(const be13::packet_info &pi) {
+        return !active || in_set(pi);
+    }
+
+private:
+    static bool active;                 // the set is in use
+    static bool resuming;               // between start() and stop()
+    static bool in_set(const be13::packet_info &pi);
+};
+
+#endif
@@ -14,32 +14,25 @@
 #include "http-parser/http_parser.h"
 
 #include "mime_map.h"
+#include "http_stream.h"
+#include "body_decoder.h"
+#include "stream_scan.h"
+#include "flow_hash.h"
+#include "alert_channel.h"
+#include "body_store.h"
 
 #ifdef HAVE_SYS_WAIT_H
 #include <sys/wait.h>
 #endif
 
 
-#ifdef HAVE_LIBZ
-#  define ZLIB_CONST
-#  ifdef GNUC_HAS_DIAGNOSTIC_PRAGMA
-#    pragma GCC diagnostic ignored "-Wundef"
-#    pragma GCC diagnostic ignored "-Wcast-qual"
-#  endif
-#  ifdef HAVE_ZLIB_H
-#    include <zlib.h>
-#  endif
-#else
-#  define z_stream void *               // prevents z_stream from generating an error
-#endif
-
 #define MIN_HTTP_BUFSIZE 80             // don't bother parsing smaller than this
 
 #include <sys/types.h>
 #include <iostream>
 #include <algorithm>
-#include <map>
 #include <iomanip>
+#include <mutex>
 
 #define HTTP_CMD "http_cmd"
 #define HTTP_ALERT_FD "http_alert_fd"
@@ -49,58 +42,122 @@ std::string http_cmd;                   // command to run on each http object
 int http_subproc_max = 10;              // how many subprocesses are we allowed?
 int http_subproc = 0;                   // how many do we currently have?
 int http_alert_fd = -1;                 // where should we send alerts?
+static std::mutex http_M;               // protects http_subproc; with http_stream, bodies are written on the packet threads
 
+/* Tell http_alert_fd about a body file */
+static void http_alert(const char *what,const std::string &path,uint64_t bytes)
+{
+    alert_channel::event e;
+    e.what  = what;
+    e.kind  = "http";
+    e.path  = path;
+    e.bytes = bytes;
+    alert_channel::post(http_alert_fd,e);
+}
+
+/*
+ * Part of a header, left where the parser found it in the buffer while
+ * the callbacks for it are contiguous; copied when they are not, or when
+ * the buffer is about to go away (see http_stream::feed()).
+ */
+class header_text {
+    const char  *p;
+    size_t      len;
+    bool        owned;                  // the text is in copy, not at p
+    std::string copy;
+public:
+    header_text():p(0),len(0),owned(false),copy(){}
+    header_text(const header_text &t):p(t.p),len(t.len),owned(t.owned),copy(t.copy){}
+    header_text &operator=(const header_text &t) {
+        p = t.p; len = t.len; owned = t.owned; copy = t.copy;
+        return *this;
+    }
+    void clear() { p = 0; len = 0; owned = false; copy.clear(); }
+    void append(const char *at,size_t length) {
+        if(!owned && (len==0 || p+len==at)){
+            if(len==0) p = at;
+            len += length;
+            return;
+        }
+        keep();
+        copy.append(at,length);
+    }
+    void keep() {
+        if(owned) return;
+        copy.assign(p,len);
+        owned = true;
+    }
+    const char *data() const { return owned ? copy.data() : p; }
+    size_t size() const { return owned ? copy.size() : len; }
+    std::string str() const { return std::string(data(),size()); }
+};
 
 /* define a callback object for sharing state between scan_http() and its callbacks
  */
-class scan_http_cbo {
+class scan_http_cbo : public body_decoder::sink {
 private:
     typedef enum {NOTHING,FIELD,VALUE} last_on_header_t;
+    /* the headers that are used; the others are not kept */
+    typedef enum {HEADER_OTHER,HEADER_CONTENT_TYPE,HEADER_CONTENT_ENCODING} header_t;
     scan_http_cbo(const scan_http_cbo& c); // not implemented
     scan_http_cbo &operator=(const scan_http_cbo &c); // not implemented
 
 public:
     virtual ~scan_http_cbo(){
         on_message_complete();          // make sure message was ended
+        delete body_hash;
+        delete store;
     }
     scan_http_cbo(const std::string& path_,const char *base_,std::stringstream *xmlstream_) :
-        path(path_), base(base_),xmlstream(xmlstream_),xml_fo(),request_no(0),
-        headers(), last_on_header(NOTHING), header_value(), header_field(),
-        output_path(), fd(-1), first_body(true),bytes_written(0),unzip(false),zs(),zinit(false),zfail(false){};
+        path(path_), base(base_),base_offset(0),xmlstream(xmlstream_),xml_fo(),request_no(0),
+        last_on_header(NOTHING), header(HEADER_OTHER), header_value(), header_field(),
+        content_type(), content_encoding(),
+        output_path(), fd(-1), root(0), to_segments(false), extents(), first_body(true),bytes_written(0),decoder(0),body_hash(0),store(0){};
 private:        
         
     const std::string path;             // where data gets written
     const char *base;                   // where data started in memory
+    uint64_t base_offset;               // and where that is in the flow
     std::stringstream *xmlstream;       // if present, where to put the fileobject annotations
     std::stringstream xml_fo;           // xml stream for this file object
     int request_no;                     // request number
         
-    /* parsed headers */
-    std::map<std::string, std::string> headers;
-        
     /* placeholders for possibly-incomplete header data */
     last_on_header_t last_on_header;
-    std::string header_value, header_field;
+    header_t    header;                 // what header_field turned out to be
+    header_text header_value, header_field;
+
+    /* parsed headers */
+    header_text content_type, content_encoding;
     std::string output_path;
     int         fd;                         // fd for writing
+    uint16_t    root;                       // the output root it is on, as the flow is; see output_roots.h
+    bool        to_segments;                // --segments: the body goes into extents rather than fd
+    segment_extents extents;
     bool        first_body;                 // first call to on_body after headers
     uint64_t    bytes_written;
 
-    /* decompression for gzip-encoded streams. */
-    bool     unzip;           // should we be decompressing?
-    z_stream zs;              // zstream (avoids casting and memory allocation)
-    bool     zinit;           // we have initialized the zstream 
-    bool     zfail;           // zstream failed in some manner, so ignore the rest of this stream
+    /* decompression for bodies with a Content-Encoding */
+    body_decoder *decoder;    // 0 if the body is written as it is
+
+    /* with -e md5, the digests of the body as it is written; kept for the next one */
+    flow_hash::context *body_hash;
+
+    /* with -S dedup_dir, where the body goes instead of fd; see body_store.h */
+    body_store::writer *store;
 
     /* The static functions are callbacks; they wrap the method calls */
 #define CBO (reinterpret_cast<scan_http_cbo*>(parser->data))
 public:
+    void set_base(const char *base_,uint64_t offset) { base = base_; base_offset = offset; } // for http_stream
+    void keep_headers();                // copy what is still in the buffer given to set_base()
+    static void init_settings(http_parser_settings &settings);
     static int scan_http_cb_on_message_begin(http_parser * parser) { return CBO->on_message_begin();}
     static int scan_http_cb_on_url(http_parser * parser, const char *at, size_t length) { return 0;}
     static int scan_http_cb_on_header_field(http_parser * parser, const char *at, size_t length) { return CBO->on_header_field(at,length);}
     static int scan_http_cb_on_header_value(http_parser * parser, const char *at, size_t length) { return CBO->on_header_value(at,length); }
-    static int scan_http_cb_on_headers_complete(http_parser * parser) { return CBO->on_headers_complete();}
-    static int scan_http_cb_on_body(http_parser * parser, const char *at, size_t length) { return CBO->on_body(at,length);}
+    static int scan_http_cb_on_headers_complete(http_parser * parser) { return CBO->on_headers_complete(parser);}
+    static int scan_http_cb_on_body(http_parser * parser, const char *at, size_t length) { return CBO->on_body(parser,at,length);}
     static int scan_http_cb_on_message_complete(http_parser * parser) {return CBO->on_message_complete();}
 #undef CBO
 private:
@@ -108,9 +165,13 @@ private:
     int on_url(const char *at, size_t length);
     int on_header_field(const char *at, size_t length);
     int on_header_value(const char *at, size_t length);
-    int on_headers_complete();
-    int on_body(const char *at, size_t length);
+    int on_headers_complete(const http_parser *parser);
+    int on_body(const http_parser *parser,const char *at, size_t length);
     int on_message_complete();          
+    void write_body(const void *data,size_t length);
+    virtual void put(const uint8_t *data,size_t length) { write_body(data,length); } // from decoder
+    static header_t which_header(const char *name,size_t length);
+    void end_header();
 };
     
 
@@ -136,31 +197,56 @@ int scan_http_cbo::on_url(const char *at, size_t length)
 
 
 /* Note 1: The state machine is defined in http-parser/README.md
- * Note 2: All header field names are converted to lowercase.
+ * Note 2: Header field names are compared without regard to case.
  *         This is consistent with the RFC.
  */
 
+/* static */ scan_http_cbo::header_t scan_http_cbo::which_header(const char *name,size_t length)
+{
+    switch(length){
+    case 12:
+        if(strncasecmp(name,"content-type",12)==0) return HEADER_CONTENT_TYPE;
+        break;
+    case 16:
+        if(strncasecmp(name,"content-encoding",16)==0) return HEADER_CONTENT_ENCODING;
+        break;
+    }
+    return HEADER_OTHER;
+}
+
+/* The value of the header is complete; keep it if it is one that is used */
+void scan_http_cbo::end_header()
+{
+    switch(header){
+    case HEADER_CONTENT_TYPE:     content_type     = header_value; break;
+    case HEADER_CONTENT_ENCODING: content_encoding = header_value; break;
+    case HEADER_OTHER: break;
+    }
+    header = HEADER_OTHER;
+}
+
+void scan_http_cbo::keep_headers()
+{
+    header_field.keep();
+    header_value.keep();
+    content_type.keep();
+    content_encoding.keep();
+}
+
 int scan_http_cbo::on_header_field(const char *at,size_t length)
 {
-    std::string field(at,length);
-    std::transform(field.begin(), field.end(), field.begin(), ::tolower);
-    
     switch(last_on_header){
-    case NOTHING:                       
-        // Allocate new buffer and copy callback data into it
-        header_field = field;
-        break;
     case VALUE:
         // New header started.
-        // Copy current name,value buffers to headers
-        // list and allocate new buffer for new name
-        headers[header_field] = header_value;
-        header_field = field;
+        end_header();
+        /* FALLTHROUGH */
+    case NOTHING:                       
+        header_field.clear();
+        header_field.append(at,length);
         break;
     case FIELD:
-        // Previous name continues. Reallocate name
-        // buffer and append callback data to it
-        header_field.append(field);
+        // Previous name continues.
+        header_field.append(at,length);
         break;
     }
     last_on_header = FIELD;
@@ -169,17 +255,16 @@ int scan_http_cbo::on_header_field(const char *at,size_t length)
 
 int scan_http_cbo::on_header_value(const char *at, size_t length)
 {
-    const std::string value(at,length);
     switch(last_on_header){
     case FIELD:
-        //Value for current header started. Allocate
-        //new buffer and copy callback data to it
-        header_value = value;
+        //Value for current header started.
+        header = which_header(header_field.data(),header_field.size());
+        header_value.clear();
+        if(header!=HEADER_OTHER) header_value.append(at,length);
         break;
     case VALUE:
-        //Value continues. Reallocate value buffer
-        //and append callback data to it
-        header_value.append(value);
+        //Value continues.
+        if(header!=HEADER_OTHER) header_value.append(at,length);
         break;
     case NOTHING:
         // this shouldn't happen
@@ -197,14 +282,14 @@ int scan_http_cbo::on_header_value(const char *at, size_t length)
  * Also see if decompressing is happening...
  */
 
-int scan_http_cbo::on_headers_complete()
+int scan_http_cbo::on_headers_complete(const http_parser *parser)
 {
     tcpdemux *demux = tcpdemux::getInstance();
 
-    /* Add the most recently read header to the map, if any */
+    /* Keep the most recently read header, if it is used */
     if (last_on_header==VALUE) {
-        headers[header_field] = header_value;
-        header_field="";
+        end_header();
+        header_field.clear();
     }
         
     /* Set output path to <path>-HTTPBODY-nnn.ext for each part.
@@ -216,7 +301,7 @@ int scan_http_cbo::on_headers_complete()
     os << path << "-HTTPBODY-" << std::setw(3) << std::setfill('0') << request_no << std::setw(0);
 
     /* See if we can guess a file extension */
-    std::string extension = get_extension_for_mime_type(headers["content-type"]);
+    std::string extension = get_extension_for_mime_type(content_type.str());
     if (extension.size()) {
         os << "." << extension;
     }
@@ -224,34 +309,44 @@ int scan_http_cbo::on_headers_complete()
     output_path = os.str();
         
     /* Choose an output function based on the content encoding */
-    std::string content_encoding(headers["content-encoding"]);
-
-    if ((content_encoding == "gzip" || content_encoding == "deflate") && (demux->opt.gzip_decompress)){
-#ifdef HAVE_LIBZ
-        DEBUG(10) ( "%s: detected zlib content, decompressing", output_path.c_str());
-        unzip = true;
-#else
-        /* We can't decompress, so just give it a .gz */
-        output_path.append(".gz");
-        DEBUG(5) ( "%s: refusing to decompress since zlib is unavailable", output_path.c_str() );
-#endif
+    body_decoder::encoding_t encoding = body_decoder::encoding_for(content_encoding.str());
+
+    if (encoding!=body_decoder::IDENTITY && encoding!=body_decoder::UNKNOWN && demux->opt.gzip_decompress){
+        decoder = body_decoder::make(encoding,*this);
+        if (decoder) {
+            DEBUG(10) ( "%s: detected %s content, decompressing", output_path.c_str(), content_encoding.str().c_str());
+        } else {
+            /* We can't decompress, so just give it a .gz (or .br or .zst) */
+            output_path.append(body_decoder::suffix(encoding));
+            DEBUG(5) ( "%s: refusing to decompress since %s is unavailable", output_path.c_str(), content_encoding.str().c_str() );
+        }
     } 
         
-    /* Open the output path */
-    fd = demux->retrying_open(output_path.c_str(), O_WRONLY|O_CREAT|O_BINARY|O_TRUNC, 0644);
-    if (fd < 0) {
-        DEBUG(1) ("unable to open HTTP body file %s", output_path.c_str());
+    /* Open the output path; with --segments there is no file, and the name is only indexed */
+    to_segments = demux->opt.output_segments;
+    if (to_segments) {
+        fd = demux->segment_output()->current_fd();
+    } else if (body_store::active()) {
+        /* the length, if the bytes written are the ones the header counts */
+        bool counted = decoder==0 && !(parser->flags & F_CHUNKED) && parser->content_length!=(uint64_t)-1;
+        store = new body_store::writer(output_path, counted ? parser->content_length : 0);
+    } else {
+        fd = demux->retrying_open(output_path.c_str(), O_WRONLY|O_CREAT|O_BINARY|O_TRUNC, 0644);
+        root = demux->roots.find(output_path);
     }
-    if(http_alert_fd>=0){
-        std::stringstream ss;
-        ss << "open\t" << output_path << "\n";
-        const std::string &sso = ss.str();
-        if(write(http_alert_fd,sso.c_str(),sso.size())!=(int)sso.size()){
-            perror("write");
-        }
+    if (fd < 0 && store == 0) {
+        DEBUG(1) ("unable to open HTTP body file %s", output_path.c_str());
     }
+    if(http_alert_fd>=0) http_alert("open",output_path,0);
 
     first_body = true;                  // next call to on_body will be the first one
+    if(flow_hash::enabled){
+        if(body_hash==0){
+            body_hash = new flow_hash::context(flow_hash::algs);
+        } else {
+            body_hash->reset();
+        }
+    }
         
     /* We can do something smart with the headers here.
      *
@@ -263,93 +358,46 @@ int scan_http_cbo::on_headers_complete()
     return 0;
 }
 
+void scan_http_cbo::write_body(const void *data,size_t length)
+{
+    tcpdemux *demux = tcpdemux::getInstance();
+    if (store) {
+        store->write(static_cast<const uint8_t *>(data), length);
+    } else if (to_segments) {
+        demux->segment_output()->append(extents, bytes_written, data, length);
+    } else {
+        demux->write_file(fd, data, length, bytes_written, root);
+    }
+    bytes_written += length;
+    if(body_hash) body_hash->update(static_cast<const uint8_t *>(data),length);
+}
+
 /* Write to fd, optionally decompressing as we go */
-int scan_http_cbo::on_body(const char *at,size_t length)
+int scan_http_cbo::on_body(const http_parser *parser,const char *at,size_t length)
 {
-    if (fd < 0)    return -1;              // no open fd? (internal error)x
+    if (fd < 0 && store == 0) return -1;   // no open fd? (internal error)x
     if (length==0) return 0;               // nothing to write
 
+    /* with a Content-Length, the first call that leaves none to come has the whole body */
+    bool whole = first_body && parser->content_length==0 && !(parser->flags & F_CHUNKED);
     if(first_body){                      // stuff for first time on_body is called
-        xml_fo << "     <byte_run file_offset='" << (at-base) << "'><fileobject><filename>" << output_path << "</filename>";
+        xml_fo << "     <byte_run file_offset='" << (at-base)+base_offset << "'><fileobject>";
+        if (store == 0) xml_fo << "<filename>" << output_path << "</filename>"; // a stored body's is known at the end
         first_body = false;
     }
 
     /* If not decompressing, just write the data and return. */
-    if(unzip==false){
-        size_t offset = 0;
-        while (offset < length) {
-                int rv = write(fd, at + offset, length - offset);
-                if (rv < 0) return -1;  // write error; that's bad
-                offset += rv;
-        }
-        bytes_written += offset;
+    if(decoder==0){
+        write_body(at, length);
         return 0;
     }
 
-#ifndef HAVE_LIBZ
-    assert(0);                          // shoudln't have gotten here
-#endif    
-    if(zfail) return 0;                 // stream was corrupt; ignore rest
-    /* set up this round of decompression, using a small local buffer */
-
-    /* Call init if we are not initialized */
-    char decompressed[65536];           // where decompressed data goes
-    if (!zinit) {
-        memset(&zs,0,sizeof(zs));
-        zs.next_in = (Bytef*)at;
-        zs.avail_in = length;
-        zs.next_out = (Bytef*)decompressed;
-        zs.avail_out = sizeof(decompressed);
-        
-        int rv = inflateInit2(&zs, 32 + MAX_WBITS);      /* 32 auto-detects gzip or deflate */
-        if (rv != Z_OK) {
-            /* fail! */
-            DEBUG(3) ("decompression failed at stream initialization; rv=%d bad Content-Encoding?",rv);
-            zfail = true;
-            return 0;
-        }
-        zinit = true;                   // successfully initted
+    /* a corrupt body is given up on quietly, and the rest of it ignored */
+    const uint8_t *data = reinterpret_cast<const uint8_t *>(at);
+    if(whole){
+        decoder->decode_all(data, length);
     } else {
-        zs.next_in = (Bytef*)at;
-        zs.avail_in = length;
-        zs.next_out = (Bytef*)decompressed;
-        zs.avail_out = sizeof(decompressed);
-    }
-        
-    /* iteratively decompress, writing each time */
-    while (zs.avail_in > 0) {
-        /* decompress as much as possible */
-        int rv = inflate(&zs, Z_SYNC_FLUSH);
-                
-        if (rv == Z_STREAM_END) {
-            /* are we done with the stream? */
-            if (zs.avail_in > 0) {
-                /* ...no. */
-                DEBUG(3) ("decompression completed, but with trailing garbage");
-                return 0;
-            }
-        } else if (rv != Z_OK) {
-            /* some other error */
-            DEBUG(3) ("decompression failed (corrupted stream?)");
-            zfail = true;               // ignore the rest of this stream
-            return 0;
-        }
-                
-        /* successful decompression, at least partly */
-        /* write the result */
-        int bytes_decompressed = sizeof(decompressed) - zs.avail_out;
-        ssize_t written = write(fd, decompressed, bytes_decompressed);
-
-        if (written < bytes_decompressed) {
-            DEBUG(3) ("writing decompressed data failed");
-            zfail= true;
-            return 0;
-        }
-        bytes_written += written;
-                
-        /* reset the buffer for the next iteration */
-        zs.next_out = (Bytef*)decompressed;
-        zs.avail_out = sizeof(decompressed);
+        decoder->decode(data, length);
     }
     return 0;
 }
@@ -362,12 +410,38 @@ int scan_http_cbo::on_body(const char *at,size_t length)
 
 int scan_http_cbo::on_message_complete()
 {
+    if(decoder){                        // what it holds goes in the file before it is closed
+        decoder->flush();
+        delete decoder;
+        decoder = 0;
+    }
+
+    /* A stored body becomes its object, and output_path a link to it */
+    std::string body_path = output_path;
+    std::string dedup_xml,sha256;
+    if(store){
+        if(bytes_written>0) dedup_xml = store->finish(body_path,sha256);
+        delete store;
+        store = 0;
+    }
+
     /* Close the file */
-    headers.clear();
-    header_field = "";
-    header_value = "";
+    content_type.clear();
+    content_encoding.clear();
+    header_field.clear();
+    header_value.clear();
+    header = HEADER_OTHER;
     last_on_header = NOTHING;
+    if(to_segments) {
+        fd = -1;                        // belongs to the segment_store
+        if(extents.size()>0) {
+            struct timeval none = {0,0};    // bodies are indexed without a session or times
+            tcpdemux::getInstance()->segment_output()->commit(output_path, 0, none, none, extents);
+        }
+        extents.clear();
+    }
     if(fd >= 0) {
+        tcpdemux::getInstance()->sync_file(fd, root);
         if (::close(fd) != 0) {
             perror("close() of http body");
         }
@@ -378,20 +452,24 @@ int scan_http_cbo::on_message_complete()
     if(bytes_written>0){
         /* Update DFXML */
         if(xmlstream){
-            xml_fo << "<filesize>" << bytes_written << "</filesize></fileobject></byte_run>\n";
-            if(xmlstream) *xmlstream << xml_fo.str();
-        }
-        if(http_alert_fd>=0){
-            std::stringstream ss;
-            ss << "close\t" << output_path << "\n";
-            const std::string &sso = ss.str();
-            if(write(http_alert_fd,sso.c_str(),sso.size()) != (int)sso.size()){
-                perror("write");
+            if(dedup_xml.size()) xml_fo << "<filename>" << body_path << "</filename>";
+            xml_fo << "<filesize>" << bytes_written << "</filesize>";
+            bool have_sha256 = false;
+            if(body_hash){
+                flow_hash::digests_t d;
+                body_hash->final(d);
+                xml_fo << flow_hash::xml(d);
+                have_sha256 = (body_hash->which() & flow_hash::SHA256)!=0;
             }
+            if(sha256.size() && !have_sha256) xml_fo << "<hashdigest type='SHA256'>" << sha256 << "</hashdigest>";
+            xml_fo << dedup_xml << "</fileobject></byte_run>\n";
+            if(xmlstream) *xmlstream << xml_fo.str();
         }
-        if(http_cmd.size()>0 && output_path.size()>0){
+        if(http_alert_fd>=0) http_alert("close",body_path,bytes_written);
+        if(http_cmd.size()>0 && body_path.size()>0 && !to_segments){
             /* If we are at maximum number of subprocesses, wait for one to exit */
-            std::string cmd = http_cmd + " " + output_path;
+            std::string cmd = http_cmd + " " + body_path;
+            std::lock_guard<std::mutex> lock(http_M);
 #ifdef HAVE_FORK
             int status=0;
             pid_t pid = 0;
@@ -413,7 +491,7 @@ int scan_http_cbo::on_message_complete()
         }
     } else {
         /* Nothing written; erase the file */
-        if(output_path.size() > 0){
+        if(output_path.size() > 0 && !to_segments && !body_store::active()){
             ::unlink(output_path.c_str());
         }
     }
@@ -422,16 +500,123 @@ int scan_http_cbo::on_message_complete()
     xml_fo.str("");
     output_path = "";
     bytes_written=0;
-    unzip = false;
-    if(zinit){
-        inflateEnd(&zs);
-        zinit = false;
-    }
-    zfail = false;
+    to_segments = false;
     return 0;
 }
 
 
+/* static */ void scan_http_cbo::init_settings(http_parser_settings &settings)
+{
+    memset(&settings,0,sizeof(settings)); // in the event that new callbacks get created
+    settings.on_message_begin          = scan_http_cb_on_message_begin;
+    settings.on_url                    = scan_http_cb_on_url;
+    settings.on_header_field           = scan_http_cb_on_header_field;
+    settings.on_header_value           = scan_http_cb_on_header_value;
+    settings.on_headers_complete       = scan_http_cb_on_headers_complete;
+    settings.on_body                   = scan_http_cb_on_body;
+    settings.on_message_complete       = scan_http_cb_on_message_complete;
+}
+
+
+/***
+ * http_stream: the same parsing, a segment at a time. See http_stream.h
+ */
+
+/* static */ bool http_stream::enabled     = false;
+/* static */ bool http_stream::bodies_only = false;
+/* static */ bool http_stream::active      = false;
+
+/* static */ bool http_stream::starts_response(const uint8_t *data,size_t length)
+{
+    return length>=7 && memcmp(data,"HTTP/1.",7)==0;
+}
+
+http_stream::http_stream(const std::string &path_):
+    path(path_),parser(new http_parser),cbo(0),xml(),next(0),started_at(0),stopped(false),broken(false)
+{
+    xml << "\n    <byte_runs>\n";
+    start(0);
+}
+
+http_stream::~http_stream()
+{
+    delete cbo;
+    delete parser;
+}
+
+void http_stream::start(uint64_t offset)
+{
+    delete cbo;                         // ends its message
+    http_parser_init(parser, HTTP_RESPONSE);
+    cbo = new scan_http_cbo(path,0,&xml);
+    parser->data = cbo;
+    started_at = offset;
+}
+
+void http_stream::feed(uint64_t offset,const uint8_t *data,size_t length)
+{
+    if(stopped || length==0) return;
+    if(offset > next){
+        DEBUG(10)("%s: gap at %" PRIu64 "; the flow will be scanned when it is finished",path.c_str(),next);
+        give_up();
+        return;
+    }
+    if(offset+length <= next) return;   // a retransmission
+    data   += next-offset;
+    length -= next-offset;
+
+    http_parser_settings settings;
+    scan_http_cbo::init_settings(settings);
+    while(length>0){
+        cbo->set_base(reinterpret_cast<const char *>(data),next);
+        size_t parsed = http_parser_execute(parser,&settings,reinterpret_cast<const char *>(data),length);
+        assert(parsed <= length);
+        cbo->keep_headers();            // data is gone when this returns
+        next   += parsed;
+        data   += parsed;
+        length -= parsed;
+        if(length==0) return;
+
+        /* Stop parsing if a new parser could parse nothing, as scan_http does */
+        if(next==started_at){
+            stopped = true;
+            return;
+        }
+        if(parser->upgrade){
+            DEBUG(9) ("upgrade connection detected (WebSockets?); cowardly refusing to dump further");
+            stopped = true;
+            return;
+        }
+        start(next);
+    }
+}
+
+void http_stream::give_up()
+{
+    stopped = true;
+    broken  = true;
+    delete cbo;
+    cbo = 0;
+}
+
+bool http_stream::finish(std::string &xmladd)
+{
+    if(broken) return false;
+    if(!stopped){
+        /* Indicate EOF (flushing callbacks) */
+        http_parser_settings settings;
+        scan_http_cbo::init_settings(settings);
+        http_parser_execute(parser,&settings,NULL,0);
+        stopped = true;
+    }
+    delete cbo;
+    cbo = 0;
+    xml << "    </byte_runs>";
+    xmladd += xml.str();
+    return true;
+}
+
+
 /***
  * the HTTP scanner plugin itself
  */
@@ -450,23 +635,20 @@ void  scan_http(const class scanner_params &sp,const recursion_control_block &rc
         sp.info->flags = scanner_info::SCANNER_DISABLED; // default disabled
         sp.info->get_config(HTTP_CMD,&http_cmd,"Command to execute on each HTTP attachment");
         sp.info->get_config(HTTP_ALERT_FD,&http_alert_fd,"File descriptor to send information about completed HTTP attachments");
+        sp.info->get_config("http_stream",&http_stream::enabled,"Parse HTTP responses as the flow is stored, instead of after it is finished");
+        sp.info->get_config("http_bodies_only",&http_stream::bodies_only,"With http_stream, write no transcript for flows that are parsed as HTTP");
+        sp.info->get_config("http_decode_buffer",&body_decoder::buffer_size,"Bytes of a decoded HTTP body collected before they are written");
         return;         /* No feature files created */
     }
 
     if(sp.phase==scanner_params::PHASE_SCAN){
+        if(http_stream::active && stream_scan::take(sp.sbuf.pos0.path,stream_scan::HTTP)) return; // done as it was stored
         /* See if there is an HTTP response */
         if(sp.sbuf.bufsize>=MIN_HTTP_BUFSIZE && sp.sbuf.memcmp(reinterpret_cast<const uint8_t *>("HTTP/1."),0,7)==0){
             /* Smells enough like HTTP to try parsing */
             /* Set up callbacks */
             http_parser_settings scan_http_parser_settings;
-            memset(&scan_http_parser_settings,0,sizeof(scan_http_parser_settings)); // in the event that new callbacks get created
-            scan_http_parser_settings.on_message_begin          = scan_http_cbo::scan_http_cb_on_message_begin;
-            scan_http_parser_settings.on_url                    = scan_http_cbo::scan_http_cb_on_url;
-            scan_http_parser_settings.on_header_field           = scan_http_cbo::scan_http_cb_on_header_field;
-            scan_http_parser_settings.on_header_value           = scan_http_cbo::scan_http_cb_on_header_value;
-            scan_http_parser_settings.on_headers_complete       = scan_http_cbo::scan_http_cb_on_headers_complete;
-            scan_http_parser_settings.on_body                   = scan_http_cbo::scan_http_cb_on_body;
-            scan_http_parser_settings.on_message_complete       = scan_http_cbo::scan_http_cb_on_message_complete;
+            scan_http_cbo::init_settings(scan_http_parser_settings);
                         
             if(sp.sxml) (*sp.sxml) << "\n    <byte_runs>\n";
             for(size_t offset=0;;){
@@ -7,7 +7,8 @@
 
 #include "config.h"
 #include "bulk_extractor_i.h"
-#include "dfxml/src/hash_t.h"
+#include "flow_hash.h"
+#include "stream_scan.h"
 
 #include <iostream>
 #include <sys/types.h>
@@ -26,15 +27,22 @@ void  scan_md5(const class scanner_params &sp,const recursion_control_block &rcb
     if(sp.phase==scanner_params::PHASE_STARTUP){
 	sp.info->name  = "md5";
 	sp.info->flags = scanner_info::SCANNER_DISABLED;
+        sp.info->get_config("flow_hashes",&flow_hash::names,"Digests of each flow and HTTP body: md5, sha1 and sha256, separated by commas");
+        flow_hash::algs = flow_hash::parse(flow_hash::names);
+        if(flow_hash::algs==0){
+            std::cerr << "flow_hashes: " << flow_hash::names << " is not md5, sha1 or sha256\n";
+            exit(1);
+        }
         return;     /* No feature files created */
     }
 
-#ifdef HAVE_EVP_GET_DIGESTBYNAME
+#ifdef HAVE_FLOW_HASH
     if(sp.phase==scanner_params::PHASE_SCAN){
-	static const std::string hash0("<hashdigest type='MD5'>");
-	static const std::string hash1("</hashdigest>");
+	if(stream_scan::take(sp.sbuf.pos0.path,stream_scan::MD5)) return; // tcpip hashed it as it was written
 	if(sp.sxml){
-            (*sp.sxml) << hash0 << dfxml::md5_generator::hash_buf(sp.sbuf.buf,sp.sbuf.bufsize).hexdigest() << hash1;
+            flow_hash::digests_t d;
+            flow_hash::hash(flow_hash::algs,sp.sbuf.buf,sp.sbuf.bufsize,d);
+            (*sp.sxml) << flow_hash::xml(d);
         }
 	return;
     }
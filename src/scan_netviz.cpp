@@ -12,8 +12,18 @@
 #include "bulk_extractor_i.h"
 
 #ifdef HAVE_LIBCAIRO
+#include "tcpflow.h"
+#include "tcpip.h"
+#include "tcpdemux.h"
 #include "netviz/one_page_report.h"
 
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <fstream>
+#include <mutex>
+#include <thread>
+
 /* These control the size of the iptable histogram
  * and whether or not it is dumped. The histogram should be kept
  * either small enough that it is not expensive to maintain, or large
@@ -24,10 +34,161 @@
 #define HISTOGRAM_DUMP "netviz_histogram_dump"
 #define DEFAULT_MAX_HISTOGRAM_SIZE 1000 
 
+/* The thread that started the scanner adds its packets to report; any other
+ * thread that delivers packets (with several -r files read in parallel, say)
+ * gets a partial report of its own, and they are merged at shutdown.
+ */
 static one_page_report *report=0;
+static int max_histogram_size = DEFAULT_MAX_HISTOGRAM_SIZE;
+static std::thread::id report_thread;
+static std::mutex partials_M;
+static std::vector<one_page_report *> partials;
+
+static std::string save_state;          // -S netviz_save
+static std::string merge_states;        // -S netviz_merge
+
+/* With -S netviz_snapshot_secs or -S netviz_snapshot_packets, report.pdf is
+ * drawn while packets are still arriving. Every thread then adds its packets
+ * to a partial report, even the one that started the scanner; when a partial
+ * has covered the interval it is handed to the snapshot thread and a new one
+ * is started, so that the packet threads take no locks to count a packet.
+ * The snapshot thread merges what it is handed into report and draws a copy,
+ * or, with -S netviz_snapshot_window=N, draws just the last N partials.
+ */
+static uint32_t snapshot_secs = 0;      // of packet time
+static uint64_t snapshot_packets = 0;
+static uint32_t snapshot_window = 0;
+
+class netviz_snapshots {
+    netviz_snapshots(const netviz_snapshots &);
+    netviz_snapshots &operator=(const netviz_snapshots &);
+    std::mutex              M;
+    std::condition_variable ready;
+    std::vector<one_page_report *> handed; // not merged yet
+    std::deque<one_page_report *>  window; // the last snapshot_window partials
+    bool                    stopping;
+    std::thread             worker;
+
+    void run(){
+        while(true){
+            std::vector<one_page_report *> batch;
+            {
+                std::unique_lock<std::mutex> lock(M);
+                while(handed.empty() && !stopping) ready.wait(lock);
+                if(handed.empty()) return;
+                batch.swap(handed);
+            }
+            for(std::vector<one_page_report *>::iterator it=batch.begin();it!=batch.end();it++){
+                report->merge(**it);
+                if(snapshot_window>0){
+                    window.push_back(*it);
+                    if(window.size()>snapshot_window){
+                        delete window.front();
+                        window.pop_front();
+                    }
+                } else {
+                    delete *it;
+                }
+            }
+            draw();
+        }
+    }
+
+    /* draw into a temporary file and rename it, so that report.pdf is always whole */
+    void draw(){
+        const tcpdemux *demux = tcpdemux::getInstance();
+        one_page_report copy(max_histogram_size);
+        if(snapshot_window>0){
+            for(std::deque<one_page_report *>::const_iterator it=window.begin();it!=window.end();it++){
+                copy.merge(**it);
+            }
+        } else {
+            copy.merge(*report);
+        }
+        copy.source_identifier = demux->fs ? demux->fs->get_input_fname() : "";
+        std::string fname = demux->outdir + "/" + copy.filename;
+        copy.filename += ".tmp";
+        copy.render(demux->outdir);
+        if(rename((fname + ".tmp").c_str(),fname.c_str())){
+            DEBUG(1)("netviz snapshot: %s: %s",fname.c_str(),strerror(errno));
+        }
+    }
+
+public:
+    netviz_snapshots():M(),ready(),handed(),window(),stopping(false),worker(){
+        worker = std::thread(&netviz_snapshots::run,this);
+    }
+    ~netviz_snapshots(){                // after everything handed is in report
+        {
+            std::lock_guard<std::mutex> lock(M);
+            stopping = true;
+        }
+        ready.notify_one();
+        worker.join();
+        for(std::deque<one_page_report *>::iterator it=window.begin();it!=window.end();it++) delete *it;
+    }
+    void hand_off(one_page_report *partial){
+        {
+            std::lock_guard<std::mutex> lock(M);
+            handed.push_back(partial);
+        }
+        ready.notify_one();
+    }
+};
+static netviz_snapshots *snapshots = 0;
+
 static void netviz_process_packet(void *user,const be13::packet_info &pi)
 {
-    report->ingest_packet(pi);
+    static thread_local one_page_report *mine = 0;
+    static thread_local uint64_t mine_packets = 0;
+    static thread_local time_t   mine_start = 0;
+    if(mine==0){
+        if(std::this_thread::get_id()==report_thread && snapshots==0){
+            mine = report;
+        } else {
+            mine = new one_page_report(max_histogram_size);
+            std::lock_guard<std::mutex> lock(partials_M);
+            partials.push_back(mine);
+        }
+    }
+    mine->ingest_packet(pi);
+    if(snapshots==0) return;
+    if(mine_packets++==0) mine_start = pi.ts.tv_sec;
+    if((snapshot_packets>0 && mine_packets>=snapshot_packets) ||
+       (snapshot_secs>0 && pi.ts.tv_sec-mine_start>=(time_t)snapshot_secs)){
+        one_page_report *next = new one_page_report(max_histogram_size);
+        {
+            std::lock_guard<std::mutex> lock(partials_M);
+            std::replace(partials.begin(),partials.end(),mine,next);
+        }
+        snapshots->hand_off(mine);
+        mine = next;
+        mine_packets = 0;
+    }
+}
+
+/* add the states named in merge_states, separated by commas */
+static void merge_saved()
+{
+    size_t merged = 0;
+    for(size_t start=0;start<merge_states.size();){
+        size_t comma = merge_states.find(',',start);
+        if(comma==std::string::npos) comma = merge_states.size();
+        std::string fname = merge_states.substr(start,comma-start);
+        start = comma+1;
+        if(fname.size()==0) continue;
+        std::ifstream in(fname.c_str());
+        one_page_report saved(max_histogram_size);
+        if(!in.is_open() || !saved.load(in)){
+            std::cerr << "netviz: cannot read the report state in " << fname << "\n";
+            continue;
+        }
+        report->merge(saved);
+        merged++;
+    }
+    if(merged>0){
+        report->source_identifier += " + " + std::to_string(merged) + " saved reports";
+    }
 }
 
 #endif
@@ -55,9 +216,19 @@ void  scan_netviz(const class scanner_params &sp,const recursion_control_block &
         sp.info->description = "Performs 1-page visualization of network packets";
 	sp.info->packet_cb = netviz_process_packet;
         sp.info->get_config(HISTOGRAM_DUMP,&histogram_dump,"Dumps the histogram");
-        int max_histogram_size = DEFAULT_MAX_HISTOGRAM_SIZE;
         sp.info->get_config(HISTOGRAM_SIZE,&max_histogram_size,"Maximum histogram size");
+        sp.info->get_config("netviz_save",&save_state,"Also write the report's counts to this file (in the output directory), for netviz_merge");
+        sp.info->get_config("netviz_merge",&merge_states,"Files written by netviz_save, separated by commas, to add to the report");
+        sp.info->get_config("netviz_snapshot_secs",&snapshot_secs,"Draw report.pdf every this many seconds of packets, as well as at the end");
+        sp.info->get_config("netviz_snapshot_packets",&snapshot_packets,"Draw report.pdf every this many packets, as well as at the end");
+        sp.info->get_config("netviz_snapshot_window",&snapshot_window,"Each report.pdf snapshot shows only the last this many intervals");
+        sp.info->get_config("netviz_sample",&one_page_report::packet_sample,"Count only 1 in this many packets, scaling the counts up");
+        sp.info->get_config("netviz_sample_flows",&one_page_report::flow_sample,"Count only the packets of 1 in this many flows, scaling the counts up");
+        if(one_page_report::packet_sample<1) one_page_report::packet_sample = 1;
+        if(one_page_report::flow_sample<1) one_page_report::flow_sample = 1;
         report = new one_page_report(max_histogram_size);
+        report_thread = std::this_thread::get_id();
+        if(snapshot_secs>0 || snapshot_packets>0) snapshots = new netviz_snapshots();
 #else
         sp.info->description = "Disabled (compiled without libcairo";
 #endif
@@ -66,11 +237,28 @@ void  scan_netviz(const class scanner_params &sp,const recursion_control_block &
 
     if(sp.phase==scanner_params::PHASE_SHUTDOWN){
         assert(report!=0);
+        delete snapshots;               // merges what it was handed into report
+        snapshots = 0;
+        {
+            std::lock_guard<std::mutex> lock(partials_M);
+            for(std::vector<one_page_report *>::iterator it=partials.begin();it!=partials.end();it++){
+                report->merge(**it);
+                delete *it;
+            }
+            partials.clear();
+        }
+        report->source_identifier = sp.fs.get_input_fname();
+        merge_saved();
+        if(save_state.size()){
+            std::string fname = save_state[0]=='/' ? save_state : sp.fs.get_outdir() + "/" + save_state;
+            std::ofstream out(fname.c_str());
+            report->save(out);
+            if(!out.good()) std::cerr << "netviz: cannot write " << fname << "\n";
+        }
         if(histogram_dump){
             report->src_tree.dump_stats(std::cout);
             report->dump(histogram_dump);
         }
-        report->source_identifier = sp.fs.get_input_fname();
         report->render(sp.fs.get_outdir());
         delete report;
         report = 0;
@@ -0,0 +1,260 @@
+/**
+ *
+ * scan_pool.cpp
+ * Threads that scan finished flows. See scan_pool.h
+ *
+ * This source code is under the GNU Public License (GPL).  See
+ * LICENSE for details.
+ *
+ */
+
+#include "tcpflow.h"
+#include "tcpip.h"
+#include "tcpdemux.h"
+#include "scan_pool.h"
+#include "stream_scan.h"
+#include "metrics.h"
+#include "scan_python.h"
+#include "mem_budget.h"
+
+#include <sstream>
+#include <algorithm>
+
+/* static */ uint32_t    scan_pool::threads    = 0;
+/* static */ uint32_t    scan_pool::queue_max  = 256;
+/* static */ std::string scan_pool::queue_full = "wait";
+/* static */ uint32_t    scan_pool::window     = 16*1024*1024;
+
+scan_pool::job::job(const tcpip &tcp,feature_recorder_set *fs_,dfxml_writer *xreport_):
+    seq(0),report(tcp),fs(fs_),xreport(xreport_),scan(false),zstd(false),in_memory(false),
+    segments(),extents(),length(0),name(),path(),contents(),xmladd()
+{
+}
+
+scan_pool::job::job(feature_recorder_set *fs_,dfxml_writer *xreport_):
+    seq(0),report(),fs(fs_),xreport(xreport_),scan(false),zstd(false),in_memory(false),
+    segments(),extents(),length(0),name(),path(),contents(),xmladd()
+{
+}
+
+scan_pool::scan_pool(const tcpdemux &parent):
+    workers(),demuxes(),M(),work_ready(),space_ready(),queue(),stopping(false),
+    next_seq(0),waited(0),inlined(0),skipped(0),scan_M(),report_M(),done(),next_report(0)
+{
+    if(queue_full!="wait" && queue_full!="inline" && queue_full!="skip"){
+        std::cerr << "scan_queue_full must be wait, inline or skip\n";
+        exit(1);
+    }
+    if(queue_max<1) queue_max = 1;
+    DEBUG(1)("starting %u scan threads",threads);
+    for(unsigned int i=0;i<threads;i++){
+        demuxes.push_back(parent.make_worker(tcpdemux::SCAN_SHARD_BASE+i,1));
+    }
+    for(unsigned int i=0;i<threads;i++){
+        workers.push_back(std::thread(&scan_pool::run,this,i));
+    }
+    metrics::add_gauge("scan_queue",[this]{
+        std::lock_guard<std::mutex> lock(M);
+        return (uint64_t)queue.size();
+    });
+}
+
+scan_pool::~scan_pool()
+{
+    metrics::remove_gauge("scan_queue");
+    {
+        std::lock_guard<std::mutex> lock(M);
+        stopping = true;
+    }
+    work_ready.notify_all();
+    for(std::vector<std::thread>::iterator it=workers.begin();it!=workers.end();it++){
+        it->join();
+    }
+    assert(done.empty());               // every job was finished()
+    for(std::vector<tcpdemux *>::iterator it=demuxes.begin();it!=demuxes.end();it++){
+        /* the report and packet writer belong to the parent demux */
+        (*it)->xreport = 0;
+        (*it)->pwriter = 0;
+        delete *it;
+    }
+    DEBUG(2)("scan queue: waited %" PRIu64 " times, %" PRIu64 " flows scanned inline, %" PRIu64 " not scanned",
+             waited,inlined,skipped);
+}
+
+/* static */ void scan_pool::scan(job &j,std::mutex &lock_M)
+{
+    std::vector<job *> one(1,&j);
+    scan(one,lock_M);
+}
+
+/* static */ void scan_pool::scan(const std::vector<job *> &jobs,std::mutex &lock_M)
+{
+    std::vector<sbuf_t *> sbufs(jobs.size(),(sbuf_t *)0);
+    std::vector<int> fds(jobs.size(),-1);
+    std::vector<python_host::flow_view> views;
+    std::vector<uint64_t> charged(jobs.size(),0);
+    for(size_t i=0;i<jobs.size();i++){
+        job &j = *jobs[i];
+        if(j.segments.size()>0){
+            if(j.length > window_bytes()){
+                scan_windows(j,lock_M);
+                continue;
+            }
+            charged[i] = j.length;
+            mem_budget::charge(mem_budget::SCAN,charged[i]);
+            j.contents.resize(j.length);
+            if(segment_read(j.segments,j.extents,0,(uint8_t *)&j.contents[0],j.contents.size())){
+                DEBUG(1)("%s: cannot read back from the segments: %s",j.name.c_str(),strerror(errno));
+                j.contents.clear();
+                continue;
+            }
+        }
+        if(j.zstd){
+            /* scan the flow, not the file */
+            std::string error;
+            if(zstd_transcript::read(j.path,j.contents,error)){
+                DEBUG(1)("cannot read back %s",error.c_str());
+                continue;
+            }
+        }
+        if(j.zstd || j.in_memory){
+            if(j.contents.size()==0) continue;
+            sbufs[i] = new sbuf_t(pos0_t(j.name),(const uint8_t *)j.contents.data(),j.contents.size(),j.contents.size(),false,false);
+        } else {
+            fds[i] = open(j.path.c_str(),O_RDONLY|O_BINARY);
+            if(fds[i]<0){
+                DEBUG(1)("%s: %s",j.path.c_str(),strerror(errno));
+                continue;
+            }
+            sbufs[i] = sbuf_t::map_file(j.path,fds[i],false);
+            if(sbufs[i]==0) continue;
+        }
+        std::stringstream xmladd;
+        {
+            std::lock_guard<std::mutex> lock(lock_M); // scanners are not thread-safe
+            be13::plugin::process_sbuf(scanner_params(scanner_params::PHASE_SCAN,*sbufs[i],*(j.fs),&xmladd));
+        }
+        j.xmladd += xmladd.str();       // after what http_stream found, if anything
+        if(python_host::running()){
+            python_host::flow_view v;
+            v.name   = &j.name;
+            v.data   = sbufs[i]->buf;
+            v.length = sbufs[i]->bufsize;
+            v.xmladd = &j.xmladd;
+            views.push_back(v);
+        }
+    }
+    /* outside lock_M, so that the other scan threads go on while Python has the batch */
+    if(views.size()>0) python_host::deliver(views);
+    for(size_t i=0;i<jobs.size();i++){
+        delete sbufs[i];
+        if(fds[i]>=0) close(fds[i]);
+        if(charged[i]){
+            std::string().swap(jobs[i]->contents);
+            mem_budget::release(mem_budget::SCAN,charged[i]);
+        }
+    }
+}
+
+/* static */ uint64_t scan_pool::window_bytes()
+{
+    uint64_t w = std::max(window,(uint32_t)4096);
+    if(mem_budget::max>0) w = std::min(w,std::max(mem_budget::max/16,(uint64_t)4096));
+    return w;
+}
+
+/* Each window is a page of an sbuf whose margin is the start of the next one,
+ * so that a feature across the boundary is found, and found once.
+ */
+/* static */ void scan_pool::scan_windows(job &j,std::mutex &lock_M)
+{
+    const uint64_t page   = window_bytes();
+    const uint64_t margin = page/16;
+    std::string buf;
+    mem_budget::charge(mem_budget::SCAN,page+margin);
+    for(uint64_t offset=0;offset<j.length;offset+=page){
+        size_t pagesize = (size_t)std::min(page,j.length-offset);
+        size_t len      = (size_t)std::min(page+margin,j.length-offset);
+        buf.resize(len);
+        if(segment_read(j.segments,j.extents,offset,(uint8_t *)&buf[0],len)){
+            DEBUG(1)("%s: cannot read back from the segments: %s",j.name.c_str(),strerror(errno));
+            break;
+        }
+        sbuf_t sb(pos0_t(j.name)+offset,(const uint8_t *)buf.data(),len,pagesize,false,false);
+        std::stringstream xmladd;
+        {
+            std::lock_guard<std::mutex> lock(lock_M); // scanners are not thread-safe
+            be13::plugin::process_sbuf(scanner_params(scanner_params::PHASE_SCAN,sb,*(j.fs),&xmladd));
+        }
+        j.xmladd += xmladd.str();
+    }
+    mem_budget::release(mem_budget::SCAN,page+margin);
+}
+
+void scan_pool::submit(job *j)
+{
+    std::unique_lock<std::mutex> lock(M);
+    j->seq = next_seq++;
+    if(j->scan && queue.size()>=queue_max){
+        if(queue_full=="skip"){
+            skipped++;
+            j->scan = false;
+        } else if(queue_full=="inline"){
+            inlined++;
+            lock.unlock();
+            scan(*j,scan_M);
+            finished(j);
+            return;
+        } else {
+            waited++;
+            while(queue.size()>=queue_max) space_ready.wait(lock);
+        }
+    }
+    if(!j->scan){
+        lock.unlock();
+        finished(j);
+        return;
+    }
+    queue.push_back(j);
+    lock.unlock();
+    work_ready.notify_one();
+}
+
+void scan_pool::run(unsigned int i)
+{
+    tcpdemux::set_thread_instance(demuxes[i]);
+    /* -e python takes its flows in batches; see scan_python.h */
+    size_t batch_max = python_host::running() ? python_host::batch_size : 1;
+    while(true){
+        std::vector<job *> batch;
+        {
+            std::unique_lock<std::mutex> lock(M);
+            while(queue.empty() && !stopping) work_ready.wait(lock);
+            if(queue.empty()) break;    // stopping, and nothing is left
+            while(queue.size()>0 && batch.size()<batch_max){
+                batch.push_back(queue.front());
+                queue.pop_front();
+            }
+        }
+        space_ready.notify_all();
+        scan(batch,scan_M);
+        for(std::vector<job *>::iterator it=batch.begin();it!=batch.end();it++){
+            finished(*it);
+        }
+    }
+    tcpdemux::set_thread_instance(0);
+}
+
+void scan_pool::finished(job *j)
+{
+    if(j->name.size()) stream_scan::forget(j->name); // it was scanned, or it will not be
+    std::lock_guard<std::mutex> lock(report_M);
+    done[j->seq] = j;
+    while(!done.empty() && done.begin()->first==next_report){
+        job *r = done.begin()->second;
+        done.erase(done.begin());
+        tcpdemux::report(r->xreport,r->report,r->xmladd);
+        delete r;
+        next_report++;
+    }
+}
@@ -0,0 +1,120 @@
+#ifndef SCAN_POOL_H
+#define SCAN_POOL_H
+
+/**
+ * scan_pool.h
+ *
+ * Threads that run the post-processing scanners (-e http, md5, ...) on
+ * finished flows, with -S scan_threads=N.
+ *
+ * tcpdemux::post_process() still writes out the flow, saves it and closes
+ * its file on the packet thread, so the fd is given back at once; what
+ * is left, reading the flow back and scanning it, is put on a bounded
+ * queue as a job. When the queue is full, -S scan_queue_full says what
+ * the packet thread does:
+ *   wait     wait for a scan thread to take a job (the default)
+ *   inline   scan the flow itself
+ *   skip     report the flow without scanning it
+ *
+ * The scanners are not thread-safe, so they still scan one flow at a
+ * time; the threads take the mapping, decompression and waiting off the
+ * packet thread. Each scan thread has a demux of its own, so that what
+ * the scanners do through tcpdemux::getInstance() does not touch the
+ * packet thread's flows.
+ *
+ * With -e python a scan thread takes up to -S py_batch jobs at a time and
+ * gives them to the Python function together; see scan_python.h.
+ *
+ * A flow in the --segments output is read back from the segment files by
+ * the thread that scans it. One longer than -S scan_window bytes (default
+ * 16MiB, and no more than a sixteenth of -S memory_max) is scanned a
+ * window at a time, each with the bytes after it as its margin, so that it
+ * is never all in memory; the Python function does not get those flows.
+ * What is read back is charged to the memory budget.
+ *
+ * Every finished flow, scanned or not, is given a number when it is
+ * submitted, and the <fileobject>s go to the DFXML report in that order.
+ *
+ * This source code is under the GNU Public License (GPL).  See
+ * LICENSE for details.
+ */
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include "segment_reader.h"
+
+class tcpdemux;
+
+class scan_pool {
+public:
+    /* A finished flow */
+    class job {
+        job(const job &);
+        job &operator=(const job &);
+    public:
+        job(const class tcpip &tcp,class feature_recorder_set *fs_,class dfxml_writer *xreport_);
+        job(class feature_recorder_set *fs_,class dfxml_writer *xreport_); // a flow with no tcpip (--rescan)
+        uint64_t    seq;                // order of the report
+        flow_report report;
+        class feature_recorder_set *fs;
+        class dfxml_writer *xreport;    // 0 if there is no report
+        bool        scan;               // run the scanners on it
+        bool        zstd;               // path is a -S compress=zstd transcript
+        bool        in_memory;          // the flow is in contents, not at path
+        std::string segments;           // with --segments, the base of the segment files the flow is in
+        segment_extents extents;        // and where it is in them
+        uint64_t    length;             // of the flow in the segments
+        std::string name;               // what the scanners are told the flow is called
+        std::string path;               // the transcript
+        std::string contents;           // the flow, when it is in memory or was decompressed
+        std::string xmladd;             // what the scanners add to the <fileobject>
+    };
+
+    static uint32_t    threads;         // -S scan_threads; 0 scans on the packet thread
+    static uint32_t    queue_max;       // -S scan_queue
+    static std::string queue_full;      // -S scan_queue_full: wait, inline or skip
+    static uint32_t    window;          // -S scan_window
+
+    explicit scan_pool(const tcpdemux &parent); // starts threads scan threads
+    virtual ~scan_pool();               // scans what is queued, writes the reports and joins the threads
+
+    void submit(job *j);                // takes j
+    /* Run the scanners on j, holding M while they run */
+    static void scan(job &j,std::mutex &M);
+    /* The same for each of jobs; then -e python has them all at once, without M */
+    static void scan(const std::vector<job *> &jobs,std::mutex &M);
+
+private:
+    scan_pool(const scan_pool &);
+    scan_pool &operator=(const scan_pool &);
+
+    std::vector<std::thread> workers;
+    std::vector<tcpdemux *>  demuxes;   // one for each of workers
+    std::mutex               M;         // protects everything down to skipped
+    std::condition_variable  work_ready;  // signaled when queue gets a job or stopping is set
+    std::condition_variable  space_ready; // signaled when a job is taken off queue
+    std::deque<job *>        queue;
+    bool                     stopping;
+    uint64_t                 next_seq;
+    uint64_t                 waited;    // times the packet thread waited for room
+    uint64_t                 inlined;   // flows scanned on the packet thread
+    uint64_t                 skipped;   // flows not scanned
+    std::mutex               scan_M;    // the scanners run one flow at a time
+    std::mutex               report_M;  // protects done and next_report
+    std::map<uint64_t,job *> done;      // finished jobs waiting for an earlier one
+    uint64_t                 next_report;
+
+    static uint64_t window_bytes();     // window, within the memory budget
+    static void scan_windows(job &j,std::mutex &M); // a flow in the segments too long to read at once
+    void run(unsigned int i);           // scan thread body
+    void finished(job *j);              // writes the reports that are due
+};
+
+#endif
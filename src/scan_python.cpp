@@ -5,213 +5,186 @@
  * Use external python scripts to post-process flow files
  *
  * 2020-09-27 - slg - removed from build because this is only Python 2.7
+ * Now Python 3, with finished flows given to the function in batches
+ * from the scan threads; see scan_python.h
  */
 
 #include "config.h"
-#include "dfxml/src/hash_t.h"
-#include "tcpflow.h"
-
-#include <iostream>
-#include <sys/types.h>
 
-#if HAVE_PYTHON2_7_PYTHON_H
-#  include <python2.7/Python.h> // Get header: install package "python-devel"
+#if HAVE_PYTHON3
+#  define PY_SSIZE_T_CLEAN
+#  include <Python.h>           // Get header: install package "python3-devel" or "python3-dev"
 #endif
 
+#include "tcpflow.h"
+#include "scan_python.h"
+#include "dfxml/src/dfxml_writer.h"
 
-struct ScanPython
-{
-    ScanPython()
-        : py_path()
-        , py_module()
-        , py_function()
-        , init_script()
-#if HAVE_PYTHON2_7_PYTHON_H
-        , pythonFunction (NULL)
-#endif
-    { }
-
-    ScanPython(const ScanPython& o)
-        : py_path(o.py_path)
-        , py_module(o.py_module)
-        , py_function(o.py_function)
-        , init_script(o.init_script)
-#if HAVE_PYTHON2_7_PYTHON_H
-        , pythonFunction (NULL)
-#endif
-    { }
-
-    ScanPython& operator=(const ScanPython& o) {
-        py_path     = o.py_path;
-        py_module   = o.py_module;
-        py_function = o.py_function;
-        init_script = o.init_script;
-#if HAVE_PYTHON2_7_PYTHON_H
-        pythonFunction = NULL;
-#endif
-        return *this;
-    }
-
-    void startup(const scanner_params& sp);
-    void init(const scanner_params& sp);
-    void before();
-    void scan(const scanner_params& sp);
-    void shutdown();
-
-    std::string py_path;
-    std::string py_module;
-    std::string py_function;
-    std::string init_script;
+#include <iostream>
+#include <sys/types.h>
 
-#if HAVE_PYTHON2_7_PYTHON_H
-    PyObject* pythonFunction;
-#endif
-};
+/* static */ std::string python_host::path;
+/* static */ std::string python_host::module;
+/* static */ std::string python_host::function;
+/* static */ uint32_t    python_host::batch_size = 32;
 
+#if HAVE_PYTHON3
+static PyObject      *py_func     = 0; // the function, once start() found it
+static PyThreadState *main_thread = 0; // saved while tcpflow runs without the GIL
 
-void ScanPython::startup(const scanner_params& sp)
+/* The pending exception as a string; clears it */
+static std::string python_error()
 {
-    if (sp.sp_version != scanner_params::CURRENT_SP_VERSION) {
-        std::cerr << "scan_python requires sp version "
-                  << scanner_params::CURRENT_SP_VERSION << "; "
-                  << "got version " << sp.sp_version << "\n";
-        exit(1);
+    PyObject *type = 0, *value = 0, *tb = 0;
+    PyErr_Fetch(&type,&value,&tb);
+    std::string msg = "unknown error";
+    PyObject *what = value ? value : type;
+    if(what){
+        PyObject *s = PyObject_Str(what);
+        const char *c = s ? PyUnicode_AsUTF8(s) : 0;
+        if(c) msg = c;
+        Py_XDECREF(s);
     }
-
-    sp.info->name = "python";
-    sp.info->flags = scanner_info::SCANNER_DISABLED;
-
-    sp.info->get_config("py_path", &py_path, "    Directory to find python module (optional)");
-    sp.info->get_config("py_module", &py_module, "  Name of python module (script name without extension)");
-    sp.info->get_config("py_function", &py_function, "Function name within the python module");
+    Py_XDECREF(type);
+    Py_XDECREF(value);
+    Py_XDECREF(tb);
+    PyErr_Clear();
+    return msg;
 }
+#endif
 
-
-static std::string get_working_dir(const std::string& path)
+/* static */ bool python_host::running()
 {
-    if (path.empty()) {
-        return "os.getcwd()";
-    }
-    if (path[0] == '/'){
-        return "'" + path + "'";
-    } else {
-        return "os.getcwd() + '/" + path + "'";
-    }
+#if HAVE_PYTHON3
+    return py_func!=0;
+#else
+    return false;
+#endif
 }
 
-void ScanPython::init(const scanner_params& /*sp*/)
+/* static */ int python_host::start(std::string &error)
 {
-    if (py_module.empty() || py_function.empty()) {
-        DEBUG(1)("[scan_python] Cannot call python becase no provided module/function."  "\n"
-                 "\t\t\t\t"  "Please use arguments -S py_module=module -S py_function=foo" );
-        // "\n"  "\t\t\t\t"  "The scanner 'python' is disabled to avoid warning messages.");
-        // sp.info->flags = scanner_info::SCANNER_DISABLED;
-        // TODO(simsong): Should we disable the scanner to avoid warnings?
-        return;
+    if(module.empty() || function.empty()){
+        error = "-e python needs -S py_module=module -S py_function=function";
+        return -1;
     }
-
-    // Write the initialization script to set directory to the local system path
-    init_script = "import sys, os"                          "\n"
-                           "workingDir = " + get_working_dir(py_path) + "\n"
-                           "sys.path.append(workingDir)"             "\n";
-
-#if HAVE_PYTHON2_7_PYTHON_H
-    // Spawn python interpreter
-    Py_Initialize();
-
-    DEBUG(10) ("[scan_python]  Initialize Python using script:" "\n" "%s", init_script.c_str());
-    PyRun_SimpleString(init_script.c_str());
-
-    // Create PyObject from script filename
-    PyObject* pName = PyString_FromString(py_module.c_str());
-    if (pName == NULL) {
-        DEBUG(2) ("[scan_python] Cannot create PyObject from path='%s' and module='%s'"   "\n"
-                  "\t\t\t" "Try using three arguments: -S py_path=path -S py_module=module -S py_function=foo",
-                  py_path.c_str(), py_module.c_str());
-        return;
+    if(batch_size<1) batch_size = 1;
+#if HAVE_PYTHON3
+    Py_InitializeEx(0);                 // tcpflow keeps its own signal handlers
+#if PY_VERSION_HEX < 0x03070000
+    PyEval_InitThreads();
+#endif
+    /* py_path goes first in sys.path; a relative one is from the current directory */
+    PyObject *sys_path = PySys_GetObject("path"); // borrowed
+    PyObject *dir = PyUnicode_DecodeFSDefault(path.size() ? path.c_str() : ".");
+    if(sys_path && dir) PyList_Insert(sys_path,0,dir);
+    Py_XDECREF(dir);
+
+    PyObject *mod = PyImport_ImportModule(module.c_str());
+    if(mod){
+        py_func = PyObject_GetAttrString(mod,function.c_str());
+        Py_DECREF(mod);
     }
-
-    // Import script file in python interpreter
-    PyObject* pModule = PyImport_Import(pName);
-    if (pModule == NULL) {
-        DEBUG(2) ("[scan_python] Cannot import module='%s' from path='%s' in Python interpreter"   "\n"
-                  "\t\t\t" "Try using three arguments: -S py_path=path -S py_module=module -S py_function=foo",
-                  py_module.c_str(), py_path.c_str());
-        return;
+    if(py_func && !PyCallable_Check(py_func)){
+        Py_CLEAR(py_func);
+        PyErr_SetString(PyExc_TypeError,"not callable");
     }
-
-    // Identify function to be used
-    pythonFunction = PyObject_GetAttrString(pModule, py_function.c_str());
-    if (pythonFunction == NULL) {
-        DEBUG(2) ("[scan_python] Cannot identify function='%s' in module='%s' from path='%s'"   "\n"
-                  "\t\t\t" "Try using three arguments: -S py_path=path -S py_module=module -S py_function=foo",
-                  py_function.c_str(), py_module.c_str(), py_path.c_str());
-        return;
+    if(py_func==0){
+        error = "-e python: cannot use " + module + "." + function
+            + (path.size() ? " from " + path : "") + ": " + python_error();
+        Py_Finalize();
+        return -1;
     }
+    DEBUG(1)("python: flows go to %s.%s, %u at a time",module.c_str(),function.c_str(),batch_size);
+    main_thread = PyEval_SaveThread();  // the GIL is taken only to deliver a batch
+    return 0;
+#else
+    error = "-e python: tcpflow was built without Python 3; install python3-devel and build it again";
+    return -1;
 #endif
 }
 
-
-// TODO(simsong): Why is PHASE_THREAD_BEFORE_SCAN never processed?
-void ScanPython::before()
+/* static */ void python_host::stop()
 {
+#if HAVE_PYTHON3
+    if(main_thread==0) return;
+    PyEval_RestoreThread(main_thread);
+    main_thread = 0;
+    Py_CLEAR(py_func);
+    Py_Finalize();
+#endif
 }
 
-
-void ScanPython::scan(const scanner_params& sp)
+/* static */ void python_host::deliver(const std::vector<flow_view> &batch)
 {
-#if HAVE_PYTHON2_7_PYTHON_H
-    if (pythonFunction == NULL) {
-        init(sp);
-        if (pythonFunction == NULL) {
-            // DEBUG(1)("[scan_python] Cannot initialize => Disabled the scanner to avoid warning messages.");
-            // sp.info->flags = scanner_info::SCANNER_DISABLED;
-            // TODO(simsong): Should we disable the scanner to avoid warnings?
-            return;
+#if HAVE_PYTHON3
+    if(py_func==0 || batch.empty()) return;
+    PyGILState_STATE gil = PyGILState_Ensure();
+
+    std::vector<PyObject *> views(batch.size(),(PyObject *)0);
+    PyObject *flows = PyList_New(batch.size());
+    for(size_t i=0;flows && i<batch.size();i++){
+        /* a read-only view of the flow where it is; nothing is copied */
+        views[i] = PyMemoryView_FromMemory((char *)batch[i].data,batch[i].length,PyBUF_READ);
+        PyObject *name = PyUnicode_DecodeFSDefault(batch[i].name->c_str());
+        PyObject *t = views[i] && name ? PyTuple_Pack(2,name,views[i]) : 0;
+        Py_XDECREF(name);
+        if(t==0){
+            Py_CLEAR(flows);
+            break;
         }
+        PyList_SET_ITEM(flows,i,t);     // takes t
     }
 
-    // Cast packet buffer contents into a string and create pyObject
-    std::string data(reinterpret_cast<char const*>(sp.sbuf.buf));
-    PyObject* pData = PyString_FromString(data.c_str());
-
-    // Compose python argument in the form of a tuple and pass the argument to
-    // the chosen function; if the function does not return anything or
-    // encounters an error, return to exit and/or display the error
-    PyObject* pArgs = PyTuple_New(1);
-    PyTuple_SetItem(pArgs, 0, pData);
-    PyObject* pResult = PyObject_CallObject(pythonFunction, pArgs);
-    if (pResult) {
-        // If XML-reporting enabled => Insert the string returned by the python function
-        if (sp.sxml) {
-            const char* returned_string = PyString_AsString(pResult);
-
-            (*sp.sxml) << "<tcpflow:result scan=\"python\" "
-                          "path=\""<< py_path <<"\" "
-                          "module=\""<< py_module <<"\" "
-                          "function=\""<< py_function;
-
-            if (returned_string)
-                (*sp.sxml)  <<"\">"<< returned_string <<"</tcpflow:result>";
-            else
-                (*sp.sxml) << "\"/>";
+    PyObject *result = flows ? PyObject_CallFunctionObjArgs(py_func,flows,NULL) : 0;
+    if(result==0){
+        DEBUG(1)("python: %s.%s: %s",module.c_str(),function.c_str(),python_error().c_str());
+    } else if(result!=Py_None){
+        PyObject *seq = PySequence_Fast(result,"not a list");
+        if(seq==0 || PySequence_Fast_GET_SIZE(seq)!=(Py_ssize_t)batch.size()){
+            if(seq==0) PyErr_Clear();
+            DEBUG(1)("python: %s.%s did not return None or a list with an item for each of %zu flows",
+                     module.c_str(),function.c_str(),batch.size());
+        } else {
+            for(size_t i=0;i<batch.size();i++){
+                PyObject *item = PySequence_Fast_GET_ITEM(seq,i); // borrowed
+                if(item==Py_None) continue;
+                PyObject *s = PyObject_Str(item);
+                const char *c = s ? PyUnicode_AsUTF8(s) : 0;
+                if(c){
+                    *batch[i].xmladd += "<tcpflow:result scanner=\"python\""
+                        + (path.size() ? " path=\"" + dfxml_writer::xmlescape(path) + "\"" : std::string())
+                        + " module=\"" + dfxml_writer::xmlescape(module)
+                        + "\" function=\"" + dfxml_writer::xmlescape(function) + "\">"
+                        + dfxml_writer::xmlescape(c) + "</tcpflow:result>";
+                } else {
+                    PyErr_Clear();
+                }
+                Py_XDECREF(s);
+            }
+        }
+        Py_XDECREF(seq);
+    }
+    Py_XDECREF(result);
+
+    /* The flows' memory goes away when this returns. A released view raises
+     * ValueError if it is used; one the function took a buffer from cannot
+     * be released, and that buffer must not be used.
+     */
+    for(size_t i=0;i<views.size();i++){
+        if(views[i]==0) continue;
+        PyObject *r = PyObject_CallMethod(views[i],"release",NULL);
+        if(r==0){
+            DEBUG(1)("python: %s.%s kept a buffer of %s after it returned: %s",module.c_str(),function.c_str(),
+                     batch[i].name->c_str(),python_error().c_str());
         }
+        Py_XDECREF(r);
+        Py_DECREF(views[i]);
     }
+    Py_XDECREF(flows);
+    PyGILState_Release(gil);
 #else
-    DEBUG(2)
-    ("[scan_python] tcpflow cannot call python scripts required by the scanner 'python'"        "\n"
-     "\t\t" "because the header <python2.7/Python.h> was not present during the tcpflow build." "\n"
-     "\t\t" "Try to install package 'python-devel' and build again tcpflow (./configure)");
-#endif
-}
-
-
-void ScanPython::shutdown()
-{
-#if HAVE_PYTHON2_7_PYTHON_H
-    // Terminate the python interpreter and exit
-    Py_Finalize();
-    pythonFunction = NULL;
+    (void)batch;
 #endif
 }
 
@@ -219,8 +192,6 @@ void ScanPython::shutdown()
 extern "C" void scan_python(const scanner_params& sp,
                             const recursion_control_block& /*rcb*/)
 {
-    static ScanPython singleton;
-
     switch (sp.phase) {
 
     case scanner_params::PHASE_NONE:
@@ -229,27 +200,32 @@ extern "C" void scan_python(const scanner_params& sp,
     // Called in main thread to parse configuration
     // (also used to build the --help text)
     case scanner_params::PHASE_STARTUP:
-        singleton.startup(sp);
+        if (sp.sp_version != scanner_params::CURRENT_SP_VERSION) {
+            std::cerr << "scan_python requires sp version "
+                      << scanner_params::CURRENT_SP_VERSION << "; "
+                      << "got version " << sp.sp_version << "\n";
+            exit(1);
+        }
+        sp.info->name = "python";
+        sp.info->flags = scanner_info::SCANNER_DISABLED;
+        sp.info->get_config("py_path", &python_host::path, "    Directory to find python module (optional)");
+        sp.info->get_config("py_module", &python_host::module, "  Name of python module (script name without extension)");
+        sp.info->get_config("py_function", &python_host::function, "Function name within the python module");
+        sp.info->get_config("py_batch", &python_host::batch_size, "   Finished flows a scan thread gives the python function at once");
         break;
 
-    // Should be called in main thread after all scanners loaded (but never called)
+    // The interpreter is started by python_host::start() once -e python is known
     case scanner_params::PHASE_INIT:
-        singleton.init(sp);
-        break;
-
-    // Called in worker thread before first scan
     case scanner_params::PHASE_THREAD_BEFORE_SCAN:
-        singleton.before();
         break;
 
-    // Called in worker thread for each sbuf
+    // The flows come from scan_pool::scan() as a whole, through python_host::deliver()
     case scanner_params::PHASE_SCAN:
-        singleton.scan(sp);
         break;
 
-    // Called in main thread when scanner is shutdown
+    // Called in main thread when scanner is shutdown, after the scan threads have finished
     case scanner_params::PHASE_SHUTDOWN:
-        singleton.shutdown();
+        python_host::stop();
         break;
     }
 }
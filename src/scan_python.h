@@ -0,0 +1,62 @@
+#ifndef SCAN_PYTHON_H
+#define SCAN_PYTHON_H
+
+/**
+ * scan_python.h
+ *
+ * -e python: finished flows are given to a function of a Python 3 module,
+ *
+ *   tcpflow -e python -S py_path=dir -S py_module=module -S py_function=f
+ *
+ * The function is called with a list of (name, memoryview) tuples, one
+ * for each flow, and returns None or a list with an item for each flow;
+ * an item that is not None is put in the flow's <fileobject> as
+ *
+ *   <tcpflow:result scanner="python" path=".." module=".." function="..">item</tcpflow:result>
+ *
+ * The memoryviews are read-only and look at the flow where tcpflow has
+ * it, mapped from its transcript or in memory, without a copy; they are
+ * released when the function returns, so the function must copy
+ * (bytes(view)) anything it wants to keep.
+ *
+ * The interpreter is started once, and tcpflow holds the GIL only while
+ * a batch is being delivered. With -S scan_threads each scan thread takes
+ * up to -S py_batch finished flows at a time, runs the other scanners on
+ * them one at a time as before, and then gives them all to the function
+ * at once, outside the scanners' lock, so the other scan threads and the
+ * packet threads go on while Python works. Without scan threads each
+ * flow is a batch of its own.
+ *
+ * This source code is under the GNU Public License (GPL).  See
+ * LICENSE for details.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+#include <vector>
+
+class python_host {
+public:
+    /* A finished flow, as the function sees it; data must stay valid until deliver() returns */
+    struct flow_view {
+        const std::string *name;
+        const uint8_t     *data;
+        size_t             length;
+        std::string       *xmladd;      // where the result goes
+    };
+
+    static std::string path;            // -S py_path: directory of the module, before sys.path
+    static std::string module;          // -S py_module
+    static std::string function;        // -S py_function
+    static uint32_t    batch_size;      // -S py_batch: flows a scan thread gives the function at once
+
+    static bool running();              // start() found the function
+    /* Start the interpreter and find the function; main thread, before there are scan threads */
+    static int  start(std::string &error);
+    static void stop();                 // after the last deliver()
+    /* Call the function on the batch; from any thread */
+    static void deliver(const std::vector<flow_view> &batch);
+};
+
+#endif
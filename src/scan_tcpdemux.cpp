@@ -15,6 +15,11 @@
 #include "tcpflow.h"
 #include "tcpip.h"
 #include "tcpdemux.h"
+#include "tcpdemux_pool.h"
+#include "cmd_pool.h"
+#include "pcap_index.h"
+#include "segment_coalescer.h"
+#include "resume_filter.h"
 #include <iostream>
 #include <sys/types.h>
 #include "bulk_extractor_i.h"
@@ -24,7 +29,13 @@
  */ 
 static void packet_handler(void *user,const be13::packet_info &pi)
 {
-    reinterpret_cast<tcpdemux *>(user)->process_pkt(pi);
+    tcpdemux *demux = reinterpret_cast<tcpdemux *>(user);
+    tcpdemux *local = tcpdemux::getInstance();
+    if(!resume_filter::wanted(pi)) return;  // a -R packet of no open flow
+    if(pcap_index::building) pcap_index::building->add(pi);
+    if(local!=demux) segment_coalescer::offer(*local,pi); // a thread feeding its own demux (a capture ring or an independent input)
+    else if(demux->pool) demux->pool->dispatch(pi);
+    else segment_coalescer::offer(*demux,pi);
 }
 
 extern "C"
@@ -45,7 +56,49 @@ void  scan_tcpdemux(const class scanner_params &sp,const recursion_control_block
         
         sp.info->get_config("tcp_timeout",&tcpdemux::getInstance()->tcp_timeout,"Timeout for TCP connections");
         sp.info->get_config("tcp_cmd",&tcpdemux::getInstance()->tcp_cmd,"Command to execute on each TCP flow");
+        sp.info->get_config("tcp_cmd_workers",&cmd_pool::workers,"Long-running tcp_cmd processes that are sent each flow on their input, instead of a shell per flow");
+        sp.info->get_config("tcp_cmd_queue",&cmd_pool::queue_max,"Flows sent to a tcp_cmd worker that it has not answered yet");
         sp.info->get_config("tcp_alert_fd",&tcpdemux::getInstance()->tcp_alert_fd,"File descriptor to send information about completed TCP flows");
+        sp.info->get_config("max_saved_flows",&tcpdemux::max_saved_flows,"Number of closed flows remembered for matching straggling packets");
+        sp.info->get_config("saved_flow_tail",&tcpdemux::saved_flow_tail,"Bytes at the end of each remembered flow kept in memory");
+        sp.info->get_config("write_buffer_size",&tcpdemux::write_buffer_size,"Bytes of contiguous data buffered per flow before writing");
+        sp.info->get_config("write_buffer_max",&tcpdemux::write_buffer_max,"Bytes buffered for all flows before the largest buffers are flushed");
+        sp.info->get_config("reorder_window",&tcpdemux::reorder_window,"Bytes of out-of-order data held in memory per flow until the gap before it is filled");
+        sp.info->get_config("reorder_max",&tcpdemux::reorder_max,"Bytes of out-of-order data held for all flows together; past it, segments are written in place");
+        sp.info->get_config("stage_bytes",&tcpdemux::stage_bytes,"Flows up to this many bytes are kept in memory and written with one write when they finish; 0 opens each flow's file at once");
+        sp.info->get_config("syn_table",&tcpdemux::syn_table_size,"Connections that have only sent a SYN kept in a fixed table instead of as flows; 0 makes a flow of each SYN");
+        sp.info->get_config("syn_timeout",&tcpdemux::syn_timeout,"Seconds a syn_table record waits for the SYN/ACK or data");
+        sp.info->get_config("flow_sample",&tcpdemux::flow_sample,"Keep 1 connection in N, chosen by a hash of its addresses and ports; 1 keeps them all");
+        sp.info->get_config("pin_cpus",&tcpdemux_pool::cpu_list,"CPUs for the --threads workers, e.g. 0-3,8-11");
+        sp.info->get_config("packet_index_text",&tcpdemux::packet_index_text,"With -I, write the text .findx index instead of the binary .findb");
+        sp.info->get_config("coalesce",&segment_coalescer::enabled,"Take runs of in-order data segments of a flow in a packet batch through the demultiplexer together");
+        sp.info->get_config("exact_fd_lru",&tcpdemux::exact_fd_lru,"Close the least recently used file when out of descriptors, instead of CLOCK");
+        sp.info->get_config("io_uring",&uring_writer::enabled,"Write transcripts and HTTP bodies asynchronously with io_uring");
+        sp.info->get_config("io_uring_depth",&uring_writer::queue_depth,"Writes in flight at once with io_uring");
+        sp.info->get_config("io_uring_buffer",&uring_writer::buffer_size,"Bytes in each registered io_uring buffer");
+        sp.info->get_config("segment_size",&segment_store::segment_size,"Bytes in each --segments file before the next one is started");
+        std::string compress("none");
+        sp.info->get_config("compress",&compress,"Compress transcripts as they are written: none or zstd");
+        sp.info->get_config("compress_level",&zstd_transcript::level,"zstd level for -S compress=zstd");
+        sp.info->get_config("compress_frame",&zstd_transcript::frame_size,"Bytes of a flow in each zstd frame of a compressed transcript");
+        if(compress=="zstd"){
+            if(!zstd_transcript::available()){
+                std::cerr << "compress=zstd: tcpflow was built without libzstd\n";
+                exit(1);
+            }
+            tcpdemux::getInstance()->opt.output_zstd = true;
+        } else if(compress!="none"){
+            std::cerr << "compress must be none or zstd\n";
+            exit(1);
+        }
+        sp.info->get_config("ip_defrag",&ip_reassembler::enabled,"Reassemble fragmented IPv4 and IPv6 datagrams");
+        sp.info->get_config("ip_defrag_memory",&ip_reassembler::memory_budget,"Bytes of IP fragments held for reassembly");
+        sp.info->get_config("ip_defrag_timeout",&ip_reassembler::timeout,"Seconds a fragmented datagram may wait for the rest of it");
+        sp.info->get_config("ip_defrag_overlap",&ip_reassembler::overlap_policy,"Overlapping IP fragments: first or last wins");
+        if(ip_reassembler::overlap_policy!="first" && ip_reassembler::overlap_policy!="last"){
+            std::cerr << "ip_defrag_overlap must be first or last\n";
+            exit(1);
+        }
 
         return;     /* No feature files created */
     }
@@ -5,6 +5,8 @@
  */
 
 #include "config.h"
+#include <algorithm>
+#include <iomanip>
 #include <iostream>
 #include <sys/types.h>
 
@@ -28,14 +30,37 @@ void  scan_wifiviz(const class scanner_params &sp,const recursion_control_block
 	sp.info->packet_user = 0;
         sp.info->description = "Performs wifi isualization";
         sp.info->get_config("check_fcs",&TFCB::theTFCB.opt_check_fcs,"Require valid Frame Check Sum (FCS)");
+        sp.info->get_config("wifiviz_max_aps",&TFCB::theTFCB.max_aps,"Most MAC and SSID pairs to count beacons for (0 for no limit)");
+        sp.info->get_config("wifiviz_ap_times",&TFCB::theTFCB.opt_ap_times,"Report when each MAC and SSID was first and last seen");
     }
     if(sp.phase==scanner_params::PHASE_SHUTDOWN){
         if(sp.sxml){
-            (*sp.sxml) << "<ssids>\n";
-            for(TFCB::mac_ssid_map_t::const_iterator it=TFCB::theTFCB.mac_to_ssid.begin();
-                it!=TFCB::theTFCB.mac_to_ssid.end();it++){
-                (*sp.sxml) << "  <ssid mac='" << (*it).first.mac <<"' ssid='" << dfxml_writer::xmlescape((*it).first.ssid) << "' count='" <<
-                    (*it).second << "'/>\n";
+            const TFCB &cb = TFCB::theTFCB;
+            /* in MAC and then SSID order, as they were reported when they were kept in a map */
+            std::vector<TFCB::ap_map_t::const_iterator> sorted;
+            for(TFCB::ap_map_t::const_iterator it=cb.aps.begin();it!=cb.aps.end();it++){
+                sorted.push_back(it);
+            }
+            std::sort(sorted.begin(),sorted.end(),
+                      [&cb](const TFCB::ap_map_t::const_iterator &a,const TFCB::ap_map_t::const_iterator &b){
+                          if(a->first.mac!=b->first.mac) return a->first.mac < b->first.mac;
+                          return cb.ssids[a->first.ssid] < cb.ssids[b->first.ssid];
+                      });
+            if(cb.dropped_beacons>0){
+                (*sp.sxml) << "<ssids dropped_beacons='" << cb.dropped_beacons << "'>\n";
+            } else {
+                (*sp.sxml) << "<ssids>\n";
+            }
+            for(std::vector<TFCB::ap_map_t::const_iterator>::const_iterator it=sorted.begin();it!=sorted.end();it++){
+                const TFCB::ap_info &info = (*it)->second;
+                (*sp.sxml) << "  <ssid mac='" << MAC((*it)->first.mac) <<"' ssid='"
+                           << dfxml_writer::xmlescape(cb.ssids[(*it)->first.ssid]) << "' count='" << info.count << "'";
+                if(cb.opt_ap_times){
+                    (*sp.sxml) << " first_seen='" << info.first_seen.tv_sec << "." << std::setfill('0') << std::setw(6)
+                               << info.first_seen.tv_usec << "' last_seen='" << info.last_seen.tv_sec << "."
+                               << std::setw(6) << info.last_seen.tv_usec << std::setfill(' ') << "'";
+                }
+                (*sp.sxml) << "/>\n";
             }
             (*sp.sxml) << "</ssids>\n";
         }
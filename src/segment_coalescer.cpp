@@ -0,0 +1,113 @@
+/*
+ * segment_coalescer.cpp:
+ *
+ * Runs of in-order data segments of one flow. See segment_coalescer.h
+ *
+ * This source code is under the GNU Public License (GPL).  See
+ * LICENSE for details.
+ */
+
+#include "tcpflow.h"
+#include "tcpip.h"
+#include "tcpdemux.h"
+#include "packet_batch.h"
+#include "segment_coalescer.h"
+
+/* static */ bool segment_coalescer::enabled = true;
+
+/* static */ segment_coalescer::state &segment_coalescer::thread_state()
+{
+    static thread_local state s;
+    return s;
+}
+
+/* Only the flags that tell tcpdemux::process_tcp() nothing may be set */
+static const uint8_t RUN_FLAGS = 0x10 | 0x08 | 0x40 | 0x80; // ACK, PSH, ECE, CWR
+
+/* static */ bool segment_coalescer::parse(const be13::packet_info &pi,flow_addr &key,segment &s)
+{
+    const uint8_t *ip = pi.ip_data;
+    size_t tcp_offset = 0;
+    uint32_t tcp_length = 0;
+    switch(pi.ip_version()){
+    case 4: {
+        if(pi.ip_datalen < sizeof(struct be13::ip4) || ip[9]!=IPPROTO_TCP) return false;
+        if(((ip[6]<<8) | ip[7]) & 0x3fff) return false; // a fragment, for ip_reassembler
+        tcp_offset = (ip[0] & 0x0f) * 4;
+        if(tcp_offset > (size_t)((ip[2]<<8) | ip[3]) || tcp_offset > pi.ip_datalen) return false;
+        tcp_length = (uint16_t)(pi.ip_datalen - tcp_offset);
+        memcpy(key.src.addr,ip+12,4);
+        memcpy(key.dst.addr,ip+16,4);
+        key.family = AF_INET;
+        break;
+    }
+    case 6: {
+        ip6_headers headers;
+        if(!headers.walk(ip,pi.ip_datalen) || headers.fragment || headers.proto!=IPPROTO_TCP) return false;
+        size_t ip_len = 40 + ((ip[4]<<8) | ip[5]);
+        if(ip_len < headers.offset) return false;
+        tcp_offset = headers.offset;
+        tcp_length = (uint16_t)(ip_len - headers.offset);
+        memcpy(key.src.addr,ip+8,16);
+        memcpy(key.dst.addr,ip+24,16);
+        key.family = AF_INET6;
+        break;
+    }
+    default:
+        return false;
+    }
+    if(tcp_length < sizeof(struct be13::tcphdr) || tcp_offset+tcp_length > pi.ip_datalen) return false;
+    const uint8_t *th = ip + tcp_offset;
+    uint8_t flags = th[13];
+    if((flags & ~RUN_FLAGS) || !(flags & 0x10)) return false; // SYN, FIN, RST and URG go the usual way
+    size_t header_len = (th[12]>>4) * 4;
+    if(tcp_length <= header_len) return false;                 // no data
+    key.sport    = (th[0]<<8) | th[1];
+    key.dport    = (th[2]<<8) | th[3];
+    s.hdr        = *pi.pcap_hdr;
+    s.ts         = pi.ts;
+    s.dlt        = pi.pcap_dlt;
+    s.data       = pi.pcap_data;
+    s.ip_data    = pi.ip_data;
+    s.ip_datalen = pi.ip_datalen;
+    s.tcp_length = tcp_length;
+    s.seq        = (uint32_t)th[4]<<24 | (uint32_t)th[5]<<16 | (uint32_t)th[6]<<8 | th[7];
+    s.payload    = th + header_len;
+    s.length     = tcp_length - header_len;
+    return true;
+}
+
+/* static */ void segment_coalescer::offer(tcpdemux &demux,const be13::packet_info &pi)
+{
+    state &st = thread_state();
+    flow_addr key;
+    segment s;
+    if(!enabled || !demux.coalesce || !packet_batch::flushing() || !parse(pi,key,s)){
+        flush();                        // the packets stay in order
+        demux.process_pkt(pi);
+        return;
+    }
+    if(st.run.size()>0 && (st.demux!=&demux || !(st.key==key) || st.next!=s.seq)){
+        flush();
+    }
+    if(st.run.empty()){
+        st.demux = &demux;
+        st.key   = key;
+    }
+    st.run.push_back(s);
+    st.next = s.seq + s.length;
+}
+
+/* static */ void segment_coalescer::flush()
+{
+    state &st = thread_state();
+    if(st.run.empty()) return;
+    if(st.run.size()==1){
+        const segment &s = st.run[0];
+        be13::packet_info pi(s.dlt,&s.hdr,s.data,s.ts,s.ip_data,s.ip_datalen);
+        st.demux->process_pkt(pi);
+    } else {
+        st.demux->process_run(st.run,st.key);
+    }
+    st.run.clear();
+}
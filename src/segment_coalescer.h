@@ -0,0 +1,73 @@
+#ifndef SEGMENT_COALESCER_H
+#define SEGMENT_COALESCER_H
+
+/**
+ * segment_coalescer.h
+ *
+ * Consecutive in-order data segments of one flow, as a bulk transfer
+ * gives them, taken through tcpdemux together (as GRO does in the kernel).
+ *
+ * While packet_batch::flush() hands a batch to the plugins, tcpdemux's
+ * packet handler gives each packet to offer() instead of process_pkt().
+ * A TCP segment with data and no flags but ACK (and PSH, ECE, CWR) whose
+ * sequence number is where the one before it in the same flow ended is
+ * held with it; anything else ends the run. A run of one is given to
+ * process_pkt() as it was; a longer one to tcpdemux::process_run(), which
+ * processes the first packet as usual and then the rest with one flow
+ * lookup, one timer and LRU update, and their len, caplen and
+ * packet_count added up. Each payload is still stored with its own
+ * timestamp, so -I keeps a record for each packet.
+ *
+ * The packets stay where packet_batch has them until it has called
+ * flush(), after the last packet of the batch.
+ *
+ * No runs are made for -c/-C, -K or -S json_events with segments, which
+ * see each packet, nor with --threads, whose dispatcher copies each packet
+ * to its worker. -S coalesce=0 turns it off.
+ *
+ * Include after tcpip.h.
+ *
+ * This source code is under the GNU Public License (GPL).  See
+ * LICENSE for details.
+ */
+
+#include <vector>
+
+class segment_coalescer {
+public:
+    static bool enabled;                // -S coalesce
+
+    /* A held packet: what packet_batch keeps of it, and its TCP data */
+    struct segment {
+        struct pcap_pkthdr hdr;
+        struct timeval     ts;
+        int                dlt;
+        const u_char       *data;
+        const uint8_t      *ip_data;
+        uint32_t           ip_datalen;
+        uint32_t           tcp_length;  // the IP payload, as process_ip4() and process_ip6() count it
+        be13::tcp_seq      seq;
+        const u_char       *payload;
+        uint32_t           length;
+    };
+    typedef std::vector<segment> run_t;
+
+    /* From the packet handler; pi is processed now, or held for a run */
+    static void offer(class tcpdemux &demux,const be13::packet_info &pi);
+    static void flush();                // process the run that is held; from packet_batch::flush()
+
+    /* The flow and data of pi, if it can be part of a run */
+    static bool parse(const be13::packet_info &pi,flow_addr &key,segment &s);
+
+private:
+    struct state {
+        state():demux(0),key(),next(0),run(){}
+        class tcpdemux *demux;
+        flow_addr      key;
+        be13::tcp_seq  next;            // where the next segment of the run starts
+        run_t          run;
+    };
+    static state &thread_state();
+};
+
+#endif
@@ -0,0 +1,197 @@
+/*
+ * segment_reader.cpp:
+ *
+ * Read flows back out of --segments output. See segment_reader.h
+ *
+ * This source code is under the GNU Public License (GPL).  See
+ * LICENSE for details.
+ */
+
+#include "segment_reader.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+std::string segment_filename(const std::string &base,uint32_t segment)
+{
+    char buf[16];
+    snprintf(buf,sizeof(buf),"-%06u",segment);
+    return base + buf;
+}
+
+int segment_read(const std::string &base,const segment_extents &extents,
+                 uint64_t offset,uint8_t *buf,size_t length)
+{
+    memset(buf,0,length);
+    int      fd = -1;
+    uint32_t fd_segment = 0;
+    int      r = 0;
+    for(segment_extents::const_iterator it=extents.begin();it!=extents.end() && r==0;it++){
+        uint64_t start = std::max(it->offset,offset);
+        uint64_t end   = std::min(it->offset+it->length,offset+length);
+        if(start>=end) continue;
+        if(fd<0 || fd_segment!=it->segment){
+            if(fd>=0) close(fd);
+            fd = ::open(segment_filename(base,it->segment).c_str(),O_RDONLY|O_BINARY);
+            fd_segment = it->segment;
+            if(fd<0){
+                r = -1;
+                break;
+            }
+        }
+        size_t  n = end-start;
+        ssize_t got = pread(fd,buf+(start-offset),n,(off_t)(it->segment_offset+(start-it->offset)));
+        if(got!=(ssize_t)n){
+            if(got>=0) errno = EIO;     // the segment is shorter than the index says
+            r = -1;
+        }
+    }
+    if(fd>=0){
+        int saved = errno;
+        close(fd);
+        errno = saved;
+    }
+    return r;
+}
+
+/* seconds.microseconds */
+static bool parse_time(const std::string &s,struct timeval &tv)
+{
+    char *end = 0;
+    tv.tv_sec  = strtol(s.c_str(),&end,10);
+    tv.tv_usec = 0;
+    if(*end=='.') tv.tv_usec = strtol(end+1,&end,10);
+    return *end=='\0';
+}
+
+int segment_reader::read_index(const std::string &path,std::string &error)
+{
+    std::ifstream in(path.c_str());
+    if(!in.is_open()){
+        error = path + ": " + strerror(errno);
+        return -1;
+    }
+    std::string base = path.substr(0,path.size()-4); // without .idx
+    std::string line;
+    unsigned lineno = 0;
+    while(std::getline(in,line)){
+        lineno++;
+        if(line.empty() || line[0]=='#') continue;
+        std::vector<std::string> f;
+        std::stringstream ss(line);
+        std::string field;
+        while(std::getline(ss,field,'\t')) f.push_back(field);
+        struct timeval tstart,tlast;
+        if(f.size()!=8 || !parse_time(f[6],tstart) || !parse_time(f[7],tlast)){
+            std::stringstream e;
+            e << path << ":" << lineno << ": malformed index line";
+            error = e.str();
+            return -1;
+        }
+        uint64_t session_id = strtoull(f[1].c_str(),0,10);
+        segment_extent e(strtoull(f[2].c_str(),0,10),strtoull(f[3].c_str(),0,10),
+                         (uint32_t)strtoul(f[4].c_str(),0,10),strtoull(f[5].c_str(),0,10));
+
+        /* the lines of an object are together */
+        if(objs.empty() || objs.back().name!=f[0] || objs.back().session_id!=session_id
+           || objs.back().base!=base){
+            objs.push_back(object());
+            objs.back().name       = f[0];
+            objs.back().session_id = session_id;
+            objs.back().base       = base;
+        }
+        object &obj = objs.back();
+        obj.tstart = tstart;
+        obj.tlast  = tlast;
+        obj.length = std::max(obj.length,e.offset+e.length);
+        obj.extents.push_back(e);
+    }
+    return 0;
+}
+
+int segment_reader::open(std::string &error)
+{
+    DIR *dirp = opendir(dir.c_str());
+    if(dirp==0){
+        error = dir + ": " + strerror(errno);
+        return -1;
+    }
+    std::vector<std::string> indexes;
+    struct dirent *dp = 0;
+    while((dp=readdir(dirp))!=0){
+        std::string fn(dp->d_name);
+        if(fn.compare(0,8,"segment-")==0 && fn.size()>4 && fn.compare(fn.size()-4,4,".idx")==0){
+            indexes.push_back(dir + "/" + fn);
+        }
+    }
+    closedir(dirp);
+    std::sort(indexes.begin(),indexes.end());
+
+    objs.clear();
+    for(std::vector<std::string>::const_iterator it=indexes.begin();it!=indexes.end();it++){
+        if(read_index(*it,error)) return -1;
+    }
+    return 0;
+}
+
+std::vector<const segment_reader::object *> segment_reader::find(const std::string &name) const
+{
+    std::vector<const object *> found;
+    for(objects_t::const_iterator it=objs.begin();it!=objs.end();it++){
+        if(it->name==name) found.push_back(&*it);
+    }
+    return found;
+}
+
+int segment_reader::read(const object &obj,std::string &data,std::string &error) const
+{
+    data.resize(obj.length);
+    if(obj.length==0) return 0;
+    if(segment_read(obj.base,obj.extents,0,(uint8_t *)&data[0],obj.length)){
+        error = obj.name + ": " + strerror(errno);
+        data.clear();
+        return -1;
+    }
+    return 0;
+}
+
+/* Extent by extent, so that a large flow does not have to fit in memory */
+int segment_reader::extract(const object &obj,const std::string &path,std::string &error) const
+{
+    int fd = ::open(path.c_str(),O_WRONLY|O_CREAT|O_TRUNC|O_BINARY,0666);
+    if(fd<0){
+        error = path + ": " + strerror(errno);
+        return -1;
+    }
+    std::vector<uint8_t> buf;
+    int r = 0;
+    for(segment_extents::const_iterator it=obj.extents.begin();it!=obj.extents.end() && r==0;it++){
+        segment_extents one(1,*it);
+        buf.resize(it->length);
+        if(it->length==0) continue;
+        if(segment_read(obj.base,one,it->offset,&buf[0],it->length)
+           || pwrite(fd,&buf[0],it->length,(off_t)it->offset)!=(ssize_t)it->length){
+            error = path + ": " + strerror(errno);
+            r = -1;
+        }
+    }
+    if(r==0 && ftruncate(fd,(off_t)obj.length)){ // a hole at the end
+        error = path + ": " + strerror(errno);
+        r = -1;
+    }
+    close(fd);
+    return r;
+}
@@ -0,0 +1,96 @@
+/*
+ * segment_reader.h:
+ *
+ * Read flows back out of --segments output.
+ *
+ * With --segments, tcpflow does not create a file per flow. The data
+ * of every flow (and every HTTP body) is appended to large segment
+ * files, and an index says where each piece went:
+ *
+ *   outdir/segment-SS-NNNNNN   segment NNNNNN of worker SS, segment_size bytes or so
+ *   outdir/segment-SS.idx      one line per extent, written when its flow is finished
+ *
+ * An index line has tab-separated fields:
+ *
+ *   name  session_id  offset  length  segment  segment_offset  tstart  tlast
+ *
+ * name is the file the flow would have been written to, relative to
+ * outdir (so it carries the flow key, as the filename template has it);
+ * offset and length are where the extent goes in the flow; segment and
+ * segment_offset are where it is stored; tstart and tlast are the times
+ * of the flow's first and last packets, as seconds.microseconds. When
+ * extents overlap the later line wins, as a later write to the same
+ * place in a file would have.
+ *
+ * This is used by tcpflow-extract, and has no dependencies on the rest
+ * of tcpflow so that other programs can use it too.
+ *
+ * This source code is under the GNU Public License (GPL).  See
+ * LICENSE for details.
+ */
+
+#ifndef SEGMENT_READER_H
+#define SEGMENT_READER_H
+
+#include <stdint.h>
+#include <sys/time.h>
+#include <string>
+#include <vector>
+
+/* A piece of an object (a flow or an HTTP body) stored in a segment */
+struct segment_extent {
+    segment_extent():offset(0),length(0),segment(0),segment_offset(0){}
+    segment_extent(uint64_t offset_,uint64_t length_,uint32_t segment_,uint64_t segment_offset_):
+        offset(offset_),length(length_),segment(segment_),segment_offset(segment_offset_){}
+    uint64_t offset;                    // in the object
+    uint64_t length;
+    uint32_t segment;                   // which segment file
+    uint64_t segment_offset;            // where in it
+};
+typedef std::vector<segment_extent> segment_extents;
+
+/* "segment-SS-NNNNNN" given "segment-SS" */
+std::string segment_filename(const std::string &base,uint32_t segment);
+
+/* Read length bytes at offset in the object made of extents into buf.
+ * Bytes that no extent covers are zero. Returns 0, or -1 with errno set.
+ */
+int segment_read(const std::string &base,const segment_extents &extents,
+                 uint64_t offset,uint8_t *buf,size_t length);
+
+class segment_reader {
+public:
+    struct object {
+        object():name(),session_id(0),tstart(),tlast(),length(0),base(),extents(){}
+        std::string     name;
+        uint64_t        session_id;
+        struct timeval  tstart;
+        struct timeval  tlast;
+        uint64_t        length;         // bytes, to the end of the last extent
+        std::string     base;           // path of its segments, without the number
+        segment_extents extents;        // in the order they were written
+    };
+    typedef std::vector<object> objects_t;
+
+    explicit segment_reader(const std::string &dir_):dir(dir_),objs(){}
+
+    /* Read every index in dir. Returns 0, or -1 with error set. */
+    int open(std::string &error);
+
+    const objects_t &objects() const { return objs; }
+    /* The objects called name, in the order they were finished */
+    std::vector<const object *> find(const std::string &name) const;
+
+    /* The whole of an object */
+    int read(const object &obj,std::string &data,std::string &error) const;
+    /* Write an object to path. Returns 0, or -1 with error set. */
+    int extract(const object &obj,const std::string &path,std::string &error) const;
+
+private:
+    int read_index(const std::string &path,std::string &error);
+
+    std::string dir;
+    objects_t   objs;
+};
+
+#endif
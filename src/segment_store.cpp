@@ -0,0 +1,121 @@
+/*
+ * segment_store.cpp:
+ *
+ * Rolling segment output. See segment_store.h
+ *
+ * This source code is under the GNU Public License (GPL).  See
+ * LICENSE for details.
+ */
+
+#include "tcpflow.h"
+#include "tcpip.h"
+#include "tcpdemux.h"
+#include "segment_store.h"
+
+/* static */ uint64_t segment_store::segment_size = 1024*1024*1024;
+
+segment_store::segment_store(tcpdemux &demux_,const std::string &dir_,unsigned int shard):
+    demux(demux_),dir(dir_),base(),fd(-1),segment(0),size(0),index(0),bytes(0),segments(0)
+{
+    char buf[32];
+    snprintf(buf,sizeof(buf),"segment-%02u",shard);
+    base = (dir.size()>0 ? dir+"/" : std::string()) + buf;
+    std::string ipath = base + ".idx";
+    index = fopen(ipath.c_str(),"a");
+    if(index==0) die("cannot open %s: %s",ipath.c_str(),strerror(errno));
+    if(ftell(index)==0) fprintf(index,"# name\tsession_id\toffset\tlength\tsegment\tsegment_offset\ttstart\ttlast\n");
+
+    /* carry on after the segments of an earlier run into the same outdir */
+    struct stat st;
+    while(stat(segment_filename(base,segment).c_str(),&st)==0) segment++;
+}
+
+segment_store::~segment_store()
+{
+    if(fd>=0){
+        demux.sync_file(fd);
+        close(fd);
+    }
+    if(index) fclose(index);
+}
+
+int segment_store::roll()
+{
+    if(fd>=0){
+        demux.sync_file(fd);
+        close(fd);
+        segment++;
+    }
+    std::string fn = segment_filename(base,segment);
+    fd = demux.retrying_open(fn,O_RDWR|O_BINARY|O_CREAT|O_EXCL,0666);
+    size = 0;
+    if(fd<0){
+        perror(fn.c_str());
+        return -1;
+    }
+    segments++;
+    DEBUG(5)("%s: new segment",fn.c_str());
+    return 0;
+}
+
+int segment_store::current_fd()
+{
+    if(fd<0) roll();
+    return fd;
+}
+
+int segment_store::append(segment_extents &extents,uint64_t offset,const void *data,size_t length)
+{
+    if(length==0) return 0;
+    if(fd<0 || (size>0 && size+length > segment_size)){
+        if(roll()) return -1;
+    }
+    /* a write that carries on from the object's last one, in the same place, extends it */
+    if(extents.size()>0){
+        segment_extent &last = extents.back();
+        if(last.segment==segment && last.segment_offset+last.length==size
+           && last.offset+last.length==offset){
+            last.length += length;
+        } else {
+            extents.push_back(segment_extent(offset,length,segment,size));
+        }
+    } else {
+        extents.push_back(segment_extent(offset,length,segment,size));
+    }
+    demux.write_file(fd,data,length,size);
+    size  += length;
+    bytes += length;
+    return 0;
+}
+
+int segment_store::read(const segment_extents &extents,uint64_t offset,uint8_t *buf,size_t length)
+{
+    demux.sync_file(fd);                // the current segment may have writes queued
+    return segment_read(base,extents,offset,buf,length);
+}
+
+void segment_store::sync()
+{
+    demux.sync_file(fd);
+}
+
+void segment_store::commit(const std::string &name,uint64_t session_id,
+                           const struct timeval &tstart,const struct timeval &tlast,
+                           const segment_extents &extents)
+{
+    std::string rel(name);
+    if(dir.size()>0 && rel.compare(0,dir.size()+1,dir+"/")==0) rel.erase(0,dir.size()+1);
+    for(segment_extents::const_iterator it=extents.begin();it!=extents.end();it++){
+        fprintf(index,"%s\t%" PRIu64 "\t%" PRIu64 "\t%" PRIu64 "\t%u\t%" PRIu64 "\t%ld.%06ld\t%ld.%06ld\n",
+                rel.c_str(),session_id,it->offset,it->length,it->segment,it->segment_offset,
+                (long)tstart.tv_sec,(long)tstart.tv_usec,(long)tlast.tv_sec,(long)tlast.tv_usec);
+    }
+    if(ferror(index)) DEBUG(1)("write to %s.idx failed",base.c_str());
+}
+
+/* static */ void segment_store::shift(segment_extents &extents,uint64_t insert_bytes)
+{
+    for(segment_extents::iterator it=extents.begin();it!=extents.end();it++){
+        it->offset += insert_bytes;
+    }
+}
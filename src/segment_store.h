@@ -0,0 +1,67 @@
+/*
+ * segment_store.h:
+ *
+ * Write flows into rolling segment files instead of a file per flow
+ * (--segments). See segment_reader.h for the layout and the index.
+ *
+ * Each flow keeps the list of its extents in memory while it is open;
+ * the extents are appended to the index when it is finished, so that
+ * prepending to a flow only has to move offsets in the list. Data is
+ * written with tcpdemux::write_file(), so -S io_uring=1 applies to it.
+ *
+ * Not thread-safe; each tcpdemux has its own, used by the thread that
+ * runs it.
+ *
+ * This source code is under the GNU Public License (GPL).  See
+ * LICENSE for details.
+ */
+
+#ifndef SEGMENT_STORE_H
+#define SEGMENT_STORE_H
+
+#include "tcpflow.h"
+#include "segment_reader.h"
+
+class segment_store {
+    segment_store(const segment_store &);
+    segment_store &operator=(const segment_store &);
+
+    class tcpdemux &demux;
+    std::string dir;
+    std::string base;                   // dir/segment-SS
+    int         fd;                     // the segment being appended to
+    uint32_t    segment;                // its number
+    uint64_t    size;                   // and how much is in it
+    FILE        *index;
+
+    int  roll();                        // start the next segment
+
+public:
+    static uint64_t segment_size;       // -S segment_size; a new segment is started past this
+
+    segment_store(class tcpdemux &demux_,const std::string &dir_,unsigned int shard);
+    ~segment_store();                   // waits for every write and closes the index
+
+    /* The segment now being appended to, started if need be; -1 if it cannot be */
+    int  current_fd();
+    /* Append length bytes that go at offset in an object.
+     * Returns 0, or -1 if the data could not be stored.
+     */
+    int  append(segment_extents &extents,uint64_t offset,const void *data,size_t length);
+    /* Read back part of an object; see segment_read() */
+    int  read(const segment_extents &extents,uint64_t offset,uint8_t *buf,size_t length);
+    /* Wait for the writes to the current segment, so that segment_read() sees them */
+    void sync();
+    const std::string &base_path() const { return base; } // for segment_read()
+    /* Write the object's index lines; name is made relative to dir */
+    void commit(const std::string &name,uint64_t session_id,
+                const struct timeval &tstart,const struct timeval &tlast,
+                const segment_extents &extents);
+    static void shift(segment_extents &extents,uint64_t insert_bytes); // the object's data moved up
+
+    /* statistics */
+    uint64_t bytes;
+    uint32_t segments;
+};
+
+#endif
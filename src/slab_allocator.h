@@ -0,0 +1,80 @@
+#ifndef SLAB_ALLOCATOR_H
+#define SLAB_ALLOCATOR_H
+
+#include <vector>
+#include <cstddef>
+#include <type_traits>
+
+// A fixed-size object pool.
+//
+// Memory is taken from the heap in slabs of OBJECTS_PER_SLAB objects and
+// recycled through a free list, so creating and destroying objects of the
+// same type does not go through malloc. Slabs are only returned when the
+// allocator is destroyed; every object must have been released by then.
+//
+// Not thread-safe: each tcpdemux (and so each worker thread) has its own.
+//
+//   void *mem = slab.alloc();
+//   T *t = new (mem) T(...);
+//   ...
+//   t->~T();
+//   slab.release(t);
+
+template <class T>
+class slab_allocator {
+  union node {
+    node *next;
+    typename std::aligned_storage<sizeof(T),std::alignment_of<T>::value>::type storage;
+  };
+
+  slab_allocator(const slab_allocator &);
+  slab_allocator &operator=(const slab_allocator &);
+
+  public:
+  enum { OBJECTS_PER_SLAB = 256 };
+
+  slab_allocator():slabs(), free_list(0), used(0), peak_used(0) {}
+  ~slab_allocator() {
+    for (typename std::vector<node *>::iterator it = slabs.begin(); it != slabs.end(); it++) {
+      delete [] *it;
+    }
+  }
+
+  inline void *alloc() {
+    if (free_list == 0) grow();
+    node *n = free_list;
+    free_list = n->next;
+    if (++used > peak_used) peak_used = used;
+    return &n->storage;
+  }
+
+  inline void release(void *p) {
+    node *n = reinterpret_cast<node *>(p);
+    n->next = free_list;
+    free_list = n;
+    used--;
+  }
+
+  /* stats */
+  size_t in_use() const { return used; }
+  size_t peak() const { return peak_used; }
+  size_t capacity() const { return slabs.size() * OBJECTS_PER_SLAB; }
+  size_t slab_count() const { return slabs.size(); }
+
+  private:
+  void grow() {
+    node *slab = new node[OBJECTS_PER_SLAB];
+    slabs.push_back(slab);
+    for (size_t i = OBJECTS_PER_SLAB; i > 0; i--) {   // so that alloc() hands them out in order
+      slab[i-1].next = free_list;
+      free_list = &slab[i-1];
+    }
+  }
+
+  std::vector<node *> slabs;
+  node *free_list;
+  size_t used;
+  size_t peak_used;
+};
+
+#endif // SLAB_ALLOCATOR_H
@@ -0,0 +1,38 @@
+/*
+ * stream_scan.cpp:
+ *
+ * See stream_scan.h
+ *
+ * This source code is under the GNU Public License (GPL).  See
+ * LICENSE for details.
+ */
+
+#include "stream_scan.h"
+
+#include <map>
+#include <mutex>
+
+static std::mutex                      done_M;
+static std::map<std::string,unsigned>  done_flows; // name -> scanner_t bits
+
+/* static */ void stream_scan::done(const std::string &name,scanner_t s)
+{
+    std::lock_guard<std::mutex> lock(done_M);
+    done_flows[name] |= s;
+}
+
+/* static */ bool stream_scan::take(const std::string &name,scanner_t s)
+{
+    std::lock_guard<std::mutex> lock(done_M);
+    std::map<std::string,unsigned>::iterator it = done_flows.find(name);
+    if(it==done_flows.end() || (it->second & s)==0) return false;
+    it->second &= ~(unsigned)s;
+    if(it->second==0) done_flows.erase(it);
+    return true;
+}
+
+/* static */ void stream_scan::forget(const std::string &name)
+{
+    std::lock_guard<std::mutex> lock(done_M);
+    done_flows.erase(name);
+}
@@ -0,0 +1,30 @@
+/*
+ * stream_scan.h:
+ *
+ * Scanners whose work was done while a flow was being stored.
+ *
+ * tcpdemux::post_process() marks a finished flow, by the name it is
+ * scanned as, for each scanner that has nothing left to do with it: the
+ * HTTP responses were parsed by http_stream, or the MD5 was computed as
+ * the bytes were written. The scanner takes the mark in PHASE_SCAN and
+ * returns. scan_pool::scan() forgets whatever marks are left, so that a
+ * flow that was not scanned after all leaves nothing behind.
+ *
+ * This source code is under the GNU Public License (GPL).  See
+ * LICENSE for details.
+ */
+
+#ifndef STREAM_SCAN_H
+#define STREAM_SCAN_H
+
+#include <string>
+
+class stream_scan {
+public:
+    enum scanner_t { HTTP=1, MD5=2 };
+    static void done(const std::string &name,scanner_t s);
+    static bool take(const std::string &name,scanner_t s); // true, once, if s was done for name
+    static void forget(const std::string &name);
+};
+
+#endif
@@ -0,0 +1,148 @@
+#ifndef SYN_TABLE_H
+#define SYN_TABLE_H
+
+#include <vector>
+#include <cstddef>
+#include <stdint.h>
+
+// Connections that have only sent a SYN, with -S syn_table=n.
+//
+// A SYN with no data is not given a tcpip (and so a tcp_session, a
+// flow_map slot and a recon_set) until the connection turns out to be
+// real: its SYN/ACK, or its first data, promotes it with
+// tcpdemux::promote_syn(). Until then it is a record of the address, the
+// ISN and what the packets came to, in a table of n records (rounded up to
+// a power of 2) that never grows, so a SYN flood or a scan costs no more
+// than n records. A record is free again after -S syn_timeout seconds
+// (default 30) without a packet; otherwise a SYN that finds its set of
+// records full takes one by CLOCK: each packet marks its record, and the
+// first record of the set that is not marked is taken, the marks being
+// cleared as they are passed over.
+//
+// Connections that never get past the SYN are not reported.
+//
+// Not thread-safe: each tcpdemux (and so each worker thread) has its own.
+//
+// T is flow_addr; it is a parameter only so that this does not need tcpip.h.
+
+template <class T>
+class syn_table {
+  syn_table(const syn_table &);
+  syn_table &operator=(const syn_table &);
+
+  public:
+  enum { WAYS = 4 };                     // records a SYN can go in
+
+  struct entry {
+    entry():addr(), isn(0), first_sec(0), first_usec(0), last_sec(0), len(0), caplen(0),
+            packets(0), used(false), referenced(false) {}
+    T        addr;
+    uint32_t isn;
+    uint32_t first_sec;                  // when the SYN was seen
+    uint32_t first_usec;
+    uint32_t last_sec;                   // when the last packet was
+    uint32_t len;                        // the packets' off-wire length
+    uint32_t caplen;
+    uint16_t packets;
+    bool     used;
+    bool     referenced;                 // a packet since the clock last passed it
+  };
+
+  struct stats {
+    stats():added(0), promoted(0), evicted(0), expired(0), reset(0) {}
+    uint64_t added;                      // SYNs that made a record
+    uint64_t promoted;                   // records that became a tcpip
+    uint64_t evicted;                    // records taken for another SYN
+    uint64_t expired;                    // records that timed out
+    uint64_t reset;                      // records ended by a RST or FIN
+    void add(const stats &s) {
+      added += s.added; promoted += s.promoted; evicted += s.evicted;
+      expired += s.expired; reset += s.reset;
+    }
+  };
+
+  syn_table():entries(), mask(0), s() {}
+
+  /* room for n records; 0 for none. Forgets what was there */
+  void resize(size_t n) {
+    size_t sets = 1;
+    while (sets*WAYS < n) sets <<= 1;
+    entries.assign(n>0 ? sets*WAYS : 0, entry());
+    mask = sets-1;
+  }
+  size_t capacity() const { return entries.size(); }
+  size_t bytes() const { return entries.size()*sizeof(entry); }
+
+  /* the record of addr, if there is one that has not timed out */
+  entry *find(const T &addr, time_t now, uint32_t timeout) {
+    if (entries.empty()) return 0;
+    entry *set = &entries[(addr.hash() & mask) * WAYS];
+    for (size_t i = 0; i < WAYS; i++) {
+      entry &e = set[i];
+      if (e.used && e.addr == addr) {
+        if ((uint32_t)now - e.last_sec > timeout) {
+          e.used = false;
+          s.expired++;
+          return 0;
+        }
+        return &e;
+      }
+    }
+    return 0;
+  }
+
+  /* a SYN for addr; e is what find() returned for it */
+  void add_syn(entry *e, const T &addr, uint32_t isn, const struct timeval &ts,
+               uint32_t len, uint32_t caplen, time_t now, uint32_t timeout) {
+    if (e == 0) {
+      e = take(addr, now, timeout);
+      *e = entry();
+      e->addr = addr;
+      e->first_sec = ts.tv_sec;
+      e->first_usec = ts.tv_usec;
+      e->used = true;
+      s.added++;
+    }
+    e->isn = isn;                        // a retransmitted SYN may be a new attempt
+    count(e, ts, len, caplen);
+  }
+
+  /* another packet of e's connection that does not promote it */
+  void count(entry *e, const struct timeval &ts, uint32_t len, uint32_t caplen) {
+    e->last_sec = ts.tv_sec;
+    e->len += len;
+    e->caplen += caplen;
+    if (e->packets < UINT16_MAX) e->packets++;
+    e->referenced = true;
+  }
+
+  void promoted(entry *e) { e->used = false; s.promoted++; }
+  void reset(entry *e)    { e->used = false; s.reset++; }
+
+  const stats &get_stats() const { return s; }
+
+  private:
+  /* a free, timed out or (by CLOCK) least recently used record of addr's set */
+  entry *take(const T &addr, time_t now, uint32_t timeout) {
+    entry *set = &entries[(addr.hash() & mask) * WAYS];
+    for (size_t i = 0; i < WAYS; i++) {
+      if (!set[i].used) return &set[i];
+      if ((uint32_t)now - set[i].last_sec > timeout) {
+        s.expired++;
+        return &set[i];
+      }
+    }
+    s.evicted++;
+    for (size_t i = 0; i < WAYS; i++) {
+      if (!set[i].referenced) return &set[i];
+      set[i].referenced = false;         // a second chance
+    }
+    return &set[0];                      // every one was marked; now none is
+  }
+
+  std::vector<entry> entries;            // WAYS records for each set
+  size_t mask;                           // sets-1
+  stats s;
+};
+
+#endif // SYN_TABLE_H
@@ -0,0 +1,163 @@
+#ifndef TCP_POLICY_H
+#define TCP_POLICY_H
+
+/**
+ * tcp_policy.h
+ *
+ * The options that tcpdemux::process_tcp() and tcpip::write_segment()
+ * would otherwise test on each packet, as a class the two are templates
+ * over:
+ *
+ *   console(demux)  -c and -C: the data is printed, not stored
+ *   store(demux)    the data is stored (not -X)
+ *   alerts()        -S tcp_alert_fd is set
+ *   index(demux)    -I, without --segments
+ *   limit(tcp)      the flow has a -b limit
+ *
+ * tcp_policy_any tests each option as it is. tcpdemux::select_tcp_processor()
+ * picks, once the options are set, the process_tcp() made with the
+ * tcp_policy that has them as constants, so the compiler leaves out the
+ * tests and the code they guard, and the common case of store_packet(),
+ * the next bytes of a flow whose file is open, is inlined into it.
+ *
+ * A flow's -b limit can come from load_shed, a checkpoint or a truncate
+ * rule of -S flow_policy too, so limit(tcp) is still tested for each flow
+ * when any of them is in use.
+ *
+ * Include after tcpdemux.h.
+ *
+ * This source code is under the GNU Public License (GPL).  See
+ * LICENSE for details.
+ */
+
+#include "http_stream.h"
+#include "tls_stream.h"
+#include "metrics.h"
+#include "tracer.h"
+#include "mem_budget.h"
+
+#include <algorithm>
+
+struct tcp_policy_any {
+    static bool console(const tcpdemux &d) { return d.opt.console_output; }
+    static bool store(const tcpdemux &d)   { return d.opt.store_output; }
+    static bool alerts()                   { return tcpdemux::tcp_alert_fd>=0; }
+    static bool index(const tcpdemux &d)   { return d.opt.output_packet_index && !d.opt.output_segments; }
+    static bool limit(const tcpip &tcp)    { return tcp.max_bytes>=0; }
+};
+
+enum tcp_output { TCP_TO_NOTHING, TCP_TO_CONSOLE, TCP_TO_FILES };
+
+template<int OUTPUT,bool ALERTS,bool INDEX,bool LIMIT>
+struct tcp_policy {
+    static bool console(const tcpdemux &)  { return OUTPUT==TCP_TO_CONSOLE; }
+    static bool store(const tcpdemux &)    { return OUTPUT==TCP_TO_FILES; }
+    static bool alerts()                   { return ALERTS; }
+    static bool index(const tcpdemux &)    { return INDEX; }
+    static bool limit(const tcpip &tcp)    { return LIMIT && tcp.max_bytes>=0; }
+};
+
+/*
+ * Write one segment at its offset in the flow and account for it:
+ * the index file, the seen set, pos, nsn and last_byte.
+ * pos only moves forward; a segment behind it fills an earlier gap.
+ */
+template<class policy>
+inline void tcpip::write_segment(uint64_t offset,const u_char *data,uint32_t length,const struct timeval &ts)
+{
+    /* reduce length to write if it goes beyond the number of bytes per flow,
+     * but remember to move pos to the actual position after the truncated write...
+     */
+    uint32_t wlength = length;		// length to write
+    if (policy::limit(*this)){
+        uint64_t max_bytes_per_flow = (uint64_t)max_bytes;
+
+	if(offset >= max_bytes_per_flow){
+	    wlength = 0;
+	}
+	if(offset < max_bytes_per_flow &&  offset+length > max_bytes_per_flow){
+	    DEBUG(2) ("packet truncated by max_bytes_per_flow on %s", flow_pathname.c_str());
+	    wlength = max_bytes_per_flow - offset;
+	}
+    }
+
+    /* write the data into the file */
+    DEBUG(25) ("%s: %s write %ld bytes @%" PRId64,
+               flow_pathname.c_str(),
+               fd>=0 || staging ? "will" : "won't",
+               (long) wlength, offset);
+
+    if(fd>=0 || staging){
+	if(wlength>0) buffered_write(offset,data,wlength);
+	/* Remember where it went for the index; it is sorted and written when the flow is finished */
+	if (policy::index(demux)) {
+	    uint64_t o = offset;
+	    uint32_t n = wlength;
+	    do {
+		uint32_t part = std::min(n,(uint32_t)packet_index_record::MAX_LENGTH);
+		packet_index.push_back(packet_index_record(o,part,ts.tv_sec,ts.tv_usec));
+		o += part;
+		n -= part;
+	    } while(n>0);
+	}
+    }
+
+    if(http) http->feed(offset,data,wlength); // it only takes the bytes in order
+    if(tls) tls->feed(offset,data,length);    // the hello, whether or not -b keeps it
+    if(stream_hash && transcript) hash_segment(offset,data,wlength);
+
+    /* Update the database of bytes that we've seen; a gap costs memory */
+    size_t intervals = seen.interval_count();
+    seen.add(offset,length);
+    if(seen.interval_count()!=intervals){
+        mem_budget::charge(mem_budget::RECON,recon_bytes(seen.interval_count())-recon_bytes(intervals));
+    }
+
+    /* Update the position in the file and the next expected sequence number */
+    if(offset+length > pos){
+        nsn += (uint32_t)(offset+length-pos); // expected next sequence number
+        pos = offset+length;
+    }
+
+    if(pos>last_byte) last_byte = pos;
+}
+
+/*
+ * store_packet() for the next bytes of a flow whose file is open, with
+ * nothing held past a gap: all that is left of it is write_segment().
+ * Everything else goes to store_packet() itself.
+ */
+template<class policy>
+inline void tcpip::store_packet(const u_char *data,uint32_t length,int32_t delta,struct timeval ts)
+{
+    if(delta==0 && length>0 && pos>0 && fd>=0 && reorder.empty()){
+        metrics::count(metrics::STORE,length);
+        tracer::event(trace_record::STORE,length,myflow.id,pos);
+        write_segment<policy>(pos,data,length,ts);
+        return;
+    }
+    store_packet(data,length,delta,ts);
+}
+
+/*
+ * The data of a flow whose -S flow_policy rule is metadata or drop: only
+ * where it goes in the flow is noted, so that the flow's length is known
+ * and it is finished when its FIN's bytes have all been seen.
+ */
+inline void tcpip::skip_packet(uint32_t length,int32_t delta)
+{
+    if((int64_t)pos+delta < 0) return;  // before the start of the flow
+    uint64_t offset = pos+delta;
+    size_t intervals = seen.interval_count();
+    seen.add(offset,length);
+    if(seen.interval_count()!=intervals){
+        mem_budget::charge(mem_budget::RECON,recon_bytes(seen.interval_count())-recon_bytes(intervals));
+    }
+    if(offset+length > pos){
+        nsn += (uint32_t)(offset+length-pos);
+        pos = offset+length;
+    }
+    if(pos>last_byte) last_byte = pos;
+}
+
+#endif
@@ -14,106 +14,414 @@
 #include "tcpflow.h"
 #include "tcpip.h"
 #include "tcpdemux.h"
+#include "tcpdemux_pool.h"
+#include "scan_pool.h"
+#include "cmd_pool.h"
+#include "alert_channel.h"
+#include "report_writer.h"
+#include "http_stream.h"
+#include "tls_stream.h"
+#include "stream_scan.h"
+#include "metrics.h"
+#include "tracer.h"
+#include "load_shed.h"
+#include "mem_budget.h"
+#include "flow_checkpoint.h"
+#include "json_stream.h"
+#include "tcp_policy.h"
+#include "disk_ring.h"
+#include "flow_policy.h"
 
 #include <iostream>
 #include <sstream>
 #include <vector>
+#include <new>
+#include <algorithm>
 
 #ifdef HAVE_SYS_WAIT_H
 #include <sys/wait.h>
 #endif
 
 /* static */ uint32_t tcpdemux::max_saved_flows = 100;
+/* static */ uint32_t tcpdemux::saved_flow_tail = 4096;
+/* static */ bool     tcpdemux::exact_fd_lru = false;
+/* static */ uint32_t tcpdemux::write_buffer_size = 32768;
+/* static */ uint64_t tcpdemux::write_buffer_max = 64*1024*1024;
+/* static */ uint32_t tcpdemux::reorder_window = 256*1024;
+/* static */ uint64_t tcpdemux::reorder_max = 64*1024*1024;
+/* static */ bool     tcpdemux::packet_index_text = false;
+/* static */ uint32_t tcpdemux::syn_table_size = 0;
+/* static */ uint32_t tcpdemux::syn_timeout = 30;
+/* static */ uint32_t tcpdemux::stage_bytes = 0;
+/* static */ uint32_t tcpdemux::flow_sample = 1;
 /* static */ uint32_t tcpdemux::tcp_timeout = 0;
 /* static */ int tcpdemux::tcp_subproc_max = 10;
 /* static */ int tcpdemux::tcp_subproc = 0;
 /* static */ int tcpdemux::tcp_alert_fd = -1;
 /* static */ std::string tcpdemux::tcp_cmd = "";
+/* static */ std::mutex tcpdemux::output_M;
+/* static */ scan_pool *tcpdemux::scanners = 0;
+/* static */ cmd_pool  *tcpdemux::tcp_workers = 0;
+/* static */ report_writer *tcpdemux::reports = 0;
+
+/* Tell tcp_alert_fd about a flow's file */
+static void tcp_alert(const char *what,const tcpip &tcp)
+{
+    alert_channel::event e;
+    e.what       = what;
+    e.kind       = "tcp";
+    e.path       = tcp.flow_pathname;
+    e.has_flow   = true;
+    e.addr       = tcp.myflow;
+    e.session_id = tcp.myflow.session_id;
+    e.bytes      = tcp.last_byte;
+    e.packets    = tcp.myflow.packet_count;
+    alert_channel::post(tcpdemux::tcp_alert_fd,e);
+}
+
+static thread_local tcpdemux *thread_instance = 0; // set in worker threads
 
 tcpdemux::tcpdemux():
-#ifdef HAVE_SQLITE3
-    db(),insert_flow(),
-#endif
-    flow_sorter(0),tcp_processor(0),
+    flow_sorter(false),tcp_processor(0),
     outdir("."),flow_counter(0),packet_counter(0),
     xreport(0),pwriter(0),max_open_flows(),max_fds(get_max_fds()-NUM_RESERVED_FDS),
-    unique_id(0),
-    flow_map(),open_flows(),saved_flow_map(),flow_fd_cache_map(0),
-    saved_flows(),start_new_connections(false),opt(),fs()
+    unique_id(0),write_buffer_bytes(0),reorder_held(0),shard(0),nshards(1),pool(0),roots(),segments(0),coalesce(false),
+    session_slab(),flow_map(),open_flows(),flow_timeouts(),frags(),saved_flow_map(),flow_fd_cache_map(0),open_pcaps(),
+    saved_flows(),start_new_connections(false),memory_refusing(false),budget_enforced(0),last_packet(),idle_packet(),idle_clock(0),tables_charged(0),syns(),sample_skipped(0),opt(),fs()
 {
-    tcp_processor = &tcpdemux::process_tcp;
+    tcp_processor = &tcpdemux::process_tcp<tcp_policy_any>;
 }
 
-void tcpdemux::alter_processing_core()
+tcpdemux::~tcpdemux()
 {
-    DEBUG(1) ("ensuring pcap core");
-    tcp_processor = &tcpdemux::dissect_tcp;
-    flow_sorter = new pcap_writer();
-}
-
-void tcpdemux::openDB()
-{
-#ifdef HAVE_SQLITE3
-    int rc = sqlite3_open("test.db", &db);
-    if( rc ){
-        fprintf(stderr, "Can't open database: %s\n", sqlite3_errmsg(db));
-        db = 0;
-    }
-    /* Create SQL statement */
-    const char *sql = "CREATE TABLE connections ("
-        "starttime TEXT NOT NULL,"
-        "endtime TEXT NOT NULL,"
-        "src_ipn TEXT,"
-        "dst_ipn TEXT,"
-        "mac_daddr TEXT,"
-        "mac_saddr TEXT,"
-        "packets INTEGER,"
-        "srcport INTEGER,"
-        "dstport INTEGER,"
-        "hashdigest_md5 TEXT);";
-
-    /* Execute SQL statement */
-    rc = sqlite3_exec(db, sql, callback, 0, &zErrMsg);
-    if( rc != SQLITE_OK ){
-        fprintf(stderr, "SQL error: %s\n", zErrMsg);
-        sqlite3_free(zErrMsg);
-        sqlite3_close(db);
-        return 0;
+    delete pool;
+    delete xreport;
+    delete pwriter;
+    delete segments;                    // before the writers it syncs with; roots waits for them
+    mem_budget::release(mem_budget::SESSIONS,tables_charged+syns.bytes());
+}
+
+void tcpdemux::write_file(int fd,const void *data,size_t length,uint64_t offset,uint16_t root)
+{
+    uring_writer *writer = roots.writer(root);
+    if(writer){
+        writer->write(fd,data,length,offset);
+        return;
     }
-    const char* zSql = "INSERT INTO connections (starttime,endtime,src_ipn,dst_ipn,mac_daddr,mac_saddr,packets,srcport,dstport,hashdigest_md5) VALUES (?,?,?,?,?,?,?,?,?,?)";
-    if(sqlite3_prepare_v2(db, zSql, strlen(zSql), &insert_stmt, NULL)!=SQLITE_OK ){
-        fprintf(stderr, "SQL prepare error");
-        db = 0;
-        insert_stmt=0;
-        return(0);
+    ssize_t r = pwrite(fd,data,length,(off_t)offset);
+    if (r != (ssize_t)length) {
+        DEBUG(1) ("write to fd %d failed: %s",fd,strerror(errno));
     }
-#endif
 }
 
-void  tcpdemux::write_flow_record(const std::string &starttime,const std::string &endtime,
-                        const std::string &src_ipn,const std::string &dst_ipn,
-                        const std::string &mac_daddr,const std::string &mac_saddr,
-                        uint64_t packets,uint16_t srcport,uint16_t dstport,
-                        const std::string &hashdigest_md5)
+void tcpdemux::sync_file(int fd,uint16_t root)
 {
+    uring_writer *writer = fd>=0 ? roots[root<roots.size() ? root : 0].writer : 0;
+    if(writer) writer->sync(fd);
 }
 
+segment_store *tcpdemux::segment_output()
+{
+    if(segments==0) segments = new segment_store(*this,outdir,shard);
+    return segments;
+}
 
+void tcpdemux::alter_processing_core()
+{
+    DEBUG(1) ("ensuring pcap core");
+    tcp_processor = &tcpdemux::dissect_tcp;
+    flow_sorter = true;
+}
+
+/* The process_tcp() made for the options; see tcp_policy.h.
+ * A flow's -b limit can also come from load_shed, a checkpoint or -S flow_policy.
+ */
+void tcpdemux::select_tcp_processor()
+{
+    if(flow_sorter) return;             // -K: dissect_tcp()
+    coalesce = segment_coalescer::enabled && opt.store_output && !opt.console_output
+        && !(json_stream::path.size()>0 && json_stream::events!="flows");
+    if(opt.console_output){
+        tcp_processor = &tcpdemux::process_tcp<tcp_policy<TCP_TO_CONSOLE,false,false,false> >;
+        return;
+    }
+    if(!opt.store_output){
+        tcp_processor = &tcpdemux::process_tcp<tcp_policy<TCP_TO_NOTHING,false,false,false> >;
+        return;
+    }
+    static const tcp_processor_t to_files[8] = {  // by alerts, index and limit
+        &tcpdemux::process_tcp<tcp_policy<TCP_TO_FILES,false,false,false> >,
+        &tcpdemux::process_tcp<tcp_policy<TCP_TO_FILES,false,false,true > >,
+        &tcpdemux::process_tcp<tcp_policy<TCP_TO_FILES,false,true ,false> >,
+        &tcpdemux::process_tcp<tcp_policy<TCP_TO_FILES,false,true ,true > >,
+        &tcpdemux::process_tcp<tcp_policy<TCP_TO_FILES,true ,false,false> >,
+        &tcpdemux::process_tcp<tcp_policy<TCP_TO_FILES,true ,false,true > >,
+        &tcpdemux::process_tcp<tcp_policy<TCP_TO_FILES,true ,true ,false> >,
+        &tcpdemux::process_tcp<tcp_policy<TCP_TO_FILES,true ,true ,true > >,
+    };
+    bool alerts = tcp_alert_fd>=0;
+    bool index  = opt.output_packet_index && !opt.output_segments;
+    bool limit  = opt.max_bytes_per_flow>=0 || load_shed::enabled || flow_checkpoint::load_path.size()>0
+        || flow_policy::active();
+    tcp_processor = to_files[(alerts?4:0) | (index?2:0) | (limit?1:0)];
+    DEBUG(2)("tcp core: files, alerts=%d index=%d limit=%d",(int)alerts,(int)index,(int)limit);
+}
 
 /* static */ tcpdemux *tcpdemux::getInstance()
 {
+    if(thread_instance) return thread_instance;
     static tcpdemux * theInstance = 0;
     if(theInstance==0) theInstance = new tcpdemux();
     return theInstance;
 }
 
+/* static */ void tcpdemux::set_thread_instance(tcpdemux *demux)
+{
+    thread_instance = demux;
+}
+
+/* Create a demux that shares this one's options and outputs.
+ * The xreport and pwriter still belong to this demux.
+ */
+tcpdemux *tcpdemux::make_worker(unsigned int shard_,unsigned int nshards_) const
+{
+    tcpdemux *w = new tcpdemux();
+    w->outdir  = outdir;
+    w->xreport = xreport;
+    w->pwriter = pwriter;
+    w->max_fds = max_fds/nshards_ > 0 ? max_fds/nshards_ : 1;
+    w->roots.configure(std::string(),w->max_fds);
+    w->start_new_connections = start_new_connections;
+    w->opt     = opt;
+    w->fs      = fs;
+    w->shard   = shard_;
+    w->nshards = nshards_;
+    if(flow_sorter) w->alter_processing_core();
+    else w->tcp_processor = tcp_processor;
+    w->coalesce = coalesce;
+    return w;
+}
+
+void tcpdemux::start_pool(unsigned int nthreads)
+{
+    assert(pool==0);
+    pool = new tcpdemux_pool();
+    pool->start(*this,nthreads);
+}
+
+void tcpdemux::set_start_new_connections(bool flag)
+{
+    start_new_connections = flag;
+    memory_refusing = false;            // housekeeping must not undo this
+    if(pool) pool->set_start_new_connections(flag);
+}
+
+size_t tcpdemux::open_flow_count() const
+{
+    size_t count = open_flows.size();
+    if(pool){
+        pool->drain();
+        for(size_t i=0;i<pool->size();i++) count += pool->get_worker(i).open_flows.size();
+    }
+    return count;
+}
+
+void tcpdemux::session_slab_stats(size_t &peak,size_t &capacity) const
+{
+    peak = session_slab.peak();
+    capacity = session_slab.capacity();
+    if(pool){
+        pool->drain();
+        for(size_t i=0;i<pool->size();i++){
+            peak     += pool->get_worker(i).session_slab.peak();
+            capacity += pool->get_worker(i).session_slab.capacity();
+        }
+    }
+}
+
+void tcpdemux::syn_stats(syn_table<flow_addr>::stats &s) const
+{
+    s = syns.get_stats();
+    if(pool){
+        pool->drain();
+        for(size_t i=0;i<pool->size();i++) s.add(pool->get_worker(i).syns.get_stats());
+    }
+}
+
+uint64_t tcpdemux::sample_skipped_count() const
+{
+    uint64_t count = sample_skipped;
+    if(pool){
+        pool->drain();
+        for(size_t i=0;i<pool->size();i++) count += pool->get_worker(i).sample_skipped;
+    }
+    return count;
+}
+
+void tcpdemux::root_flows(std::vector<uint64_t> &flows) const
+{
+    roots.add_flows(flows);
+    if(pool){
+        pool->drain();
+        for(size_t i=0;i<pool->size();i++) pool->get_worker(i).roots.add_flows(flows);
+    }
+}
+
+void tcpdemux::open_flow_keys(std::vector<flow_addr> &keys) const
+{
+    for(flow_map_t::const_iterator it=flow_map.begin();it!=flow_map.end();it++) keys.push_back(it->first);
+    if(pool){
+        pool->drain();
+        for(size_t i=0;i<pool->size();i++) pool->get_worker(i).open_flow_keys(keys);
+    }
+}
+
+size_t tcpdemux::flow_map_count() const
+{
+    size_t count = flow_map.size();
+    if(pool){
+        pool->drain();
+        for(size_t i=0;i<pool->size();i++) count += pool->get_worker(i).flow_map.size();
+    }
+    return count;
+}
+
 /**
  * find the flow that has been written to in the furthest past and close it.
+ * By default this is approximated with CLOCK (second chance), so that packets
+ * only have to mark their flow instead of moving it in open_flows.
  */
 void tcpdemux::close_oldest_fd()
 {
-    tcpip *oldest_tcp = *open_flows.begin();
-    if(oldest_tcp) oldest_tcp->close_file();
+    tcpip *oldest_tcp = exact_fd_lru ? open_flows.front() : open_flows.clock_victim();
+    if(oldest_tcp){
+        metrics::event(metrics::FD_EVICTIONS);
+        tracer::event(trace_record::FD_EVICTION,0,oldest_tcp->myflow.id);
+        oldest_tcp->close_file();
+    }
+}
+
+/**
+ * close the file of the flow on root that was opened in the furthest past,
+ * when root has used its share of max_fds; see output_roots.h
+ */
+bool tcpdemux::close_oldest_fd_on(uint16_t root)
+{
+    for(intrusive_list<tcpip>::iterator it=open_flows.begin();it!=open_flows.end();++it){
+        tcpip *tcp = *it;
+        if(tcp->myflow.root!=root) continue;
+        metrics::event(metrics::FD_EVICTIONS);
+        tracer::event(trace_record::FD_EVICTION,0,tcp->myflow.id);
+        tcp->close_file();
+        return true;
+    }
+    return false;
+}
+
+/**
+ * close the -K flow file that was written to in the furthest past.
+ * It is opened again, for appending, when its flow has another packet.
+ */
+void tcpdemux::close_oldest_pcap()
+{
+    sparse_saved_flow *oldest = exact_fd_lru ? open_pcaps.front() : open_pcaps.clock_victim();
+    if(oldest==0) return;
+    open_pcaps.erase(oldest);
+    oldest->pcap->close();
+}
+
+/* Open the file of a -K flow. The -K files share max_fds with the
+ * transcripts, and other -K files are closed to make room.
+ */
+int tcpdemux::open_pcap(sparse_saved_flow *ssf)
+{
+    while(true){
+        if(open_pcaps.size()>0 && open_pcaps.size()+open_flows.size() >= max_fds) close_oldest_pcap();
+        if(ssf->pcap->open()==0){
+            open_pcaps.push_back(ssf);
+            return 0;
+        }
+        if((errno!=ENFILE && errno!=EMFILE) || open_pcaps.empty()){
+            DEBUG(1)("cannot write %s: %s",ssf->pcap->name().c_str(),strerror(errno));
+            return -1;
+        }
+        DEBUG(5) ("too many open files -- closing -K flow files (open=%d)", (int)open_pcaps.size());
+        close_oldest_pcap();
+    }
+}
+
+static bool larger_write_buffer(const tcpip *a,const tcpip *b)
+{
+    return a->wbuf.size() > b->wbuf.size();
+}
+
+/**
+ * Flush the largest write buffers until they use at most half of write_buffer_max,
+ * or, for the flows on one root, half of the root's share of it.
+ * Only open flows have buffers.
+ */
+void tcpdemux::flush_largest_buffers(int root)
+{
+    std::vector<tcpip *> buffered;
+    for(intrusive_list<tcpip>::iterator it=open_flows.begin();it!=open_flows.end();++it){
+        if((*it)->wbuf.size()>0 && (root<0 || (*it)->myflow.root==root)) buffered.push_back(*it);
+    }
+    std::sort(buffered.begin(),buffered.end(),larger_write_buffer);
+    uint64_t target = root<0 ? write_buffer_max/2 : write_buffer_max/roots.size()/2;
+    for(std::vector<tcpip *>::iterator it=buffered.begin();it!=buffered.end();it++){
+        if((root<0 ? write_buffer_bytes : roots[root].buffered) <= target) break;
+        (*it)->flush_buffer();
+    }
+}
+
+static bool less_recently_active(const tcpip *a,const tcpip *b)
+{
+    return timercmp(&a->myflow.tlast,&b->myflow.tlast,<);
+}
+
+/**
+ * Give memory back when the total is over -S memory_max, in the order that
+ * loses the least, until it is down to 7/8 of it; see mem_budget.h.
+ * Each worker does this for its own flows.
+ */
+void tcpdemux::enforce_budget(time_t now)
+{
+    budget_enforced = now;
+
+    /* What can be written out or forgotten without losing anything */
+    for(intrusive_list<tcpip>::iterator it=open_flows.begin();it!=open_flows.end();++it){
+        (*it)->flush_buffer();
+    }
+    std::vector<tcpip *> all;
+    for(flow_map_t::iterator it=flow_map.begin();it!=flow_map.end();it++){
+        for(int i=0;i<2;i++) if(it->second->half[i]) all.push_back(it->second->half[i]);
+    }
+    for(std::vector<tcpip *>::iterator it=all.begin();it!=all.end();it++){
+        (*it)->spill();
+        if((*it)->reorder_bytes>0) (*it)->flush_reorder();
+    }
+    while(saved_flows.size()>0) forget_oldest_saved_flow();
+    mem_budget::flush();
+    if(mem_budget::low_water()) return;
+
+    /* The flows that have gone longest without a packet, up to a quarter of them */
+    size_t evict = all.size()/4 > 0 ? all.size()/4 : all.size();
+    std::partial_sort(all.begin(),all.begin()+evict,all.end(),less_recently_active);
+    size_t evicted = 0;
+    while(evicted<evict && !mem_budget::low_water()){
+        post_process(all[evicted++]);
+        metrics::event(metrics::MEMORY_EVICTIONS);
+        mem_budget::flush();
+    }
+    if(evicted>0) DEBUG(1)("over memory_max: closed %u flows",(unsigned)evicted);
+    if(mem_budget::low_water()) return;
+
+    /* Then keep the flows there are */
+    if(start_new_connections){
+        DEBUG(1)("over memory_max: not starting new connections");
+        start_new_connections = false;
+        memory_refusing = true;
+    }
 }
 
 /* Open a file, closing one of the existing flows f necessary.
@@ -121,8 +429,7 @@ void tcpdemux::close_oldest_fd()
 int tcpdemux::retrying_open(const std::string &filename,int oflag,int mask)
 {
     while(true){
-    //Packet index file reduces max_fds by 1/2 as the index files also take a fd
-	if(open_flows.size() >= (opt.output_packet_index ?  max_fds/2 : max_fds)) close_oldest_fd();
+	if(open_flows.size() >= max_fds) close_oldest_fd();
 	int fd = ::open(filename.c_str(),oflag,mask);
 	DEBUG(2)("retrying_open ::open(fn=%s,oflag=x%x,mask:x%x)=%d",filename.c_str(),oflag,mask,fd);
 	if(fd>=0){
@@ -139,17 +446,25 @@ int tcpdemux::retrying_open(const std::string &filename,int oflag,int mask)
     }
 }
 
-/* Find previously a previously created flow state in the database.
+/* Find the connection that flow is either direction of.
  */
-tcpip *tcpdemux::find_tcpip(const flow_addr &flow)
+tcp_session *tcpdemux::find_session(const flow_addr &flow)
 {
-    flow_map_t::const_iterator it = flow_map.find(flow);
+    flow_map_t::const_iterator it = flow_map.find(tcp_session::canonical(flow));
     if (it==flow_map.end()){
 	return NULL; // flow not found
     }
     return it->second;
 }
 
+/* Find previously a previously created flow state in the database.
+ */
+tcpip *tcpdemux::find_tcpip(const flow_addr &flow)
+{
+    tcp_session *session = find_session(flow);
+    return session ? session->half[tcp_session::direction(flow)] : NULL;
+}
+
 /* Create a new flow state structure for a given flow.
  * Puts the flow in the map.
  * Returns a pointer to the new state.
@@ -157,6 +472,7 @@ tcpip *tcpdemux::find_tcpip(const flow_addr &flow)
  * This is called by tcpdemux::process_tcp(). (Only place it is called)
  *
  * @param - pi - first packet seen on this connection.
+ * @param - session - the connection, if the other direction has been seen; otherwise one is created.
  *
  * NOTE: We keep pointers to tcp structures in the map, rather than
  * the structures themselves. This makes the map slightly more efficient,
@@ -167,25 +483,126 @@ tcpip *tcpdemux::find_tcpip(const flow_addr &flow)
  * This is resulting in an unnecessary copy.
  */
 
-tcpip *tcpdemux::create_tcpip(const flow_addr &flowa, be13::tcp_seq isn,const be13::packet_info &pi)
+tcp_session *tcpdemux::new_session(const flow_addr &key)
+{
+    tcp_session *session = new (session_slab.alloc()) tcp_session(key);
+    flow_map[key] = session;
+    metrics::flows(flow_map.size(),flow_map.capacity());
+    uint64_t tables = session_slab.capacity()*sizeof(tcp_session)
+        + flow_map.capacity()*sizeof(flow_map_t::value_type);
+    if(tables!=tables_charged){         // neither gives memory back
+        mem_budget::charge(mem_budget::SESSIONS,(int64_t)(tables-tables_charged));
+        tables_charged = tables;
+    }
+    return session;
+}
+
+tcpip *tcpdemux::create_tcpip(const flow_addr &flowa, be13::tcp_seq isn,const be13::packet_info &pi,tcp_session *session)
 {
+    if(session==0) session = new_session(tcp_session::canonical(flowa));
+
     /* create space for the new state */
-    flow flow(flowa,flow_counter++,pi);
+    flow flow(flowa,flow_counter++*nshards+shard,pi);
 
-    tcpip *new_tcpip = new tcpip(*this,flow,isn);
+    int dir = tcp_session::direction(flowa);
+    tcpip *other = session->half[1-dir];
+    flow.root = other ? roots.join(other->myflow.root) : roots.place(flowa); // both directions on one root
+    tcpip *new_tcpip = new (session->storage[dir]) tcpip(*this,flow,isn);
     new_tcpip->nsn   = isn+1;		// expected sequence number of the first byte
+    new_tcpip->session = session;
+    session->half[dir] = new_tcpip;
+    if(flow_policy::active()) flow_policy::apply(*new_tcpip,other); // once for the connection; see flow_policy.h
+    if(load_shed::enabled && load_shed::level()>=load_shed::TRUNCATE){
+        /* falling behind: this flow keeps less, or only its report; see load_shed.h */
+        int64_t shed_bytes = (int64_t)load_shed::max_bytes;
+        if(new_tcpip->max_bytes<0 || new_tcpip->max_bytes>shed_bytes) new_tcpip->max_bytes = shed_bytes;
+        new_tcpip->shed_level = load_shed::level();
+        if(new_tcpip->shed_level>=load_shed::METADATA_ONLY) new_tcpip->transcript = false;
+    }
+    tracer::event(trace_record::NEW_FLOW,0,new_tcpip->myflow.id);
     DEBUG(5) ("new flow %s. path: %s next seq num (nsn):%d",
               flowa.str().c_str(),new_tcpip->flow_pathname.c_str(),new_tcpip->nsn);
-    flow_map[flow] = new_tcpip;
     open_flows.reset(new_tcpip);
     return new_tcpip;
 }
 
+/**
+ * A flow that a -S checkpoint_file of an earlier tcpflow had, with the
+ * flow it had; flow_checkpoint::load() sets the rest. It keeps its id.
+ */
+tcpip *tcpdemux::restore_tcpip(const flow &f,be13::tcp_seq isn)
+{
+    tcp_session *session = find_session(f);
+    int dir = tcp_session::direction(f);
+    if(session && session->half[dir]) return 0;
+    if(session==0) session = new_session(tcp_session::canonical(f));
+    tcpip *tcp = new (session->storage[dir]) tcpip(*this,f,isn);
+    tcp->session = session;
+    session->half[dir] = tcp;
+    open_flows.reset(tcp);
+    return tcp;
+}
+
+/**
+ * Make a flow of a connection that only had a SYN in syns. reverse is true
+ * when pi is a packet of the other direction, the SYN/ACK.
+ */
+tcpip *tcpdemux::promote_syn(syn_table<flow_addr>::entry *e,const be13::packet_info &pi,tcp_session *&session,bool reverse)
+{
+    int dir = tcp_session::direction(e->addr);
+    tcpip *reverse_tcp = session ? session->half[1-dir] : 0;
+    tcpip *tcp = create_tcpip(e->addr, e->isn, pi, session);
+    session = tcp->session;
+    tcp->myflow.session_id = reverse_tcp ? reverse_tcp->myflow.session_id : unique_id++*nshards+shard;
+    tcp->myflow.tstart.tv_sec  = e->first_sec;
+    tcp->myflow.tstart.tv_usec = e->first_usec;
+    tcp->myflow.packet_count   = e->packets;
+    tcp->myflow.len            = e->len;
+    tcp->myflow.caplen         = e->caplen;
+    tcp->syn_count = 1;
+    tcp->dir = tcpip::dir_cs;
+    if(reverse){                        // the MAC addresses came the other way
+        uint8_t mac[sizeof(tcp->myflow.mac_saddr)];
+        memcpy(mac,tcp->myflow.mac_saddr,sizeof(mac));
+        memcpy(tcp->myflow.mac_saddr,tcp->myflow.mac_daddr,sizeof(mac));
+        memcpy(tcp->myflow.mac_daddr,mac,sizeof(mac));
+        tcp->myflow.tlast = pi.ts;
+        if(tcp_timeout) flow_timeouts.schedule(tcp,pi.ts.tv_sec + tcp_timeout + 1);
+    }
+    syns.promoted(e);
+    return tcp;
+}
+
+void tcpdemux::release_tcpip(tcpip *tcp)
+{
+    tcp_session *session = tcp->session;
+    session->half[session->half[0]==tcp ? 0 : 1] = 0;
+    tcp->~tcpip();
+    if(session->empty()){
+        flow_map.erase(session->key);
+        metrics::flows(flow_map.size(),flow_map.capacity());
+        session->~tcp_session();
+        session_slab.release(session);
+    }
+}
+
+/* A finished flow's <fileobject>: written here, or handed to the report writer */
+/* static */ void tcpdemux::report(dfxml_writer *x,const flow_report &r,const std::string &xmladd)
+{
+    if(reports){
+        reports->submit(r,xmladd);
+    } else if(x){
+        std::lock_guard<std::mutex> lock(output_M);
+        r.dump_xml(x,xmladd);
+    }
+    if(disk_ring::running()) disk_ring::add(r,xmladd); // after the record, so <expired> follows it
+}
+
 /**
  * Remove a flow from the database.
  * Close the flow file.
  * Write to the report.xml object.
- * Save in the sqlite database.
+ * Save in the sqlite database, with -S flow_db (see flow_db.h).
  * This is the ONLY place where a tcpip object is deleted so there is no chance of finding it again.
  *
  * Flows are post-processed when a FIN is received and all bytes are received.
@@ -199,43 +616,107 @@ tcpip *tcpdemux::create_tcpip(const flow_addr &flowa, be13::tcp_seq isn,const be
 
 void tcpdemux::post_process(tcpip *tcp)
 {
-    std::stringstream xmladd;		// for this <fileobject>
-    if(opt.post_processing && tcp->file_created && tcp->last_byte>0){
+    metrics::count(metrics::POST_PROCESS,tcp->last_byte);
+    tracer::event(trace_record::CLOSE,0,tcp->myflow.id,tcp->last_byte);
+    if(tcp->policy && flow_policy::action(*tcp)==flow_policy::DROP){
+        flow_timeouts.cancel(tcp);      // nothing was kept, and nothing is reported
+        release_tcpip(tcp);
+        return;
+    }
+    tcp->flush_reorder();               // whatever is still waiting for a gap
+    std::string staged;                 // the flow, if it was small enough never to have had a file
+    if(tcp->staging){
+        tcp->finish_staging(staged);
+        if(tcp->fd>=0 && opt.store_output && tcp_alert_fd>=0) tcp_alert("open",*tcp);
+    }
+    tcp->flush_buffer();                // everything below reads the file
+    tcp->merge_prefix();
+    if(tcp->compressed && (tcp->fd>=0 || tcp->open_file()==0)){
+        tcp->compressed->finish();
+        tcp->write_compressed();
+    }
+    sync_file(tcp->fd,tcp->myflow.root);
+    tcp->write_index();
+    if(json_stream::flows()) json_stream::flow_finished(*tcp);
+    scan_pool::job *job = new scan_pool::job(*tcp,fs,xreport);
+    bool http_parsed = tcp->http && tcp->http->finish(job->xmladd);
+    if(tcp->tls) tcp->tls->finish(job->xmladd);
+    bool scan = opt.post_processing && tcp->transcript && tcp->file_created && tcp->last_byte>0;
+    if(scan && load_shed::enabled && load_shed::level()>=load_shed::NO_SCANS){
+        scan = false;                   // falling behind; see load_shed.h
+        if(tcp->shed_level<load_shed::NO_SCANS) tcp->shed_level = load_shed::NO_SCANS;
+    }
+    if(tcp->shed_level>0){
+        job->xmladd += "<load_shed level='" + std::to_string((int)tcp->shed_level) + "'/>";
+    }
+    if(tcp->policy){
+        job->xmladd += "<flow_policy rule='" + std::to_string(tcp->policy) + "' action='"
+            + flow_policy::action_name(flow_policy::action(*tcp)) + "'/>";
+    }
+    if(scan){
         /**
          * After the flow is finished, if more than a byte was
          * written, then put it in an SBUF and process it.  if we are
          * doing post-processing.  This is called from tcpip::~tcpip()
          * in tcpip.cpp.
+         *
+         * With -S scan_threads, a scan_pool thread does that, after
+         * the file is closed.
          */
-
-        /* Open the fd if it is not already open */
-        tcp->open_file();
-        if(tcp->fd>=0){
-            sbuf_t *sbuf = sbuf_t::map_file(tcp->flow_pathname,tcp->fd, false);
-            if(sbuf){
-                be13::plugin::process_sbuf(scanner_params(scanner_params::PHASE_SCAN,*sbuf,*(fs),&xmladd));
-                delete sbuf;
-                sbuf = 0;
-            }
+        job->scan = true;
+        job->name = tcp->flow_pathname;
+        job->path = tcp->flow_pathname;
+        if(opt.output_segments){
+            /* there is no file to map; the scan reads the flow back out of its segments, a window at a time */
+            segment_output()->sync();
+            job->in_memory = true;
+            job->segments  = segment_output()->base_path();
+            job->extents   = tcp->extents;
+            job->length    = tcp->last_byte;
+        } else if(tcp->compressed){
+            /* HTTP bodies are named after the flow without .zst */
+            job->zstd = true;
+            job->name = tcp->flow_pathname.substr(0,tcp->flow_pathname.size()-4);
+        } else if(staged.size()>0){
+            job->in_memory = true;      // no need to read back what was just written
+            job->contents.swap(staged);
+        }
+        if(http_parsed && job->scan) stream_scan::done(job->name,stream_scan::HTTP);
+        if(job->scan && tcp->stream_digests(job->report.digests)) stream_scan::done(job->name,stream_scan::MD5);
+        if(scanners==0 && job->scan){
+            scan_pool::scan(*job,output_M);
+            stream_scan::forget(job->name);
         }
     }
-    tcp->close_file();
-    if(xreport) tcp->dump_xml(xreport,xmladd.str());
     /**
-     * Before we delete the tcp structure, save information about the saved flow
+     * Before we delete the tcp structure, save information about the saved flow.
+     * This is done while the file may still be open, so that its tail can be kept.
+     * A compressed flow's tail is kept only if it was decompressed to be scanned here.
      */
-    save_flow(tcp);
-
-    if(opt.store_output && tcp_alert_fd>=0){
-	std::stringstream ss;
-	ss << "close\t" << tcp->flow_pathname.c_str() << "\n";
-	const std::string &sso = ss.str();
-	if(write(tcp_alert_fd,sso.c_str(),sso.size()) != (int)sso.size()){
-	    perror("write");
-	}
+    if(tcp->transcript){
+        save_flow(tcp,job->zstd && job->contents.size()>0 ? &job->contents : 0);
+    } else if(tcp->file_created && !opt.output_segments){
+        ::unlink(tcp->flow_pathname.c_str()); // -S http_bodies_only; see tcpip::start_http()
+    }
+    tcp->close_file();
+    if(opt.output_segments && tcp->extents.size()>0){
+        segment_output()->commit(tcp->flow_pathname,tcp->myflow.session_id,
+                                 tcp->myflow.tstart,tcp->myflow.tlast,tcp->extents);
+    }
+
+    if(scanners){
+        scanners->submit(job);          // it writes the report, in order
+    } else {
+        report(xreport,job->report,job->xmladd);
+        delete job;
     }
 
-    if(tcp_cmd.size()>0 && tcp->flow_pathname.size()>0){
+    if(opt.store_output && tcp_alert_fd>=0) tcp_alert("close",*tcp);
+
+    std::unique_lock<std::mutex> lock(output_M);
+
+    if(tcp_cmd.size()>0 && tcp->flow_pathname.size()>0 && !opt.output_segments // there is no file to give it
+       && (tcp_workers==0 || !tcp_workers->submit(cmd_pool::describe(*tcp)))){
 	/* If we are at maximum number of subprocesses, wait for one to exit */
 	std::string cmd = tcp_cmd + " " + tcp->flow_pathname;
 #ifdef HAVE_FORK
@@ -257,32 +738,87 @@ void tcpdemux::post_process(tcpip *tcp)
 	system(cmd.c_str());
 #endif
     }
+    lock.unlock();
 
-    delete tcp;
+    flow_timeouts.cancel(tcp);
+    release_tcpip(tcp);
 }
 
 void tcpdemux::remove_flow(const flow_addr &flow)
 {
-    flow_map_t::iterator it = flow_map.find(flow);
-    if(it!=flow_map.end()){
-        post_process(it->second);
-	flow_map.erase(it);
-    }
+    tcpip *tcp = find_tcpip(flow);
+    if(tcp) post_process(tcp);
 }
 
 void tcpdemux::remove_all_flows()
 {
+    if(pool){
+        /* the workers close their own flows; then collect their counters for the report */
+        pool->stop();
+        for(size_t i=0;i<pool->size();i++){
+            const tcpdemux &w = pool->get_worker(i);
+            flow_counter   += w.flow_counter;
+            packet_counter += w.packet_counter;
+            max_open_flows += w.max_open_flows;
+        }
+    }
+
+    if(flow_checkpoint::enabled()) checkpoint_flows();
 
     DEBUG(10) ("Cleaning up flows");
+    std::vector<tcpip *> all;           // post_process() takes the sessions out of flow_map
     for(flow_map_t::iterator it=flow_map.begin();it!=flow_map.end();it++){
-        post_process(it->second);
+        for(int i=0;i<2;i++) if(it->second->half[i]) all.push_back(it->second->half[i]);
+    }
+    for(std::vector<tcpip *>::iterator it=all.begin();it!=all.end();it++){
+        post_process(*it);
     }
     flow_map.clear();
 
     for(sparse_saved_flow_map_t::iterator it=flow_fd_cache_map.begin();it!=flow_fd_cache_map.end();it++){
+        open_pcaps.erase(it->second);
+        mem_budget::release(mem_budget::PCAP_FILES,sizeof(*it->second)+pcap_writer::FLOW_BUFFER_SIZE);
         delete it->second;
     }
     flow_fd_cache_map.clear();
+
+    delete segments;                    // finish the index; a later flow starts a new segment
+    segments = 0;
+}
+
+/**
+ * Write the flows that another tcpflow can carry on with, and the saved
+ * flows, to the checkpoint, and let the flows go without finishing them;
+ * see flow_checkpoint.h. remove_all_flows() finishes the rest.
+ */
+void tcpdemux::checkpoint_flows()
+{
+    std::vector<tcpip *> all;
+    for(flow_map_t::iterator it=flow_map.begin();it!=flow_map.end();it++){
+        for(int i=0;i<2;i++) if(it->second->half[i]) all.push_back(it->second->half[i]);
+    }
+    std::string records;
+    uint64_t count = 0;
+    for(std::vector<tcpip *>::iterator it=all.begin();it!=all.end();it++){
+        tcpip *tcp = *it;
+        if(tcp->http || tcp->compressed || opt.output_segments) continue;
+        tcp->flush_reorder();
+        if(tcp->staging) tcp->spill();
+        tcp->flush_buffer();
+        tcp->merge_prefix();
+        tcp->close_file();
+        flow_checkpoint::encode_flow(records,*tcp);
+        count++;
+        flow_timeouts.cancel(tcp);
+        release_tcpip(tcp);
+    }
+    for(saved_flows_t::const_iterator it=saved_flows.begin();it!=saved_flows.end();it++){
+        saved_flow_map_t::const_iterator m = saved_flow_map.find((*it)->addr);
+        if(m==saved_flow_map.end() || m->second!=*it) continue; // a newer one has the address
+        flow_checkpoint::encode_saved_flow(records,**it);
+        count++;
+    }
+    flow_checkpoint::add(records,count);
 }
 
 /****************************************************************
@@ -358,26 +894,104 @@ unsigned int tcpdemux::get_max_fds(void)
 void tcpdemux::save_unk_packets(const std::string &ofname,const std::string &ifname)
 {
     pwriter = pcap_writer::open_copy(ofname,ifname);
+    if(pwriter==0) die("cannot write %s: %s",ofname.c_str(),strerror(errno));
 }
 
 /**
- * save information on this flow needed to handle strangling packets
+ * save information on this flow needed to handle strangling packets.
+ * If the flow's file is still open, the last saved_flow_tail bytes are kept
+ * so that retransmissions after the FIN can be checked without reopening it.
+ * A compressed flow's tail can only come from contents.
  */
-int c = 0;
-void tcpdemux::save_flow(tcpip *tcp)
+void tcpdemux::forget_oldest_saved_flow()
+{
+    saved_flow *flow0 = saved_flows.front();
+    saved_flow_map_t::iterator it = saved_flow_map.find(flow0->addr);
+    if(it!=saved_flow_map.end() && it->second==flow0){
+        saved_flow_map.erase(it);         // remove from the map, unless a newer flow reused the address
+    }
+    saved_flows.pop_front();              // remove from the queue
+    mem_budget::release(mem_budget::SAVED_FLOWS,flow0->bytes());
+    delete flow0;                         // and delete the saved flow
+}
+
+void tcpdemux::save_flow(tcpip *tcp,const std::string *contents)
 {
     /* First remove the oldest flow if we are in overload */
-    if(saved_flows.size()>0 && saved_flows.size()>max_saved_flows){
-        saved_flow *flow0 = saved_flows.at(0);
-        saved_flow_map.erase(flow0->addr);    // remove from the map
-        saved_flows.erase(saved_flows.begin()); // remove from the vector
-        delete flow0;                           // and delete the saved flow
+    while(saved_flows.size()>0 && saved_flows.size()>=max_saved_flows){
+        forget_oldest_saved_flow();
     }
+    if(max_saved_flows==0) return;
 
     /* Now save the flow */
     saved_flow *sf = new saved_flow(tcp);
+    if(saved_flow_tail>0 && tcp->fd>=0 && tcp->last_byte>0){
+        size_t len = tcp->last_byte < saved_flow_tail ? tcp->last_byte : saved_flow_tail;
+        sf->tail_offset = tcp->last_byte - len;
+        sf->tail.resize(len);
+        bool ok = false;
+        if(opt.output_segments){
+            ok = segment_output()->read(tcp->extents,sf->tail_offset,(uint8_t *)&sf->tail[0],len)==0;
+        } else if(tcp->compressed){     // the file cannot be read in place
+            ok = contents && contents->size()==tcp->last_byte;
+            if(ok) memcpy(&sf->tail[0],contents->data()+sf->tail_offset,len);
+        } else {
+            ok = pread(tcp->fd,&sf->tail[0],len,sf->tail_offset)==(ssize_t)len;
+        }
+        if(!ok){
+            sf->tail_offset = 0;
+            sf->tail.clear();
+        }
+    }
+    remember_saved_flow(sf);
+}
+
+void tcpdemux::remember_saved_flow(saved_flow *sf)
+{
     saved_flow_map[sf->addr] = sf;
     saved_flows.push_back(sf);
+    mem_budget::charge(mem_budget::SAVED_FLOWS,sf->bytes());
+}
+
+void tcpdemux::restore_saved_flow(saved_flow *sf)
+{
+    while(saved_flows.size()>0 && saved_flows.size()>=max_saved_flows){
+        forget_oldest_saved_flow();
+    }
+    if(max_saved_flows==0 || saved_flow_map.find(sf->addr)!=saved_flow_map.end()){
+        delete sf;
+        return;
+    }
+    remember_saved_flow(sf);
+}
+
+/**
+ * Check that length bytes at offset in a saved flow are data.
+ * Uses the in-memory tail if it covers the range, the file otherwise.
+ */
+bool tcpdemux::saved_flow_matches(const saved_flow &sf,uint64_t offset,const u_char *data,size_t length)
+{
+    if(sf.tail.size()>0){
+        uint64_t file_end = sf.tail_offset + sf.tail.size();
+        if(offset+length > file_end) return false; // past the end of the transcript
+        if(offset >= sf.tail_offset){
+            return memcmp(sf.tail.data() + (offset - sf.tail_offset),data,length)==0;
+        }
+    }
+    if(opt.output_segments || opt.output_zstd) return false; // there is no file to look in
+    bool data_match = false;
+    int fd = open(sf.saved_filename.c_str(),O_RDONLY | O_BINARY);
+    if(fd>0){
+        char *buf = (char *)malloc(length);
+        if(buf){
+            DEBUG(100)("pread(fd,%" PRId64 ")",(int64_t)(offset));
+            ssize_t r = pread(fd,buf,length,offset);
+            data_match = (r==(ssize_t)length) && memcmp(buf,data,length)==0;
+            free(buf);
+        }
+        close(fd);
+    }
+    return data_match;
 }
 
 /**
@@ -399,20 +1013,27 @@ int tcpdemux::dissect_tcp(const ipaddr &src, const ipaddr &dst,sa_family_t famil
     flow_addr this_flow(src,dst,ntohs(tcp_header->th_sport),
                         ntohs(tcp_header->th_dport),family);
 
+    sparse_saved_flow *ssf = 0;
     sparse_saved_flow_map_t::const_iterator it = flow_fd_cache_map.find(this_flow);
     if(it!=flow_fd_cache_map.end()){
-        flow_sorter->update_sink(it->second->fcap);
+        ssf = it->second;
     }
     else {
         flow fn_gen_vehicle(this_flow, 0, pi); // impromptu flow name generator
+        fn_gen_vehicle.root = roots.place(this_flow);
         std::string fn = fn_gen_vehicle.new_pcap_filename();
-        flow_sorter->refresh_sink(fn, pi.pcap_dlt);
-        FILE *sink= flow_sorter->yield_sink();
-        sparse_saved_flow *ssf = new sparse_saved_flow(this_flow, sink);
+        ssf = new sparse_saved_flow(this_flow, new pcap_writer(fn,pcap_writer::FLOW_BUFFER_SIZE));
         flow_fd_cache_map[ssf->addr] = ssf;
+        mem_budget::charge(mem_budget::PCAP_FILES,sizeof(*ssf)+pcap_writer::FLOW_BUFFER_SIZE);
     }
 
-    flow_sorter->writepkt(pi.pcap_hdr,pi.pcap_data);
+    if(ssf->pcap->is_open()){
+        if(exact_fd_lru) open_pcaps.move_to_end(ssf);
+        else open_pcaps.touch(ssf);
+    } else if(open_pcap(ssf)){
+        return -1;
+    }
+    ssf->pcap->writepkt(pi.pcap_hdr,pi.pcap_data,pi.pcap_dlt);
 
     return 0;
 }
@@ -438,6 +1059,7 @@ int tcpdemux::dissect_tcp(const ipaddr &src, const ipaddr &dst,sa_family_t famil
 
 
 
+template<class policy>
 int tcpdemux::process_tcp(const ipaddr &src, const ipaddr &dst,sa_family_t family,
                           const u_char *ip_data, uint32_t ip_payload_len,
                           const be13::packet_info &pi)
@@ -447,12 +1069,22 @@ int tcpdemux::process_tcp(const ipaddr &src, const ipaddr &dst,sa_family_t famil
                   (u_int)ip_payload_len,(u_int)sizeof(struct be13::tcphdr));
 	return 1;
     }
+    metrics::count(metrics::TCP,ip_payload_len);
 
     struct be13::tcphdr *tcp_header = (struct be13::tcphdr *) ip_data;
 
     /* fill in the flow_addr structure with info that identifies this flow */
     flow_addr this_flow(src,dst,ntohs(tcp_header->th_sport),ntohs(tcp_header->th_dport),family);
 
+    /* -S flow_sample: a connection is kept or not by the hash of its addresses, the
+     * same for both directions, before there is any state for it. The hash is mixed
+     * again so that the sample does not line up with the --threads shards.
+     */
+    if(flow_sample>1 && hash_mix64(tcpdemux_pool::shard_hash(this_flow)) % flow_sample != 0){
+        sample_skipped++;
+        return 0;
+    }
+
     be13::tcp_seq seq  = ntohl(tcp_header->th_seq);
     bool syn_set = FLAG_SET(tcp_header->th_flags, TH_SYN);
     bool ack_set = FLAG_SET(tcp_header->th_flags, TH_ACK);
@@ -472,7 +1104,10 @@ int tcpdemux::process_tcp(const ipaddr &src, const ipaddr &dst,sa_family_t famil
 
     /* see if we have state about this flow; if not, create it */
     int32_t  delta = 0;			// from current position in tcp connection; must be SIGNED 32 bit!
-    tcpip   *tcp = find_tcpip(this_flow);
+    int      dir = tcp_session::direction(this_flow);
+    tcp_session *session = find_session(this_flow); // one lookup for both directions
+    tcpip   *tcp = session ? session->half[dir] : 0;
+    tracer::event(trace_record::TCP,tcp_datalen,tcp ? tcp->myflow.id : ~(uint64_t)0,seq);
 
     DEBUG(60)("%s%s%s%s tcp_header_len=%d tcp_datalen=%d seq=%u tcp=%p",
               (syn_set?"SYN ":""),(ack_set?"ACK ":""),(fin_set?"FIN ":""),(rst_set?"RST ":""),(int)tcp_header_len,(int)tcp_datalen,(int)seq,tcp);
@@ -485,6 +1120,35 @@ int tcpdemux::process_tcp(const ipaddr &src, const ipaddr &dst,sa_family_t famil
         return 1;
     }
 
+    /* With -S syn_table, a SYN with no data is only a record until its
+     * SYN/ACK or its first data; see syn_table.h
+     */
+    if(tcp==0 && syn_table_size>0){
+        if(syns.capacity()==0){
+            syns.resize(syn_table_size);
+            mem_budget::charge(mem_budget::SESSIONS,syns.bytes());
+        }
+        if(syn_set && ack_set){
+            flow_addr client(dst,src,this_flow.dport,this_flow.sport,family);
+            syn_table<flow_addr>::entry *e = syns.find(client,pi.ts.tv_sec,syn_timeout);
+            if(e && (session==0 || session->half[1-dir]==0)) promote_syn(e,pi,session,true);
+        } else {
+            syn_table<flow_addr>::entry *e = syns.find(this_flow,pi.ts.tv_sec,syn_timeout);
+            if(tcp_datalen==0){
+                if(syn_set && !rst_set && !fin_set){
+                    syns.add_syn(e,this_flow,seq,pi.ts,pi.pcap_hdr->len,pi.pcap_hdr->caplen,
+                                 pi.ts.tv_sec,syn_timeout);
+                } else if(e && (rst_set || fin_set)){
+                    syns.reset(e);      // it never got anywhere
+                } else if(e){
+                    syns.count(e,pi.ts,pi.pcap_hdr->len,pi.pcap_hdr->caplen); // the ACK of the handshake
+                }
+                return 0;
+            }
+            if(e) tcp = promote_syn(e,pi,session,false);
+        }
+    }
+
     if(tcp==0){
         if(tcp_datalen==0){                       // zero length packet
             if(fin_set) return 0;              // FIN on a connection that's unknown; safe to ignore
@@ -499,19 +1163,7 @@ int tcpdemux::process_tcp(const ipaddr &src, const ipaddr &dst,sa_family_t famil
             saved_flow_map_t::const_iterator it = saved_flow_map.find(this_flow);
             if(it!=saved_flow_map.end()){
                 uint32_t offset = seq - it->second->isn - 1;
-                bool data_match = false;
-                int fd = open(it->second->saved_filename.c_str(),O_RDONLY | O_BINARY);
-                if(fd>0){
-                    char *buf = (char *)malloc(tcp_datalen);
-                    if(buf){
-                        DEBUG(100)("lseek(fd,%" PRId64 ",SEEK_SET)",(int64_t)(offset));
-                        lseek(fd,offset,SEEK_SET);
-                        ssize_t r = read(fd,buf,tcp_datalen);
-                        data_match = (r==(ssize_t)tcp_datalen) && memcmp(buf,tcp_data,tcp_datalen)==0;
-                        free(buf);
-                    }
-                    close(fd);
-                }
+                bool data_match = saved_flow_matches(*it->second,offset,tcp_data,tcp_datalen);
                 DEBUG(60)("Packet matches saved flow. offset=%u len=%d filename=%s data match=%d\n",
                           (u_int)offset,(u_int)tcp_datalen,it->second->saved_filename.c_str(),(u_int)data_match);
                 if(data_match) return 0;
@@ -533,7 +1185,9 @@ int tcpdemux::process_tcp(const ipaddr &src, const ipaddr &dst,sa_family_t famil
 	delta = seq - tcp->nsn;		// notice that signed offset is calculated
 
 	if(abs(delta) > opt.max_seek){
-	    remove_flow(this_flow);
+	    bool last = session->half[1-dir]==0;
+	    post_process(tcp);
+	    if(last) session = 0;       // went with it
 	    delta = 0;
 	    tcp = 0;
 	}
@@ -557,8 +1211,7 @@ int tcpdemux::process_tcp(const ipaddr &src, const ipaddr &dst,sa_family_t famil
         if(syn_set==false && tcp_datalen==0) return 0;
 
 	/* Check if this is the server->client flow related to a client->server flow that is being demultiplexed */
-	flow_addr reverse_flow(dst,src,ntohs(tcp_header->th_dport),ntohs(tcp_header->th_sport),family);
-	tcpip   *reverse_tcp = find_tcpip(reverse_flow);
+	tcpip   *reverse_tcp = session ? session->half[1-dir] : 0;
 	uint64_t uid;
 	if (reverse_tcp)
 	{
@@ -568,19 +1221,20 @@ int tcpdemux::process_tcp(const ipaddr &src, const ipaddr &dst,sa_family_t famil
 	else
 	{
 	    /* Assign a new unique ID */
-	    uid = unique_id++;
+	    uid = unique_id++*nshards+shard;
 	}
 
 	/* Create a new connection.
 	 * delta will be 0, because it's a new connection!
 	 */
         be13::tcp_seq isn = syn_set ? seq : seq-1;
-	tcp = create_tcpip(this_flow, isn, pi);
+	tcp = create_tcpip(this_flow, isn, pi, session);
 	tcp->myflow.session_id = uid;
     }
 
     /* Now tcp is valid */
     tcp->myflow.tlast = pi.ts;		// most recently seen packet
+    if(tcp_timeout) flow_timeouts.schedule(tcp,pi.ts.tv_sec + tcp_timeout + 1);
     tcp->last_packet_number = packet_counter++;
     tcp->myflow.len += pi.pcap_hdr->len;
     tcp->myflow.caplen += pi.pcap_hdr->caplen;
@@ -631,30 +1285,30 @@ int tcpdemux::process_tcp(const ipaddr &src, const ipaddr &dst,sa_family_t famil
      * Notice that this typically won't be called for the SYN or SYN/ACK,
      * since they both have no data by definition.
      */
-    if (tcp_datalen>0){
-	if (opt.console_output) {
+    if (tcp_datalen>0 && tcp->bypass){
+        tcp->skip_packet(tcp_datalen,delta); // -S flow_policy: only counted
+    } else if (tcp_datalen>0){
+	int64_t offset = (int64_t)tcp->pos+delta;  // before store_packet() moves pos
+	if (policy::console(*this)) {
 	    tcp->print_packet(tcp_data, tcp_datalen);
 	} else {
-	    if (opt.store_output){
+	    if (policy::store(*this)){
 		bool new_file = false;
 		if (tcp->fd < 0) new_file = true;
 
-		tcp->store_packet(tcp_data, tcp_datalen, delta,pi.ts);
+		tcp->store_packet<policy>(tcp_data, tcp_datalen, delta,pi.ts);
 
-		if(new_file && tcp_alert_fd>=0){
-		    std::stringstream ss;
-		    ss << "open\t" << tcp->flow_pathname.c_str() << "\n";
-		    const std::string &sso = ss.str();
-		    if(write(tcp_alert_fd,sso.c_str(),sso.size())!=(int)sso.size()){
-			perror("write");
-		    }
-		}
+		if(new_file && tcp->fd>=0 && policy::alerts()) tcp_alert("open",*tcp); // not while it is staging
 	    }
 	}
+	/* after the file is opened, so that the event has the name it was given */
+	if (json_stream::segments() && offset >= 0){
+	    json_stream::segment(*tcp,pi.ts,offset,tcp_data,tcp_datalen);
+	}
     }
 
     if (rst_set){
-        remove_flow(this_flow);	// take it out of the map
+        post_process(tcp);	// take it out of the map
         return 0;
     }
 
@@ -667,7 +1321,8 @@ int tcpdemux::process_tcp(const ipaddr &src, const ipaddr &dst,sa_family_t famil
             tcp->fin_size = (seq+tcp_datalen-tcp->isn)-1;
         }
     } else {
-        open_flows.move_to_end(tcp);
+        if(exact_fd_lru) open_flows.move_to_end(tcp);
+        else open_flows.touch(tcp);
     }
 
     /* If a fin was sent and we've seen all of the bytes, close the stream */
@@ -675,7 +1330,8 @@ int tcpdemux::process_tcp(const ipaddr &src, const ipaddr &dst,sa_family_t famil
 
     if (tcp->fin_count>0 && tcp->seen_bytes() == tcp->fin_size){
         DEBUG(50)("all bytes have been received; removing flow");
-        remove_flow(this_flow);	// take it out of the map
+        post_process(tcp);	// take it out of the map
+        return 0;
     }
 
     DEBUG(50)("fin_set=%d  seq=%u fin_count=%d  seq_count=%d len=%d isn=%u",
@@ -689,7 +1345,9 @@ int tcpdemux::process_tcp(const ipaddr &src, const ipaddr &dst,sa_family_t famil
  * it's valid and contains a TCP segment; if so, we pass it to
  * process_tcp() for further processing.
  *
- * Note: we currently don't know how to handle IP fragments. */
+ * Fragments are held by frags until their datagram is complete, which is
+ * then processed as if it had arrived in one piece. With -S ip_defrag=0
+ * every fragment but the first is thrown away. */
 #pragma GCC diagnostic ignored "-Wcast-align"
 
 
@@ -701,11 +1359,13 @@ int tcpdemux::process_ip4(const be13::packet_info &pi)
 	DEBUG(6) ("received truncated IP datagram!");
 	return -1;                      // couldn't process
     }
+    metrics::count(metrics::IP4,pi.ip_datalen);
+    tracer::event(trace_record::IP4,pi.ip_datalen);
 
     const struct be13::ip4 *ip_header = (struct be13::ip4 *) pi.ip_data;
 
     DEBUG(100)("process_ip4. caplen=%d vlan=%d  ip_p=%d",(int)pi.pcap_hdr->caplen,(int)pi.vlan(),(int)ip_header->ip_p);
-    if(debug>200){
+    if(DEBUG_ON(201)){
 	sbuf_t sbuf(pos0_t(),(const uint8_t *)pi.ip_data,pi.ip_datalen,pi.ip_datalen,false, false);
 	sbuf.hex_dump(std::cerr);
     }
@@ -726,11 +1386,18 @@ int tcpdemux::process_ip4(const be13::packet_info &pi)
 		  (long) pi.ip_datalen, (long) ip_len);
     }
 
-    /* XXX - throw away everything but fragment 0; this version doesn't
-     * know how to do fragment reassembly.
-     */
+    if (ip_reassembler::enabled && ip_reassembler::is_fragment(pi.ip_data,pi.ip_datalen)) {
+        const uint8_t *dgram = 0;
+        size_t dgram_len = 0;
+        int r = frags.add(pi.ts,pi.ip_data,pi.ip_datalen,&dgram,&dgram_len);
+        if (r<=0) return r;             // held, or rejected
+        be13::packet_info rpi(pi.pcap_dlt,pi.pcap_hdr,pi.pcap_data,pi.ts,dgram,dgram_len);
+        return process_ip4(rpi);
+    }
+
+    /* without reassembly, throw away everything but fragment 0 */
     if (ntohs(ip_header->ip_off) & 0x1fff) {
-	DEBUG(2) ("warning: throwing away IP fragment from X to X");
+	DEBUG(2) ("warning: throwing away IP fragment");
 	return -1;
     }
 
@@ -756,7 +1423,8 @@ int tcpdemux::process_ip4(const be13::packet_info &pi)
 
 /* This is called when we receive an IPv6 datagram.
  *
- * Note: we don't support IPv6 extended headers
+ * The extension headers are walked to find the TCP header. Fragments
+ * are reassembled as for IPv4, in the same frags.
  */
 
 /* These might be defined from an include file, so undef them to be sure */
@@ -768,25 +1436,76 @@ int tcpdemux::process_ip6(const be13::packet_info &pi)
 	DEBUG(6) ("received truncated IPv6 datagram!");
 	return -1;
     }
+    metrics::count(metrics::IP6,pi.ip_datalen);
+    tracer::event(trace_record::IP6,pi.ip_datalen);
 
     const struct be13::ip6_hdr *ip_header = (struct be13::ip6_hdr *) pi.ip_data;
 
+    ip6_headers headers;
+    if (!headers.walk(pi.ip_data,pi.ip_datalen)) {
+	DEBUG(6) ("received IPv6 datagram with truncated or too many extension headers");
+	return -1;
+    }
+
+    if (headers.fragment) {
+        if (!ip_reassembler::enabled || headers.proto != IPPROTO_TCP) {
+            DEBUG(2) ("warning: throwing away IPv6 fragment");
+            return -1;
+        }
+        const uint8_t *dgram = 0;
+        size_t dgram_len = 0;
+        int r = frags.add6(pi.ts,pi.ip_data,pi.ip_datalen,headers.fragment,&dgram,&dgram_len);
+        if (r<=0) return r;             // held, or rejected
+        be13::packet_info rpi(pi.pcap_dlt,pi.pcap_hdr,pi.pcap_data,pi.ts,dgram,dgram_len);
+        return process_ip6(rpi);
+    }
+
     /* for now we're only looking for TCP; throw away everything else */
-    if (ip_header->ip6_ctlun.ip6_un1.ip6_un1_nxt != IPPROTO_TCP) {
-	DEBUG(50) ("got non-TCP frame -- IP proto %d", ip_header->ip6_ctlun.ip6_un1.ip6_un1_nxt);
+    if (headers.proto != IPPROTO_TCP) {
+	DEBUG(50) ("got non-TCP frame -- IP proto %d", headers.proto);
 	return -1;
     }
 
-    /* do TCP processing */
-    uint16_t ip_payload_len = ntohs(ip_header->ip6_ctlun.ip6_un1.ip6_un1_plen);
+    /* do TCP processing; the payload length includes the extension headers */
+    size_t ip_len = sizeof(struct be13::ip6_hdr) + ntohs(ip_header->ip6_ctlun.ip6_un1.ip6_un1_plen);
+    if (ip_len < headers.offset) {
+	DEBUG(6) ("received truncated IPv6 datagram!");
+	return -1;
+    }
+    uint16_t ip_payload_len = ip_len - headers.offset;
     ipaddr src(ip_header->ip6_src.addr.addr8);
     ipaddr dst(ip_header->ip6_dst.addr.addr8);
 
     return (this->*tcp_processor)(src, dst ,AF_INET6,
-                                   pi.ip_data + sizeof(struct be13::ip6_hdr),
+                                   pi.ip_data + headers.offset,
                                    ip_payload_len,pi);
 }
 
+/* Start loading the flow table slot that process_pkt(pi) will look at.
+ * Only plain IPv4 and IPv6 TCP packets are looked at; this is only a hint,
+ * so anything out of the ordinary is left to process_pkt.
+ */
+#pragma GCC diagnostic ignored "-Wcast-align"
+void tcpdemux::prefetch_flow(const be13::packet_info &pi) const
+{
+    const uint8_t *ip = pi.ip_data;
+    if(pi.ip_datalen < sizeof(struct be13::ip4)) return;
+    if((ip[0]>>4)==4){
+        const struct be13::ip4 *ip_header = (const struct be13::ip4 *)ip;
+        size_t hlen = ip_header->ip_hl * 4;
+        if(ip_header->ip_p!=IPPROTO_TCP || pi.ip_datalen < hlen+4) return;
+        const struct be13::tcphdr *tcp_header = (const struct be13::tcphdr *)(ip+hlen);
+        flow_map.prefetch(tcp_session::canonical(flow_addr(ip_header->ip_src.addr,ip_header->ip_dst.addr,
+                                    ntohs(tcp_header->th_sport),ntohs(tcp_header->th_dport),AF_INET)));
+    } else if((ip[0]>>4)==6){
+        const struct be13::ip6_hdr *ip_header = (const struct be13::ip6_hdr *)ip;
+        if(ip_header->ip6_ctlun.ip6_un1.ip6_un1_nxt!=IPPROTO_TCP || pi.ip_datalen < sizeof(*ip_header)+4) return;
+        const struct be13::tcphdr *tcp_header = (const struct be13::tcphdr *)(ip+sizeof(*ip_header));
+        flow_map.prefetch(tcp_session::canonical(flow_addr(ip_header->ip6_src.addr.addr8,ip_header->ip6_dst.addr.addr8,
+                                    ntohs(tcp_header->th_sport),ntohs(tcp_header->th_dport),AF_INET6)));
+    }
+}
+
 /* This is called when we receive an IPv4 or IPv6 datagram.
  * This function calls process_ip4 or process_ip6
  * Returns 0 if packet is processed, 1 if it is not processed, -1 if error.
@@ -807,27 +1526,96 @@ int tcpdemux::process_pkt(const be13::packet_info &pi)
     }
     if(r!=0){                           // packet not processed?
         /* Write the packet if we didn't process it */
-        if(pwriter) pwriter->writepkt(pi.pcap_hdr,pi.pcap_data);
+        if(pwriter){
+            std::lock_guard<std::mutex> lock(output_M);
+            pwriter->writepkt(pi.pcap_hdr,pi.pcap_data,pi.pcap_dlt);
+        }
     }
+    housekeeping(pi.ts);
+    return r;
+}
 
-    /* Process the timeout, if there is any */
-    if(tcp_timeout){
-        /* Get a list of the flows that need to be closed.  */
-        std::vector<flow_addr *> to_close;
-        for(flow_map_t::iterator it = flow_map.begin(); it!=flow_map.end(); it++){
-            tcpip &tcp = *(it->second);
-            uint32_t age = pi.ts.tv_sec - tcp.myflow.tlast.tv_sec;
-            if (age > tcp_timeout){
-                to_close.push_back(&tcp.myflow);
-            }
+/* A run of segment_coalescer segments: one flow, in order, with data and
+ * no SYN, FIN or RST. The first is processed as any packet is, and makes
+ * or finds the flow; the others follow it with no lookup, as long as they
+ * start where the flow expects its next byte.
+ */
+void tcpdemux::process_run(const segment_coalescer::run_t &run,const flow_addr &key)
+{
+    {
+        const segment_coalescer::segment &s = run[0];
+        be13::packet_info pi(s.dlt,&s.hdr,s.data,s.ts,s.ip_data,s.ip_datalen);
+        process_pkt(pi);
+    }
+    tcpip *tcp = find_tcpip(key);
+    size_t i = 1;
+    if(tcp && tcp->nsn==run[1].seq && tcp->fin_count==0){
+        bool new_file = tcp->fd < 0;
+        metrics::stage_t ip_stage = key.family==AF_INET6 ? metrics::IP6 : metrics::IP4;
+        for(;i<run.size();i++){
+            const segment_coalescer::segment &s = run[i];
+            metrics::count(ip_stage,s.ip_datalen);
+            metrics::count(metrics::TCP,s.tcp_length);
+            tcp->myflow.len    += s.hdr.len;
+            tcp->myflow.caplen += s.hdr.caplen;
+            if(tcp->bypass) tcp->skip_packet(s.length,(int32_t)(s.seq - tcp->nsn));
+            else tcp->store_packet<tcp_policy_any>(s.payload,s.length,(int32_t)(s.seq - tcp->nsn),s.ts);
         }
-        /* Close them. This removes the flows from the flow_map(), which is why we need
-         * to create the list first.
-         */
-        for(std::vector<flow_addr *>::iterator it = to_close.begin(); it!=to_close.end(); it++){
-            remove_flow(*(*it));
+        uint64_t n = run.size()-1;
+        tcp->myflow.packet_count += n;
+        tcp->myflow.tlast = run.back().ts;
+        if(tcp_timeout) flow_timeouts.schedule(tcp,tcp->myflow.tlast.tv_sec + tcp_timeout + 1);
+        packet_counter += n;
+        tcp->last_packet_number = packet_counter-1;
+        if(new_file && tcp->fd>=0 && tcp_alert_fd>=0) tcp_alert("open",*tcp);
+        if(exact_fd_lru) open_flows.move_to_end(tcp);
+        else open_flows.touch(tcp);
+        housekeeping(run.back().ts);
+        return;
+    }
+    /* the flow was not started, or was closed, or is somewhere else; each goes the usual way */
+    for(;i<run.size();i++){
+        const segment_coalescer::segment &s = run[i];
+        be13::packet_info pi(s.dlt,&s.hdr,s.data,s.ts,s.ip_data,s.ip_datalen);
+        process_pkt(pi);
+    }
+}
+
+void tcpdemux::tick(const struct timeval &ts)
+{
+    /* Process the timeout, if there is any.
+     * Flows are rescheduled on flow_timeouts each time a packet is seen,
+     * so only the flows idle for longer than tcp_timeout come back.
+     */
+    if(tcp_timeout){
+        std::vector<tcpip *> to_close;
+        flow_timeouts.expire(ts.tv_sec,to_close);
+        /* Close them. This removes the flows from the flow_map() */
+        for(std::vector<tcpip *>::iterator it = to_close.begin(); it!=to_close.end(); it++){
+            post_process(*it);
         }
     }
-    return r;
+
+    /* -S memory_max; once a second at most once it has done what it can */
+    if(mem_budget::over()){
+        if(start_new_connections || ts.tv_sec!=budget_enforced) enforce_budget(ts.tv_sec);
+    } else if(memory_refusing && mem_budget::low_water()){
+        DEBUG(1)("under memory_max again: starting new connections");
+        start_new_connections = true;
+        memory_refusing = false;
+    }
+}
+
+void tcpdemux::idle(time_t now)
+{
+    if(last_packet.tv_sec!=idle_packet.tv_sec || last_packet.tv_usec!=idle_packet.tv_usec){
+        idle_packet = last_packet;      // there were packets since the last call; count from here
+        idle_clock = now;
+        return;
+    }
+    if(last_packet.tv_sec==0) return;   // none yet
+    struct timeval ts = last_packet;
+    ts.tv_sec += now - idle_clock;
+    tick(ts);
 }
 #pragma GCC diagnostic warning "-Wcast-align"
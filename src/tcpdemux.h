@@ -21,10 +21,6 @@
 #include "dfxml/src/dfxml_writer.h"
 #include "dfxml/src/hash_t.h"
 
-#if defined(HAVE_SQLITE3_H)
-#include <sqlite3.h>
-#endif
-
 #if defined(HAVE_UNORDERED_MAP)
 # include <unordered_map>
 # include <unordered_set>
@@ -39,45 +35,54 @@
 #endif
 
 #include <queue>
+#include <deque>
+#include <mutex>
 #include "intrusive_list.h"
+#include "timer_wheel.h"
+#include "flow_table.h"
+#include "slab_allocator.h"
+#include "ip_reassembly.h"
+#include "uring_writer.h"
+#include "output_roots.h"
+#include "segment_store.h"
+#include "zstd_transcript.h"
+#include "syn_table.h"
+#include "segment_coalescer.h"
+
+class tcpdemux_pool;
+class scan_pool;
+class cmd_pool;
+class report_writer;
 
 /**
  * the tcp demultiplixer
  * This is a singleton class; we only need a single demultiplexer.
+ * With --threads, the singleton feeds a tcpdemux_pool of worker demuxes,
+ * and getInstance() returns the worker that runs on the calling thread.
  */
 class tcpdemux {
-    /* see http://mikecvet.wordpress.com/tag/hashing/ */
     typedef struct {
-        long operator() (const flow_addr &k) const {return k.hash(); }
+        uint64_t operator() (const flow_addr &k) const {return k.hash(); }
     } flow_addr_hash;
 
     typedef struct {
         bool operator() (const flow_addr &x, const flow_addr &y) const { return x==y;}
     } flow_addr_key_eq;
 
-#ifdef HAVE_TR1_UNORDERED_MAP
-    typedef std::tr1::unordered_map<flow_addr,tcpip *,flow_addr_hash,flow_addr_key_eq> flow_map_t; // active flows
-    typedef std::tr1::unordered_map<flow_addr,saved_flow *,flow_addr_hash,flow_addr_key_eq> saved_flow_map_t; // flows that have been saved
-    typedef std::tr1::unordered_map<flow_addr,sparse_saved_flow *,flow_addr_hash,flow_addr_key_eq> sparse_saved_flow_map_t; // flows ctxt caching for pcap dissection
-#else
-    typedef std::unordered_map<flow_addr,tcpip *,flow_addr_hash,flow_addr_key_eq> flow_map_t; // active flows
-    typedef std::unordered_map<flow_addr,saved_flow *,flow_addr_hash,flow_addr_key_eq> saved_flow_map_t; // flows that have been saved
-    typedef std::unordered_map<flow_addr,sparse_saved_flow *,flow_addr_hash,flow_addr_key_eq> sparse_saved_flow_map_t; // flows ctxt caching for pcap dissection
-#endif
-    typedef std::vector<class saved_flow *> saved_flows_t; // needs to be ordered
+    typedef flow_table<flow_addr,tcp_session *,flow_addr_hash,flow_addr_key_eq> flow_map_t; // active connections, by canonical flow
+    typedef flow_table<flow_addr,saved_flow *,flow_addr_hash,flow_addr_key_eq> saved_flow_map_t; // flows that have been saved
+    typedef flow_table<flow_addr,sparse_saved_flow *,flow_addr_hash,flow_addr_key_eq> sparse_saved_flow_map_t; // flows ctxt caching for pcap dissection
+    typedef std::deque<class saved_flow *> saved_flows_t; // oldest first
 
 
     tcpdemux();
-#ifdef HAVE_SQLITE3
-    sqlite3 *db;
-    sqlite3_stmt *insert_flow;
-#endif
-    pcap_writer *flow_sorter;
+    bool flow_sorter;                   // -K: packets go to a pcap file per flow
 
     /* facility logic hinge */
-    int (tcpdemux::*tcp_processor)(const ipaddr &src, const ipaddr &dst,sa_family_t family,
+    typedef int (tcpdemux::*tcp_processor_t)(const ipaddr &src, const ipaddr &dst,sa_family_t family,
                          const u_char *tcp_data, uint32_t tcp_length,
                          const be13::packet_info &pi);
+    tcp_processor_t tcp_processor;
 
 public:
     static uint32_t tcp_timeout;
@@ -85,12 +90,14 @@ public:
     static int tcp_subproc_max;              // how many subprocesses are we allowed?
     static int tcp_subproc;                   // how many do we currently have?
     static int tcp_alert_fd; 
+    static std::mutex output_M;              // serializes writes to outputs shared between worker threads
+    static scan_pool *scanners;              // -S scan_threads: where post_process() sends flows to be scanned
+    static cmd_pool  *tcp_workers;           // -S tcp_cmd_workers: where post_process() sends flows for tcp_cmd
+    static report_writer *reports;           // -S report_thread: what writes the flows' reports
+    static void report(class dfxml_writer *x,const struct flow_report &r,const std::string &xmladd);
     
     static unsigned int get_max_fds(void);             // returns the max
-    virtual ~tcpdemux(){
-        delete xreport;
-        delete pwriter;
-    }
+    virtual ~tcpdemux();
 
     /* The pure options class means we can add new options without having to modify the tcpdemux constructor. */
     class options {
@@ -103,7 +110,7 @@ public:
                   max_flows(0),suppress_header(0),
                   output_strip_nonprint(true),output_json(false),
                   output_pcap(false),output_hex(false),use_color(0),
-                  output_packet_index(false),max_seek(MAX_SEEK) {
+                  output_packet_index(false),output_segments(false),output_zstd(false),max_seek(MAX_SEEK) {
         }
         bool    console_output;
         bool    console_output_nonewline;
@@ -121,12 +128,14 @@ public:
         bool    use_color;
         bool    output_packet_index;    // Generate a packet index file giving the timestamp and location
                                         // bytes written to the flow file.
+        bool    output_segments;        // --segments: append flows to segment files instead of a file each
+        bool    output_zstd;            // -S compress=zstd: transcripts are .zst files; see zstd_transcript.h
         int32_t max_seek;               // signed becuase we compare with abs()
     };
 
     enum { WARN_TOO_MANY_FILES=10000};  // warn if more than this number of files in a directory
 
-    std::string  outdir;                 /* output directory */
+    std::string  outdir;                 /* output directory; the first of roots */
     uint64_t     flow_counter;           // how many flows have we seen?
     uint64_t     packet_counter;         // monotomically increasing 
     dfxml_writer *xreport;               // DFXML output file
@@ -134,32 +143,75 @@ public:
     unsigned int max_open_flows;        // how large did it ever get?
     unsigned int max_fds;               // maximum number of file descriptors for this tcpdemux
     uint64_t     unique_id;                 // next unique id to assign
+    uint64_t     write_buffer_bytes;     // bytes in the write buffers of open flows
+    uint64_t     reorder_held;           // bytes in the reorder windows of all flows
+    unsigned int shard;                 // which worker this is, when running in a pool
+    unsigned int nshards;               // number of workers; flow and session ids are strided by this
+    tcpdemux_pool *pool;                // worker threads, if any
+    output_roots roots;                 // where flows go, with their io_uring writers; see output_roots.h
+    segment_store *segments;            // with --segments; see segment_output()
+    bool         coalesce;              // packets may come in runs, to process_run(); see segment_coalescer.h
 
-    flow_map_t   flow_map;               // db of open tcpip objects, indexed by flow
+    slab_allocator<tcp_session> session_slab; // where tcp_session objects (and so tcpip objects) are allocated
+    flow_map_t   flow_map;               // db of open connections, indexed by tcp_session::canonical()
     intrusive_list<tcpip> open_flows; // the tcpip flows with open files in access order
+    timer_wheel<tcpip> flow_timeouts; // flows by when they expire, if tcp_timeout is set
+    ip_reassembler  frags;           // IP fragments waiting for the rest of their datagram
 
     saved_flow_map_t saved_flow_map;  // db of saved flows, indexed by flow
     sparse_saved_flow_map_t flow_fd_cache_map;  // db caching saved flows descriptors, indexed by flow
+    intrusive_list<sparse_saved_flow> open_pcaps; // the -K flow files that are open, in access order
     saved_flows_t    saved_flows;     // the flows that were saved
     bool             start_new_connections;  // true if we should start new connections
+    bool             memory_refusing;        // enforce_budget() turned start_new_connections off
+    time_t           budget_enforced;        // packet time enforce_budget() last ran
+    struct timeval   last_packet;            // of the last packet processed
+    struct timeval   idle_packet;            // last_packet when idle() found no packets since
+    time_t           idle_clock;             // and the clock then
+    uint64_t         tables_charged;         // bytes of session_slab and flow_map charged to mem_budget
+    syn_table<flow_addr> syns;               // -S syn_table: connections that have only sent a SYN
+    uint64_t         sample_skipped;         // -S flow_sample: TCP packets of connections that were not sampled
 
     options      opt;
     class feature_recorder_set *fs; // where features extracted from each flow should be stored
     
     static uint32_t max_saved_flows;       // how many saved flows are kept in the saved_flow_map
+    static uint32_t saved_flow_tail;       // how many bytes at the end of each saved flow are kept in memory
+    static bool     exact_fd_lru;          // close the least recently used fd rather than using CLOCK
+    static uint32_t write_buffer_size;     // per-flow write buffer; 0 writes every segment directly
+    static uint64_t write_buffer_max;      // limit for all of this demux's write buffers together
+    static uint32_t reorder_window;        // per-flow bytes held past a gap; 0 writes out-of-order segments in place
+    static uint64_t reorder_max;           // limit for all of this demux's reorder windows together
+    static bool     packet_index_text;     // -I writes the old text .findx instead of the binary .findb
+    static uint32_t syn_table_size;        // -S syn_table: records in syns; 0 for none
+    static uint32_t syn_timeout;           // -S syn_timeout: seconds a record lasts without a packet
+    static uint32_t stage_bytes;           // -S stage_bytes: flows up to this big get their file when they finish
+    static uint32_t flow_sample;           // -S flow_sample: keep 1 connection in this many, by its addresses; 1 keeps all
 
     void alter_processing_core();
+    void select_tcp_processor();        // once the options are set; see tcp_policy.h
     static tcpdemux *getInstance();
+    static void set_thread_instance(tcpdemux *demux); // used by worker threads
 
-    /* Databse */
-
-    void  openDB();                    // open the database file if we are using it in outdir directory.
-    void  write_flow_record(const std::string &starttime,const std::string &endtime,
-                            const std::string &src_ipn,const std::string &dst_ipn,
-                            const std::string &mac_daddr,const std::string &mac_saddr,
-                            uint64_t packets,uint16_t srcport,uint16_t dstport,
-                            const std::string &hashdigest_md5);
-
+    /* Threading */
+    tcpdemux *make_worker(unsigned int shard_,unsigned int nshards_) const; // a demux configured like this one
+    /* The scan threads (scan_pool, flow_rescan) are shards SCAN_SHARD_BASE and up, past
+     * any demultiplexer thread's (--threads is less than this), so their segment files are distinct.
+     */
+    enum { SCAN_SHARD_BASE = 1000 };
+    void  start_pool(unsigned int nthreads);
+    void  set_start_new_connections(bool flag);
+    /* The counts below wait for the workers to finish what is queued
+     * (tcpdemux_pool::drain()) before they look at them, so they are only
+     * called from the thread that dispatches to the pool.
+     */
+    size_t open_flow_count() const;    // including the flows of any workers
+    size_t flow_map_count() const;
+    void  session_slab_stats(size_t &peak,size_t &capacity) const; // summed over any workers
+    void  syn_stats(syn_table<flow_addr>::stats &s) const;           // summed over any workers
+    uint64_t sample_skipped_count() const;                          // summed over any workers
+    void  root_flows(std::vector<uint64_t> &flows) const;           // flows placed on each root, summed over any workers
+    void  open_flow_keys(std::vector<flow_addr> &keys) const;       // the flow_map keys of this demux and any workers
 
     void  save_unk_packets(const std::string &wfname,const std::string &ifname);
                                        // save unknown packets at this location
@@ -168,25 +220,50 @@ public:
     /* management of open fds and in-process tcpip flows*/
     void  close_tcpip_fd(tcpip *);         
     void  close_oldest_fd();
+    bool  close_oldest_fd_on(uint16_t root); // false if no flow on root has its file open
+    void  close_oldest_pcap();
+    int   open_pcap(sparse_saved_flow *ssf); // open ssf's -K file within max_fds
+    void  flush_largest_buffers(int root=-1); // bring write_buffer_bytes, or root's share, back under write_buffer_max
+    void  enforce_budget(time_t now);     // give memory back when over -S memory_max; see mem_budget.h
+
+    /* Output files: transcripts and what the scanners extract.
+     * With -S io_uring=1 writes are queued and return at once, and sync_file()
+     * must be called before the file is read, has its times set or is closed.
+     * root is the output root the file is on, whose ring the writes go to.
+     */
+    void  write_file(int fd,const void *data,size_t length,uint64_t offset,uint16_t root=0);
+    void  sync_file(int fd,uint16_t root=0);
+    segment_store *segment_output();       // created when first used
     void  remove_flow(const flow_addr &flow); // remove a flow from the database, closing open files if necessary
     void  remove_all_flows();                 // stop processing all tcpip connections
+    void  checkpoint_flows();                 // with -S checkpoint_file, before remove_all_flows() finishes the rest
 
     /* open a new file, closing an fd in the openflow database if necessary */
     int   retrying_open(const std::string &filename,int oflag,int mask);
 
     /* the flow database holds in-process tcpip connections */
-    tcpip *create_tcpip(const flow_addr &flow, be13::tcp_seq isn, const be13::packet_info &pi);
+    tcp_session *new_session(const flow_addr &key); // key is canonical
+    tcpip *create_tcpip(const flow_addr &flow, be13::tcp_seq isn, const be13::packet_info &pi,tcp_session *session);
+    tcpip *restore_tcpip(const flow &f,be13::tcp_seq isn); // from a checkpoint; 0 if f is already there
     tcpip *find_tcpip(const flow_addr &flow);
+    tcp_session *find_session(const flow_addr &flow); // either direction
+    tcpip *promote_syn(syn_table<flow_addr>::entry *e,const be13::packet_info &pi,tcp_session *&session,bool reverse);
+    void  release_tcpip(tcpip *tcp);   // destroy tcp, and its session if that was the last half
 
     /* saved flows are completed flows that we remember in case straggling packets
      * show up. Remembering the flows lets us resolve the packets rather than creating
      * new flows.
      */
-    void  save_flow(tcpip *);
+    void  save_flow(tcpip *,const std::string *contents=0); // contents: the flow, if post_process() read it
+    void  forget_oldest_saved_flow();
+    void  remember_saved_flow(saved_flow *sf); // takes sf
+    void  restore_saved_flow(saved_flow *sf);  // from a checkpoint; takes sf
+    bool  saved_flow_matches(const saved_flow &sf,uint64_t offset,const u_char *data,size_t length);
 
     /** packet processing.
      * Each returns 0 if processed, 1 if not processed, -1 if error.
      */
+    template<class policy>              // see tcp_policy.h
     int  process_tcp(const ipaddr &src, const ipaddr &dst,sa_family_t family,
                      const u_char *tcp_data, uint32_t tcp_length,
                      const be13::packet_info &pi);
@@ -196,7 +273,16 @@ public:
     int  process_ip4(const be13::packet_info &pi);
     int  process_ip6(const be13::packet_info &pi);
     int  process_pkt(const be13::packet_info &pi);
+    void process_run(const segment_coalescer::run_t &run,const flow_addr &key); // from segment_coalescer
+    void prefetch_flow(const be13::packet_info &pi) const; // before process_pkt(pi); see packet_batch.h
+    /* For a worker of tcpdemux_pool, which may go a long time without a packet of its own */
+    void tick(const struct timeval &ts); // tcp_timeout and -S memory_max at packet time ts
+    void idle(time_t now);               // tick() as far past the last packet as the clock has moved since
 private:;
+    void housekeeping(const struct timeval &ts) { // after each packet
+        last_packet = ts;
+        tick(ts);
+    }
     /* These are not implemented */
     tcpdemux(const tcpdemux &t);
     tcpdemux &operator=(const tcpdemux &that);
@@ -0,0 +1,335 @@
+/**
+ *
+ * tcpdemux_pool.cpp
+ * Worker threads, each running its own tcpdemux on a shard of the flows.
+ *
+ * This file is part of tcpflow by Simson Garfinkel,
+ * originally by Jeremy Elson <jelson@circlemud.org>
+ *
+ * This source code is under the GNU Public License (GPL).  See
+ * LICENSE for details.
+ *
+ */
+
+#include "tcpflow.h"
+#include "tcpip.h"
+#include "tcpdemux.h"
+#include "tcpdemux_pool.h"
+#include "capture_tpacket.h"
+
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+
+/* static */ std::string tcpdemux_pool::cpu_list;
+
+tcpdemux_pool::~tcpdemux_pool()
+{
+    stop();
+    for(std::vector<worker *>::iterator it=workers.begin();it!=workers.end();it++){
+        /* the report and packet writer belong to the parent demux */
+        (*it)->demux->xreport = 0;
+        (*it)->demux->pwriter = 0;
+        delete (*it)->demux;
+        delete *it;
+    }
+    for(std::vector<queued_packet *>::iterator it=free_packets.begin();it!=free_packets.end();it++){
+        delete *it;
+    }
+}
+
+/* Parse a list such as "0-3,8,10-11" */
+static std::vector<int> parse_cpu_list(const std::string &list)
+{
+    std::vector<int> cpus;
+    const char *cc = list.c_str();
+    while(*cc){
+        char *end = 0;
+        long first = strtol(cc,&end,10);
+        if(end==cc) break;              // not a number
+        long last = first;
+        if(*end=='-') last = strtol(end+1,&end,10);
+        for(long cpu=first;cpu<=last;cpu++) cpus.push_back((int)cpu);
+        cc = end;
+        if(*cc==',') cc++;
+    }
+    return cpus;
+}
+
+/* static */ void tcpdemux_pool::pin_this_thread(int cpu)
+{
+    if(cpu<0) return;
+#if defined(__LINUX__) && defined(HAVE_PTHREAD_H) && defined(CPU_SET)
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu,&set);
+    int r = pthread_setaffinity_np(pthread_self(),sizeof(set),&set);
+    if(r){
+        DEBUG(1)("cannot pin thread to CPU %d: %s",cpu,strerror(r));
+    }
+#else
+    DEBUG(1)("pin_cpus is not supported on this system");
+#endif
+}
+
+void tcpdemux_pool::start(tcpdemux &parent,unsigned int nthreads)
+{
+    assert(workers.size()==0);
+    DEBUG(1)("starting %u demultiplexer threads",nthreads);
+    std::vector<int> cpus = parse_cpu_list(cpu_list);
+    for(unsigned int i=0;i<nthreads;i++){
+        int cpu = cpus.size()>0 ? cpus[i % cpus.size()] : -1;
+        workers.push_back(new worker(parent.make_worker(i,nthreads),cpu));
+    }
+    for(std::vector<worker *>::iterator it=workers.begin();it!=workers.end();it++){
+        (*it)->thread = std::thread(&tcpdemux_pool::run,this,*it);
+    }
+}
+
+tcpdemux_pool::queued_packet *tcpdemux_pool::alloc_packet()
+{
+    {
+        std::lock_guard<std::mutex> lock(free_M);
+        if(free_packets.size()>0){
+            queued_packet *qp = free_packets.back();
+            free_packets.pop_back();
+            return qp;
+        }
+    }
+    return new queued_packet();
+}
+
+void tcpdemux_pool::free_packet(queued_packet *qp)
+{
+    std::lock_guard<std::mutex> lock(free_M);
+    free_packets.push_back(qp);
+}
+
+static inline uint64_t endpoint_hash(const uint8_t *addr,size_t addrlen,uint16_t port)
+{
+    uint64_t h = port;
+    for(size_t i=0;i<addrlen;i+=4){
+        h = hash_mix64(h ^ ((uint64_t)addr[i]<<24 | (uint64_t)addr[i+1]<<16 | (uint64_t)addr[i+2]<<8 | addr[i+3]));
+    }
+    return h;
+}
+
+/* Hash the two endpoints of the packet so that A->B and B->A produce the same value.
+ * Packets that are not TCP (or are too short to tell) all hash to 0.
+ */
+/* static */ uint64_t tcpdemux_pool::shard_hash(const be13::packet_info &pi)
+{
+    const uint8_t *ip = pi.ip_data;
+    const uint8_t *src = 0;
+    const uint8_t *dst = 0;
+    size_t addrlen = 0;
+    size_t tcp_offset = 0;
+
+    switch(pi.ip_version()){
+    case 4:
+        if(pi.ip_datalen < sizeof(struct be13::ip4)) return 0;
+        if(ip[9]!=IPPROTO_TCP) return 0;
+        src = ip+12; dst = ip+16; addrlen = 4;
+        /* non-first fragments carry no ports (only with -S ip_defrag=0 do they get here) */
+        tcp_offset = ((ip[6] & 0x1f) | ip[7]) ? 0 : (ip[0] & 0x0f) * 4;
+        break;
+    case 6: {
+        ip6_headers headers;
+        if(!headers.walk(ip,pi.ip_datalen) || headers.proto!=IPPROTO_TCP) return 0;
+        src = ip+8; dst = ip+24; addrlen = 16;
+        tcp_offset = headers.fragment ? 0 : headers.offset;
+        break;
+    }
+    default:
+        return 0;
+    }
+    uint16_t sport = 0;
+    uint16_t dport = 0;
+    if(tcp_offset>0 && pi.ip_datalen >= tcp_offset+4){
+        sport = (ip[tcp_offset+0]<<8) | ip[tcp_offset+1];
+        dport = (ip[tcp_offset+2]<<8) | ip[tcp_offset+3];
+    }
+    /* addition is commutative, so the direction does not matter */
+    return endpoint_hash(src,addrlen,sport) + endpoint_hash(dst,addrlen,dport);
+}
+
+/* static */ uint64_t tcpdemux_pool::shard_hash(const flow_addr &a)
+{
+    size_t addrlen = a.family==AF_INET6 ? 16 : 4;
+    return endpoint_hash(a.src.addr,addrlen,a.sport) + endpoint_hash(a.dst.addr,addrlen,a.dport);
+}
+
+/* IP fragments are put back together here, before they are hashed,
+ * so that a reassembled datagram goes to the worker its ports select.
+ */
+void tcpdemux_pool::dispatch(const be13::packet_info &pi)
+{
+    if(ip_reassembler::enabled){
+        const uint8_t *dgram = 0;
+        size_t dgram_len = 0;
+        int r = -2;                     // not a fragment
+        if(pi.ip_version()==4){
+            if(ip_reassembler::is_fragment(pi.ip_data,pi.ip_datalen) && pi.ip_data[9]==IPPROTO_TCP){
+                r = frags.add(pi.ts,pi.ip_data,pi.ip_datalen,&dgram,&dgram_len);
+            }
+        } else if(pi.ip_version()==6 && pi.ip_datalen > ip6_headers::FIXED_LEN && pi.ip_data[6]!=IPPROTO_TCP){
+            ip6_headers headers;
+            if(headers.walk(pi.ip_data,pi.ip_datalen) && headers.fragment && headers.proto==IPPROTO_TCP){
+                r = frags.add6(pi.ts,pi.ip_data,pi.ip_datalen,headers.fragment,&dgram,&dgram_len);
+            }
+        }
+        if(r==0 || r==-1) return;       // held, or rejected
+        if(r==1){
+            be13::packet_info rpi(pi.pcap_dlt,pi.pcap_hdr,pi.pcap_data,pi.ts,dgram,dgram_len);
+            dispatch(rpi);
+            return;
+        }
+    }
+    worker *w = workers[shard_hash(pi) % workers.size()];
+    queued_packet *qp = alloc_packet();
+
+    qp->dlt        = pi.pcap_dlt;
+    qp->hdr        = *pi.pcap_hdr;
+    qp->ts         = pi.ts;
+    qp->ip_datalen = pi.ip_datalen;
+    qp->data.assign(pi.pcap_data,pi.pcap_data+pi.pcap_hdr->caplen);
+    if(pi.ip_data >= pi.pcap_data && pi.ip_data+pi.ip_datalen <= pi.pcap_data+pi.pcap_hdr->caplen){
+        qp->ip_offset = pi.ip_data - pi.pcap_data;
+    } else {
+        /* ip data was not inside the frame (e.g. a decoded wifi frame); keep a copy after it */
+        qp->ip_offset = qp->data.size();
+        qp->data.insert(qp->data.end(),pi.ip_data,pi.ip_data+pi.ip_datalen);
+    }
+    if(qp->data.size()==0) qp->data.push_back(0); // so that &data[0] is valid
+
+    std::unique_lock<std::mutex> lock(w->M);
+    while(w->queue.size() >= MAX_QUEUED_PACKETS){
+        w->space_ready.wait(lock);
+    }
+    w->queue.push_back(qp);
+    w->work_ready.notify_one();
+    lock.unlock();
+
+    if(pi.ts.tv_sec!=last_tick){
+        last_tick = pi.ts.tv_sec;
+        tick_all(pi.ts);
+    }
+}
+
+/* Each worker runs tcpdemux::tick(ts) once it has processed what is queued now */
+void tcpdemux_pool::tick_all(const struct timeval &ts)
+{
+    for(std::vector<worker *>::iterator it=workers.begin();it!=workers.end();it++){
+        std::lock_guard<std::mutex> lock((*it)->M);
+        (*it)->tick = ts;
+        (*it)->ticked = true;
+        (*it)->work_ready.notify_one();
+    }
+}
+
+void tcpdemux_pool::run(worker *w)
+{
+    tcpdemux::set_thread_instance(w->demux);
+    pin_this_thread(w->cpu);
+    packet_queue_t batch;
+    struct timeval tick;
+    bool ticked = false;
+    while(true){
+        {
+            std::unique_lock<std::mutex> lock(w->M);
+            while(w->queue.empty() && !w->ticked && !w->stopping){
+                w->work_ready.wait(lock);
+            }
+            if(w->queue.empty() && !w->ticked) break; // stopping and nothing left to do
+            batch.swap(w->queue);
+            ticked = w->ticked;
+            tick = w->tick;
+            w->ticked = false;
+            w->busy = true;
+        }
+        w->space_ready.notify_all();
+        for(packet_queue_t::iterator it=batch.begin();it!=batch.end();it++){
+            queued_packet *qp = *it;
+            be13::packet_info pi(qp->dlt,&qp->hdr,&qp->data[0],qp->ts,&qp->data[qp->ip_offset],qp->ip_datalen);
+            w->demux->process_pkt(pi);
+            free_packet(qp);
+        }
+        batch.clear();
+        if(ticked) w->demux->tick(tick); // after the packets that were queued before it
+        {
+            std::lock_guard<std::mutex> lock(w->M);
+            w->busy = false;
+        }
+        w->space_ready.notify_all();
+    }
+    /* Flows are closed by the worker that owns them */
+    w->demux->remove_all_flows();
+    tcpdemux::set_thread_instance(0);
+}
+
+/*
+ * A capture thread is its worker's demux for as long as the ring runs; the worker
+ * thread itself stays idle because nothing is dispatched to it, and only touches
+ * the demux again when stop() is called, after these threads have been joined.
+ */
+void tcpdemux_pool::capture_run(worker *w,tpacket_ring *ring,pcap_handler handler,int *result)
+{
+    tcpdemux::set_thread_instance(w->demux);
+    pin_this_thread(w->cpu);
+    ring->idle = ring_idle;
+    *result = ring->loop(handler,(u_char *)w->demux);
+    tcpdemux::set_thread_instance(0);
+}
+
+/* static */ void tcpdemux_pool::ring_idle(u_char *user)
+{
+    reinterpret_cast<tcpdemux *>(user)->idle(time(0));
+}
+
+int tcpdemux_pool::capture(const std::vector<tpacket_ring *> &rings,pcap_handler handler)
+{
+    assert(rings.size()==workers.size());
+    std::vector<int> results(rings.size(),0);
+    std::vector<std::thread> threads;
+    for(size_t i=0;i<rings.size();i++){
+        threads.push_back(std::thread(&tcpdemux_pool::capture_run,this,workers[i],rings[i],handler,&results[i]));
+    }
+    int ret = 0;
+    for(size_t i=0;i<threads.size();i++){
+        threads[i].join();
+        if(results[i]<0) ret = -1;
+    }
+    return ret;
+}
+
+void tcpdemux_pool::drain()
+{
+    for(std::vector<worker *>::iterator it=workers.begin();it!=workers.end();it++){
+        std::unique_lock<std::mutex> lock((*it)->M);
+        while(!(*it)->queue.empty() || (*it)->ticked || (*it)->busy){
+            (*it)->space_ready.wait(lock);
+        }
+    }
+}
+
+void tcpdemux_pool::set_start_new_connections(bool flag)
+{
+    drain();
+    for(std::vector<worker *>::iterator it=workers.begin();it!=workers.end();it++){
+        std::lock_guard<std::mutex> lock((*it)->M);
+        (*it)->demux->start_new_connections = flag;
+        (*it)->demux->memory_refusing = false;
+    }
+}
+
+void tcpdemux_pool::stop()
+{
+    for(std::vector<worker *>::iterator it=workers.begin();it!=workers.end();it++){
+        std::lock_guard<std::mutex> lock((*it)->M);
+        (*it)->stopping = true;
+        (*it)->work_ready.notify_one();
+    }
+    for(std::vector<worker *>::iterator it=workers.begin();it!=workers.end();it++){
+        if((*it)->thread.joinable()) (*it)->thread.join();
+    }
+}
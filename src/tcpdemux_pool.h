@@ -0,0 +1,117 @@
+#ifndef TCPDEMUX_POOL_H
+#define TCPDEMUX_POOL_H
+
+/**
+ * tcpdemux_pool.h
+ *
+ * A pool of worker tcpdemux instances, one per thread.
+ *
+ * The capture thread hashes each packet's direction-independent flow
+ * address and hands a copy of the packet to the worker that owns that
+ * shard. Each worker has its own flow_map, open_flows, saved flows and
+ * a share of max_fds, so both halves of a connection are always
+ * reassembled by the same worker, in capture order, and the transcripts
+ * are the same as in single-threaded mode.
+ *
+ * Created by tcpdemux::start_pool() when --threads N is given.
+ *
+ * A worker's flows time out (tcp_timeout) and give memory back (-S
+ * memory_max) as its packets go by, so one whose shard is quiet would
+ * hold on to them; the dispatcher also hands every worker a tick with the
+ * packet time each time it moves on by a second, after the packets queued
+ * before it.
+ *
+ * With a TPACKET_V3 ring per worker in a PACKET_FANOUT group, capture()
+ * runs each ring on its own thread that feeds its worker's demux directly,
+ * so there is no dispatcher at all; a ring with no packets ticks its worker
+ * by the clock instead (tcpdemux::idle()). Workers (and their capture
+ * threads) can be pinned to CPUs with -S pin_cpus=LIST.
+ */
+
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "ip_reassembly.h"
+
+class tpacket_ring;
+class flow_addr;
+
+class tcpdemux_pool {
+    /* A packet copied out of the pcap buffer so that it outlives the callback */
+    class queued_packet {
+    public:
+        queued_packet():dlt(0),hdr(),ts(),ip_offset(0),ip_datalen(0),data(){}
+        int      dlt;
+        struct pcap_pkthdr hdr;
+        struct timeval ts;              // shifted timestamp; packet_info keeps a reference to it
+        size_t   ip_offset;             // offset of ip_data within data
+        uint32_t ip_datalen;
+        std::vector<u_char> data;       // the pcap_data, hdr.caplen bytes
+    };
+    typedef std::deque<queued_packet *> packet_queue_t;
+
+    class worker {
+        worker(const worker &);
+        worker &operator=(const worker &);
+    public:
+        worker(tcpdemux *demux_,int cpu_):demux(demux_),cpu(cpu_),thread(),M(),work_ready(),space_ready(),
+                                 queue(),tick(),ticked(false),busy(false),stopping(false){}
+        tcpdemux                *demux;
+        int                     cpu;            // CPU to run on, or -1
+        std::thread             thread;
+        std::mutex              M;              // protects everything below
+        std::condition_variable work_ready;     // signaled when queue gets packets, ticked or stopping is set
+        std::condition_variable space_ready;    // signaled when the worker empties its queue
+        packet_queue_t          queue;
+        struct timeval          tick;           // packet time for tcpdemux::tick(), after queue
+        bool                    ticked;         // tick is waiting
+        bool                    busy;           // worker is processing a batch
+        bool                    stopping;
+    };
+
+    tcpdemux_pool(const tcpdemux_pool &);
+    tcpdemux_pool &operator=(const tcpdemux_pool &);
+
+    std::vector<worker *> workers;
+    std::mutex            free_M;               // protects free_packets
+    std::vector<queued_packet *> free_packets;  // recycled packet buffers
+    ip_reassembler       frags;                // the dispatcher's; see dispatch()
+    time_t               last_tick;            // packet second of the last tick the dispatcher handed out
+
+    queued_packet *alloc_packet();
+    void free_packet(queued_packet *qp);
+    void run(worker *w);                        // worker thread body
+    void tick_all(const struct timeval &ts);    // dispatcher
+    void capture_run(worker *w,tpacket_ring *ring,pcap_handler handler,int *result);
+    static void ring_idle(u_char *user);
+    static void pin_this_thread(int cpu);
+public:
+    static std::string cpu_list;                // e.g. "0-3,8-11"; worker i runs on the i'th CPU of the list
+
+    enum { MAX_QUEUED_PACKETS = 4096 };         // per worker; the capture thread blocks beyond this
+
+    tcpdemux_pool():workers(),free_M(),free_packets(),frags(),last_tick(0){}
+    virtual ~tcpdemux_pool();
+
+    /* worker demuxes are created from the configured parent demux */
+    void start(tcpdemux &parent,unsigned int nthreads);
+    size_t size() const { return workers.size(); }
+    tcpdemux &get_worker(size_t i) { return *workers.at(i)->demux; }
+
+    /* direction-independent hash used to pick a worker */
+    static uint64_t shard_hash(const be13::packet_info &pi);
+    static uint64_t shard_hash(const flow_addr &a);      // the same, for a flow's packets
+
+    void dispatch(const be13::packet_info &pi); // called by the capture thread
+    /* Capture from rings[i] into worker i, one thread each, until every ring's loop ends.
+     * Returns 0, or -1 if any of the loops failed.
+     */
+    int  capture(const std::vector<tpacket_ring *> &rings,pcap_handler handler);
+    void drain();                               // wait until every queued packet is processed
+    void set_start_new_connections(bool flag);  // must be called after drain()
+    void stop();                                // finish all flows in their workers and join the threads
+};
+
+#endif
@@ -15,6 +15,37 @@
 
 #include "tcpip.h"
 #include "tcpdemux.h"
+#include "tcpdemux_pool.h"
+#include "scan_pool.h"
+#include "scan_python.h"
+#include "cmd_pool.h"
+#include "alert_channel.h"
+#include "report_writer.h"
+#include "metrics.h"
+#include "tracer.h"
+#include "load_shed.h"
+#include "disk_ring.h"
+#include "flow_policy.h"
+#include "mem_budget.h"
+#include "flow_checkpoint.h"
+#include "flow_db.h"
+#include "flow_arrow.h"
+#include "body_store.h"
+#include "flow_rescan.h"
+#include "http_stream.h"
+#include "tls_stream.h"
+#include "flow_hash.h"
+#include "capture_tpacket.h"
+#include "capture_ring.h"
+#include "pcap_mmap.h"
+#include "pcap_index.h"
+#include "console_output.h"
+#include "json_stream.h"
+#include "pcap_merge.h"
+#include "live_capture.h"
+#include "resume_filter.h"
+#include "pcap_inflate.h"
+#include "packet_batch.h"
 #include "bulk_extractor_i.h"
 #include "iptree.h"
 
@@ -22,6 +53,11 @@
 
 #include <string>
 #include <vector>
+#include <set>
+#include <algorithm>
+#include <thread>
+#include <atomic>
+#include <mutex>
 #include <sys/types.h>
 #include <dirent.h>
 #include <getopt.h>      // getopt_long()
@@ -86,8 +122,7 @@ scanner_t *scanners_builtin[] = {
     scan_md5,
     scan_http,
     scan_netviz,
-// removed scan_python becasue it does not support Python 3
-//    scan_python,
+    scan_python,
     scan_tcpdemux,
 #ifdef USE_WIFI
     scan_wifiviz,
@@ -102,10 +137,23 @@ bool opt_no_promisc = false;		// true if we should not use promiscious mode
  * feel free to submit more!
  */
 
+enum { OPT_THREADS = 256,               // long options without a short equivalent
+       OPT_PARALLEL_INPUTS,
+       OPT_SEGMENTS,
+       OPT_INDEX,
+       OPT_FLOWS,
+       OPT_RESCAN };
+
 static const struct option longopts[] = {
     { "chroot", required_argument, NULL, 'z' },
+    { "flows", required_argument, NULL, OPT_FLOWS },
     { "help", no_argument, NULL, 'h' },
+    { "index", no_argument, NULL, OPT_INDEX },
+    { "parallel-inputs", optional_argument, NULL, OPT_PARALLEL_INPUTS },
     { "relinquish-privileges", required_argument, NULL, 'U' },
+    { "rescan", required_argument, NULL, OPT_RESCAN },
+    { "segments", no_argument, NULL, OPT_SEGMENTS },
+    { "threads", required_argument, NULL, OPT_THREADS },
     { "verbose", no_argument, NULL, 'v' },
     { "version", no_argument, NULL, 'V' },
     { NULL, 0, NULL, 0 }
@@ -122,7 +170,9 @@ static void usage(int level)
     std::cout << "usage: " << progname << " [-aBcCDhIpsvVZ] [-b max_bytes] [-d debug_level] \n";
     std::cout << "     [-[eE] scanner] [-f max_fds] [-F[ctTXMkmg]] [-h|--help] [-i iface]\n";
     std::cout << "     [-l files...] [-L semlock] [-m min_bytes] [-o outdir] [-r file] [-R file]\n";
-    std::cout << "     [-S name=value] [-T template] [-U|--relinquish-privileges user] [-v|--verbose]\n";
+    std::cout << "     [--parallel-inputs[=merge|independent]] [--segments] [--index] [--flows keys]\n";
+    std::cout << "     [--rescan dir]\n";
+    std::cout << "     [-S name=value] [-T template] [--threads N] [-U|--relinquish-privileges user] [-v|--verbose]\n";
     std::cout << "     [-w file] [-x scanner] [-X xmlfile] [-z|--chroot dir] [expression]\n\n";
     std::cout << "   -a: do ALL post-processing.\n";
     std::cout << "   -b max_bytes: max number of bytes per flow to save\n";
@@ -130,8 +180,9 @@ static void usage(int level)
     std::cout << "   -f: maximum number of file descriptors to use\n";
     std::cout << "   -h: print this help message (-hh for more help)\n";
     std::cout << "   -H: print detailed information about each scanner\n";
-    std::cout << "   -i: network interface on which to listen\n";
-    std::cout << "   -I: write for each flow another file *.findx to provide byte-indexed timestamps\n";
+    std::cout << "   -i: network interface on which to listen; several with -i eth0,eth1 or -i eth0 -i eth1\n";
+    std::cout << "   -I: write for each flow another file *.findb to provide byte-indexed timestamps\n";
+    std::cout << "       (binary; tcpflow-findx or -S packet_index_text=1 gives the text *.findx)\n";
     std::cout << "   -g: output each flow in alternating colors (note change!)\n";
     std::cout << "   -l: treat non-flag arguments as input files rather than a pcap expression\n";
     std::cout << "   -L  semlock - specifies that writes are locked using a named semaphore\n";
@@ -143,7 +194,8 @@ static void usage(int level)
     std::cout << "   -v           : verbose operation equivalent to -d 10\n";
     std::cout << "   -V           : print version number and exit\n";
     std::cout << "   -w  file     : write packets not processed to file\n";
-    std::cout << "   -o  outdir   : specify output directory (default '.')\n";
+    std::cout << "   -o  outdir   : specify output directory (default '.'); given more than once, flows are\n";
+    std::cout << "                  spread over the directories (-S root_placement=hash|queue)\n";
     std::cout << "   -X  filename : DFXML output to filename\n";
     std::cout << "   -m  bytes    : specifies skip that starts a new stream (default "
               << (unsigned)tcpdemux::options::MAX_SEEK << ").\n";
@@ -151,7 +203,17 @@ static void usage(int level)
     std::cout << "   -T{t} : filename template (-hh for options; default "
               << flow::filename_template << ")\n";
     std::cout << "   -Z       do not decompress gzip-compressed HTTP transactions\n";
-    std::cout << "   -K: output|keep pcap flow structure.\n";
+    std::cout << "   -K: output|keep pcap flow structure (-S pcapng=1 writes -K and -w files as pcapng).\n";
+    std::cout << "   --threads N : demultiplex flows with N worker threads\n";
+    std::cout << "   --parallel-inputs[=merge] : read all -r files at once, in timestamp order\n";
+    std::cout << "   --parallel-inputs=independent : process each -r file on its own, into outdir/file/\n";
+    std::cout << "   --segments : append flows to large segment files with an index, instead of a file\n";
+    std::cout << "                per flow (-S segment_size=bytes; read them with tcpflow-extract)\n";
+    std::cout << "   --index : write file.tfidx for each -r file, saying where each connection's packets are\n";
+    std::cout << "   --flows keys : with -r, read only these connections' packets, using file.tfidx\n";
+    std::cout << "                (keys are src.sport-dst.dport as in the filenames, separated by commas)\n";
+    std::cout << "   --rescan dir : run the scanners again over the flows in dir, an earlier run's output,\n";
+    std::cout << "                instead of reading packets; the new report and features go to -o\n";
 
     std::cout << "\nSecurity:\n";
     std::cout << "   -U user  relinquish privleges and become user (if running as root)\n";
@@ -241,11 +303,21 @@ void replace(std::string &str,const std::string &from,const std::string &to)
 feature_recorder_set *the_fs = 0;
 dfxml_writer *xreport = 0;
 pcap_t *pd = 0;
+std::vector<tpacket_ring *> live_rings;
+mmap_pcap_reader *offline_reader = 0;
+std::vector<pcap_merge *> active_merges;
+live_capture *live_devices = 0;
+volatile sig_atomic_t terminating = 0;  // no more inputs are started
 void terminate(int sig)
 {
     if (sig == SIGHUP || sig == SIGINT || sig == SIGTERM) {
         DEBUG(1) ("terminating orderly");
-        pcap_breakloop(pd);
+        terminating = 1;
+        for (size_t i=0; i<live_rings.size(); i++) live_rings[i]->breakloop();
+        if (offline_reader) offline_reader->breakloop();
+        for (size_t i=0; i<active_merges.size(); i++) active_merges[i]->breakloop();
+        if (live_devices) live_devices->breakloop();
+        if (pd) pcap_breakloop(pd);
         return;
     } else {
         DEBUG(1) ("terminating");
@@ -422,6 +494,284 @@ void tcpflow_droproot(tcpdemux &demux)
 #ifdef HAVE_INFLATER
 static inflaters_t *inflaters = 0;
 #endif
+
+/*
+ * Live capture from TPACKET_V3 rings.
+ * With --threads there is one ring per worker, all in one PACKET_FANOUT group,
+ * and each ring is read by a thread that feeds its worker directly.
+ * Returns 0 on success, -1 on error, or 1 if the rings could not be set up
+ * and libpcap should be used instead.
+ */
+static void free_rings(std::vector<tpacket_ring *> &rings)
+{
+    for(std::vector<tpacket_ring *>::iterator it=rings.begin();it!=rings.end();it++){
+        delete *it;
+    }
+    rings.clear();
+}
+
+static int process_tpacket(tcpdemux &demux,const std::string &expression,const std::string &device)
+{
+    std::string error;
+    size_t nrings = demux.pool ? demux.pool->size() : 1;
+    int fanout_group = getpid() & 0xffff;
+    std::vector<tpacket_ring *> rings;
+    for(size_t i=0;i<nrings;i++){
+        tpacket_ring *ring = new tpacket_ring();
+        rings.push_back(ring);
+        if (ring->open(device,!opt_no_promisc,expression,packet_buffer_timeout,error) ||
+            (nrings>1 && ring->join_fanout(fanout_group,error))){
+            DEBUG(1) ("%s: cannot use TPACKET_V3 (%s); using libpcap", device.c_str(), error.c_str());
+            free_rings(rings);
+            return 1;
+        }
+    }
+    tcpflow_droproot(demux);                     // drop root if requested
+    pcap_handler handler = find_handler(rings[0]->datalink(), device.c_str());
+
+    live_rings = rings;
+    std::vector<tpacket_ring *> *stat_rings = &rings;
+    metrics::add_gauge("capture_received",[stat_rings]{
+        uint64_t sum=0;
+        for(size_t i=0;i<stat_rings->size();i++){
+            uint64_t p=0,d=0,f=0;
+            (*stat_rings)[i]->stats(p,d,f);
+            sum += p;
+        }
+        return sum;
+    });
+    metrics::add_gauge("capture_dropped",[stat_rings]{
+        uint64_t sum=0;
+        for(size_t i=0;i<stat_rings->size();i++){
+            uint64_t p=0,d=0,f=0;
+            (*stat_rings)[i]->stats(p,d,f);
+            sum += d;
+        }
+        return sum;
+    });
+    portable_signal(SIGTERM, terminate);
+    portable_signal(SIGINT, terminate);
+#ifdef SIGHUP
+    portable_signal(SIGHUP, terminate);
+#endif
+
+    int r = 0;
+    if (nrings>1){
+        DEBUG(1) ("listening on %s (TPACKET_V3, fanout to %d workers)", device.c_str(), (int)nrings);
+        r = demux.pool->capture(rings, handler);
+    } else {
+        DEBUG(1) ("listening on %s (TPACKET_V3)", device.c_str());
+        r = rings[0]->loop(handler, (u_char *)tcpdemux::getInstance());
+    }
+    live_rings.clear();
+    metrics::remove_gauge("capture_received"); // before the rings are read here
+    metrics::remove_gauge("capture_dropped");
+
+    uint64_t packets=0,drops=0,freezes=0;
+    for(size_t i=0;i<nrings;i++){
+        uint64_t p=0,d=0,f=0;
+        rings[i]->stats(p,d,f);
+        packets += p; drops += d; freezes += f;
+    }
+    DEBUG(1) ("%s: %" PRIu64 " packets received by the ring, %" PRIu64 " dropped",
+              device.c_str(), packets, drops);
+    if (xreport){
+        std::lock_guard<std::mutex> lock(tcpdemux::output_M); // the report writer may be writing flows
+        std::stringstream attrs;
+        attrs << "device='" << device << "' rings='" << nrings << "' packets='" << packets
+              << "' drops='" << drops << "' freeze_count='" << freezes << "'";
+        xreport->xmlout("tpacket_stats","",attrs.str(),false);
+    }
+    free_rings(rings);
+    return r;
+}
+
+/*
+ * Live capture from several interfaces (-i eth0,eth1) into the one demux.
+ * Returns 0 on success or -1 on error.
+ */
+static int process_live_devices(tcpdemux &demux,const std::string &expression,const std::string &devices)
+{
+    live_capture *capture = new live_capture();
+    std::set<std::string> seen;
+    std::stringstream ss(devices);
+    std::string device;
+    while(std::getline(ss,device,',')){
+        if(device.empty() || !seen.insert(device).second) continue;
+        std::string error;
+        if(capture->add_device(device,expression,!opt_no_promisc,packet_buffer_timeout,error)){
+            die("%s", error.c_str());
+        }
+    }
+    if (tpacket_ring::enabled){
+        DEBUG(1) ("TPACKET_V3 reads one interface; using libpcap for %s", devices.c_str());
+    }
+    tcpflow_droproot(demux);                     // drop root if requested
+
+    live_capture *stat_capture = capture;
+    metrics::add_gauge("capture_received",[stat_capture]{
+        uint64_t sum=0;
+        for(size_t i=0;i<stat_capture->size();i++){
+            uint64_t p=0,d=0,f=0;
+            if(stat_capture->stats(i,p,d,f)) sum += p;
+        }
+        return sum;
+    });
+    metrics::add_gauge("capture_dropped",[stat_capture]{
+        uint64_t sum=0;
+        for(size_t i=0;i<stat_capture->size();i++){
+            uint64_t p=0,d=0,f=0;
+            if(stat_capture->stats(i,p,d,f)) sum += d;
+        }
+        return sum;
+    });
+    metrics::add_gauge("capture_ifdropped",[stat_capture]{
+        uint64_t sum=0;
+        for(size_t i=0;i<stat_capture->size();i++){
+            uint64_t p=0,d=0,f=0;
+            if(stat_capture->stats(i,p,d,f)) sum += f;
+        }
+        return sum;
+    });
+    live_devices = capture;
+    portable_signal(SIGTERM, terminate);
+    portable_signal(SIGINT, terminate);
+#ifdef SIGHUP
+    portable_signal(SIGHUP, terminate);
+#endif
+
+    DEBUG(1) ("listening on %s", devices.c_str());
+    int r = capture->run((u_char *)tcpdemux::getInstance());
+    live_devices = 0;
+    metrics::remove_gauge("capture_received"); // before the handles are closed
+    metrics::remove_gauge("capture_dropped");
+    metrics::remove_gauge("capture_ifdropped");
+
+    for(size_t i=0;i<capture->size();i++){
+        uint64_t packets=0,drops=0,ifdrops=0;
+        if(!capture->stats(i,packets,drops,ifdrops)) continue;
+        DEBUG(1) ("%s: %" PRIu64 " packets received, %" PRIu64 " dropped, %" PRIu64 " dropped by the interface",
+                  capture->name(i).c_str(), packets, drops, ifdrops);
+        if (xreport){
+            std::lock_guard<std::mutex> lock(tcpdemux::output_M); // the report writer may be writing flows
+            std::stringstream attrs;
+            attrs << "device='" << dfxml_writer::xmlescape(capture->name(i)) << "' packets='" << packets
+                  << "' drops='" << drops << "' ifdrops='" << ifdrops << "'";
+            xreport->xmlout("capture_stats","",attrs.str(),false);
+        }
+    }
+    delete capture;
+    return r;
+}
+
+/*
+ * Read a pcap or pcapng file through mmap_pcap_reader.
+ * Returns 0 on success, -1 on error, or 1 if the file should be read with libpcap.
+ */
+static int process_mmap_file(tcpdemux &demux,const std::string &expression,const std::string &infile)
+{
+    std::string error;
+    mmap_pcap_reader *reader = new mmap_pcap_reader();
+    if (reader->open(infile,error)){
+        if (pcap_index::wanted.size()>0) die("%s; --flows needs a pcap file that can be mapped", error.c_str());
+        DEBUG(5) ("%s; using libpcap", error.c_str());
+        delete reader;
+        return 1;
+    }
+    tcpflow_droproot(demux);        // drop root if requested
+
+    /* The filter is run here, since libpcap does not see the packets */
+    if (reader->set_filter(resume_filter::started() ? resume_filter::filter(reader->datalink()) : expression,error)){
+        die("%s", error.c_str());
+    }
+
+    /* with --flows, only the packets that the index gives */
+    std::vector<uint64_t> offsets;
+    if (pcap_index::wanted.size()>0 && pcap_index::lookup(infile,pcap_index::wanted,offsets,error)){
+        die("%s", error.c_str());
+    }
+    pcap_index *index = 0;
+    if (pcap_index::build && pcap_index::wanted.size()==0){
+        index = new pcap_index();
+        reader->set_index(index);
+        pcap_index::building = index;
+    }
+
+    offline_reader = reader;
+    portable_signal(SIGTERM, terminate);
+    portable_signal(SIGINT, terminate);
+#ifdef SIGHUP
+    portable_signal(SIGHUP, terminate);
+#endif
+
+    /* each packet goes to the handler for its interface's link type */
+    int r = pcap_index::wanted.size()>0 ? reader->loop_at(offsets, 0, (u_char *)tcpdemux::getInstance())
+                                        : reader->loop(0, (u_char *)tcpdemux::getInstance());
+    offline_reader = 0;
+    if (index){
+        pcap_index::building = 0;
+        if (r==0 && index->write(infile,error)){
+            std::cerr << error << "\n";
+        }
+        delete index;
+    }
+    delete reader;
+    return r;
+}
+
+/*
+ * Start a decompressor for infile if it needs one.
+ * Returns the path to read the packets from; pipefd and waitfor are set
+ * to the pipe and the decompressor's pid if one was started.
+ * If infile is decompressed in-process, fp is set to the stream to read
+ * it from instead (see pcap_inflate.h).
+ */
+static std::string input_path(const std::string &infile,int &pipefd,int &waitfor,FILE *&fp)
+{
+    std::string file_path = infile;
+    pipefd = -1;
+    waitfor = -1;
+    fp = 0;
+    if(inflate_stream::enabled){
+        std::string error;
+        fp = inflate_stream::fopen(infile,error);
+        if(fp) return file_path;
+        if(error.size()) die("%s", error.c_str());
+    }
+#ifdef HAVE_INFLATER
+    if(inflaters==0) inflaters = build_inflaters();
+    for(inflaters_t::const_iterator it = inflaters->begin(); it != inflaters->end(); it++) {
+        if((*it)->appropriate(infile)) {
+            pipefd = (*it)->invoke(infile, &waitfor);
+            if(pipefd < 0) {
+                std::cerr << "decompression of '" << infile << "' failed: " << strerror (errno) << std::endl;
+                exit(1);
+            }
+            file_path = ssprintf("/dev/fd/%d", pipefd);
+            if(access(file_path.c_str(), R_OK)) {
+                std::cerr << "decompression of '" << infile << "' is not available on this system" << std::endl;
+                exit(1);
+            }
+            break;
+        }
+    }
+#endif
+    return file_path;
+}
+
+/* Wait for the decompressor started by input_path(), if there was one */
+static void finish_input(int pipefd,int waitfor)
+{
+#ifdef HAVE_FORK
+    if (waitfor != -1) {
+        waitpid (waitfor, 0, 0);
+    }
+    if (pipefd != -1) {
+        close (pipefd);
+    }
+#endif
+}
+
 static int process_infile(tcpdemux &demux,const std::string &expression,std::string &device,const std::string &infile)
 {
     char error[PCAP_ERRBUF_SIZE];
@@ -429,32 +779,24 @@ static int process_infile(tcpdemux &demux,const std::string &expression,std::str
     pcap_handler handler;
     int waitfor = -1;
     int pipefd = -1;
-
-#ifdef HAVE_INFLATER
-    if(inflaters==0) inflaters = build_inflaters();
-#endif
+    FILE *fp = 0;
 
     if (infile!=""){
-        std::string file_path = infile;
         // decompress input if necessary
-#ifdef HAVE_INFLATER
-        for(inflaters_t::const_iterator it = inflaters->begin(); it != inflaters->end(); it++) {
-            if((*it)->appropriate(infile)) {
-                pipefd = (*it)->invoke(infile, &waitfor);
-                if(pipefd < 0) {
-                    std::cerr << "decompression of '" << infile << "' failed: " << strerror (errno) << std::endl;
-                    exit(1);
-                }
-                file_path = ssprintf("/dev/fd/%d", pipefd);
-                if(access(file_path.c_str(), R_OK)) {
-                    std::cerr << "decompression of '" << infile << "' is not available on this system" << std::endl;
-                    exit(1);
-                }
-                break;
-            }
+        std::string file_path = input_path(infile,pipefd,waitfor,fp);
+        /* files that are not decompressed can be mapped */
+        if (pipefd < 0 && fp == 0 && mmap_pcap_reader::enabled){
+            int r = process_mmap_file(demux,expression,infile);
+            if (r != 1) return r;
         }
-#endif
-	if ((pd = pcap_open_offline(file_path.c_str(), error)) == NULL){	/* open the capture file */
+        if (pcap_index::wanted.size()>0){
+            die("%s: --flows cannot be used with compressed files or -S mmap_pcap=0", infile.c_str());
+        }
+        if (pcap_index::build){
+            std::cerr << infile << ": not indexed; --index needs a pcap file that can be mapped\n";
+        }
+	pd = fp ? pcap_fopen_offline(fp, error) : pcap_open_offline(file_path.c_str(), error);
+	if (pd == NULL){	/* open the capture file */
 	    die("%s", error);
 	}
         tcpflow_droproot(demux);        // drop root if requested
@@ -485,6 +827,17 @@ static int process_infile(tcpdemux &demux,const std::string &expression,std::str
 #endif
     }
 
+	/* several interfaces, each read by a thread of its own */
+	if (device.find(',')!=std::string::npos){
+	    return process_live_devices(demux,expression,device);
+	}
+
+	/* the TPACKET_V3 ring, if it was asked for, does not go through libpcap at all */
+	if (tpacket_ring::enabled){
+	    int r = process_tpacket(demux,expression,device);
+	    if (r != 1) return r;
+	}
+
 	/* make sure we can open the device */
 	if ((pd = pcap_open_live(device.c_str(), SNAPLEN, !opt_no_promisc, packet_buffer_timeout, error)) == NULL){
 	    die("%s", error);
@@ -495,11 +848,13 @@ static int process_infile(tcpdemux &demux,const std::string &expression,std::str
 	handler = find_handler(dlt, device.c_str());
     }
 
-    DEBUG(20) ("filter expression: '%s'",expression.c_str());
+    /* for a -R file, only the open connections */
+    std::string file_expression = resume_filter::started() ? resume_filter::filter(dlt) : expression;
+    DEBUG(20) ("filter expression: '%s'",file_expression.c_str());
 
     /* install the filter expression in libpcap */
     struct bpf_program	fcode;
-    if (pcap_compile(pd, &fcode, expression.c_str(), 1, 0) < 0){
+    if (pcap_compile(pd, &fcode, file_expression.c_str(), 1, 0) < 0){
 	die("%s", pcap_geterr(pd));
     }
 
@@ -519,41 +874,212 @@ static int process_infile(tcpdemux &demux,const std::string &expression,std::str
 #endif
 
     /* start listening or reading from the input file */
-    if (infile == "") DEBUG(1) ("listening on %s", device.c_str());
-    int pcap_retval = pcap_loop(pd, -1, handler, (u_char *)tcpdemux::getInstance());
+    if (infile == "") {
+        DEBUG(1) ("listening on %s", device.c_str());
+        pcap_t *stat_pd = pd;
+        metrics::add_gauge("capture_received",[stat_pd]{
+            struct pcap_stat st;
+            return pcap_stats(stat_pd,&st)==0 ? (uint64_t)st.ps_recv : 0;
+        });
+        metrics::add_gauge("capture_dropped",[stat_pd]{
+            struct pcap_stat st;
+            return pcap_stats(stat_pd,&st)==0 ? (uint64_t)st.ps_drop : 0;
+        });
+        metrics::add_gauge("capture_ifdropped",[stat_pd]{
+            struct pcap_stat st;
+            return pcap_stats(stat_pd,&st)==0 ? (uint64_t)st.ps_ifdrop : 0;
+        });
+    }
+    int pcap_retval = 0;
+    if (infile == "" && capture_ring::size_bytes > 0) {
+        /* the demultiplexer on this thread, and the reading on another */
+        capture_ring *ring = new capture_ring(capture_ring::size_bytes);
+        metrics::add_gauge("capture_ring_used",[ring]{ return ring->used(); });
+        metrics::add_gauge("capture_ring_overflows",[ring]{ return ring->overflow_count(); });
+        pcap_retval = ring->run(pd, handler, (u_char *)tcpdemux::getInstance());
+        metrics::remove_gauge("capture_ring_used");
+        metrics::remove_gauge("capture_ring_overflows");
+        DEBUG(1) ("capture ring: %" PRIu64 " packets, %" PRIu64 " overflowed, at most %" PRIu64 " of %" PRIu64 " bytes used",
+                  ring->packet_count(), ring->overflow_count(), ring->high_water_mark(), ring->size());
+        if (xreport){
+            std::lock_guard<std::mutex> lock(tcpdemux::output_M); // the report writer may be writing flows
+            std::stringstream attrs;
+            attrs << "bytes='" << ring->size() << "' packets='" << ring->packet_count()
+                  << "' high_water='" << ring->high_water_mark() << "' overflows='" << ring->overflow_count() << "'";
+            xreport->xmlout("capture_ring","",attrs.str(),false);
+        }
+        delete ring;
+    } else {
+        pcap_retval = pcap_loop(pd, -1, handler, (u_char *)tcpdemux::getInstance());
+    }
+    metrics::remove_gauge("capture_received");
+    metrics::remove_gauge("capture_dropped");
+    metrics::remove_gauge("capture_ifdropped");
 
     if (pcap_retval < 0 && pcap_retval != -2){
 	DEBUG(1) ("%s: %s", infile.c_str(),pcap_geterr(pd));
 	return -1;
     }
     pcap_close (pd);
-#ifdef HAVE_FORK
-    if (waitfor != -1) {
-        wait (0);
+    pd = 0;
+    finish_input(pipefd,waitfor);
+
+    return 0;
+}
+
+/*
+ * Read all of the -r files at once, merging their packets into one
+ * timestamp-ordered stream for demux (--parallel-inputs=merge).
+ * Returns 0 on success or -1 on error.
+ */
+static int process_merged_infiles(tcpdemux &demux,const std::string &expression,
+                                  const std::vector<std::string> &infiles)
+{
+    pcap_merge *merge = new pcap_merge();
+    std::vector<int> pipefds,waitfors;
+    for(std::vector<std::string>::const_iterator it=infiles.begin();it!=infiles.end();it++){
+        int pipefd,waitfor;
+        FILE *fp;
+        std::string file_path = input_path(*it,pipefd,waitfor,fp);
+        pipefds.push_back(pipefd);
+        waitfors.push_back(waitfor);
+        std::string error;
+        if(merge->add_file(file_path,fp,*it,expression,error)){
+            die("%s", error.c_str());
+        }
     }
-    if (pipefd != -1) {
-        close (pipefd);
+    tcpflow_droproot(demux);        // drop root if requested
+
+    active_merges.push_back(merge);
+    portable_signal(SIGTERM, terminate);
+    portable_signal(SIGINT, terminate);
+#ifdef SIGHUP
+    portable_signal(SIGHUP, terminate);
+#endif
+    int r = merge->run((u_char *)tcpdemux::getInstance());
+    active_merges.clear();
+    delete merge;
+    for(size_t i=0;i<pipefds.size();i++) finish_input(pipefds[i],waitfors[i]);
+    return r;
+}
+
+/*
+ * Process each -r file with a demux of its own, writing its flows to a
+ * subdirectory of the output directory named after the file
+ * (--parallel-inputs=independent). Up to nthreads files are processed at once;
+ * each is opened (and its decompressor started) when a thread picks it up,
+ * and closed when the thread is done with it.
+ * Returns 0 on success or -1 if any file had an error.
+ */
+class independent_input {
+    independent_input(const independent_input &);
+    independent_input &operator=(const independent_input &);
+public:
+    independent_input():infile(),merge(),demux(0),pipefd(-1),waitfor(-1),result(0){}
+    std::string infile;
+    pcap_merge merge;                   // with just the one file, a read-ahead thread
+    tcpdemux  *demux;
+    int       pipefd;
+    int       waitfor;
+    int       result;
+};
+
+static int process_independent_infiles(tcpdemux &demux,const std::string &expression,
+                                       const std::vector<std::string> &infiles,unsigned int nthreads)
+{
+    if(nthreads > infiles.size()) nthreads = infiles.size();
+    std::vector<independent_input *> inputs;
+    std::set<std::string> subdirs;
+    for(std::vector<std::string>::const_iterator it=infiles.begin();it!=infiles.end();it++){
+        independent_input *in = new independent_input();
+        inputs.push_back(in);
+        in->infile = *it;
+        /* the subdirectory is the file's name without its directory; duplicates get a -N suffix */
+        std::string base = *it;
+        size_t slash = base.rfind('/');
+        if(slash!=std::string::npos) base = base.substr(slash+1);
+        std::string subdir = base;
+        for(int n=2;subdirs.count(subdir);n++) subdir = ssprintf("%s-%d",base.c_str(),n);
+        subdirs.insert(subdir);
+
+        in->demux = demux.make_worker(0,1);
+        in->demux->max_fds = demux.max_fds/nthreads > 0 ? demux.max_fds/nthreads : 1;
+        in->demux->outdir = demux.outdir + "/" + subdir;
+        in->demux->roots.configure(subdir,in->demux->max_fds);
+        for(uint16_t root=0;root<in->demux->roots.size();root++){
+            struct stat stbuf;
+            const std::string &dir = in->demux->roots.dir(root);
+            if(stat(dir.c_str(),&stbuf) && MKDIR(dir.c_str(),0777)){
+                die("cannot create %s: %s", dir.c_str(), strerror(errno));
+            }
+        }
     }
+    tcpflow_droproot(demux);        // drop root if requested; like the later -r files of a serial run, the inputs are opened without it
+
+    /* The inputs are opened and closed on their threads, so they are not in
+     * active_merges: the handler only sets terminating, which each merge polls.
+     */
+    portable_signal(SIGTERM, terminate);
+    portable_signal(SIGINT, terminate);
+#ifdef SIGHUP
+    portable_signal(SIGHUP, terminate);
 #endif
 
-    return 0;
+    std::atomic<size_t> next_input(0);
+    std::mutex open_lock;           // input_path() and the decompressors are not for several threads at once
+    std::vector<std::thread> threads;
+    for(unsigned int t=0;t<nthreads;t++){
+        threads.push_back(std::thread([&inputs,&next_input,&open_lock,&expression](){
+            for(size_t i=next_input++;i<inputs.size() && !terminating;i=next_input++){
+                independent_input *in = inputs[i];
+                {
+                    std::lock_guard<std::mutex> lock(open_lock);
+                    FILE *fp;
+                    std::string file_path = input_path(in->infile,in->pipefd,in->waitfor,fp);
+                    std::string error;
+                    if(in->merge.add_file(file_path,fp,in->infile,expression,error)){
+                        die("%s", error.c_str());
+                    }
+                }
+                tcpdemux::set_thread_instance(in->demux);
+                in->merge.halt_on(&terminating);
+                in->result = in->merge.run((u_char *)in->demux);
+                in->demux->remove_all_flows();
+                tcpdemux::set_thread_instance(0);
+                in->merge.close();
+                finish_input(in->pipefd,in->waitfor);
+            }
+        }));
+    }
+    for(size_t t=0;t<threads.size();t++) threads[t].join();
+
+    int r = 0;
+    for(std::vector<independent_input *>::iterator it=inputs.begin();it!=inputs.end();it++){
+        independent_input *in = *it;
+        if(in->result < 0) r = -1;
+        demux.flow_counter   += in->demux->flow_counter;
+        demux.packet_counter += in->demux->packet_counter;
+        demux.max_open_flows += in->demux->max_open_flows;
+        for(uint16_t root=0;root<demux.roots.size();root++) demux.roots[root].flows += in->demux->roots[root].flows;
+        in->demux->xreport = 0;         // these belong to demux
+        in->demux->pwriter = 0;
+        delete in->demux;
+        delete in;
+    }
+    return r;
 }
 
 
 /* be_hash. Currently this just returns the MD5 of the sbuf,
  * but eventually it will allow the use of different hashes.
+ * The name is looked up once; flow_hash keeps a context per thread.
  */
 static std::string be_hash_name("md5");
 static std::string be_hash_func(const uint8_t *buf,size_t bufsize)
 {
-    if(be_hash_name=="md5" || be_hash_name=="MD5"){
-        return dfxml::md5_generator::hash_buf(buf,bufsize).hexdigest();
-    }
-    if(be_hash_name=="sha1" || be_hash_name=="SHA1" || be_hash_name=="sha-1" || be_hash_name=="SHA-1"){
-        return dfxml::sha1_generator::hash_buf(buf,bufsize).hexdigest();
-    }
-    if(be_hash_name=="sha256" || be_hash_name=="SHA256" || be_hash_name=="sha-256" || be_hash_name=="SHA-256"){
-        return dfxml::sha256_generator::hash_buf(buf,bufsize).hexdigest();
+    static const unsigned alg = flow_hash::parse(be_hash_name);
+    if(alg==flow_hash::MD5 || alg==flow_hash::SHA1 || alg==flow_hash::SHA256){
+        return flow_hash::hexdigest(static_cast<flow_hash::alg_t>(alg),buf,bufsize);
     }
     std::cerr << "Invalid hash name: " << be_hash_name << "\n";
     std::cerr << "This version of bulk_extractor only supports MD5, SHA1, and SHA256\n";
@@ -583,20 +1109,24 @@ int main(int argc, char *argv[])
     std::string reportfilename;
     std::vector<std::string> Rfiles;	// files for finishing
     std::vector<std::string> rfiles;	// files to read
+    std::string rescan_dir;		// --rescan: the flows of an earlier run, instead of packets
     tcpdemux &demux = *tcpdemux::getInstance();			// the demux object we will be using.
     std::string command_line = dfxml_writer::make_command_line(argc,argv);
     std::string opt_unk_packets;
     bool opt_quiet = false;
+    int opt_threads = 1;
+    enum { INPUTS_SERIAL, INPUTS_MERGE, INPUTS_INDEPENDENT } opt_parallel_inputs = INPUTS_SERIAL;
 
     /* Set up debug system */
     progname = argv[0];
     init_debug(progname,1);
 
     /* Make sure that the system was compiled properly */
-    if(sizeof(struct be13::ip4)!=20 || sizeof(struct be13::tcphdr)!=20){
+    if(sizeof(struct be13::ip4)!=20 || sizeof(struct be13::tcphdr)!=20 || sizeof(flow_addr)!=38){
 	fprintf(stderr,"COMPILE ERROR.\n");
 	fprintf(stderr,"  sizeof(struct ip)=%d; should be 20.\n", (int)sizeof(struct be13::ip4));
 	fprintf(stderr,"  sizeof(struct tcphdr)=%d; should be 20.\n", (int)sizeof(struct be13::tcphdr));
+	fprintf(stderr,"  sizeof(flow_addr)=%d; should be 38 (it is compared with memcmp).\n", (int)sizeof(flow_addr));
 	fprintf(stderr,"CANNOT CONTINUE\n");
 	exit(1);
     }
@@ -676,7 +1206,10 @@ int main(int argc, char *argv[])
             demux.max_fds = mnew;
 	    break;
         }
-    case 'i': device = std::string(optarg); break;
+    case 'i':
+        if(device.size()>0) device += ",";
+        device += optarg;
+        break;
  	case 'I':
  		DEBUG(10) ("creating packet index files");
  		demux.opt.output_packet_index = true;
@@ -698,8 +1231,8 @@ int main(int argc, char *argv[])
 	    demux.opt.max_seek = atoi(optarg);
 	    DEBUG(10) ("max_seek set to %d",demux.opt.max_seek); break;
 	case 'o':
-            demux.outdir = optarg;
-            flow::outdir = optarg;
+            if(output_roots::dirs.empty()) demux.outdir = optarg; // the report and the rest go in the first
+            output_roots::dirs.push_back(optarg);
             break;
 	case 'p': opt_no_promisc = true; DEBUG(10) ("NOT turning on promiscuous mode"); break;
         case 'q': opt_quiet = true; break;
@@ -735,6 +1268,41 @@ int main(int argc, char *argv[])
 	case 'Z': demux.opt.gzip_decompress = 0; break;
 	case 'H': opt_Help += 1; break;
 	case 'h': opt_help += 1; break;
+	case OPT_THREADS:
+	    opt_threads = atoi(optarg);
+	    if(opt_threads<1 || opt_threads>=tcpdemux::SCAN_SHARD_BASE){
+		std::cerr << "--threads requires a positive number less than " << tcpdemux::SCAN_SHARD_BASE << "\n";
+		exit(1);
+	    }
+	    break;
+	case OPT_PARALLEL_INPUTS:
+	    if(optarg==0 || strcmp(optarg,"merge")==0){
+		opt_parallel_inputs = INPUTS_MERGE;
+	    } else if(strcmp(optarg,"independent")==0){
+		opt_parallel_inputs = INPUTS_INDEPENDENT;
+	    } else {
+		std::cerr << "--parallel-inputs must be merge or independent\n";
+		exit(1);
+	    }
+	    break;
+	case OPT_SEGMENTS:
+	    demux.opt.output_segments = true;
+	    break;
+	case OPT_INDEX:
+	    pcap_index::build = true;
+	    break;
+	case OPT_RESCAN:
+	    rescan_dir = optarg;
+	    break;
+	case OPT_FLOWS:
+	    {
+		std::string error;
+		if(pcap_index::parse_flows(optarg,error)){
+		    std::cerr << error << "\n";
+		    exit(1);
+		}
+		break;
+	    }
 	default:
 	    DEBUG(1) ("error: unrecognized switch '%c'", arg);
 	    opt_help += 1;
@@ -773,8 +1341,16 @@ int main(int argc, char *argv[])
         exit(1);
     }
 
+    flow::compile_template();           // -T and -F are all in; check it before any flow needs it
+
     if(demux.opt.opt_md5) be13::plugin::scanners_enable("md5");
     be13::plugin::scanners_process_enable_disable_commands();
+    if(http_stream::enabled){
+        std::vector<std::string> enabled;
+        be13::plugin::get_enabled_scanners(enabled);
+        http_stream::active = std::find(enabled.begin(),enabled.end(),"http")!=enabled.end();
+        if(!http_stream::active) DEBUG(1)("http_stream is ignored without -e http");
+    }
 
     /* If there is no report filename, call it report.xml in the output directory */
     if( reportfilename.size()==0 ){
@@ -809,19 +1385,23 @@ int main(int argc, char *argv[])
     }
 
     if(force_binary_output) demux.opt.output_strip_nonprint = false;
-    /* make sure outdir is a directory. If it isn't, try to make it.*/
-    struct stat stbuf;
-    if(stat(demux.outdir.c_str(),&stbuf)==0){
-	if(!S_ISDIR(stbuf.st_mode)){
-	    std::cerr << "outdir is not a directory: " << demux.outdir << "\n";
-	    exit(1);
-	}
-    } else {
-	if(MKDIR(demux.outdir.c_str(),0777)){
-	    std::cerr << "cannot create " << demux.outdir << ": " << strerror(errno) << "\n";
-	    exit(1);
-	}
+    /* make sure each outdir is a directory. If it isn't, try to make it.*/
+    if(output_roots::dirs.empty()) output_roots::dirs.push_back(demux.outdir);
+    for(std::vector<std::string>::const_iterator it=output_roots::dirs.begin();it!=output_roots::dirs.end();it++){
+        struct stat stbuf;
+        if(stat(it->c_str(),&stbuf)==0){
+            if(!S_ISDIR(stbuf.st_mode)){
+                std::cerr << "outdir is not a directory: " << *it << "\n";
+                exit(1);
+            }
+        } else {
+            if(MKDIR(it->c_str(),0777)){
+                std::cerr << "cannot create " << *it << ": " << strerror(errno) << "\n";
+                exit(1);
+            }
+        }
     }
+    demux.roots.configure(std::string(),demux.max_fds);
 
     std::string input_fname;
     if(rfiles.size() > 0) {
@@ -874,6 +1454,97 @@ int main(int argc, char *argv[])
 
     si.get_config("tdelta",&datalink_tdelta,"Time offset for packets");
     si.get_config("packet-buffer-timeout", &packet_buffer_timeout, "Time in milliseconds between each callback from libpcap");
+    si.get_config("mmap_pcap", &mmap_pcap_reader::enabled, "Read pcap files by mapping them into memory instead of with libpcap");
+    si.get_config("packet_batch", &packet_batch::max_packets, "Packets held and prefetched together on their way to the plugins");
+    si.get_config("native_decompress", &inflate_stream::enabled, "Decompress .gz, .xz and .zst input files in-process instead of with gunzip, unxz or zstd");
+    si.get_config("decompress_buffer", &inflate_stream::buffer_size, "Bytes of decompressed input buffered ahead of the packet reader");
+    if(tpacket_ring::available()){
+        si.get_config("tpacket", &tpacket_ring::enabled, "Live capture from a TPACKET_V3 ring instead of libpcap");
+        si.get_config("tpacket_block_size", &tpacket_ring::block_size, "Bytes per TPACKET_V3 ring block");
+        si.get_config("tpacket_block_count", &tpacket_ring::block_count, "Number of TPACKET_V3 ring blocks");
+        si.get_config("tpacket_busy_poll", &tpacket_ring::busy_poll, "Spin on the TPACKET_V3 ring instead of sleeping");
+    }
+
+    si.get_config("pcapng", &pcap_writer::pcapng, "Write the -w and -K packet files as pcapng, with nanosecond time stamps");
+    si.get_config("console_buffer", &console_output::buffer_size, "Bytes of -c/-C output kept and written together; 0 writes each packet at once");
+    si.get_config("mkdir_cache", &mkdirs_cache_max, "Output directories remembered as existing, so that they are not made again");
+    uint64_t precreate_dirs = 0;
+    si.get_config("root_placement", &output_roots::placement, "With more than one -o, how each flow's directory is picked: hash, or queue for the one with the least waiting to be written");
+    si.get_config("precreate_dirs", &precreate_dirs, "Create the -Fk/-Fm/-Fg directories for this many flows before starting");
+    if(precreate_dirs>0) flow::precreate_dirs(precreate_dirs);
+    si.get_config("scan_threads", &scan_pool::threads, "Threads that run the scanners on finished flows; 0 scans on the packet thread");
+    si.get_config("scan_queue", &scan_pool::queue_max, "Finished flows that can wait for a scan thread");
+    si.get_config("scan_queue_full", &scan_pool::queue_full, "What to do with a finished flow when the scan queue is full: wait, inline or skip");
+    si.get_config("scan_window", &scan_pool::window, "Bytes of a --segments flow read back and scanned at a time");
+    si.get_config("report_thread", &report_writer::background, "Write the flows' DFXML report entries on a thread of their own");
+    si.get_config("report_queue", &report_writer::queue_max, "Finished flows that can wait for the report thread");
+    si.get_config("report_format", &report_writer::format, "Where the finished flows are reported: dfxml, or jsonl for a .jsonl file next to the report");
+    if(report_writer::format!="dfxml" && report_writer::format!="jsonl"){
+        std::cerr << "report_format must be dfxml or jsonl\n";
+        exit(1);
+    }
+    si.get_config("flow_db", &flow_db::path, "SQLite database of the finished flows, in the output directory unless the path is absolute");
+    si.get_config("flow_db_batch", &flow_db::batch_rows, "Flows inserted into flow_db in each transaction");
+    si.get_config("flow_db_ms", &flow_db::batch_ms, "Milliseconds a flow_db transaction is left open for more flows");
+    si.get_config("flow_arrow", &flow_arrow::path, "Arrow IPC stream of the finished flows' metadata, in columns (in the output directory unless the path is absolute)");
+    si.get_config("flow_arrow_batch", &flow_arrow::batch_rows, "Flows in each flow_arrow record batch");
+    si.get_config("alert_format", &alert_channel::format, "How tcp_alert_fd and http_alert_fd events are written: text or jsonl");
+    si.get_config("alert_queue", &alert_channel::queue_size, "Events waiting to be written to each alert fd before more are dropped");
+    if(alert_channel::format!="text" && alert_channel::format!="jsonl"){
+        std::cerr << "alert_format must be text or jsonl\n";
+        exit(1);
+    }
+    si.get_config("metrics_file", &metrics::path, "Write counters for each stage of processing to this file (in the output directory) as tcpflow runs");
+    si.get_config("metrics_secs", &metrics::interval, "Seconds between the metrics_file updates");
+    si.get_config("metrics_format", &metrics::format, "How metrics_file is written: text, or prometheus for node_exporter's textfile collector");
+    si.get_config("trace_file", &tracer::path, "Keep the last trace_records events of each thread's packets and flows, and write them to this file (in the output directory) at the end; read it with tcpflow-trace");
+    si.get_config("trace_records", &tracer::records, "Events kept for each thread with trace_file");
+    si.get_config("load_shed", &load_shed::enabled, "When falling behind the capture, stop scanning, then truncate new flows, then keep only their metadata");
+    si.get_config("load_shed_ms", &load_shed::interval_ms, "Milliseconds between load_shed looks at the drops and queues");
+    si.get_config("load_shed_drops", &load_shed::drops, "Capture drops between two looks that count as falling behind");
+    si.get_config("load_shed_calm", &load_shed::calm, "Looks in a row without falling behind before load_shed goes down a level");
+    si.get_config("load_shed_bytes", &load_shed::max_bytes, "Bytes kept of each new flow while load_shed truncates");
+    si.get_config("memory_max", &mem_budget::max, "Bytes that flows, buffers and scanners may hold together before flows are closed and new ones refused; 0 for no limit");
+    si.get_config("memory_batch", &mem_budget::batch, "Bytes each thread charges or releases before the memory total is updated");
+    si.get_config("checkpoint_file", &flow_checkpoint::path, "When tcpflow stops, write the open flows to this file (in the output directory) instead of finishing them");
+    si.get_config("checkpoint_load", &flow_checkpoint::load_path, "Take up the open flows of a checkpoint_file written by an earlier tcpflow");
+    si.get_config("ring_bytes", &disk_ring::max_bytes, "Keep the files of the finished flows within this many bytes, removing those of the oldest; 0 keeps them all");
+    si.get_config("dedup_dir", &body_store::dir, "Keep each HTTP body once, as an object named by its SHA-256 in this directory (in the output directory), and link the body files to it");
+    si.get_config("dedup_prefix", &body_store::prefix_bytes, "Bytes of an HTTP body held in memory before dedup_dir writes it or compares it with an object");
+    si.get_config("dedup_links", &body_store::links, "With dedup_dir, make each HTTP body file as a link to its object; 0 names the object in the report instead");
+    si.get_config("capture_ring", &capture_ring::size_bytes, "Read the interface on a thread of its own into a ring of this many bytes, and demultiplex the packets from it on another; 0 reads and demultiplexes on one thread");
+    si.get_config("resume_filter", &resume_filter::enabled, "Read only the packets of the flows that are still open from the -R files");
+    si.get_config("resume_bpf_max", &resume_filter::bpf_max, "Open flows that resume_filter puts in a BPF expression; more are looked up in a set of hashes");
+    si.get_config("json_stream", &json_stream::path, "Write a JSON line for each segment and finished flow to this file (in the output directory); - for stdout");
+    si.get_config("json_events", &json_stream::events, "Which json_stream events: segments, flows or both");
+    si.get_config("json_payload", &json_stream::payload, "How json_stream writes segment data: base64, escape or none");
+    si.get_config("json_buffer", &json_stream::buffer_size, "Bytes of json_stream lines gathered before they are written");
+    if(json_stream::events!="segments" && json_stream::events!="flows" && json_stream::events!="both"){
+        std::cerr << "json_events must be segments, flows or both\n";
+        exit(1);
+    }
+    if(json_stream::payload!="base64" && json_stream::payload!="escape" && json_stream::payload!="none"){
+        std::cerr << "json_payload must be base64, escape or none\n";
+        exit(1);
+    }
+    si.get_config("flow_policy", &flow_policy::path, "File of rules that choose, for each connection, store, truncate N, metadata or drop");
+    if(flow_policy::path.size()>0){
+        std::string error;
+        if(!flow_policy::load(flow_policy::path,error)){
+            std::cerr << error << "\n";
+            exit(1);
+        }
+    }
+    si.get_config("tls_meta", &tls_stream::enabled, "Parse the TLS hello at the start of each flow as it is stored, for <tls> in the report");
+    si.get_config("tls_meta_only", &tls_stream::meta_only, "With tls_meta, write no transcript for flows that start with a TLS handshake");
+    si.get_config("tls_meta_bytes", &tls_stream::max_bytes, "Bytes at the start of a flow within which its TLS hello has to be");
+    si.get_config("stream_hash", &tcpip::stream_hash, "With -e md5, hash each flow as it is written instead of reading it back");
+    if(flow_hash::available()){
+        std::vector<std::string> enabled;
+        be13::plugin::get_enabled_scanners(enabled);
+        flow_hash::enabled = std::find(enabled.begin(),enabled.end(),"md5")!=enabled.end();
+    }
+    if(!flow_hash::enabled || !demux.opt.post_processing) tcpip::stream_hash = false;
 
     /* Record the configuration */
     if(xreport){
@@ -884,14 +1555,137 @@ int main(int argc, char *argv[])
 
 
 
+    if(opt_threads>1 && demux.opt.console_output){
+        std::cerr << "--threads is ignored with console output\n";
+        opt_threads = 1;
+    }
+    if(xreport && opt_threads>1){
+        xreport->xmlout("threads",opt_threads);
+    }
+    if(pcap_index::wanted.size()>0 || pcap_index::build){
+        if(rfiles.size()==0 && Rfiles.size()==0){
+            std::cerr << "--index and --flows need -r\n";
+            exit(1);
+        }
+        if(opt_parallel_inputs!=INPUTS_SERIAL){
+            std::cerr << "--index and --flows cannot be used with --parallel-inputs\n";
+            exit(1);
+        }
+    }
+    if(rescan_dir.size()>0){
+        if(rfiles.size()>0 || Rfiles.size()>0 || device.size()>0){
+            std::cerr << "--rescan reads no packets; it cannot be used with -r, -R or -i\n";
+            exit(1);
+        }
+        if(!demux.opt.post_processing){
+            std::cerr << "--rescan needs scanners to run (-e or -a)\n";
+            exit(1);
+        }
+    }
+    if(opt_parallel_inputs==INPUTS_INDEPENDENT){
+        if(Rfiles.size()>0){
+            std::cerr << "--parallel-inputs=independent cannot be used with -R\n";
+            exit(1);
+        }
+        if(rfiles.size()<2) opt_parallel_inputs = INPUTS_SERIAL;
+    }
+    /* in independent mode the threads go to the files, not to a pool */
+    std::string db_path = flow_db::path;
+    if(db_path.size()>0 && db_path[0]!='/') db_path = demux.outdir + "/" + db_path;
+    std::string arrow_path = flow_arrow::path;
+    if(arrow_path.size()>0 && arrow_path[0]!='/') arrow_path = demux.outdir + "/" + arrow_path;
+    if(!report_writer::background && (db_path.size()>0 || arrow_path.size()>0 || (xreport && report_writer::format=="jsonl"))){
+        std::cerr << "-S report_thread=0 cannot be used with -S flow_db, -S flow_arrow or -S report_format=jsonl, which are written by the report thread\n";
+        exit(1);
+    }
+    if(xreport && report_writer::format=="jsonl"){
+        tcpdemux::reports = new report_writer(0,report_writer::jsonl_name(reportfilename),db_path,arrow_path);
+    } else if((xreport && report_writer::background) || db_path.size()>0 || arrow_path.size()>0){
+        tcpdemux::reports = new report_writer(xreport,"",db_path,arrow_path);
+    }
+    if(cmd_pool::workers>0 && tcpdemux::tcp_cmd.size()>0){ // forked before there are threads
+        tcpdemux::tcp_workers = new cmd_pool(tcpdemux::tcp_cmd);
+    }
+    demux.select_tcp_processor();       // the options are all in; before any worker copies it
+    if(opt_threads>1 && opt_parallel_inputs!=INPUTS_INDEPENDENT) demux.start_pool(opt_threads);
+    if(demux.opt.post_processing){
+        std::vector<std::string> enabled;
+        be13::plugin::get_enabled_scanners(enabled);
+        if(std::find(enabled.begin(),enabled.end(),"python")!=enabled.end()){
+            std::string error;
+            if(python_host::start(error)){ // before the scan threads, which deliver to it
+                std::cerr << error << "\n";
+                exit(1);
+            }
+        }
+    }
+    if(scan_pool::threads>0 && demux.opt.post_processing) tcpdemux::scanners = new scan_pool(demux);
+    if(metrics::path.size()>0){
+        metrics::start(metrics::path[0]=='/' ? metrics::path : demux.outdir + "/" + metrics::path);
+    }
+    if(tracer::path.size()>0){
+        tracer::start(tracer::path[0]=='/' ? tracer::path : demux.outdir + "/" + tracer::path);
+    }
+    if(json_stream::path.size()>0){
+        json_stream::start(json_stream::path[0]=='/' || json_stream::path=="-" ? json_stream::path
+                                                                               : demux.outdir + "/" + json_stream::path);
+    }
+    if(load_shed::enabled) load_shed::start();
+    if(disk_ring::max_bytes>0){
+        if(demux.opt.output_segments){
+            std::cerr << "-S ring_bytes does nothing with --segments\n";
+        } else {
+            disk_ring::start(xreport);
+        }
+    }
+    if(body_store::dir.size()>0){
+        if(demux.opt.output_segments){
+            std::cerr << "-S dedup_dir does nothing with --segments\n";
+        } else {
+            std::string error;
+            if(!body_store::start(body_store::dir[0]=='/' ? body_store::dir : demux.outdir + "/" + body_store::dir,error)){
+                std::cerr << error << "\n";
+                exit(1);
+            }
+        }
+    }
+    mem_budget::add_gauges();
+    if(flow_checkpoint::load_path.size()>0){
+        std::string file = flow_checkpoint::load_path[0]=='/' ? flow_checkpoint::load_path
+                                                               : demux.outdir + "/" + flow_checkpoint::load_path;
+        int64_t flows = flow_checkpoint::load(file,demux);
+        if(flows<0){
+            std::cerr << file << ": not a complete checkpoint; no flows were taken up\n";
+        } else {
+            DEBUG(1)("%s: %" PRId64 " flows taken up",file.c_str(),flows);
+        }
+    }
+    if(flow_checkpoint::enabled()){
+        flow_checkpoint::start(flow_checkpoint::path[0]=='/' ? flow_checkpoint::path
+                                                             : demux.outdir + "/" + flow_checkpoint::path);
+    }
+
     /* Process r files and R files */
     int exit_val = 0;
     if(xreport){
         xreport->push("configuration");
     }
-    if(rfiles.size()==0 && Rfiles.size()==0){
+    if(rescan_dir.size()>0){
+	/* no packets; the flows of an earlier run */
+	unsigned int nthreads = opt_threads>1 ? opt_threads : std::thread::hardware_concurrency();
+	std::string error;
+	int64_t flows = flow_rescan::run(demux,rescan_dir,nthreads,error);
+	if(flows<0){
+	    std::cerr << error << "\n";
+	    exit_val = 1;
+	} else {
+	    DEBUG(1)("%s: %" PRId64 " flows rescanned",rescan_dir.c_str(),flows);
+	}
+	input_fname = rescan_dir;
+    }
+    else if(rfiles.size()==0 && Rfiles.size()==0){
 	/* live capture */
-	demux.start_new_connections = true;
+	demux.set_start_new_connections(true);
         int err = process_infile(demux,expression,device,"");
         if (err < 0) {
             exit_val = 1;
@@ -900,34 +1694,67 @@ int main(int argc, char *argv[])
     }
     else {
 	/* first pick up the new connections with -r */
-	demux.start_new_connections = true;
-	for(std::vector<std::string>::const_iterator it=rfiles.begin();it!=rfiles.end();it++){
-	    int err = process_infile(demux,expression,device,*it);
-	    if (err < 0) {
+	demux.set_start_new_connections(true);
+	if(opt_parallel_inputs==INPUTS_MERGE && rfiles.size()>0){
+	    if(process_merged_infiles(demux,expression,rfiles) < 0){
 	        exit_val = 1;
 	    }
+	} else if(opt_parallel_inputs==INPUTS_INDEPENDENT){
+	    unsigned int nthreads = opt_threads>1 ? opt_threads : std::thread::hardware_concurrency();
+	    if(nthreads<1) nthreads = 1;
+	    if(process_independent_infiles(demux,expression,rfiles,nthreads) < 0){
+	        exit_val = 1;
+	    }
+	} else {
+	    for(std::vector<std::string>::const_iterator it=rfiles.begin();it!=rfiles.end();it++){
+	        int err = process_infile(demux,expression,device,*it);
+	        if (err < 0) {
+	            exit_val = 1;
+	        }
+	    }
 	}
 	/* now pick up the outstanding connection with -R, but don't start new connections */
-	demux.start_new_connections = false;
+	demux.set_start_new_connections(false);
+	if(Rfiles.size()>0 && resume_filter::enabled
+	   && !resume_filter::start(demux,expression)){
+	    DEBUG(1) ("no flows are open; the -R files are not read");
+	    Rfiles.clear();
+	}
 	for(std::vector<std::string>::const_iterator it=Rfiles.begin();it!=Rfiles.end();it++){
 	    int err = process_infile(demux,expression,device,*it);
 	    if (err < 0) {
 	        exit_val = 1;
 	    }
 	}
+	resume_filter::stop();
     }
 
     /* -1 causes pcap_loop to loop forever, but it finished when the input file is exhausted. */
+    int open_fds = (int)demux.open_flow_count();      // these wait for any workers
+    int flow_map_size = (int)demux.flow_map_count();
+    std::vector<uint64_t> root_flows;
+    demux.root_flows(root_flows);
 
-    DEBUG(2)("Open FDs at end of processing:      %d",(int)demux.open_flows.size());
+    demux.remove_all_flows();	// empty the map to capture the state; stops any workers and adds up their counters
+
+    DEBUG(2)("Open FDs at end of processing:      %d",open_fds);
     DEBUG(2)("demux.max_open_flows:               %d",(int)demux.max_open_flows);
-    DEBUG(2)("Flow map size at end of processing: %d",(int)demux.flow_map.size());
+    DEBUG(2)("Flow map size at end of processing: %d",flow_map_size);
     DEBUG(2)("Flows seen:                         %d",(int)demux.flow_counter);
-
-    int open_fds = (int)demux.open_flows.size();
-    int flow_map_size = (int)demux.flow_map.size();
-
-    demux.remove_all_flows();	// empty the map to capture the state
+    console_output::flush();
+    json_stream::stop();
+    flow_checkpoint::finish();
+    delete tcpdemux::scanners;          // scan what is left and write its reports
+    tcpdemux::scanners = 0;
+    delete tcpdemux::tcp_workers;       // waits for the workers to finish
+    tcpdemux::tcp_workers = 0;
+    alert_channel::stop_all();          // after the last close
+    disk_ring::stop();                  // after the last report; its <expired> go to the report_writer
+    delete tcpdemux::reports;           // writes the last of the flows' reports
+    tcpdemux::reports = 0;
+    load_shed::stop();
+    metrics::stop();                    // the final counts
+    tracer::stop();
     std::stringstream ss;
     be13::plugin::phase_shutdown(fs,xreport ? &ss : 0);
 
@@ -942,12 +1769,35 @@ int main(int argc, char *argv[])
 
     if(xreport){
         xreport->pop();                 // fileobjects
+        if(load_shed::enabled) load_shed::dump_xml(xreport);
+        if(mem_budget::max>0) mem_budget::dump_xml(xreport);
+        if(output_roots::dirs.size()>1) output_roots::dump_xml(xreport,root_flows);
+        if(disk_ring::max_bytes>0 && !demux.opt.output_segments) disk_ring::dump_xml(xreport);
+        if(flow_policy::active()) flow_policy::dump_xml(xreport);
+        if(body_store::active()) body_store::dump_xml(xreport);
         xreport->xmlout("summary",ss.str(),"",false);
         xreport->xmlout("open_fds_at_end",open_fds);
         xreport->xmlout("max_open_flows",demux.max_open_flows);
         xreport->xmlout("total_flows",demux.flow_counter);
         xreport->xmlout("flow_map_size",flow_map_size);
         xreport->xmlout("total_packets",demux.packet_counter);
+        size_t slab_peak=0,slab_capacity=0;
+        demux.session_slab_stats(slab_peak,slab_capacity);
+        xreport->xmlout("session_pool_peak",(uint64_t)slab_peak);
+        xreport->xmlout("session_pool_capacity",(uint64_t)slab_capacity);
+        if(tcpdemux::syn_table_size>0){
+            syn_table<flow_addr>::stats syns;
+            demux.syn_stats(syns);
+            std::stringstream attrs;
+            attrs << "added='" << syns.added << "' promoted='" << syns.promoted << "' evicted='" << syns.evicted
+                  << "' expired='" << syns.expired << "' reset='" << syns.reset << "'";
+            xreport->xmlout("syn_table","",attrs.str(),false);
+        }
+        if(tcpdemux::flow_sample>1){
+            std::stringstream attrs;
+            attrs << "rate='" << tcpdemux::flow_sample << "' skipped_packets='" << demux.sample_skipped_count() << "'";
+            xreport->xmlout("flow_sampling","",attrs.str(),false);
+        }
 	xreport->add_rusage();
 	xreport->pop();                 // bulk_extractor
 	xreport->close();
@@ -270,7 +270,15 @@ extern sem_t *semlock;
 extern int debug;
 #endif
 
-#define DEBUG(message_level) if (debug >= message_level) debug_real
+/* DEBUG(n) messages above DEBUG_MAX_LEVEL are compiled out, arguments and all;
+ * build with ./configure --with-debug-max=N (or -DDEBUG_MAX_LEVEL=N) to drop the
+ * per-packet ones. DEBUG_ON(n) is the same test, for code that only runs at a level.
+ */
+#ifndef DEBUG_MAX_LEVEL
+#define DEBUG_MAX_LEVEL 1000000
+#endif
+#define DEBUG_ON(message_level) ((message_level) <= DEBUG_MAX_LEVEL && __builtin_expect(debug >= (message_level),0))
+#define DEBUG(message_level) if (DEBUG_ON(message_level)) debug_real
 
 /************************* per-file globals  ****************************/
 
@@ -304,12 +312,20 @@ extern int debug;
 std::string ssprintf(const char *fmt,...);
 std::string comma_number_string(int64_t input);
 void mkdirs_for_path(std::string path); // creates any directories necessary for the path
+extern uint32_t mkdirs_cache_max;       // directories mkdirs_for_path() remembers; -S mkdir_cache
 std::string macaddr(const uint8_t *addr);
+std::string json_quote(const std::string &s); // s as a JSON string, with its quotes
 
 #define DEBUG_PEDANTIC    0x0001       // check values more rigorously
 void init_debug(const char *progname,int include_pid);
 void (*portable_signal(int signo, void (*func)(int)))(int);
 void debug_real(const char *fmt, ...) __attribute__ ((format (printf, 1, 2)));
+#ifndef HAVE_PREAD
+ssize_t pread(int fd,void *buf,size_t count,off_t offset);
+#endif
+#ifndef HAVE_PWRITE
+ssize_t pwrite(int fd,const void *buf,size_t count,off_t offset);
+#endif
 [[noreturn]] void die(const char *fmt, ...) __attribute__ ((__noreturn__))  __attribute__ ((format (printf, 1, 2)));
 
 /* scanners */
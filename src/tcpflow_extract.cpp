@@ -0,0 +1,180 @@
+/**
+ * tcpflow_extract.cpp
+ *
+ * List and extract the flows and HTTP bodies that tcpflow --segments
+ * stored in segment files.
+ *
+ * usage: tcpflow-extract [-d dir] [-o outdir] [-l] [name ...]
+ *
+ * With -l, prints one line per object: name, session id, bytes, and the
+ * times of its first and last packets. Otherwise extracts the objects
+ * called name (all of them if no names are given) into outdir, as the
+ * files tcpflow would have written. The pieces of a flow that were
+ * stored as more than one object under the same session are put back
+ * into one file; a name that was used by another session as well is
+ * extracted as name.SESSION for the later sessions.
+ *
+ * usage: tcpflow-extract -z [-o outdir] file.zst ...
+ *
+ * Decompresses transcripts that tcpflow -S compress=zstd wrote, patches
+ * and all (see zstd_transcript.h), into the file without .zst, next to
+ * it or in outdir.
+ *
+ * This source code is under the GNU Public License (GPL).  See
+ * LICENSE for details.
+ */
+
+#include "segment_reader.h"
+#include "zstd_transcript.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <inttypes.h>
+#include <iostream>
+#include <map>
+#include <set>
+#include <sstream>
+#include <vector>
+
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+static void usage()
+{
+    std::cerr << "usage: tcpflow-extract [-d dir] [-o outdir] [-l] [name ...]\n";
+    std::cerr << "       tcpflow-extract -z [-o outdir] file.zst ...\n";
+    std::cerr << "   -d dir    : where tcpflow --segments wrote (default '.')\n";
+    std::cerr << "   -o outdir : where to extract to (default '.')\n";
+    std::cerr << "   -l        : list what is there instead\n";
+    std::cerr << "   -z        : decompress -S compress=zstd transcripts\n";
+    exit(1);
+}
+
+/* make the directories in path, as a filename template with '/' would have */
+static void mkdirs_for(const std::string &path)
+{
+    for(size_t i=path.find('/',1);i!=std::string::npos;i=path.find('/',i+1)){
+        mkdir(path.substr(0,i).c_str(),0777);
+    }
+}
+
+/* decompress each of names to the name without .zst */
+static int decompress(const std::vector<std::string> &names,const std::string &outdir)
+{
+    int r = 0;
+    for(std::vector<std::string>::const_iterator it=names.begin();it!=names.end();it++){
+        std::string path(*it);
+        if(path.size()>4 && path.compare(path.size()-4,4,".zst")==0) path.erase(path.size()-4);
+        else path += ".out";
+        if(outdir.size()>0){
+            size_t slash = path.rfind('/');
+            path = outdir + "/" + (slash==std::string::npos ? path : path.substr(slash+1));
+        }
+        std::string contents,error;
+        if(zstd_transcript::read(*it,contents,error)){
+            std::cerr << "tcpflow-extract: " << error << "\n";
+            r = 1;
+            continue;
+        }
+        FILE *f = fopen(path.c_str(),"wb");
+        if(f==0){
+            std::cerr << "tcpflow-extract: " << path << ": " << strerror(errno) << "\n";
+            r = 1;
+            continue;
+        }
+        if(fwrite(contents.data(),1,contents.size(),f)!=contents.size() || fclose(f)){
+            std::cerr << "tcpflow-extract: " << path << ": write failed\n";
+            r = 1;
+        }
+    }
+    return r;
+}
+
+int main(int argc,char **argv)
+{
+    std::string dir(".");
+    std::string outdir(".");
+    bool outdir_given = false;
+    bool list = false;
+    bool zst  = false;
+    int ch;
+    while((ch = getopt(argc,argv,"d:o:lzh")) != -1){
+        switch(ch){
+        case 'd': dir = optarg; break;
+        case 'o': outdir = optarg; outdir_given = true; break;
+        case 'l': list = true; break;
+        case 'z': zst = true; break;
+        default:  usage();
+        }
+    }
+    if(zst){
+        if(optind==argc) usage();
+        return decompress(std::vector<std::string>(argv+optind,argv+argc),outdir_given ? outdir : std::string());
+    }
+    std::set<std::string> names(argv+optind,argv+argc);
+
+    segment_reader reader(dir);
+    std::string error;
+    if(reader.open(error)){
+        std::cerr << "tcpflow-extract: " << error << "\n";
+        return 1;
+    }
+
+    int r = 0;
+    std::map<std::string,uint64_t> first_session;  // the session that gets the plain name
+    std::set<std::string> started;                 // files already truncated by an earlier object
+    const segment_reader::objects_t &objs = reader.objects();
+    for(segment_reader::objects_t::const_iterator it=objs.begin();it!=objs.end();it++){
+        if(names.size()>0 && names.find(it->name)==names.end()) continue;
+        if(list){
+            printf("%s\t%" PRIu64 "\t%" PRIu64 "\t%ld.%06ld\t%ld.%06ld\n",
+                   it->name.c_str(),it->session_id,it->length,
+                   (long)it->tstart.tv_sec,(long)it->tstart.tv_usec,
+                   (long)it->tlast.tv_sec,(long)it->tlast.tv_usec);
+            continue;
+        }
+        std::string path = outdir + "/" + it->name;
+        std::map<std::string,uint64_t>::const_iterator fs = first_session.find(it->name);
+        if(fs==first_session.end()){
+            first_session[it->name] = it->session_id;
+        } else if(fs->second!=it->session_id){
+            std::stringstream ss;
+            ss << path << "." << it->session_id;
+            path = ss.str();
+        }
+        mkdirs_for(path);
+        if(started.find(path)==started.end()){
+            started.insert(path);
+            if(reader.extract(*it,path,error)){
+                std::cerr << "tcpflow-extract: " << error << "\n";
+                r = 1;
+            }
+            continue;
+        }
+        /* more of a flow that was already started: lay it over what is there */
+        std::string data;
+        if(reader.read(*it,data,error)){
+            std::cerr << "tcpflow-extract: " << error << "\n";
+            r = 1;
+            continue;
+        }
+        FILE *f = fopen(path.c_str(),"r+b");
+        if(f==0){
+            std::cerr << "tcpflow-extract: " << path << ": " << strerror(errno) << "\n";
+            r = 1;
+            continue;
+        }
+        for(segment_extents::const_iterator e=it->extents.begin();e!=it->extents.end();e++){
+            if(fseeko(f,(off_t)e->offset,SEEK_SET)==0) fwrite(data.data()+e->offset,1,e->length,f);
+        }
+        if(ferror(f)){
+            std::cerr << "tcpflow-extract: " << path << ": write failed\n";
+            r = 1;
+        }
+        fclose(f);
+    }
+    return r;
+}
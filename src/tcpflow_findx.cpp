@@ -0,0 +1,77 @@
+/**
+ * tcpflow_findx.cpp
+ *
+ * Turn the binary packet index that tcpflow -I writes (*.findb) into
+ * the older text form (*.findx).
+ *
+ * usage: tcpflow-findx file.findb ...
+ *
+ * Each file.findb becomes file.findx next to it; "-" converts standard
+ * input to standard output.
+ *
+ * This source code is under the GNU Public License (GPL).  See
+ * LICENSE for details.
+ */
+
+#include "packet_index.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+static int convert(FILE *in,FILE *out)
+{
+    uint8_t buf[packet_index_record::SIZE];
+    size_t n;
+    while((n=fread(buf,1,sizeof(buf),in))==sizeof(buf)){
+        packet_index_record::decode(buf).print(out);
+    }
+    if(n!=0){
+        fprintf(stderr,"tcpflow-findx: %u bytes left over; not a packet index?\n",(unsigned)n);
+        return -1;
+    }
+    return ferror(in) || ferror(out) ? -1 : 0;
+}
+
+int main(int argc,char **argv)
+{
+    if(argc<2){
+        fprintf(stderr,"usage: tcpflow-findx file.findb ...\n");
+        return 1;
+    }
+    int r = 0;
+    for(int i=1;i<argc;i++){
+        std::string in_name(argv[i]);
+        if(in_name=="-"){
+            if(convert(stdin,stdout)) r = 1;
+            continue;
+        }
+        std::string out_name(in_name);
+        if(out_name.size()>6 && out_name.compare(out_name.size()-6,6,".findb")==0){
+            out_name.replace(out_name.size()-6,6,".findx");
+        } else {
+            out_name += ".findx";
+        }
+        FILE *in = fopen(in_name.c_str(),"rb");
+        if(in==0){
+            fprintf(stderr,"tcpflow-findx: %s: %s\n",in_name.c_str(),strerror(errno));
+            r = 1;
+            continue;
+        }
+        FILE *out = fopen(out_name.c_str(),"w");
+        if(out==0){
+            fprintf(stderr,"tcpflow-findx: %s: %s\n",out_name.c_str(),strerror(errno));
+            fclose(in);
+            r = 1;
+            continue;
+        }
+        if(convert(in,out)){
+            fprintf(stderr,"tcpflow-findx: %s: conversion failed\n",in_name.c_str());
+            r = 1;
+        }
+        fclose(in);
+        if(fclose(out)) r = 1;
+    }
+    return r;
+}
@@ -0,0 +1,89 @@
+/**
+ * tcpflow_trace.cpp
+ *
+ * Print the records that tcpflow -S trace_file=... writes, of all the
+ * threads together in time order.
+ *
+ * usage: tcpflow-trace [-f flow] [-e event] file
+ *
+ * Each line is "seconds thread event name=value ...", the seconds counted
+ * from when the tracing started. -f prints only the events of one flow
+ * (the number in the flow= fields, which -F filename templates split into
+ * %G%M%K%N), and -e only those of one event ("store", "fd_eviction", ...).
+ *
+ * This source code is under the GNU Public License (GPL).  See
+ * LICENSE for details.
+ */
+
+#include "trace_record.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <unistd.h>
+
+static void usage()
+{
+    fprintf(stderr,"usage: tcpflow-trace [-f flow] [-e event] file\n");
+    exit(1);
+}
+
+int main(int argc,char **argv)
+{
+    bool by_flow = false;
+    uint64_t flow = 0;
+    int event = -1;
+    int ch;
+    while((ch = getopt(argc,argv,"f:e:h")) != -1){
+        switch(ch){
+        case 'f': by_flow = true; flow = strtoull(optarg,0,10); break;
+        case 'e':
+            for(unsigned e=0;e<trace_record::EVENTS;e++){
+                if(strcmp(optarg,trace_record::event_name(e))==0) event = e;
+            }
+            if(event<0){
+                fprintf(stderr,"tcpflow-trace: no event %s\n",optarg);
+                return 1;
+            }
+            break;
+        default: usage();
+        }
+    }
+    if(optind+1!=argc) usage();
+
+    const char *fname = argv[optind];
+    FILE *in = strcmp(fname,"-")==0 ? stdin : fopen(fname,"rb");
+    if(in==0){
+        fprintf(stderr,"tcpflow-trace: %s: %s\n",fname,strerror(errno));
+        return 1;
+    }
+    uint8_t buf[trace_record::SIZE];
+    if(fread(buf,1,trace_record::HEADER_SIZE,in)!=trace_record::HEADER_SIZE
+       || !trace_record::decode_header(buf)){
+        fprintf(stderr,"tcpflow-trace: %s: not a tcpflow trace, or of another version\n",fname);
+        return 1;
+    }
+    std::vector<trace_record> recs;
+    size_t n;
+    while((n=fread(buf,1,sizeof(buf),in))==sizeof(buf)){
+        trace_record r = trace_record::decode(buf);
+        if(event>=0 && r.event!=event) continue;
+        const char *b_name = trace_record::event_field(r.event,1);
+        if(by_flow && (b_name==0 || strcmp(b_name,"flow")!=0 || r.b!=flow)) continue;
+        recs.push_back(r);
+    }
+    if(n!=0){
+        fprintf(stderr,"tcpflow-trace: %s: %u bytes left over\n",fname,(unsigned)n);
+    }
+    if(in!=stdin) fclose(in);
+
+    std::stable_sort(recs.begin(),recs.end()); // each thread's are in order already
+    for(std::vector<trace_record>::const_iterator it=recs.begin();it!=recs.end();it++){
+        it->print(stdout);
+    }
+    return ferror(stdout) ? 1 : 0;
+}
@@ -14,16 +14,27 @@
 
 #include "tcpflow.h"
 #include "tcpip.h"
+#include "console_output.h"
 #include "tcpdemux.h"
+#include "http_stream.h"
+#include "tls_stream.h"
+#include "flow_policy.h"
+#include "metrics.h"
+#include "tracer.h"
+#include "mem_budget.h"
+#include "tcp_policy.h"
+#include "json_stream.h"
 
 #include <iostream>
 #include <sstream>
 #include <vector>
 #include <string>
+#include <algorithm>
 
 #pragma GCC diagnostic ignored "-Weffc++"
 #pragma GCC diagnostic ignored "-Wshadow"
 
+/* static */ bool tcpip::stream_hash = true;
 
 /* Create a new tcp object.
  * 
@@ -35,32 +46,40 @@
 tcpip::tcpip(tcpdemux &demux_,const flow &flow_,be13::tcp_seq isn_):
     demux(demux_),myflow(flow_),dir(unknown),isn(isn_),nsn(0),
     syn_count(0),fin_count(0),fin_size(0),pos(0),
-    flow_pathname(),fd(-1),file_created(false),
-    flow_index_pathname(),idx_file(),
-    seen(new recon_set()),
+    flow_pathname(),fd(-1),file_created(false),wbuf(),staging(false),wbuf_offset(0),
+    reorder(),reorder_bytes(0),prefix(),headroom(0),extents(),compressed(0),compressed_size(0),
+    http(0),tls(0),transcript(true),max_bytes(demux_.opt.max_bytes_per_flow),shed_level(0),policy(0),bypass(false),hasher(0),hash_next(0),hash_broken(false),json_prefix(),json_prefix_named(false),
+    flow_index_pathname(),packet_index(),
+    seen(),
     last_byte(),
-    last_packet_number(),out_of_order_count(0),violations(0)
+    last_packet_number(),out_of_order_count(0),violations(0),
+    it(),timer_it(),timer_slot(timer_wheel<tcpip>::NOT_SCHEDULED),timer_when(0),
+    session(0)
 {
 }
 
 
-uint32_t tcpip::seen_bytes()
+void tcpip::dump_seen()
 {
-    if(seen) return seen->size();
-    return 0;
+    for(size_t i=0;i<seen.interval_count();i++){
+        recon_set::interval r = seen.get_interval(i);
+        std::cerr << "[" << r.begin << "," << r.end << "), ";
+    }
+    std::cerr << std::endl;
 }
 
-void tcpip::dump_seen()
+flow_report::flow_report(const tcpip &tcp):
+    myflow(tcp.myflow),flow_pathname(tcp.flow_pathname),last_byte(tcp.last_byte),
+    out_of_order_count(tcp.out_of_order_count),violations(tcp.violations),digests()
 {
-    if(seen){
-        for(recon_set::const_iterator it = seen->begin(); it!=seen->end(); it++){
-            std::cerr << *it << ", ";
-        }
-        std::cerr << std::endl;
-    }
 }
 
 void tcpip::dump_xml(class dfxml_writer *xreport,const std::string &xmladd)
+{
+    flow_report(*this).dump_xml(xreport,xmladd);
+}
+
+void flow_report::dump_xml(class dfxml_writer *xreport,const std::string &xmladd,bool flush) const
 {
     static const std::string fileobject_str("fileobject");
     static const std::string filesize_str("filesize");
@@ -83,17 +102,54 @@ void tcpip::dump_xml(class dfxml_writer *xreport,const std::string &xmladd)
     attrs << "srcport='"  << myflow.sport << "' ";
     attrs << "dstport='"  << myflow.dport << "' ";
     attrs << "packets='"  << myflow.packet_count << "' ";
+    if(output_roots::dirs.size()>1) attrs << "root='" << myflow.root << "' ";
     if(out_of_order_count) attrs << "out_of_order_count='" << out_of_order_count << "' ";
     if(violations)         attrs << "violations='" << violations << "' ";
     attrs << "len='"      << myflow.len << "' ";
     if(myflow.len != myflow.caplen) attrs << "caplen='"   << myflow.caplen << "' ";
     xreport->xmlout(tcpflow_str,"",attrs.str(),false);
+    if(digests.size()>0) xreport->xmlout("",flow_hash::xml(digests),"",false);
     if(xmladd.size()>0) xreport->xmlout("",xmladd,"",false);
     xreport->pop();
-    xreport->flush();
+    if(flush) xreport->flush();
+}
+
+void flow_report::dump_json(std::string &out,const std::string &xmladd) const
+{
+    std::stringstream ss;
+    ss << "{\"filename\":" << json_quote(flow_pathname)
+       << ",\"filesize\":" << last_byte
+       << ",\"startime\":\"" << dfxml_writer::to8601(myflow.tstart) << "\""
+       << ",\"endtime\":\""  << dfxml_writer::to8601(myflow.tlast)  << "\"";
+    if(myflow.has_mac_daddr()) ss << ",\"mac_daddr\":\"" << macaddr(myflow.mac_daddr) << "\"";
+    if(myflow.has_mac_saddr()) ss << ",\"mac_saddr\":\"" << macaddr(myflow.mac_saddr) << "\"";
+    ss << ",\"family\":"    << (int)myflow.family
+       << ",\"src_ipn\":\"" << ipaddr_prn(myflow.src, myflow.family) << "\""
+       << ",\"dst_ipn\":\"" << ipaddr_prn(myflow.dst, myflow.family) << "\""
+       << ",\"srcport\":"   << myflow.sport
+       << ",\"dstport\":"   << myflow.dport
+       << ",\"session_id\":" << myflow.session_id
+       << ",\"packets\":"   << myflow.packet_count;
+    if(output_roots::dirs.size()>1) ss << ",\"root\":" << myflow.root;
+    if(out_of_order_count) ss << ",\"out_of_order_count\":" << out_of_order_count;
+    if(violations)         ss << ",\"violations\":" << violations;
+    ss << ",\"len\":" << myflow.len;
+    if(myflow.len != myflow.caplen) ss << ",\"caplen\":" << myflow.caplen;
+    for(flow_hash::digests_t::const_iterator it=digests.begin();it!=digests.end();it++){
+        ss << ",\"" << it->type << "\":\"" << it->hex << "\"";
+    }
+    if(xmladd.size()>0) ss << ",\"xml\":" << json_quote(xmladd); // what the scanners found, as they put it
+    ss << "}\n";
+    out += ss.str();
 }
 
 
+/* what a recon_set of n intervals holds beyond itself; the first is inline */
+/* static */ int64_t tcpip::recon_bytes(size_t n)
+{
+    return n>1 ? (int64_t)(n*sizeof(recon_set::interval)) : 0;
+}
+
 /**
  * Destructor is called when flow is closed.
  * It implements "after" processing.
@@ -103,7 +159,15 @@ void tcpip::dump_xml(class dfxml_writer *xreport,const std::string &xmladd)
 tcpip::~tcpip()
 {
     assert(fd<0);                       // file must be closed
-    delete seen;                        // no need to check to see if seen is null or not.
+    demux.reorder_held -= reorder_bytes;
+    mem_budget::release(mem_budget::REORDER,reorder_bytes);
+    mem_budget::release(mem_budget::RECON,recon_bytes(seen.interval_count()));
+    if(http) mem_budget::release(mem_budget::HTTP,sizeof(*http));
+    if(tls) mem_budget::release(mem_budget::TLS,sizeof(*tls));
+    delete compressed;
+    delete http;
+    delete tls;
+    delete hasher;
 }
 
 #pragma GCC diagnostic warning "-Weffc++"
@@ -127,7 +191,21 @@ tcpip::~tcpip()
  */
 void tcpip::close_file()
 {
+    if(demux.opt.output_segments){
+        if(fd>=0){
+            flush_buffer();
+            fd = -1;                    // the segment stays open
+            demux.open_flows.erase(this);
+        }
+        return;
+    }
     if (fd>=0){
+	flush_buffer();
+	if(compressed){                 // a flow that is opened again carries on in a new frame
+	    compressed->end_frame();
+	    write_compressed();
+	}
+	demux.sync_file(fd,myflow.root); // before futimes, and before the fd goes
 	struct timeval times[2];
 	times[0] = myflow.tstart;
 	times[1] = myflow.tstart;
@@ -160,10 +238,7 @@ void tcpip::close_file()
 	close(fd);
 	fd = -1;
 	demux.open_flows.erase(this);           // we are no longer open
-    }
-    // Also close the flow_index file, if flow indexing is in use --GDD
-    if(demux.opt.output_packet_index && idx_file.is_open()){
-    	idx_file.close();
+	demux.roots[myflow.root].open_fds--;
     }
     //std::cerr << "close_file1 " << *this << "\n";
 }
@@ -176,19 +251,38 @@ void tcpip::close_file()
 
 int tcpip::open_file()
 {
-	int create_idx_needed = false;
+    if(!transcript) return -1;
+    if(demux.opt.output_segments){
+        /* The flow goes into the current segment. Its name is only used in the
+         * index and the reports, so there is no file for it to find free.
+         * The segment index takes the place of -I.
+         */
+        if(fd<0){
+            fd = demux.segment_output()->current_fd();
+            if(fd<0) return -1;
+            if(flow_pathname.size()==0){
+                flow_pathname = myflow.filename(0,false);
+                file_created = true;
+            }
+            demux.open_flows.push_back(this);
+            if(demux.open_flows.size() > demux.max_open_flows) demux.max_open_flows = demux.open_flows.size();
+        }
+        return 0;
+    }
     if(fd<0){
         //std::cerr << "open_file0 " << ct << " " << *this << "\n";
+        /* the flow's root may have used its share of the fds; see output_roots.h */
+        while(demux.roots.fds_full(myflow.root) && demux.close_oldest_fd_on(myflow.root)) {}
         /* If we don't have a filename, create the flow */
         if(flow_pathname.size()==0) {
-            flow_pathname = myflow.new_filename(&fd,O_RDWR|O_BINARY|O_CREAT|O_EXCL,0666);
+            flow_pathname = myflow.new_filename(&fd,O_RDWR|O_BINARY|O_CREAT|O_EXCL,0666,
+                                                demux.opt.output_zstd ? ".zst" : "");
             file_created = true;		// remember we made it
-            create_idx_needed = true;	// We created a new stream, so we need to create a new flow file. --GDD
+            if(demux.opt.output_zstd) compressed = new zstd_transcript();
             DEBUG(5) ("%s: created new file",flow_pathname.c_str());
         } else {
             /* open an existing flow */
             fd = demux.retrying_open(flow_pathname,O_RDWR | O_BINARY | O_CREAT,0666);
-            lseek(fd,pos,SEEK_SET);  
             DEBUG(5) ("%s: opening existing file", flow_pathname.c_str());
         }
         
@@ -202,33 +296,10 @@ int tcpip::open_file()
         }
         /* Remember that we have this open */
         demux.open_flows.push_back(this);
+        demux.roots[myflow.root].open_fds++;
         if(demux.open_flows.size() > demux.max_open_flows) demux.max_open_flows = demux.open_flows.size();
         //std::cerr << "open_file1 " << *this << "\n";
     }
-    if(demux.opt.output_packet_index){
-    	//Open the file for the flow index.  We don't do this if the flow file could not be
-    	//	opened.  The file must be opened for append, in case this is a reopen.  The filename
-    	//	standard is the flow name followed by ".findx", which google currently says does not
-    	//	conflict with anything major.
-    	flow_index_pathname = flow_pathname + ".findx";
-    	DEBUG(10)("opening index file: %s",flow_index_pathname.c_str());
-    	if(create_idx_needed){
-    		//New flow file, even if there was an old one laying around --GDD
-    		idx_file.open(flow_index_pathname.c_str(),std::ios::trunc|std::ios::in|std::ios::out);
-    	}else{
-    		//Use existing flow file --GDD
-    		idx_file.open(flow_index_pathname.c_str(),std::ios::ate|std::ios::in|std::ios::out);
-    	}
-    	if(idx_file.bad()){
-    		perror(flow_index_pathname.c_str());
-    		// Be nice and be sure the flow has been closed in the demultiplexer.
-    		// demux.close_tcpip_fd(this);  Need to fix this.  Also, when called, it will
-    		// have to differentiate the fact that the open fd cound only needs to be
-    		// decremented by one and not by 2.--GDD
-    		return -1;
-    	}
-
-    }
     return 0;
 }
 
@@ -239,14 +310,15 @@ int tcpip::open_file()
 /* print the contents of this packet to the console.
  * This is nice for immediate satisfaction, but it can't handle
  * out of order packets, etc.
+ * The packet is rendered into a buffer and written with one write(); see console_output.h
  */
 void tcpip::print_packet(const u_char *data, uint32_t length)
 {
     /* green, blue, read */
     const char *color[3] = { "\033[0;32m", "\033[0;34m", "\033[0;31m" };
 
-    if(demux.opt.max_bytes_per_flow>=0){
-        uint64_t max_bytes_per_flow = (uint64_t)demux.opt.max_bytes_per_flow;
+    if(max_bytes>=0){
+        uint64_t max_bytes_per_flow = (uint64_t)max_bytes;
 
 	if(last_byte > max_bytes_per_flow) return; /* too much has been printed */
 	if(length > max_bytes_per_flow - last_byte){
@@ -255,61 +327,19 @@ void tcpip::print_packet(const u_char *data, uint32_t length)
 	}
     }
 
-#ifdef HAVE_PTHREAD
-    if(semlock){
-	if(sem_wait(semlock)){
-	    fprintf(stderr,"%s: attempt to acquire semaphore failed: %s\n",progname,strerror(errno));
-	    exit(1);
-	}
-    }
-#endif
+    static thread_local std::string out; // reused; --parallel-inputs=independent prints from several threads
+    out.clear();
 
     if(flow_pathname.size()==0) flow_pathname = myflow.filename(0, false);
-    if (demux.opt.use_color) fputs(dir==dir_cs ? color[1] : color[2], stdout);
+    if (demux.opt.use_color) out += dir==dir_cs ? color[1] : color[2];
     if (demux.opt.suppress_header == 0 && demux.opt.output_json == 0){
-        printf("%s: ", flow_pathname.c_str());
-        if(demux.opt.output_hex) putchar('\n');
+        out += flow_pathname;
+        out += ": ";
+        if(demux.opt.output_hex) out += '\n';
     }
 
-    size_t written = 0;
     if(demux.opt.output_hex){
-        const size_t bytes_per_line = 32;
-        size_t max_spaces = 0;
-        for(u_int i=0;i<length;i+=bytes_per_line){
-            size_t spaces=0;
-            
-            /* Print the offset */
-            char b[64];
-            size_t count = snprintf(b,sizeof(b),"%04x: ",(int)i);
-            if(fwrite(b,1,count,stdout)!=count){
-	      perror("fwrite");
-	    }
-            spaces += count;
-            
-            /* Print the hext bytes */
-            for(size_t j=0;j<bytes_per_line && i+j<length ;j++){
-                unsigned char ch = data[i+j];
-                fprintf(stdout,"%02x",ch);  spaces += 2;
-                if(j%2==1){
-                    fputc(' ',stdout);
-                    spaces += 1;
-                }
-            }
-            /* space out to where the ASCII region is */
-            if(spaces>max_spaces) max_spaces=spaces;
-            for(;spaces<max_spaces;spaces++){
-                fputc(' ',stdout);
-            }
-            putchar(' ');
-            /* Print the ascii */
-            for(size_t j=0;j<bytes_per_line && i+j<length;j++){
-                unsigned char ch = data[i+j];
-                if(ch>=' ' && ch<='~') fputc(ch,stdout);
-                else fputc('.',stdout);
-            }
-            fputc('\n',stdout);
-        }
-        written = length;               // just fake it.
+        console_output::append_hex(out,data,length);
     } else if (demux.opt.output_json) {
         // {
         //     "src_host": "192.168.0.1",
@@ -317,101 +347,31 @@ void tcpip::print_packet(const u_char *data, uint32_t length)
         //     "dst_host": "1.1.1.1",
         //     "dst_port": 80,
         //     "payload" : [...]
-        // }    
-
-        std::string hoststr = std::string();
-
-        putchar('{');   
-        printf("\"src_host\":\"");
-
-        size_t src_pos = 0;
-        size_t src_end_pos = 0;
-        size_t src_pos_counter = 0;
-
-        size_t pathname_len = flow_pathname.length();
-        for(size_t i = 0; i < pathname_len; ++i) {
-            if(flow_pathname[i] == '.') {
-                src_pos_counter++;
-                printf("%d%s", atoi(hoststr.c_str()), (src_pos_counter != 4 ? "." : ""));
-                hoststr.clear();
-            } else {
-                hoststr = hoststr + flow_pathname[i];
-            }
-            if(src_pos_counter == 4) {
-                src_pos = i;
-                break;
-            }
-        }
-        src_end_pos = src_pos;
-        for(;src_end_pos < pathname_len; ++src_end_pos) {
-            if(flow_pathname[src_end_pos] == '-') {
-                break;
-            }
-        }
-        printf("\",\"src_port\":%d,\"dst_host\":\"", atoi(flow_pathname.substr(src_pos + 1, src_end_pos - src_pos).c_str()));
-        
-        size_t dst_pos = src_end_pos + 1;
-        size_t dst_end_pos = dst_pos;
-        size_t dst_pos_counter = 0;
-        
-        for(size_t i = dst_pos; i < pathname_len; ++i) {
-              if(flow_pathname[i] == '.') {
-                dst_pos_counter++;
-                printf("%d%s", atoi(hoststr.c_str()), (dst_pos_counter != 4 ? "." : ""));
-                hoststr.clear();
-            } else {
-                hoststr = hoststr + flow_pathname[i];
-            }
-            if(dst_pos_counter == 4) {
-                dst_pos = i;
-                break;
-            }
-        }
-        dst_end_pos = dst_pos;
-        for(;dst_end_pos < pathname_len; ++dst_end_pos) {
-            if(flow_pathname[dst_end_pos] == '-') {
-                break;
-            }
-        }
-        printf("\",\"dst_port\":%d,\"payload\": [", atoi(flow_pathname.substr(dst_pos + 1, dst_end_pos - dst_pos).c_str()));
-
+        // }
+        std::stringstream ss;
+        ss << "{\"src_host\":\"" << ipaddr_prn(myflow.src,myflow.family)
+           << "\",\"src_port\":" << myflow.sport
+           << ",\"dst_host\":\"" << ipaddr_prn(myflow.dst,myflow.family)
+           << "\",\"dst_port\":" << myflow.dport << ",\"payload\": [";
+        out += ss.str();
+        char b[8];
         for(size_t i = 0; i < length; ++i) {
-            printf("%d%s", data[i], (i != length - 1 ? "," : "]}"));
+            int count = snprintf(b,sizeof(b),i ? ",%d" : "%d",data[i]);
+            out.append(b,count);
         }
+        out += "]}";
     } else if (demux.opt.output_strip_nonprint) {
-	    for(const u_char *cc = data;cc<data+length;cc++){
-	    if(isprint(*cc) || (*cc=='\n') || (*cc=='\r')){
-                int ret = fputc(*cc,stdout);
-                if(ret==EOF){
-                    std::cerr << "EOF on write to stdout\n";
-                    exit(1);
-                
-                }
-	    }
-	    else fputc('.',stdout);
-            written += 1; // treat even unprintable characters as "written". It
-                          // really means "processed"
-        }
-	} else {
-	    written = fwrite(data,1,length,stdout);
-        if(length != written) std::cerr << "\nwrite error to stdout (" << length << "!=" << written << ") \n";
+        console_output::append_stripped(out,data,length);
+    } else {
+        out.append((const char *)data,length);
     }
 
     last_byte += length;
 
-    if (demux.opt.use_color) printf("\033[0m");
-
-    if (! demux.opt.console_output_nonewline) putchar('\n');
-    fflush(stdout);
+    if (demux.opt.use_color) out += "\033[0m";
 
-#ifdef HAVE_PTHREAD
-    if(semlock){
-	if(sem_post(semlock)){
-	    fprintf(stderr,"%s: attempt to post semaphore failed: %s\n",progname,strerror(errno));
-	    exit(1);
-	}
-    }
-#endif
+    if (! demux.opt.console_output_nonewline) out += '\n';
+    console_output::write(out);
 }
 
 /*
@@ -429,6 +389,7 @@ static int shift_file(int fd, size_t inslen)
     struct stat sb;
 
     DEBUG(100)("shift_file(%d,%d)",fd,(int)inslen);
+    metrics::event(metrics::SHIFT_FILE);
 
     if (fstat(fd, &sb) != 0) return -1;
 
@@ -439,23 +400,308 @@ static int shift_file(int fd, size_t inslen)
 	ssize_t bytes_this_time = bytes_to_move < BUFFERSIZE ? bytes_to_move : BUFFERSIZE ;
 	ssize_t rd_off = read_end_offset - bytes_this_time;
 	ssize_t wr_off = rd_off + inslen;
-	lseek(fd, rd_off, SEEK_SET);
-	if (read(fd, buffer, bytes_this_time) != bytes_this_time)
+	if (pread(fd, buffer, bytes_this_time, rd_off) != bytes_this_time)
 	    return -1;
-	lseek(fd, wr_off, SEEK_SET);
-	if (write(fd, buffer, bytes_this_time) != bytes_this_time)
+	if (pwrite(fd, buffer, bytes_this_time, wr_off) != bytes_this_time)
 	    return -1;
 	bytes_to_move -= bytes_this_time;
     }   
     return 0;
 }
 
-#pragma GCC diagnostic ignored "-Weffc++"
-void update_seen(recon_set *seen,uint64_t pos,uint32_t length)
+/* Move everything in the file after its first dellen bytes down to the start */
+static int unshift_file(int fd, size_t dellen)
+{
+    enum { BUFFERSIZE = 64 * 1024 };
+    char buffer[BUFFERSIZE];
+    struct stat sb;
+
+    DEBUG(100)("unshift_file(%d,%d)",fd,(int)dellen);
+    metrics::event(metrics::UNSHIFT_FILE);
+
+    if (fstat(fd, &sb) != 0) return -1;
+    if ((off_t)dellen > sb.st_size) dellen = sb.st_size;
+    for (off_t rd_off = dellen; rd_off < sb.st_size; ) {
+	ssize_t bytes_this_time = std::min((off_t)BUFFERSIZE,sb.st_size-rd_off);
+	if (pread(fd, buffer, bytes_this_time, rd_off) != bytes_this_time)
+	    return -1;
+	if (pwrite(fd, buffer, bytes_this_time, rd_off-dellen) != bytes_this_time)
+	    return -1;
+	rd_off += bytes_this_time;
+    }
+    return ftruncate(fd, sb.st_size-dellen);
+}
+
+/*
+ * Make room for insert_bytes at the start of the file.
+ *
+ * shift_file() rewrites the whole file each time, which made every
+ * prepend cost as much as the flow was long. Instead:
+ *  - what is left of the headroom from an earlier insert is used first;
+ *  - otherwise, where the file system can (ext4 and XFS), whole blocks
+ *    are inserted with FALLOC_FL_INSERT_RANGE and the part of them that
+ *    is not needed becomes headroom;
+ *  - otherwise the new start of the flow is kept in prefix, in memory.
+ * merge_prefix() puts the file in order once, when the flow is finished
+ * (or prefix gets too big), and not at all when the inserted blocks
+ * came out even. With --segments only the offsets of the extents move.
+ */
+void tcpip::prepend_file(uint32_t insert_bytes)
+{
+    enum { MAX_PREFIX = 1024 * 1024 };
+    if(demux.opt.output_segments){      // nothing is in place in a segment
+        segment_store::shift(extents,insert_bytes);
+        return;
+    }
+    if(compressed){                     // nor in a compressed file; a marker in it says so
+        compressed->shift(insert_bytes);
+        write_compressed();
+        return;
+    }
+    demux.sync_file(fd,myflow.root);    // the file is about to move under the queued writes
+    if(prefix.empty()){
+        if(headroom >= insert_bytes){
+            headroom -= insert_bytes;
+            return;
+        }
+#if defined(HAVE_FALLOCATE) && defined(FALLOC_FL_INSERT_RANGE)
+        struct stat sb;
+        if(fstat(fd,&sb)==0 && sb.st_blksize>0 && sb.st_size>0){
+            uint64_t need  = insert_bytes - headroom;
+            uint64_t range = (need + sb.st_blksize - 1) / sb.st_blksize * sb.st_blksize;
+            if(fallocate(fd,FALLOC_FL_INSERT_RANGE,0,range)==0){
+                headroom = headroom + range - insert_bytes;
+                DEBUG(25)("%s: inserted %" PRIu64 " bytes; headroom %" PRIu64,flow_pathname.c_str(),range,headroom);
+                return;
+            }
+            DEBUG(25)("%s: FALLOC_FL_INSERT_RANGE: %s",flow_pathname.c_str(),strerror(errno));
+        }
+#endif
+        insert_bytes -= headroom;       // the rest of the new bytes are in front of the headroom
+        headroom = 0;
+    }
+    prefix.insert(0,insert_bytes,'\0');
+    if(prefix.size() > MAX_PREFIX) merge_prefix();
+}
+
+void tcpip::merge_prefix()
+{
+    if(prefix.empty() && headroom==0) return;
+    if(fd<0 && open_file()) return;
+    demux.sync_file(fd,myflow.root);
+    DEBUG(25)("%s: merging %d prefix bytes and %d of headroom",flow_pathname.c_str(),(int)prefix.size(),(int)headroom);
+    if(prefix.size() > headroom){
+        tracer::event(trace_record::SHIFT_FILE,headroom,myflow.id,prefix.size());
+        shift_file(fd,prefix.size()-headroom);
+    } else if(prefix.size() < headroom){
+        tracer::event(trace_record::UNSHIFT_FILE,headroom,myflow.id,prefix.size());
+        unshift_file(fd,headroom-prefix.size());
+    }
+    headroom = 0;
+    std::string p;
+    p.swap(prefix);                     // so that write_at() puts it in the file
+    write_at(0,(const u_char *)p.data(),p.size());
+}
+
+/*
+ * Write length bytes at offset.
+ * Writes are positional, so the file position does not have to follow pos.
+ * The flow's first prefix.size() bytes go into prefix rather than the file,
+ * and the file's first headroom bytes are skipped; see prepend_file().
+ * With --segments the data is appended to the current segment instead,
+ * and with -S compress=zstd it is compressed onto the end of the file.
+ */
+void tcpip::write_at(uint64_t offset,const u_char *data,size_t length)
+{
+    if(demux.opt.output_segments){
+        if(demux.segment_output()->append(extents,offset,data,length)){
+            DEBUG(1)("%s: cannot append %d bytes to the segment",flow_pathname.c_str(),(int)length);
+        }
+        return;
+    }
+    if(compressed){
+        compressed->write(offset,data,length);
+        write_compressed();
+        return;
+    }
+    if(offset < prefix.size()){
+        size_t n = std::min((uint64_t)length,prefix.size()-offset);
+        memcpy(&prefix[offset],data,n);
+        offset += n;
+        data   += n;
+        length -= n;
+        if(length==0) return;
+    }
+    offset = offset - prefix.size() + headroom; // where it goes in the file
+    demux.write_file(fd,data,length,offset,myflow.root);
+}
+
+/*
+ * Add data to the flow's write buffer, flushing it if the data is not
+ * contiguous with it or it reached write_buffer_size. Segments at least
+ * as large as the buffer are written directly.
+ */
+void tcpip::buffered_write(uint64_t offset,const u_char *data,size_t length)
 {
-    if(seen){
-        (*seen) += boost::icl::discrete_interval<uint64_t>::closed(pos,pos+length-1);
+    if(staging){
+        if(offset == wbuf_offset+wbuf.size() && wbuf.size()+length <= tcpdemux::stage_bytes
+           && demux.write_buffer_bytes+length <= tcpdemux::write_buffer_max){
+            wbuf.append((const char *)data,length);
+            demux.write_buffer_bytes += length;
+            demux.roots[myflow.root].buffered += length;
+            mem_budget::charge(mem_budget::WRITE_BUFFERS,length);
+            return;
+        }
+        spill();                        // too big, not in order, or too much is staged
+        if(fd<0) return;
+    }
+    if(wbuf.size()>0 && offset != wbuf_offset+wbuf.size()) flush_buffer();
+    if(wbuf.size()==0 && length >= tcpdemux::write_buffer_size){
+        write_at(offset,data,length);
+        return;
+    }
+    if(wbuf.size()==0) wbuf_offset = offset;
+    wbuf.append((const char *)data,length);
+    demux.write_buffer_bytes += length;
+    demux.roots[myflow.root].buffered += length;
+    mem_budget::charge(mem_budget::WRITE_BUFFERS,length);
+    if(wbuf.size() >= tcpdemux::write_buffer_size){
+        flush_buffer();
+    } else if(demux.write_buffer_bytes > tcpdemux::write_buffer_max){
+        demux.flush_largest_buffers();
+    } else if(demux.roots.buffers_full(myflow.root,tcpdemux::write_buffer_max)){
+        demux.flush_largest_buffers(myflow.root);
+    }
+}
+
+void tcpip::flush_buffer()
+{
+    if(staging){
+        spill();
+        return;
+    }
+    if(wbuf.size()==0) return;
+    DEBUG(25) ("%s: flushing %d bytes @%" PRId64, flow_pathname.c_str(), (int)wbuf.size(), wbuf_offset);
+    write_at(wbuf_offset,(const u_char *)wbuf.data(),wbuf.size());
+    demux.write_buffer_bytes -= wbuf.size();
+    demux.roots[myflow.root].buffered -= wbuf.size();
+    mem_budget::release(mem_budget::WRITE_BUFFERS,wbuf.size());
+    std::string().swap(wbuf);           // give the memory back
+}
+
+/*
+ * A staging flow has all of its bytes in wbuf and no file; see store_packet().
+ * If the file cannot be made the bytes are dropped, as store_packet() drops
+ * a segment when a flow's file cannot be opened.
+ */
+void tcpip::spill()
+{
+    if(!staging) return;
+    staging = false;
+    if(open_file()){
+        DEBUG(1)("unable to open TCP file %s",flow_pathname.c_str());
+        demux.write_buffer_bytes -= wbuf.size();
+        demux.roots[myflow.root].buffered -= wbuf.size();
+        mem_budget::release(mem_budget::WRITE_BUFFERS,wbuf.size());
+        std::string().swap(wbuf);
+        return;
+    }
+    flush_buffer();
+}
+
+/* A small flow, written with one write; the scanners get contents instead of reading it back */
+void tcpip::finish_staging(std::string &contents)
+{
+    contents.assign(wbuf_offset,'\0');  // shift_stream() may have moved it up
+    contents.append(wbuf);
+    spill();
+    if(fd<0) contents.clear();
+}
+
+/* The compressed file only grows */
+void tcpip::write_compressed()
+{
+    if(compressed->error.size()){
+        DEBUG(1)("%s: zstd: %s",flow_pathname.c_str(),compressed->error.c_str());
+        compressed->error.clear();
+    }
+    if(compressed->out.size()==0) return;
+    demux.write_file(fd,compressed->out.data(),compressed->out.size(),compressed_size,myflow.root);
+    compressed_size += compressed->out.size();
+    compressed->out.clear();
+}
+
+/*
+ * Write the held segments that pos has reached, in order.
+ * Segments that are entirely behind pos were retransmitted and are dropped.
+ */
+void tcpip::release_segments()
+{
+    while(!reorder.empty() && reorder.begin()->first <= pos){
+        reorder_window_t::iterator si = reorder.begin();
+        const std::string &data = si->second.data;
+        if(si->first + data.size() > pos){
+            write_segment<tcp_policy_any>(si->first,(const u_char *)data.data(),data.size(),si->second.ts);
+        }
+        reorder_bytes -= data.size();
+        demux.reorder_held -= data.size();
+        mem_budget::release(mem_budget::REORDER,data.size());
+        reorder.erase(si);
+    }
+}
+
+/*
+ * Write every held segment where si belongs, gaps or not.
+ * Called when the flow is finished.
+ */
+void tcpip::flush_reorder()
+{
+    if(reorder.empty()) return;
+    if(fd<0 && !staging) open_file();
+    while(!reorder.empty()){
+        reorder_window_t::iterator si = reorder.begin();
+        const std::string &data = si->second.data;
+        DEBUG(25) ("%s: gap before %d held bytes @%" PRId64, flow_pathname.c_str(),
+                   (int)data.size(), si->first);
+        write_segment<tcp_policy_any>(si->first,(const u_char *)data.data(),data.size(),si->second.ts);
+        reorder_bytes -= data.size();
+        demux.reorder_held -= data.size();
+        mem_budget::release(mem_budget::REORDER,data.size());
+        reorder.erase(si);
+    }
+}
+
+/*
+ * Make room for insert_bytes at the start of the flow.
+ * As long as everything written so far is still in the write buffer,
+ * only wbuf_offset has to change; otherwise see prepend_file().
+ * The held segments and the seen set move with the data.
+ */
+void tcpip::shift_stream(uint32_t insert_bytes)
+{
+    if(http) http->give_up();           // what it parsed is not at the start any more
+    hash_broken = true;
+    if(last_byte>0){
+        if(wbuf_offset==0 && wbuf.size()==last_byte && prefix.empty()){
+            wbuf_offset += insert_bytes;
+        } else {
+            flush_buffer();
+            if(fd>=0) prepend_file(insert_bytes);
+        }
+        last_byte += insert_bytes;
     }
+    if(!reorder.empty()){
+        reorder_window_t shifted;
+        for(reorder_window_t::iterator si = reorder.begin(); si!=reorder.end(); si++){
+            shifted[si->first+insert_bytes].data.swap(si->second.data);
+            shifted[si->first+insert_bytes].ts = si->second.ts;
+        }
+        reorder.swap(shifted);
+    }
+    for(packet_index_t::iterator ri=packet_index.begin();ri!=packet_index.end();ri++){
+        ri->shift(insert_bytes);
+    }
+    seen.shift(insert_bytes);
 }
 
 /* store the contents of this packet to its place in its file
@@ -470,14 +716,22 @@ void update_seen(recon_set *seen,uint64_t pos,uint32_t length)
  * to insert.  A relative seek more than max_seek means that we have a
  * different flow that needs to be separately handled.
  *
+ * Data that arrives past a gap is held in the reorder window (up to
+ * reorder_window bytes per flow, and reorder_max for all of the demux's
+ * flows together) and written once the gap is filled,
+ * so that the common reordering case still produces sequential writes.
+ * When the window is full the data is written in place.
+ *
  * called from tcpdemux::process_tcp_packet()
  */
 void tcpip::store_packet(const u_char *data, uint32_t length, int32_t delta,struct timeval ts)
 {
     if(length==0) return;               // no need to do anything
+    metrics::count(metrics::STORE,length);
 
     uint32_t insert_bytes=0;
     uint64_t offset = pos+delta;	// where the data will go in absolute byte positions (first byte is pos=0)
+    tracer::event(trace_record::STORE,length,myflow.id,offset);
 
     if((int64_t)offset < 0){
 	/* We got bytes before the beginning of the TCP connection.
@@ -493,20 +747,16 @@ void tcpip::store_packet(const u_char *data, uint32_t length, int32_t delta,stru
 	offset = 0;			// and write the data here
     }
 
-    /* reduce length to write if it goes beyond the number of bytes per flow,
-     * but remember to seek out to the actual position after the truncated write...
-     */
-    uint32_t wlength = length;		// length to write
-    if (demux.opt.max_bytes_per_flow >= 0){
-        uint64_t max_bytes_per_flow = (uint64_t)demux.opt.max_bytes_per_flow;
-
-	if(offset >= max_bytes_per_flow){
-	    wlength = 0;
-	} 
-	if(offset < max_bytes_per_flow &&  offset+length > max_bytes_per_flow){
-	    DEBUG(2) ("packet truncated by max_bytes_per_flow on %s", flow_pathname.c_str());
-	    wlength = max_bytes_per_flow - offset;
-	}
+    /* The first bytes say whether it is TLS, before there is a file for it */
+    if(tls==0 && !bypass && pos==0 && last_byte==0 && (tls_stream::enabled || !transcript)){
+        bool tls_rule = policy && flow_policy::action(*this)==flow_policy::TLS_ONLY;
+        if(offset==0 && insert_bytes==0 && tls_stream::starts_handshake(data,length)){
+            if(tls_stream::enabled || tls_rule) start_tls();
+        } else if(tls_rule){
+            bypass = true;              // not TLS, so only counted
+            skip_packet(length,delta);
+            return;
+        }
     }
 
     /* if we don't have a file open for this flow, try to open it.
@@ -514,33 +764,34 @@ void tcpip::store_packet(const u_char *data, uint32_t length, int32_t delta,stru
      * save the return value because open_tcpfile() puts the file pointer
      * into the structure for us.
      */
-    if (fd < 0) {
-	if (open_file()) {
-	    DEBUG(1)("unable to open TCP file %s  fd=%d  wlength=%d",
-                     flow_pathname.c_str(),fd,(int)wlength);
+    if (fd < 0 && transcript && !staging) {
+        if (flow_pathname.size()==0 && tcpdemux::stage_bytes>0
+            && !demux.opt.output_segments && !demux.opt.output_zstd
+            && !json_stream::segments()) { // its segment events name the file
+            staging = true;             // the file is made when the flow outgrows stage_bytes, or finishes
+        } else if (open_file()) {
+	    DEBUG(1)("unable to open TCP file %s  fd=%d  length=%d",
+                     flow_pathname.c_str(),fd,(int)length);
 	    return;
 	}
     }
     
-    /* Shift the file now if we were going shift it */
+    /* Shift the stream now if we were going shift it */
 
     if(insert_bytes>0){
-	if(fd>=0) shift_file(fd,insert_bytes);
+	shift_stream(insert_bytes);
 	isn -= insert_bytes;		// it's really earlier
-	lseek(fd,(off_t)0,SEEK_SET);	// put at the beginning
-	pos = 0;
-	nsn = isn+1;
+	pos += insert_bytes;            // the data we had moved up
 	out_of_order_count++;
-	DEBUG(25)("%s: insert(0,%d); lseek(%d,0,SEEK_SET) out_of_order_count=%" PRId64,
-		  flow_pathname.c_str(), insert_bytes,
-		  fd,out_of_order_count);
+	DEBUG(25)("%s: insert(0,%d) out_of_order_count=%" PRId64,
+		  flow_pathname.c_str(), insert_bytes, out_of_order_count);
+    }
 
-        /* TK: If we have seen packets, everything in the recon set needs to be shifted as well.*/
-        delete seen;
-        seen = 0;
+    if(http_stream::active && http==0 && offset==0 && pos==0 && last_byte==0
+       && http_stream::starts_response(data,length)){
+        start_http();
     }
 
-    /* if we're not at the correct point in the file, seek there */
     if (offset != pos) {
         /* Check for a keepalive */
         if(delta == -1 && length == 1) {
@@ -548,56 +799,29 @@ void tcpip::store_packet(const u_char *data, uint32_t length, int32_t delta,stru
             return;
         }
 
-	if(fd>=0) lseek(fd,(off_t)delta,SEEK_CUR);
 	if(delta<0) out_of_order_count++; // only increment for backwards seeks
-	DEBUG(25)("%s: lseek(%d,%d,SEEK_CUR) offset=%" PRId64 " pos=%" PRId64 " out_of_order_count=%" PRId64,
-		  flow_pathname.c_str(), fd,(int)delta,offset,pos,out_of_order_count);
-	pos += delta;			// where we are now
-	nsn += delta;			// what we expect the nsn to be now
-    }
-    
-    /* write the data into the file */
-    DEBUG(25) ("%s: %s write %ld bytes @%" PRId64,
-               flow_pathname.c_str(),
-               fd>=0 ? "will" : "won't",
-               (long) wlength, offset);
-    
-    if(fd>=0){
-      if ((uint32_t)write(fd,data, wlength) != wlength) {
-	    DEBUG(1) ("write to %s failed: ", flow_pathname.c_str());
-	    if (debug >= 1) perror("");
-	}
-	// Write to the index file if needed.  Note, index file is sorted before close, so no need to jump around --GDD
-		if (demux.opt.output_packet_index && idx_file.is_open()) {
-			idx_file << offset << "|" << ts.tv_sec << "." << std::setw(6) << std::setfill('0') << ts.tv_usec << "|"
-					<< wlength << "\n";
-			if (idx_file.bad()){
-				DEBUG(1)("write to index file %s failed: ",flow_index_pathname.c_str());
-				if(debug >= 1){
-					perror("");
-				}
-			}
-		}
-	if(wlength != length){
-	    off_t p = lseek(fd,length-wlength,SEEK_CUR); // seek out the space we didn't write
-            DEBUG(100)("   lseek(%" PRId64 ",SEEK_CUR)=%" PRId64,(int64_t)(length-wlength),(int64_t)p);
-	}
+        tracer::event(trace_record::OUT_OF_ORDER,length,myflow.id,offset);
+	DEBUG(25)("%s: out of order (%d) offset=%" PRId64 " pos=%" PRId64 " out_of_order_count=%" PRId64,
+		  flow_pathname.c_str(), (int)delta,offset,pos,out_of_order_count);
+
+        /* Past a gap: hold it until the gap is filled, if there is room in the flow's window and in the demux's */
+        if(offset > pos && reorder_bytes + length <= tcpdemux::reorder_window
+           && demux.reorder_held + length <= tcpdemux::reorder_max){
+            reorder_segment &seg = reorder[offset];
+            if(seg.data.size() < length){
+                reorder_bytes += length - seg.data.size();
+                demux.reorder_held += length - seg.data.size();
+                mem_budget::charge(mem_budget::REORDER,length - seg.data.size());
+                seg.data.assign((const char *)data,length);
+                seg.ts = ts;
+            }
+            return;
+        }
     }
 
-    /* Update the database of bytes that we've seen */
-    if(seen) update_seen(seen,pos,length);
-
-    /* Update the position in the file and the next expected sequence number */
-    pos += length;
-    nsn += length;			// expected next sequence number
-
-    if(pos>last_byte) last_byte = pos;
-
-    if(debug>=100){
-        uint64_t rpos = lseek(fd,(off_t)0,SEEK_CUR);
-        DEBUG(100)("    pos=%" PRId64 "  lseek(fd,0,SEEK_CUR)=%" PRId64,pos,rpos);
-        assert(pos==rpos);
-    }
+    write_segment<tcp_policy_any>(offset,data,length,ts);
+    release_segments();                 // the gap before them may be filled now
+    if(tls && !transcript && tls->finished()) end_tls();
 
 #ifdef DEBUG_REOPEN_LOGIC
     /* For debugging, force this connection closed */
@@ -606,62 +830,141 @@ void tcpip::store_packet(const u_char *data, uint32_t length, int32_t delta,stru
 }
 
 /*
- * Compare two index strings and return the result.  Called by
- * the vector::sort in sort_index.
- * --GDD
+ * Parse the flow as it is stored. The bodies are named after the flow as
+ * post_process() names it to the scanners.
+ * With http_bodies_only the file that was just made stays empty, so that
+ * no other flow takes its name, and post_process() removes it.
  */
-bool tcpip::compare(std::string a, std::string b){
-	std::stringstream ss_a(a),ss_b(b);
-	long a_l,b_l;
+void tcpip::start_http()
+{
+    spill();                            // the bodies are named after the file
+    std::string name = flow_pathname;
+    if(compressed) name = name.substr(0,name.size()-4); // without .zst
+    http = new http_stream(name);
+    mem_budget::charge(mem_budget::HTTP,sizeof(*http));
+    if(http_stream::bodies_only){
+        close_file();
+        transcript = false;
+    }
+}
 
-	ss_a >> a_l;
-	ss_b >> b_l;
-	return a_l < b_l;
+/*
+ * Parse the hello at the start of the flow. With -S tls_meta_only (or the
+ * flow's tls rule, which has already done it) there is no transcript.
+ */
+void tcpip::start_tls()
+{
+    tls = new tls_stream();
+    mem_budget::charge(mem_budget::TLS,sizeof(*tls));
+    if(tls_stream::meta_only) transcript = false;
 }
 
 /*
- * Sort an index file (presumably from this object) if file indexing is
- * turned on and the file exists.  Index files may be out of order due
- * to the arrival of out of order packets.  It is cheaper to reorder them
- * one time at the end of processing than it is to continually keep them
- * in order.
- * --GDD
+ * From here on the flow's packets are only counted, as a bypass flow's
+ * are; so are those held past a gap, which the parser did not need.
  */
-void tcpip::sort_index(std::fstream *ix_file) {
-
-	std::vector<std::string> idx;
-	std::string line;
-
-	if (demux.opt.output_packet_index) {
-		if (!(idx_file.good() && idx_file.is_open())) {
-			DEBUG(5)("Skipping index file sort.  Unusual behavior.\n");
-			return; //Nothing to do
-		}
-		//Make sure we are at the beginning.
-		ix_file->clear();
-		ix_file->seekg(0);
-		do {
-			*ix_file >> line;
-			if (!ix_file->eof()) {
-				idx.push_back(line);
-			}
-		} while (ix_file->good());
-		std::sort(idx.begin(), idx.end(), &tcpip::compare);
-		ix_file->clear();
-		ix_file->seekg(0);
-		for (std::vector<std::string>::iterator s = idx.begin(); s != idx.end();
-				s++) {
-			*ix_file << *s << "\n";
-		}
-	}
+void tcpip::end_tls()
+{
+    bypass = true;
+    while(!reorder.empty()){
+        reorder_window_t::iterator si = reorder.begin();
+        size_t length = si->second.data.size();
+        skip_packet(length,(int32_t)(si->first - pos));
+        reorder_bytes -= length;
+        demux.reorder_held -= length;
+        mem_budget::release(mem_budget::REORDER,length);
+        reorder.erase(si);
+    }
 }
 
 /*
- * Convenience function to cause the local index file to be sorted.
- * --GDD
+ * Hash the flow as it is written, so that scan_md5 does not have to read
+ * it back. The file reads as zeros where a gap has not been filled, and
+ * so does the hash; filling it, or anything else written behind
+ * hash_next, means the file has to be hashed after all.
  */
-void tcpip::sort_index(){
-	tcpip::sort_index(&(this->idx_file));
+void tcpip::hash_segment(uint64_t offset,const u_char *data,size_t length)
+{
+    static const uint8_t zeros[4096] = {0};
+    if(hash_broken || length==0) return;
+    if(offset < hash_next){
+        DEBUG(10)("%s: written behind the hash; it is computed from the file",flow_pathname.c_str());
+        hash_broken = true;
+        return;
+    }
+    if(hasher==0) hasher = new flow_hash::context(flow_hash::algs);
+    while(hash_next < offset){
+        size_t n = std::min(offset-hash_next,(uint64_t)sizeof(zeros));
+        hasher->update(zeros,n);
+        hash_next += n;
+    }
+    hasher->update(data,length);
+    hash_next += length;
+}
+
+bool tcpip::stream_digests(flow_hash::digests_t &d)
+{
+    if(hasher==0 || hash_broken || hash_next!=last_byte) return false;
+    hasher->final(d);
+    return true;
+}
+
+/*
+ * Sort the packet index by offset. Packets mostly arrive in order, so
+ * the index is nearly sorted and an insertion sort is close to linear;
+ * if it turns out not to be, std::stable_sort takes over.
+ */
+/* static */ void tcpip::sort_index(packet_index_t &idx)
+{
+    size_t moves = 0;
+    const size_t max_moves = 4*idx.size() + 64;
+    for(size_t i=1;i<idx.size();i++){
+        if(!(idx[i] < idx[i-1])) continue;
+        packet_index_record r = idx[i];
+        size_t j = i;
+        while(j>0 && r < idx[j-1] && moves < max_moves){
+            idx[j] = idx[j-1];
+            j--;
+            moves++;
+        }
+        idx[j] = r;
+        if(moves >= max_moves){
+            std::stable_sort(idx.begin(),idx.end());
+            return;
+        }
+    }
+}
+
+/*
+ * Write the packet index, sorted, next to the transcript; see packet_index.h
+ * A flow that was reopened after it was saved appends to the index it had.
+ */
+void tcpip::write_index()
+{
+    if(packet_index.empty()) return;
+    sort_index(packet_index);
+    flow_index_pathname = flow_pathname + (tcpdemux::packet_index_text ? ".findx" : ".findb");
+    DEBUG(10)("writing index file: %s",flow_index_pathname.c_str());
+    int ifd = demux.retrying_open(flow_index_pathname,O_WRONLY|O_CREAT|O_BINARY|(file_created ? O_TRUNC : O_APPEND),0666);
+    FILE *f = ifd>=0 ? fdopen(ifd,"wb") : 0;
+    if(f==0){
+        perror(flow_index_pathname.c_str());
+        if(ifd>=0) close(ifd);
+        packet_index_t().swap(packet_index);
+        return;
+    }
+    for(packet_index_t::const_iterator ri=packet_index.begin();ri!=packet_index.end();ri++){
+        if(tcpdemux::packet_index_text){
+            ri->print(f);
+        } else {
+            uint8_t buf[packet_index_record::SIZE];
+            ri->encode(buf);
+            fwrite(buf,sizeof(buf),1,f);
+        }
+    }
+    if(ferror(f)) DEBUG(1)("write to index file %s failed",flow_index_pathname.c_str());
+    fclose(f);
+    packet_index_t().swap(packet_index);  // give the memory back
 }
 
 #pragma GCC diagnostic ignored "-Weffc++"
@@ -2,6 +2,8 @@
 #define TCPIP_H
 
 #include <fstream>
+#include <map>
+#include <vector>
 
 #include "inet_ntop.h"
 
@@ -43,7 +45,7 @@ public:;
         return (addr[i / 8]) & (1<<(7-i%8));
     }
     uint32_t quad(int i) const {        // gets the ith quad as a 32-bit value
-        return (addr[i*4+0]<<24) | (addr[i*4+2]<<16) | (addr[i*4+1]<<8) |  (addr[i*4+3]<<0);
+        return (addr[i*4+0]<<24) | (addr[i*4+1]<<16) | (addr[i*4+2]<<8) |  (addr[i*4+3]<<0);
     }
     uint64_t dquad(int i) const {       // gets the first 64-bit half or the second 64-bit half
         return (uint64_t)(quad(i*2+1))<<32 | (uint64_t)(quad(i*2));
@@ -80,9 +82,95 @@ inline bool operator <(const struct timeval &a,const struct timeval &b) {
     return (a.tv_sec<b.tv_sec) || ((a.tv_sec==b.tv_sec) && (a.tv_sec<b.tv_sec));
 }
 
+/* Mix the bits of a 64-bit value (the splitmix64 finalizer) */
+inline uint64_t hash_mix64(uint64_t x) {
+    x ^= x >> 30; x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27; x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+}
+
+inline uint32_t load32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v,p,sizeof(v));
+    return v;
+}
+
+inline uint64_t load64(const uint8_t *p) {
+    uint64_t v;
+    memcpy(&v,p,sizeof(v));
+    return v;
+}
+
+/*
+ * Find the upper-layer header of an IPv6 packet by walking its extension
+ * headers (hop-by-hop, routing, destination options, authentication and
+ * fragment), at most MAX_EXTENSIONS of them.
+ *
+ * A fragment header with an offset or the M flag set stops the walk,
+ * since what follows it is only part of a datagram; proto is then the
+ * fragment header's next header and fragment is where the fragment header
+ * is. An atomic fragment (RFC 6946) is walked through like any other
+ * extension header.
+ */
+class ip6_headers {
+public:
+    enum { FIXED_LEN = 40, MAX_EXTENSIONS = 8 };
+    ip6_headers():proto(0),offset(0),fragment(0){}
+    uint8_t proto;                      // the upper-layer protocol
+    size_t  offset;                     // where its header starts
+    size_t  fragment;                   // offset of the fragment header that stopped the walk, or 0
+
+    /* Returns false if the headers run past len or there are too many of them */
+    bool walk(const uint8_t *ip,size_t len) {
+        if(len < FIXED_LEN) return false;
+        proto  = ip[6];
+        offset = FIXED_LEN;
+        fragment = 0;
+        if(proto==IPPROTO_TCP) return true; // the usual case: no extension headers
+        for(unsigned i=0;i<MAX_EXTENSIONS;i++){
+            size_t hlen = 0;
+            switch(proto){
+            case 0:                     // hop-by-hop options
+            case 43:                    // routing
+            case 60:                    // destination options
+                if(len < offset+2) return false;
+                hlen = (ip[offset+1]+1) * 8;
+                break;
+            case 51:                    // authentication
+                if(len < offset+2) return false;
+                hlen = (ip[offset+1]+2) * 4;
+                break;
+            case 44:                    // fragment
+                if(len < offset+8) return false;
+                if(((ip[offset+2]<<8) | ip[offset+3]) & 0xfff9){
+                    fragment = offset;
+                    proto    = ip[offset];
+                    offset  += 8;
+                    return true;
+                }
+                hlen = 8;
+                break;
+            default:
+                return true;            // an upper-layer header (or 59, no next header)
+            }
+            if(len < offset+hlen) return false;
+            proto   = ip[offset];
+            offset += hlen;
+        }
+        return false;
+    }
+};
+
 /*
  * describes the TCP flow.
  * No timing information; this is used as a map index.
+ *
+ * This is a plain, trivially-copyable key with no padding (38 bytes), so it
+ * can be compared with memcmp() and a flow_table slot fits in a cache line.
+ * IPv4 addresses leave bytes 4..15 of each ipaddr zero, so only 12 bytes
+ * (the two addresses and the ports) differ between IPv4 keys and only
+ * those are hashed.
  */
 class flow_addr {
 public:
@@ -90,35 +178,28 @@ public:
     flow_addr(const ipaddr &s,const ipaddr &d,uint16_t sp,uint16_t dp,sa_family_t f):
 	src(s),dst(d),sport(sp),dport(dp),family(f){
     }
-    flow_addr(const flow_addr &f):src(f.src),dst(f.dst),sport(f.sport),dport(f.dport),
-				  family(f.family){
-    }
-    virtual ~flow_addr(){};
     ipaddr	src;		// Source IP address; holds v4 or v6 
     ipaddr	dst;		// Destination IP address; holds v4 or v6 
     uint16_t    sport;		// Source port number 
     uint16_t    dport;		// Destination port number 
-    sa_family_t family;		// AF_INET or AF_INET6 */
+    uint16_t    family;		// AF_INET or AF_INET6; not sa_family_t, which is one byte on BSD and would leave padding
 
+    /* The source is hashed before the destination, so A->B and B->A
+     * hash differently; every byte of an IPv6 address is used.
+     */
     uint64_t hash() const {
-	if(family==AF_INET){
-	    return ((uint64_t)(src.quad(0))<<32 | dst.quad(0))
-                ^ ((uint64_t)(dst.quad(0))<<32 | src.quad(0))
-                ^ (sport<<16 | dport);
-	} else {
-	    return (src.dquad(0)<<32 ^ dst.dquad(0))
-                ^ (dst.dquad(0)<<32  ^ src.dquad(0))
-                ^ (src.dquad(1)      ^ dst.dquad(1))
-                ^ (sport<<16 | dport);
-	}
+        uint64_t h = (uint64_t)family<<32 | (uint64_t)sport<<16 | dport;
+        if(family==AF_INET){
+            return hash_mix64(h ^ hash_mix64((uint64_t)load32(src.addr)<<32 | load32(dst.addr)));
+        }
+        h = hash_mix64(h ^ load64(src.addr));
+        h = hash_mix64(h ^ load64(src.addr+8));
+        h = hash_mix64(h ^ load64(dst.addr));
+        return hash_mix64(h ^ load64(dst.addr+8));
     }
 
     inline bool operator ==(const flow_addr &b) const {
-	return this->src==b.src &&
-	    this->dst==b.dst &&
-	    this->sport==b.sport &&
-	    this->dport==b.dport &&
-	    this->family==b.family;
+	return memcmp(this,&b,sizeof(flow_addr))==0;
     }
 
     inline bool operator <(const flow_addr &b) const {
@@ -142,6 +223,9 @@ public:
     }
 };
 
+/* operator== compares the bytes, so there must be none that are not set */
+static_assert(sizeof(flow_addr)==2*sizeof(ipaddr)+3*sizeof(uint16_t),"flow_addr must have no padding");
+
 inline std::ostream & operator <<(std::ostream &os,const flow_addr &f)  {
     os << f.str();
     return os;
@@ -157,8 +241,9 @@ class flow : public flow_addr {
 public:;
     static void usage();			// print information on flow notation
     static std::string filename_template;	// 
-    static std::string outdir;                  // where the output gets written
-    flow():id(),vlan(),mac_daddr(),mac_saddr(),tstart(),tlast(),len(),caplen(),packet_count(),session_id(){};
+    static void compile_template();             // parse filename_template for filename(); exits if it is invalid
+    static void precreate_dirs(uint64_t flows); // make the %K/%M/%G directories for flow ids 0..flows-1
+    flow():id(),vlan(),mac_daddr(),mac_saddr(),tstart(),tlast(),len(),caplen(),packet_count(),session_id(),root(){};
     flow(const flow_addr &flow_addr_,uint64_t id_,const be13::packet_info &pi):
 	flow_addr(flow_addr_),id(id_),vlan(pi.vlan()),
         mac_daddr(),
@@ -167,7 +252,8 @@ public:;
         len(0),
         caplen(0),
 	packet_count(0),
-        session_id(0) {
+        session_id(0),
+        root(0) {
         if(pi.pcap_hdr){
             memcpy(mac_daddr,pi.get_ether_dhost(),sizeof(mac_daddr));
             memcpy(mac_saddr,pi.get_ether_shost(),sizeof(mac_saddr));
@@ -184,20 +270,33 @@ public:;
     uint64_t caplen;    		// captured length
     uint64_t packet_count;		// packet count
     uint64_t session_id;      // session unique id (used to match client->server and server->client flows
+    uint16_t root;                      // the output root its files go in; see output_roots.h
 
     // return a filename for a flow based on the template and the connection count
     std::string filename(uint32_t connection_count, bool);
     // return a new filename for a flow based on the temlate,
     // optionally opening the file and returning a fd if &fd is provided
-    std::string new_filename(int *fd,int flags,int mode);	
+    std::string new_filename(int *fd,int flags,int mode,const char *suffix="");	
 
     std::string new_pcap_filename();
 
-    bool has_mac_daddr(){
+private:
+    /* filename_template, parsed once: a literal run (directive 0) or a % directive */
+    struct template_op {
+        template_op(char directive_,const std::string &text_):directive(directive_),text(text_){}
+        char        directive;
+        std::string text;
+    };
+    static std::vector<template_op> template_ops;
+    static std::string compiled_template;       // what template_ops was compiled from
+    void append_directive(std::string &out,char directive,uint32_t connection_count) const;
+public:
+
+    bool has_mac_daddr() const {
         return mac_daddr[0] || mac_daddr[1] || mac_daddr[2] || mac_daddr[3] || mac_daddr[4] || mac_daddr[5];
     }
 
-    bool has_mac_saddr(){
+    bool has_mac_saddr() const {
         return mac_saddr[0] || mac_saddr[1] || mac_saddr[2] || mac_saddr[3] || mac_saddr[4] || mac_saddr[5];
     }
 };
@@ -257,20 +356,48 @@ public:
 #pragma GCC diagnostic ignored "-Wall"
 #pragma GCC diagnostic ignored "-Wmissing-noreturn"
 
-#if defined(HAVE_BOOST_ICL_INTERVAL_HPP) && defined(HAVE_BOOST_ICL_INTERVAL_MAP_HPP) && defined(HAVE_BOOST_ICL_INTERVAL_SET_HPP)
-#include <boost/icl/interval.hpp>
-#include <boost/icl/interval_map.hpp>
-#include <boost/icl/interval_set.hpp>
-typedef boost::icl::interval_set<uint64_t> recon_set; // Boost interval set of bytes that were reconstructed.
-#endif
-
+#include "recon_set.h"
 #include "intrusive_list.h"
+#include "timer_wheel.h"
+#include "segment_reader.h"
+#include "packet_index.h"
+#include "pcap_writer.h"
+#include "flow_hash.h"
 
 #pragma GCC diagnostic warning "-Weffc++"
 #pragma GCC diagnostic warning "-Wshadow"
 #pragma GCC diagnostic warning "-Wall"
 #pragma GCC diagnostic warning "-Wmissing-noreturn"
 
+/*
+ * A segment that arrived ahead of a gap in its flow. It is held in the
+ * flow's reorder window until the gap is filled.
+ */
+struct reorder_segment {
+    reorder_segment():data(),ts() {}
+    std::string    data;
+    struct timeval ts;
+};
+typedef std::map<uint64_t,reorder_segment> reorder_window_t; // by offset in the flow
+
+/*
+ * What the DFXML <fileobject> of a finished flow says. It is copied out
+ * of the tcpip so that the report can be written after the tcpip is gone,
+ * when the flow is scanned on a scan_pool thread.
+ */
+struct flow_report {
+    explicit flow_report(const class tcpip &tcp);
+    flow_report():myflow(),flow_pathname(),last_byte(0),out_of_order_count(0),violations(0),digests(){}
+    flow        myflow;
+    std::string flow_pathname;
+    uint64_t    last_byte;
+    uint64_t    out_of_order_count;
+    uint64_t    violations;
+    flow_hash::digests_t digests;       // if tcpip::hasher hashed the whole flow
+    void dump_xml(class dfxml_writer *xmlreport,const std::string &xmladd,bool flush=true) const;
+    void dump_json(std::string &out,const std::string &xmladd) const; // one line, for -S report_format=jsonl
+};
+
 class tcpip {
 public:
     /** track the direction of the flow; this is largely unused */
@@ -306,35 +433,120 @@ public:;
 
     /* Archiving information */
     std::string flow_pathname;		// path where flow is saved
-    int		fd;			// file descriptor for file storing this flow's data 
+    int		fd;			// file descriptor for file storing this flow's data; with --segments, the segment's, which the flow does not own
     bool	file_created;		// true if file was created
+    std::string wbuf;                   // contiguous data not yet written; only while fd is open, or staging
+    bool        staging;                // -S stage_bytes: the flow has no file yet, and all of it is in wbuf
+    uint64_t    wbuf_offset;            // where wbuf goes in the file
+    reorder_window_t reorder;           // segments past pos, waiting for the gap before them
+    uint64_t    reorder_bytes;          // bytes held in reorder
+    std::string prefix;                 // the start of the flow, when it was prepended and not yet written to the file
+    uint64_t    headroom;               // unused bytes at the start of the file, left by FALLOC_FL_INSERT_RANGE
+    segment_extents extents;            // with --segments, where the flow's data went; indexed when it is finished
+    class zstd_transcript *compressed;  // with -S compress=zstd, what turns the flow into the file
+    uint64_t    compressed_size;        // bytes of the compressed file written so far
+    class http_stream *http;            // with -S http_stream, the HTTP parser the flow is fed to
+    class tls_stream *tls;              // with -S tls_meta, or a tls rule of -S flow_policy, the TLS hello parser
+    bool        transcript;             // false with -S http_bodies_only once http has started: nothing is written
+    int64_t     max_bytes;              // -b, or less if the flow was created while shedding load; -1 for no limit
+    uint8_t     shed_level;             // the load_shed level that cost the flow something; 0 for none
+    uint16_t    policy;                 // 1 + the -S flow_policy rule of its connection; 0 for none
+    bool        bypass;                 // its rule is metadata or drop: the packets are only counted
+    flow_hash::context *hasher;         // with -e md5 and -S stream_hash, the flow hashed as it is written
+    uint64_t    hash_next;              // offset of the next byte hasher takes
+    bool        hash_broken;            // bytes were written behind hash_next, so the file has to be hashed again
+    static bool stream_hash;            // -S stream_hash; cleared by tcpflow.cpp without the md5 scanner
+    std::string json_prefix;            // -S json_stream: the flow's name and addresses, made once; see json_stream.h
+    bool        json_prefix_named;      // json_prefix has the name the flow's file was given
 
     /* Flow Index information - only used if flow packet/data indexing is requested --GDD */
     std::string flow_index_pathname;	// Path for the flow index file
-    std::fstream		idx_file;				// File descriptor for storing the flow index data
+    packet_index_t  packet_index;       // where each packet went; written by write_index()
 
     /* Stats */
-    recon_set   *seen;                  // what we've seen; it must be * due to boost lossage
+    recon_set   seen;                   // what we've seen
     uint64_t    last_byte;              // last byte in flow processed
     uint64_t	last_packet_number;	// for finding most recent packet written
     uint64_t	out_of_order_count;	// all packets were contigious
     uint64_t    violations;		// protocol violation count
 
     /* File Acess Order */
-    intrusive_list<tcpip>::iterator it;
+    intrusive_list_hook<tcpip> it;
+
+    /* Timeout (tcp_timeout) */
+    timer_wheel<tcpip>::iterator timer_it;
+    size_t      timer_slot;
+    time_t      timer_when;
+
+    /* The connection this is one direction of */
+    class tcp_session *session;
 
     /* Methods */
     void close_file();			// close fd
     int  open_file();                   // opens save file; return -1 if failure, 0 if success
     void print_packet(const u_char *data, uint32_t length);
     void store_packet(const u_char *data, uint32_t length, int32_t delta,struct timeval ts);
+    template<class policy>              // the in-order case, inline; see tcp_policy.h
+    void store_packet(const u_char *data, uint32_t length, int32_t delta,struct timeval ts);
+    inline void skip_packet(uint32_t length,int32_t delta); // a bypass flow's data, only counted; tcp_policy.h
+    void write_at(uint64_t offset,const u_char *data,size_t length); // write to the file at offset
+    void buffered_write(uint64_t offset,const u_char *data,size_t length);
+    void flush_buffer();                // write out wbuf
+    void spill();                       // give a staging flow its file, and write wbuf to it
+    void finish_staging(std::string &contents); // the same, once the flow is finished; contents gets the flow
+    void write_compressed();            // write what compressed made for the file
+    template<class policy>              // in tcp_policy.h
+    void write_segment(uint64_t offset,const u_char *data,uint32_t length,const struct timeval &ts);
+    void release_segments();            // write held segments that no longer follow a gap
+    void flush_reorder();               // write all held segments where they belong
+    void shift_stream(uint32_t insert_bytes);
+    void prepend_file(uint32_t insert_bytes); // make room at the start of the file
+    void merge_prefix();                // write prefix and remove headroom, so that the file is in its final form
     void process_packet(const struct timeval &ts,const int32_t delta,const u_char *data,const uint32_t length);
-    uint32_t seen_bytes();
+    void start_http();                  // the flow is an HTTP response; see http_stream.h
+    void start_tls();                   // the flow starts with a TLS handshake; see tls_stream.h
+    void end_tls();                     // tls has its hello, and nothing else of the flow is kept
+    void hash_segment(uint64_t offset,const u_char *data,size_t length); // for hasher, in order
+    bool stream_digests(flow_hash::digests_t &d); // false if hasher did not take exactly the flow
+    uint32_t seen_bytes() const { return seen.size(); }
+    static int64_t recon_bytes(size_t intervals); // what seen holds beyond itself, for mem_budget
     void dump_seen();
     void dump_xml(class dfxml_writer *xmlreport,const std::string &xmladd);
-    static bool compare(std::string a, std::string b);
-    void sort_index(std::fstream *idx_file);
-    void sort_index();
+    static void sort_index(packet_index_t &idx);
+    void write_index();                 // with -I, once the flow is finished
+};
+
+/*
+ * Both directions of a TCP connection.
+ *
+ * The flow_map is indexed by the session's canonical flow_addr, so a
+ * single lookup finds either direction, and the two tcpip objects are
+ * constructed in the session's own storage, next to each other.
+ * half[0] carries data from key.src to key.dst; half[1] the other way.
+ * A half is 0 until its first packet is seen and again after it has
+ * been post-processed; the session goes when both halves are gone.
+ */
+class tcp_session {
+    tcp_session(const tcp_session &);
+    tcp_session &operator=(const tcp_session &);
+public:
+    explicit tcp_session(const flow_addr &key_):key(key_){ half[0] = half[1] = 0; }
+    flow_addr key;
+    tcpip     *half[2];
+    alignas(tcpip) unsigned char storage[2][sizeof(tcpip)];
+
+    bool empty() const { return half[0]==0 && half[1]==0; }
+
+    /* Which half f is: 0 if its source is the lower endpoint */
+    static int direction(const flow_addr &f) {
+        int c = memcmp(f.src.addr,f.dst.addr,sizeof(f.src.addr));
+        return (c>0 || (c==0 && f.sport>f.dport)) ? 1 : 0;
+    }
+    /* f with the lower endpoint as the source */
+    static flow_addr canonical(const flow_addr &f) {
+        if(direction(f)==0) return f;
+        return flow_addr(f.dst,f.src,f.dport,f.sport,f.family);
+    }
 };
 
 /* print a tcpip data structure. Largely for debugging */
@@ -345,7 +557,6 @@ inline std::ostream & operator <<(std::ostream &os,const tcpip &f) {
        << " pos:" << f.pos << " fd: " << f.fd << " cr:" << f.file_created 
        << " lb:" << f.last_byte << " lpn:" << f.last_packet_number << " ooc:" << f.out_of_order_count
        << "]";
-    if(f.fd>0) os << " ftell(" << f.fd << ")=" << lseek(f.fd,0L,SEEK_CUR);
     return os;
 }
 
@@ -360,23 +571,29 @@ class saved_flow  {
 public:
     saved_flow(tcpip *tcp):addr(tcp->myflow),
                            saved_filename(tcp->flow_pathname),
-                           isn(tcp->isn) {}
+                           isn(tcp->isn),tail_offset(0),tail() {}
+    saved_flow(const flow_addr &addr_,const std::string &filename,be13::tcp_seq isn_):
+                           addr(addr_),saved_filename(filename),isn(isn_),tail_offset(0),tail() {}
                            
     flow_addr         addr;                  // flow address
     std::string       saved_filename;        // where the flow was saved
     be13::tcp_seq     isn;                    // the flow's ISN
+    uint64_t          tail_offset;           // where tail starts in the file
+    std::string       tail;                  // the last bytes of the file, if they could be kept
+    int64_t bytes() const { return sizeof(*this)+saved_filename.capacity()+tail.capacity(); } // for mem_budget
     virtual ~saved_flow(){};
 };
 
 class sparse_saved_flow  {
 public:
-    sparse_saved_flow (const flow_addr &idx, FILE *_fcap):addr(idx),fcap(_fcap) {}
+    sparse_saved_flow (const flow_addr &idx, pcap_writer *_pcap):addr(idx),pcap(_pcap),it() {}
 
     flow_addr         addr;                  // flow address
-    FILE              *fcap;                // output pcap file
+    pcap_writer       *pcap;                 // output pcap file; closed when not among the recently used
+    intrusive_list_hook<sparse_saved_flow> it; // in tcpdemux::open_pcaps while pcap is open
     virtual ~sparse_saved_flow()
     {
-        if(fcap) fclose(fcap);
+        delete pcap;
     }
     /* these are not implemented */
 private:
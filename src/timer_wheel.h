@@ -0,0 +1,98 @@
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <list>
+#include <vector>
+#include <ctime>
+
+// A hashed timing wheel with one slot per second.
+//
+// Nodes are scheduled to expire at an absolute time (in seconds). Scheduling,
+// rescheduling and cancelling are O(1); expire() only looks at the slots that
+// the clock passed over. Deadlines further away than the wheel size stay in
+// their slot until the clock comes around again.
+//
+// Like intrusive_list, T must provide:
+//   typename timer_wheel<T>::iterator timer_it;
+//   size_t timer_slot;   // initialize to timer_wheel<T>::NOT_SCHEDULED
+//   time_t timer_when;
+
+template <class T>
+class timer_wheel {
+  public:
+  typedef typename std::list<T*>::iterator iterator;
+  enum { NUM_SLOTS = 4096 };             // must be a power of 2
+  static const size_t NOT_SCHEDULED = (size_t)-1;
+
+  timer_wheel():slots(NUM_SLOTS), current(0), started(false), len(0) {}
+
+  /* schedule node to expire at when, rescheduling it if it is already scheduled */
+  inline void schedule(T* node, time_t when) {
+    if (!started) {
+      current = when - 1;
+      started = true;
+    }
+    /* already due: put it in the next slot the clock will reach */
+    size_t slot = (when > current) ? slot_for(when) : slot_for(current + 1);
+    node->timer_when = when;
+    if (node->timer_slot == NOT_SCHEDULED) {
+      slots[slot].push_back(node);
+      node->timer_it = --slots[slot].end();
+      len++;
+    } else if (node->timer_slot != slot) {
+      slots[slot].splice(slots[slot].end(), slots[node->timer_slot], node->timer_it);
+    }
+    node->timer_slot = slot;
+  }
+
+  inline void cancel(T* node) {
+    if (node->timer_slot == NOT_SCHEDULED)
+      return;
+    slots[node->timer_slot].erase(node->timer_it);
+    node->timer_slot = NOT_SCHEDULED;
+    len--;
+  }
+
+  /* advance the clock to now, removing every node due at or before now and appending it to expired */
+  void expire(time_t now, std::vector<T*> &expired) {
+    if (!started || now <= current)
+      return;
+    time_t ticks = now - current;
+    if (ticks > NUM_SLOTS) ticks = NUM_SLOTS;  // every slot gets looked at once
+    for (time_t t = current + 1; t <= current + ticks; t++) {
+      std::list<T*> &li = slots[slot_for(t)];
+      for (iterator it = li.begin(); it != li.end(); ) {
+        T* node = *it;
+        if (node->timer_when <= now) {
+          it = li.erase(it);
+          node->timer_slot = NOT_SCHEDULED;
+          len--;
+          expired.push_back(node);
+        } else {
+          ++it;
+        }
+      }
+    }
+    current = now;
+  }
+
+  inline bool empty() const {
+    return len == 0;
+  }
+
+  inline size_t size() const {
+    return len;
+  }
+
+  private:
+  inline size_t slot_for(time_t when) const {
+    return (size_t)when & (NUM_SLOTS - 1);
+  }
+
+  std::vector<std::list<T*> > slots;
+  time_t current;                        // the clock; everything due at or before it has been expired
+  bool started;
+  size_t len;
+};
+
+#endif // TIMER_WHEEL_H
@@ -0,0 +1,354 @@
+/**
+ *
+ * tls_stream.cpp
+ * The metadata of a TLS handshake, as the flow is stored. See tls_stream.h
+ *
+ * This source code is under the GNU Public License (GPL).  See
+ * LICENSE for details.
+ *
+ */
+
+#include "tcpflow.h"
+#include "flow_hash.h"
+#include "tls_stream.h"
+
+#include <algorithm>
+#include <sstream>
+
+/* static */ bool     tls_stream::enabled   = false;
+/* static */ bool     tls_stream::meta_only = false;
+/* static */ uint32_t tls_stream::max_bytes = 16384;
+
+enum { TLS_HANDSHAKE=22, CLIENT_HELLO=1, SERVER_HELLO=2 };
+enum { EXT_SERVER_NAME=0x0000, EXT_SUPPORTED_GROUPS=0x000a, EXT_EC_POINT_FORMATS=0x000b,
+       EXT_SIGNATURE_ALGORITHMS=0x000d, EXT_ALPN=0x0010, EXT_SUPPORTED_VERSIONS=0x002b };
+
+static uint16_t be16(const uint8_t *p) { return (uint16_t)((p[0]<<8) | p[1]); }
+static uint32_t be24(const uint8_t *p) { return ((uint32_t)p[0]<<16) | ((uint32_t)p[1]<<8) | p[2]; }
+
+/* RFC 8701 values, which clients put in to keep servers honest; fingerprints leave them out */
+static bool grease(uint16_t v) { return (v & 0x0f0f)==0x0a0a && (v>>8)==(v & 0xff); }
+
+static std::string hex4(uint16_t v)
+{
+    char buf[8];
+    snprintf(buf,sizeof(buf),"%04x",v);
+    return buf;
+}
+
+static std::string two_digits(size_t n)
+{
+    char buf[8];
+    snprintf(buf,sizeof(buf),"%02u",(unsigned)std::min(n,(size_t)99));
+    return buf;
+}
+
+/* The first 12 hex digits of the SHA-256 of s, as JA4 has it; all zeros for nothing */
+static std::string ja4_hash(const std::string &s)
+{
+    if(s.empty()) return "000000000000";
+    return flow_hash::hexdigest(flow_hash::SHA256,(const uint8_t *)s.data(),s.size()).substr(0,12);
+}
+
+/* static */ bool tls_stream::starts_handshake(const uint8_t *data,size_t length)
+{
+    if(length<3) return false;
+    if(data[0]!=TLS_HANDSHAKE || data[1]!=3 || data[2]>4) return false; // SSL 3.0 to TLS 1.3 record versions
+    return length<6 || data[5]==CLIENT_HELLO || data[5]==SERVER_HELLO;
+}
+
+tls_stream::tls_stream():
+    state(PARSING),next(0),records(),message(),hello(0),legacy_version(0),versions(),ciphers(),
+    extensions(),groups(),point_formats(),sig_algs(),alpn(),sni()
+{
+}
+
+void tls_stream::fail()
+{
+    state = FAILED;
+    std::string().swap(records);
+    std::string().swap(message);
+}
+
+void tls_stream::feed(uint64_t offset,const uint8_t *data,size_t length)
+{
+    if(state!=PARSING || length==0) return;
+    if(offset>next){                    // a gap
+        fail();
+        return;
+    }
+    if(offset+length<=next) return;     // taken already
+    size_t skip = (size_t)(next-offset);
+    records.append((const char *)data+skip,length-skip);
+    next = offset+length;
+    parse_records();
+    if(state==PARSING && next>=max_bytes) fail(); // the hello is not in the first max_bytes
+}
+
+/* Put the fragments of the records together until the first message is whole */
+void tls_stream::parse_records()
+{
+    size_t p = 0;
+    while(state==PARSING && records.size()-p>=5){
+        const uint8_t *r = (const uint8_t *)records.data()+p;
+        if(r[0]!=TLS_HANDSHAKE){        // an alert, or not TLS after all
+            fail();
+            return;
+        }
+        size_t len = be16(r+3);
+        if(records.size()-p < 5+len) break;
+        message.append((const char *)r+5,len);
+        p += 5+len;
+        if(message.size()>=4){
+            const uint8_t *m = (const uint8_t *)message.data();
+            size_t mlen = be24(m+1);
+            if(mlen>max_bytes){
+                fail();
+                return;
+            }
+            if(message.size()>=4+mlen){
+                hello = m[0];
+                if((hello==CLIENT_HELLO || hello==SERVER_HELLO) && parse_hello(m+4,mlen)){
+                    state = PARSED;
+                    std::string().swap(records);
+                    std::string().swap(message);
+                } else {
+                    fail();
+                }
+                return;
+            }
+        }
+    }
+    records.erase(0,p);
+}
+
+bool tls_stream::parse_hello(const uint8_t *p,size_t len)
+{
+    const uint8_t *end = p+len;
+    if(end-p < 2+32+1) return false;
+    legacy_version = be16(p);
+    p += 2+32;                          // and the random
+    size_t n = *p++;                    // session id
+    if((size_t)(end-p) < n) return false;
+    p += n;
+    if(hello==CLIENT_HELLO){
+        if(end-p < 2) return false;
+        n = be16(p);
+        p += 2;
+        if((size_t)(end-p) < n || n%2) return false;
+        for(size_t i=0;i<n;i+=2) ciphers.push_back(be16(p+i));
+        p += n;
+        if(end-p < 1) return false;
+        n = *p++;                       // compression methods
+        if((size_t)(end-p) < n) return false;
+        p += n;
+    } else {
+        if(end-p < 3) return false;
+        ciphers.push_back(be16(p));
+        p += 3;                         // and the compression method
+    }
+    if(end-p < 2) return true;          // no extensions
+    n = be16(p);
+    p += 2;
+    if((size_t)(end-p) < n) return false;
+    end = p+n;
+    while(end-p >= 4){
+        uint16_t type = be16(p);
+        size_t elen = be16(p+2);
+        p += 4;
+        if((size_t)(end-p) < elen) return false;
+        extensions.push_back(type);
+        if(!parse_extension(type,p,elen)) return false;
+        p += elen;
+    }
+    return true;
+}
+
+bool tls_stream::parse_extension(uint16_t type,const uint8_t *p,size_t len)
+{
+    const uint8_t *end = p+len;
+    switch(type){
+    case EXT_SERVER_NAME:
+        if(hello!=CLIENT_HELLO || len<2) return true; // the server's is empty
+        p += 2;
+        while(end-p >= 3){
+            uint8_t name_type = p[0];
+            size_t n = be16(p+1);
+            p += 3;
+            if((size_t)(end-p) < n) return false;
+            if(name_type==0 && sni.empty()) sni.assign((const char *)p,n);
+            p += n;
+        }
+        return true;
+    case EXT_ALPN:
+        if(len<2) return false;
+        p += 2;
+        while(end-p >= 1){
+            size_t n = *p++;
+            if((size_t)(end-p) < n) return false;
+            alpn.push_back(std::string((const char *)p,n));
+            p += n;
+        }
+        return true;
+    case EXT_SUPPORTED_VERSIONS:
+        if(hello==SERVER_HELLO){
+            if(len<2) return false;
+            versions.push_back(be16(p));
+            return true;
+        }
+        if(len<1) return false;
+        p++;
+        for(;end-p>=2;p+=2) versions.push_back(be16(p));
+        return true;
+    case EXT_SUPPORTED_GROUPS:
+        if(len<2) return false;
+        for(p+=2;end-p>=2;p+=2) groups.push_back(be16(p));
+        return true;
+    case EXT_SIGNATURE_ALGORITHMS:
+        if(len<2) return false;
+        for(p+=2;end-p>=2;p+=2) sig_algs.push_back(be16(p));
+        return true;
+    case EXT_EC_POINT_FORMATS:
+        if(len<1) return false;
+        for(p++;p<end;p++) point_formats.push_back(*p);
+        return true;
+    }
+    return true;
+}
+
+/* The version the hello is about: the highest offered, or the one chosen */
+static uint16_t hello_version(uint16_t legacy,const std::vector<uint16_t> &versions)
+{
+    uint16_t v = 0;
+    for(std::vector<uint16_t>::const_iterator it=versions.begin();it!=versions.end();it++){
+        if(!grease(*it) && *it>v) v = *it;
+    }
+    return v ? v : legacy;
+}
+
+std::string tls_stream::version_name() const
+{
+    switch(hello_version(legacy_version,versions)){
+    case 0x0300: return "ssl3";
+    case 0x0301: return "1.0";
+    case 0x0302: return "1.1";
+    case 0x0303: return "1.2";
+    case 0x0304: return "1.3";
+    }
+    return hex4(hello_version(legacy_version,versions));
+}
+
+std::string tls_stream::ja4_version() const
+{
+    switch(hello_version(legacy_version,versions)){
+    case 0x0002: return "s2";
+    case 0x0300: return "s3";
+    case 0x0301: return "10";
+    case 0x0302: return "11";
+    case 0x0303: return "12";
+    case 0x0304: return "13";
+    }
+    return "00";
+}
+
+/* The first and last characters of the first ALPN value, or of its hex if they are not letters or digits */
+std::string tls_stream::ja4_alpn() const
+{
+    if(alpn.empty() || alpn[0].empty()) return "00";
+    const std::string &a = alpn[0];
+    char first = a[0], last = a[a.size()-1];
+    if(isalnum((unsigned char)first) && isalnum((unsigned char)last) && (unsigned char)first<0x80 && (unsigned char)last<0x80){
+        return std::string(1,first) + last;
+    }
+    static const char digits[] = "0123456789abcdef";
+    return std::string(1,digits[(uint8_t)first>>4]) + digits[(uint8_t)last & 0x0f];
+}
+
+template<class T>
+static std::string joined(const std::vector<T> &v,bool skip_grease)
+{
+    std::stringstream ss;
+    bool any = false;
+    for(typename std::vector<T>::const_iterator it=v.begin();it!=v.end();it++){
+        if(skip_grease && grease(*it)) continue;
+        if(any) ss << '-';
+        ss << (unsigned)*it;
+        any = true;
+    }
+    return ss.str();
+}
+
+/* SSLVersion,Ciphers,Extensions,EllipticCurves,EllipticCurvePointFormats; the server's has the first three */
+std::string tls_stream::ja3() const
+{
+    std::stringstream ss;
+    ss << legacy_version << "," << joined(ciphers,true) << "," << joined(extensions,true);
+    if(hello==CLIENT_HELLO) ss << "," << joined(groups,true) << "," << joined(point_formats,false);
+    return ss.str();
+}
+
+static std::string hex_list(const std::vector<uint16_t> &v)
+{
+    std::string s;
+    for(std::vector<uint16_t>::const_iterator it=v.begin();it!=v.end();it++){
+        if(s.size()) s += ",";
+        s += hex4(*it);
+    }
+    return s;
+}
+
+std::string tls_stream::ja4() const
+{
+    std::vector<uint16_t> c,e;
+    size_t nexts = 0;
+    for(std::vector<uint16_t>::const_iterator it=ciphers.begin();it!=ciphers.end();it++){
+        if(!grease(*it)) c.push_back(*it);
+    }
+    for(std::vector<uint16_t>::const_iterator it=extensions.begin();it!=extensions.end();it++){
+        if(grease(*it)) continue;
+        nexts++;
+        if(*it!=EXT_SERVER_NAME && *it!=EXT_ALPN) e.push_back(*it);
+    }
+    std::sort(c.begin(),c.end());
+    std::sort(e.begin(),e.end());
+    std::string exts = hex_list(e);
+    if(exts.size() && sig_algs.size()) exts += "_" + hex_list(sig_algs);
+    bool has_sni = std::find(extensions.begin(),extensions.end(),(uint16_t)EXT_SERVER_NAME)!=extensions.end();
+    return "t" + ja4_version() + (has_sni ? "d" : "i") + two_digits(c.size()) + two_digits(nexts) + ja4_alpn()
+        + "_" + ja4_hash(hex_list(c)) + "_" + ja4_hash(exts);
+}
+
+std::string tls_stream::ja4s() const
+{
+    return "t" + ja4_version() + two_digits(extensions.size()) + ja4_alpn()
+        + "_" + hex4(ciphers.size() ? ciphers[0] : 0) + "_" + ja4_hash(hex_list(extensions));
+}
+
+void tls_stream::finish(std::string &xmladd) const
+{
+    if(state!=PARSED) return;
+    std::stringstream ss;
+    ss << "<tls hello='" << (hello==CLIENT_HELLO ? "client" : "server") << "' version='" << version_name() << "'";
+    if(sni.size()) ss << " sni='" << dfxml_writer::xmlescape(sni) << "'";
+    if(alpn.size()){
+        std::string a;
+        for(std::vector<std::string>::const_iterator it=alpn.begin();it!=alpn.end();it++){
+            if(a.size()) a += ",";
+            a += *it;
+        }
+        ss << " alpn='" << dfxml_writer::xmlescape(a) << "'";
+    }
+    if(hello==CLIENT_HELLO){
+        ss << " ciphers='" << ciphers.size() << "'";
+    } else if(ciphers.size()){
+        ss << " cipher='0x" << hex4(ciphers[0]) << "'";
+    }
+    if(flow_hash::available()){
+        std::string s = ja3();
+        ss << (hello==CLIENT_HELLO ? " ja3='" : " ja3s='")
+           << flow_hash::hexdigest(flow_hash::MD5,(const uint8_t *)s.data(),s.size()) << "'";
+        ss << (hello==CLIENT_HELLO ? " ja4='" : " ja4s='") << (hello==CLIENT_HELLO ? ja4() : ja4s()) << "'";
+    }
+    ss << "/>";
+    xmladd += ss.str();
+}
@@ -0,0 +1,93 @@
+/*
+ * tls_stream.h:
+ *
+ * The metadata of a TLS handshake, taken from the first bytes of each
+ * direction of a flow as it is stored, with -S tls_meta=1.
+ *
+ * A flow whose first bytes are a TLS handshake record gets a tls_stream
+ * in its tcpip. tcpip::write_segment() feeds it the flow in order until
+ * the first handshake message, the ClientHello or the ServerHello, has
+ * been put together from its records; the report then has
+ *
+ *   <tls hello='client' version='1.3' sni='example.com' alpn='h2,http/1.1'
+ *        ciphers='18' ja3='304734bb...' ja4='t13d1812h2_85036bcba153_d41ae481755e'/>
+ *   <tls hello='server' version='1.3' cipher='0x1302'
+ *        ja3s='15af977c...' ja4s='t130200_1302_a56c5b993250'/>
+ *
+ * A TLS 1.3 server's ALPN is in its encrypted extensions, so only a
+ * TLS 1.2 ServerHello has one. ja3 and ja3s are MD5 digests, and ja4 and
+ * ja4s need SHA-256, so they are left out when tcpflow is built without
+ * OpenSSL. A gap before the hello, or a hello that is not whole in the
+ * first -S tls_meta_bytes bytes (default 16384), ends the parsing
+ * without a <tls>.
+ *
+ * Most of the bytes of a TLS flow are of no use once it is stored
+ * encrypted, so the flows that are TLS can be left out:
+ *
+ *   -S tls_meta_only=1   a flow whose first bytes are TLS has no transcript;
+ *                        once its hello is parsed its packets are only counted
+ *   -S flow_policy       a tls rule does that for its connections, and keeps
+ *                        nothing but the report of those that are not TLS
+ *
+ * Such a flow costs the few hundred bytes of its hello, parsed once.
+ * The flows that keep their transcripts are scanned as before.
+ *
+ * This source code is under the GNU Public License (GPL).  See
+ * LICENSE for details.
+ */
+
+#ifndef TLS_STREAM_H
+#define TLS_STREAM_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+class tls_stream {
+    tls_stream(const tls_stream &);
+    tls_stream &operator=(const tls_stream &);
+
+public:
+    static bool     enabled;            // -S tls_meta
+    static bool     meta_only;          // -S tls_meta_only
+    static uint32_t max_bytes;          // -S tls_meta_bytes
+    static bool starts_handshake(const uint8_t *data,size_t length); // a TLS handshake record at the start of a flow
+
+    tls_stream();
+
+    void feed(uint64_t offset,const uint8_t *data,size_t length);
+    bool finished() const { return state!=PARSING; } // nothing more is taken
+    void finish(std::string &xmladd) const; // the <tls>, if a hello was parsed
+
+private:
+    enum state_t { PARSING, PARSED, FAILED };
+    state_t     state;
+    uint64_t    next;                   // offset in the flow of the next byte to take
+    std::string records;                // bytes taken and not yet put into message
+    std::string message;                // the handshake message, from the records' fragments
+
+    /* what the hello says */
+    uint8_t     hello;                  // 1 ClientHello, 2 ServerHello
+    uint16_t    legacy_version;
+    std::vector<uint16_t> versions;     // supported_versions, or the one the server chose
+    std::vector<uint16_t> ciphers;      // offered, or the one chosen
+    std::vector<uint16_t> extensions;   // in the order given
+    std::vector<uint16_t> groups;       // supported_groups
+    std::vector<uint8_t>  point_formats;
+    std::vector<uint16_t> sig_algs;     // signature_algorithms
+    std::vector<std::string> alpn;      // offered, or the one chosen
+    std::string sni;
+
+    void fail();
+    void parse_records();
+    bool parse_hello(const uint8_t *p,size_t len);
+    bool parse_extension(uint16_t type,const uint8_t *p,size_t len);
+    std::string version_name() const;   // 1.3 and the like
+    std::string ja4_version() const;
+    std::string ja4_alpn() const;
+    std::string ja3() const;            // the JA3 or JA3S string, before it is hashed
+    std::string ja4() const;
+    std::string ja4s() const;
+};
+
+#endif
@@ -0,0 +1,124 @@
+/*
+ * trace_record.h:
+ *
+ * The records of -S trace_file: what happened to each packet and flow, in
+ * the order it happened, written by tracer (tracer.h) and read back by
+ * tcpflow-trace.
+ *
+ * The file is a 16-byte header, "tcpflow-trace" and three bytes of version
+ * (1), followed by 32-byte records, all little-endian:
+ *
+ *   bytes  0-7   nanoseconds since the tracing started
+ *   bytes  8-9   event
+ *   bytes 10-11  thread, numbered from 0 in the order they first traced
+ *   bytes 12-15  a \
+ *   bytes 16-23  b  } what they say depends on the event; see event_t
+ *   bytes 24-31  c /
+ *
+ * Each thread's records are in time order, and the threads follow each other.
+ *
+ * This header has no dependencies on the rest of tcpflow.
+ *
+ * This source code is under the GNU Public License (GPL).  See
+ * LICENSE for details.
+ */
+
+#ifndef TRACE_RECORD_H
+#define TRACE_RECORD_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+class trace_record {
+public:
+    enum { SIZE = 32, HEADER_SIZE = 16, VERSION = 1 };
+    enum event_t {
+        DATALINK,                       // a=caplen b=dlt
+        IP4,                            // a=datagram length
+        IP6,                            // a=datagram length
+        TCP,                            // a=payload length b=flow id, or all ones if new c=seq
+        NEW_FLOW,                       // b=flow id
+        STORE,                          // a=length b=flow id c=offset in the flow
+        OUT_OF_ORDER,                   // a=length b=flow id c=offset in the flow
+        CLOSE,                          // b=flow id c=last byte
+        FD_EVICTION,                    // b=flow id whose fd was closed
+        SHIFT_FILE,                     // a=headroom b=flow id c=prefix bytes; see tcpip::merge_prefix()
+        UNSHIFT_FILE,                   // the same, when the file moves down instead of up
+        EVENTS
+    };
+    static const char *event_name(unsigned e) {
+        static const char *names[] = {"datalink","ip4","ip6","tcp","new_flow","store",
+                                      "out_of_order","close","fd_eviction","shift_file","unshift_file"};
+        return e<EVENTS ? names[e] : "unknown";
+    }
+    /* the names of a, b and c for event e; 0 if it does not use that one */
+    static const char *event_field(unsigned e,int field) {
+        static const char *fields[EVENTS][3] = {
+            {"caplen","dlt",0}, {"len",0,0}, {"len",0,0}, {"len","flow","seq"}, {0,"flow",0},
+            {"len","flow","offset"}, {"len","flow","offset"}, {0,"flow","last_byte"},
+            {0,"flow",0}, {"headroom","flow","prefix"}, {"headroom","flow","prefix"}
+        };
+        return e<EVENTS ? fields[e][field] : 0;
+    }
+
+    uint64_t ns;
+    uint16_t event;
+    uint16_t thread;
+    uint32_t a;
+    uint64_t b;
+    uint64_t c;
+
+    trace_record():ns(0),event(0),thread(0),a(0),b(0),c(0){}
+
+    static void put(uint8_t *buf,uint64_t v,int bytes) {
+        for(int i=0;i<bytes;i++) buf[i] = (uint8_t)(v >> (8*i));
+    }
+    static uint64_t get(const uint8_t *buf,int bytes) {
+        uint64_t v = 0;
+        for(int i=0;i<bytes;i++) v |= (uint64_t)buf[i] << (8*i);
+        return v;
+    }
+    static void encode_header(uint8_t *buf) {
+        const char magic[] = "tcpflow-trace";
+        for(int i=0;i<13;i++) buf[i] = magic[i];
+        put(buf+13,VERSION,3);
+    }
+    static bool decode_header(const uint8_t *buf) {
+        const char magic[] = "tcpflow-trace";
+        for(int i=0;i<13;i++) if(buf[i]!=(uint8_t)magic[i]) return false;
+        return get(buf+13,3)==VERSION;
+    }
+    void encode(uint8_t *buf) const {
+        put(buf,ns,8);
+        put(buf+8,event,2);
+        put(buf+10,thread,2);
+        put(buf+12,a,4);
+        put(buf+16,b,8);
+        put(buf+24,c,8);
+    }
+    static trace_record decode(const uint8_t *buf) {
+        trace_record r;
+        r.ns     = get(buf,8);
+        r.event  = get(buf+8,2);
+        r.thread = get(buf+10,2);
+        r.a      = get(buf+12,4);
+        r.b      = get(buf+16,8);
+        r.c      = get(buf+24,8);
+        return r;
+    }
+    bool operator<(const trace_record &r) const { return ns < r.ns; }
+
+    /* "seconds thread event name=value ...\n" */
+    int print(FILE *f) const {
+        int n = fprintf(f,"%llu.%09llu %u %s",(unsigned long long)(ns/1000000000),
+                        (unsigned long long)(ns%1000000000),thread,event_name(event));
+        const uint64_t v[3] = {a,b,c};
+        for(int i=0;i<3;i++){
+            const char *name = event_field(event,i);
+            if(name) n += fprintf(f," %s=%llu",name,(unsigned long long)v[i]);
+        }
+        return n + fprintf(f,"\n");
+    }
+};
+
+#endif
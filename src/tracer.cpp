@@ -0,0 +1,84 @@
+/**
+ *
+ * tracer.cpp
+ * A flight recorder for the packet path. See tracer.h
+ *
+ * This source code is under the GNU Public License (GPL).  See
+ * LICENSE for details.
+ *
+ */
+
+#include "tcpflow.h"
+#include "tracer.h"
+
+#include <mutex>
+
+/* static */ std::string tracer::path    = "";
+/* static */ uint32_t    tracer::records = 65536;
+/* static */ bool        tracer::enabled = false;
+
+static std::mutex                   rings_M;
+static std::vector<tracer::ring *>  rings;   // one for each thread that traced; never freed
+static std::string                  file;
+static uint64_t                     start_ticks = 0;
+static std::chrono::steady_clock::time_point start_time;
+
+tracer::ring::ring(uint16_t thread_,size_t size):recs(size),mask(size-1),next(0),thread(thread_)
+{
+}
+
+/* static */ tracer::ring &tracer::local()
+{
+    static thread_local ring *mine = 0;
+    if(mine==0){
+        std::lock_guard<std::mutex> lock(rings_M);
+        mine = new ring(rings.size(),records);
+        rings.push_back(mine);
+    }
+    return *mine;
+}
+
+/* static */ void tracer::start(const std::string &file_)
+{
+    uint32_t size = 1;
+    while(size < records && size < (1U<<30)) size <<= 1;
+    records = size;
+    file = file_;
+    start_time  = std::chrono::steady_clock::now();
+    start_ticks = ticks();
+    enabled = true;
+}
+
+/* static */ void tracer::stop()
+{
+    if(!enabled) return;
+    enabled = false;
+
+    /* how many nanoseconds a tick is, from the ticks and the time since start() */
+    uint64_t stop_ticks = ticks();
+    double ns = std::chrono::duration<double,std::nano>(std::chrono::steady_clock::now()-start_time).count();
+    double ns_per_tick = stop_ticks>start_ticks ? ns/(stop_ticks-start_ticks) : 1.0;
+
+    FILE *f = fopen(file.c_str(),"wb");
+    if(f==0){
+        DEBUG(1)("%s: %s",file.c_str(),strerror(errno));
+        return;
+    }
+    uint8_t buf[trace_record::SIZE];
+    trace_record::encode_header(buf);
+    bool ok = fwrite(buf,1,trace_record::HEADER_SIZE,f)==trace_record::HEADER_SIZE;
+
+    std::lock_guard<std::mutex> lock(rings_M);
+    for(std::vector<ring *>::const_iterator it=rings.begin();it!=rings.end() && ok;it++){
+        const ring &r = **it;
+        uint64_t count = r.next < r.recs.size() ? r.next : r.recs.size();
+        for(uint64_t i=r.next-count;i<r.next && ok;i++){
+            trace_record rec = r.recs[i & r.mask];
+            rec.ns = rec.ns>start_ticks ? (uint64_t)((rec.ns-start_ticks)*ns_per_tick) : 0;
+            rec.encode(buf);
+            ok = fwrite(buf,1,sizeof(buf),f)==sizeof(buf);
+        }
+    }
+    if(fclose(f)!=0) ok = false;
+    if(!ok) DEBUG(1)("%s: %s",file.c_str(),strerror(errno));
+}
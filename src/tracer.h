@@ -0,0 +1,77 @@
+#ifndef TRACER_H
+#define TRACER_H
+
+/**
+ * tracer.h
+ *
+ * A flight recorder for the packet path, with -S trace_file.
+ *
+ * Each thread puts a 32-byte record of each event (a packet reaching the
+ * datalink, IPv4, IPv6 or TCP code, a flow created, stored to, reordered,
+ * closed or evicted; see trace_record.h) in a ring of its own, with no lock
+ * and no formatting: a clock read and a few stores. When a ring is full the
+ * oldest records are written over, so that it can be left on, and holds the
+ * last -S trace_records (default 65536) events of each thread. At the end of
+ * the run the rings are written to the file, which tcpflow-trace prints.
+ *
+ * On x86 the clock is the TSC, turned into nanoseconds when the file is
+ * written; elsewhere it is the steady clock.
+ *
+ * This source code is under the GNU Public License (GPL).  See
+ * LICENSE for details.
+ */
+
+#include "trace_record.h"
+
+#include <string>
+#include <vector>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#include <chrono>
+
+class tracer {
+public:
+    static std::string path;            // -S trace_file; "" for none
+    static uint32_t    records;         // -S trace_records: ring size of each thread
+    static bool        enabled;         // set by start()
+
+    static void event(trace_record::event_t e,uint32_t a=0,uint64_t b=0,uint64_t c=0) {
+        if(enabled) local().add(e,a,b,c);
+    }
+
+    static void start(const std::string &file); // file is path, resolved against the output directory
+    static void stop();                 // writes the file; the other threads must be done
+
+    static uint64_t ticks() {
+#if defined(__x86_64__) || defined(__i386__)
+        return __rdtsc();
+#else
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+    }
+
+    /* one thread's records; only that thread writes them */
+    struct ring {
+        ring(uint16_t thread_,size_t size);
+        std::vector<trace_record> recs;  // size is a power of 2
+        uint64_t mask;
+        uint64_t next;                   // records added; recs[next & mask] is the oldest once it wraps
+        uint16_t thread;
+        void add(trace_record::event_t e,uint32_t a,uint64_t b,uint64_t c) {
+            trace_record &r = recs[next++ & mask];
+            r.ns     = ticks();          // turned into nanoseconds by stop()
+            r.event  = e;
+            r.thread = thread;
+            r.a      = a;
+            r.b      = b;
+            r.c      = c;
+        }
+    };
+
+private:
+    static ring &local();
+};
+
+#endif
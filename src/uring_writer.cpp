@@ -0,0 +1,212 @@
+/*
+ * uring_writer.cpp:
+ *
+ * Asynchronous transcript writes with io_uring. See uring_writer.h
+ *
+ * This source code is under the GNU Public License (GPL).  See
+ * LICENSE for details.
+ */
+
+#include "tcpflow.h"
+#include "uring_writer.h"
+
+#include <algorithm>
+
+#ifdef HAVE_URING_WRITER
+#include <liburing.h>
+#include <sys/uio.h>
+#endif
+
+/* static */ bool     uring_writer::enabled = false;
+/* static */ uint32_t uring_writer::queue_depth = 256;
+/* static */ uint32_t uring_writer::buffer_size = 64*1024;
+
+static const unsigned SUBMIT_BATCH = 16;    // writes queued before they are submitted
+
+uring_writer::uring_writer():
+    ring(0),buffers(0),slot_size(0),slots(),free_slots(),in_flight(),unsubmitted(0),
+    writes(0),waits(0),errors(0),pending(0)
+{
+}
+
+/* static */ uring_writer *uring_writer::create(std::string &error)
+{
+#ifdef HAVE_URING_WRITER
+    uring_writer *w = new uring_writer();
+    if(w->init(error)){
+        delete w;
+        return 0;
+    }
+    return w;
+#else
+    error = "io_uring is not available";
+    return 0;
+#endif
+}
+
+int uring_writer::init(std::string &error)
+{
+#ifdef HAVE_URING_WRITER
+    unsigned depth = std::max(queue_depth,(uint32_t)1);
+    size_t   bsize = std::max(buffer_size,(uint32_t)4096);
+    ring = new io_uring();
+    int r = io_uring_queue_init(depth,ring,0);
+    if(r<0){
+        error = std::string("io_uring_queue_init: ") + strerror(-r);
+        delete ring;
+        ring = 0;
+        return -1;
+    }
+    if(posix_memalign((void **)&buffers,4096,depth*bsize)){
+        error = "cannot allocate the io_uring buffers";
+        buffers = 0;
+        return -1;
+    }
+    std::vector<struct iovec> iov(depth);
+    for(unsigned i=0;i<depth;i++){
+        iov[i].iov_base = buffers + i*bsize;
+        iov[i].iov_len  = bsize;
+    }
+    r = io_uring_register_buffers(ring,&iov[0],depth);
+    if(r<0){
+        error = std::string("io_uring_register_buffers: ") + strerror(-r);
+        return -1;
+    }
+    slot_size = bsize;
+    slots.resize(depth);
+    for(unsigned i=depth;i>0;i--) free_slots.push_back(i-1);
+    return 0;
+#else
+    error = "io_uring is not available";
+    return -1;
+#endif
+}
+
+uring_writer::~uring_writer()
+{
+#ifdef HAVE_URING_WRITER
+    if(ring){
+        if(slots.size()>0) drain();
+        io_uring_queue_exit(ring);
+        delete ring;
+    }
+#endif
+    free(buffers);
+}
+
+void uring_writer::submit()
+{
+#ifdef HAVE_URING_WRITER
+    if(unsubmitted==0) return;
+    int r = io_uring_submit(ring);
+    if(r<0) DEBUG(1)("io_uring_submit: %s",strerror(-r));
+    unsubmitted = 0;
+#endif
+}
+
+/* Account for the completion of slot i, finishing a short write synchronously */
+void uring_writer::complete(unsigned i,int res)
+{
+    slot &s = slots[i];
+    if(res < (int)s.len){
+        const uint8_t *buf = buffers + i*slot_size;
+        size_t done = res>0 ? res : 0;
+        if(res<0) DEBUG(2)("io_uring write to fd %d failed (%s); retrying",s.fd,strerror(-res));
+        while(done < s.len){
+            ssize_t w = pwrite(s.fd,buf+done,s.len-done,s.offset+done);
+            if(w<=0){
+                DEBUG(1)("write to fd %d at %" PRIu64 " failed: %s",s.fd,s.offset+done,strerror(errno));
+                errors++;
+                break;
+            }
+            done += w;
+        }
+    }
+    std::map<int,unsigned>::iterator it = in_flight.find(s.fd);
+    if(it!=in_flight.end() && --it->second==0) in_flight.erase(it);
+    pending -= s.len;
+    s.fd = -1;
+    free_slots.push_back(i);
+}
+
+bool uring_writer::reap(bool wait)
+{
+#ifdef HAVE_URING_WRITER
+    submit();
+    struct io_uring_cqe *cqe = 0;
+    if(wait){
+        int r;
+        do {
+            r = io_uring_wait_cqe(ring,&cqe);
+        } while(r==-EINTR);
+        if(r<0){
+            DEBUG(1)("io_uring_wait_cqe: %s",strerror(-r));
+            return false;
+        }
+    }
+    while(io_uring_peek_cqe(ring,&cqe)==0 && cqe){
+        unsigned i = (unsigned)(uintptr_t)io_uring_cqe_get_data(cqe);
+        int res = cqe->res;
+        io_uring_cqe_seen(ring,cqe);
+        complete(i,res);
+    }
+#endif
+    return true;
+}
+
+void uring_writer::write(int fd,const void *data,size_t len,uint64_t offset)
+{
+#ifdef HAVE_URING_WRITER
+    const uint8_t *p = (const uint8_t *)data;
+    while(len>0){
+        if(free_slots.empty()) reap(false);
+        if(free_slots.empty()){
+            waits++;                    // backpressure: wait for the disk
+            if(!reap(true) || free_slots.empty()) { // the ring is broken; write it ourselves
+                if(pwrite(fd,p,len,offset)!=(ssize_t)len) errors++;
+                return;
+            }
+        }
+        unsigned i = free_slots.back();
+        free_slots.pop_back();
+        size_t n = std::min(len,slot_size);
+        uint8_t *buf = buffers + i*slot_size;
+        memcpy(buf,p,n);
+        slots[i].fd     = fd;
+        slots[i].offset = offset;
+        slots[i].len    = n;
+        in_flight[fd]++;
+        pending += n;
+
+        struct io_uring_sqe *sqe = io_uring_get_sqe(ring);
+        if(sqe==0){                     // cannot happen with one sqe per buffer, but be safe
+            submit();
+            sqe = io_uring_get_sqe(ring);
+        }
+        io_uring_prep_write_fixed(sqe,fd,buf,n,offset,i);
+        io_uring_sqe_set_data(sqe,(void *)(uintptr_t)i);
+        if(++unsubmitted >= SUBMIT_BATCH) submit();
+        writes++;
+
+        p      += n;
+        offset += n;
+        len    -= n;
+    }
+#else
+    if(pwrite(fd,data,len,offset)!=(ssize_t)len) errors++;
+#endif
+}
+
+void uring_writer::sync(int fd)
+{
+    while(in_flight.find(fd)!=in_flight.end()){
+        if(!reap(true)) break;
+    }
+}
+
+void uring_writer::drain()
+{
+    while(!in_flight.empty()){
+        if(!reap(true)) break;
+    }
+}
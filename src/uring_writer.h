@@ -0,0 +1,86 @@
+/*
+ * uring_writer.h:
+ *
+ * Write transcripts and HTTP bodies through io_uring, so that a slow
+ * disk does not hold up the packet thread.
+ *
+ * Each write is copied into one of queue_depth registered buffers and
+ * submitted as IORING_OP_WRITE_FIXED at its absolute offset; the caller
+ * goes on at once. When every buffer is in flight the caller waits for
+ * one to complete, which holds the capture path back by no more than
+ * one write instead of letting the queue grow without bound.
+ *
+ * Anything that reads a file back, sets its times or closes it must
+ * call sync(fd) first. tcpdemux::write_file() and tcpdemux::sync_file()
+ * do this and fall back to pwrite() without io_uring.
+ *
+ * Not thread-safe; each tcpdemux has its own, used by the thread that
+ * runs it.
+ *
+ * This source code is under the GNU Public License (GPL).  See
+ * LICENSE for details.
+ */
+
+#ifndef URING_WRITER_H
+#define URING_WRITER_H
+
+#include "tcpflow.h"
+
+#include <vector>
+#include <map>
+
+/* the library must be there as well as the header */
+#if defined(HAVE_LIBURING_H) && defined(HAVE_LIBURING)
+#define HAVE_URING_WRITER
+#endif
+
+struct io_uring;
+
+class uring_writer {
+    uring_writer(const uring_writer &);
+    uring_writer &operator=(const uring_writer &);
+
+    /* A registered buffer and the write it carries */
+    struct slot {
+        slot():fd(-1),offset(0),len(0){}
+        int      fd;
+        uint64_t offset;
+        size_t   len;
+    };
+
+    struct io_uring       *ring;
+    uint8_t               *buffers;         // slots.size() * slot_size bytes, registered with the ring
+    size_t                slot_size;        // buffer_size, at least 4096; the statics are shared by every writer
+    std::vector<slot>     slots;
+    std::vector<unsigned> free_slots;
+    std::map<int,unsigned> in_flight;       // writes not yet completed, by fd
+    unsigned              unsubmitted;
+
+    uring_writer();
+    int  init(std::string &error);
+    void submit();
+    void complete(unsigned i,int res);
+    bool reap(bool wait);                   // handle the completions that are there, or wait for one; false if the ring failed
+
+public:
+    /* Tuning; set with -S */
+    static bool     enabled;                // -S io_uring=1 turns this on
+    static uint32_t queue_depth;            // writes in flight at most
+    static uint32_t buffer_size;            // bytes per registered buffer; larger writes take several
+
+    /* statistics */
+    uint64_t writes;
+    uint64_t waits;                         // times a write had to wait for a free buffer
+    uint64_t errors;
+    uint64_t pending;                       // bytes submitted and not yet written
+
+    /* Returns a writer, or 0 (with error set) if io_uring is not available */
+    static uring_writer *create(std::string &error);
+    ~uring_writer();                        // waits for every write
+
+    void write(int fd,const void *data,size_t len,uint64_t offset);
+    void sync(int fd);                      // wait until every write to fd is done
+    void drain();                           // wait until every write is done
+};
+
+#endif
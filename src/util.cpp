@@ -11,6 +11,9 @@
 #include "tcpflow.h"
 
 #include <iomanip>
+#include <mutex>
+#include <unordered_set>
+#include <algorithm>
 
 static char *debug_prefix = NULL;
 
@@ -66,6 +69,26 @@ std::string macaddr(const uint8_t *addr)
     return std::string(buf);
 }
 
+std::string json_quote(const std::string &s)
+{
+    std::string out("\"");
+    for(size_t i=0;i<s.size();i++){
+        unsigned char ch = s[i];
+        if(ch=='"' || ch=='\\'){
+            out += '\\';
+            out += ch;
+        } else if(ch<0x20){
+            char buf[8];
+            snprintf(buf,sizeof(buf),"\\u%04x",ch);
+            out += buf;
+        } else {
+            out += ch;
+        }
+    }
+    out += '"';
+    return out;
+}
+
 /*
  * Remember our program name and process ID so we can use them later
  * for printing debug messages
@@ -106,12 +129,54 @@ static std::vector<std::string> split(const std::string &s, char delim)
 #endif
 
 
+/*
+ * The directories that mkdirs_for_path() made or found, so that it does
+ * not have to try them again. The cache is bounded by keeping two
+ * generations: when the current one holds half of mkdirs_cache_max
+ * entries it becomes the previous one, and a directory found only in
+ * the previous one is moved forward. The binning directories of recent
+ * flows stay; those of long-gone flows are forgotten.
+ */
+uint32_t mkdirs_cache_max = 65536;
+static std::unordered_set<std::string> made_dirs[2]; // current and previous generation
+static std::mutex made_dirs_M;          // demux worker threads share made_dirs
+
+static void remember_dir(const std::string &dir)
+{
+    if(made_dirs[0].size() >= std::max(mkdirs_cache_max/2,(uint32_t)1)){
+        made_dirs[1].swap(made_dirs[0]);
+        made_dirs[0].clear();
+    }
+    made_dirs[0].insert(dir);
+}
+
+static bool known_dir(const std::string &dir)
+{
+    if(made_dirs[0].find(dir)!=made_dirs[0].end()) return true;
+    if(made_dirs[1].find(dir)!=made_dirs[1].end()){
+        remember_dir(dir);
+        return true;
+    }
+    return false;
+}
+
 /* mkdir all of the containing directories in path.
  * keep track of those made so we don't need to keep remaking them.
  */
 void mkdirs_for_path(std::string path)
 {
-    static std::set<std::string> made_dirs; // track what we made
+    static thread_local std::string last_dir; // the directory of the last path; flows often share it
+
+    /* Known directories are not split and looked up part by part each time */
+    size_t slash = path.rfind('/');
+    if(slash==std::string::npos || slash==0) return; // nothing to make
+    std::string dir = path.substr(0,slash);
+    if(dir==last_dir) return;
+    std::lock_guard<std::mutex> lock(made_dirs_M);
+    if(known_dir(dir)){
+        last_dir = dir;
+        return;
+    }
 
     std::string mpath;                  // the path we are making
 
@@ -126,7 +191,7 @@ void mkdirs_for_path(std::string path)
      * That's okay, because it's a filename.
      */
     for(std::vector<std::string>::const_iterator it=parts.begin();it!=parts.end();it++){
-        if(made_dirs.find(mpath)==made_dirs.end()){
+        if(!known_dir(mpath)){
             if(mpath.size()){
                 int r = MKDIR(mpath.c_str(),0777);
                 if(r<0){
@@ -136,12 +201,14 @@ void mkdirs_for_path(std::string path)
                         exit(1);
                     }
                 }
-                made_dirs.insert(mpath);
+                remember_dir(mpath);
             }
         }
         if(mpath.size()>0) mpath += "/";
         mpath += *it;
     }
+    remember_dir(dir);
+    last_dir = dir;
 }
 
 /*
@@ -220,6 +287,27 @@ void (*portable_signal(int signo, void (*func)(int)))(int)
 #include <sys/mman.h>
 #endif
 
+/**
+ * Positional I/O for systems without it. Transcripts are only ever
+ * written with pwrite(), so these are the only places that move a
+ * file offset.
+ */
+#ifndef HAVE_PREAD
+ssize_t pread(int fd,void *buf,size_t count,off_t offset)
+{
+    if(lseek(fd,offset,SEEK_SET)<0) return -1;
+    return read(fd,buf,count);
+}
+#endif
+
+#ifndef HAVE_PWRITE
+ssize_t pwrite(int fd,const void *buf,size_t count,off_t offset)
+{
+    if(lseek(fd,offset,SEEK_SET)<0) return -1;
+    return write(fd,buf,count);
+}
+#endif
+
 /**
  * fake implementation of mmap and munmap if we don't have them
  */
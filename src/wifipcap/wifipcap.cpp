@@ -15,6 +15,7 @@
 #include <inttypes.h>
 
 #include <iostream>
+#include <vector>
 #include <cstdlib>
 #include <cstdio>
 #include <cstring>
@@ -52,6 +53,11 @@
 MAC MAC::broadcast(0xffffffffffffULL);
 MAC MAC::null((uint64_t)0);
 int WifiPacket::debug=0;
+
+WifiPacket::WifiPacket(WifipcapCallbacks *cbs_,const int header_type_,const struct pcap_pkthdr *header_,const u_char *packet_):
+    cbs(cbs_),layers(cbs_->layers()),header_type(header_type_),header(header_),packet(packet_),fcs_ok(false)
+{
+}
 int MAC::print_fmt(MAC::PRINT_FMT_COLON);
 
 std::ostream& operator<<(std::ostream& out, const MAC& mac) {
@@ -976,6 +982,9 @@ WifiPacket::decode_mgmt_body(u_int16_t fc, struct mgmt_header_t *pmh, const u_ch
 
 int WifiPacket::decode_mgmt_frame(const u_char * ptr, size_t len, u_int16_t fc, u_int8_t hdrlen)
 {
+    const unsigned wanted = FC_SUBTYPE(fc)==ST_BEACON ? WifipcapCallbacks::LAYER_BEACON : WifipcapCallbacks::LAYER_MGMT;
+    if ((layers & (wanted | WifipcapCallbacks::LAYER_80211))==0) return 0;
+
     mgmt_header_t hdr;
     u_int16_t seq_ctl;
 
@@ -990,11 +999,14 @@ int WifiPacket::decode_mgmt_frame(const u_char * ptr, size_t len, u_int16_t fc,
     hdr.seq   = COOK_SEQUENCE_NUMBER(seq_ctl);
     hdr.frag  = COOK_FRAGMENT_NUMBER(seq_ctl);
 
-    cbs->Handle80211(*this, fc, hdr.sa, hdr.da, MAC::null, MAC::null, ptr, len);
+    if (layers & WifipcapCallbacks::LAYER_80211) {
+        cbs->Handle80211(*this, fc, hdr.sa, hdr.da, MAC::null, MAC::null, ptr, len);
+    }
+    if ((layers & wanted)==0) return 0;
 
     int ret = decode_mgmt_body(fc, &hdr, ptr+MGMT_HDRLEN, len-MGMT_HDRLEN);
 
-    if (ret==0) {
+    if (ret==0 && (layers & WifipcapCallbacks::LAYER_80211)) {
 	cbs->Handle80211Unknown(*this, fc, ptr, len);
 	return 0;
     }
@@ -1002,6 +1014,16 @@ int WifiPacket::decode_mgmt_frame(const u_char * ptr, size_t len, u_int16_t fc,
     return 0;
 }
 
+void WifiPacket::call_data_callbacks(data_callback_t cb, const mac_hdr_t &hdr, const u_char *ptr, size_t len, size_t hdrlen)
+{
+    if (layers & WifipcapCallbacks::LAYER_80211) {
+        cbs->Handle80211( *this, hdr.fc, hdr.sa, hdr.da, hdr.ra, hdr.ta, ptr, len);
+    }
+    if (layers & WifipcapCallbacks::LAYER_DATA) {
+        (cbs->*cb)( *this, hdr, ptr+hdrlen, len-hdrlen);
+    }
+}
+
 int WifiPacket::decode_data_frame(const u_char * ptr, size_t len, u_int16_t fc)
 {
     mac_hdr_t hdr;
@@ -1029,24 +1051,21 @@ int WifiPacket::decode_data_frame(const u_char * ptr, size_t len, u_int16_t fc)
 	hdr.bssid = address3;
 	hdrlen = DATA_HDRLEN;
         if(hdr.qos) hdrlen+=2;
-        cbs->Handle80211( *this, fc, hdr.sa, hdr.da, hdr.ra, hdr.ta, ptr, len);
-	cbs->Handle80211DataIBSS( *this, hdr, ptr+hdrlen, len-hdrlen);
+        call_data_callbacks(&WifipcapCallbacks::Handle80211DataIBSS, hdr, ptr, len, hdrlen);
     } else if (FC_TO_DS(fc)==0 && FC_FROM_DS(fc)) { /* from AP to STA */
         hdr.da = address1;
         hdr.bssid = address2;
         hdr.sa = address3;
 	hdrlen = DATA_HDRLEN;
         if(hdr.qos) hdrlen+=2;
-        cbs->Handle80211( *this, fc, hdr.sa, hdr.da, hdr.ra, hdr.ta, ptr, len);
-	cbs->Handle80211DataFromAP( *this, hdr, ptr+hdrlen, len-hdrlen);
+        call_data_callbacks(&WifipcapCallbacks::Handle80211DataFromAP, hdr, ptr, len, hdrlen);
     } else if (FC_TO_DS(fc) && FC_FROM_DS(fc)==0) {	/* frame from STA to AP */
         hdr.bssid = address1;
         hdr.sa = address2;
         hdr.da = address3;
 	hdrlen = DATA_HDRLEN;
         if(hdr.qos) hdrlen+=2;
-        cbs->Handle80211( *this, fc, hdr.sa, hdr.da, hdr.ra, hdr.ta, ptr, len);
-	cbs->Handle80211DataToAP( *this, hdr, ptr+hdrlen, len-hdrlen);
+        call_data_callbacks(&WifipcapCallbacks::Handle80211DataToAP, hdr, ptr, len, hdrlen);
     } else if (FC_TO_DS(fc) && FC_FROM_DS(fc)) {	/* WDS */
         const MAC address4 = MAC::ether2MAC(ptr+18);
         hdr.ra = address1;
@@ -1055,11 +1074,13 @@ int WifiPacket::decode_data_frame(const u_char * ptr, size_t len, u_int16_t fc)
         hdr.sa = address4;
         hdrlen = DATA_WDS_HDRLEN;
         if(hdr.qos) hdrlen+=2;
-        cbs->Handle80211( *this, fc, hdr.sa, hdr.da, hdr.ra, hdr.ta, ptr, len);
-	cbs->Handle80211DataWDS( *this, hdr, ptr+hdrlen, len-hdrlen);
+        call_data_callbacks(&WifipcapCallbacks::Handle80211DataWDS, hdr, ptr, len, hdrlen);
     }
 
     /* Handle either the WEP or the link layer. This handles the data itself */
+    if ((layers & WifipcapCallbacks::LAYER_LLC)==0) {
+        return 0;
+    }
     if (FC_WEP(fc)) {
         handle_wep(ptr+hdrlen, len-hdrlen-4 ); 
     } else {
@@ -1070,6 +1091,7 @@ int WifiPacket::decode_data_frame(const u_char * ptr, size_t len, u_int16_t fc)
 
 int WifiPacket::decode_ctrl_frame(const u_char * ptr, size_t len, u_int16_t fc)
 {
+    if ((layers & (WifipcapCallbacks::LAYER_CTRL | WifipcapCallbacks::LAYER_80211))==0) return 0;
     u_int16_t du = EXTRACT_LE_16BITS(ptr+2);        //duration
 
     switch (FC_SUBTYPE(fc)) {
@@ -1149,8 +1171,10 @@ void WifiPacket::handle_80211(const u_char * pkt, size_t len /* , int pad */)
 {
     if (debug) std::cerr << "handle_80211(len= " << len << " ";
     if (len < 2) {
-	cbs->Handle80211( *this, 0, MAC::null, MAC::null, MAC::null, MAC::null, pkt, len);
-	cbs->Handle80211Unknown( *this, -1, pkt, len);
+        if (layers & WifipcapCallbacks::LAYER_80211) {
+            cbs->Handle80211( *this, 0, MAC::null, MAC::null, MAC::null, MAC::null, pkt, len);
+            cbs->Handle80211Unknown( *this, -1, pkt, len);
+        }
 	return;
     }
 
@@ -1169,8 +1193,9 @@ void WifiPacket::handle_80211(const u_char * pkt, size_t len /* , int pad */)
 	return;
     }
 
-    /* Always calculate the frame checksum, but only process the packets if the FCS or if we are ignoring it */
-    if (len >= hdrlen + 4) {
+    /* Calculate the frame checksum if it is checked or looked at, and only process the packets if the FCS or if we are ignoring it */
+    bool check_fcs = cbs->Check80211FCS(*this);
+    if (len >= hdrlen + 4 && (check_fcs || (layers & WifipcapCallbacks::LAYER_FCS))) {
         // assume fcs is last 4 bytes (?)
         u_int32_t fcs_sent = EXTRACT_32BITS(pkt+len-4);
         u_int32_t fcs = crc32_802(pkt, len-4);
@@ -1184,7 +1209,7 @@ void WifiPacket::handle_80211(const u_char * pkt, size_t len /* , int pad */)
 	
         fcs_ok = (fcs == fcs_sent);
     }
-    if (cbs->Check80211FCS(*this) && fcs_ok==false){
+    if (check_fcs && fcs_ok==false){
         cbs->Handle80211Unknown(*this,fc,pkt,len);
         return;
     }
@@ -1205,80 +1230,90 @@ void WifiPacket::handle_80211(const u_char * pkt, size_t len /* , int pad */)
 	    return;
 	break;
     default:
-	cbs->Handle80211( *this, fc, MAC::null, MAC::null, MAC::null, MAC::null, pkt, len);
-	cbs->Handle80211Unknown( *this, fc, pkt, len);
+        if (layers & WifipcapCallbacks::LAYER_80211) {
+            cbs->Handle80211( *this, fc, MAC::null, MAC::null, MAC::null, MAC::null, pkt, len);
+            cbs->Handle80211Unknown( *this, fc, pkt, len);
+        }
 	return;
     }
 }
 
-int WifiPacket::print_radiotap_field(struct cpack_state *s, u_int32_t bit, int *pad, radiotap_hdr *hdr)
-{
-    union {
-        int8_t		i8;
-        u_int8_t	u8;
-        int16_t		i16;
-        u_int16_t	u16;
-        u_int32_t	u32;
-        u_int64_t	u64;
-    } u, u2, u3;
-    int rc;
+/* How each radiotap field that we know is packed */
+enum radiotap_kind { RT_UNKNOWN, RT_U8, RT_I8, RT_U16, RT_U16_U16, RT_U64, RT_U8_U8_U8 };
 
+static radiotap_kind radiotap_field_kind(u_int32_t bit)
+{
     switch (bit) {
     case IEEE80211_RADIOTAP_FLAGS:
-        rc = cpack_uint8(s, &u.u8);
-        if (u.u8 & IEEE80211_RADIOTAP_F_DATAPAD)
-            *pad = 1;
-        break;
     case IEEE80211_RADIOTAP_RATE:
     case IEEE80211_RADIOTAP_DB_ANTSIGNAL:
     case IEEE80211_RADIOTAP_DB_ANTNOISE:
     case IEEE80211_RADIOTAP_ANTENNA:
-        rc = cpack_uint8(s, &u.u8);
-        break;
+    case IEEE80211_RADIOTAP_DB_TX_ATTENUATION:
+    case IEEE80211_RADIOTAP_RTS_RETRIES:
+    case IEEE80211_RADIOTAP_DATA_RETRIES:
+    case IEEE80211_RADIOTAP_XCHANNEL:   // simson guess
+        return RT_U8;
     case IEEE80211_RADIOTAP_DBM_ANTSIGNAL:
     case IEEE80211_RADIOTAP_DBM_ANTNOISE:
-        rc = cpack_int8(s, &u.i8);
-        break;
-    case IEEE80211_RADIOTAP_CHANNEL:
-        rc = cpack_uint16(s, &u.u16);
-        if (rc != 0)
-            break;
-        rc = cpack_uint16(s, &u2.u16);
-        break;
+    case IEEE80211_RADIOTAP_DBM_TX_POWER:
+        return RT_I8;
     case IEEE80211_RADIOTAP_FHSS:
     case IEEE80211_RADIOTAP_LOCK_QUALITY:
     case IEEE80211_RADIOTAP_TX_ATTENUATION:
-        rc = cpack_uint16(s, &u.u16);
-        break;
-    case IEEE80211_RADIOTAP_DB_TX_ATTENUATION:
+    case IEEE80211_RADIOTAP_RX_FLAGS:
+    case IEEE80211_RADIOTAP_TX_FLAGS:
+        return RT_U16;
+    case IEEE80211_RADIOTAP_CHANNEL:
+        return RT_U16_U16;
+    case IEEE80211_RADIOTAP_TSFT:
+        return RT_U64;
+    case IEEE80211_RADIOTAP_MCS:        // simson guess
+        return RT_U8_U8_U8;
+    default:
+        return RT_UNKNOWN;
+    }
+}
+
+union radiotap_value {
+    int8_t		i8;
+    u_int8_t	u8;
+    int16_t		i16;
+    u_int16_t	u16;
+    u_int32_t	u32;
+    u_int64_t	u64;
+};
+
+static void store_radiotap_field(u_int32_t bit, const radiotap_value &u, const radiotap_value &u2,
+                                 int *pad, radiotap_hdr *hdr);
+
+int WifiPacket::print_radiotap_field(struct cpack_state *s, u_int32_t bit, int *pad, radiotap_hdr *hdr)
+{
+    radiotap_value u, u2, u3;
+    int rc;
+
+    switch (radiotap_field_kind(bit)) {
+    case RT_U8:
         rc = cpack_uint8(s, &u.u8);
         break;
-    case IEEE80211_RADIOTAP_DBM_TX_POWER:
+    case RT_I8:
         rc = cpack_int8(s, &u.i8);
         break;
-    case IEEE80211_RADIOTAP_TSFT:
-        rc = cpack_uint64(s, &u.u64);
-        break;
-    case IEEE80211_RADIOTAP_RX_FLAGS:
+    case RT_U16:
         rc = cpack_uint16(s, &u.u16);
         break;
-    case IEEE80211_RADIOTAP_TX_FLAGS:
+    case RT_U16_U16:
         rc = cpack_uint16(s, &u.u16);
+        if (rc != 0)
+            break;
+        rc = cpack_uint16(s, &u2.u16);
         break;
-    case IEEE80211_RADIOTAP_RTS_RETRIES:
-        rc = cpack_uint8(s, &u.u8);
-        break;
-    case IEEE80211_RADIOTAP_DATA_RETRIES:
-        rc = cpack_uint8(s, &u.u8);
-        break;
-        // simson add follows:
-    case IEEE80211_RADIOTAP_XCHANNEL:
-        rc = cpack_uint8(s, &u.u8);      // simson guess
+    case RT_U64:
+        rc = cpack_uint64(s, &u.u64);
         break;
-    case IEEE80211_RADIOTAP_MCS:
-        rc = cpack_uint8(s, &u.u8) || cpack_uint8(s, &u2.u8) || cpack_uint8(s, &u3.u8);      // simson guess
+    case RT_U8_U8_U8:
+        rc = cpack_uint8(s, &u.u8) || cpack_uint8(s, &u2.u8) || cpack_uint8(s, &u3.u8);
         break;
-        // simson end
     default:
         /* this bit indicates a field whose
          * size we do not know, so we cannot
@@ -1294,7 +1329,13 @@ int WifiPacket::print_radiotap_field(struct cpack_state *s, u_int32_t bit, int *
         fprintf(stderr, "wifipcap: truncated radiotap header for bit: %d\n", bit);
         return  rc ;
     }
+    store_radiotap_field(bit, u, u2, pad, hdr);
+    return 0;
+}
 
+static void store_radiotap_field(u_int32_t bit, const radiotap_value &u, const radiotap_value &u2,
+                                 int *pad, radiotap_hdr *hdr)
+{
     switch (bit) {
     case IEEE80211_RADIOTAP_CHANNEL:
         //printf("%u MHz ", u.u16);
@@ -1355,6 +1396,8 @@ int WifiPacket::print_radiotap_field(struct cpack_state *s, u_int32_t bit, int *
         hdr->txpower_dbm = u.i8;
         break;
     case IEEE80211_RADIOTAP_FLAGS:
+        if (u.u8 & IEEE80211_RADIOTAP_F_DATAPAD)
+            *pad = 1;
         hdr->has_flags = true;
         if (u.u8 & IEEE80211_RADIOTAP_F_CFP)
             //printf("cfp ");
@@ -1399,11 +1442,102 @@ int WifiPacket::print_radiotap_field(struct cpack_state *s, u_int32_t bit, int *
         hdr->data_retries = u.u8;
         break;
     }
-    return  0 ;
 }
 
 
 
+/* Where the fields are for one set of it_present words, worked out the first
+ * time the set is seen; a capture usually has one set per interface. The
+ * offsets are from the end of the present words, aligned as cpack aligns them.
+ */
+struct radiotap_layout {
+    struct field {
+        u_int32_t     bit;
+        radiotap_kind kind;
+        size_t        offset;
+    };
+    std::vector<u_int8_t> present;      // the present words, as they are in the header
+    std::vector<field>    fields;
+    size_t                end;          // bytes that the fields take
+    int                   unknown_bit;  // where the walk stops, or -1
+};
+static const size_t RADIOTAP_LAYOUTS = 8;
+static thread_local std::vector<radiotap_layout> radiotap_layouts; // the newest last
+
+static const radiotap_layout &find_radiotap_layout(const u_int8_t *present, size_t present_len)
+{
+    for (size_t i = radiotap_layouts.size(); i > 0; i--) {
+        const radiotap_layout &l = radiotap_layouts[i-1];
+        if (l.present.size()==present_len && memcmp(&l.present[0], present, present_len)==0) return l;
+    }
+    radiotap_layout l;
+    l.present.assign(present, present+present_len);
+    l.end = 0;
+    l.unknown_bit = -1;
+    for (size_t w = 0; w < present_len/4 && l.unknown_bit<0; w++) {
+        u_int32_t bits = EXTRACT_LE_32BITS(present + w*4);
+        for (u_int32_t b = 0; b < 32; b++) {
+            if ((bits & (1U << b))==0) continue;
+            radiotap_layout::field f;
+            f.bit = w*32 + b;
+            f.kind = radiotap_field_kind(f.bit);
+            size_t align = 1, size = 1;
+            switch (f.kind) {
+            case RT_U16:      align = 2; size = 2; break;
+            case RT_U16_U16:  align = 2; size = 4; break;
+            case RT_U64:      align = 8; size = 8; break;
+            case RT_U8_U8_U8: size = 3; break;
+            case RT_UNKNOWN:  l.unknown_bit = f.bit; break;
+            default:          break;
+            }
+            if (l.unknown_bit>=0) break;
+            f.offset = (l.end + align - 1) / align * align;
+            l.end = f.offset + size;
+            l.fields.push_back(f);
+        }
+    }
+    if (radiotap_layouts.size()==RADIOTAP_LAYOUTS) radiotap_layouts.erase(radiotap_layouts.begin());
+    radiotap_layouts.push_back(l);
+    return radiotap_layouts.back();
+}
+
+/* The fields of a header that is long enough for the layout, loaded from where they are */
+static void read_radiotap_fields(const radiotap_layout &l, const u_char *iter, int *pad, radiotap_hdr *hdr)
+{
+    for (std::vector<radiotap_layout::field>::const_iterator it = l.fields.begin(); it != l.fields.end(); it++) {
+        const u_char *f = iter + it->offset;
+        radiotap_value u, u2;
+        switch (it->kind) {
+        case RT_U8:
+            u.u8 = f[0];
+            break;
+        case RT_U8_U8_U8:
+            u.u8 = f[0];
+            u2.u8 = f[1];
+            break;
+        case RT_I8:
+            u.i8 = (int8_t)f[0];
+            break;
+        case RT_U16:
+            u.u16 = EXTRACT_LE_16BITS(f);
+            break;
+        case RT_U16_U16:
+            u.u16 = EXTRACT_LE_16BITS(f);
+            u2.u16 = EXTRACT_LE_16BITS(f+2);
+            break;
+        case RT_U64:
+            u.u64 = EXTRACT_LE_64BITS(f);
+            break;
+        default:
+            break;
+        }
+        store_radiotap_field(it->bit, u, u2, pad, hdr);
+    }
+    if (l.unknown_bit>=0) {
+        fprintf(stderr, "wifipcap: unknown radiotap bit: %d (%d)\n", l.unknown_bit,IEEE80211_RADIOTAP_XCHANNEL);
+    }
+}
+
 void WifiPacket::handle_radiotap(const u_char *p,size_t caplen)
 {
 #define	BITNO_32(x) (((x) >> 16) ? 16 + BITNO_16((x) >> 16) : BITNO_16((x)))
@@ -1459,13 +1593,28 @@ void WifiPacket::handle_radiotap(const u_char *p,size_t caplen)
         return;// caplen;
     }
 
+    if ((layers & WifipcapCallbacks::LAYER_RADIO)==0) {
+        handle_80211(p+len, caplen-len); // without parsing the fields
+        return;
+    }
+
     radiotap_hdr ohdr;
     memset(&ohdr, 0, sizeof(ohdr));
 	
     /* Assume no Atheros padding between 802.11 header and body */
     int pad = 0;
     uint32_t *presentp;
-    int bit0=0;
+    int bit0;
+
+    /* Load the fields directly if the layout is known and they are all there */
+    const radiotap_layout &layout = find_radiotap_layout((const u_int8_t *)&hdr->it_present,
+                                                         (const u_char *)(last_presentp + 1) - (const u_char *)&hdr->it_present);
+    if (layout.end <= cpacker.c_len) {
+        read_radiotap_fields(layout, iter, &pad, &ohdr);
+        goto done;
+    }
+
+    /* Otherwise walk them, as far as they go */
     for (bit0 = 0, presentp = &hdr->it_present; presentp <= last_presentp;
          presentp++, bit0 += 32) {
 
@@ -1513,7 +1662,7 @@ void WifiPacket::handle_prism(const u_char *pc, size_t len)
         hdr.noise   	= EXTRACT_LE_32BITS(pc+104);
         hdr.rate		= EXTRACT_LE_32BITS(pc+116)/2;
         hdr.istx		= EXTRACT_LE_32BITS(pc+128);
-        cbs->HandlePrism( *this, &hdr, pc + 144, len - 144);
+        if (layers & WifipcapCallbacks::LAYER_RADIO) cbs->HandlePrism( *this, &hdr, pc + 144, len - 144);
         handle_80211(pc+144,len-144);
     }
 }
@@ -9,6 +9,7 @@
 #define _WIFIPCAP_H_
 
 #include <list>
+#include <type_traits>
 #include <stdint.h>
 #include <inttypes.h>
 
@@ -563,8 +564,7 @@ struct WifiPacket {
     /** 48-bit MACs in 64-bit ints */
     static int debug;                   // prints callback before they are called
 
-    WifiPacket(WifipcapCallbacks *cbs_,const int header_type_,const struct pcap_pkthdr *header_,const u_char *packet_):
-        cbs(cbs_),header_type(header_type_),header(header_),packet(packet_),fcs_ok(false){}
+    WifiPacket(WifipcapCallbacks *cbs_,const int header_type_,const struct pcap_pkthdr *header_,const u_char *packet_);
     void parse_elements(struct mgmt_body_t *pbody, const u_char *p, int offset, size_t len);
     int handle_beacon(const struct mgmt_header_t *pmh, const u_char *p, size_t len);
     int handle_assoc_request(const struct mgmt_header_t *pmh, const u_char *p, size_t len);
@@ -581,6 +581,8 @@ struct WifiPacket {
     int decode_mgmt_body(u_int16_t fc, struct mgmt_header_t *pmh, const u_char *p, size_t len);
     int decode_mgmt_frame(const u_char * ptr, size_t len, u_int16_t fc, u_int8_t hdrlen);
     int decode_data_frame(const u_char * ptr, size_t len, u_int16_t fc);
+    typedef void (WifipcapCallbacks::*data_callback_t)(const WifiPacket &p, const struct mac_hdr_t &hdr, const u_char *rest, size_t len);
+    void call_data_callbacks(data_callback_t cb, const mac_hdr_t &hdr, const u_char *ptr, size_t len, size_t hdrlen);
     int decode_ctrl_frame(const u_char * ptr, size_t len, u_int16_t fc);
 
     /* Handle the individual packet types based on DTL callback switch */
@@ -595,6 +597,7 @@ struct WifiPacket {
 
     /* And finally the data for each packet */
     WifipcapCallbacks *cbs;             // the callbacks to use with this packet
+    const unsigned layers;              // cbs->layers()
     const int header_type;                    // DLT
     const struct pcap_pkthdr *header;   // the actual pcap headers
     const u_char *packet;               // the actual packet data
@@ -612,6 +615,27 @@ struct WifipcapCallbacks {
 
     virtual const char *name() const {return "WifipcapCallbacks";} // override with your own name!
 
+    /* The groups of Handle*() functions below that are wanted. A group that
+     * is not is neither called nor decoded for: without LAYER_RADIO the
+     * radiotap fields are not parsed, without LAYER_MGMT and LAYER_BEACON the
+     * management frame bodies are not, and without LAYER_LLC the frames are
+     * not decoded past the 802.11 header. Without LAYER_FCS the frame
+     * checksum is only worked out when Check80211FCS() returns true.
+     * WifipcapCallbacksFor<> below works this out from what a subclass declares.
+     */
+    enum {
+        LAYER_RADIO  = 0x01,            // HandlePrism, HandleRadiotap
+        LAYER_80211  = 0x02,            // Handle80211, Handle80211Unknown
+        LAYER_BEACON = 0x04,            // Handle80211MgmtBeacon
+        LAYER_MGMT   = 0x08,            // the other Handle80211Mgmt*()
+        LAYER_CTRL   = 0x10,            // Handle80211Ctrl*()
+        LAYER_DATA   = 0x20,            // Handle80211Data*()
+        LAYER_LLC    = 0x40,            // HandleLLC, HandleLLCUnknown, HandleWEP
+        LAYER_FCS    = 0x80,            // WifiPacket::fcs_ok is read
+        LAYER_ALL    = 0xff
+    };
+    virtual unsigned layers() const { return LAYER_ALL; }
+
     /* Instance variables --- for a specific packet.
      * (Previously all of the functions had these parameters as the arguments, which made no sense)
      */
@@ -714,6 +738,43 @@ struct WifipcapCallbacks {
     virtual void HandleL3Unknown(const WifiPacket &p, const ip4_hdr_t *ip4h, const ip6_hdr_t *ip6h, const u_char *rest, size_t len){}
 };
 
+/**
+ * Callbacks that derive from WifipcapCallbacksFor<themselves>:
+ *
+ *    class MyCallbacks : public WifipcapCallbacksFor<MyCallbacks> { ... };
+ *
+ * get a layers() that is worked out at compile time from the Handle*()
+ * functions that they declare, so the layers they do not listen to are not
+ * decoded and their empty callbacks are not called. (LAYER_FCS is left out;
+ * override Check80211FCS() to have the checksum worked out.) They are still
+ * WifipcapCallbacks, and are passed to Wifipcap in the same way.
+ */
+template <class CB>
+struct WifipcapCallbacksFor : public WifipcapCallbacks {
+    virtual unsigned layers() const {
+        typedef WifipcapCallbacks W;
+#define WIFIPCAP_DECLARES(f) (!std::is_same<decltype(&CB::f),decltype(&W::f)>::value)
+        return (WIFIPCAP_DECLARES(HandlePrism) || WIFIPCAP_DECLARES(HandleRadiotap) ? LAYER_RADIO : 0)
+            | (WIFIPCAP_DECLARES(Handle80211) || WIFIPCAP_DECLARES(Handle80211Unknown) ? LAYER_80211 : 0)
+            | (WIFIPCAP_DECLARES(Handle80211MgmtBeacon) ? LAYER_BEACON : 0)
+            | (WIFIPCAP_DECLARES(Handle80211MgmtAssocRequest) || WIFIPCAP_DECLARES(Handle80211MgmtAssocResponse)
+               || WIFIPCAP_DECLARES(Handle80211MgmtReassocRequest) || WIFIPCAP_DECLARES(Handle80211MgmtReassocResponse)
+               || WIFIPCAP_DECLARES(Handle80211MgmtProbeRequest) || WIFIPCAP_DECLARES(Handle80211MgmtProbeResponse)
+               || WIFIPCAP_DECLARES(Handle80211MgmtATIM) || WIFIPCAP_DECLARES(Handle80211MgmtDisassoc)
+               || WIFIPCAP_DECLARES(Handle80211MgmtAuth) || WIFIPCAP_DECLARES(Handle80211MgmtAuthSharedKey)
+               || WIFIPCAP_DECLARES(Handle80211MgmtDeauth) ? LAYER_MGMT : 0)
+            | (WIFIPCAP_DECLARES(Handle80211CtrlPSPoll) || WIFIPCAP_DECLARES(Handle80211CtrlRTS)
+               || WIFIPCAP_DECLARES(Handle80211CtrlCTS) || WIFIPCAP_DECLARES(Handle80211CtrlAck)
+               || WIFIPCAP_DECLARES(Handle80211CtrlCFEnd) || WIFIPCAP_DECLARES(Handle80211CtrlEndAck) ? LAYER_CTRL : 0)
+            | (WIFIPCAP_DECLARES(Handle80211Data) || WIFIPCAP_DECLARES(Handle80211DataIBSS)
+               || WIFIPCAP_DECLARES(Handle80211DataFromAP) || WIFIPCAP_DECLARES(Handle80211DataToAP)
+               || WIFIPCAP_DECLARES(Handle80211DataWDS) ? LAYER_DATA : 0)
+            | (WIFIPCAP_DECLARES(HandleLLC) || WIFIPCAP_DECLARES(HandleLLCUnknown)
+               || WIFIPCAP_DECLARES(HandleWEP) ? LAYER_LLC : 0);
+#undef WIFIPCAP_DECLARES
+    }
+};
+
 
 
 
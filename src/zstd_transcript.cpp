@@ -0,0 +1,304 @@
+/*
+ * zstd_transcript.cpp:
+ *
+ * Compressed transcripts. See zstd_transcript.h
+ *
+ * This source code is under the GNU Public License (GPL).  See
+ * LICENSE for details.
+ */
+
+#include "zstd_transcript.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+
+#ifdef HAVE_ZSTD_TRANSCRIPT
+#include <zstd.h>
+#endif
+
+/* static */ int32_t  zstd_transcript::level = 3;
+/* static */ uint32_t zstd_transcript::frame_size = 1024*1024;
+
+static const uint32_t ZSTD_FRAME_MAGIC = 0xFD2FB528;
+
+static void put_le32(std::string &s,uint32_t v)
+{
+    for(int i=0;i<4;i++) s += (char)(v >> (8*i));
+}
+
+static void put_le64(std::string &s,uint64_t v)
+{
+    for(int i=0;i<8;i++) s += (char)(v >> (8*i));
+}
+
+static uint32_t get_le32(const uint8_t *p)
+{
+    return p[0] | (p[1]<<8) | (p[2]<<16) | ((uint32_t)p[3]<<24);
+}
+
+static uint64_t get_le64(const uint8_t *p)
+{
+    return get_le32(p) | ((uint64_t)get_le32(p+4) << 32);
+}
+
+/* static */ bool zstd_transcript::available()
+{
+#ifdef HAVE_ZSTD_TRANSCRIPT
+    return true;
+#else
+    return false;
+#endif
+}
+
+zstd_transcript::zstd_transcript():
+    out(),error(),cctx(0),obuf(),next(0),frame_in(0),frame_out(0),failed(false),finished(false),frames()
+{
+#ifdef HAVE_ZSTD_TRANSCRIPT
+    cctx = ZSTD_createCCtx();
+    if(cctx) ZSTD_CCtx_setParameter(cctx,ZSTD_c_compressionLevel,level);
+    obuf.resize(ZSTD_CStreamOutSize());
+#endif
+    if(cctx==0){
+        failed = true;
+        error = "cannot create a compression context";
+    }
+}
+
+zstd_transcript::~zstd_transcript()
+{
+#ifdef HAVE_ZSTD_TRANSCRIPT
+    ZSTD_freeCCtx(cctx);
+#endif
+}
+
+void zstd_transcript::compress(const uint8_t *data,size_t length,bool end)
+{
+#ifdef HAVE_ZSTD_TRANSCRIPT
+    ZSTD_inBuffer ib = {data,length,0};
+    while(true){
+        ZSTD_outBuffer ob = {&obuf[0],obuf.size(),0};
+        size_t r = ZSTD_compressStream2(cctx,&ob,&ib,end ? ZSTD_e_end : ZSTD_e_continue);
+        if(ZSTD_isError(r)){
+            error = ZSTD_getErrorName(r);
+            failed = true;
+            return;
+        }
+        out.append((const char *)&obuf[0],ob.pos);
+        frame_out += ob.pos;
+        if(end ? r==0 : ib.pos==ib.size) return;
+    }
+#endif
+}
+
+/* Add to the regular frames, starting a new one every frame_size bytes */
+void zstd_transcript::append(const uint8_t *data,size_t length)
+{
+    const uint32_t fsize = frame_size>0 ? frame_size : 1;
+    while(length>0 && !failed){
+        size_t n = std::min(length,(size_t)(fsize - frame_in));
+        compress(data,n,false);
+        frame_in += n;
+        next     += n;
+        data     += n;
+        length   -= n;
+        if(frame_in >= fsize) end_frame();
+    }
+}
+
+void zstd_transcript::write(uint64_t offset,const uint8_t *data,size_t length)
+{
+    if(failed || finished || length==0) return;
+    if(offset < next){                  // some of it is behind the end already
+        size_t n = std::min((uint64_t)length,next-offset);
+        patch(offset,data,n);
+        offset += n;
+        data   += n;
+        length -= n;
+        if(length==0) return;
+    }
+    static const uint8_t zeros[64*1024] = {0};
+    while(offset > next && !failed){    // a gap
+        append(zeros,std::min(offset-next,(uint64_t)sizeof(zeros)));
+    }
+    append(data,length);
+}
+
+void zstd_transcript::end_frame()
+{
+    if(failed || frame_in==0) return;
+    compress(0,0,true);
+    frames.push_back(std::make_pair(frame_out,frame_in));
+    frame_in  = 0;
+    frame_out = 0;
+}
+
+void zstd_transcript::skippable(uint32_t magic,const std::string &payload,bool in_table)
+{
+    put_le32(out,magic);
+    put_le32(out,payload.size());
+    out += payload;
+    /* a reader of the seek table decompresses a skippable frame to nothing */
+    if(in_table) frames.push_back(std::make_pair((uint32_t)(8+payload.size()),(uint32_t)0));
+}
+
+void zstd_transcript::patch(uint64_t offset,const uint8_t *data,size_t length)
+{
+#ifdef HAVE_ZSTD_TRANSCRIPT
+    end_frame();
+    std::string payload;
+    put_le64(payload,offset);
+    size_t bound = ZSTD_compressBound(length);
+    payload.resize(8+bound);
+    size_t r = ZSTD_compress2(cctx,&payload[8],bound,data,length);
+    if(ZSTD_isError(r)){
+        error = ZSTD_getErrorName(r);
+        failed = true;
+        return;
+    }
+    payload.resize(8+r);
+    skippable(PATCH_MAGIC,payload,true);
+#endif
+}
+
+void zstd_transcript::shift(uint64_t insert_bytes)
+{
+    if(failed || finished || insert_bytes==0) return;
+    end_frame();
+    std::string payload;
+    put_le64(payload,insert_bytes);
+    skippable(SHIFT_MAGIC,payload,true);
+    next += insert_bytes;
+}
+
+void zstd_transcript::finish()
+{
+    if(failed || finished) return;
+    end_frame();
+    std::string table;
+    for(std::vector<std::pair<uint32_t,uint32_t> >::const_iterator it=frames.begin();it!=frames.end();it++){
+        put_le32(table,it->first);
+        put_le32(table,it->second);
+    }
+    put_le32(table,frames.size());
+    table += (char)0;                   // descriptor: no checksums
+    put_le32(table,SEEKABLE_MAGIC);
+    skippable(SEEK_TABLE_MAGIC,table,false);
+    finished = true;
+}
+
+#ifdef HAVE_ZSTD_TRANSCRIPT
+/* Decompress the one zstd frame in src into d */
+static int decompress_frame(ZSTD_DCtx *dctx,const uint8_t *src,size_t len,std::string &d,std::string &error)
+{
+    ZSTD_DCtx_reset(dctx,ZSTD_reset_session_only);
+    std::vector<uint8_t> buf(ZSTD_DStreamOutSize());
+    ZSTD_inBuffer ib = {src,len,0};
+    d.clear();
+    while(true){
+        ZSTD_outBuffer ob = {&buf[0],buf.size(),0};
+        size_t r = ZSTD_decompressStream(dctx,&ob,&ib);
+        if(ZSTD_isError(r)){
+            error = ZSTD_getErrorName(r);
+            return -1;
+        }
+        d.append((const char *)&buf[0],ob.pos);
+        if(r==0) return 0;
+        if(ib.pos==ib.size && ob.pos==0){
+            error = "truncated zstd frame";
+            return -1;
+        }
+    }
+}
+#endif
+
+static void place(std::string &contents,uint64_t offset,const std::string &d)
+{
+    if(contents.size() < offset+d.size()) contents.resize(offset+d.size());
+    memcpy(&contents[offset],d.data(),d.size());
+}
+
+/* static */ int zstd_transcript::read(const std::string &path,std::string &contents,std::string &error)
+{
+#ifdef HAVE_ZSTD_TRANSCRIPT
+    FILE *f = fopen(path.c_str(),"rb");
+    if(f==0){
+        error = path + ": " + strerror(errno);
+        return -1;
+    }
+    std::string file;
+    char buf[65536];
+    size_t n;
+    while((n=fread(buf,1,sizeof(buf),f))>0) file.append(buf,n);
+    bool bad = ferror(f);
+    fclose(f);
+    if(bad){
+        error = path + ": read error";
+        return -1;
+    }
+
+    ZSTD_DCtx *dctx = ZSTD_createDCtx();
+    if(dctx==0){
+        error = "ZSTD_createDCtx failed";
+        return -1;
+    }
+    contents.clear();
+    uint64_t cursor = 0;                // where the next regular frame goes
+    const uint8_t *p = (const uint8_t *)file.data();
+    size_t pos = 0;
+    int r = 0;
+    std::string d;
+    while(pos < file.size() && r==0){
+        size_t left = file.size()-pos;
+        if(left < 8){
+            error = "truncated frame header";
+            r = -1;
+            break;
+        }
+        uint32_t magic = get_le32(p+pos);
+        if(magic==ZSTD_FRAME_MAGIC){
+            size_t len = ZSTD_findFrameCompressedSize(p+pos,left);
+            if(ZSTD_isError(len)){
+                error = ZSTD_getErrorName(len);
+                r = -1;
+                break;
+            }
+            r = decompress_frame(dctx,p+pos,len,d,error);
+            if(r) break;
+            place(contents,cursor,d);
+            cursor += d.size();
+            pos    += len;
+            continue;
+        }
+        if((magic & 0xFFFFFFF0)!=0x184D2A50){
+            error = "not a zstd transcript";
+            r = -1;
+            break;
+        }
+        uint32_t len = get_le32(p+pos+4);
+        if(len > left-8){
+            error = "truncated skippable frame";
+            r = -1;
+            break;
+        }
+        const uint8_t *q = p+pos+8;
+        if(magic==PATCH_MAGIC && len>=8){
+            r = decompress_frame(dctx,q+8,len-8,d,error);
+            if(r) break;
+            place(contents,get_le64(q),d);
+        } else if(magic==SHIFT_MAGIC && len>=8){
+            uint64_t insert_bytes = get_le64(q);
+            contents.insert(0,insert_bytes,'\0');
+            cursor += insert_bytes;
+        }
+        pos += 8+len;                   // the seek table and anything else is passed over
+    }
+    ZSTD_freeDCtx(dctx);
+    if(r) error = path + ": " + error;
+    return r;
+#else
+    error = path + ": tcpflow was built without zstd";
+    return -1;
+#endif
+}
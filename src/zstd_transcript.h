@@ -0,0 +1,97 @@
+/*
+ * zstd_transcript.h:
+ *
+ * Compressed transcripts, for -S compress=zstd.
+ *
+ * A flow's bytes go, in order, into zstd frames of at most frame_size
+ * bytes each, so that `zstd -d` turns the file back into the transcript.
+ * A gap in the flow is compressed as zeros, which is what a transcript
+ * file reads there.
+ *
+ * Two things cannot be said with plain frames, and go into skippable
+ * frames that zstd -d passes over:
+ *   PATCH_MAGIC  bytes for a place that was already compressed (a write
+ *                behind the end, as when a late segment fills a gap that
+ *                was given up on): the 8-byte offset, then a zstd frame
+ *   SHIFT_MAGIC  bytes inserted at the start of the flow (see
+ *                tcpip::prepend_file()): the 8-byte count
+ * read() applies them, and tcpflow-extract -z uses read(). Without them,
+ * which is the usual case, zstd -d gives the same bytes.
+ *
+ * finish() ends the file with a seek table in the zstd seekable format,
+ * so a reader can begin at any frame.
+ *
+ * The class makes the bytes of the file and leaves them in out; the
+ * caller writes them. It needs only libzstd, so that tcpflow-extract can
+ * use it too. All numbers in the skippable frames are little-endian.
+ *
+ * This source code is under the GNU Public License (GPL).  See
+ * LICENSE for details.
+ */
+
+#ifndef ZSTD_TRANSCRIPT_H
+#define ZSTD_TRANSCRIPT_H
+
+#include "config.h"
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <utility>
+
+/* the library must be there as well as the header */
+#if defined(HAVE_ZSTD_H) && defined(HAVE_LIBZSTD)
+#define HAVE_ZSTD_TRANSCRIPT
+#endif
+
+struct ZSTD_CCtx_s;
+
+class zstd_transcript {
+    zstd_transcript(const zstd_transcript &);
+    zstd_transcript &operator=(const zstd_transcript &);
+
+public:
+    static int32_t  level;              // zstd compression level
+    static uint32_t frame_size;         // bytes of the flow in each frame
+    static bool available();            // false if tcpflow was built without libzstd
+
+    enum { PATCH_MAGIC      = 0x184D2A50,
+           SHIFT_MAGIC      = 0x184D2A51,
+           SEEK_TABLE_MAGIC = 0x184D2A5E,
+           SEEKABLE_MAGIC   = 0x8F92EAB1, // last word of the seek table
+    };
+
+    zstd_transcript();
+    ~zstd_transcript();
+
+    void write(uint64_t offset,const uint8_t *data,size_t length);
+    void shift(uint64_t insert_bytes);  // the flow's bytes move up; the new ones are zeros until written
+    void end_frame();                   // so that out holds everything written so far
+    void finish();                      // end_frame() and the seek table; nothing may follow
+    uint64_t size() const { return next; } // bytes of the flow in the regular frames
+
+    std::string out;                    // bytes for the file not yet taken by the caller
+    std::string error;                  // why compressing failed, for the caller to report; nothing more is written
+
+    /* Decompress the transcript at path into contents, applying the
+     * patches and shifts. Returns 0, or -1 with error set.
+     */
+    static int read(const std::string &path,std::string &contents,std::string &error);
+
+private:
+    struct ZSTD_CCtx_s *cctx;
+    std::vector<uint8_t> obuf;          // ZSTD_CStreamOutSize() bytes
+    uint64_t next;                      // where the next regular frame byte goes in the flow
+    uint32_t frame_in;                  // bytes of the flow in the open frame; 0 if there is none
+    uint32_t frame_out;                 // compressed bytes of the open frame so far
+    bool     failed;
+    bool     finished;
+    std::vector<std::pair<uint32_t,uint32_t> > frames; // compressed and flow bytes of each frame, for the seek table
+
+    void append(const uint8_t *data,size_t length);
+    void compress(const uint8_t *data,size_t length,bool end);
+    void patch(uint64_t offset,const uint8_t *data,size_t length);
+    void skippable(uint32_t magic,const std::string &payload,bool in_table);
+};
+
+#endif
@@ -0,0 +1,170 @@
+#!/bin/sh
+#
+# Throughput benchmark: run tcpflow in fixed configurations over synthetic
+# pcaps written by src/bench_pcapgen and report packets/s, bytes/s, peak RSS
+# and (with strace) syscall counts.
+#
+# usage: bench.sh [-o results.json] [-b baseline.json] [-t tolerance%] [-n runs] [-s]
+#   -o  where to write the results          (default bench-results.json)
+#   -b  compare against an earlier results file; exits 1 if a run is more
+#       than -t percent (default 10) slower, or its peak RSS that much larger
+#   -n  runs of each; the fastest is kept    (default 3)
+#   -s  count syscalls with strace -c -f, in a run of its own; 0 without it
+#
+# Run it with "make bench" in tests/, after "make -C ../src tcpflow bench_pcapgen".
+# To keep a baseline, copy the results file somewhere and pass it with -b
+# next time.  Results are one JSON object per line inside a "results" array,
+# so that they can be read with grep and awk as well as a JSON parser.
+#
+
+TCPFLOW=${TCPFLOW:-../src/tcpflow}
+GEN=${GEN:-../src/bench_pcapgen}
+WORK=${WORK:-bench-work}
+RESULTS=bench-results.json
+BASELINE=
+TOLERANCE=10
+RUNS=3
+STRACE=
+
+while getopts o:b:t:n:s opt
+do
+  case $opt in
+  o) RESULTS=$OPTARG ;;
+  b) BASELINE=$OPTARG ;;
+  t) TOLERANCE=$OPTARG ;;
+  n) RUNS=$OPTARG ;;
+  s) STRACE=1 ;;
+  *) sed -n '7,12p' $0; exit 1 ;;
+  esac
+done
+
+for p in $TCPFLOW $GEN
+do
+  if ! [ -x $p ] ; then echo $p not found; exit 1 ; fi
+done
+if [ -x /usr/bin/time ] && /usr/bin/time -f %M true 2>/dev/null ; then
+  TIME=/usr/bin/time
+else
+  echo GNU time not found: peak RSS will not be reported
+  TIME=
+fi
+if [ x$STRACE = x1 ] && ! strace -V >/dev/null 2>&1 ; then
+  echo strace not found: syscalls will not be counted
+  STRACE=
+fi
+
+mkdir -p $WORK
+
+# name and bench_pcapgen options of each workload
+WORKLOADS="bulk:-f,64,-c,16,-b,4000000
+mixed:-f,20000,-c,500,-b,20000,-6,0.3,-z,0.5,-o,0.01,-l,0.001,-r,0.01
+small:-f,100000,-c,2000,-b,500,-s,536,-6,0.5"
+
+# name and tcpflow options of each configuration; OUT is replaced by the output directory
+CONFIGS="console:-c
+store:-o,OUT
+index:-I,-o,OUT
+http:-e,http,-o,OUT
+netviz:-e,netviz,-o,OUT"
+
+now()
+{
+  date +%s.%N
+}
+
+echo '{' > $RESULTS.tmp
+echo "\"tcpflow\": \"`$TCPFLOW -V 2>&1 | head -1`\"," >> $RESULTS.tmp
+echo "\"host\": \"`uname -n` `uname -m`\", \"date\": \"`date -u +%Y-%m-%dT%H:%M:%SZ`\"," >> $RESULTS.tmp
+echo '"results": [' >> $RESULTS.tmp
+sep=' '
+
+for w in $WORKLOADS
+do
+  wname=${w%%:*}
+  wopts=`echo ${w#*:} | tr , ' '`
+  pcap=$WORK/$wname.pcap
+  stats=`$GEN $wopts $pcap` || exit 1
+  packets=`echo $stats | awk '{print $2}'`
+  bytes=`echo $stats | awk '{print $4}'`
+  echo "$wname: $packets packets, $bytes bytes"
+
+  for c in $CONFIGS
+  do
+    cname=${c%%:*}
+    out=$WORK/out-$wname-$cname
+    copts=`echo ${c#*:} | tr , ' ' | sed "s|OUT|$out|"`
+    best=
+    rss=0
+    i=0
+    while [ $i -lt $RUNS ]
+    do
+      rm -rf $out
+      t0=`now`
+      if [ -n "$TIME" ] ; then
+        $TIME -f %M -o $WORK/rss $TCPFLOW $copts -r $pcap > /dev/null 2> $WORK/stderr
+      else
+        $TCPFLOW $copts -r $pcap > /dev/null 2> $WORK/stderr
+      fi
+      status=$?
+      t1=`now`
+      if [ $status != 0 ] ; then
+        echo "$wname/$cname failed:"; cat $WORK/stderr; exit 1
+      fi
+      secs=`echo $t0 $t1 | awk '{printf "%.4f", $2-$1}'`
+      best=`echo "$best" $secs | awk 'NF==1 || $2<$1 {print $NF; next} {print $1}'`
+      if [ -n "$TIME" ] ; then
+        r=`tail -1 $WORK/rss`
+        if [ $r -gt $rss ] ; then rss=$r ; fi
+      fi
+      i=`expr $i + 1`
+    done
+
+    syscalls=0
+    if [ -n "$STRACE" ] ; then
+      rm -rf $out
+      strace -c -f -o $WORK/strace $TCPFLOW $copts -r $pcap > /dev/null 2>&1
+      # the calls column of the total line; the columns are right-aligned under
+      # the header, and some are blank in the total line of some versions
+      syscalls=`awk '!end && / calls / {end=index($0," calls ")+6}
+                     $NF=="total" && end {n=split(substr($0,1,end),f," "); print f[n]}' $WORK/strace`
+      if [ -z "$syscalls" ] ; then syscalls=0 ; fi
+    fi
+    rm -rf $out
+
+    line=`echo $wname $cname $packets $bytes $best $rss $syscalls | awk '{
+      printf "{\"workload\": \"%s\", \"config\": \"%s\", \"packets\": %d, \"bytes\": %d, \"seconds\": %s, ", $1, $2, $3, $4, $5;
+      printf "\"packets_per_sec\": %.0f, \"bytes_per_sec\": %.0f, \"peak_rss_kb\": %d, \"syscalls\": %s}", $3/$5, $4/$5, $6, $7 }'`
+    echo "$sep$line" >> $RESULTS.tmp
+    sep=','
+    echo "  $cname: $best s, peak RSS $rss KB, syscalls $syscalls"
+  done
+done
+
+echo ']' >> $RESULTS.tmp
+echo '}' >> $RESULTS.tmp
+mv $RESULTS.tmp $RESULTS
+echo results in $RESULTS
+
+if [ -z "$BASELINE" ] ; then exit 0 ; fi
+
+# pull workload, config, packets_per_sec and peak_rss_kb out of each result line
+extract()
+{
+  sed -n 's/.*"workload": "\([^"]*\)", "config": "\([^"]*\)".*"packets_per_sec": \([0-9]*\).*"peak_rss_kb": \([0-9]*\).*/\1\/\2 \3 \4/p' $1
+}
+
+extract $BASELINE > $WORK/baseline
+extract $RESULTS > $WORK/current
+awk -v tol=$TOLERANCE '
+  NR==FNR { pps[$1]=$2; rss[$1]=$3; next }
+  !($1 in pps) { print $1 ": not in the baseline"; next }
+  {
+    d = ($2 - pps[$1]) * 100 / pps[$1];
+    msg = sprintf("%s: %d packets/s, %+.1f%% against %d", $1, $2, d, pps[$1]);
+    if (d < -tol) { msg = msg " SLOWER"; bad++ }
+    if (rss[$1] > 0 && $3 > rss[$1] * (1 + tol/100)) {
+      msg = msg sprintf(", peak RSS %d KB against %d LARGER", $3, rss[$1]); bad++
+    }
+    print msg
+  }
+  END { if (bad) { print bad " regressions"; exit 1 } }' $WORK/baseline $WORK/current
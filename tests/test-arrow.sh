@@ -0,0 +1,52 @@
+#!/bin/sh
+#
+# test -S flow_arrow: the Arrow IPC stream of test1.pcap's flows starts
+# and ends as a stream does and names each transcript; with pyarrow
+# installed, it is read back and has a row for each flow in the report
+#
+
+. $srcdir/test-subs.sh
+
+DMPFILE=$DMPDIR/test1.pcap
+if ! [ -r $DMPFILE ] ; then echo $DMPFILE not found ; exit 1 ; fi
+/bin/rm -rf out
+
+cmd "$TCPFLOW -o out -X out/report.xml -S flow_arrow=flows.arrows -r $DMPFILE"
+
+if ! [ -r out/flows.arrows ] ; then
+  echo flows.arrows not written.
+  exit 1
+fi
+if [ "`head -c 4 out/flows.arrows | od -An -tx1 | tr -d ' \n'`" != "ffffffff" ] ; then
+  echo flows.arrows does not start with an IPC message.
+  exit 1
+fi
+if [ "`tail -c 8 out/flows.arrows | od -An -tx1 | tr -d ' \n'`" != "ffffffff00000000" ] ; then
+  echo flows.arrows does not end with the end-of-stream marker.
+  exit 1
+fi
+for f in 074.125.019.101.00080-192.168.001.102.50956 074.125.019.104.00080-192.168.001.102.50955 \
+         192.168.001.102.50955-074.125.019.104.00080 192.168.001.102.50956-074.125.019.101.00080
+do
+  if ! grep -a $f out/flows.arrows >/dev/null ; then
+    echo $f not in flows.arrows
+    exit 1
+  fi
+done
+
+if python3 -c 'import pyarrow' >/dev/null 2>&1 ; then
+  flows=`grep -c '<fileobject>' out/report.xml`
+  rows=`python3 -c '
+import sys, pyarrow.ipc
+t = pyarrow.ipc.open_stream(sys.argv[1]).read_all()
+for c in ("starttime","src_ip","dst_ip","srcport","dstport","packets","filename"):
+    assert c in t.column_names, c
+print(t.num_rows)' out/flows.arrows` || exit 1
+  if [ x$rows != x$flows ] ; then
+    echo flows.arrows has $rows rows for $flows flows
+    exit 1
+  fi
+fi
+
+/bin/rm -rf out
+exit 0
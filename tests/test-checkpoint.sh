@@ -0,0 +1,38 @@
+#!/bin/sh
+#
+# test -S checkpoint_file and checkpoint_load: test1.pcap read in two runs,
+# split in the middle of both of its connections, gives the same
+# transcripts as test1.sh gets from reading it in one
+#
+
+. $srcdir/test-subs.sh
+
+for t in 1 2
+do
+  DMPFILE=$DMPDIR/test1-checkpoint-$t.pcap
+  if ! [ -r $DMPFILE ] ; then echo $DMPFILE not found ; exit 1 ; fi
+done
+/bin/rm -rf out
+
+cmd "$TCPFLOW -o out -X out/report.xml -S checkpoint_file=flows.ckpt -r $DMPDIR/test1-checkpoint-1.pcap"
+if ! [ -r out/flows.ckpt ] ; then
+  echo checkpoint not written.
+  exit 1
+fi
+
+cmd "$TCPFLOW -o out -X out/report.xml -S checkpoint_load=flows.ckpt -r $DMPDIR/test1-checkpoint-2.pcap"
+
+checkmd5 out/"074.125.019.101.00080-192.168.001.102.50956" "ae30a88136feb0655492bdb75e078643" "136"
+checkmd5 out/"074.125.019.104.00080-192.168.001.102.50955" "61051e417d34e1354559e3a8901d19d3" "2792"
+checkmd5 out/"192.168.001.102.50955-074.125.019.104.00080" "14e9c335bf54dc4652999e25d99fecfe" "655"
+checkmd5 out/"192.168.001.102.50956-074.125.019.101.00080" "78b8073093d107207327103e80fbdf43" "604"
+
+# each connection is still one flow
+if ls out | grep '[0-9]c[0-9][0-9]*$' >/dev/null ; then
+  echo a flow was split across the runs:
+  ls out
+  exit 1
+fi
+
+/bin/rm -rf out
+exit 0
@@ -0,0 +1,32 @@
+#!/bin/sh
+#
+# test IPv4 fragment reassembly: a segment in three fragments that arrive
+# out of order, the last of them overlapping the other two with X's.
+# With ip_defrag_overlap=first the X's only fill the gap between them;
+# with last they overwrite what the others brought.
+#
+
+. $srcdir/test-subs.sh
+
+DMPFILE=$DMPDIR/fragments-ipv4.pcap
+if ! [ -r $DMPFILE ] ; then echo $DMPFILE not found ; exit 1 ; fi
+
+for policy in first last
+do
+  /bin/rm -rf out
+  cmd "$TCPFLOW -o out -X out/report.xml -S ip_defrag_overlap=$policy -r $DMPFILE"
+
+  case $policy in
+  first)
+  checkmd5 out/"010.002.000.001.40002-010.002.000.002.00080" "851a137b6e968fc4937b4bdc6c90bc0b" "100"
+;;
+  last)
+  checkmd5 out/"010.002.000.001.40002-010.002.000.002.00080" "c47eaef597c0aed69f60980e234acb62" "100"
+;;
+  esac
+  checkmd5 out/"010.002.000.002.00080-010.002.000.001.40002" "25ab1a13a64c34db91f4e0f1c1d9046d" "11"
+  echo Overlap policy $policy completed successfully
+done
+
+/bin/rm -rf out
+exit 0
@@ -0,0 +1,32 @@
+#!/bin/sh
+#
+# test IPv6 extension headers and fragments: a segment in three fragments
+# that arrive out of order, one of them overlapping the other two with
+# Y's, and then a segment behind a hop-by-hop and a destination options
+# header. Fragments are put together as IPv4's are, by ip_defrag_overlap.
+#
+
+. $srcdir/test-subs.sh
+
+DMPFILE=$DMPDIR/fragments-ipv6.pcap
+if ! [ -r $DMPFILE ] ; then echo $DMPFILE not found ; exit 1 ; fi
+
+for policy in first last
+do
+  /bin/rm -rf out
+  cmd "$TCPFLOW -o out -X out/report.xml -S ip_defrag_overlap=$policy -r $DMPFILE"
+
+  case $policy in
+  first)
+  checkmd5 out/"2001:db8::1.40003-2001:db8::2.00080" "4d2e375fe7d08dca56ddcb8d8246edd2" "124"
+;;
+  last)
+  checkmd5 out/"2001:db8::1.40003-2001:db8::2.00080" "edbf00b8843b5c1a99143e067a077d0b" "124"
+;;
+  esac
+  checkmd5 out/"2001:db8::2.00080-2001:db8::1.40003" "96075a1274a6a72a50f8a4cc62dd50c6" "11"
+  echo Overlap policy $policy completed successfully
+done
+
+/bin/rm -rf out
+exit 0
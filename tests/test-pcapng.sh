@@ -0,0 +1,27 @@
+#!/bin/sh
+#
+# test that a pcapng file is read with each interface's own link type and
+# timestamp resolution: the client's packets were captured on an Ethernet
+# interface in microseconds, the server's on a raw IP one with if_tsresol=9
+#
+
+. $srcdir/test-subs.sh
+
+DMPFILE=$DMPDIR/pcapng-two-links.pcapng
+if ! [ -r $DMPFILE ] ; then echo $DMPFILE not found ; exit 1 ; fi
+/bin/rm -rf out
+
+cmd "$TCPFLOW -o out -X out/report.xml -r $DMPFILE"
+
+checkmd5 out/"010.001.000.001.40001-010.001.000.002.00080" "87a57f7184c7a5664f0d825a7262a692" "39"
+checkmd5 out/"010.001.000.002.00080-010.001.000.001.40001" "1ca3c104be2f101c2060ef2d6094326e" "44"
+
+# Read as microseconds, the nanosecond timestamps would be thousands of years out
+if ! ls -l out/010.001.000.002.00080-010.001.000.001.40001 | grep '2015' >/dev/null ;
+then
+  echo if_tsresol not applied to the timestamps.
+  exit 1
+fi
+
+/bin/rm -rf out
+exit 0
@@ -0,0 +1,37 @@
+#!/bin/sh
+#
+# test -S tls_meta: the ClientHello of tls-hello.pcap is split over two
+# records and two segments; the report has its SNI, ALPN and version, the
+# server's cipher, and with OpenSSL the JA3 and JA4 fingerprints of both
+#
+
+. $srcdir/test-subs.sh
+
+DMPFILE=$DMPDIR/tls-hello.pcap
+if ! [ -r $DMPFILE ] ; then echo $DMPFILE not found ; exit 1 ; fi
+/bin/rm -rf out
+
+cmd "$TCPFLOW -o out -X out/report.xml -S tls_meta=1 -r $DMPFILE"
+
+for s in "hello='client' version='1.3' sni='example.com' alpn='h2,http/1.1' ciphers='4'" \
+         "hello='server' version='1.3' cipher='0x1301'"
+do
+  if ! grep "$s" out/report.xml >/dev/null ; then
+    echo "$s" not in report.xml
+    exit 1
+  fi
+done
+
+if grep "ja3=" out/report.xml >/dev/null ; then
+  for s in "ja3='11138d9933242c3a03b6aad35a296476'" "ja4='t13d0306h2_5559582ccdc4_fb71836bce29'" \
+           "ja3s='f4febc55ea12b31ae17cfb7e614afda8'" "ja4s='t130200_1301_a56c5b993250'"
+  do
+    if ! grep "$s" out/report.xml >/dev/null ; then
+      echo "$s" not in report.xml
+      exit 1
+    fi
+  done
+fi
+
+/bin/rm -rf out
+exit 0
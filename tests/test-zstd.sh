@@ -0,0 +1,53 @@
+#!/bin/sh
+#
+# test -S compress=zstd: the transcripts of test1.pcap come back from the
+# .zst files, with tcpflow-extract -z and with zstd -d
+#
+
+. $srcdir/test-subs.sh
+
+EXTRACT=`dirname $TCPFLOW`/tcpflow-extract
+DMPFILE=$DMPDIR/test1.pcap
+if ! [ -r $DMPFILE ] ; then echo $DMPFILE not found ; exit 1 ; fi
+/bin/rm -rf out
+
+if ! $TCPFLOW -o out -X out/report.xml -S compress=zstd -r $DMPFILE 2>compress.err ; then
+  if grep 'without libzstd' compress.err >/dev/null ; then
+    echo tcpflow was built without libzstd
+    /bin/rm -rf out compress.err
+    exit 0
+  fi
+  cat compress.err
+  echo failed
+  exit 1
+fi
+/bin/rm -f compress.err
+
+checkflows()
+{
+  checkmd5 $1/"074.125.019.101.00080-192.168.001.102.50956" "ae30a88136feb0655492bdb75e078643" "136"
+  checkmd5 $1/"074.125.019.104.00080-192.168.001.102.50955" "61051e417d34e1354559e3a8901d19d3" "2792"
+  checkmd5 $1/"192.168.001.102.50955-074.125.019.104.00080" "14e9c335bf54dc4652999e25d99fecfe" "655"
+  checkmd5 $1/"192.168.001.102.50956-074.125.019.101.00080" "78b8073093d107207327103e80fbdf43" "604"
+}
+
+for f in out/*.zst
+do
+  if [ -r `echo $f | sed 's/\.zst$//'` ] ; then echo $f was also written uncompressed ; exit 1 ; fi
+done
+
+mkdir out/extract
+cmd "$EXTRACT -z -o out/extract `ls out/*.zst`"
+checkflows out/extract
+
+if which zstd >/dev/null 2>&1 ; then
+  mkdir out/zstd
+  for f in out/*.zst
+  do
+    zstd -q -d -o out/zstd/`basename $f .zst` $f || exit 1
+  done
+  checkflows out/zstd
+fi
+
+/bin/rm -rf out
+exit 0